@@ -10,6 +10,34 @@ extern "C" {
 #include "spv-node.h"
 #include "block_hdrs-db.h"
 #include "chains.h"
+#include "block_download.h"
+#include "mempool.h"
+#include "compact_block.h"
+#include "bloom_filter.h"
+#include "block_filter.h"
+#include "block_file_reader.h"
+#include "block_cache.h"
+
+#define APP_RECENT_BLOCKS	(8)	// kept to answer getdata(cmpct_block, filtered_block) and getblocktxn
+#define APP_BLOCKS_DIR		"data/blocks"	// optional, blk(nnnnn).dat files (e.g. copied from a full node)
+#define APP_REINDEX_BATCH	(64)	// blocks read from the blk files per batch
+#define APP_BLOCK_CACHE_SIZE	(64 * 1024 * 1024)	// the blocks served from the blk files
+
+// a block received from the network (serialized)
+struct raw_block
+{
+	ssize_t length;
+	unsigned char data[0];
+};
+
+// the position of a block in the blk files
+struct block_file_pos
+{
+	uint256_t hash;
+	int64_t file_index;
+	int64_t start_pos;	// the beginning of the block data (after the {magic, block_size} record header)
+	uint32_t block_size;
+};
 
 typedef struct app_context
 {
@@ -20,6 +48,28 @@ typedef struct app_context
 	spv_node_context_t spv[1];
 	block_headers_db_t hdrs_db[1];
 	
+	block_download_manager_t * blocks_downloader;	// blocks after the local headers chain at startup
+	mempool_t * mempool;
+	
+	// BIP152: compact blocks
+	partial_block_t * partial_block;	// waiting for the missing txs (blocktxn)
+	struct raw_block * recent_blocks[APP_RECENT_BLOCKS];	// ring buffer
+	uint256_t recent_hashes[APP_RECENT_BLOCKS];
+	int recent_blocks_pos;
+	
+	// BIP37: the latest filtered block, parsed and indexed once for all the filters
+	uint256_t filtered_hash;
+	satoshi_block_t filtered_block[1];
+	bloom_block_index_t filtered_index[1];
+	
+	// BIP157/158: compact block filters of the downloaded blocks (spv->compact_filters)
+	db_engine_t * filters_engine;
+	block_filter_index_t * filter_index;
+	
+	// the main chain blocks found in APP_BLOCKS_DIR at startup (indexed by height, block_size == 0: not found)
+	struct block_file_pos * block_positions;
+	ssize_t num_block_positions;
+	block_cache_t * blocks_cache;	// answers getdata(witness_block) for them
 }app_context_t;
 
 app_context_t * app_context_init(app_context_t * app, void * user_data);
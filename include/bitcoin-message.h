@@ -10,6 +10,7 @@ extern "C" {
 
 // https://en.bitcoin.it/wiki/Protocol_documentation
 #define BITCOIN_MESSAGE_MAX_PAYLOAD_ENTRIES (50000)
+#define BITCOIN_MESSAGE_MAX_PAYLOAD_SIZE	(32 * 1024 * 1024)
 
 #define BITCOIN_MESSAGE_MAGIC_MAINNET 	0xD9B4BEF9
 #define BITCOIN_MESSAGE_MAGIC_TESTNET 	0xDAB5BFFA
@@ -50,11 +51,18 @@ enum bitcoin_message_type	// command
 	bitcoin_message_type_cmpctblock,
 	bitcoin_message_type_getblocktxn,
 	bitcoin_message_type_blocktxn,
+	bitcoin_message_type_getcfilters,
+	bitcoin_message_type_cfilter,
+	bitcoin_message_type_getcfheaders,
+	bitcoin_message_type_cfheaders,
+	bitcoin_message_type_getcfcheckpt,
+	bitcoin_message_type_cfcheckpt,
 	//
 	bitcoin_message_types_count
 };
 const char * bitcoin_message_type_to_string(enum bitcoin_message_type msg_type);
 enum bitcoin_message_type bitcoin_message_type_from_string(const char * command);
+enum bitcoin_message_type bitcoin_message_type_from_command(const char command[static 12]);	// O(1), the NUL-padded command of a message header
 
 
 /******************************************
@@ -75,6 +83,7 @@ typedef struct bitcoin_message
 	void * user_data;
 	
 	struct bitcoin_message_header * msg_data;	// raw_data or serialized payload
+	int borrowed;	// msg_data points to the caller's receiving buffer (not freed by clear())
 	enum bitcoin_message_type msg_type;
 	
 	struct bitcoin_message_header hdr[1];
@@ -91,6 +100,12 @@ typedef struct bitcoin_message
 bitcoin_message_t * bitcoin_message_new(bitcoin_message_t * msg, uint32_t network_magic, enum bitcoin_message_type type, void * user_data);
 void bitcoin_message_cleanup(bitcoin_message_t * msg);
 int bitcoin_message_parse(bitcoin_message_t * msg, const struct bitcoin_message_header * hdr, const void * payload, size_t length);
+
+/**
+ * bitcoin_message_parse_in_place(): zero-copy parsing
+ *   msg->msg_data points to hdr, which must be kept valid until the msg was cleared.
+ */
+int bitcoin_message_parse_in_place(bitcoin_message_t * msg, const struct bitcoin_message_header * hdr, int verify_checksum);
 void bitcoin_message_clear(bitcoin_message_t * msg);
 
 ssize_t bitcoin_message_serialize(struct bitcoin_message * msg, unsigned char ** p_data);
@@ -150,6 +165,7 @@ enum bitcoin_message_service_type
 	bitcoin_message_service_type_node_getutxo = 2,	// bip 0064
 	bitcoin_message_service_type_node_bloom   = 4,	// bip 0111
 	bitcoin_message_service_type_node_witness = 8, 	// bip 0144
+	bitcoin_message_service_type_node_compact_filters = 64,	// bip 0157
 	bitcoin_message_service_type_node_network_limited = 1024, // bip 0159
 	
 	bitcoin_message_service_type_size = UINT64_MAX,	// place holder
@@ -308,6 +324,190 @@ void bitcoin_message_block_headers_cleanup(struct bitcoin_message_block_headers
 ssize_t bitcoin_message_block_headers_serialize(const struct bitcoin_message_block_headers * msg, unsigned char ** p_data);
 void bitcoin_message_block_headers_dump(const struct bitcoin_message_block_headers * msg);
 
+/******************************************
+ * BIP37: connection bloom filtering
+ *  struct bitcoin_message_filterload
+ *  struct bitcoin_message_filteradd
+ *  (filterclear has no payload)
+ *  struct bitcoin_message_merkleblock
+******************************************/
+struct bitcoin_message_filterload
+{
+	ssize_t filter_size;	// <= 36000 bytes
+	unsigned char * filter;
+	uint32_t hash_funcs;	// <= 50
+	uint32_t tweak;
+	uint8_t flags;			// enum bloom_filter_update_type
+};
+struct bitcoin_message_filterload * bitcoin_message_filterload_parse(struct bitcoin_message_filterload * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_filterload_cleanup(struct bitcoin_message_filterload * msg);
+ssize_t bitcoin_message_filterload_serialize(const struct bitcoin_message_filterload * msg, unsigned char ** p_data);
+void bitcoin_message_filterload_dump(const struct bitcoin_message_filterload * msg);
+
+struct bitcoin_message_filteradd
+{
+	ssize_t data_size;		// <= 520 bytes (max script element size)
+	unsigned char * data;
+};
+struct bitcoin_message_filteradd * bitcoin_message_filteradd_parse(struct bitcoin_message_filteradd * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_filteradd_cleanup(struct bitcoin_message_filteradd * msg);
+ssize_t bitcoin_message_filteradd_serialize(const struct bitcoin_message_filteradd * msg, unsigned char ** p_data);
+void bitcoin_message_filteradd_dump(const struct bitcoin_message_filteradd * msg);
+
+struct bitcoin_message_merkleblock
+{
+	struct satoshi_block_header hdr;
+	uint32_t total_txns;	// number of txs in the block
+	ssize_t hashes_count;
+	uint256_t * hashes;		// partial merkle tree, in depth-first order
+	ssize_t flags_size;
+	unsigned char * flags;	// flag bits, packed per 8 in a byte, least significant bit first
+};
+struct bitcoin_message_merkleblock * bitcoin_message_merkleblock_parse(struct bitcoin_message_merkleblock * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_merkleblock_cleanup(struct bitcoin_message_merkleblock * msg);
+ssize_t bitcoin_message_merkleblock_serialize(const struct bitcoin_message_merkleblock * msg, unsigned char ** p_data);
+void bitcoin_message_merkleblock_dump(const struct bitcoin_message_merkleblock * msg);
+
+/******************************************
+ * BIP152: compact block relay
+ *  struct bitcoin_message_sendcmpct
+ *  struct bitcoin_message_cmpctblock
+ *  struct bitcoin_message_getblocktxn
+ *  struct bitcoin_message_blocktxn
+******************************************/
+struct bitcoin_message_sendcmpct
+{
+	uint8_t announce;	// 1: high-bandwidth mode (new blocks are announced with cmpctblock), 0: low-bandwidth mode (inv / headers)
+	uint64_t version;	// 1: short ids of txids, 2: short ids of wtxids (segwit)
+};
+struct bitcoin_message_sendcmpct * bitcoin_message_sendcmpct_parse(struct bitcoin_message_sendcmpct * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_sendcmpct_cleanup(struct bitcoin_message_sendcmpct * msg);
+ssize_t bitcoin_message_sendcmpct_serialize(const struct bitcoin_message_sendcmpct * msg, unsigned char ** p_data);
+void bitcoin_message_sendcmpct_dump(const struct bitcoin_message_sendcmpct * msg);
+
+#define BITCOIN_MESSAGE_SHORTID_SIZE	(6)
+struct bitcoin_prefilled_tx
+{
+	ssize_t index;	// absolute index in the block (differentially encoded in the message)
+	satoshi_tx_t tx;
+};
+struct bitcoin_message_cmpctblock
+{
+	struct satoshi_block_header hdr;
+	uint64_t nonce;
+	ssize_t shortids_count;
+	uint64_t * shortids;	// 6 bytes (little-endian) on the wire
+	ssize_t prefilled_count;
+	struct bitcoin_prefilled_tx * prefilled_txns;
+};
+struct bitcoin_message_cmpctblock * bitcoin_message_cmpctblock_parse(struct bitcoin_message_cmpctblock * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_cmpctblock_cleanup(struct bitcoin_message_cmpctblock * msg);
+ssize_t bitcoin_message_cmpctblock_serialize(const struct bitcoin_message_cmpctblock * msg, unsigned char ** p_data);
+void bitcoin_message_cmpctblock_dump(const struct bitcoin_message_cmpctblock * msg);
+
+struct bitcoin_message_getblocktxn
+{
+	uint256_t block_hash;
+	ssize_t count;
+	ssize_t * indexes;	// absolute indexes (differentially encoded in the message)
+};
+struct bitcoin_message_getblocktxn * bitcoin_message_getblocktxn_parse(struct bitcoin_message_getblocktxn * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_getblocktxn_cleanup(struct bitcoin_message_getblocktxn * msg);
+ssize_t bitcoin_message_getblocktxn_serialize(const struct bitcoin_message_getblocktxn * msg, unsigned char ** p_data);
+void bitcoin_message_getblocktxn_dump(const struct bitcoin_message_getblocktxn * msg);
+
+struct bitcoin_message_blocktxn
+{
+	uint256_t block_hash;
+	ssize_t count;
+	satoshi_tx_t * txns;	// in the order of the getblocktxn's indexes
+};
+struct bitcoin_message_blocktxn * bitcoin_message_blocktxn_parse(struct bitcoin_message_blocktxn * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_blocktxn_cleanup(struct bitcoin_message_blocktxn * msg);
+ssize_t bitcoin_message_blocktxn_serialize(const struct bitcoin_message_blocktxn * msg, unsigned char ** p_data);
+void bitcoin_message_blocktxn_dump(const struct bitcoin_message_blocktxn * msg);
+
+/******************************************
+ * BIP157: compact block filters
+ *  struct bitcoin_message_getcfilters
+ *  struct bitcoin_message_cfilter
+ *  struct bitcoin_message_getcfheaders
+ *  struct bitcoin_message_cfheaders
+ *  struct bitcoin_message_getcfcheckpt
+ *  struct bitcoin_message_cfcheckpt
+******************************************/
+#define BITCOIN_MESSAGE_MAX_GETCFILTERS_SIZE	(1000)	// blocks per getcfilters
+#define BITCOIN_MESSAGE_MAX_CFHEADERS_SIZE	(2000)	// filter hashes per cfheaders
+#define BITCOIN_MESSAGE_CFCHECKPT_INTERVAL	(1000)	// blocks between two checkpoints
+struct bitcoin_message_getcfilters
+{
+	uint8_t filter_type;	// 0: basic
+	uint32_t start_height;
+	uint256_t stop_hash;
+};
+struct bitcoin_message_getcfilters * bitcoin_message_getcfilters_parse(struct bitcoin_message_getcfilters * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_getcfilters_cleanup(struct bitcoin_message_getcfilters * msg);
+ssize_t bitcoin_message_getcfilters_serialize(const struct bitcoin_message_getcfilters * msg, unsigned char ** p_data);
+void bitcoin_message_getcfilters_dump(const struct bitcoin_message_getcfilters * msg);
+
+struct bitcoin_message_cfilter
+{
+	uint8_t filter_type;
+	uint256_t block_hash;
+	ssize_t filter_size;
+	unsigned char * filter;	// the serialized filter: varint(N) + golomb-rice coded set
+};
+struct bitcoin_message_cfilter * bitcoin_message_cfilter_parse(struct bitcoin_message_cfilter * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_cfilter_cleanup(struct bitcoin_message_cfilter * msg);
+ssize_t bitcoin_message_cfilter_serialize(const struct bitcoin_message_cfilter * msg, unsigned char ** p_data);
+void bitcoin_message_cfilter_dump(const struct bitcoin_message_cfilter * msg);
+
+struct bitcoin_message_getcfheaders
+{
+	uint8_t filter_type;
+	uint32_t start_height;
+	uint256_t stop_hash;
+};
+struct bitcoin_message_getcfheaders * bitcoin_message_getcfheaders_parse(struct bitcoin_message_getcfheaders * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_getcfheaders_cleanup(struct bitcoin_message_getcfheaders * msg);
+ssize_t bitcoin_message_getcfheaders_serialize(const struct bitcoin_message_getcfheaders * msg, unsigned char ** p_data);
+void bitcoin_message_getcfheaders_dump(const struct bitcoin_message_getcfheaders * msg);
+
+struct bitcoin_message_cfheaders
+{
+	uint8_t filter_type;
+	uint256_t stop_hash;
+	uint256_t prev_header;		// the filter header of (start_height - 1)
+	ssize_t count;
+	uint256_t * filter_hashes;	// [start_height, stop_height]
+};
+struct bitcoin_message_cfheaders * bitcoin_message_cfheaders_parse(struct bitcoin_message_cfheaders * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_cfheaders_cleanup(struct bitcoin_message_cfheaders * msg);
+ssize_t bitcoin_message_cfheaders_serialize(const struct bitcoin_message_cfheaders * msg, unsigned char ** p_data);
+void bitcoin_message_cfheaders_dump(const struct bitcoin_message_cfheaders * msg);
+
+struct bitcoin_message_getcfcheckpt
+{
+	uint8_t filter_type;
+	uint256_t stop_hash;
+};
+struct bitcoin_message_getcfcheckpt * bitcoin_message_getcfcheckpt_parse(struct bitcoin_message_getcfcheckpt * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_getcfcheckpt_cleanup(struct bitcoin_message_getcfcheckpt * msg);
+ssize_t bitcoin_message_getcfcheckpt_serialize(const struct bitcoin_message_getcfcheckpt * msg, unsigned char ** p_data);
+void bitcoin_message_getcfcheckpt_dump(const struct bitcoin_message_getcfcheckpt * msg);
+
+struct bitcoin_message_cfcheckpt
+{
+	uint8_t filter_type;
+	uint256_t stop_hash;
+	ssize_t count;
+	uint256_t * filter_headers;	// the filter headers at the heights of 1000, 2000, ... (<= stop_height)
+};
+struct bitcoin_message_cfcheckpt * bitcoin_message_cfcheckpt_parse(struct bitcoin_message_cfcheckpt * msg, const unsigned char * payload, size_t length);
+void bitcoin_message_cfcheckpt_cleanup(struct bitcoin_message_cfcheckpt * msg);
+ssize_t bitcoin_message_cfcheckpt_serialize(const struct bitcoin_message_cfcheckpt * msg, unsigned char ** p_data);
+void bitcoin_message_cfcheckpt_dump(const struct bitcoin_message_cfcheckpt * msg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,73 +14,212 @@ extern "C" {
 #include <sys/epoll.h>
 
 #include "satoshi-types.h"
+#include "bitcoin-message.h"
 #include "auto_buffer.h"
 
+/**
+ * bitcoin_node: multi-peer p2p engine
+ *
+ * @details
+ *  - one accepting thread (listening sockets, level-triggered epoll),
+ *    and N io threads, each one owns an edge-triggered epoll fd.
+ *  - peers are sharded by fd (fd % N): a peer's io, state machine and callbacks
+ *    always run in the same io thread, no locks are needed on the receive path.
+ *  - sockets are non-blocking (including connect), version / verack / ping are handled by the engine,
+ *    other messages are framed, checksummed and passed to bnode->on_message().
+ */
+
+#define BITCOIN_NODE_MAX_LISTENING_FDS 	(8)
+#define BITCOIN_NODE_DEFAULT_IO_THREADS	(4)
+#define BITCOIN_NODE_MAX_PAYLOAD_SIZE	BITCOIN_MESSAGE_MAX_PAYLOAD_SIZE
+#define BITCOIN_NODE_MAX_SEND_BUFFER	(64 * 1024 * 1024)	// per peer, hard limit
+#define BITCOIN_NODE_SEND_HIGH_WATERMARK	(8 * 1024 * 1024)	// per peer, bulk messages are refused above this level
+#define BITCOIN_NODE_HANDSHAKE_TIMEOUT	(60)		// seconds
+#define BITCOIN_NODE_INACTIVITY_TIMEOUT	(20 * 60)	// seconds
+#define BITCOIN_NODE_MIN_PROTOCOL_VERSION	(70001)
+
+enum peer_state
+{
+	peer_state_closed = 0,
+	peer_state_connecting,		// (outbound) non-blocking connect() in progress
+	peer_state_handshaking,		// connected, exchanging version / verack
+	peer_state_established,
+};
+const char * peer_state_to_string(enum peer_state state);
+
+enum peer_handshake_flags
+{
+	peer_handshake_flags_version_sent = 0x01,
+	peer_handshake_flags_version_received = 0x02,
+	peer_handshake_flags_verack_received = 0x04,
+};
+
+/**
+ * bitcoin_node_message: a serialized message (header + payload),
+ *   immutable and reference counted, can be queued to any number of peers without copying.
+ */
+typedef struct bitcoin_node_message
+{
+	int refs;
+	size_t size;	// sizeof(hdr) + hdr.length
+	struct bitcoin_message_header hdr;	// followed by the payload
+}bitcoin_node_message_t;
+bitcoin_node_message_t * bitcoin_node_message_new(uint32_t magic, const char * command, const void * payload, size_t length);
+bitcoin_node_message_t * bitcoin_node_message_addref(bitcoin_node_message_t * msg);
+void bitcoin_node_message_unref(bitcoin_node_message_t * msg);
+
+enum bitcoin_node_message_priority
+{
+	bitcoin_node_message_priority_control = 0,	// sent ahead of any queued bulk message (never splits a message on the wire)
+	bitcoin_node_message_priority_bulk = 1,		// block, tx, ...: subject to the high watermark
+};
+enum bitcoin_node_message_priority bitcoin_node_message_priority_from_type(enum bitcoin_message_type msg_type);
+
+struct peer_outbound_entry;
 typedef struct peer_info
 {
 	int fd;
 	struct sockaddr_storage addr;
 	socklen_t addr_len;
-	
-	void * server_ctx;
-	void * priv;
-	
+
+	void * server_ctx;	// bitcoin_node_t *
+	void * priv;		// the io thread which owns this peer
+	void * user_data;
+
 	int quit;
-	
-	struct bitcoin_message_header in_hdr;
+	int refs;
+	int is_outbound;
+	enum peer_state state;
+	int handshake_flags;	// enum peer_handshake_flags
+	int64_t connected_at;	// monotonic seconds
+	int64_t last_recv;
+
+	// the remote node's version message
+	int32_t version;
+	uint64_t services;
+	int32_t start_height;
+
+	struct bitcoin_message_header in_hdr;	// the message being received (in_hdr.length is valid if in_hdr.magic != 0)
 	auto_buffer_t in_buf[1];
-	
-	struct bitcoin_message_header out_hdr;
-	auto_buffer_t out_buf[1];
-	
+
+	// outbound queue, drained with writev()
+	pthread_mutex_t out_mutex;
+	struct peer_outbound_entry * out_head;
+	struct peer_outbound_entry * out_tail;
+	struct peer_outbound_entry * out_last_control;	// control messages are queued after this one
+	size_t out_offset;	// bytes of out_head have been sent
+	size_t out_bytes;	// queued bytes not yet sent
+	ssize_t out_count;
+	int send_blocked;	// a bulk message was refused, on_peer_writable() will be called once drained
+	int flush_pending;	// a flush request has been posted to the io thread
+
 	int (* read)(struct peer_info * peer);
 	int (* write)(struct peer_info * peer);
-	
+
 	// callback
 	int (* on_read)(struct peer_info * peer, struct epoll_event * ev);
 	int (* on_write)(struct peer_info * peer, struct epoll_event * ev);
 	int (* on_error)(struct peer_info * peer, struct epoll_event * ev);
 }peer_info_t;
-peer_info_t * peer_info_new(int fd, void * server_ctx, const struct addrinfo * addr);
+peer_info_t * peer_info_new(int fd, void * server_ctx, const struct sockaddr * addr, socklen_t addr_len);
 void peer_info_free(peer_info_t * peer);
+peer_info_t * peer_info_addref(peer_info_t * peer);
+void peer_info_unref(peer_info_t * peer);	// free the peer when the last reference was released
 
 
-#define BITCOIN_NODE_MAX_LISTENING_FDS (8)
 typedef struct bitcoin_node
 {
 	void * priv;
 	void * user_data;
-	int async_mode; 
+	int async_mode;
 
-	pthread_t th;
+	pthread_t th;	// accepting thread (async mode only)
 	int quit;
-	
-	pthread_mutex_t mutex;
-	pthread_t peers_th;
-	
+
+	pthread_mutex_t mutex;	// lock peers[] and peers_count
+
 	int listening_efd;
-	int peers_efd;
-	
 	int server_fds[BITCOIN_NODE_MAX_LISTENING_FDS];
 	int fds_count;
-	
-	struct addrinfo addrs[BITCOIN_NODE_MAX_LISTENING_FDS];
+
+	struct sockaddr_storage addrs[BITCOIN_NODE_MAX_LISTENING_FDS];
 	char hosts[BITCOIN_NODE_MAX_LISTENING_FDS][NI_MAXHOST];
-	char servs[BITCOIN_NODE_MAX_LISTENING_FDS][NI_MAXSERV];
-	
-	peer_info_t ** peers;
-	ssize_t max_size;
+	char servs[BITCOIN_NODE_MAX_LISTENING_FDS][NI_MAXSERV];	// the bound ports (if port "0" was given)
+
+	// local node's version message
+	uint32_t magic;
+	int32_t protocol_version;
+	uint64_t services;
+	int32_t start_height;
+	uint64_t nonce;		// to detect connections to self
+	const char * user_agent;
+
+	size_t send_high_watermark;	// per peer, bulk messages
+	size_t max_send_buffer;		// per peer, all messages
+
+	int num_io_threads;
+	peer_info_t ** peers;	// indexed by fd
+	ssize_t max_fds;		// size of peers[] (RLIMIT_NOFILE)
+	ssize_t max_size;		// max number of peers
 	ssize_t peers_count;
-	
+
 	int (* on_accept)(struct bitcoin_node * bnode, struct epoll_event * ev);
 	int (* on_error)(struct bitcoin_node * bnode, struct epoll_event * ev);
-	
+
+	/*
+	 * callbacks, called in the peer's io thread.
+	 *   on_message(): msg_hdr points into the peer's receiving buffer (checksum verified, never copied),
+	 *     and is only valid during the call. use bitcoin_message_parse_in_place(msg, msg_hdr, 0) to decode it.
+	 *   returns non-zero to close the connection.
+	 */
+	int (* on_peer_established)(struct bitcoin_node * bnode, peer_info_t * peer);
+	void (* on_peer_closed)(struct bitcoin_node * bnode, peer_info_t * peer);
+	int (* on_message)(struct bitcoin_node * bnode, peer_info_t * peer, const struct bitcoin_message_header * msg_hdr);
+	void (* on_peer_writable)(struct bitcoin_node * bnode, peer_info_t * peer);	// the queue was drained below half of the high watermark
 }bitcoin_node_t;
-bitcoin_node_t * bitcoin_node_new(size_t max_size, void * user_data);
+bitcoin_node_t * bitcoin_node_new(size_t max_size, int num_io_threads, void * user_data);
 void bitcoin_node_free(bitcoin_node_t * bnode);
+
+/**
+ * bitcoin_node_run(): listen on serv_name:port (serv_name and port are nullable, outbound only if port is NULL)
+ *   async_mode: 0 to run the accepting loop in the caller's thread until bitcoin_node_terminate() was called.
+ */
 int bitcoin_node_run(bitcoin_node_t * bnode, const char * serv_name, const char * port, int async_mode);
 void bitcoin_node_terminate(void);
 
+/**
+ * bitcoin_node_connect(): start a non-blocking outbound connection
+ * @return the fd of the new peer, or -1 on error
+ */
+int bitcoin_node_connect(bitcoin_node_t * bnode, const char * host, const char * port);
+
+/**
+ * bitcoin_node_get_peer(): lookup an active peer by fd.
+ *   the returned peer was referenced, call peer_info_unref() when it's no longer used.
+ */
+peer_info_t * bitcoin_node_get_peer(bitcoin_node_t * bnode, int fd);
+
+/**
+ * bitcoin_node_send(): queue a shared message, thread-safe.
+ *   the queue is flushed immediately if called in the peer's io thread, otherwise by the io thread.
+ *   (the caller must hold a reference of the peer if called outside the peer's callbacks)
+ * @return 0 on success, -1 on error:
+ *   errno == EAGAIN: (bulk) the peer's queue is above the high watermark, retry after on_peer_writable()
+ *   errno == ENOBUFS: the hard limit (max_send_buffer) was reached
+ *   errno == EPIPE: the peer has been closed
+ */
+int bitcoin_node_send(bitcoin_node_t * bnode, peer_info_t * peer,
+	bitcoin_node_message_t * msg, enum bitcoin_node_message_priority priority);
+ssize_t bitcoin_node_broadcast_message(bitcoin_node_t * bnode,
+	bitcoin_node_message_t * msg, enum bitcoin_node_message_priority priority);	// to all established peers
+
+/*
+ * serialize and send (the priority is chosen by the command)
+ */
+int bitcoin_node_send_message(bitcoin_node_t * bnode, peer_info_t * peer,
+	const char * command, const void * payload, size_t length);
+ssize_t bitcoin_node_broadcast(bitcoin_node_t * bnode, const char * command, const void * payload, size_t length);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,109 @@
+#ifndef _BLOCK_CACHE_H_
+#define _BLOCK_CACHE_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "block_files.h"
+
+/**
+ * struct block_cache
+ *
+ * @details
+ *  A sharded LRU cache of raw serialized blocks, sits in front of the blk(nnnnn).dat files.
+ *  Blocks are identified by the position info stored in 'db_record_block_t':
+ *  (file_index, start_pos, block_size).
+ *
+ *  - each shard owns a hash table, a LRU list and (max_bytes / num_shards) bytes budget.
+ *  - entries are reference counted, an entry which is still in use by the caller
+ *    will be unlinked from the cache when evicted, and be freed on the last release().
+ *  - send_to() streams a block to a socket. if the block is not cached,
+ *    the data will be sent by sendfile() directly from the blk file (zero-copy),
+ *    the block is loaded into the cache when it is sent again (while its key is still in the shard's ghost keys).
+ */
+
+#define BLOCK_CACHE_DEFAULT_SHARDS			(16)
+#define BLOCK_CACHE_DEFAULT_MAX_BYTES		(512 * 1024 * 1024)	// about 300~500 recent mainnet blocks
+#define BLOCK_CACHE_BLOCK_FILE_FMT			BLOCK_FILE_FMT
+#define BLOCK_CACHE_GHOST_KEYS				(64)	// per shard, the blocks recently sent uncached
+
+typedef struct block_cache_entry
+{
+	int64_t file_index;
+	int64_t start_pos;
+	uint32_t block_size;
+	unsigned char * data;	// raw serialized block, (block_size) bytes
+
+	void * priv;			// internal use: shard, hash_next, lru_prev, lru_next, refs
+}block_cache_entry_t;
+
+struct block_cache_stats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t bytes_read;		// bytes loaded from blk files
+	uint64_t bytes_sent;		// bytes sent by send_to()
+	uint64_t bytes_sendfile;	// bytes sent through sendfile() (zero-copy)
+
+	int64_t num_entries;
+	int64_t total_bytes;
+	int64_t max_bytes;
+};
+
+typedef struct block_cache
+{
+	void * priv;
+	void * user_data;
+
+	/**
+	 * get(): find the block in the cache, or load it from the blk file.
+	 * @return a referenced entry, the caller MUST call release() when done. NULL on error.
+	 */
+	block_cache_entry_t * (* get)(struct block_cache * cache,
+		int64_t file_index, int64_t start_pos, uint32_t block_size);
+	void (* release)(struct block_cache * cache, block_cache_entry_t * entry);
+
+	/**
+	 * peek(): find the block in the cache only, never touch the disk.
+	 */
+	block_cache_entry_t * (* peek)(struct block_cache * cache, int64_t file_index, int64_t start_pos);
+
+	/**
+	 * send_to():
+	 *   send (part of) the block to the socket,
+	 *   supports non-blocking sockets: (*p_offset) is the number of bytes already sent,
+	 *   and will be updated after each call.
+	 * @return bytes sent in this call; -1 on error (errno is preserved, eg. EAGAIN)
+	 */
+	ssize_t (* send_to)(struct block_cache * cache, int sockfd,
+		int64_t file_index, int64_t start_pos, uint32_t block_size,
+		off_t * p_offset);
+
+	/**
+	 * invalidate(): drop all cached blocks of the file,
+	 *   should be called when the blk file was rewritten or pruned.
+	 *   (the reads in progress keep the old fd, it is closed once they are finished)
+	 */
+	int (* invalidate)(struct block_cache * cache, int64_t file_index);
+	int (* set_max_bytes)(struct block_cache * cache, int64_t max_bytes);
+	int (* get_stats)(struct block_cache * cache, struct block_cache_stats * stats);
+}block_cache_t;
+
+block_cache_t * block_cache_init(block_cache_t * cache,
+	const char * blocks_dir, 	// the directory of blk(nnnnn).dat files
+	int64_t max_bytes,			// <= 0: use default
+	int num_shards, 			// <= 0: use default
+	void * user_data);
+void block_cache_cleanup(block_cache_t * cache);
+
+#define block_cache_get_record(cache, record) (cache)->get(cache, (record)->file_index, (record)->start_pos, (record)->block_size)
+
+#ifdef __cplusplus
+}
+#endif
+#endif
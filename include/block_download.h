@@ -0,0 +1,115 @@
+#ifndef BLOCK_DOWNLOAD_H_
+#define BLOCK_DOWNLOAD_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "satoshi-types.h"
+#include "chains.h"
+#include "bitcoin-message.h"
+
+/**
+ * block_download_manager: parallel block download after headers-first sync
+ *
+ * @details
+ *  - the blocks of the main (headers) chain in [next_height, next_height + window_size) are
+ *    assigned to the peers, each peer has at most 'max_in_flight' requests.
+ *  - per-peer window (adaptive): grows by one for each block delivered in time,
+ *    halved when a request timed out or stalled the download window.
+ *  - stall detection: if the block at next_height was requested more than 'stall_timeout' seconds ago
+ *    while later blocks are waiting, it's reassigned to another peer (on_peer_stalling() is called).
+ *    any request older than 'request_timeout' is reassigned as well.
+ *  - completed blocks are passed to on_block_ready() strictly in height order,
+ *    by one thread at a time (the callback is called without holding the lock).
+ *  - thread-safe, can be called from any network thread.
+ */
+
+#define BLOCK_DOWNLOAD_DEFAULT_WINDOW_SIZE	(1024)
+#define BLOCK_DOWNLOAD_DEFAULT_MAX_IN_FLIGHT	(16)	// per peer
+#define BLOCK_DOWNLOAD_STALL_TIMEOUT	(2.0)	// seconds
+#define BLOCK_DOWNLOAD_REQUEST_TIMEOUT	(60.0)	// seconds
+
+struct block_download_peer_stats
+{
+	int peer_id;
+	int in_flight;
+	int max_in_flight;	// current (adaptive) window of the peer
+	int64_t received;
+	int64_t stalls;		// requests reassigned for stalling or timeout
+};
+
+typedef struct block_download_manager
+{
+	void * priv;
+	void * user_data;
+	blockchain_t * chain;	// the headers chain
+
+	ssize_t window_size;
+	int max_in_flight;		// per peer
+	double stall_timeout;
+	double request_timeout;
+	uint32_t inv_type;		// bitcoin_inventory_type_msg_block (default) or msg_witness_block
+
+	ssize_t next_height;	// the next block to be passed to on_block_ready()
+
+	/*
+	 * on_block_ready(): called in height order, 'block' is released by on_free_block() after the call.
+	 *   returns non-zero if the block is invalid: it will be downloaded again (from another peer).
+	 */
+	int (* on_block_ready)(struct block_download_manager * mgr, ssize_t height, const uint256_t * hash, void * block, int peer_id);
+	void (* on_free_block)(void * block);
+	void (* on_peer_stalling)(struct block_download_manager * mgr, int peer_id);	// e.g. disconnect the peer
+
+	double (* get_time)(struct block_download_manager * mgr);	// monotonic seconds (overridable for tests)
+}block_download_manager_t;
+
+block_download_manager_t * block_download_manager_new(blockchain_t * chain, ssize_t start_height, void * user_data);
+void block_download_manager_free(block_download_manager_t * mgr);
+
+int block_download_add_peer(block_download_manager_t * mgr, int peer_id, ssize_t best_height);
+void block_download_update_peer(block_download_manager_t * mgr, int peer_id, ssize_t best_height);
+void block_download_remove_peer(block_download_manager_t * mgr, int peer_id);	// its requests are reassigned
+int block_download_get_peer_stats(block_download_manager_t * mgr, int peer_id, struct block_download_peer_stats * stats);
+
+/**
+ * block_download_get_requests(): assign the next missing blocks to a peer
+ * @return the number of inventories filled (to be sent in a getdata message)
+ */
+ssize_t block_download_get_requests(block_download_manager_t * mgr, int peer_id, struct bitcoin_inventory * invs, ssize_t max_count);
+
+/**
+ * block_download_on_block(): a block was received, ownership of 'block' is taken on success.
+ * @return 0 on success, -1 if the block was not requested or already received (the caller keeps 'block')
+ */
+int block_download_on_block(block_download_manager_t * mgr, int peer_id, const uint256_t * hash, void * block);
+int block_download_on_notfound(block_download_manager_t * mgr, int peer_id, const uint256_t * hash);
+
+/**
+ * block_download_check_timeouts(): reassign the stalled / timed out requests, call it periodically.
+ * @return the number of requests reassigned
+ */
+ssize_t block_download_check_timeouts(block_download_manager_t * mgr);
+
+/**
+ * block_download_is_known(): the block has been delivered, or is being downloaded.
+ *   (to filter out the known elements of inv messages)
+ */
+int block_download_is_known(block_download_manager_t * mgr, const uint256_t * hash);
+
+/**
+ * block_download_on_reorg(): the blocks above 'fork_height' were removed from the main chain,
+ *   next_height is moved back to (fork_height + 1), the requests and the received blocks above it are dropped.
+ *   (call it from chain->on_remove_block(), with (height - 1))
+ */
+void block_download_on_reorg(block_download_manager_t * mgr, ssize_t fork_height);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
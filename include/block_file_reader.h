@@ -0,0 +1,111 @@
+#ifndef _BLOCK_FILE_READER_H_
+#define _BLOCK_FILE_READER_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * struct block_file_reader
+ *
+ * @details
+ *  Asynchronous batched reader of blk(nnnnn).dat files,
+ *  used for reindexing (see block_file_reader_scan(), and the filter index reindex of spv_node_app).
+ *
+ *  - callers submit a batch of (file_index, offset, length) requests,
+ *    on_completed() will be called (in one of the reader's threads) once all requests of the batch finished.
+ *  - backends: io_uring (if the kernel supports it), or a pool of pread() threads.
+ *  - block_reader_flags_sequential: the batch is a part of a sequential scan,
+ *    readahead hints (posix_fadvise) will be given to the kernel.
+ */
+
+#define BLOCK_FILE_READER_DEFAULT_THREADS	(4)
+#define BLOCK_FILE_READER_QUEUE_DEPTH		(64)
+#define BLOCK_FILE_READER_SCAN_CHUNK_SIZE	(1024 * 1024)	// the size of each request of a scan window
+#define BLOCK_FILE_READER_SCAN_WINDOW_SIZE	(16 * 1024 * 1024)
+
+typedef struct block_read_request
+{
+	int64_t file_index;
+	int64_t offset;
+	uint32_t length;
+	unsigned char * data;	// nullable, if NULL, a buffer will be allocated by the reader, and owned by the caller after completion.
+	void * user_data;
+
+	// results
+	ssize_t cb_read;		// (length) on success, -1 on error
+	int err_code;			// errno
+}block_read_request_t;
+
+enum block_reader_flags
+{
+	block_reader_flags_sequential = 0x01,
+};
+
+enum block_reader_backend
+{
+	block_reader_backend_thread_pool = 0,
+	block_reader_backend_io_uring = 1,
+};
+
+struct block_file_reader;
+typedef void (* block_reader_on_completed_callback)(struct block_file_reader * reader,
+	block_read_request_t * requests, ssize_t count,
+	void * user_data);
+
+typedef struct block_file_reader
+{
+	void * priv;
+	void * user_data;
+	enum block_reader_backend backend;
+
+	/**
+	 * submit(): queue a batch of requests, returns immediately.
+	 *   the requests array MUST be kept valid until on_completed() was called.
+	 */
+	int (* submit)(struct block_file_reader * reader,
+		block_read_request_t * requests, ssize_t count,
+		int flags,	// enum block_reader_flags
+		block_reader_on_completed_callback on_completed,
+		void * user_data);
+
+	/**
+	 * read_batch(): submit and wait
+	 * @return the number of successful requests
+	 */
+	ssize_t (* read_batch)(struct block_file_reader * reader,
+		block_read_request_t * requests, ssize_t count,
+		int flags);
+}block_file_reader_t;
+
+block_file_reader_t * block_file_reader_init(block_file_reader_t * reader,
+	const char * blocks_dir,
+	int num_threads,	// <= 0: use default
+	int use_io_uring,	// try io_uring first, fall back to the thread pool if not supported
+	void * user_data);
+void block_file_reader_cleanup(block_file_reader_t * reader);
+
+/**
+ * block_file_reader_scan(): walk through the {magic, block_size, block_data} records of blk(file_index).dat
+ *
+ * @details
+ *  the file is read sequentially, (BLOCK_FILE_READER_SCAN_WINDOW_SIZE) bytes per batch,
+ *  on_block() is called (in the caller's thread) for each complete record, 'data' is only valid during the call.
+ *  the scan stops at the end of the file, at the zero-filled preallocated space, or when on_block() returns non-zero.
+ *
+ * @return the number of blocks found, -1 if the file can not be read or contains an invalid record
+ */
+typedef int (* block_reader_on_block_callback)(struct block_file_reader * reader,
+	int64_t file_index, int64_t start_pos, uint32_t block_size, const unsigned char * data,
+	void * user_data);
+ssize_t block_file_reader_scan(block_file_reader_t * reader, int64_t file_index, uint32_t magic,
+	block_reader_on_block_callback on_block, void * user_data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
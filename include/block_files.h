@@ -0,0 +1,76 @@
+#ifndef _BLOCK_FILES_H_
+#define _BLOCK_FILES_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/**
+ * struct block_files
+ *
+ * @details
+ *  The read-only file descriptors of the blk(nnnnn).dat files in 'blocks_dir',
+ *  indexed by file_index, opened on first access and kept open until cleanup.
+ *  Shared by block_cache and block_file_reader, thread-safe.
+ */
+
+#define BLOCK_FILE_FMT				"blk%.5d.dat"
+#define BLOCK_FILES_ALLOC_SIZE		(1024)
+
+/**
+ * block_files: the table of opened blk files, shared by the readers of a blocks directory
+ *
+ * @details
+ *  - the fds are reference counted: a user holds the fd from block_files_get_fd() to block_files_put_fd(),
+ *    (e.g. across a pread(), a sendfile(), or while a queued io_uring read carries a copy of it)
+ *  - block_files_close() detaches the fd from the table, the next block_files_get_fd() opens the file again,
+ *    the old fd is retired and only closed when its last reference is released,
+ *    so the number can not be reused by another open() while a read is still in flight.
+ */
+struct block_file_ref
+{
+	int fd;		// -1: not opened
+	int refs;	// number of users holding the fd
+};
+
+typedef struct block_files
+{
+	char blocks_dir[PATH_MAX];
+
+	pthread_mutex_t mutex;
+	ssize_t max_files;
+	struct block_file_ref * fds;	// indexed by file_index
+
+	// detached by block_files_close() while still in use
+	ssize_t retired_count;
+	ssize_t retired_max;
+	struct block_file_ref * retired;
+}block_files_t;
+
+block_files_t * block_files_init(block_files_t * files, const char * blocks_dir);
+void block_files_cleanup(block_files_t * files);
+
+/**
+ * block_files_get_fd(): open (or reuse) blk(file_index).dat and take a reference to its fd.
+ * @return the fd (owned by 'files', do not close it), or -1 on error
+ *
+ * block_files_put_fd(): release the reference, 'fd' must be the value returned by block_files_get_fd(file_index).
+ */
+int block_files_get_fd(block_files_t * files, int64_t file_index);
+void block_files_put_fd(block_files_t * files, int64_t file_index, int fd);
+
+/**
+ * block_files_close(): close the file (once it is no longer in use), it will be reopened on next access.
+ */
+void block_files_close(block_files_t * files, int64_t file_index);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
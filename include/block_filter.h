@@ -0,0 +1,171 @@
+#ifndef BLOCK_FILTER_H_
+#define BLOCK_FILTER_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "satoshi-types.h"
+#include "bitcoin-message.h"
+#include "db_engine.h"
+
+/**
+ * block_filter: BIP158 compact block filters (basic type)
+ *
+ * @details
+ *  - elements: the output scripts of all the txs (except the empty and OP_RETURN scripts),
+ *    and the scripts spent by the inputs (except the coinbase's), duplicates are removed.
+ *  - each element is mapped into [0, N * M) by SipHash-2-4 (keyed by the first 16 bytes of the block hash),
+ *    the sorted values are delta-coded with Golomb-Rice coding (P = 19, M = 784931).
+ *  - serialized filter: varint(N) + the bit stream (most significant bit first, zero-padded).
+ *  - filter header: hash256(hash256(filter) || prev_header), the prev_header of the genesis block is zero.
+ *  - the spent scripts are not part of a block, they are passed in by the caller
+ *    (block_filter_index keeps them for the blocks it has indexed).
+ */
+
+#define BLOCK_FILTER_TYPE_BASIC	(0)
+#define BLOCK_FILTER_BASIC_P	(19)
+#define BLOCK_FILTER_BASIC_M	(784931)
+
+typedef struct block_filter
+{
+	uint8_t filter_type;
+	uint256_t block_hash;
+	uint64_t k0, k1;		// siphash keys
+
+	ssize_t num_elements;	// N
+	ssize_t size;
+	unsigned char * data;	// the serialized filter
+}block_filter_t;
+
+/**
+ * block_filter_build():
+ * @param spent_scripts	the scripts spent by the inputs, in block order, excluding the coinbase.
+ *   (spent_count must be the number of non-coinbase inputs)
+ * @return 0 on success, -1 on error
+ */
+int block_filter_build(block_filter_t * filter, const satoshi_block_t * block, const uint256_t * block_hash,
+	const varstr_t ** spent_scripts, ssize_t spent_count);
+
+/**
+ * block_filter_load(): init the filter with a serialized filter (e.g. a received cfilter), the data is copied.
+ * @return 0 on success, -1 if the filter is malformed
+ */
+int block_filter_load(block_filter_t * filter, const uint256_t * block_hash, const unsigned char * data, ssize_t size);
+void block_filter_cleanup(block_filter_t * filter);
+
+void block_filter_get_hash(const block_filter_t * filter, uint256_t * filter_hash);
+void block_filter_compute_header(const uint256_t * filter_hash, const uint256_t * prev_header, uint256_t * header);
+
+/**
+ * block_filter_match(): (the client side) false positive rate: 1 / M
+ * block_filter_match_any(): matches a set of elements in a single pass over the filter
+ * @return 1 if matched, 0 otherwise
+ */
+int block_filter_match(const block_filter_t * filter, const void * element, size_t length);
+int block_filter_match_any(const block_filter_t * filter, ssize_t count, const unsigned char ** elements, const size_t * lengths);
+
+
+/**
+ * block_filter_index: the filters and filter headers of the main chain (BIP157 serving)
+ *
+ * @details
+ *  databases (in the db_engine):
+ *   - <db_name>:          block_hash --> { height, filter_hash, header, filter }
+ *   - <db_name>_height:   height --> block_hash (secondary)
+ *   - <db_name>_prevouts: outpoint --> { value, output script }, the unspent outputs of the indexed blocks
+ *   - <db_name>_undo:     block_hash --> { created outpoints, spent (outpoint, value, script) }, to disconnect a block
+ *  - blocks are added in height order on top of the tip (or from the genesis block), and removed from the tip.
+ *  - add_blocks(): the spent scripts are resolved sequentially (they depend on the previous blocks),
+ *    then the filters are built in parallel (num_threads), then the headers are chained and stored in one txn.
+ *  - reindex(): add_blocks() in batches, the blocks are provided by get_block() (spv_node_app reads them from the blk files with block_file_reader).
+ *  - thread-safe.
+ */
+#define BLOCK_FILTER_INDEX_DEFAULT_THREADS	(4)
+#define BLOCK_FILTER_INDEX_REINDEX_BATCH	(256)	// blocks
+
+struct block_filter_record
+{
+	int32_t height;		// index of the secondary db
+	uint256_t filter_hash;
+	uint256_t header;
+	unsigned char filter[0];
+}__attribute__((packed));
+
+typedef struct block_filter_index
+{
+	void * priv;
+	void * user_data;
+	db_engine_t * engine;
+	pthread_mutex_t mutex;
+
+	int num_threads;
+	int32_t height;			// the tip, -1: empty
+	uint256_t tip_hash;
+	uint256_t tip_header;
+}block_filter_index_t;
+
+block_filter_index_t * block_filter_index_init(block_filter_index_t * index, db_engine_t * engine, const char * db_name, void * user_data);
+void block_filter_index_cleanup(block_filter_index_t * index);
+
+/**
+ * block_filter_index_add_blocks(): blocks[i] is at (start_height + i)
+ * @return 0 on success, -1 if start_height is not (tip + 1), or a spent output is unknown (nothing is stored)
+ */
+int block_filter_index_add_blocks(block_filter_index_t * index, int32_t start_height, ssize_t count,
+	const uint256_t * hashes, const satoshi_block_t * blocks);
+#define block_filter_index_add_block(index, height, hash, block) block_filter_index_add_blocks(index, height, 1, hash, block)
+
+/**
+ * block_filter_index_remove_block(): disconnect the tip (the spent outputs are restored)
+ * @return 0 on success, -1 if the block is not the tip
+ */
+int block_filter_index_remove_block(block_filter_index_t * index, const uint256_t * hash);
+
+/**
+ * block_filter_index_reindex(): index the blocks from (tip + 1) until get_block() returns non-zero
+ * @return the number of blocks added, -1 on error
+ */
+typedef int (* block_filter_get_block_callback)(void * user_data, int32_t height, uint256_t * hash, satoshi_block_t * block);
+ssize_t block_filter_index_reindex(block_filter_index_t * index, block_filter_get_block_callback get_block, void * user_data);
+
+/**
+ * block_filter_index_find(): any of the outputs can be NULL
+ * @return 0 on success, -1 if not found
+ */
+int block_filter_index_find(block_filter_index_t * index, const uint256_t * hash,
+	int32_t * p_height, uint256_t * filter_hash, uint256_t * header, block_filter_t * filter);
+int block_filter_index_get_hash(block_filter_index_t * index, int32_t height, uint256_t * hash);
+
+/**
+ * block_filter_index_get_prevout(): an unspent output of the indexed blocks (as of the tip of the index),
+ *   e.g. to value the confirmed inputs of a tx. 'p_value' and 'p_scripts' are nullable (varstr_free() the scripts).
+ * @return 0 on success, -1 if not found (spent, or not indexed yet)
+ */
+int block_filter_index_get_prevout(block_filter_index_t * index, const satoshi_outpoint_t * outpoint,
+	int64_t * p_value, varstr_t ** p_scripts);
+
+/**
+ * BIP157 requests:
+ *  get_cfilters(): the filters are filled in *p_filters (call bitcoin_message_cfilter_cleanup() and free() to release them)
+ *  get_cfheaders() / get_cfcheckpt(): call bitcoin_message_cfheaders_cleanup() / bitcoin_message_cfcheckpt_cleanup() to release the reply
+ * @return -1 if the request is invalid (the peer should be disconnected),
+ *   0 if the filters are not available (yet), the number of filters / headers otherwise
+ *   (get_cfcheckpt(): 1 if the reply is filled, a stop block below the first checkpoint has no headers)
+ */
+ssize_t block_filter_index_get_cfilters(block_filter_index_t * index, const struct bitcoin_message_getcfilters * request,
+	struct bitcoin_message_cfilter ** p_filters);
+ssize_t block_filter_index_get_cfheaders(block_filter_index_t * index, const struct bitcoin_message_getcfheaders * request,
+	struct bitcoin_message_cfheaders * reply);
+int block_filter_index_get_cfcheckpt(block_filter_index_t * index, const struct bitcoin_message_getcfcheckpt * request,
+	struct bitcoin_message_cfcheckpt * reply);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,138 @@
+#ifndef BLOOM_FILTER_H_
+#define BLOOM_FILTER_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "satoshi-types.h"
+#include "bitcoin-message.h"
+
+/**
+ * bloom_filter: BIP37 connection bloom filtering (the serving side)
+ *
+ * @details
+ *  - the filter of a peer is loaded by filterload, extended by filteradd, and removed by filterclear.
+ *  - hash functions: murmur3_32(i * 0xFBA4C795 + tweak, data) % (size * 8), i in [0, num_hash_funcs)
+ *  - bloom_filter_match_tx(): matches a tx (txid, the data pushes of the output scripts,
+ *    the spent outpoints and the data pushes of the input scripts),
+ *    and inserts the outpoints of the matched outputs according to the update flags.
+ *  - blocks: the data pushes of a block are extracted once (bloom_block_index_init()),
+ *    then each peer's filter walks them in a single pass (bloom_filter_match_block()),
+ *    and the merkleblock is built from the cached merkle tree of the block (bloom_block_index_get_merkleblock()).
+ *  - not thread-safe: a filter belongs to one peer, a block index can be shared (read-only) once built.
+ */
+
+#define BLOOM_FILTER_MAX_SIZE	(36000)		// bytes
+#define BLOOM_FILTER_MAX_HASH_FUNCS	(50)
+#define BLOOM_FILTER_MAX_ELEMENT_SIZE	(520)	// filteradd
+
+enum bloom_filter_update_type
+{
+	bloom_filter_update_none = 0,
+	bloom_filter_update_all = 1,			// the outpoints of all the matched outputs are inserted
+	bloom_filter_update_p2pubkey_only = 2,	// only the outpoints of matched pay-to-pubkey and multisig outputs
+	bloom_filter_update_mask = 3,
+};
+
+typedef struct bloom_filter
+{
+	unsigned char * data;
+	size_t size;		// bytes
+	uint32_t num_hash_funcs;
+	uint32_t tweak;
+	uint8_t flags;		// enum bloom_filter_update_type
+
+	int is_full;		// all bits are set: matches everything
+	int is_empty;		// no bits are set: matches nothing
+}bloom_filter_t;
+
+/**
+ * bloom_filter_load(): init the filter with a filterload message (call bloom_filter_cleanup() before reloading it)
+ * @return 0 on success, -1 if the filter exceeds the BIP37 limits (the peer should be disconnected)
+ */
+int bloom_filter_load(bloom_filter_t * filter, const struct bitcoin_message_filterload * msg);
+void bloom_filter_cleanup(bloom_filter_t * filter);
+
+void bloom_filter_insert(bloom_filter_t * filter, const void * data, size_t length);
+int bloom_filter_contains(const bloom_filter_t * filter, const void * data, size_t length);
+
+/**
+ * bloom_filter_add(): filteradd
+ * @return 0 on success, -1 if the element is too large (the peer should be disconnected)
+ */
+int bloom_filter_add(bloom_filter_t * filter, const struct bitcoin_message_filteradd * msg);
+
+/**
+ * bloom_filter_match_tx(): (and update the filter)
+ * @return 1 if the tx is relevant to the filter, 0 otherwise
+ */
+int bloom_filter_match_tx(bloom_filter_t * filter, const satoshi_tx_t * tx);
+
+
+/**
+ * bloom_block_index: the matchable elements of a block, in block order
+ *   (the pointers refer to the scripts of 'block', which must outlive the index)
+ */
+enum bloom_block_item_type
+{
+	bloom_block_item_txout_push = 0,	// a data push of an output script
+	bloom_block_item_outpoint = 1,		// the outpoint spent by an input (36 bytes)
+	bloom_block_item_txin_push = 2,		// a data push of an input script
+};
+
+struct bloom_block_item
+{
+	const unsigned char * data;
+	uint32_t length;
+	uint16_t type;			// enum bloom_block_item_type
+	uint16_t is_p2pubkey;	// txout_push: the output is pay-to-pubkey or multisig
+	uint32_t txout_index;	// txout_push: the index of the output
+};
+
+typedef struct bloom_block_index
+{
+	const satoshi_block_t * block;
+	ssize_t txn_count;
+
+	ssize_t * tx_items;		// [txn_count + 1], the items of txns[i] are items[tx_items[i] .. tx_items[i + 1])
+	ssize_t items_count;
+	struct bloom_block_item * items;
+
+	// merkle tree, levels[0] are the txids
+	int height;
+	ssize_t * level_offsets;	// [height + 1]
+	uint256_t * hashes;
+}bloom_block_index_t;
+
+int bloom_block_index_init(bloom_block_index_t * index, const satoshi_block_t * block);
+void bloom_block_index_cleanup(bloom_block_index_t * index);
+
+/**
+ * bloom_filter_match_block(): match (and update the filter with) all the txs of the block, in block order
+ * @param matched	[out] txn_count flags
+ * @return the number of matched txs
+ */
+ssize_t bloom_filter_match_block(bloom_filter_t * filter, const bloom_block_index_t * index, uint8_t * matched);
+
+/**
+ * bloom_block_index_get_merkleblock(): build the partial merkle tree of the matched txs,
+ *   call bitcoin_message_merkleblock_cleanup() to release it.
+ */
+int bloom_block_index_get_merkleblock(const bloom_block_index_t * index, const uint8_t * matched, struct bitcoin_message_merkleblock * msg);
+
+/**
+ * merkleblock_extract_matches(): verify the partial merkle tree (the client side),
+ *   the matched txids are filled in *p_txids (can be NULL), call free() to release it.
+ * @return the number of matched txids, -1 if the tree is invalid or does not match the merkle root of the header
+ */
+ssize_t merkleblock_extract_matches(const struct bitcoin_message_merkleblock * msg, uint256_t ** p_txids);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -7,9 +7,11 @@ extern "C" {
 #endif
 #include <stdint.h>
 #include "satoshi-types.h"
+#include "uint256_math.h"
 #include <pthread.h>
 
 struct block_info;
+struct bitcoin_params;
 
 /**
  * struct active_chain 
@@ -50,15 +52,32 @@ typedef struct block_info
 	struct satoshi_block_header * hdr;
 	void (* hdr_free)(void *);	// set to NULL if no need to free
 	
-	int height;		// the index in the blockchain, -1 means not attached to any chains
+	/**
+	 * height: the (absolute) height of the block, -1 if the branch is not connected to the BLOCKCHAIN yet.
+	 * 	once known, the height of a block never changes.
+	 * 
+	 * pskip: (as 'pskip' of the reference client) 
+	 *  an ancestor at a lower height, used to find the ancestors and the fork-point in O(log n).
+	 *  it never goes beyond the 'head' of the chain (points to the 'head' if the target height is below),
+	 *  NULL if the height is unknown.
+	 */
+	int height;
+	struct block_info * pskip;
+	int peer_id;	// the peer who sent the header, -1: local (or unknown)
 
+	uint256_u64_t work;	// exact work (the expected number of hashes) of this block, 0 for the 'head' of a chain
+	
 	/**
-	 *  sice the precision of compact int is limited, 
-	 * when the cumulative difficulty exceeds a certain value (2^^72), 
-	 * it cannot be able to accumulate correctly.
+	 * cached best descendant:
+	 *   best_work: cumulative work of the heaviest branch starting from this node (inclusive),
+	 *   best_descendant: the end of that branch (the node itself if it has no children).
+	 *   the heaviest child is always kept at the 'first_child' position, 
+	 *   so the first-child path leads to the 'best_descendant'.
+	 * 
+	 * both are relative to the node itself, attaching a subtree only needs to refresh the ancestors.
 	 */
-	double cumulative_difficulty;
-	// compact_uint256_t cumulative_difficulty;	// use compact_uint256 to represent cumulative difficulty.
+	uint256_u64_t best_work;
+	struct block_info * best_descendant;
 	
 	struct block_info * parent;	// there can be only one parent for each block
 	struct block_info * first_child;	// the first child will belong to the longest-chain
@@ -99,35 +118,100 @@ typedef struct active_chain
 	struct block_info head[1];
 	
 	// The fields below are for internal use only,
-	struct block_info * longest_end; // used to quickly find the longest-chain within current branch
+	struct block_info * longest_end; // used to quickly find the longest-chain within current branch, (head->best_descendant)
 	
 	/**
-	 * A pointer to the search-root of chains-list, 
-	 * used to update the search-tree when adding or deleting a child-node.
+	 * the chains-list which the chain belongs to, 
+	 * used to update the hash index when deleting the chain.
 	 */
-	void ** p_search_root;
+	struct active_chain_list * list;
+	ssize_t list_pos;	// position in list->chains
+	
+	// orphan pool: chains are ordered by the last update (LRU), the oldest ones are evicted first
+	struct active_chain * lru_prev;
+	struct active_chain * lru_next;
+	int64_t last_update;	// unix time
 	
 	// add child to 'head'
 	int (* add_child)(struct active_chain * chain, struct block_info * child);
 	
 }active_chain_t;
-active_chain_t * active_chain_new(block_info_t * orphan, void ** p_search_root);
+active_chain_t * active_chain_new(block_info_t * orphan, struct active_chain_list * list);
 void active_chain_free(active_chain_t * chain);
 
+/**
+ * struct active_chain_index
+ * @details
+ *  Open-addressing (linear probing) hash table: block_hash ==> (block_info_t *), 
+ *  contains all nodes of the chains-list, including the 'head' of each chain.
+ *  entries are removed by the node pointer, removed slots are marked as tombstones (node == NULL).
+ */
+struct active_chain_index_slot
+{
+	uint64_t key;		// 0: empty
+	struct block_info * node;	// NULL: tombstone
+};
+struct active_chain_index
+{
+	ssize_t size;		// power of 2
+	ssize_t used;		// live slots + tombstones
+	ssize_t count;		// live slots
+	struct active_chain_index_slot * slots;
+};
+
+/**
+ * orphan pool limits:
+ *   the chains-list holds headers which are not on the main chain (forks and orphans), 
+ *   the memory is accounted per node and attributed to the peer who sent the header.
+ *   
+ *   - when the pool is over 'max_bytes', or a chain has not been updated for 'max_age' seconds,
+ *     the least recently updated chains are evicted;
+ *   - a peer who holds more than 'max_bytes_per_peer' can not add any disconnected headers,
+ *     and 'on_peer_over_quota' is called to let the network layer ban the peer.
+ *     (the headers of the local peer (-1) are not limited by the per-peer quota)
+ */
+#define ACTIVE_CHAIN_LIST_DEFAULT_MAX_BYTES		(64 * 1024 * 1024)
+#define ACTIVE_CHAIN_LIST_DEFAULT_MAX_BYTES_PER_PEER	(8 * 1024 * 1024)
+#define ACTIVE_CHAIN_LIST_DEFAULT_MAX_AGE		(20 * 60)
+#define ACTIVE_CHAIN_NODE_SIZE	(sizeof(struct block_info) + sizeof(struct satoshi_block_header) + 2 * sizeof(struct active_chain_index_slot))
+
+struct active_chain_peer_usage
+{
+	int peer_id;
+	ssize_t num_nodes;
+	ssize_t bytes;
+	ssize_t num_rejected;	// headers rejected since the peer was over quota
+};
+
 typedef struct active_chain_list
 {
 	ssize_t max_size;
 	ssize_t count;
 	active_chain_t ** chains;
 	
-	void * search_root;	// tsearch root, used to find if a block is already in the list.
+	struct active_chain_index index[1];	// used to find if a block (or the missing parent of a chain) is already in the list.
 	void * user_data;
 	
+	// orphan pool
+	ssize_t max_bytes;			// 0: unlimited
+	ssize_t max_bytes_per_peer;	// 0: unlimited
+	int64_t max_age;			// 0: never expire
+	ssize_t bytes_used;
+	ssize_t num_evicted;		// number of nodes evicted
+	active_chain_t * lru_first;	// the least recently updated chain
+	active_chain_t * lru_last;
+	
+	ssize_t peers_count;
+	ssize_t peers_max;
+	struct active_chain_peer_usage * peers;
+	
+	void (* on_peer_over_quota)(struct active_chain_list * list, int peer_id, void * user_data);
+	
 	block_info_t * (* find_node)(struct active_chain_list * list, const uint256_t * hash, active_chain_t ** p_chain);
 	
-	// add or remove the node from the 'search-tree' 
-	int (* search_tree_add)(struct active_chain_list * list, block_info_t * node); 
-	int (* search_tree_remove)(struct active_chain_list * list, block_info_t * node); 
+	// add or remove the node from the hash index
+	int (* index_add)(struct active_chain_list * list, block_info_t * node); 
+	int (* index_remove)(struct active_chain_list * list, block_info_t * node); 
 	
 	int (* add)(struct active_chain_list * list, struct active_chain * chain);
 	int (* remove)(struct active_chain_list * list, struct active_chain * chain);
@@ -135,6 +219,8 @@ typedef struct active_chain_list
 }active_chain_list_t;
 active_chain_list_t * active_chain_list_init(active_chain_list_t * list, ssize_t max_size, void * user_data);
 void active_chain_list_cleanup(active_chain_list_t * list);
+const struct active_chain_peer_usage * active_chain_list_get_peer_usage(const active_chain_list_t * list, int peer_id);
+ssize_t active_chain_list_evict(active_chain_list_t * list, int64_t now);	// return the number of nodes evicted
 
 /**
  * struct blockchain_heir
@@ -145,44 +231,165 @@ void active_chain_list_cleanup(active_chain_list_t * list);
  * 
  * Unlike 'satoshi_block_header', this structure cannot prove the genuineness of itself by itself.
  * so do not add it directly to the BLOCKCHAIN, only appending block_header is allowed.
+ * 
+ * compact layout (112 bytes): 
+ *   the header fields are stored only once, and 'prev_hash' is the hash of the previous heir, 
+ *   use blockchain_get_header() or blockchain_snapshot_get_header() to reconstruct the full header.
  */
 typedef struct blockchain_heir
 {
 	uint256_t hash[1];
-	uint64_t timestamp;	// add support for BIP0113 (Median time-past as endpoint for lock-time calculations)
+	uint256_t merkle_root[1];
+	uint256_u64_t chainwork;	// exact cumulative work from the genesis block
 	
+	int32_t version;
+	uint32_t timestamp;	// add support for BIP0113 (Median time-past as endpoint for lock-time calculations)
 	uint32_t bits;		// current target
+	uint32_t nonce;
+}blockchain_heir_t;
+
+
+/**
+ * struct blockchain_hash_index
+ * @details
+ *  Open-addressing (linear probing) hash table: block_hash ==> height (index of the 'heirs' array).
+ *  
+ *  - block hashes are already uniformly random, a 64-bit slice of the hash is used as the hash code directly,
+ *    the full hash is verified against 'heirs[height].hash' on match.
+ *  - slots are 16 bytes each (4 slots per cache line), removed slots are marked as tombstones.
+ *  - resizing is incremental: when the table is half full, a new table is allocated,
+ *    and the old slots are migrated in small steps on every subsequent insertion.
+ *    lookups check both tables during the migration.
+ *  - snapshots probe the tables without locking: the writer stores 'key' last when inserting,
+ *    and removed entries are kept until no snapshot can see the removed heir.
+ */
+struct blockchain_hash_index_slot
+{
+	uint64_t key;		// 0: empty
+	int64_t height;		// -1: tombstone
+};
+struct blockchain_hash_index
+{
+	ssize_t size;		// power of 2
+	ssize_t used;		// live slots + tombstones of the current table
+	ssize_t count;		// live entries of both tables
+	struct blockchain_hash_index_slot * slots;
 	
-	/**
-	 *  sice the precision of compact int is limited, 
-	 * when the cumulative difficulty exceeds a certain value (2^^72), 
-	 * it cannot be able to accumulate correctly.
-	 */
-	double cumulative_difficulty;
-	//~ compact_uint256_t cumulative_difficulty;
+	// incremental resizing
+	ssize_t old_size;
+	ssize_t migrate_pos;
+	struct blockchain_hash_index_slot * old_slots;
+};
+
+/**
+ * heirs storage:
+ *   the heirs are stored in fixed-size chunks, 'heirs' is the directory of the chunks.
+ *   published chunks are never modified in place (copy-on-write), 
+ *   so a snapshot can keep reading them while the writer is reorganizing the chain.
+ */
+#define BLOCKCHAIN_HEIRS_CHUNK_BITS	(10)
+#define BLOCKCHAIN_HEIRS_CHUNK_SIZE	(1 << BLOCKCHAIN_HEIRS_CHUNK_BITS)
+#define blockchain_heirs_at(heirs, height) \
+	(&(heirs)[(height) >> BLOCKCHAIN_HEIRS_CHUNK_BITS][(height) & (BLOCKCHAIN_HEIRS_CHUNK_SIZE - 1)])
+
+/**
+ * struct blockchain_view
+ * @details
+ *   an immutable version of the main chain, published by the writer after each add or reorg.
+ *   the hash index is shared with the writer, but only the entries within 'height' are valid for the view.
+ */
+typedef struct blockchain_view
+{
+	ssize_t height;
+	blockchain_heir_t * const * heirs;	// chunks directory
 	
-	struct satoshi_block_header hdr[1];
-}blockchain_heir_t;
+	const struct blockchain_hash_index_slot * slots;
+	ssize_t size;
+	const struct blockchain_hash_index_slot * old_slots;
+	ssize_t old_size;
+}blockchain_view_t;
 
+/**
+ * struct blockchain_retired_list
+ * @details
+ *   memory (or index entries) no longer used by the writer, 
+ *   but may still be referenced by the readers of a previous epoch.
+ */
+struct blockchain_retired_item
+{
+	void * ptr;		// free(ptr) when reclaiming, or NULL for an index tombstone
+	uint64_t key;
+	int64_t height;
+};
+struct blockchain_retired_list
+{
+	ssize_t max_size;
+	ssize_t count;
+	struct blockchain_retired_item * items;
+};
+
+/**
+ * contextual validation caches of the main chain
+ * 
+ * struct blockchain_mtp_window:
+ *   timestamps of the last 11 heirs (ending at 'height'), 
+ *   updated incrementally when a heir is appended to the tip, rebuilt after a reorg.
+ *   median-time-past = sorted[count / 2]
+ * 
+ * struct blockchain_retarget_cache:
+ *   the required bits of the first block of a difficulty epoch,
+ *   computed once per epoch (and per parent, competing branches may have different timestamps).
+ */
+#define BLOCKCHAIN_MTP_SPAN	(11)
+struct blockchain_mtp_window
+{
+	ssize_t height;		// the last heir in the window, -1: invalid
+	int count;
+	int oldest;			// ring position of the oldest timestamp
+	uint32_t ring[BLOCKCHAIN_MTP_SPAN];		// in chain order
+	uint32_t sorted[BLOCKCHAIN_MTP_SPAN];	// in ascending order
+};
+struct blockchain_retarget_cache
+{
+	ssize_t height;				// the first height of the epoch, -1: invalid
+	uint256_t parent_hash[1];	// the last block of the previous epoch
+	uint32_t bits;
+};
 
 /**
  * struct blockchain
  * @details:
  * 	heirs: currently the longest-chain with the largest cumulative difficulty.
  *  candidates_list:  chains that containing valid blocks but not the longest one.
+ * 
+ *  find(), get() and get_height() are writer-side functions: 
+ *    the caller must hold the lock or be called from the on_add_block / on_remove_block callbacks.
+ *  other threads should read from a snapshot (see blockchain_snapshot_acquire()), which never blocks.
  */ 
 typedef struct blockchain
 {
-	blockchain_heir_t * heirs;
-	ssize_t max_size;
+	blockchain_heir_t ** heirs;	// chunks of BLOCKCHAIN_HEIRS_CHUNK_SIZE heirs
+	ssize_t max_size;	// capacity of the chunks directory (in number of heirs)
 	ssize_t height;
+	uint256_t genesis_prev_hash[1];	// 'prev_hash' of the first heir (not necessarily zero if started from a checkpoint)
 	
 	pthread_mutex_t mutex;
-	void * search_root;
+	struct blockchain_hash_index hash_index[1];	// hashes of the heirs
 	void * user_data;
 	struct active_chain_list candidates_list[1];
 	
-	// public functions
+	// contextual validation (see blockchain_set_params())
+	const struct bitcoin_params * params;	// nullable: the difficulty transitions are not checked
+	struct blockchain_mtp_window mtp[1];
+	struct blockchain_retarget_cache retarget[1];
+	
+	/**
+	 * public functions (writer-side):
+	 *   find(), get() and get_height() read the live heirs and hash index without taking the lock,
+	 *   the caller must hold the lock (blockchain_lock()) or be called from the on_add_block / on_remove_block callbacks,
+	 *   and the returned heir is only valid until the lock is released.
+	 *   other threads use blockchain_snapshot_find(), blockchain_snapshot_get() and blockchain_snapshot_get_height().
+	 */
 	const blockchain_heir_t * (*find)(struct blockchain * chain, const uint256_t * hash);
 	ssize_t (* get_height)(struct blockchain * chain, const uint256_t * hash);
 	const blockchain_heir_t * (* get)(struct blockchain * chain, ssize_t height);
@@ -204,6 +411,17 @@ typedef struct blockchain
 		const uint256_t * block_hash, const int height, 
 		const struct satoshi_block_header * hdr,
 		void * user_data);
+	
+	// snapshots (epoch based reclamation), for internal use only
+	blockchain_view_t * view;	// the latest published view
+	uint64_t epoch;
+	int64_t readers[2];		// number of active readers of the even / odd epochs
+	ssize_t * sealed;		// per chunk: the highest height which has been published
+	ssize_t dirty_chunk;	// the first chunk modified since the last publish
+	int dir_shared;			// the chunks directory has been published
+	int limbo_parity;
+	struct blockchain_retired_list pending[1];	// retired in the current epoch
+	struct blockchain_retired_list limbo[1];	// waiting for the readers of the previous epoch
 }blockchain_t;
 
 blockchain_t * blockchain_init(blockchain_t * chain, 
@@ -213,8 +431,87 @@ blockchain_t * blockchain_init(blockchain_t * chain,
 void blockchain_cleanup(blockchain_t * chain);
 
 ssize_t blockchain_get_latest(blockchain_t * chain, uint256_t * hash, struct satoshi_block_header * hdr);
+int blockchain_get_header(blockchain_t * chain, ssize_t height, struct satoshi_block_header * hdr);	// writer-side, same as get()
 ssize_t blockchain_get_known_hashes(blockchain_t * chain, size_t max_hashes, uint256_t ** p_hashes);
 
+/**
+ * contextual header validation:
+ *   a header is checked against its ancestors when it is about to become a heir 
+ *   (by add(), blockchain_add_batch() or a reorg):
+ *   - timestamp > median-time-past of the previous 11 blocks;
+ *   - timestamp <= now + 2 hours (also checked before a header joins the orphan pool);
+ *   - bits == the required work (only if the consensus params have been set).
+ *   a branch is cut off at the first invalid header, and the heaviest valid branch is reselected.
+ * 
+ * blockchain_set_params(): 
+ *   only the proof-of-work fields (pow_*) are used, 'params' must outlive the chain.
+ * 
+ * blockchain_get_median_time_past(), blockchain_get_next_work_required():
+ *   writer-side functions, 'hdr' is the header which would extend the current tip.
+ */
+void blockchain_set_params(blockchain_t * chain, const struct bitcoin_params * params);
+int64_t blockchain_get_median_time_past(blockchain_t * chain, ssize_t height);
+uint32_t blockchain_get_next_work_required(blockchain_t * chain, const struct satoshi_block_header * hdr);
+
+/**
+ * blockchain_add_batch():
+ *   add a run of block headers (e.g. from a 'headers' message) in one call.
+ *   - hashes and proof-of-work are checked in parallel before taking the lock;
+ *   - the headers which extend the current tip are appended under a single lock, and published once;
+ *   - the others (forks or out-of-order headers) follow the same rules as add().
+ * @return the number of headers accepted before the first failure.
+ */
+ssize_t blockchain_add_batch(blockchain_t * chain, const struct satoshi_block_header * hdrs, ssize_t count);
+
+/**
+ * blockchain_find_fork_point():
+ *   return the height of the last block which is both on the main chain and the branch of 'hash', 
+ *   the height of 'hash' if it is on the main chain, or -1 if the branch is unknown (or not connected).
+ * 
+ * blockchain_locate():
+ *   find the fork-point of the first known hash in a block locator (e.g. from a 'getheaders' message).
+ * 
+ * (both take the lock, do not call them from the on_add_block / on_remove_block callbacks)
+ */
+ssize_t blockchain_find_fork_point(blockchain_t * chain, const uint256_t * hash);
+ssize_t blockchain_locate(blockchain_t * chain, const uint256_t * locator, ssize_t count);
+
+/**
+ * blockchain_add_from_peer(), blockchain_add_batch_from_peer():
+ *   same as add() and blockchain_add_batch(), 
+ *   the headers which can not be connected to the main chain are attributed to 'peer_id' in the orphan pool.
+ *   (see active_chain_list::max_bytes_per_peer)
+ */
+int blockchain_add_from_peer(blockchain_t * chain, const uint256_t * hash, const struct satoshi_block_header * hdr, int peer_id);
+ssize_t blockchain_add_batch_from_peer(blockchain_t * chain, const struct satoshi_block_header * hdrs, ssize_t count, int peer_id);
+
+/**
+ * blockchain_snapshot: lock-free readers
+ * 
+ *   blockchain_snapshot_t snapshot[1];
+ *   blockchain_snapshot_acquire(chain, snapshot);
+ *   const blockchain_heir_t * heir = blockchain_snapshot_get(snapshot, blockchain_snapshot_height(snapshot));
+ *   ...
+ *   blockchain_snapshot_release(snapshot);
+ * 
+ * the snapshot (and the heirs got from it) stays unchanged until released, 
+ * keep it short-lived, the writer can not reclaim the retired memory while it is held.
+ */
+typedef struct blockchain_snapshot
+{
+	blockchain_t * chain;
+	const blockchain_view_t * view;
+	uint64_t epoch;
+}blockchain_snapshot_t;
+blockchain_snapshot_t * blockchain_snapshot_acquire(blockchain_t * chain, blockchain_snapshot_t * snapshot);
+void blockchain_snapshot_release(blockchain_snapshot_t * snapshot);
+
+#define blockchain_snapshot_height(snapshot) ((snapshot)->view->height)
+const blockchain_heir_t * blockchain_snapshot_get(const blockchain_snapshot_t * snapshot, ssize_t height);
+const blockchain_heir_t * blockchain_snapshot_find(const blockchain_snapshot_t * snapshot, const uint256_t * hash);
+ssize_t blockchain_snapshot_get_height(const blockchain_snapshot_t * snapshot, const uint256_t * hash);
+int blockchain_snapshot_get_header(const blockchain_snapshot_t * snapshot, ssize_t height, struct satoshi_block_header * hdr);
+
 #define blockchain_lock(chain)   pthread_mutex_lock(&(chain)->mutex)
 #define blockchain_unlock(chain) pthread_mutex_unlock(&(chain)->mutex)
 
@@ -222,6 +519,17 @@ block_info_t * block_info_new(const uint256_t * hash, struct satoshi_block_heade
 int block_info_add_child(block_info_t * parent, block_info_t * child);
 void block_info_free(block_info_t * info);
 
+/**
+ * block_info_get_ancestor(): 
+ *   return the ancestor at 'height' on the same chain, 
+ *   or NULL if the height is unknown, or it is beyond the 'head' of the chain.
+ * 
+ * block_info_find_fork():
+ *   return the last common ancestor of two nodes on the same chain (may be the 'head'), or NULL.
+ */
+block_info_t * block_info_get_ancestor(block_info_t * node, int height);
+block_info_t * block_info_find_fork(block_info_t * a, block_info_t * b);
+
 
 
 /**
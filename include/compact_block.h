@@ -0,0 +1,102 @@
+#ifndef COMPACT_BLOCK_H_
+#define COMPACT_BLOCK_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "satoshi-types.h"
+#include "bitcoin-message.h"
+#include "mempool.h"
+
+/**
+ * compact_block: BIP152 compact block relay
+ *
+ * @details
+ *  - short ids: SipHash-2-4 of the txid (version 1) or the wtxid (version 2), truncated to 6 bytes,
+ *    keyed by the single SHA256 of the block header and the nonce.
+ *  - sender: compact_block_from_block() (the coinbase is prefilled),
+ *            compact_block_get_txns() answers a getblocktxn.
+ *  - receiver: partial_block_init() reconstructs the block from the prefilled txs and the mempool,
+ *    the missing txs are requested with getblocktxn (partial_block_get_missing()),
+ *    and filled with the blocktxn (partial_block_fill()).
+ *    partial_block_build() verifies the merkle root and serializes the block,
+ *    on failure (short id collisions) the full block should be requested instead.
+ */
+
+#define COMPACT_BLOCK_VERSION_TXID	(1)
+#define COMPACT_BLOCK_VERSION_WTXID	(2)
+#define COMPACT_BLOCK_SHORTID_MASK	(0xffffffffffffULL)
+#define COMPACT_BLOCK_MAX_DEPTH	(5)	// deeper blocks are requested / relayed in full
+
+uint64_t siphash24(uint64_t k0, uint64_t k1, const void * data, size_t length);
+uint64_t siphash24_uint256(uint64_t k0, uint64_t k1, const uint256_t * hash);
+
+void compact_block_get_keys(const struct satoshi_block_header * hdr, uint64_t nonce, uint64_t keys[static 2]);
+static inline uint64_t compact_block_shortid(const uint64_t keys[static 2], const uint256_t * hash)
+{
+	return siphash24_uint256(keys[0], keys[1], hash) & COMPACT_BLOCK_SHORTID_MASK;
+}
+
+/**
+ * compact_block_from_block(): build a cmpctblock message, call bitcoin_message_cmpctblock_cleanup() to release it.
+ */
+int compact_block_from_block(struct bitcoin_message_cmpctblock * cmpct, const satoshi_block_t * block, uint64_t nonce, int version);
+
+/**
+ * compact_block_get_txns(): build the blocktxn reply of a getblocktxn request
+ * @return 0 on success, -1 if the request is not for the block or an index is out of range
+ */
+int compact_block_get_txns(const satoshi_block_t * block, const struct bitcoin_message_getblocktxn * request, struct bitcoin_message_blocktxn * reply);
+
+
+struct partial_block_tx
+{
+	uint256_t txid;
+	ssize_t length;		// 0: missing
+	unsigned char * data;	// serialized tx
+};
+
+typedef struct partial_block
+{
+	struct satoshi_block_header hdr;
+	uint256_t hash;
+	int version;
+
+	ssize_t txn_count;
+	struct partial_block_tx * txns;
+	ssize_t missing_count;
+
+	ssize_t prefilled_count;
+	ssize_t mempool_count;	// txs found in the mempool
+}partial_block_t;
+
+/**
+ * partial_block_init():
+ * @return 0 on success, -1 if the cmpctblock is invalid,
+ *   1 if its short ids collide (the full block should be requested)
+ */
+int partial_block_init(partial_block_t * pblock, const struct bitcoin_message_cmpctblock * cmpct, int version, mempool_t * pool);
+void partial_block_cleanup(partial_block_t * pblock);
+
+/**
+ * partial_block_get_missing(): the indexes of the missing txs (for getblocktxn), call free() to release them.
+ * @return the number of missing txs
+ */
+ssize_t partial_block_get_missing(const partial_block_t * pblock, ssize_t ** p_indexes);
+int partial_block_fill(partial_block_t * pblock, const struct bitcoin_message_blocktxn * blocktxn);
+
+/**
+ * partial_block_build(): serialize the reconstructed block, call free() to release it.
+ * @return the length of the block, -1 if there are missing txs or the merkle root does not match
+ */
+ssize_t partial_block_build(partial_block_t * pblock, unsigned char ** p_data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -2,6 +2,7 @@
 #define _DB_ENGINE_H_
 
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <limits.h>
 
@@ -14,6 +15,49 @@ extern "C" {
 #endif
 struct db_handle;
 struct db_engine;
+struct json_object;
+
+/**
+ * storage statistics
+ * 
+ * @details
+ *  per-operation counters and latency histograms.
+ *  histogram[i] counts the operations which took [2^(i-1), 2^i) microseconds, 
+ *  histogram[0] is for (< 1 us), the last bucket also counts all slower operations.
+ */
+#define DB_STATS_HISTOGRAM_SIZE	(24)
+struct db_stats_op
+{
+	uint64_t count;
+	uint64_t errors;
+	uint64_t total_usec;
+	uint64_t max_usec;
+	uint64_t histogram[DB_STATS_HISTOGRAM_SIZE];
+};
+
+enum db_stats_op_type
+{
+	db_stats_op_find,
+	db_stats_op_find_secondary,
+	db_stats_op_insert,
+	db_stats_op_update,
+	db_stats_op_del,
+	db_stats_op_cursor,
+	db_stats_op_types_count
+};
+
+typedef struct db_handle_stats
+{
+	struct db_stats_op ops[db_stats_op_types_count];
+}db_handle_stats_t;
+const char * db_stats_op_type_to_string(enum db_stats_op_type type);
+
+// helpers for backends
+int64_t db_stats_clock_usec(void);
+void db_stats_op_record(struct db_stats_op * op, int64_t begin_usec, int is_error);
+void db_stats_op_copy(struct db_stats_op * dst, struct db_stats_op * src);
+struct json_object * db_stats_op_to_json(const struct db_stats_op * op);
+
 typedef struct db_engine_txn
 {
 	void * priv;
@@ -66,6 +110,7 @@ enum db_format_type
 	db_format_type_hash = 1
 };
 
+struct db_cursor;
 typedef struct db_handle
 {
 	void * priv;
@@ -104,11 +149,50 @@ typedef struct db_handle
 	int (* insert)(struct db_handle * db, db_engine_txn_t * txn, const db_record_data_t * key, const db_record_data_t * value);
 	int (* update)(struct db_handle * db, db_engine_txn_t * txn, const db_record_data_t * key, const db_record_data_t * value);
 	int (* del)(struct db_handle * db, db_engine_txn_t * txn, const db_record_data_t * key);
-
+	
+	// statistics
+	int (* get_stats)(struct db_handle * db, db_handle_stats_t * stats);
+	void (* reset_stats)(struct db_handle * db);
+	
+	// backend specific cursor constructor, called by db_cursor_init()
+	int (* cursor_open)(struct db_handle * db, db_engine_txn_t * txn, struct db_cursor * cursor, int flags);
 }db_handle_t;
 db_handle_t * db_handle_init(db_handle_t * db, struct db_engine * engine, void * user_data);
 void db_handle_cleanup(db_handle_t * db);
 
+/**
+ * bulk scan options
+ * 
+ * @details
+ *  - [lower, upper): key range, lower is inclusive, upper is exclusive. (nullable)
+ *  - prefix: only the keys start with the prefix will be returned.
+ *  - filter(): return non-zero to accept the record.
+ *  In btree databases, the scan starts at max(lower, prefix) and stops at the end of the range,
+ *  in hash databases, all records will be checked.
+ *  The bounds and the prefix are referenced (not copied), MUST be kept valid until scan_end().
+ */
+#define DB_SCAN_DEFAULT_BUFFER_SIZE		(1024 * 1024)
+typedef int (* db_scan_filter_callback)(const db_record_data_t * key, const db_record_data_t * value, void * user_data);
+typedef struct db_scan_options
+{
+	const db_record_data_t * lower;
+	const db_record_data_t * upper;
+	const void * prefix;
+	ssize_t prefix_size;
+	
+	db_scan_filter_callback filter;
+	void * user_data;
+	
+	ssize_t buffer_size;	// bytes per page (BDB), <= 0: use default
+}db_scan_options_t;
+
+/**
+ * db_scan_check_record():
+ * @return 1: accept; 0: skip; -1: out of range (stop the scan)
+ */
+int db_scan_check_record(const db_scan_options_t * options, int is_sorted,
+	const db_record_data_t * key, const db_record_data_t * value);
+
 typedef struct db_cursor
 {
 	void * priv;
@@ -129,6 +213,21 @@ typedef struct db_cursor
 	int (* move_to)(struct db_cursor * cursor, const db_record_data_t * key);
 	int (* set)(struct db_cursor * cursor);
 	int (* del)(struct db_cursor * cursor);
+	
+	void (* close)(struct db_cursor * cursor);	// called by db_cursor_cleanup()
+	
+	/**
+	 * bulk scan
+	 *  scan_begin(): start a forward scan, records are fetched in pages into a reusable buffer.
+	 *  scan_next():  set (key, value) to pointer views of the next record, no malloc and no copy,
+	 *                the views are only valid until the next call of scan_next() or scan_end().
+	 *                (on a secondary database, the values are the primary keys)
+	 *    @return 0 on success, DB_NOTFOUND at the end of the scan.
+	 */
+	void * scan_ctx;
+	int (* scan_begin)(struct db_cursor * cursor, const db_scan_options_t * options);
+	int (* scan_next)(struct db_cursor * cursor, db_record_data_t * key, db_record_data_t * value);
+	void (* scan_end)(struct db_cursor * cursor);
 }db_cursor_t;
 db_cursor_t * db_cursor_init(db_cursor_t * cursor, db_handle_t * db, db_engine_txn_t * txn, int flags);
 void db_cursor_cleanup(db_cursor_t * cursor);
@@ -153,11 +252,37 @@ typedef struct db_engine
 	
 	db_engine_txn_t * (* txn_new)(struct db_engine * engine, struct db_engine_txn * parent_txn);
 	void (* txn_free)(struct db_engine * engine, db_engine_txn_t * txn);
+	
+	/**
+	 * get_stats(): 
+	 *   export the statistics of the engine (mpool / log / checkpoint / txn) 
+	 *   and all opened databases.
+	 * @return a new json_object, the caller should call json_object_put() to free it.
+	 */
+	struct json_object * (* get_stats)(struct db_engine * engine);
 }db_engine_t;
 db_engine_t * db_engine_init(const char * home_dir, void * user_data);
 void db_engine_cleanup(db_engine_t * engine);
 db_engine_t * db_engine_get();
 
+/**
+ * in-memory backend
+ * 
+ * @details
+ *  A pure in-process implementation of the same interfaces (src/db_engine_mem.c), 
+ *  no disk I/O and no Berkeley DB environment.
+ *  - btree databases are kept in sorted pages, hash databases in a hash table.
+ *  - secondary databases (associate) are supported.
+ *  - transactions are snapshot-isolated (MVCC), 
+ *    a write-write conflict fails the operation with DB_ENGINE_ERR_CONFLICT.
+ *  - databases are not persistent, 'db_filename' is only used as a label.
+ */
+#define DB_ENGINE_ERR_NOTFOUND		(-30988)	// same as DB_NOTFOUND in db.h
+#define DB_ENGINE_ERR_KEYEXIST		(-30995)	// same as DB_KEYEXIST in db.h
+#define DB_ENGINE_ERR_CONFLICT		(-30993)	// same as DB_LOCK_DEADLOCK in db.h
+db_engine_t * db_engine_memory_new(void * user_data);
+void db_engine_memory_free(db_engine_t * engine);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,146 @@
+#ifndef MEMPOOL_H_
+#define MEMPOOL_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "satoshi-types.h"
+
+/**
+ * mempool: validated (unconfirmed) transactions
+ *
+ * @details
+ *  - entries are stored in a slab (an array indexed by entry id), each tx is kept serialized
+ *    in one allocation together with its spent outpoints and in-pool parents.
+ *  - open-addressing hash indexes: txid, wtxid, and spent outpoint --> (entry, txin)
+ *  - package graph: parents / children links, ancestor and descendant aggregates
+ *    (count, vsize, fees) are maintained incrementally.
+ *  - eviction index: binary min-heap by descendant score (max of the tx's and its package's fee rate),
+ *    the cheapest package is evicted first when the memory usage exceeds 'max_memory',
+ *    the rolling minimum fee rate is raised accordingly (and decays with a half-life of 12 hours).
+ *  - block template selection: by ancestor fee rate, packages are added in topological order.
+ *  - conflicts (double spends of an in-pool outpoint) are refused, there is no replace-by-fee.
+ *  - thread-safe.
+ *
+ * fee rates are in satoshis per 1000 virtual bytes.
+ */
+
+#define MEMPOOL_DEFAULT_MAX_MEMORY	(300 * 1024 * 1024)
+#define MEMPOOL_DEFAULT_MIN_RELAY_FEE_RATE	(1000)	// sat/kvB
+#define MEMPOOL_DEFAULT_INCREMENTAL_FEE_RATE	(1000)	// sat/kvB
+#define MEMPOOL_MAX_ANCESTORS	(25)	// including the tx itself
+#define MEMPOOL_MAX_DESCENDANTS	(25)
+#define MEMPOOL_MAX_PACKAGE_VSIZE	(101000)
+
+enum mempool_status
+{
+	mempool_status_ok = 0,
+	mempool_status_invalid = 1,
+	mempool_status_duplicate,		// already in the pool
+	mempool_status_conflict,		// spends an outpoint which has been spent by an in-pool tx
+	mempool_status_too_long_chain,	// ancestors / descendants limits
+	mempool_status_fee_too_low,		// below min_relay_fee_rate or the rolling minimum fee rate
+	mempool_status_full,			// evicted right after being added
+};
+const char * mempool_status_to_string(enum mempool_status status);
+
+struct mempool_entry_info
+{
+	uint256_t txid;
+	uint256_t wtxid;
+	int64_t fee;
+	int64_t vsize;
+	int64_t size;		// serialized size (with witness)
+	int64_t time;		// when added (seconds since the epoch)
+
+	// including the tx itself
+	int64_t ancestor_count;
+	int64_t ancestor_vsize;
+	int64_t ancestor_fees;
+	int64_t descendant_count;
+	int64_t descendant_vsize;
+	int64_t descendant_fees;
+};
+
+struct mempool_stats
+{
+	int64_t count;
+	int64_t total_vsize;
+	int64_t total_fees;
+	int64_t memory_usage;	// bytes
+	int64_t min_fee_rate;	// current rolling minimum (sat/kvB), 0 if the pool has never been full
+	int64_t evicted;		// txs evicted since created
+};
+
+typedef struct mempool
+{
+	void * priv;
+	void * user_data;
+	pthread_mutex_t mutex;
+
+	int64_t max_memory;
+	int64_t min_relay_fee_rate;
+	int64_t incremental_fee_rate;
+
+	// optional callback (called with the lock held, must not call mempool functions)
+	void (* on_tx_removed)(struct mempool * pool, const uint256_t * txid, int evicted);
+}mempool_t;
+
+mempool_t * mempool_new(int64_t max_memory, void * user_data);
+void mempool_free(mempool_t * pool);
+
+/**
+ * mempool_add(): add a validated tx, 'fee' is the sum of inputs minus the sum of outputs.
+ *   the inputs which spend in-pool txs are linked to their parents.
+ */
+enum mempool_status mempool_add(mempool_t * pool, const satoshi_tx_t * tx, int64_t fee);
+
+int mempool_contains(mempool_t * pool, const uint256_t * hash, int is_wtxid);
+int mempool_get_entry_info(mempool_t * pool, const uint256_t * txid, struct mempool_entry_info * info);
+
+/**
+ * mempool_get_tx(): serialized tx (a copy), call free() to release it.
+ * @return the length of the tx, or -1 if not found
+ */
+ssize_t mempool_get_tx(mempool_t * pool, const uint256_t * hash, int is_wtxid, unsigned char ** p_data);
+
+/**
+ * mempool_get_spender(): the in-pool tx which spends the outpoint
+ * @return 1 if found, 0 otherwise
+ */
+int mempool_get_spender(mempool_t * pool, const satoshi_outpoint_t * outpoint, uint256_t * txid);
+
+/**
+ * mempool_get_hashes(): a snapshot of the txids and wtxids of the pool (e.g. to match the short ids of a compact block),
+ *   either output can be NULL, call free() to release them.
+ * @return the number of txs
+ */
+ssize_t mempool_get_hashes(mempool_t * pool, uint256_t ** p_txids, uint256_t ** p_wtxids);
+
+ssize_t mempool_remove(mempool_t * pool, const uint256_t * txid);	// with its descendants, returns the number of txs removed
+
+/**
+ * mempool_remove_for_block(): remove the txs included in a new block (their descendants stay in the pool),
+ *   and the conflicting txs (with their descendants).
+ * @return the number of txs removed
+ */
+ssize_t mempool_remove_for_block(mempool_t * pool, const satoshi_tx_t * txs, ssize_t count);
+
+/**
+ * mempool_select_txs(): select txs for a block template, by ancestor fee rate
+ * @return the number of txids (in a valid order) filled in *p_txids, call free() to release it.
+ */
+ssize_t mempool_select_txs(mempool_t * pool, int64_t max_vsize, uint256_t ** p_txids, int64_t * p_total_fees);
+
+void mempool_get_stats(mempool_t * pool, struct mempool_stats * stats);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,109 @@
+#ifndef MESSAGE_PIPELINE_H_
+#define MESSAGE_PIPELINE_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "bitcoin-message.h"
+
+/**
+ * message_pipeline: moves message decoding and validation off the network threads
+ *
+ * @details
+ *   network thread(s) --[mpsc]--> parse stage --[spsc]--> validation stage
+ *
+ *  - network threads: frame and checksum the messages, message_pipeline_submit() copies them to the pipeline.
+ *  - parse stage (1 thread): decodes the messages (bitcoin_message_parse_in_place()).
+ *  - validation stage (1 thread): applies the messages in order, all callbacks are called in this thread,
+ *      so the chain / db states need no locks.
+ *  - backpressure: a source (peer) is refused (EAGAIN) when its pending bytes exceed max_pending_bytes
+ *      or the queue is full, the network thread should stop reading from it until on_source_drained().
+ *      slow validation only stalls the sources which have sent too much.
+ */
+
+#define MESSAGE_PIPELINE_DEFAULT_QUEUE_SIZE	(4096)
+#define MESSAGE_PIPELINE_DEFAULT_MAX_PENDING_BYTES	(8 * 1024 * 1024)	// per source
+
+typedef struct message_pipeline_source
+{
+	void * user_data;	// the peer
+	int refs;
+	int closed;		// the pending messages of a closed source are dropped
+	int error;		// the first error reported by the pipeline (parse or validation)
+	int blocked;	// the latest message was refused, on_source_drained() will be called
+
+	int64_t pending_bytes;	// submitted but not yet validated
+	int64_t pending_count;
+	int64_t max_pending_bytes;
+}message_pipeline_source_t;
+
+enum message_pipeline_stage
+{
+	message_pipeline_stage_parse = 0,
+	message_pipeline_stage_validate = 1,
+	message_pipeline_stages_count
+};
+
+struct message_pipeline_stage_stats
+{
+	int64_t queue_depth;	// sampled when a message was taken from the stage's queue
+	int64_t max_queue_depth;
+	int64_t processed;
+	int64_t dropped;		// messages of closed sources, or failed ones
+	int64_t total_wait_ns;	// time spent in the stage's queue
+	int64_t max_wait_ns;
+	int64_t total_busy_ns;	// time spent in the stage's handler
+	int64_t max_busy_ns;
+};
+
+typedef struct message_pipeline
+{
+	void * priv;
+	void * user_data;
+
+	size_t queue_size;
+	int64_t default_max_pending_bytes;
+
+	/*
+	 * callbacks, called in the validation thread.
+	 *   on_message(): returns non-zero to report an error on the source (on_source_error() will be called)
+	 */
+	int (* on_message)(struct message_pipeline * pipeline, message_pipeline_source_t * source, const bitcoin_message_t * msg);
+	void (* on_source_error)(struct message_pipeline * pipeline, message_pipeline_source_t * source, int error);
+	void (* on_source_drained)(struct message_pipeline * pipeline, message_pipeline_source_t * source);
+
+	struct message_pipeline_stage_stats stats[message_pipeline_stages_count];
+}message_pipeline_t;
+
+message_pipeline_t * message_pipeline_new(size_t queue_size, void * user_data);
+void message_pipeline_free(message_pipeline_t * pipeline);
+int message_pipeline_start(message_pipeline_t * pipeline);
+void message_pipeline_stop(message_pipeline_t * pipeline);	// pending messages are dropped
+
+message_pipeline_source_t * message_pipeline_source_new(message_pipeline_t * pipeline, void * user_data);
+void message_pipeline_source_close(message_pipeline_source_t * source);	// stop delivering its messages
+message_pipeline_source_t * message_pipeline_source_addref(message_pipeline_source_t * source);
+void message_pipeline_source_unref(message_pipeline_source_t * source);
+
+/**
+ * message_pipeline_submit(): copy a framed message to the pipeline, called in the network thread.
+ * @return 0 on success, -1 on error:
+ *   errno == EAGAIN: backpressure, retry after on_source_drained()
+ *   errno == EBADMSG: invalid checksum (if verify_checksum)
+ *   errno == EPIPE: the source has been closed or has failed
+ */
+int message_pipeline_submit(message_pipeline_t * pipeline, message_pipeline_source_t * source,
+	const struct bitcoin_message_header * msg_hdr, int verify_checksum);
+
+void message_pipeline_get_stats(message_pipeline_t * pipeline, enum message_pipeline_stage stage, struct message_pipeline_stage_stats * stats);
+void message_pipeline_dump_stats(message_pipeline_t * pipeline, FILE * fp);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -19,6 +19,15 @@ extern "C" {
 #include "avl_tree.h"
 
 #include "bitcoin-message.h"
+#include "message-pipeline.h"
+#include "rolling_bloom_filter.h"
+#include "bloom_filter.h"
+
+#define SPV_NODE_MAX_INV_SIZE	(50000)	// max number of entries of an inv / getdata message
+#define SPV_NODE_INV_TRICKLE_INTERVAL	(2.0)	// seconds, average delay of tx announcements (poisson)
+#define SPV_NODE_INV_BROADCAST_MAX	(1000)	// max number of tx announcements per trickle
+#define SPV_NODE_CMPCT_VERSION	(2)	// BIP152 compact blocks (short ids of wtxids)
+#define SPV_NODE_CMPCT_MIN_PROTOCOL_VERSION	(70014)
 
 typedef struct spv_node_context spv_node_context_t;
 typedef int (* spv_node_message_callback_fn)(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
@@ -38,8 +47,9 @@ struct spv_node_context
 	uint32_t magic;
 	blockchain_t chain[1];
 	
-	struct pollfd pfd[1];
+	struct pollfd pfd[2];	// [0]: the peer, [1]: wakeup_fd
 	int fd;
+	int wakeup_fd;	// eventfd, wakes the network thread when there's data to send or the pipeline was drained
 	
 	pthread_mutex_t in_mutex;
 	auto_buffer_t in_buf[1];
@@ -47,12 +57,43 @@ struct spv_node_context
 	pthread_mutex_t out_mutex;
 	auto_buffer_t out_buf[1];
 	
+	// received messages are parsed and handled by the pipeline threads (msg_callbacks are called in the validation thread)
+	message_pipeline_t * pipeline;
+	message_pipeline_source_t * source;	// the current connection
+	int read_paused;	// backpressure, resumed by pipeline->on_source_drained()
+	
+	// known inventories (hashes), locked by inv_mutex
+	pthread_mutex_t inv_mutex;
+	rolling_bloom_filter_t peer_known_invs[1];	// announced by the peer or sent to it, reset on reconnection
+	rolling_bloom_filter_t requested_invs[1];	// getdata sent
+	rolling_bloom_filter_t recent_invs[1];		// recently received (accepted) txs and blocks
+	rolling_bloom_filter_t recent_rejects[1];	// recently rejected txs and blocks
+	
+	// announcements to the peer: blocks are sent at the next wakeup, txs are batched and trickled
+	struct bitcoin_inventory * pending_invs;
+	ssize_t pending_invs_count;
+	ssize_t max_pending_invs;
+	double next_trickle_time;
+	
 	int argc;
 	char ** argv;
 	json_object * jconfig;
 	int max_retries;
 	
 	int send_headers_flag;
+	
+	// BIP152: compact blocks
+	int cmpct_high_bandwidth;		// ask the peer to announce new blocks with cmpctblock (config: "compact_blocks_high_bandwidth")
+	uint64_t peer_cmpct_version;	// 0: the peer does not support compact blocks (no sendcmpct with a known version)
+	int peer_cmpct_announce;		// the peer asked us to announce new blocks with cmpctblock
+	
+	// BIP37: bloom filters of the peer (used by the validation thread only, reset by the peer's version message)
+	int bloom_filters;			// serve filtered blocks and txs, advertised as NODE_BLOOM (config: "peer_bloom_filters")
+	int peer_relay_txs;			// the peer wants tx announcements (the relay flag of its version, or a filter has been loaded)
+	bloom_filter_t * peer_filter;	// NULL: no filter loaded
+	
+	// BIP157: compact block filters (the filter index is kept by the app)
+	int compact_filters;		// serve cfilter, cfheaders and cfcheckpt, advertised as NODE_COMPACT_FILTERS (config: "peer_compact_filters")
 	avl_tree_t addrs_list[1];
 	
 	spv_node_message_callback_fn msg_callbacks[bitcoin_message_types_count]; // callbacks for parsed in_msgs
@@ -72,6 +113,25 @@ int spv_node_run(spv_node_context_t * spv, int async_mode);
 
 int spv_node_parse_args(spv_node_context_t * spv, int argc, char ** argv);
 
+/*
+ * spv_node_send_data(): queue serialized message(s), thread-safe
+ */
+int spv_node_send_data(spv_node_context_t * spv, const void * data, size_t length);
+
+/*
+ * known inventories, thread-safe
+ *
+ * spv_node_filter_invs(): called with the invs announced by the peer, they are marked as known by the peer.
+ *   copies the unknown ones to 'unknown_invs' (which can be 'invs'), and returns their count.
+ *   (the unknown txs are marked as requested, the caller should send getdata for them)
+ * spv_node_mark_inv_received(): a tx or block has been received and validated (or rejected).
+ * spv_node_announce_inv(): queue an announcement, unless the peer already knows it.
+ */
+ssize_t spv_node_filter_invs(spv_node_context_t * spv, const struct bitcoin_inventory * invs, ssize_t count, struct bitcoin_inventory * unknown_invs);
+void spv_node_mark_inv_received(spv_node_context_t * spv, const uint256_t * hash, int rejected);
+void spv_node_mark_inv_known_by_peer(spv_node_context_t * spv, const uint256_t * hash);
+int spv_node_announce_inv(spv_node_context_t * spv, const struct bitcoin_inventory * inv);
+
 #ifdef __cplusplus
 }
 #endif
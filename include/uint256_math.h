@@ -0,0 +1,67 @@
+#ifndef _UINT256_MATH_H_
+#define _UINT256_MATH_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "satoshi-types.h"
+
+/**
+ * uint256_u64: fixed-width 256-bit unsigned integer on 4 x uint64 limbs
+ *
+ * @details
+ *  allocation-free arithmetic for targets and chainwork (used on every header).
+ *  - limbs[0] is the least significant, the same memory layout as uint256_t on little-endian hosts;
+ *  - all operations are modulo 2^256, add/sub/mul/shl report the carry (or overflow);
+ *  - compact encoding follows the 'nBits' rules (sign bit, overflow) of the reference client.
+ */
+typedef struct uint256_u64
+{
+	uint64_t limbs[4];
+}uint256_u64_t;
+
+#define uint256_u64_zero	((uint256_u64_t){{0, 0, 0, 0}})
+
+void uint256_u64_from_uint256(uint256_u64_t * r, const uint256_t * u);
+void uint256_u64_to_uint256(uint256_t * u, const uint256_u64_t * a);
+void uint256_u64_set_u64(uint256_u64_t * r, uint64_t value);
+
+int uint256_u64_is_zero(const uint256_u64_t * a);
+int uint256_u64_compare(const uint256_u64_t * a, const uint256_u64_t * b);
+int uint256_u64_bits(const uint256_u64_t * a);	// number of significant bits (0 if a == 0)
+
+int uint256_u64_add(uint256_u64_t * r, const uint256_u64_t * a, const uint256_u64_t * b);	// return carry
+int uint256_u64_sub(uint256_u64_t * r, const uint256_u64_t * a, const uint256_u64_t * b);	// return borrow
+int uint256_u64_mul(uint256_u64_t * r, const uint256_u64_t * a, const uint256_u64_t * b);	// return 1 if overflowed
+void uint256_u64_not(uint256_u64_t * r, const uint256_u64_t * a);
+void uint256_u64_shl(uint256_u64_t * r, const uint256_u64_t * a, unsigned int bits);
+void uint256_u64_shr(uint256_u64_t * r, const uint256_u64_t * a, unsigned int bits);
+
+/**
+ * uint256_u64_divmod(): q = n / d, r = n % d  (q, r are nullable, and may alias n or d)
+ * @return -1 if d == 0
+ */
+int uint256_u64_divmod(uint256_u64_t * q, uint256_u64_t * r, const uint256_u64_t * n, const uint256_u64_t * d);
+
+/**
+ * compact ('nBits') encoding
+ *   uint256_u64_set_compact(): p_negative and p_overflow are nullable
+ */
+void uint256_u64_set_compact(uint256_u64_t * r, uint32_t bits, int * p_negative, int * p_overflow);
+uint32_t uint256_u64_get_compact(const uint256_u64_t * a);
+
+/**
+ * uint256_u64_work_from_compact():
+ *   the expected number of hashes to find a block with the target: 2^256 / (target + 1)
+ *   (0 if the target is invalid)
+ */
+void uint256_u64_work_from_compact(uint256_u64_t * work, uint32_t bits);
+double uint256_u64_to_double(const uint256_u64_t * a);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
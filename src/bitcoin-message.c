@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <endian.h>
+#include <pthread.h>
 
 #include "bitcoin-message.h"
 #include "utils.h"
@@ -51,7 +52,7 @@ static const char * s_sz_message_types[bitcoin_message_types_count] =
 	[bitcoin_message_type_addr] = "addr",
 	[bitcoin_message_type_inv] = "inv",
 	[bitcoin_message_type_getdata] = "getdata",
-	[bitcoin_message_type_notfound] = "notefound",
+	[bitcoin_message_type_notfound] = "notfound",
 	[bitcoin_message_type_getblocks] = "getblocks",
 	[bitcoin_message_type_getheaders] = "getheaders",
 	[bitcoin_message_type_tx] = "tx",
@@ -68,7 +69,7 @@ static const char * s_sz_message_types[bitcoin_message_types_count] =
 	[bitcoin_message_type_filterload] = "filterload",
 	[bitcoin_message_type_filteradd] = "filteradd",
 	[bitcoin_message_type_filterclear] = "filterclear",
-	[bitcoin_message_type_merkleblock] = "merkle_block",
+	[bitcoin_message_type_merkleblock] = "merkleblock",
 	[bitcoin_message_type_alert] = "alert",
 	[bitcoin_message_type_sendheaders] = "sendheaders",
 	[bitcoin_message_type_feefilter] = "feefilter",
@@ -76,20 +77,91 @@ static const char * s_sz_message_types[bitcoin_message_types_count] =
 	[bitcoin_message_type_cmpctblock] = "cmpctblock",
 	[bitcoin_message_type_getblocktxn] = "getblocktxn",
 	[bitcoin_message_type_blocktxn] = "blocktxn",
+	[bitcoin_message_type_getcfilters] = "getcfilters",
+	[bitcoin_message_type_cfilter] = "cfilter",
+	[bitcoin_message_type_getcfheaders] = "getcfheaders",
+	[bitcoin_message_type_cfheaders] = "cfheaders",
+	[bitcoin_message_type_getcfcheckpt] = "getcfcheckpt",
+	[bitcoin_message_type_cfcheckpt] = "cfcheckpt",
 	//
 };
 const char * bitcoin_message_type_to_string(enum bitcoin_message_type msg_type)
 {
-	if(msg_type < 0 || msg_type > bitcoin_message_types_count) return NULL;
+	if(msg_type < 0 || msg_type >= bitcoin_message_types_count) return NULL;
 	return s_sz_message_types[msg_type];
 }
-enum bitcoin_message_type bitcoin_message_type_from_string(const char * command)
+
+/*
+ * command ==> type in constant time:
+ *   the NUL-padded 12-byte command is loaded as two packed words (8 + 4 bytes),
+ *   hashed into a 64-slot table (collision-free for the known commands, linear probing otherwise),
+ *   and confirmed by comparing the words.
+ */
+#define COMMAND_TABLE_BITS	(6)
+#define COMMAND_TABLE_SIZE	(1 << COMMAND_TABLE_BITS)
+struct command_slot
+{
+	uint64_t lo;
+	uint32_t hi;
+	enum bitcoin_message_type type;	// bitcoin_message_type_unknown: empty slot
+};
+static struct command_slot s_command_table[COMMAND_TABLE_SIZE];
+static pthread_once_t s_command_table_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t command_hash(uint64_t lo, uint32_t hi)
+{
+	uint64_t h = (lo ^ ((uint64_t)hi << 7) ^ ((uint64_t)hi << 39)) * UINT64_C(0x3FE186EFC4AEA9E7);	// searched to be collision-free for the commands above
+	return (uint32_t)(h >> (64 - COMMAND_TABLE_BITS));
+}
+
+static void command_table_init(void)
 {
-	for(int i = 1; i < bitcoin_message_types_count; ++i) {
-		if(strncmp(command, s_sz_message_types[i], 12) == 0) return i;
+	for(int type = 1; type < bitcoin_message_types_count; ++type) {
+		char command[12] = { 0 };
+		size_t cb = strlen(s_sz_message_types[type]);
+		assert(cb <= sizeof(command));
+		memcpy(command, s_sz_message_types[type], cb);
+
+		uint64_t lo = 0;
+		uint32_t hi = 0;
+		memcpy(&lo, command, 8);
+		memcpy(&hi, command + 8, 4);
+
+		uint32_t index = command_hash(lo, hi);
+		while(s_command_table[index].type != bitcoin_message_type_unknown) index = (index + 1) & (COMMAND_TABLE_SIZE - 1);
+		s_command_table[index] = (struct command_slot){ .lo = lo, .hi = hi, .type = type };
+	}
+}
+
+enum bitcoin_message_type bitcoin_message_type_from_command(const char command[static 12])
+{
+	pthread_once(&s_command_table_once, command_table_init);
+
+	uint64_t lo = 0;
+	uint32_t hi = 0;
+	memcpy(&lo, command, 8);
+	memcpy(&hi, command + 8, 4);
+
+	for(uint32_t index = command_hash(lo, hi);
+		s_command_table[index].type != bitcoin_message_type_unknown;
+		index = (index + 1) & (COMMAND_TABLE_SIZE - 1))
+	{
+		const struct command_slot * slot = &s_command_table[index];
+		if(slot->lo == lo && slot->hi == hi) return slot->type;
 	}
 	return bitcoin_message_type_unknown;
 }
+#undef COMMAND_TABLE_BITS
+#undef COMMAND_TABLE_SIZE
+
+enum bitcoin_message_type bitcoin_message_type_from_string(const char * command)
+{
+	char padded[12] = { 0 };
+	size_t cb = strnlen(command, sizeof(padded) + 1);
+	if(cb > sizeof(padded)) return bitcoin_message_type_unknown;
+	memcpy(padded, command, cb);
+	return bitcoin_message_type_from_command(padded);
+}
 
 cleanup_message_fn s_cleanup_message_func[bitcoin_message_types_count] = {
 	[bitcoin_message_type_unknown] =     (cleanup_message_fn)NULL,
@@ -112,17 +184,23 @@ cleanup_message_fn s_cleanup_message_func[bitcoin_message_types_count] = {
 	[bitcoin_message_type_ping] =        NULL,
 	[bitcoin_message_type_pong] =        NULL,
 	[bitcoin_message_type_reject] =      NULL,
-	[bitcoin_message_type_filterload] =  NULL,
-	[bitcoin_message_type_filteradd] =   NULL,
+	[bitcoin_message_type_filterload] =  (cleanup_message_fn)bitcoin_message_filterload_cleanup,
+	[bitcoin_message_type_filteradd] =   (cleanup_message_fn)bitcoin_message_filteradd_cleanup,
 	[bitcoin_message_type_filterclear] = NULL,
-	[bitcoin_message_type_merkleblock] = NULL,
+	[bitcoin_message_type_merkleblock] = (cleanup_message_fn)bitcoin_message_merkleblock_cleanup,
 	[bitcoin_message_type_alert] =       NULL,
 	[bitcoin_message_type_sendheaders] = NULL,
 	[bitcoin_message_type_feefilter] =   NULL,
-	[bitcoin_message_type_sendcmpct] =   NULL,
-	[bitcoin_message_type_cmpctblock] =  NULL,
-	[bitcoin_message_type_getblocktxn] = NULL,
-	[bitcoin_message_type_blocktxn] =    NULL,
+	[bitcoin_message_type_sendcmpct] =   (cleanup_message_fn)bitcoin_message_sendcmpct_cleanup,
+	[bitcoin_message_type_cmpctblock] =  (cleanup_message_fn)bitcoin_message_cmpctblock_cleanup,
+	[bitcoin_message_type_getblocktxn] = (cleanup_message_fn)bitcoin_message_getblocktxn_cleanup,
+	[bitcoin_message_type_blocktxn] =    (cleanup_message_fn)bitcoin_message_blocktxn_cleanup,
+	[bitcoin_message_type_getcfilters] = (cleanup_message_fn)bitcoin_message_getcfilters_cleanup,
+	[bitcoin_message_type_cfilter] =     (cleanup_message_fn)bitcoin_message_cfilter_cleanup,
+	[bitcoin_message_type_getcfheaders] = (cleanup_message_fn)bitcoin_message_getcfheaders_cleanup,
+	[bitcoin_message_type_cfheaders] =   (cleanup_message_fn)bitcoin_message_cfheaders_cleanup,
+	[bitcoin_message_type_getcfcheckpt] = (cleanup_message_fn)bitcoin_message_getcfcheckpt_cleanup,
+	[bitcoin_message_type_cfcheckpt] =   (cleanup_message_fn)bitcoin_message_cfcheckpt_cleanup,
 };
 static inline cleanup_message_fn get_cleanup_function(enum bitcoin_message_type type)
 {
@@ -152,17 +230,23 @@ static parse_payload_fn s_payload_parsers[bitcoin_message_types_count] =
 	[bitcoin_message_type_ping] =        NULL,
 	[bitcoin_message_type_pong] =        NULL,
 	[bitcoin_message_type_reject] =      NULL,
-	[bitcoin_message_type_filterload] =  NULL,
-	[bitcoin_message_type_filteradd] =   NULL,
+	[bitcoin_message_type_filterload] =  (parse_payload_fn)bitcoin_message_filterload_parse,
+	[bitcoin_message_type_filteradd] =   (parse_payload_fn)bitcoin_message_filteradd_parse,
 	[bitcoin_message_type_filterclear] = NULL,
-	[bitcoin_message_type_merkleblock] = NULL,
+	[bitcoin_message_type_merkleblock] = (parse_payload_fn)bitcoin_message_merkleblock_parse,
 	[bitcoin_message_type_alert] =       NULL,
 	[bitcoin_message_type_sendheaders] = NULL,
 	[bitcoin_message_type_feefilter] =   NULL,
-	[bitcoin_message_type_sendcmpct] =   NULL,
-	[bitcoin_message_type_cmpctblock] =  NULL,
-	[bitcoin_message_type_getblocktxn] = NULL,
-	[bitcoin_message_type_blocktxn] =    NULL,
+	[bitcoin_message_type_sendcmpct] =   (parse_payload_fn)bitcoin_message_sendcmpct_parse,
+	[bitcoin_message_type_cmpctblock] =  (parse_payload_fn)bitcoin_message_cmpctblock_parse,
+	[bitcoin_message_type_getblocktxn] = (parse_payload_fn)bitcoin_message_getblocktxn_parse,
+	[bitcoin_message_type_blocktxn] =    (parse_payload_fn)bitcoin_message_blocktxn_parse,
+	[bitcoin_message_type_getcfilters] = (parse_payload_fn)bitcoin_message_getcfilters_parse,
+	[bitcoin_message_type_cfilter] =     (parse_payload_fn)bitcoin_message_cfilter_parse,
+	[bitcoin_message_type_getcfheaders] = (parse_payload_fn)bitcoin_message_getcfheaders_parse,
+	[bitcoin_message_type_cfheaders] =   (parse_payload_fn)bitcoin_message_cfheaders_parse,
+	[bitcoin_message_type_getcfcheckpt] = (parse_payload_fn)bitcoin_message_getcfcheckpt_parse,
+	[bitcoin_message_type_cfcheckpt] =   (parse_payload_fn)bitcoin_message_cfcheckpt_parse,
 };
 static inline parse_payload_fn get_payload_parser(enum bitcoin_message_type type)
 {
@@ -181,8 +265,9 @@ void bitcoin_message_clear(bitcoin_message_t * msg)
 	}
 	
 	if(msg->msg_data) {
-		free(msg->msg_data);
+		if(!msg->borrowed) free(msg->msg_data);
 		msg->msg_data = NULL;
+		msg->borrowed = 0;
 	}
 	memset(msg->hdr, 0, sizeof(msg->hdr));
 	
@@ -199,9 +284,9 @@ int bitcoin_message_parse(bitcoin_message_t * msg, const struct bitcoin_message_
 	assert(length >= hdr->length);
 	if(NULL == payload) payload = hdr->payload;
 	
-	fprintf(stderr, "%s(command=%s, length=%u)\n", __FUNCTION__, hdr->command, hdr->length);
+	debug_printf("command=%.12s, length=%u", hdr->command, hdr->length);
 	
-	enum bitcoin_message_type type = bitcoin_message_type_from_string(hdr->command);
+	enum bitcoin_message_type type = bitcoin_message_type_from_command(hdr->command);
 	if(type == bitcoin_message_type_unknown) return -1;
 	
 	// verify checksum
@@ -231,6 +316,32 @@ int bitcoin_message_parse(bitcoin_message_t * msg, const struct bitcoin_message_
 	return 0;
 }
 
+int bitcoin_message_parse_in_place(bitcoin_message_t * msg, const struct bitcoin_message_header * hdr, int verify_checksum)
+{
+	assert(msg && hdr);
+	bitcoin_message_clear(msg);	// clear old data
+	
+	enum bitcoin_message_type type = bitcoin_message_type_from_command(hdr->command);
+	if(type == bitcoin_message_type_unknown) return -1;
+	
+	if(verify_checksum) {
+		unsigned char hash[32] = { 0 };
+		hash256(hdr->payload, hdr->length, hash);
+		if(memcmp(hash, &hdr->checksum, 4) != 0) return -1;	// invalid checksum
+	}
+	
+	// borrow the receiving buffer
+	msg->msg_data = (struct bitcoin_message_header *)hdr;
+	msg->borrowed = 1;
+	msg->msg_type = type;
+	
+	if(hdr->length > 0) {
+		parse_payload_fn parser = get_payload_parser(type);
+		if(parser) msg->msg_object = parser(NULL, hdr->payload, hdr->length);
+	}
+	return 0;
+}
+
 void bitcoin_message_cleanup(bitcoin_message_t * msg)
 {
 	if(NULL == msg) return;
@@ -337,6 +448,45 @@ bitcoin_message_t * bitcoin_message_new(bitcoin_message_t * msg, uint32_t magic,
 	case bitcoin_message_type_headers:    
 		msg_object = calloc(1, sizeof(struct bitcoin_message_block_headers)); 
 		break;
+	case bitcoin_message_type_filterload:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_filterload));
+		break;
+	case bitcoin_message_type_filteradd:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_filteradd));
+		break;
+	case bitcoin_message_type_merkleblock:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_merkleblock));
+		break;
+	case bitcoin_message_type_sendcmpct:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_sendcmpct));
+		break;
+	case bitcoin_message_type_cmpctblock:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_cmpctblock));
+		break;
+	case bitcoin_message_type_getblocktxn:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_getblocktxn));
+		break;
+	case bitcoin_message_type_blocktxn:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_blocktxn));
+		break;
+	case bitcoin_message_type_getcfilters:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_getcfilters));
+		break;
+	case bitcoin_message_type_cfilter:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_cfilter));
+		break;
+	case bitcoin_message_type_getcfheaders:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_getcfheaders));
+		break;
+	case bitcoin_message_type_cfheaders:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_cfheaders));
+		break;
+	case bitcoin_message_type_getcfcheckpt:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_getcfcheckpt));
+		break;
+	case bitcoin_message_type_cfcheckpt:
+		msg_object = calloc(1, sizeof(struct bitcoin_message_cfcheckpt));
+		break;
 	
 	case bitcoin_message_type_getaddr:    
 	case bitcoin_message_type_mempool:
@@ -346,17 +496,10 @@ bitcoin_message_t * bitcoin_message_new(bitcoin_message_t * msg, uint32_t magic,
 	case bitcoin_message_type_ping:
 	case bitcoin_message_type_pong:
 	case bitcoin_message_type_reject:
-	case bitcoin_message_type_filterload:
-	case bitcoin_message_type_filteradd:
 	case bitcoin_message_type_filterclear:
-	case bitcoin_message_type_merkleblock:
 	case bitcoin_message_type_alert:
 	case bitcoin_message_type_sendheaders:
 	case bitcoin_message_type_feefilter:
-	case bitcoin_message_type_sendcmpct:
-	case bitcoin_message_type_cmpctblock:
-	case bitcoin_message_type_getblocktxn:
-	case bitcoin_message_type_blocktxn:
 	default:
 		break;
 	}
@@ -401,6 +544,45 @@ static ssize_t message_object_serialize(enum bitcoin_message_type type, void * m
 	case bitcoin_message_type_headers:    
 		cb_payload = bitcoin_message_block_headers_serialize(msg_object, p_payload);
 		break;
+	case bitcoin_message_type_filterload:
+		cb_payload = bitcoin_message_filterload_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_filteradd:
+		cb_payload = bitcoin_message_filteradd_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_merkleblock:
+		cb_payload = bitcoin_message_merkleblock_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_sendcmpct:
+		cb_payload = bitcoin_message_sendcmpct_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_cmpctblock:
+		cb_payload = bitcoin_message_cmpctblock_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_getblocktxn:
+		cb_payload = bitcoin_message_getblocktxn_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_blocktxn:
+		cb_payload = bitcoin_message_blocktxn_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_getcfilters:
+		cb_payload = bitcoin_message_getcfilters_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_cfilter:
+		cb_payload = bitcoin_message_cfilter_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_getcfheaders:
+		cb_payload = bitcoin_message_getcfheaders_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_cfheaders:
+		cb_payload = bitcoin_message_cfheaders_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_getcfcheckpt:
+		cb_payload = bitcoin_message_getcfcheckpt_serialize(msg_object, p_payload);
+		break;
+	case bitcoin_message_type_cfcheckpt:
+		cb_payload = bitcoin_message_cfcheckpt_serialize(msg_object, p_payload);
+		break;
 	case bitcoin_message_type_getaddr:
 	case bitcoin_message_type_mempool:
 	case bitcoin_message_type_checkorder:
@@ -409,17 +591,10 @@ static ssize_t message_object_serialize(enum bitcoin_message_type type, void * m
 	case bitcoin_message_type_ping:
 	case bitcoin_message_type_pong:
 	case bitcoin_message_type_reject:
-	case bitcoin_message_type_filterload:
-	case bitcoin_message_type_filteradd:
 	case bitcoin_message_type_filterclear:
-	case bitcoin_message_type_merkleblock:
 	case bitcoin_message_type_alert:
 	case bitcoin_message_type_sendheaders:
 	case bitcoin_message_type_feefilter:
-	case bitcoin_message_type_sendcmpct:
-	case bitcoin_message_type_cmpctblock:
-	case bitcoin_message_type_getblocktxn:
-	case bitcoin_message_type_blocktxn:
 	default:
 		break;
 	}
@@ -439,7 +614,7 @@ ssize_t bitcoin_message_serialize(struct bitcoin_message * msg, unsigned char **
 	
 	struct bitcoin_message_header * hdr = msg->hdr;
 	if(!hdr->command[0]) strncpy(hdr->command, sz_type, sizeof(hdr->command));
-	assert(0 == strcmp(hdr->command, sz_type));
+	assert(0 == strncmp(hdr->command, sz_type, sizeof(hdr->command)));	// a 12-byte command is not NUL-terminated
 	
 	unsigned char * payload = NULL;
 	ssize_t cb_payload = 0;
@@ -0,0 +1,447 @@
+/*
+ * block_filters.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "bitcoin-message.h"
+#include "utils.h"
+
+/*
+ * BIP157: getcfilters, cfilter, getcfheaders, cfheaders, getcfcheckpt, cfcheckpt
+ *   (https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki)
+ */
+
+#define message_parser_error_handler(fmt, ...) do { \
+		fprintf(stderr, "\e[31m" "[ERROR]::%s@%d::%s(): " fmt "\e[39m" "\n", \
+			__FILE__, __LINE__, __FUNCTION__,	\
+			##__VA_ARGS__);						\
+		goto label_error;						\
+	} while(0)
+
+static inline const unsigned char * parse_varint(const unsigned char * p, const unsigned char * p_end, ssize_t * value)
+{
+	if(p >= p_end) return NULL;
+	ssize_t vint_size = varint_size((varint_t *)p);
+	if((p + vint_size) > p_end) return NULL;
+	
+	uint64_t v = varint_get((varint_t *)p);
+	*value = (v > INT32_MAX)?INT32_MAX:(ssize_t)v;	// too large for a count or a size, refused by the callers
+	return p + vint_size;
+}
+
+// uint256 array: { varint(count), hashes }, the hashes are copied
+static const unsigned char * parse_hashes(const unsigned char * p, const unsigned char * p_end, uint256_t ** p_hashes, ssize_t * p_count)
+{
+	ssize_t count = 0;
+	p = parse_varint(p, p_end, &count);
+	if(NULL == p || count > ((p_end - p) / (ssize_t)sizeof(uint256_t))) return NULL;
+	
+	uint256_t * hashes = NULL;
+	if(count > 0) {
+		hashes = calloc(count, sizeof(uint256_t));
+		assert(hashes);
+		memcpy(hashes, p, count * sizeof(uint256_t));
+	}
+	*p_hashes = hashes;
+	*p_count = count;
+	return p + count * sizeof(uint256_t);
+}
+
+static inline unsigned char * serialize_hashes(unsigned char * p, const uint256_t * hashes, ssize_t count)
+{
+	varint_set((varint_t *)p, count);
+	p += varint_calc_size(count);
+	if(count > 0) memcpy(p, hashes, count * sizeof(uint256_t));
+	return p + count * sizeof(uint256_t);
+}
+
+static inline unsigned char * alloc_payload(unsigned char ** p_data, ssize_t size)
+{
+	unsigned char * payload = *p_data;
+	if(NULL == payload) {
+		payload = malloc(size);
+		assert(payload);
+		*p_data = payload;
+	}
+	return payload;
+}
+
+
+/******************************************
+ * getcfilters / getcfheaders: { filter_type, start_height, stop_hash }
+******************************************/
+#define GETCF_RANGE_SIZE	(1 + 4 + 32)
+static void parse_range(const unsigned char * payload, uint8_t * filter_type, uint32_t * start_height, uint256_t * stop_hash)
+{
+	*filter_type = payload[0];
+	memcpy(start_height, payload + 1, 4);
+	memcpy(stop_hash, payload + 5, 32);
+}
+
+static void serialize_range(unsigned char * payload, uint8_t filter_type, uint32_t start_height, const uint256_t * stop_hash)
+{
+	payload[0] = filter_type;
+	memcpy(payload + 1, &start_height, 4);
+	memcpy(payload + 5, stop_hash, 32);
+}
+
+struct bitcoin_message_getcfilters * bitcoin_message_getcfilters_parse(struct bitcoin_message_getcfilters * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < GETCF_RANGE_SIZE) return NULL;
+	if(NULL == msg) msg = calloc(1, sizeof(*msg));
+	assert(msg);
+	
+	parse_range(payload, &msg->filter_type, &msg->start_height, &msg->stop_hash);
+	return msg;
+}
+void bitcoin_message_getcfilters_cleanup(struct bitcoin_message_getcfilters * msg)
+{
+	return;
+}
+ssize_t bitcoin_message_getcfilters_serialize(const struct bitcoin_message_getcfilters * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	if(NULL == p_data) return GETCF_RANGE_SIZE;
+	
+	serialize_range(alloc_payload(p_data, GETCF_RANGE_SIZE), msg->filter_type, msg->start_height, &msg->stop_hash);
+	return GETCF_RANGE_SIZE;
+}
+void bitcoin_message_getcfilters_dump(const struct bitcoin_message_getcfilters * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("filter_type: %d\n", (int)msg->filter_type);
+	printf("start_height: %u\n", msg->start_height);
+	dump_line("stop_hash: ", &msg->stop_hash, 32);
+#endif
+	return;
+}
+
+struct bitcoin_message_getcfheaders * bitcoin_message_getcfheaders_parse(struct bitcoin_message_getcfheaders * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < GETCF_RANGE_SIZE) return NULL;
+	if(NULL == msg) msg = calloc(1, sizeof(*msg));
+	assert(msg);
+	
+	parse_range(payload, &msg->filter_type, &msg->start_height, &msg->stop_hash);
+	return msg;
+}
+void bitcoin_message_getcfheaders_cleanup(struct bitcoin_message_getcfheaders * msg)
+{
+	return;
+}
+ssize_t bitcoin_message_getcfheaders_serialize(const struct bitcoin_message_getcfheaders * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	if(NULL == p_data) return GETCF_RANGE_SIZE;
+	
+	serialize_range(alloc_payload(p_data, GETCF_RANGE_SIZE), msg->filter_type, msg->start_height, &msg->stop_hash);
+	return GETCF_RANGE_SIZE;
+}
+void bitcoin_message_getcfheaders_dump(const struct bitcoin_message_getcfheaders * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("filter_type: %d\n", (int)msg->filter_type);
+	printf("start_height: %u\n", msg->start_height);
+	dump_line("stop_hash: ", &msg->stop_hash, 32);
+#endif
+	return;
+}
+#undef GETCF_RANGE_SIZE
+
+
+/******************************************
+ * cfilter
+******************************************/
+struct bitcoin_message_cfilter * bitcoin_message_cfilter_parse(struct bitcoin_message_cfilter * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < (1 + 32 + 1)) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = payload;
+	const unsigned char * p_end = p + length;
+	
+	msg->filter_type = *p++;
+	memcpy(&msg->block_hash, p, 32);
+	p += 32;
+	
+	ssize_t filter_size = 0;
+	p = parse_varint(p, p_end, &filter_size);
+	if(NULL == p || filter_size > (p_end - p)) {
+		message_parser_error_handler("parse filter failed: %s", "invalid payload length");
+	}
+	if(filter_size > 0) {
+		msg->filter = malloc(filter_size);
+		assert(msg->filter);
+		memcpy(msg->filter, p, filter_size);
+	}
+	msg->filter_size = filter_size;
+	return msg;
+	
+label_error:
+	bitcoin_message_cfilter_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_cfilter_cleanup(struct bitcoin_message_cfilter * msg)
+{
+	if(NULL == msg) return;
+	free(msg->filter);
+	msg->filter = NULL;
+	msg->filter_size = 0;
+	return;
+}
+
+ssize_t bitcoin_message_cfilter_serialize(const struct bitcoin_message_cfilter * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = 1 + 32 + varint_calc_size(msg->filter_size) + msg->filter_size;
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = alloc_payload(p_data, size);
+	unsigned char * p = payload;
+	*p++ = msg->filter_type;
+	memcpy(p, &msg->block_hash, 32);
+	p += 32;
+	
+	varint_set((varint_t *)p, msg->filter_size);
+	p += varint_calc_size(msg->filter_size);
+	if(msg->filter_size > 0) memcpy(p, msg->filter, msg->filter_size);
+	p += msg->filter_size;
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_cfilter_dump(const struct bitcoin_message_cfilter * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("filter_type: %d\n", (int)msg->filter_type);
+	dump_line("block_hash: ", &msg->block_hash, 32);
+	printf("filter_size: %ld\n", (long)msg->filter_size);
+#endif
+	return;
+}
+
+
+/******************************************
+ * cfheaders
+******************************************/
+struct bitcoin_message_cfheaders * bitcoin_message_cfheaders_parse(struct bitcoin_message_cfheaders * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < (1 + 32 + 32 + 1)) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = payload;
+	const unsigned char * p_end = p + length;
+	
+	msg->filter_type = *p++;
+	memcpy(&msg->stop_hash, p, 32);
+	p += 32;
+	memcpy(&msg->prev_header, p, 32);
+	p += 32;
+	
+	p = parse_hashes(p, p_end, &msg->filter_hashes, &msg->count);
+	if(NULL == p) {
+		message_parser_error_handler("parse filter_hashes failed: %s", "invalid payload length");
+	}
+	return msg;
+	
+label_error:
+	bitcoin_message_cfheaders_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_cfheaders_cleanup(struct bitcoin_message_cfheaders * msg)
+{
+	if(NULL == msg) return;
+	free(msg->filter_hashes);
+	msg->filter_hashes = NULL;
+	msg->count = 0;
+	return;
+}
+
+ssize_t bitcoin_message_cfheaders_serialize(const struct bitcoin_message_cfheaders * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = 1 + 32 + 32 + varint_calc_size(msg->count) + msg->count * sizeof(uint256_t);
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = alloc_payload(p_data, size);
+	unsigned char * p = payload;
+	*p++ = msg->filter_type;
+	memcpy(p, &msg->stop_hash, 32);
+	p += 32;
+	memcpy(p, &msg->prev_header, 32);
+	p += 32;
+	
+	p = serialize_hashes(p, msg->filter_hashes, msg->count);
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_cfheaders_dump(const struct bitcoin_message_cfheaders * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("filter_type: %d\n", (int)msg->filter_type);
+	dump_line("stop_hash: ", &msg->stop_hash, 32);
+	dump_line("prev_header: ", &msg->prev_header, 32);
+	printf("count: %ld\n", (long)msg->count);
+#endif
+	return;
+}
+
+
+/******************************************
+ * getcfcheckpt
+******************************************/
+struct bitcoin_message_getcfcheckpt * bitcoin_message_getcfcheckpt_parse(struct bitcoin_message_getcfcheckpt * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < (1 + 32)) return NULL;
+	if(NULL == msg) msg = calloc(1, sizeof(*msg));
+	assert(msg);
+	
+	msg->filter_type = payload[0];
+	memcpy(&msg->stop_hash, payload + 1, 32);
+	return msg;
+}
+void bitcoin_message_getcfcheckpt_cleanup(struct bitcoin_message_getcfcheckpt * msg)
+{
+	return;
+}
+ssize_t bitcoin_message_getcfcheckpt_serialize(const struct bitcoin_message_getcfcheckpt * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = 1 + 32;
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = alloc_payload(p_data, size);
+	payload[0] = msg->filter_type;
+	memcpy(payload + 1, &msg->stop_hash, 32);
+	return size;
+}
+void bitcoin_message_getcfcheckpt_dump(const struct bitcoin_message_getcfcheckpt * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("filter_type: %d\n", (int)msg->filter_type);
+	dump_line("stop_hash: ", &msg->stop_hash, 32);
+#endif
+	return;
+}
+
+
+/******************************************
+ * cfcheckpt
+******************************************/
+struct bitcoin_message_cfcheckpt * bitcoin_message_cfcheckpt_parse(struct bitcoin_message_cfcheckpt * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < (1 + 32 + 1)) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = payload;
+	const unsigned char * p_end = p + length;
+	
+	msg->filter_type = *p++;
+	memcpy(&msg->stop_hash, p, 32);
+	p += 32;
+	
+	p = parse_hashes(p, p_end, &msg->filter_headers, &msg->count);
+	if(NULL == p) {
+		message_parser_error_handler("parse filter_headers failed: %s", "invalid payload length");
+	}
+	return msg;
+	
+label_error:
+	bitcoin_message_cfcheckpt_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_cfcheckpt_cleanup(struct bitcoin_message_cfcheckpt * msg)
+{
+	if(NULL == msg) return;
+	free(msg->filter_headers);
+	msg->filter_headers = NULL;
+	msg->count = 0;
+	return;
+}
+
+ssize_t bitcoin_message_cfcheckpt_serialize(const struct bitcoin_message_cfcheckpt * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = 1 + 32 + varint_calc_size(msg->count) + msg->count * sizeof(uint256_t);
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = alloc_payload(p_data, size);
+	unsigned char * p = payload;
+	*p++ = msg->filter_type;
+	memcpy(p, &msg->stop_hash, 32);
+	p += 32;
+	
+	p = serialize_hashes(p, msg->filter_headers, msg->count);
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_cfcheckpt_dump(const struct bitcoin_message_cfcheckpt * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("filter_type: %d\n", (int)msg->filter_type);
+	dump_line("stop_hash: ", &msg->stop_hash, 32);
+	printf("count: %ld\n", (long)msg->count);
+#endif
+	return;
+}
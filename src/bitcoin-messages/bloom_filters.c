@@ -0,0 +1,333 @@
+/*
+ * bloom_filters.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "bitcoin-message.h"
+#include "utils.h"
+
+/*
+ * BIP37: filterload, filteradd, merkleblock
+ *   (https://github.com/bitcoin/bips/blob/master/bip-0037.mediawiki)
+ */
+
+#define message_parser_error_handler(fmt, ...) do { \
+		fprintf(stderr, "\e[31m" "[ERROR]::%s@%d::%s(): " fmt "\e[39m" "\n", \
+			__FILE__, __LINE__, __FUNCTION__,	\
+			##__VA_ARGS__);						\
+		goto label_error;						\
+	} while(0)
+
+static inline const unsigned char * parse_varint(const unsigned char * p, const unsigned char * p_end, ssize_t * value)
+{
+	if(p >= p_end) return NULL;
+	ssize_t vint_size = varint_size((varint_t *)p);
+	if((p + vint_size) > p_end) return NULL;
+	
+	uint64_t v = varint_get((varint_t *)p);
+	*value = (v > INT32_MAX)?INT32_MAX:(ssize_t)v;	// too large for a count or a size, refused by the callers
+	return p + vint_size;
+}
+
+// var_bytes: { varint(length), data }, the data is copied
+static const unsigned char * parse_var_bytes(const unsigned char * p, const unsigned char * p_end, unsigned char ** p_data, ssize_t * p_length)
+{
+	ssize_t length = 0;
+	p = parse_varint(p, p_end, &length);
+	if(NULL == p || length > (p_end - p)) return NULL;
+	
+	unsigned char * data = NULL;
+	if(length > 0) {
+		data = malloc(length);
+		assert(data);
+		memcpy(data, p, length);
+	}
+	*p_data = data;
+	*p_length = length;
+	return p + length;
+}
+
+static inline unsigned char * serialize_var_bytes(unsigned char * p, const unsigned char * data, ssize_t length)
+{
+	varint_set((varint_t *)p, length);
+	p += varint_calc_size(length);
+	if(length > 0) memcpy(p, data, length);
+	return p + length;
+}
+
+
+/******************************************
+ * filterload
+******************************************/
+struct bitcoin_message_filterload * bitcoin_message_filterload_parse(struct bitcoin_message_filterload * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < (1 + 4 + 4 + 1)) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = payload;
+	const unsigned char * p_end = p + length;
+	
+	p = parse_var_bytes(p, p_end, &msg->filter, &msg->filter_size);
+	if(NULL == p || (p + 4 + 4 + 1) > p_end) {
+		message_parser_error_handler("parse filter failed: %s", "invalid payload length");
+	}
+	memcpy(&msg->hash_funcs, p, 4); p += 4;
+	memcpy(&msg->tweak, p, 4); p += 4;
+	msg->flags = *p++;
+	return msg;
+	
+label_error:
+	bitcoin_message_filterload_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_filterload_cleanup(struct bitcoin_message_filterload * msg)
+{
+	if(NULL == msg) return;
+	free(msg->filter);
+	msg->filter = NULL;
+	msg->filter_size = 0;
+	return;
+}
+
+ssize_t bitcoin_message_filterload_serialize(const struct bitcoin_message_filterload * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = varint_calc_size(msg->filter_size) + msg->filter_size + 4 + 4 + 1;
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = *p_data;
+	if(NULL == payload) {
+		payload = malloc(size);
+		assert(payload);
+		*p_data = payload;
+	}
+	
+	unsigned char * p = serialize_var_bytes(payload, msg->filter, msg->filter_size);
+	memcpy(p, &msg->hash_funcs, 4); p += 4;
+	memcpy(p, &msg->tweak, 4); p += 4;
+	*p++ = msg->flags;
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_filterload_dump(const struct bitcoin_message_filterload * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("filter_size: %ld\n", (long)msg->filter_size);
+	printf("hash_funcs: %u\n", msg->hash_funcs);
+	printf("tweak: 0x%.8x\n", msg->tweak);
+	printf("flags: %d\n", (int)msg->flags);
+#endif
+	return;
+}
+
+
+/******************************************
+ * filteradd
+******************************************/
+struct bitcoin_message_filteradd * bitcoin_message_filteradd_parse(struct bitcoin_message_filteradd * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < 1) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = parse_var_bytes(payload, payload + length, &msg->data, &msg->data_size);
+	if(NULL == p) {
+		message_parser_error_handler("parse data failed: %s", "invalid payload length");
+	}
+	return msg;
+	
+label_error:
+	bitcoin_message_filteradd_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_filteradd_cleanup(struct bitcoin_message_filteradd * msg)
+{
+	if(NULL == msg) return;
+	free(msg->data);
+	msg->data = NULL;
+	msg->data_size = 0;
+	return;
+}
+
+ssize_t bitcoin_message_filteradd_serialize(const struct bitcoin_message_filteradd * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = varint_calc_size(msg->data_size) + msg->data_size;
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = *p_data;
+	if(NULL == payload) {
+		payload = malloc(size);
+		assert(payload);
+		*p_data = payload;
+	}
+	
+	unsigned char * p = serialize_var_bytes(payload, msg->data, msg->data_size);
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_filteradd_dump(const struct bitcoin_message_filteradd * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("data_size: %ld\n", (long)msg->data_size);
+	if(msg->data_size > 0) dump_line("data: ", msg->data, msg->data_size);
+#endif
+	return;
+}
+
+
+/******************************************
+ * merkleblock
+******************************************/
+struct bitcoin_message_merkleblock * bitcoin_message_merkleblock_parse(struct bitcoin_message_merkleblock * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < (sizeof(struct satoshi_block_header) + 4)) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = payload;
+	const unsigned char * p_end = p + length;
+	
+	memcpy(&msg->hdr, p, sizeof(struct satoshi_block_header));
+	p += sizeof(struct satoshi_block_header);
+	memcpy(&msg->total_txns, p, 4);
+	p += 4;
+	
+	ssize_t count = 0;
+	p = parse_varint(p, p_end, &count);
+	if(NULL == p || count > ((p_end - p) / (ssize_t)sizeof(uint256_t))) {
+		message_parser_error_handler("parse hashes failed: %s", "invalid payload length");
+	}
+	if(count > 0) {
+		msg->hashes = calloc(count, sizeof(uint256_t));
+		assert(msg->hashes);
+		memcpy(msg->hashes, p, count * sizeof(uint256_t));
+		p += count * sizeof(uint256_t);
+	}
+	msg->hashes_count = count;
+	
+	p = parse_var_bytes(p, p_end, &msg->flags, &msg->flags_size);
+	if(NULL == p) {
+		message_parser_error_handler("parse flags failed: %s", "invalid payload length");
+	}
+	return msg;
+	
+label_error:
+	bitcoin_message_merkleblock_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_merkleblock_cleanup(struct bitcoin_message_merkleblock * msg)
+{
+	if(NULL == msg) return;
+	free(msg->hashes);
+	msg->hashes = NULL;
+	msg->hashes_count = 0;
+	
+	free(msg->flags);
+	msg->flags = NULL;
+	msg->flags_size = 0;
+	return;
+}
+
+ssize_t bitcoin_message_merkleblock_serialize(const struct bitcoin_message_merkleblock * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = sizeof(struct satoshi_block_header) + 4
+		+ varint_calc_size(msg->hashes_count) + msg->hashes_count * sizeof(uint256_t)
+		+ varint_calc_size(msg->flags_size) + msg->flags_size;
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = *p_data;
+	if(NULL == payload) {
+		payload = malloc(size);
+		assert(payload);
+		*p_data = payload;
+	}
+	
+	unsigned char * p = payload;
+	memcpy(p, &msg->hdr, sizeof(struct satoshi_block_header));
+	p += sizeof(struct satoshi_block_header);
+	memcpy(p, &msg->total_txns, 4);
+	p += 4;
+	
+	varint_set((varint_t *)p, msg->hashes_count);
+	p += varint_calc_size(msg->hashes_count);
+	if(msg->hashes_count > 0) {
+		memcpy(p, msg->hashes, msg->hashes_count * sizeof(uint256_t));
+		p += msg->hashes_count * sizeof(uint256_t);
+	}
+	
+	p = serialize_var_bytes(p, msg->flags, msg->flags_size);
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_merkleblock_dump(const struct bitcoin_message_merkleblock * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	satoshi_block_header_dump(&msg->hdr);
+	printf("total_txns: %u\n", msg->total_txns);
+	printf("hashes_count: %ld\n", (long)msg->hashes_count);
+	for(ssize_t i = 0; i < msg->hashes_count; ++i) {
+		printf("\t hashes[%ld]: ", (long)i);
+		dump_line("", &msg->hashes[i], 32);
+	}
+	printf("flags_size: %ld\n", (long)msg->flags_size);
+	if(msg->flags_size > 0) dump_line("flags: ", msg->flags, msg->flags_size);
+#endif
+	return;
+}
+
@@ -0,0 +1,506 @@
+/*
+ * compact_blocks.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "bitcoin-consensus.h"
+#include "bitcoin-message.h"
+#include "utils.h"
+
+/*
+ * BIP152: sendcmpct, cmpctblock, getblocktxn, blocktxn
+ *   (https://github.com/bitcoin/bips/blob/master/bip-0152.mediawiki)
+ */
+
+#define message_parser_error_handler(fmt, ...) do { \
+		fprintf(stderr, "\e[31m" "[ERROR]::%s@%d::%s(): " fmt "\e[39m" "\n", \
+			__FILE__, __LINE__, __FUNCTION__,	\
+			##__VA_ARGS__);						\
+		goto label_error;						\
+	} while(0)
+
+static inline const unsigned char * parse_varint(const unsigned char * p, const unsigned char * p_end, ssize_t * value)
+{
+	if(p >= p_end) return NULL;
+	ssize_t vint_size = varint_size((varint_t *)p);
+	if((p + vint_size) > p_end) return NULL;
+	
+	uint64_t v = varint_get((varint_t *)p);
+	*value = (v > INT32_MAX)?INT32_MAX:(ssize_t)v;	// too large for a count or an index, refused by the callers
+	return p + vint_size;
+}
+
+static inline ssize_t parse_tx(satoshi_tx_t * tx, const unsigned char * p, const unsigned char * p_end)
+{
+	if(p >= p_end) return -1;
+	ssize_t length = p_end - p;
+	if(length > MAX_BLOCK_SERIALIZED_SIZE) length = MAX_BLOCK_SERIALIZED_SIZE;
+	return satoshi_tx_parse(tx, length, p);
+}
+
+/*
+ * the indexes of prefilled txs and getblocktxn are differentially encoded:
+ *   index[0] = diff[0], index[i] = index[i - 1] + diff[i] + 1
+ */
+static inline ssize_t decode_index(ssize_t prev_index, ssize_t diff)
+{
+	ssize_t index = prev_index + diff + 1;
+	if(index > UINT16_MAX) return -1;	// BIP152: a block can not have more than 65535 txs
+	return index;
+}
+
+
+/******************************************
+ * sendcmpct
+******************************************/
+struct bitcoin_message_sendcmpct * bitcoin_message_sendcmpct_parse(struct bitcoin_message_sendcmpct * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < 9) return NULL;
+	if(NULL == msg) msg = calloc(1, sizeof(*msg));
+	assert(msg);
+	
+	msg->announce = payload[0];
+	memcpy(&msg->version, payload + 1, sizeof(uint64_t));
+	return msg;
+}
+void bitcoin_message_sendcmpct_cleanup(struct bitcoin_message_sendcmpct * msg)
+{
+	return;
+}
+ssize_t bitcoin_message_sendcmpct_serialize(const struct bitcoin_message_sendcmpct * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = 1 + sizeof(uint64_t);
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = *p_data;
+	if(NULL == payload) {
+		payload = malloc(size);
+		assert(payload);
+		*p_data = payload;
+	}
+	payload[0] = msg->announce?1:0;
+	memcpy(payload + 1, &msg->version, sizeof(uint64_t));
+	return size;
+}
+void bitcoin_message_sendcmpct_dump(const struct bitcoin_message_sendcmpct * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	printf("announce: %d\n", (int)msg->announce);
+	printf("version: %" PRIu64 "\n", msg->version);
+#endif
+	return;
+}
+
+
+/******************************************
+ * cmpctblock
+******************************************/
+struct bitcoin_message_cmpctblock * bitcoin_message_cmpctblock_parse(struct bitcoin_message_cmpctblock * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < (sizeof(struct satoshi_block_header) + sizeof(uint64_t))) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = payload;
+	const unsigned char * p_end = p + length;
+	
+	memcpy(&msg->hdr, p, sizeof(struct satoshi_block_header));
+	p += sizeof(struct satoshi_block_header);
+	memcpy(&msg->nonce, p, sizeof(uint64_t));
+	p += sizeof(uint64_t);
+	
+	// short ids
+	ssize_t count = 0;
+	p = parse_varint(p, p_end, &count);
+	if(NULL == p || (p + count * BITCOIN_MESSAGE_SHORTID_SIZE) > p_end) {
+		message_parser_error_handler("parse shortids failed: %s", "invalid payload length");
+	}
+	if(count > 0) {
+		msg->shortids = calloc(count, sizeof(*msg->shortids));
+		assert(msg->shortids);
+		for(ssize_t i = 0; i < count; ++i) {
+			memcpy(&msg->shortids[i], p, BITCOIN_MESSAGE_SHORTID_SIZE);	// little-endian
+			p += BITCOIN_MESSAGE_SHORTID_SIZE;
+		}
+	}
+	msg->shortids_count = count;
+	
+	// prefilled txs
+	count = 0;
+	p = parse_varint(p, p_end, &count);
+	if(NULL == p || count > (p_end - p)) {
+		message_parser_error_handler("parse prefilled_txns failed: %s", "invalid payload length");
+	}
+	if(count > 0) {
+		msg->prefilled_txns = calloc(count, sizeof(*msg->prefilled_txns));
+		assert(msg->prefilled_txns);
+	}
+	
+	ssize_t index = -1;
+	for(ssize_t i = 0; i < count; ++i) {
+		ssize_t diff = 0;
+		p = parse_varint(p, p_end, &diff);
+		if(NULL == p || (index = decode_index(index, diff)) < 0) {
+			message_parser_error_handler("parse prefilled_txns[%d] failed: %s", (int)i, "invalid index");
+		}
+		
+		struct bitcoin_prefilled_tx * prefilled = &msg->prefilled_txns[i];
+		prefilled->index = index;
+		msg->prefilled_count = i + 1;	// to be cleaned up on error
+		
+		ssize_t cb = parse_tx(&prefilled->tx, p, p_end);
+		if(cb <= 0) {
+			message_parser_error_handler("parse prefilled_txns[%d] failed: %s", (int)i, "invalid tx");
+		}
+		p += cb;
+	}
+	msg->prefilled_count = count;
+	
+	// the last index must be in the block
+	if(index >= (msg->shortids_count + msg->prefilled_count)) {
+		message_parser_error_handler("invalid prefilled index: %ld", (long)index);
+	}
+	return msg;
+	
+label_error:
+	bitcoin_message_cmpctblock_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_cmpctblock_cleanup(struct bitcoin_message_cmpctblock * msg)
+{
+	if(NULL == msg) return;
+	free(msg->shortids);
+	msg->shortids = NULL;
+	msg->shortids_count = 0;
+	
+	if(msg->prefilled_txns) {
+		for(ssize_t i = 0; i < msg->prefilled_count; ++i) satoshi_tx_cleanup(&msg->prefilled_txns[i].tx);
+		free(msg->prefilled_txns);
+		msg->prefilled_txns = NULL;
+	}
+	msg->prefilled_count = 0;
+	return;
+}
+
+ssize_t bitcoin_message_cmpctblock_serialize(const struct bitcoin_message_cmpctblock * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = sizeof(struct satoshi_block_header) + sizeof(uint64_t)
+		+ varint_calc_size(msg->shortids_count)
+		+ msg->shortids_count * BITCOIN_MESSAGE_SHORTID_SIZE
+		+ varint_calc_size(msg->prefilled_count);
+	
+	ssize_t prev_index = -1;
+	for(ssize_t i = 0; i < msg->prefilled_count; ++i) {
+		const struct bitcoin_prefilled_tx * prefilled = &msg->prefilled_txns[i];
+		assert(prefilled->index > prev_index);
+		size += varint_calc_size(prefilled->index - prev_index - 1);
+		
+		ssize_t cb = satoshi_tx_serialize(&prefilled->tx, NULL);
+		assert(cb > 0);
+		size += cb;
+		prev_index = prefilled->index;
+	}
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = *p_data;
+	if(NULL == payload) {
+		payload = malloc(size);
+		assert(payload);
+		*p_data = payload;
+	}
+	
+	unsigned char * p = payload;
+	memcpy(p, &msg->hdr, sizeof(struct satoshi_block_header));
+	p += sizeof(struct satoshi_block_header);
+	memcpy(p, &msg->nonce, sizeof(uint64_t));
+	p += sizeof(uint64_t);
+	
+	varint_set((varint_t *)p, msg->shortids_count);
+	p += varint_calc_size(msg->shortids_count);
+	for(ssize_t i = 0; i < msg->shortids_count; ++i) {
+		memcpy(p, &msg->shortids[i], BITCOIN_MESSAGE_SHORTID_SIZE);
+		p += BITCOIN_MESSAGE_SHORTID_SIZE;
+	}
+	
+	varint_set((varint_t *)p, msg->prefilled_count);
+	p += varint_calc_size(msg->prefilled_count);
+	prev_index = -1;
+	for(ssize_t i = 0; i < msg->prefilled_count; ++i) {
+		const struct bitcoin_prefilled_tx * prefilled = &msg->prefilled_txns[i];
+		ssize_t diff = prefilled->index - prev_index - 1;
+		varint_set((varint_t *)p, diff);
+		p += varint_calc_size(diff);
+		
+		ssize_t cb = satoshi_tx_serialize(&prefilled->tx, &p);
+		assert(cb > 0);
+		p += cb;
+		prev_index = prefilled->index;
+	}
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_cmpctblock_dump(const struct bitcoin_message_cmpctblock * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	satoshi_block_header_dump(&msg->hdr);
+	printf("nonce: 0x%.16" PRIx64 "\n", msg->nonce);
+	printf("shortids_count: %ld\n", (long)msg->shortids_count);
+	printf("prefilled_count: %ld\n", (long)msg->prefilled_count);
+	for(ssize_t i = 0; i < msg->prefilled_count; ++i) {
+		printf("\t prefilled[%ld]: index=%ld, ", (long)i, (long)msg->prefilled_txns[i].index);
+		dump_line("txid=", msg->prefilled_txns[i].tx.txid, 32);
+	}
+#endif
+	return;
+}
+
+
+/******************************************
+ * getblocktxn
+******************************************/
+struct bitcoin_message_getblocktxn * bitcoin_message_getblocktxn_parse(struct bitcoin_message_getblocktxn * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < sizeof(uint256_t)) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = payload;
+	const unsigned char * p_end = p + length;
+	
+	memcpy(&msg->block_hash, p, sizeof(uint256_t));
+	p += sizeof(uint256_t);
+	
+	ssize_t count = 0;
+	p = parse_varint(p, p_end, &count);
+	if(NULL == p || count > (p_end - p)) {
+		message_parser_error_handler("parse indexes failed: %s", "invalid payload length");
+	}
+	if(count > 0) {
+		msg->indexes = calloc(count, sizeof(*msg->indexes));
+		assert(msg->indexes);
+	}
+	
+	ssize_t index = -1;
+	for(ssize_t i = 0; i < count; ++i) {
+		ssize_t diff = 0;
+		p = parse_varint(p, p_end, &diff);
+		if(NULL == p || (index = decode_index(index, diff)) < 0) {
+			message_parser_error_handler("parse indexes[%d] failed: %s", (int)i, "invalid index");
+		}
+		msg->indexes[i] = index;
+	}
+	msg->count = count;
+	return msg;
+	
+label_error:
+	bitcoin_message_getblocktxn_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_getblocktxn_cleanup(struct bitcoin_message_getblocktxn * msg)
+{
+	if(NULL == msg) return;
+	free(msg->indexes);
+	msg->indexes = NULL;
+	msg->count = 0;
+	return;
+}
+
+ssize_t bitcoin_message_getblocktxn_serialize(const struct bitcoin_message_getblocktxn * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = sizeof(uint256_t) + varint_calc_size(msg->count);
+	ssize_t prev_index = -1;
+	for(ssize_t i = 0; i < msg->count; ++i) {
+		assert(msg->indexes[i] > prev_index);
+		size += varint_calc_size(msg->indexes[i] - prev_index - 1);
+		prev_index = msg->indexes[i];
+	}
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = *p_data;
+	if(NULL == payload) {
+		payload = malloc(size);
+		assert(payload);
+		*p_data = payload;
+	}
+	
+	unsigned char * p = payload;
+	memcpy(p, &msg->block_hash, sizeof(uint256_t));
+	p += sizeof(uint256_t);
+	varint_set((varint_t *)p, msg->count);
+	p += varint_calc_size(msg->count);
+	
+	prev_index = -1;
+	for(ssize_t i = 0; i < msg->count; ++i) {
+		ssize_t diff = msg->indexes[i] - prev_index - 1;
+		varint_set((varint_t *)p, diff);
+		p += varint_calc_size(diff);
+		prev_index = msg->indexes[i];
+	}
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_getblocktxn_dump(const struct bitcoin_message_getblocktxn * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	dump_line("block_hash: ", &msg->block_hash, 32);
+	printf("count: %ld\n", (long)msg->count);
+	for(ssize_t i = 0; i < msg->count; ++i) printf("\t indexes[%ld]: %ld\n", (long)i, (long)msg->indexes[i]);
+#endif
+	return;
+}
+
+
+/******************************************
+ * blocktxn
+******************************************/
+struct bitcoin_message_blocktxn * bitcoin_message_blocktxn_parse(struct bitcoin_message_blocktxn * msg, const unsigned char * payload, size_t length)
+{
+	if(NULL == payload || length < sizeof(uint256_t)) return NULL;
+	
+	int is_allocated = (NULL == msg);
+	if(is_allocated) msg = calloc(1, sizeof(*msg));
+	else memset(msg, 0, sizeof(*msg));
+	assert(msg);
+	
+	const unsigned char * p = payload;
+	const unsigned char * p_end = p + length;
+	
+	memcpy(&msg->block_hash, p, sizeof(uint256_t));
+	p += sizeof(uint256_t);
+	
+	ssize_t count = 0;
+	p = parse_varint(p, p_end, &count);
+	if(NULL == p || count > (p_end - p)) {
+		message_parser_error_handler("parse txns failed: %s", "invalid payload length");
+	}
+	if(count > 0) {
+		msg->txns = calloc(count, sizeof(*msg->txns));
+		assert(msg->txns);
+	}
+	
+	for(ssize_t i = 0; i < count; ++i) {
+		msg->count = i + 1;	// to be cleaned up on error
+		ssize_t cb = parse_tx(&msg->txns[i], p, p_end);
+		if(cb <= 0) {
+			message_parser_error_handler("parse txns[%d] failed: %s", (int)i, "invalid tx");
+		}
+		p += cb;
+	}
+	msg->count = count;
+	return msg;
+	
+label_error:
+	bitcoin_message_blocktxn_cleanup(msg);
+	if(is_allocated) free(msg);
+	return NULL;
+}
+
+void bitcoin_message_blocktxn_cleanup(struct bitcoin_message_blocktxn * msg)
+{
+	if(NULL == msg) return;
+	if(msg->txns) {
+		for(ssize_t i = 0; i < msg->count; ++i) satoshi_tx_cleanup(&msg->txns[i]);
+		free(msg->txns);
+		msg->txns = NULL;
+	}
+	msg->count = 0;
+	return;
+}
+
+ssize_t bitcoin_message_blocktxn_serialize(const struct bitcoin_message_blocktxn * msg, unsigned char ** p_data)
+{
+	assert(msg);
+	ssize_t size = sizeof(uint256_t) + varint_calc_size(msg->count);
+	for(ssize_t i = 0; i < msg->count; ++i) {
+		ssize_t cb = satoshi_tx_serialize(&msg->txns[i], NULL);
+		assert(cb > 0);
+		size += cb;
+	}
+	if(NULL == p_data) return size;
+	
+	unsigned char * payload = *p_data;
+	if(NULL == payload) {
+		payload = malloc(size);
+		assert(payload);
+		*p_data = payload;
+	}
+	
+	unsigned char * p = payload;
+	memcpy(p, &msg->block_hash, sizeof(uint256_t));
+	p += sizeof(uint256_t);
+	varint_set((varint_t *)p, msg->count);
+	p += varint_calc_size(msg->count);
+	
+	for(ssize_t i = 0; i < msg->count; ++i) {
+		ssize_t cb = satoshi_tx_serialize(&msg->txns[i], &p);
+		assert(cb > 0);
+		p += cb;
+	}
+	assert((p - payload) == size);
+	return size;
+}
+
+void bitcoin_message_blocktxn_dump(const struct bitcoin_message_blocktxn * msg)
+{
+#ifdef _DEBUG
+	if(NULL == msg) return;
+	printf("==== %s() ====\n", __FUNCTION__);
+	dump_line("block_hash: ", &msg->block_hash, 32);
+	printf("count: %ld\n", (long)msg->count);
+	for(ssize_t i = 0; i < msg->count; ++i) {
+		printf("\t txns[%ld]: ", (long)i);
+		dump_line("txid=", msg->txns[i].txid, 32);
+	}
+#endif
+	return;
+}
@@ -25,34 +25,1418 @@
  * 
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	// accept4()
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <libgen.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 
 #include <sys/epoll.h>
-#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "utils.h"
 #include "satoshi-types.h"
-#include "bitcoin-consensus.h"
-#include "crypto.h"
-#include "satoshi-script.h"
+#include "bitcoin-message.h"
+#include "bitcoin-network.h"
+
+#define IO_WORKER_MAX_EVENTS	(256)
+#define PEER_READ_CHUNK_SIZE	(64 * 1024)
+#define PEER_MAX_IDLE_BUFFER_SIZE	(1024 * 1024)	// release the buffers of idle peers if larger than this size
+#define ACCEPT_BATCH_SIZE		(64)
+#define PEER_WRITEV_BATCH_SIZE	(64)	// max iovecs per writev()
+
+static volatile int s_quit;
+
+static inline int64_t get_monotonic_seconds(void)
+{
+	struct timespec ts[1] = {{ 0 }};
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return ts->tv_sec;
+}
+
+const char * peer_state_to_string(enum peer_state state)
+{
+	switch(state) {
+	case peer_state_closed: return "closed";
+	case peer_state_connecting: return "connecting";
+	case peer_state_handshaking: return "handshaking";
+	case peer_state_established: return "established";
+	default: break;
+	}
+	return "unknown";
+}
+
+/**************************************************
+ * io_worker: one edge-triggered epoll per thread
+**************************************************/
+enum io_request_type
+{
+	io_request_type_add_peer = 1,	// take the ownership of a new peer
+	io_request_type_flush,			// send the messages queued by other threads
+};
+struct io_request
+{
+	enum io_request_type type;
+	peer_info_t * peer;
+	struct io_request * next;
+};
+
+typedef struct io_worker
+{
+	bitcoin_node_t * bnode;
+	int index;
+
+	pthread_t th;
+	int running;
+
+	int efd;
+	int event_fd;	// wakeup
+
+	pthread_mutex_t mutex;	// lock the requests list
+	struct io_request * head;
+	struct io_request * tail;
+}io_worker_t;
+
+typedef struct bitcoin_node_private
+{
+	bitcoin_node_t * bnode;
+	int running;
+	int accept_thread_running;
+
+	ssize_t max_fd;		// the highest fd ever registered
+	io_worker_t * workers;
+}bitcoin_node_private_t;
+
+static void io_worker_close_peer(io_worker_t * worker, peer_info_t * peer);
+static int peer_send_version(peer_info_t * peer);
+static void peer_queue_clear(peer_info_t * peer);
+
+static int io_worker_post(io_worker_t * worker, enum io_request_type type, peer_info_t * peer)
+{
+	struct io_request * req = calloc(1, sizeof(*req));
+	assert(req);
+	req->type = type;
+	req->peer = peer;
+
+	pthread_mutex_lock(&worker->mutex);
+	if(worker->tail) worker->tail->next = req;
+	else worker->head = req;
+	worker->tail = req;
+	pthread_mutex_unlock(&worker->mutex);
+
+	uint64_t value = 1;
+	ssize_t cb = write(worker->event_fd, &value, sizeof(value));
+	(void)(cb);	// the counter can only overflow after 2^64 - 1 posts, and any value wakes up the thread
+	return 0;
+}
+
+static int io_worker_add_peer(io_worker_t * worker, peer_info_t * peer)
+{
+	bitcoin_node_t * bnode = worker->bnode;
+	bitcoin_node_private_t * priv = bnode->priv;
+	int fd = peer->fd;
+	int rc = -1;
+
+	pthread_mutex_lock(&bnode->mutex);
+	if(fd < bnode->max_fds && bnode->peers_count < bnode->max_size && NULL == bnode->peers[fd]) {
+		bnode->peers[fd] = peer;
+		__atomic_add_fetch(&bnode->peers_count, 1, __ATOMIC_RELEASE);	// read without the lock by the accepting thread
+		if(fd > priv->max_fd) priv->max_fd = fd;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&bnode->mutex);
+
+	if(rc) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): too many peers (fd=%d, count=%ld)" "\e[39m" "\n",
+			__FILE__, __LINE__, fd, (long)bnode->peers_count);
+		peer_info_unref(peer);	// close the fd
+		return -1;
+	}
+
+	struct epoll_event ev[1] = {{
+		.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+		.data.ptr = peer,
+	}};
+	rc = epoll_ctl(worker->efd, EPOLL_CTL_ADD, fd, ev);
+	if(rc) {
+		perror("epoll_ctl()");
+		io_worker_close_peer(worker, peer);
+		return -1;
+	}
+
+	// outbound connection has been established immediately (connect() returned 0)
+	if(peer->is_outbound && peer->state == peer_state_handshaking) {
+		rc = peer_send_version(peer);
+		if(rc) io_worker_close_peer(worker, peer);
+	}
+	return rc;
+}
+
+static void io_worker_close_peer(io_worker_t * worker, peer_info_t * peer)
+{
+	bitcoin_node_t * bnode = worker->bnode;
+	int fd = peer->fd;
+	if(fd < 0) return;
+
+	enum peer_state state = peer->state;
+	epoll_ctl(worker->efd, EPOLL_CTL_DEL, fd, NULL);
+
+	pthread_mutex_lock(&bnode->mutex);
+	int registered = (fd < bnode->max_fds && bnode->peers[fd] == peer);
+	if(registered) {
+		bnode->peers[fd] = NULL;
+		__atomic_sub_fetch(&bnode->peers_count, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&bnode->mutex);
+
+	// other threads may still hold references to the peer
+	pthread_mutex_lock(&peer->out_mutex);
+	peer->quit = 1;
+	peer->fd = -1;
+	peer->state = peer_state_closed;
+	peer_queue_clear(peer);
+	pthread_mutex_unlock(&peer->out_mutex);
+	close(fd);
+
+	debug_printf("peer(fd=%d) closed, state: %s", fd, peer_state_to_string(state));
+	if(state == peer_state_established && bnode->on_peer_closed) bnode->on_peer_closed(bnode, peer);
+	if(registered) peer_info_unref(peer);	// release the reference of peers[]
+}
+
+static void io_worker_process_requests(io_worker_t * worker)
+{
+	pthread_mutex_lock(&worker->mutex);
+	struct io_request * req = worker->head;
+	worker->head = worker->tail = NULL;
+	pthread_mutex_unlock(&worker->mutex);
+
+	while(req) {
+		struct io_request * next = req->next;
+		peer_info_t * peer = req->peer;
+		switch(req->type) {
+		case io_request_type_add_peer:
+			io_worker_add_peer(worker, peer);	// the reference was moved to peers[]
+			break;
+		case io_request_type_flush:
+			__atomic_store_n(&peer->flush_pending, 0, __ATOMIC_RELEASE);
+			if(!peer->quit && peer->state != peer_state_connecting) {
+				if(peer->write(peer)) io_worker_close_peer(worker, peer);
+			}
+			peer_info_unref(peer);
+			break;
+		default:
+			break;
+		}
+		free(req);
+		req = next;
+	}
+}
+
+static void io_worker_check_timeouts(io_worker_t * worker, int64_t now)
+{
+	bitcoin_node_t * bnode = worker->bnode;
+	bitcoin_node_private_t * priv = bnode->priv;
+
+	// the slots of this shard (fd % num_io_threads == index) are only modified by this thread
+	for(ssize_t fd = worker->index; fd <= priv->max_fd; fd += bnode->num_io_threads) {
+		peer_info_t * peer = bnode->peers[fd];
+		if(NULL == peer) continue;
+
+		if(peer->state != peer_state_established) {
+			if((now - peer->connected_at) <= BITCOIN_NODE_HANDSHAKE_TIMEOUT) continue;
+			fprintf(stderr, "[WARNING]: peer(fd=%d): handshake timeout (state: %s)\n",
+				(int)fd, peer_state_to_string(peer->state));
+		}else {
+			if((now - peer->last_recv) <= BITCOIN_NODE_INACTIVITY_TIMEOUT) continue;
+			fprintf(stderr, "[WARNING]: peer(fd=%d): inactivity timeout\n", (int)fd);
+		}
+		io_worker_close_peer(worker, peer);
+	}
+}
+
+static void * io_worker_thread(void * user_data)
+{
+	io_worker_t * worker = user_data;
+	bitcoin_node_t * bnode = worker->bnode;
+	assert(worker && bnode);
+
+	struct epoll_event events[IO_WORKER_MAX_EVENTS];
+	int64_t last_check = get_monotonic_seconds();
+
+	while(!__atomic_load_n(&bnode->quit, __ATOMIC_ACQUIRE) && !s_quit) {
+		int n = epoll_wait(worker->efd, events, IO_WORKER_MAX_EVENTS, 1000);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			perror("epoll_wait()");
+			break;
+		}
+
+		int has_requests = 0;
+		for(int i = 0; i < n; ++i) {
+			struct epoll_event * ev = &events[i];
+			if(ev->data.ptr == worker) {
+				uint64_t value = 0;
+				ssize_t cb = read(worker->event_fd, &value, sizeof(value));
+				(void)(cb);
+				has_requests = 1;
+				continue;
+			}
+
+			peer_info_t * peer = ev->data.ptr;
+			int rc = 0;
+			if(ev->events & EPOLLERR) rc = peer->on_error(peer, ev);
+			if(0 == rc && (ev->events & EPOLLOUT)) rc = peer->on_write(peer, ev);
+			if(0 == rc && (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) rc = peer->on_read(peer, ev);
+			if(rc || peer->quit) io_worker_close_peer(worker, peer);
+		}
+
+		// requests may close peers, process them after all events (ev->data.ptr) of this round have been handled
+		if(has_requests) io_worker_process_requests(worker);
+
+		int64_t now = get_monotonic_seconds();
+		if(now != last_check) {
+			io_worker_check_timeouts(worker, now);
+			last_check = now;
+		}
+	}
+	pthread_exit((void *)(long)0);
+}
+
+static int io_worker_init(io_worker_t * worker, bitcoin_node_t * bnode, int index)
+{
+	memset(worker, 0, sizeof(*worker));
+	worker->bnode = bnode;
+	worker->index = index;
+	pthread_mutex_init(&worker->mutex, NULL);
+
+	worker->efd = epoll_create1(EPOLL_CLOEXEC);
+	worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(worker->efd < 0 || worker->event_fd < 0) {
+		perror("io_worker_init()");
+		return -1;
+	}
+
+	struct epoll_event ev[1] = {{
+		.events = EPOLLIN,
+		.data.ptr = worker,
+	}};
+	return epoll_ctl(worker->efd, EPOLL_CTL_ADD, worker->event_fd, ev);
+}
+
+static void io_worker_cleanup(io_worker_t * worker)
+{
+	bitcoin_node_t * bnode = worker->bnode;
+	if(NULL == bnode) return;
+
+	// discard pending requests
+	struct io_request * req = worker->head;
+	while(req) {
+		struct io_request * next = req->next;
+		peer_info_unref(req->peer);
+		free(req);
+		req = next;
+	}
+	worker->head = worker->tail = NULL;
+
+	if(worker->event_fd >= 0) close(worker->event_fd);
+	if(worker->efd >= 0) close(worker->efd);
+	worker->event_fd = worker->efd = -1;
+	pthread_mutex_destroy(&worker->mutex);
+	worker->bnode = NULL;
+}
+
+/**************************************************
+ * peer_info
+**************************************************/
+static int peer_process_messages(peer_info_t * peer);
+static int peer_read(peer_info_t * peer)
+{
+	auto_buffer_t * in_buf = peer->in_buf;
+	ssize_t total = 0;
+
+	// edge-triggered: read until EAGAIN
+	while(!peer->quit) {
+		size_t used = in_buf->start_pos + in_buf->length;
+		if((in_buf->size - used) < (PEER_READ_CHUNK_SIZE / 4)) {
+			if(in_buf->start_pos > 0) {
+				memmove(in_buf->data, in_buf->data + in_buf->start_pos, in_buf->length);
+				in_buf->start_pos = 0;
+				used = in_buf->length;
+			}
+			if((in_buf->size - used) < (PEER_READ_CHUNK_SIZE / 4)
+				&& auto_buffer_resize(in_buf, used + PEER_READ_CHUNK_SIZE)) return -1;
+		}
+
+		ssize_t cb = read(peer->fd, in_buf->data + used, in_buf->size - used);
+		if(cb == 0) return -1;	// closed by the remote node
+		if(cb < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		in_buf->length += cb;
+		total += cb;
+
+		if(peer_process_messages(peer)) return -1;
+	}
+
+	if(total > 0) peer->last_recv = get_monotonic_seconds();
+	return 0;
+}
+
+/**************************************************
+ * bitcoin_node_message and the outbound queue
+**************************************************/
+struct peer_outbound_entry
+{
+	bitcoin_node_message_t * msg;
+	struct peer_outbound_entry * next;
+};
+
+bitcoin_node_message_t * bitcoin_node_message_new(uint32_t magic, const char * command, const void * payload, size_t length)
+{
+	assert(command);
+	size_t cb_command = strlen(command);
+	if(cb_command == 0 || cb_command > sizeof(((struct bitcoin_message_header *)NULL)->command)) return NULL;
+	if(NULL == payload) length = 0;
+	if(length > BITCOIN_MESSAGE_MAX_PAYLOAD_SIZE) return NULL;
+
+	bitcoin_node_message_t * msg = malloc(sizeof(*msg) + length);
+	assert(msg);
+	memset(msg, 0, sizeof(*msg));
+	msg->refs = 1;
+	msg->size = sizeof(msg->hdr) + length;
+
+	struct bitcoin_message_header * hdr = &msg->hdr;
+	hdr->magic = magic;
+	memcpy(hdr->command, command, cb_command);
+	hdr->length = length;
+	if(length > 0) memcpy(hdr->payload, payload, length);
+
+	unsigned char hash[32];
+	hash256(hdr->payload, length, hash);
+	memcpy(&hdr->checksum, hash, sizeof(hdr->checksum));
+	return msg;
+}
+
+bitcoin_node_message_t * bitcoin_node_message_addref(bitcoin_node_message_t * msg)
+{
+	assert(msg);
+	__atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+	return msg;
+}
+
+void bitcoin_node_message_unref(bitcoin_node_message_t * msg)
+{
+	if(NULL == msg) return;
+	if(__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) free(msg);
+}
+
+enum bitcoin_node_message_priority bitcoin_node_message_priority_from_type(enum bitcoin_message_type msg_type)
+{
+	switch(msg_type) {
+	case bitcoin_message_type_block:
+	case bitcoin_message_type_tx:
+	case bitcoin_message_type_headers:
+	case bitcoin_message_type_merkleblock:
+	case bitcoin_message_type_blocktxn:
+	case bitcoin_message_type_cfilter:
+	case bitcoin_message_type_cfheaders:
+		return bitcoin_node_message_priority_bulk;
+	default:
+		break;
+	}
+	return bitcoin_node_message_priority_control;
+}
+
+// lock peer->out_mutex before calling these functions
+static int peer_queue_push(peer_info_t * peer, bitcoin_node_message_t * msg, enum bitcoin_node_message_priority priority)
+{
+	bitcoin_node_t * bnode = peer->server_ctx;
+	if(peer->quit) {
+		errno = EPIPE;
+		return -1;
+	}
+	if((peer->out_bytes + msg->size) > bnode->max_send_buffer) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	// a bulk message is always accepted by an empty queue (the high watermark may be smaller than a block)
+	if(priority == bitcoin_node_message_priority_bulk && peer->out_bytes > 0
+		&& (peer->out_bytes + msg->size) > bnode->send_high_watermark)
+	{
+		peer->send_blocked = 1;
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct peer_outbound_entry * entry = calloc(1, sizeof(*entry));
+	assert(entry);
+	entry->msg = bitcoin_node_message_addref(msg);
+
+	if(priority == bitcoin_node_message_priority_bulk) {
+		if(peer->out_tail) peer->out_tail->next = entry;
+		else peer->out_head = entry;
+		peer->out_tail = entry;
+	}else {
+		// after the queued control messages, and never in front of a partially sent message
+		struct peer_outbound_entry * prev = peer->out_last_control;
+		if(NULL == prev && peer->out_offset > 0) prev = peer->out_head;
+		if(prev) {
+			entry->next = prev->next;
+			prev->next = entry;
+		}else {
+			entry->next = peer->out_head;
+			peer->out_head = entry;
+		}
+		if(NULL == entry->next) peer->out_tail = entry;
+		peer->out_last_control = entry;
+	}
+	peer->out_bytes += msg->size;
+	++peer->out_count;
+	return 0;
+}
+
+static void peer_queue_pop(peer_info_t * peer)
+{
+	struct peer_outbound_entry * entry = peer->out_head;
+	assert(entry);
+	peer->out_head = entry->next;
+	if(NULL == peer->out_head) peer->out_tail = NULL;
+	if(peer->out_last_control == entry) peer->out_last_control = NULL;
+
+	peer->out_bytes -= entry->msg->size - peer->out_offset;
+	peer->out_offset = 0;
+	--peer->out_count;
+
+	bitcoin_node_message_unref(entry->msg);
+	free(entry);
+}
+
+static void peer_queue_clear(peer_info_t * peer)
+{
+	while(peer->out_head) peer_queue_pop(peer);
+	peer->out_bytes = 0;
+}
+
+static int peer_write(peer_info_t * peer)
+{
+	bitcoin_node_t * bnode = peer->server_ctx;
+	int rc = 0;
+	int notify_writable = 0;
+
+	pthread_mutex_lock(&peer->out_mutex);
+	while(!peer->quit && peer->out_head) {
+		struct iovec iov[PEER_WRITEV_BATCH_SIZE];
+		int count = 0;
+		size_t offset = peer->out_offset;
+		for(struct peer_outbound_entry * entry = peer->out_head;
+			entry && count < PEER_WRITEV_BATCH_SIZE;
+			entry = entry->next, offset = 0)
+		{
+			iov[count].iov_base = (unsigned char *)&entry->msg->hdr + offset;
+			iov[count].iov_len = entry->msg->size - offset;
+			++count;
+		}
+
+		struct msghdr msg_hdr = { .msg_iov = iov, .msg_iovlen = count };
+		ssize_t cb = sendmsg(peer->fd, &msg_hdr, MSG_NOSIGNAL);	// writev() without SIGPIPE
+		if(cb < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;	// wait for EPOLLOUT
+			rc = -1;
+			break;
+		}
+
+		// release the messages that have been sent completely
+		while(cb > 0) {
+			size_t remaining = peer->out_head->msg->size - peer->out_offset;
+			if((size_t)cb < remaining) {
+				peer->out_offset += cb;
+				peer->out_bytes -= cb;
+				break;
+			}
+			cb -= remaining;
+			peer_queue_pop(peer);
+		}
+	}
+	if(peer->send_blocked && peer->out_bytes <= (bnode->send_high_watermark / 2)) {
+		peer->send_blocked = 0;
+		notify_writable = !peer->quit;
+	}
+	pthread_mutex_unlock(&peer->out_mutex);
+
+	if(notify_writable && bnode->on_peer_writable) bnode->on_peer_writable(bnode, peer);
+	return rc;
+}
+
+static int peer_on_read(peer_info_t * peer, struct epoll_event * ev)
+{
+	if(peer->state == peer_state_connecting) return 0;
+	return peer->read(peer);
+}
+
+static int peer_on_write(peer_info_t * peer, struct epoll_event * ev)
+{
+	if(peer->state == peer_state_connecting) {
+		int err_code = 0;
+		socklen_t len = sizeof(err_code);
+		int rc = getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err_code, &len);
+		if(rc || err_code) {
+			fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): peer(fd=%d): connect() failed: %s" "\e[39m" "\n",
+				__FILE__, __LINE__, peer->fd, strerror(rc?errno:err_code));
+			return -1;
+		}
+		peer->state = peer_state_handshaking;
+		peer->connected_at = peer->last_recv = get_monotonic_seconds();
+		return peer_send_version(peer);	// flushed by peer->write()
+	}
+	return peer->write(peer);
+}
+
+static int peer_on_error(peer_info_t * peer, struct epoll_event * ev)
+{
+	int err_code = 0;
+	socklen_t len = sizeof(err_code);
+	getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err_code, &len);
+	debug_printf("peer(fd=%d): state=%s, err=%s", peer->fd, peer_state_to_string(peer->state), strerror(err_code));
+	return -1;
+}
+
+peer_info_t * peer_info_new(int fd, void * server_ctx, const struct sockaddr * addr, socklen_t addr_len)
+{
+	peer_info_t * peer = calloc(1, sizeof(*peer));
+	assert(peer);
+
+	peer->fd = fd;
+	peer->server_ctx = server_ctx;
+	peer->refs = 1;
+	if(addr && addr_len > 0) {
+		if(addr_len > sizeof(peer->addr)) addr_len = sizeof(peer->addr);
+		memcpy(&peer->addr, addr, addr_len);
+		peer->addr_len = addr_len;
+	}
+	peer->connected_at = peer->last_recv = get_monotonic_seconds();
+
+	auto_buffer_init(peer->in_buf, 0);
+	pthread_mutex_init(&peer->out_mutex, NULL);
+
+	peer->read = peer_read;
+	peer->write = peer_write;
+	peer->on_read = peer_on_read;
+	peer->on_write = peer_on_write;
+	peer->on_error = peer_on_error;
+	return peer;
+}
+
+void peer_info_free(peer_info_t * peer)
+{
+	if(NULL == peer) return;
+	if(peer->fd >= 0) {
+		close(peer->fd);
+		peer->fd = -1;
+	}
+	auto_buffer_cleanup(peer->in_buf);
+	peer_queue_clear(peer);
+	pthread_mutex_destroy(&peer->out_mutex);
+	free(peer);
+}
+
+peer_info_t * peer_info_addref(peer_info_t * peer)
+{
+	assert(peer);
+	__atomic_add_fetch(&peer->refs, 1, __ATOMIC_RELAXED);
+	return peer;
+}
+
+void peer_info_unref(peer_info_t * peer)
+{
+	if(NULL == peer) return;
+	if(__atomic_sub_fetch(&peer->refs, 1, __ATOMIC_ACQ_REL) == 0) peer_info_free(peer);
+}
+
+/**************************************************
+ * framing and handshake
+**************************************************/
+static int peer_check_established(peer_info_t * peer)
+{
+	bitcoin_node_t * bnode = peer->server_ctx;
+	const int flags = peer_handshake_flags_version_received | peer_handshake_flags_verack_received;
+	if(peer->state != peer_state_handshaking || (peer->handshake_flags & flags) != flags) return 0;
+
+	__atomic_store_n(&peer->state, peer_state_established, __ATOMIC_RELEASE);	// read by bitcoin_node_broadcast()
+	debug_printf("peer(fd=%d) established: version=%d, start_height=%d", peer->fd, peer->version, peer->start_height);
+	if(bnode->on_peer_established) return bnode->on_peer_established(bnode, peer);
+	return 0;
+}
+
+static void set_network_address(struct bitcoin_network_address_legacy * net_addr, const struct sockaddr_storage * addr)
+{
+	memset(net_addr->ip, 0, sizeof(net_addr->ip));
+	if(addr->ss_family == AF_INET6) {
+		const struct sockaddr_in6 * addr6 = (const struct sockaddr_in6 *)addr;
+		memcpy(net_addr->ip, &addr6->sin6_addr, 16);
+		net_addr->port = addr6->sin6_port;	// network byte order
+	}else if(addr->ss_family == AF_INET) {
+		// IPv4-mapped IPv6 address
+		const struct sockaddr_in * addr4 = (const struct sockaddr_in *)addr;
+		net_addr->ip[10] = (char)0xff;
+		net_addr->ip[11] = (char)0xff;
+		memcpy(&net_addr->ip[12], &addr4->sin_addr, 4);
+		net_addr->port = addr4->sin_port;
+	}
+}
+
+static int peer_send_version(peer_info_t * peer)
+{
+	bitcoin_node_t * bnode = peer->server_ctx;
+	struct bitcoin_message_version msg_ver[1];
+	memset(msg_ver, 0, sizeof(msg_ver));
+
+	msg_ver->version = bnode->protocol_version;
+	msg_ver->services = bnode->services;
+	msg_ver->timestamp = time(NULL);
+	set_network_address(&msg_ver->addr_recv, &peer->addr);
+	msg_ver->addr_from.services = bnode->services;
+	msg_ver->nonce = bnode->nonce;
+
+	const char * user_agent = bnode->user_agent?bnode->user_agent:"";
+	msg_ver->user_agent = varstr_set(NULL, (const unsigned char *)user_agent, strlen(user_agent));
+	msg_ver->start_height = bnode->start_height;
+	msg_ver->relay = 1;
+
+	unsigned char * payload = NULL;
+	ssize_t cb = bitcoin_message_version_serialize(msg_ver, &payload);
+	bitcoin_message_version_cleanup(msg_ver);
+	if(cb <= 0 || NULL == payload) return -1;
+
+	int rc = bitcoin_node_send_message(bnode, peer, "version", payload, cb);
+	free(payload);
+	if(0 == rc) peer->handshake_flags |= peer_handshake_flags_version_sent;
+	return rc;
+}
+
+static int on_message_version(peer_info_t * peer, const struct bitcoin_message_header * msg_hdr)
+{
+	bitcoin_node_t * bnode = peer->server_ctx;
+	if(peer->handshake_flags & peer_handshake_flags_version_received) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): peer(fd=%d): duplicate version message" "\e[39m" "\n",
+			__FILE__, __LINE__, peer->fd);
+		return -1;
+	}
+
+	struct bitcoin_message_version msg_ver[1];
+	memset(msg_ver, 0, sizeof(msg_ver));
+	if(NULL == bitcoin_message_version_parse(msg_ver, msg_hdr->payload, msg_hdr->length)) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): peer(fd=%d): invalid version message" "\e[39m" "\n",
+			__FILE__, __LINE__, peer->fd);
+		return -1;
+	}
+
+	int rc = 0;
+	if(msg_ver->nonce == bnode->nonce) {
+		fprintf(stderr, "[WARNING]: peer(fd=%d): connected to self\n", peer->fd);
+		rc = -1;
+	}else if(msg_ver->version < BITCOIN_NODE_MIN_PROTOCOL_VERSION) {
+		fprintf(stderr, "[WARNING]: peer(fd=%d): obsolete protocol version %d\n", peer->fd, msg_ver->version);
+		rc = -1;
+	}
+	peer->version = msg_ver->version;
+	peer->services = msg_ver->services;
+	peer->start_height = msg_ver->start_height;
+	bitcoin_message_version_cleanup(msg_ver);
+	if(rc) return rc;
+
+	peer->handshake_flags |= peer_handshake_flags_version_received;
+
+	// inbound: reply our version after the remote node's
+	if(!(peer->handshake_flags & peer_handshake_flags_version_sent)) rc = peer_send_version(peer);
+	if(0 == rc) rc = bitcoin_node_send_message(bnode, peer, "verack", NULL, 0);
+	if(0 == rc) rc = peer_check_established(peer);
+	return rc;
+}
+
+static int on_message_verack(peer_info_t * peer, const struct bitcoin_message_header * msg_hdr)
+{
+	peer->handshake_flags |= peer_handshake_flags_verack_received;
+	return peer_check_established(peer);
+}
+
+static int peer_dispatch_message(peer_info_t * peer, const struct bitcoin_message_header * msg_hdr)
+{
+	bitcoin_node_t * bnode = peer->server_ctx;
+
+	enum bitcoin_message_type msg_type = bitcoin_message_type_from_command(msg_hdr->command);
+
+	switch(msg_type) {
+	case bitcoin_message_type_version: return on_message_version(peer, msg_hdr);
+	case bitcoin_message_type_verack: return on_message_verack(peer, msg_hdr);
+	default:
+		break;
+	}
+
+	if(!(peer->handshake_flags & peer_handshake_flags_version_received)) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): peer(fd=%d): '%.12s' received before version" "\e[39m" "\n",
+			__FILE__, __LINE__, peer->fd, msg_hdr->command);
+		return -1;
+	}
+
+	// BIP 0031
+	if(msg_type == bitcoin_message_type_ping) {
+		return bitcoin_node_send_message(bnode, peer, "pong", msg_hdr->payload, msg_hdr->length);
+	}
+
+	if(bnode->on_message) return bnode->on_message(bnode, peer, msg_hdr);
+	return 0;
+}
+
+static int peer_process_messages(peer_info_t * peer)
+{
+	bitcoin_node_t * bnode = peer->server_ctx;
+	auto_buffer_t * in_buf = peer->in_buf;
+	const size_t hdr_size = sizeof(struct bitcoin_message_header);
+
+	while(!peer->quit && in_buf->length >= hdr_size) {
+		const struct bitcoin_message_header * msg_hdr = (const struct bitcoin_message_header *)(in_buf->data + in_buf->start_pos);
+		if(0 == peer->in_hdr.magic) {	// a new message
+			if(msg_hdr->magic != bnode->magic) {
+				fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): peer(fd=%d): invalid network magic: 0x%.8x" "\e[39m" "\n",
+					__FILE__, __LINE__, peer->fd, msg_hdr->magic);
+				return -1;
+			}
+			if(msg_hdr->length > BITCOIN_NODE_MAX_PAYLOAD_SIZE) {
+				fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): peer(fd=%d): payload too large: %u" "\e[39m" "\n",
+					__FILE__, __LINE__, peer->fd, msg_hdr->length);
+				return -1;
+			}
+			memcpy(&peer->in_hdr, msg_hdr, hdr_size);
+		}
+
+		size_t msg_size = hdr_size + peer->in_hdr.length;
+		if(in_buf->length < msg_size) {
+			// pre-size the buffer, the rest of the payload will be read in place
+			if((in_buf->start_pos + msg_size) > in_buf->size) {
+				if(in_buf->start_pos > 0) {
+					memmove(in_buf->data, in_buf->data + in_buf->start_pos, in_buf->length);
+					in_buf->start_pos = 0;
+				}
+				if(auto_buffer_resize(in_buf, msg_size)) return -1;
+			}
+			break;
+		}
+
+		unsigned char hash[32];
+		hash256(msg_hdr->payload, msg_hdr->length, hash);
+		if(memcmp(hash, &msg_hdr->checksum, sizeof(msg_hdr->checksum)) != 0) {
+			fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): peer(fd=%d): checksum mismatch" "\e[39m" "\n",
+				__FILE__, __LINE__, peer->fd);
+			return -1;
+		}
+
+		int rc = peer_dispatch_message(peer, msg_hdr);
+		memset(&peer->in_hdr, 0, sizeof(peer->in_hdr));
+		in_buf->start_pos += msg_size;
+		in_buf->length -= msg_size;
+		if(rc) return -1;
+	}
+
+	if(in_buf->length == 0) {
+		in_buf->start_pos = 0;
+		if(in_buf->size > PEER_MAX_IDLE_BUFFER_SIZE) auto_buffer_cleanup(in_buf);
+	}
+	return 0;
+}
+
+/**************************************************
+ * bitcoin_node
+**************************************************/
+static int bitcoin_node_add_peer(bitcoin_node_t * bnode, int fd,
+	const struct sockaddr * addr, socklen_t addr_len,
+	int is_outbound, enum peer_state state)
+{
+	bitcoin_node_private_t * priv = bnode->priv;
+
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	peer_info_t * peer = peer_info_new(fd, bnode, addr, addr_len);
+	peer->is_outbound = is_outbound;
+	peer->state = state;
+
+	io_worker_t * worker = &priv->workers[fd % bnode->num_io_threads];
+	peer->priv = worker;
+	return io_worker_post(worker, io_request_type_add_peer, peer);
+}
+
+static int on_accept(bitcoin_node_t * bnode, struct epoll_event * ev)
+{
+	int server_fd = ev->data.fd;
+	for(int i = 0; i < ACCEPT_BATCH_SIZE; ++i) {
+		struct sockaddr_storage addr[1];
+		socklen_t addr_len = sizeof(addr);
+		memset(addr, 0, sizeof(addr));
+
+		int fd = accept4(server_fd, (struct sockaddr *)addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+
+		if(__atomic_load_n(&bnode->peers_count, __ATOMIC_RELAXED) >= bnode->max_size) {	// fast path, re-checked by the io thread
+			close(fd);
+			continue;
+		}
+		bitcoin_node_add_peer(bnode, fd, (struct sockaddr *)addr, addr_len, 0, peer_state_handshaking);
+	}
+	return 0;
+}
+
+static int on_accept_error(bitcoin_node_t * bnode, struct epoll_event * ev)
+{
+	int err_code = errno;
+	fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): accept(fd=%d) failed: %s" "\e[39m" "\n",
+		__FILE__, __LINE__, ev->data.fd, strerror(err_code));
+
+	// out of fds: the listening socket is level-triggered, back off instead of spinning
+	if(err_code == EMFILE || err_code == ENFILE || err_code == ENOBUFS || err_code == ENOMEM) {
+		usleep(100 * 1000);
+	}
+	return 0;
+}
+
+static uint64_t generate_nonce(void)
+{
+	uint64_t nonce = 0;
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if(fd >= 0) {
+		ssize_t cb = read(fd, &nonce, sizeof(nonce));
+		(void)(cb);
+		close(fd);
+	}
+	if(0 == nonce) {
+		struct timespec ts[1] = {{ 0 }};
+		clock_gettime(CLOCK_REALTIME, ts);
+		nonce = ((uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec) ^ ((uint64_t)getpid() << 32);
+	}
+	return nonce;
+}
+
+bitcoin_node_t * bitcoin_node_new(size_t max_size, int num_io_threads, void * user_data)
+{
+	if(num_io_threads <= 0) num_io_threads = BITCOIN_NODE_DEFAULT_IO_THREADS;
+
+	bitcoin_node_t * bnode = calloc(1, sizeof(*bnode));
+	assert(bnode);
+	bnode->user_data = user_data;
+
+	struct rlimit limit[1];
+	memset(limit, 0, sizeof(limit));
+	ssize_t max_fds = 1024;
+	if(0 == getrlimit(RLIMIT_NOFILE, limit)) {
+		max_fds = (limit->rlim_cur == RLIM_INFINITY)?(1 << 20):(ssize_t)limit->rlim_cur;
+		if(max_fds > (1 << 20)) max_fds = (1 << 20);
+	}
+	if(0 == max_size || max_size > max_fds) max_size = max_fds;
+
+	bnode->max_fds = max_fds;
+	bnode->max_size = max_size;
+	bnode->peers = calloc(max_fds, sizeof(*bnode->peers));
+	assert(bnode->peers);
+
+	pthread_mutex_init(&bnode->mutex, NULL);
+	bnode->listening_efd = epoll_create1(EPOLL_CLOEXEC);
+	assert(bnode->listening_efd >= 0);
+	for(int i = 0; i < BITCOIN_NODE_MAX_LISTENING_FDS; ++i) bnode->server_fds[i] = -1;
+
+	bnode->magic = BITCOIN_MESSAGE_MAGIC_MAINNET;
+	bnode->protocol_version = 70015;
+	bnode->services = bitcoin_message_service_type_node_witness;
+	bnode->nonce = generate_nonce();
+	bnode->user_agent = "/bitcoin-clib:0.1.0/";
+	bnode->send_high_watermark = BITCOIN_NODE_SEND_HIGH_WATERMARK;
+	bnode->max_send_buffer = BITCOIN_NODE_MAX_SEND_BUFFER;
+
+	bnode->on_accept = on_accept;
+	bnode->on_error = on_accept_error;
+
+	bitcoin_node_private_t * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->bnode = bnode;
+	priv->max_fd = -1;
+	bnode->priv = priv;
+
+	bnode->num_io_threads = num_io_threads;
+	priv->workers = calloc(num_io_threads, sizeof(*priv->workers));
+	assert(priv->workers);
+	for(int i = 0; i < num_io_threads; ++i) {
+		int rc = io_worker_init(&priv->workers[i], bnode, i);
+		assert(0 == rc);
+	}
+	return bnode;
+}
+
+void bitcoin_node_free(bitcoin_node_t * bnode)
+{
+	if(NULL == bnode) return;
+	bitcoin_node_private_t * priv = bnode->priv;
+
+	__atomic_store_n(&bnode->quit, 1, __ATOMIC_RELEASE);
+	if(priv) {
+		void * exit_code = NULL;
+		if(priv->accept_thread_running) {
+			pthread_join(bnode->th, &exit_code);
+			priv->accept_thread_running = 0;
+		}
+
+		for(int i = 0; i < bnode->num_io_threads; ++i) {
+			io_worker_t * worker = &priv->workers[i];
+			if(!worker->running) continue;
+			uint64_t value = 1;
+			ssize_t cb = write(worker->event_fd, &value, sizeof(value));
+			(void)(cb);
+			pthread_join(worker->th, &exit_code);
+			worker->running = 0;
+		}
+
+		// all threads have been stopped
+		for(ssize_t fd = 0; fd <= priv->max_fd; ++fd) {
+			peer_info_t * peer = bnode->peers[fd];
+			if(peer) io_worker_close_peer(peer->priv, peer);
+		}
+		for(int i = 0; i < bnode->num_io_threads; ++i) io_worker_cleanup(&priv->workers[i]);
+		free(priv->workers);
+		free(priv);
+		bnode->priv = NULL;
+	}
+
+	for(int i = 0; i < bnode->fds_count; ++i) {
+		if(bnode->server_fds[i] >= 0) close(bnode->server_fds[i]);
+		bnode->server_fds[i] = -1;
+	}
+	if(bnode->listening_efd >= 0) close(bnode->listening_efd);
+	bnode->listening_efd = -1;
+
+	free(bnode->peers);
+	pthread_mutex_destroy(&bnode->mutex);
+	free(bnode);
+}
+
+static int bitcoin_node_listen(bitcoin_node_t * bnode, const char * serv_name, const char * port)
+{
+	struct addrinfo hints, * serv_info = NULL, * pai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	int rc = getaddrinfo(serv_name, port, &hints, &serv_info);
+	if(rc) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): getaddrinfo(%s:%s) failed: %s" "\e[39m" "\n",
+			__FILE__, __LINE__, serv_name, port, gai_strerror(rc));
+		return -1;
+	}
+
+	for(pai = serv_info; pai && bnode->fds_count < BITCOIN_NODE_MAX_LISTENING_FDS; pai = pai->ai_next) {
+		int fd = socket(pai->ai_family, pai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, pai->ai_protocol);
+		if(fd < 0) continue;
+
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if(pai->ai_family == AF_INET6) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+
+		if(bind(fd, pai->ai_addr, pai->ai_addrlen) || listen(fd, SOMAXCONN)) {
+			perror("bind() / listen()");
+			close(fd);
+			continue;
+		}
+
+		int index = bnode->fds_count;
+		socklen_t addr_len = sizeof(bnode->addrs[index]);
+		getsockname(fd, (struct sockaddr *)&bnode->addrs[index], &addr_len);
+		getnameinfo((struct sockaddr *)&bnode->addrs[index], addr_len,
+			bnode->hosts[index], sizeof(bnode->hosts[index]),
+			bnode->servs[index], sizeof(bnode->servs[index]),
+			NI_NUMERICHOST | NI_NUMERICSERV);
+
+		// level-triggered, accept() in batches
+		struct epoll_event ev[1] = {{
+			.events = EPOLLIN,
+			.data.fd = fd,
+		}};
+		rc = epoll_ctl(bnode->listening_efd, EPOLL_CTL_ADD, fd, ev);
+		if(rc) {
+			perror("epoll_ctl()");
+			close(fd);
+			continue;
+		}
+		bnode->server_fds[index] = fd;
+		++bnode->fds_count;
+		fprintf(stderr, "[INFO]: listening on %s:%s ...\n", bnode->hosts[index], bnode->servs[index]);
+	}
+	freeaddrinfo(serv_info);
+	return (bnode->fds_count > 0)?0:-1;
+}
+
+static int accept_loop(bitcoin_node_t * bnode)
+{
+	struct epoll_event events[BITCOIN_NODE_MAX_LISTENING_FDS];
+	while(!__atomic_load_n(&bnode->quit, __ATOMIC_ACQUIRE) && !s_quit) {
+		int n = epoll_wait(bnode->listening_efd, events, BITCOIN_NODE_MAX_LISTENING_FDS, 1000);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			perror("epoll_wait()");
+			return -1;
+		}
+		for(int i = 0; i < n; ++i) {
+			int rc = bnode->on_accept(bnode, &events[i]);
+			if(rc && bnode->on_error) bnode->on_error(bnode, &events[i]);
+		}
+	}
+	return 0;
+}
+
+static void * accept_thread(void * user_data)
+{
+	bitcoin_node_t * bnode = user_data;
+	int rc = accept_loop(bnode);
+	pthread_exit((void *)(long)rc);
+}
+
+int bitcoin_node_run(bitcoin_node_t * bnode, const char * serv_name, const char * port, int async_mode)
+{
+	assert(bnode && bnode->priv);
+	bitcoin_node_private_t * priv = bnode->priv;
+	if(priv->running) return -1;
+
+	int rc = 0;
+	if(port) {
+		rc = bitcoin_node_listen(bnode, serv_name, port);
+		if(rc) return rc;
+	}
+
+	for(int i = 0; i < bnode->num_io_threads; ++i) {
+		io_worker_t * worker = &priv->workers[i];
+		rc = pthread_create(&worker->th, NULL, io_worker_thread, worker);
+		assert(0 == rc);
+		worker->running = 1;
+	}
+	priv->running = 1;
+
+	bnode->async_mode = async_mode;
+	if(async_mode) {
+		rc = pthread_create(&bnode->th, NULL, accept_thread, bnode);
+		assert(0 == rc);
+		priv->accept_thread_running = 1;
+		return 0;
+	}
+	return accept_loop(bnode);
+}
+
+void bitcoin_node_terminate(void)
+{
+	s_quit = 1;
+}
+
+int bitcoin_node_connect(bitcoin_node_t * bnode, const char * host, const char * port)
+{
+	assert(bnode && host && port);
+	struct addrinfo hints, * serv_info = NULL, * pai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int rc = getaddrinfo(host, port, &hints, &serv_info);
+	if(rc) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): getaddrinfo(%s:%s) failed: %s" "\e[39m" "\n",
+			__FILE__, __LINE__, host, port, gai_strerror(rc));
+		return -1;
+	}
+
+	int fd = -1;
+	for(pai = serv_info; pai; pai = pai->ai_next) {
+		fd = socket(pai->ai_family, pai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, pai->ai_protocol);
+		if(fd < 0) continue;
+
+		rc = connect(fd, pai->ai_addr, pai->ai_addrlen);
+		if(0 == rc || errno == EINPROGRESS) {
+			rc = bitcoin_node_add_peer(bnode, fd, pai->ai_addr, pai->ai_addrlen, 1,
+				(0 == rc)?peer_state_handshaking:peer_state_connecting);
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(serv_info);
+
+	if(fd < 0) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): connect to %s:%s failed" "\e[39m" "\n",
+			__FILE__, __LINE__, host, port);
+	}
+	return fd;
+}
+
+peer_info_t * bitcoin_node_get_peer(bitcoin_node_t * bnode, int fd)
+{
+	peer_info_t * peer = NULL;
+	if(fd < 0 || fd >= bnode->max_fds) return NULL;
+
+	pthread_mutex_lock(&bnode->mutex);
+	peer = bnode->peers[fd];
+	if(peer) peer_info_addref(peer);
+	pthread_mutex_unlock(&bnode->mutex);
+	return peer;
+}
+
+int bitcoin_node_send(bitcoin_node_t * bnode, peer_info_t * peer,
+	bitcoin_node_message_t * msg, enum bitcoin_node_message_priority priority)
+{
+	assert(bnode && peer && msg);
+
+	pthread_mutex_lock(&peer->out_mutex);
+	int rc = peer_queue_push(peer, msg, priority);
+	pthread_mutex_unlock(&peer->out_mutex);
+	if(rc) return rc;
+
+	io_worker_t * worker = peer->priv;
+	assert(worker);
+	if(worker->running && pthread_equal(pthread_self(), worker->th)) {
+		if(peer->state == peer_state_connecting) return 0;	// will be flushed once connected
+		return peer->write(peer);
+	}
+
+	// let the io thread flush it, coalesce the requests
+	if(0 == __atomic_exchange_n(&peer->flush_pending, 1, __ATOMIC_ACQ_REL)) {
+		rc = io_worker_post(worker, io_request_type_flush, peer_info_addref(peer));
+	}
+	return rc;
+}
+
+ssize_t bitcoin_node_broadcast_message(bitcoin_node_t * bnode,
+	bitcoin_node_message_t * msg, enum bitcoin_node_message_priority priority)
+{
+	bitcoin_node_private_t * priv = bnode->priv;
+	ssize_t count = 0;
+
+	pthread_mutex_lock(&bnode->mutex);
+	peer_info_t ** peers = calloc(bnode->peers_count + 1, sizeof(*peers));
+	assert(peers);
+	for(ssize_t fd = 0; fd <= priv->max_fd; ++fd) {
+		peer_info_t * peer = bnode->peers[fd];
+		if(peer && __atomic_load_n(&peer->state, __ATOMIC_ACQUIRE) == peer_state_established) peers[count++] = peer_info_addref(peer);
+	}
+	pthread_mutex_unlock(&bnode->mutex);
+
+	// every peer's queue shares the same serialized message
+	ssize_t num_sent = 0;
+	for(ssize_t i = 0; i < count; ++i) {
+		if(0 == bitcoin_node_send(bnode, peers[i], msg, priority)) ++num_sent;
+		peer_info_unref(peers[i]);
+	}
+	free(peers);
+	return num_sent;
+}
+
+int bitcoin_node_send_message(bitcoin_node_t * bnode, peer_info_t * peer,
+	const char * command, const void * payload, size_t length)
+{
+	assert(bnode && peer && command);
+	bitcoin_node_message_t * msg = bitcoin_node_message_new(bnode->magic, command, payload, length);
+	if(NULL == msg) return -1;
+
+	int rc = bitcoin_node_send(bnode, peer, msg,
+		bitcoin_node_message_priority_from_type(bitcoin_message_type_from_command(msg->hdr.command)));
+	bitcoin_node_message_unref(msg);
+	return rc;
+}
+
+ssize_t bitcoin_node_broadcast(bitcoin_node_t * bnode, const char * command, const void * payload, size_t length)
+{
+	bitcoin_node_message_t * msg = bitcoin_node_message_new(bnode->magic, command, payload, length);
+	if(NULL == msg) return -1;
+
+	ssize_t count = bitcoin_node_broadcast_message(bnode, msg,
+		bitcoin_node_message_priority_from_type(bitcoin_message_type_from_command(msg->hdr.command)));
+	bitcoin_node_message_unref(msg);
+	return count;
+}
 
 
 #if defined(_TEST_BITCOIN_NETWORK) && defined(_STAND_ALONE)
+#include <signal.h>
+
+static int s_established[2];	// [0]: inbound (server), [1]: outbound (client)
+static int s_pongs;
+static int s_first_outbound_fd = -1;
+static int s_large_messages;
+static int s_writable;
+#define TEST_LARGE_PAYLOAD_SIZE	(4 * 1024 * 1024 + 17)
+
+static int test_on_peer_established(bitcoin_node_t * bnode, peer_info_t * peer)
+{
+	__atomic_add_fetch(&s_established[peer->is_outbound], 1, __ATOMIC_RELAXED);
+	if(!peer->is_outbound) return 0;
+
+	int fd = -1;
+	__atomic_compare_exchange_n(&s_first_outbound_fd, &fd, peer->fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	uint64_t nonce = peer->fd;
+	return bitcoin_node_send_message(bnode, peer, "ping", &nonce, sizeof(nonce));
+}
+
+static int test_on_message(bitcoin_node_t * bnode, peer_info_t * peer, const struct bitcoin_message_header * msg_hdr)
+{
+	if(strncmp(msg_hdr->command, "pong", sizeof(msg_hdr->command)) == 0) {
+		assert(msg_hdr->length == sizeof(uint64_t));
+		__atomic_add_fetch(&s_pongs, 1, __ATOMIC_RELAXED);
+	}else if(strncmp(msg_hdr->command, "block", sizeof(msg_hdr->command)) == 0) {
+		assert(msg_hdr->length == TEST_LARGE_PAYLOAD_SIZE);
+		for(uint32_t i = 0; i < msg_hdr->length; i += 4096) assert(msg_hdr->payload[i] == (uint8_t)(i / 4096));
+		__atomic_add_fetch(&s_large_messages, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static void test_on_peer_writable(bitcoin_node_t * bnode, peer_info_t * peer)
+{
+	__atomic_add_fetch(&s_writable, 1, __ATOMIC_RELEASE);
+}
+
+static int wait_until(int * value, int expected, double timeout)
+{
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	while(__atomic_load_n(value, __ATOMIC_ACQUIRE) < expected) {
+		if(app_timer_stop(timer) > timeout) return -1;
+		usleep(1000);
+	}
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	
+	int num_peers = 1000;
+	if(argc > 1) num_peers = atoi(argv[1]);
+	signal(SIGPIPE, SIG_IGN);
+
+	// each connection takes 2 fds in this process
+	struct rlimit limit[1];
+	getrlimit(RLIMIT_NOFILE, limit);
+	limit->rlim_cur = limit->rlim_max;
+	setrlimit(RLIMIT_NOFILE, limit);
+	getrlimit(RLIMIT_NOFILE, limit);
+	if(limit->rlim_cur != RLIM_INFINITY && num_peers > (limit->rlim_cur - 64) / 2) num_peers = (limit->rlim_cur - 64) / 2;
+
+	// test 0. command ==> type (constant time lookup)
+	for(int type = 1; type < bitcoin_message_types_count; ++type) {
+		assert(bitcoin_message_type_from_string(bitcoin_message_type_to_string(type)) == type);
+	}
+	assert(bitcoin_message_type_from_command("pingpong\0\0\0\0") == bitcoin_message_type_unknown);
+	assert(bitcoin_message_type_from_command("ping\0\0\0\0\0\0\0x") == bitcoin_message_type_unknown);
+
+	bitcoin_node_t * server = bitcoin_node_new(0, 2, NULL);
+	bitcoin_node_t * client = bitcoin_node_new(0, 4, NULL);
+	assert(server && client);
+	server->magic = client->magic = BITCOIN_MESSAGE_MAGIC_REGTEST;
+	server->on_peer_established = client->on_peer_established = test_on_peer_established;
+	server->on_message = client->on_message = test_on_message;
+	client->on_peer_writable = test_on_peer_writable;
+
+	int rc = bitcoin_node_run(server, "127.0.0.1", "0", 1);
+	assert(0 == rc);
+	rc = bitcoin_node_run(client, NULL, NULL, 1);
+	assert(0 == rc);
+
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	for(int i = 0; i < num_peers; ++i) {
+		int fd = bitcoin_node_connect(client, "127.0.0.1", server->servs[0]);
+		assert(fd >= 0);
+	}
+
+	// test 1. handshakes, the first ping/pong is sent in the io threads
+	rc = wait_until(&s_established[1], num_peers, 20.0);
+	if(0 == rc) rc = wait_until(&s_established[0], num_peers, 20.0);
+	if(0 == rc) rc = wait_until(&s_pongs, num_peers, 20.0);
+	fprintf(stderr, "peers: %d, established: %d / %d, pongs: %d, time_elapsed: %.6f s\n",
+		num_peers, __atomic_load_n(&s_established[0], __ATOMIC_ACQUIRE), __atomic_load_n(&s_established[1], __ATOMIC_ACQUIRE),
+		__atomic_load_n(&s_pongs, __ATOMIC_ACQUIRE), app_timer_stop(timer));
+	assert(0 == rc);
+	assert(__atomic_load_n(&server->peers_count, __ATOMIC_ACQUIRE) == num_peers);
+	assert(__atomic_load_n(&client->peers_count, __ATOMIC_ACQUIRE) == num_peers);
+
+	// test 2. broadcast from a non-io thread (one serialized message shared by all peers)
+	app_timer_start(timer);
+	uint64_t nonce = 0x1234;
+	bitcoin_node_message_t * ping = bitcoin_node_message_new(client->magic, "ping", &nonce, sizeof(nonce));
+	assert(ping);
+	ssize_t count = bitcoin_node_broadcast_message(client, ping, bitcoin_node_message_priority_control);
+	assert(count == num_peers);
+	rc = wait_until(&s_pongs, num_peers * 2, 20.0);
+	fprintf(stderr, "broadcast: %ld pings, pongs: %d, time_elapsed: %.6f s\n",
+		(long)count, __atomic_load_n(&s_pongs, __ATOMIC_ACQUIRE), app_timer_stop(timer));
+	assert(0 == rc);
+	assert(__atomic_load_n(&ping->refs, __ATOMIC_ACQUIRE) == 1);	// released by every peer's queue
+	bitcoin_node_message_unref(ping);
+
+	// test 3. large messages (received in place, sent in several rounds of EPOLLOUT)
+	//   bulk messages are refused above the high watermark, and resumed by on_peer_writable()
+	unsigned char * payload = calloc(TEST_LARGE_PAYLOAD_SIZE, 1);
+	assert(payload);
+	for(uint32_t i = 0; i < TEST_LARGE_PAYLOAD_SIZE; i += 4096) payload[i] = (uint8_t)(i / 4096);
+	bitcoin_node_message_t * block = bitcoin_node_message_new(client->magic, "block", payload, TEST_LARGE_PAYLOAD_SIZE);
+	assert(block);
+	free(payload);
+
+	peer_info_t * peer = bitcoin_node_get_peer(client, __atomic_load_n(&s_first_outbound_fd, __ATOMIC_ACQUIRE));
+	assert(peer);
+	int num_blocked = 0;
+	app_timer_start(timer);
+	for(int i = 0; i < 8; ++i) {
+		int writable = __atomic_load_n(&s_writable, __ATOMIC_ACQUIRE);
+		rc = bitcoin_node_send(client, peer, block, bitcoin_node_message_priority_bulk);
+		if(rc) {
+			assert(errno == EAGAIN);
+			++num_blocked;
+			rc = wait_until(&s_writable, writable + 1, 20.0);
+			assert(0 == rc);
+			--i;	// retry
+		}
+	}
+	// control messages are never blocked by the high watermark
+	rc = bitcoin_node_send_message(client, peer, "ping", &nonce, sizeof(nonce));
+	assert(0 == rc);
+	peer_info_unref(peer);
+
+	rc = wait_until(&s_large_messages, 8, 20.0);
+	fprintf(stderr, "large messages: %d x %d bytes, blocked: %d, time_elapsed: %.6f s\n",
+		__atomic_load_n(&s_large_messages, __ATOMIC_ACQUIRE), TEST_LARGE_PAYLOAD_SIZE, num_blocked, app_timer_stop(timer));
+	assert(0 == rc);
+	assert(num_blocked > 0);
+	bitcoin_node_message_unref(block);
+
+	// test 4. the server side closes all connections once the client was stopped
+	bitcoin_node_free(client);
+	for(int i = 0; i < 5000 && __atomic_load_n(&server->peers_count, __ATOMIC_ACQUIRE) > 0; ++i) usleep(1000);
+	ssize_t peers_count = __atomic_load_n(&server->peers_count, __ATOMIC_ACQUIRE);
+	fprintf(stderr, "server peers after the client was stopped: %ld\n", (long)peers_count);
+	assert(peers_count == 0);
+
+	bitcoin_node_free(server);
 	return 0;
 }
 #endif
-
@@ -0,0 +1,760 @@
+/*
+ * block_cache.c
+ *
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "block_cache.h"
+#include "utils.h"
+
+/**
+ * cache_node:
+ *   the entry and all links used by the shard,
+ *   entry.priv points to the node itself.
+ */
+struct block_cache_shard;
+typedef struct cache_node
+{
+	block_cache_entry_t entry[1];
+	struct block_cache_shard * shard;
+	uint64_t hkey;
+
+	struct cache_node * hash_next;
+	struct cache_node * lru_prev;	// towards the MRU end
+	struct cache_node * lru_next;	// towards the LRU end
+
+	long refs;
+	int linked;		// still in the hash table and the lru list
+}cache_node_t;
+
+typedef struct block_cache_shard
+{
+	pthread_mutex_t mutex;
+
+	size_t buckets_size;	// power of 2
+	size_t count;
+	cache_node_t ** buckets;
+
+	cache_node_t * lru_head;	// the most recently used
+	cache_node_t * lru_tail;	// the least recently used
+
+	int64_t total_bytes;
+	int64_t max_bytes;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+
+	// the keys of the blocks recently sent uncached by send_to(), a block is cached on its second access
+	uint64_t ghost_keys[BLOCK_CACHE_GHOST_KEYS];
+	int ghost_pos;
+}block_cache_shard_t;
+
+typedef struct block_cache_private
+{
+	block_cache_t * cache;
+	block_files_t files[1];		// opened blk files
+
+	int num_shards;
+	block_cache_shard_t * shards;
+	int64_t max_bytes;
+
+	pthread_mutex_t stats_mutex;
+	uint64_t bytes_read;
+	uint64_t bytes_sent;
+	uint64_t bytes_sendfile;
+}block_cache_private_t;
+
+#define BLOCK_CACHE_BUCKETS_INIT_SIZE	(256)
+
+static inline uint64_t block_pos_hash(int64_t file_index, int64_t start_pos)
+{
+	// splitmix64 finalizer
+	uint64_t h = (uint64_t)file_index * 0x9E3779B97F4A7C15ULL ^ (uint64_t)start_pos;
+	h ^= h >> 30; h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 27; h *= 0x94D049BB133111EBULL;
+	h ^= h >> 31;
+	return h;
+}
+
+static inline block_cache_shard_t * get_shard(block_cache_private_t * priv, uint64_t hkey)
+{
+	return &priv->shards[(hkey >> 32) % (uint64_t)priv->num_shards];
+}
+
+/***************************************************************
+ * blk files
+****************************************************************/
+static ssize_t block_file_read(block_cache_private_t * priv,
+	int64_t file_index, int64_t start_pos, uint32_t block_size,
+	unsigned char * data)
+{
+	int fd = block_files_get_fd(priv->files, file_index);
+	if(fd < 0) return -1;
+
+	ssize_t length = 0;
+	while(length < block_size)
+	{
+		ssize_t cb = pread(fd, data + length, block_size - length, start_pos + length);
+		if(cb < 0) {
+			if(errno == EINTR) continue;
+			perror("block_file_read()::pread()");
+			length = -1;
+			break;
+		}
+		if(0 == cb) break;	// EOF
+		length += cb;
+	}
+	block_files_put_fd(priv->files, file_index, fd);
+	if(length < 0) return -1;
+	if(length != block_size) {
+		fprintf(stderr, "\e[31m" "[ERROR]::%s(): invalid block pos: file=%d, start=%ld, size=%u" "\e[39m" "\n",
+			__FUNCTION__, (int)file_index, (long)start_pos, block_size);
+		return -1;
+	}
+
+	pthread_mutex_lock(&priv->stats_mutex);
+	priv->bytes_read += length;
+	pthread_mutex_unlock(&priv->stats_mutex);
+	return length;
+}
+
+/***************************************************************
+ * cache_node
+****************************************************************/
+static cache_node_t * cache_node_new(int64_t file_index, int64_t start_pos, uint32_t block_size)
+{
+	cache_node_t * node = calloc(1, sizeof(*node));
+	assert(node);
+
+	node->entry->data = malloc(block_size);
+	if(NULL == node->entry->data) {
+		free(node);
+		return NULL;
+	}
+	node->entry->file_index = file_index;
+	node->entry->start_pos = start_pos;
+	node->entry->block_size = block_size;
+	node->entry->priv = node;
+
+	node->hkey = block_pos_hash(file_index, start_pos);
+	node->refs = 1;
+	return node;
+}
+
+static void cache_node_free(cache_node_t * node)
+{
+	if(NULL == node) return;
+	free(node->entry->data);
+	free(node);
+}
+
+/***************************************************************
+ * shard (must be called with shard->mutex held)
+****************************************************************/
+static void shard_rehash(block_cache_shard_t * shard, size_t new_size)
+{
+	cache_node_t ** buckets = calloc(new_size, sizeof(*buckets));
+	assert(buckets);
+
+	for(size_t i = 0; i < shard->buckets_size; ++i)
+	{
+		cache_node_t * node = shard->buckets[i];
+		while(node)
+		{
+			cache_node_t * next = node->hash_next;
+			size_t index = node->hkey & (new_size - 1);
+			node->hash_next = buckets[index];
+			buckets[index] = node;
+			node = next;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->buckets_size = new_size;
+}
+
+static cache_node_t * shard_find(block_cache_shard_t * shard, uint64_t hkey, int64_t file_index, int64_t start_pos)
+{
+	cache_node_t * node = shard->buckets[hkey & (shard->buckets_size - 1)];
+	while(node)
+	{
+		if(node->hkey == hkey
+			&& node->entry->file_index == file_index
+			&& node->entry->start_pos == start_pos) return node;
+		node = node->hash_next;
+	}
+	return NULL;
+}
+
+static inline void lru_unlink(block_cache_shard_t * shard, cache_node_t * node)
+{
+	if(node->lru_prev) node->lru_prev->lru_next = node->lru_next;
+	else shard->lru_head = node->lru_next;
+
+	if(node->lru_next) node->lru_next->lru_prev = node->lru_prev;
+	else shard->lru_tail = node->lru_prev;
+
+	node->lru_prev = node->lru_next = NULL;
+}
+
+static inline void lru_push_front(block_cache_shard_t * shard, cache_node_t * node)
+{
+	node->lru_prev = NULL;
+	node->lru_next = shard->lru_head;
+	if(shard->lru_head) shard->lru_head->lru_prev = node;
+	else shard->lru_tail = node;
+	shard->lru_head = node;
+}
+
+static void shard_remove(block_cache_shard_t * shard, cache_node_t * node)
+{
+	assert(node->linked);
+	cache_node_t ** p_node = &shard->buckets[node->hkey & (shard->buckets_size - 1)];
+	while(*p_node && *p_node != node) p_node = &(*p_node)->hash_next;
+	assert(*p_node == node);
+	*p_node = node->hash_next;
+	node->hash_next = NULL;
+
+	lru_unlink(shard, node);
+	node->linked = 0;
+
+	--shard->count;
+	shard->total_bytes -= node->entry->block_size;
+
+	if(--node->refs == 0) cache_node_free(node);	// release the reference held by the cache
+}
+
+static void shard_evict(block_cache_shard_t * shard)
+{
+	while(shard->total_bytes > shard->max_bytes && shard->lru_tail)
+	{
+		shard_remove(shard, shard->lru_tail);
+		++shard->evictions;
+	}
+}
+
+static void shard_insert(block_cache_shard_t * shard, cache_node_t * node)
+{
+	if((shard->count + 1) * 4 > shard->buckets_size * 3) shard_rehash(shard, shard->buckets_size * 2);
+
+	size_t index = node->hkey & (shard->buckets_size - 1);
+	node->hash_next = shard->buckets[index];
+	shard->buckets[index] = node;
+	lru_push_front(shard, node);
+
+	node->shard = shard;
+	node->linked = 1;
+	++node->refs;	// the reference held by the cache
+
+	++shard->count;
+	shard->total_bytes += node->entry->block_size;
+	shard_evict(shard);
+}
+
+/*
+ * shard_touch_ghost(): 
+ *   @return 1 if the key was recorded by a previous call (and forget it), 
+ *   otherwise record the key (replaces the oldest one) and return 0.
+ */
+static int shard_touch_ghost(block_cache_shard_t * shard, uint64_t hkey)
+{
+	for(int i = 0; i < BLOCK_CACHE_GHOST_KEYS; ++i) {
+		if(shard->ghost_keys[i] != hkey) continue;
+		shard->ghost_keys[i] = 0;
+		return 1;
+	}
+	shard->ghost_keys[shard->ghost_pos] = hkey;
+	shard->ghost_pos = (shard->ghost_pos + 1) % BLOCK_CACHE_GHOST_KEYS;
+	return 0;
+}
+
+static void shard_init(block_cache_shard_t * shard, int64_t max_bytes)
+{
+	int rc = pthread_mutex_init(&shard->mutex, NULL);
+	assert(0 == rc);
+
+	shard->buckets_size = BLOCK_CACHE_BUCKETS_INIT_SIZE;
+	shard->buckets = calloc(shard->buckets_size, sizeof(*shard->buckets));
+	assert(shard->buckets);
+	shard->max_bytes = max_bytes;
+}
+
+static void shard_cleanup(block_cache_shard_t * shard)
+{
+	pthread_mutex_lock(&shard->mutex);
+	while(shard->lru_head) shard_remove(shard, shard->lru_head);
+	free(shard->buckets);
+	shard->buckets = NULL;
+	shard->buckets_size = 0;
+	pthread_mutex_unlock(&shard->mutex);
+	pthread_mutex_destroy(&shard->mutex);
+}
+
+/***************************************************************
+ * block_cache
+****************************************************************/
+static block_cache_entry_t * cache_peek(struct block_cache * cache, int64_t file_index, int64_t start_pos)
+{
+	assert(cache && cache->priv);
+	block_cache_private_t * priv = cache->priv;
+
+	uint64_t hkey = block_pos_hash(file_index, start_pos);
+	block_cache_shard_t * shard = get_shard(priv, hkey);
+
+	pthread_mutex_lock(&shard->mutex);
+	cache_node_t * node = shard_find(shard, hkey, file_index, start_pos);
+	if(node) {
+		++node->refs;
+		++shard->hits;
+		lru_unlink(shard, node);
+		lru_push_front(shard, node);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return node?node->entry:NULL;
+}
+
+static block_cache_entry_t * cache_get(struct block_cache * cache,
+	int64_t file_index, int64_t start_pos, uint32_t block_size)
+{
+	assert(cache && cache->priv);
+	if(0 == block_size) return NULL;
+
+	block_cache_private_t * priv = cache->priv;
+	uint64_t hkey = block_pos_hash(file_index, start_pos);
+	block_cache_shard_t * shard = get_shard(priv, hkey);
+
+	pthread_mutex_lock(&shard->mutex);
+	cache_node_t * node = shard_find(shard, hkey, file_index, start_pos);
+	if(node) {
+		assert(node->entry->block_size == block_size);
+		++node->refs;
+		++shard->hits;
+		lru_unlink(shard, node);
+		lru_push_front(shard, node);
+		pthread_mutex_unlock(&shard->mutex);
+		return node->entry;
+	}
+	++shard->misses;
+	pthread_mutex_unlock(&shard->mutex);
+
+	// do not hold the shard lock during disk I/O
+	node = cache_node_new(file_index, start_pos, block_size);
+	if(NULL == node) return NULL;
+
+	ssize_t cb = block_file_read(priv, file_index, start_pos, block_size, node->entry->data);
+	if(cb != block_size) {
+		cache_node_free(node);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&shard->mutex);
+	cache_node_t * exists = shard_find(shard, hkey, file_index, start_pos);
+	if(exists) { // loaded by another thread
+		++exists->refs;
+		pthread_mutex_unlock(&shard->mutex);
+		cache_node_free(node);
+		return exists->entry;
+	}
+
+	node->shard = shard;
+	if(block_size <= shard->max_bytes) shard_insert(shard, node);	// else: uncached, freed on release()
+	pthread_mutex_unlock(&shard->mutex);
+
+	return node->entry;
+}
+
+static void cache_release(struct block_cache * cache, block_cache_entry_t * entry)
+{
+	if(NULL == entry) return;
+	cache_node_t * node = entry->priv;
+	assert(node && node->entry == entry);
+
+	block_cache_shard_t * shard = node->shard;
+	assert(shard);
+
+	pthread_mutex_lock(&shard->mutex);
+	long refs = --node->refs;
+	pthread_mutex_unlock(&shard->mutex);
+
+	if(0 == refs) {
+		assert(!node->linked);
+		cache_node_free(node);
+	}
+	return;
+}
+
+static ssize_t cache_send_to(struct block_cache * cache, int sockfd,
+	int64_t file_index, int64_t start_pos, uint32_t block_size,
+	off_t * p_offset)
+{
+	assert(cache && cache->priv);
+	block_cache_private_t * priv = cache->priv;
+
+	off_t offset = p_offset?*p_offset:0;
+	if(offset < 0 || offset > block_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(offset == block_size) return 0;
+
+	ssize_t cb = 0;
+	int zero_copy = 0;
+
+	block_cache_entry_t * entry = cache_peek(cache, file_index, start_pos);
+	if(NULL == entry && 0 == offset) {
+		// a block sent only once is not worth being cached, load it on the second access
+		uint64_t hkey = block_pos_hash(file_index, start_pos);
+		block_cache_shard_t * shard = get_shard(priv, hkey);
+		pthread_mutex_lock(&shard->mutex);
+		int seen = shard_touch_ghost(shard, hkey);
+		pthread_mutex_unlock(&shard->mutex);
+		if(seen) entry = cache_get(cache, file_index, start_pos, block_size);
+	}
+	if(entry) {
+		assert(entry->block_size == block_size);
+		cb = send(sockfd, entry->data + offset, block_size - offset, MSG_NOSIGNAL);
+		cache_release(cache, entry);
+	}else {
+		/*
+		 * not cached: let the kernel stream the data from the page-cache to the socket,
+		 * without copying it through user space.
+		 */
+		int fd = block_files_get_fd(priv->files, file_index);
+		if(fd < 0) return -1;
+
+		off_t pos = start_pos + offset;
+		cb = sendfile(sockfd, fd, &pos, block_size - offset);
+		block_files_put_fd(priv->files, file_index, fd);
+		zero_copy = 1;
+	}
+
+	if(cb <= 0) return cb;
+
+	offset += cb;
+	if(p_offset) *p_offset = offset;
+
+	pthread_mutex_lock(&priv->stats_mutex);
+	priv->bytes_sent += cb;
+	if(zero_copy) priv->bytes_sendfile += cb;
+	pthread_mutex_unlock(&priv->stats_mutex);
+	return cb;
+}
+
+static int cache_invalidate(struct block_cache * cache, int64_t file_index)
+{
+	assert(cache && cache->priv);
+	block_cache_private_t * priv = cache->priv;
+
+	for(int i = 0; i < priv->num_shards; ++i)
+	{
+		block_cache_shard_t * shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->mutex);
+		cache_node_t * node = shard->lru_head;
+		while(node)
+		{
+			cache_node_t * next = node->lru_next;
+			if(node->entry->file_index == file_index) shard_remove(shard, node);
+			node = next;
+		}
+		pthread_mutex_unlock(&shard->mutex);
+	}
+
+	// reopen the file on next access
+	block_files_close(priv->files, file_index);
+	return 0;
+}
+
+static int cache_set_max_bytes(struct block_cache * cache, int64_t max_bytes)
+{
+	assert(cache && cache->priv);
+	block_cache_private_t * priv = cache->priv;
+	if(max_bytes <= 0) max_bytes = BLOCK_CACHE_DEFAULT_MAX_BYTES;
+
+	priv->max_bytes = max_bytes;
+	for(int i = 0; i < priv->num_shards; ++i)
+	{
+		block_cache_shard_t * shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->mutex);
+		shard->max_bytes = max_bytes / priv->num_shards;
+		shard_evict(shard);
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	return 0;
+}
+
+static int cache_get_stats(struct block_cache * cache, struct block_cache_stats * stats)
+{
+	assert(cache && cache->priv && stats);
+	block_cache_private_t * priv = cache->priv;
+	memset(stats, 0, sizeof(*stats));
+
+	for(int i = 0; i < priv->num_shards; ++i)
+	{
+		block_cache_shard_t * shard = &priv->shards[i];
+		pthread_mutex_lock(&shard->mutex);
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->num_entries += shard->count;
+		stats->total_bytes += shard->total_bytes;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+	stats->max_bytes = priv->max_bytes;
+
+	pthread_mutex_lock(&priv->stats_mutex);
+	stats->bytes_read = priv->bytes_read;
+	stats->bytes_sent = priv->bytes_sent;
+	stats->bytes_sendfile = priv->bytes_sendfile;
+	pthread_mutex_unlock(&priv->stats_mutex);
+	return 0;
+}
+
+block_cache_t * block_cache_init(block_cache_t * cache,
+	const char * blocks_dir,
+	int64_t max_bytes,
+	int num_shards,
+	void * user_data)
+{
+	if(NULL == blocks_dir) blocks_dir = "./blocks";
+	if(max_bytes <= 0) max_bytes = BLOCK_CACHE_DEFAULT_MAX_BYTES;
+	if(num_shards <= 0) num_shards = BLOCK_CACHE_DEFAULT_SHARDS;
+
+	if(NULL == cache) cache = calloc(1, sizeof(*cache));
+	assert(cache);
+	cache->user_data = user_data;
+
+	block_cache_private_t * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->cache = cache;
+	block_files_init(priv->files, blocks_dir);
+
+	priv->num_shards = num_shards;
+	priv->max_bytes = max_bytes;
+	priv->shards = calloc(num_shards, sizeof(*priv->shards));
+	assert(priv->shards);
+	for(int i = 0; i < num_shards; ++i) shard_init(&priv->shards[i], max_bytes / num_shards);
+
+	int rc = pthread_mutex_init(&priv->stats_mutex, NULL);
+	assert(0 == rc);
+
+	cache->priv = priv;
+	cache->get = cache_get;
+	cache->release = cache_release;
+	cache->peek = cache_peek;
+	cache->send_to = cache_send_to;
+	cache->invalidate = cache_invalidate;
+	cache->set_max_bytes = cache_set_max_bytes;
+	cache->get_stats = cache_get_stats;
+
+	return cache;
+}
+
+void block_cache_cleanup(block_cache_t * cache)
+{
+	if(NULL == cache || NULL == cache->priv) return;
+	block_cache_private_t * priv = cache->priv;
+
+	for(int i = 0; i < priv->num_shards; ++i) shard_cleanup(&priv->shards[i]);
+	free(priv->shards);
+
+	block_files_cleanup(priv->files);
+	pthread_mutex_destroy(&priv->stats_mutex);
+	free(priv);
+	cache->priv = NULL;
+	return;
+}
+
+
+#if defined(_TEST_BLOCK_CACHE) && defined(_STAND_ALONE)
+#include <sys/stat.h>
+
+#define NUM_BLOCKS	(100)
+static struct
+{
+	int64_t start_pos;
+	uint32_t block_size;
+}s_blocks[NUM_BLOCKS];
+
+static void generate_block_file(const char * blocks_dir)
+{
+	char path[PATH_MAX] = "";
+	mkdir(blocks_dir, 0775);
+	snprintf(path, sizeof(path), "%s/" BLOCK_CACHE_BLOCK_FILE_FMT, blocks_dir, 0);
+
+	FILE * fp = fopen(path, "wb");
+	assert(fp);
+
+	int64_t pos = 0;
+	const uint32_t magic = 0xD9B4BEF9;
+	for(int i = 0; i < NUM_BLOCKS; ++i)
+	{
+		uint32_t block_size = 81 + (rand() % 64) * 1024;
+		unsigned char * data = malloc(block_size);
+		assert(data);
+		memset(data, i, block_size);
+
+		fwrite(&magic, sizeof(magic), 1, fp);
+		fwrite(&block_size, sizeof(block_size), 1, fp);
+		fwrite(data, 1, block_size, fp);
+		free(data);
+
+		pos += 8;
+		s_blocks[i].start_pos = pos;
+		s_blocks[i].block_size = block_size;
+		pos += block_size;
+	}
+	fclose(fp);
+}
+
+static int verify_block(int index, const unsigned char * data, uint32_t size)
+{
+	if(size != s_blocks[index].block_size) return -1;
+	for(uint32_t i = 0; i < size; ++i) if(data[i] != (unsigned char)index) return -1;
+	return 0;
+}
+
+static void test_send_to(block_cache_t * cache, int index)
+{
+	int sv[2] = { -1, -1 };
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+	assert(0 == rc);
+
+	uint32_t block_size = s_blocks[index].block_size;
+	unsigned char * data = malloc(block_size);
+	assert(data);
+
+	off_t offset = 0;
+	ssize_t length = 0;
+	while(length < block_size)
+	{
+		if(offset < block_size) {
+			ssize_t cb = cache->send_to(cache, sv[0], 0, s_blocks[index].start_pos, block_size, &offset);
+			assert(cb >= 0 || errno == EAGAIN);
+		}
+		ssize_t cb = read(sv[1], data + length, block_size - length);
+		assert(cb > 0);
+		length += cb;
+	}
+	assert(0 == verify_block(index, data, block_size));
+
+	free(data);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int main(int argc, char **argv)
+{
+	const char * blocks_dir = "data/blocks";
+	if(argc > 1) blocks_dir = argv[1];
+	generate_block_file(blocks_dir);
+
+	// 4 shards * 256KB
+	block_cache_t * cache = block_cache_init(NULL, blocks_dir, 1024 * 1024, 4, NULL);
+	assert(cache);
+
+	struct block_cache_stats stats[1];
+	for(int i = 0; i < NUM_BLOCKS; ++i)
+	{
+		block_cache_entry_t * entry = cache->get(cache, 0, s_blocks[i].start_pos, s_blocks[i].block_size);
+		assert(entry);
+		assert(0 == verify_block(i, entry->data, entry->block_size));
+		cache->release(cache, entry);
+	}
+	cache->get_stats(cache, stats);
+	printf("hits: %lu, misses: %lu, evictions: %lu, entries: %ld, bytes: %ld/%ld\n",
+		(unsigned long)stats->hits, (unsigned long)stats->misses, (unsigned long)stats->evictions,
+		(long)stats->num_entries, (long)stats->total_bytes, (long)stats->max_bytes);
+	assert(stats->misses == NUM_BLOCKS);
+	assert(stats->total_bytes <= stats->max_bytes);
+
+	// the most recent block must be cached
+	block_cache_entry_t * entry = cache->peek(cache, 0, s_blocks[NUM_BLOCKS - 1].start_pos);
+	assert(entry);
+
+	// an entry still in use must survive the eviction
+	cache->set_max_bytes(cache, 4);
+	assert(0 == verify_block(NUM_BLOCKS - 1, entry->data, entry->block_size));
+	cache->release(cache, entry);
+
+	cache->get_stats(cache, stats);
+	assert(0 == stats->num_entries && 0 == stats->total_bytes);
+	cache->set_max_bytes(cache, 1024 * 1024);
+
+	// send cached and uncached blocks
+	entry = cache->get(cache, 0, s_blocks[1].start_pos, s_blocks[1].block_size);
+	cache->release(cache, entry);
+	test_send_to(cache, 1);
+	test_send_to(cache, 2);
+
+	cache->get_stats(cache, stats);
+	printf("bytes_sent: %lu, bytes_sendfile: %lu\n",
+		(unsigned long)stats->bytes_sent, (unsigned long)stats->bytes_sendfile);
+	assert(stats->bytes_sendfile == s_blocks[2].block_size);
+	assert(stats->bytes_sent == (s_blocks[1].block_size + s_blocks[2].block_size));
+
+	// the second send of an uncached block loads it into the cache
+	test_send_to(cache, 2);
+	entry = cache->peek(cache, 0, s_blocks[2].start_pos);
+	assert(entry && 0 == verify_block(2, entry->data, entry->block_size));
+	cache->release(cache, entry);
+	cache->get_stats(cache, stats);
+	assert(stats->bytes_sendfile == s_blocks[2].block_size);
+	assert(stats->bytes_sent == (s_blocks[1].block_size + s_blocks[2].block_size * 2));
+
+	// an fd which is still in use survives invalidate(), and is closed when it is released
+	block_cache_private_t * priv = cache->priv;
+	int fd = block_files_get_fd(priv->files, 0);
+	assert(fd >= 0);
+	cache->invalidate(cache, 0);
+	assert(fcntl(fd, F_GETFD) >= 0);
+	int new_fd = block_files_get_fd(priv->files, 0);
+	assert(new_fd >= 0 && new_fd != fd);
+	block_files_put_fd(priv->files, 0, fd);
+	assert(-1 == fcntl(fd, F_GETFD) && errno == EBADF);
+	block_files_put_fd(priv->files, 0, new_fd);
+	test_send_to(cache, 3);
+
+	block_cache_cleanup(cache);
+	free(cache);
+	return 0;
+}
+#endif
@@ -0,0 +1,725 @@
+/*
+ * block_download.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include "utils.h"
+#include "satoshi-types.h"
+#include "chains.h"
+#include "block_download.h"
+
+enum download_slot_state
+{
+	download_slot_state_missing = 0,
+	download_slot_state_in_flight,
+	download_slot_state_received,
+};
+
+struct download_slot
+{
+	ssize_t height;		// -1: unused
+	uint256_t hash;
+	enum download_slot_state state;
+	int peer_id;		// requested from / received from
+	int last_peer_id;	// the peer which has failed to deliver it, avoided when reassigning
+	double requested_at;
+	void * block;
+};
+
+struct download_peer
+{
+	int peer_id;
+	ssize_t best_height;	// 0: unknown
+	int in_flight;
+	int max_in_flight;
+	int64_t received;
+	int64_t stalls;
+};
+
+typedef struct block_download_private
+{
+	block_download_manager_t * mgr;
+	pthread_mutex_t mutex;
+
+	struct download_slot * slots;	// ring buffer, indexed by (height % window_size)
+	ssize_t num_received;			// received, waiting for the blocks before them
+
+	struct download_peer * peers;
+	ssize_t num_peers;
+	ssize_t max_peers;
+
+	int delivering;	// a thread is calling on_block_ready()
+}block_download_private_t;
+
+static double get_monotonic_time(block_download_manager_t * mgr)
+{
+	struct timespec ts[1] = {{ 0 }};
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return (double)ts->tv_sec + (double)ts->tv_nsec / 1000000000.0;
+}
+
+static struct download_peer * find_peer(block_download_private_t * priv, int peer_id)
+{
+	for(ssize_t i = 0; i < priv->num_peers; ++i) {
+		if(priv->peers[i].peer_id == peer_id) return &priv->peers[i];
+	}
+	return NULL;
+}
+
+static inline struct download_slot * slot_at(block_download_private_t * priv, ssize_t height)
+{
+	return &priv->slots[height % priv->mgr->window_size];
+}
+
+// lock priv->mutex before calling these functions
+static void slot_reset(block_download_private_t * priv, struct download_slot * slot)
+{
+	block_download_manager_t * mgr = priv->mgr;
+	if(slot->state == download_slot_state_in_flight) {
+		struct download_peer * peer = find_peer(priv, slot->peer_id);
+		if(peer) --peer->in_flight;
+	}else if(slot->state == download_slot_state_received) {
+		--priv->num_received;
+		if(slot->block && mgr->on_free_block) mgr->on_free_block(slot->block);
+	}
+	slot->height = -1;
+	slot->state = download_slot_state_missing;
+	slot->peer_id = -1;
+	slot->last_peer_id = -1;
+	slot->block = NULL;
+}
+
+/*
+ * sync the slot with the main chain: (re)initialize it if it was used by another height,
+ * or if the block at this height has been replaced by a reorg.
+ */
+static struct download_slot * slot_sync(block_download_private_t * priv, const blockchain_snapshot_t * snapshot, ssize_t height)
+{
+	const blockchain_heir_t * heir = blockchain_snapshot_get(snapshot, height);
+	if(NULL == heir) return NULL;
+
+	struct download_slot * slot = slot_at(priv, height);
+	if(slot->height != height || memcmp(&slot->hash, heir->hash, sizeof(uint256_t)) != 0) {
+		slot_reset(priv, slot);
+		slot->height = height;
+		memcpy(&slot->hash, heir->hash, sizeof(uint256_t));
+	}
+	return slot;
+}
+
+// release the in-flight request, the block will be assigned to another peer if possible
+static void slot_unassign(block_download_private_t * priv, struct download_slot * slot, int is_stalled)
+{
+	assert(slot->state == download_slot_state_in_flight);
+	struct download_peer * peer = find_peer(priv, slot->peer_id);
+	if(peer) {
+		--peer->in_flight;
+		if(is_stalled) {
+			++peer->stalls;
+			peer->max_in_flight /= 2;
+			if(peer->max_in_flight < 1) peer->max_in_flight = 1;
+		}
+	}
+	slot->state = download_slot_state_missing;
+	slot->last_peer_id = slot->peer_id;
+	slot->peer_id = -1;
+}
+
+/*
+ * pass the completed blocks to on_block_ready() in order.
+ *   called with the lock held, the lock is released during the callbacks,
+ *   only one thread delivers at a time (the others just leave their blocks in the window).
+ */
+static void deliver_blocks(block_download_private_t * priv)
+{
+	block_download_manager_t * mgr = priv->mgr;
+	if(priv->delivering) return;
+	priv->delivering = 1;
+
+	while(1) {
+		ssize_t height = mgr->next_height;
+		struct download_slot * slot = slot_at(priv, height);
+		if(slot->height != height || slot->state != download_slot_state_received) break;
+
+		uint256_t hash = slot->hash;
+		void * block = slot->block;
+		int peer_id = slot->peer_id;
+		slot->block = NULL;
+		slot_reset(priv, slot);
+		++mgr->next_height;
+
+		pthread_mutex_unlock(&priv->mutex);
+		int rc = 0;
+		if(mgr->on_block_ready) rc = mgr->on_block_ready(mgr, height, &hash, block, peer_id);
+		if(block && mgr->on_free_block) mgr->on_free_block(block);
+		pthread_mutex_lock(&priv->mutex);
+
+		if(rc) {
+			// invalid block: download it again from another peer
+			fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): block %ld from peer %d was rejected" "\e[39m" "\n",
+				__FILE__, __LINE__, (long)height, peer_id);
+			if(mgr->next_height != (height + 1)) break;	// rewound by a reorg during the callback, the block is stale
+			mgr->next_height = height;
+			slot_reset(priv, slot);	// the slot may have been reused for (height + window_size)
+			slot->height = height;
+			slot->hash = hash;
+			slot->last_peer_id = peer_id;
+			break;
+		}
+	}
+	priv->delivering = 0;
+}
+
+/**************************************************
+ * block_download_manager
+**************************************************/
+block_download_manager_t * block_download_manager_new(blockchain_t * chain, ssize_t start_height, void * user_data)
+{
+	assert(chain);
+	block_download_manager_t * mgr = calloc(1, sizeof(*mgr));
+	assert(mgr);
+	mgr->user_data = user_data;
+	mgr->chain = chain;
+	mgr->window_size = BLOCK_DOWNLOAD_DEFAULT_WINDOW_SIZE;
+	mgr->max_in_flight = BLOCK_DOWNLOAD_DEFAULT_MAX_IN_FLIGHT;
+	mgr->stall_timeout = BLOCK_DOWNLOAD_STALL_TIMEOUT;
+	mgr->request_timeout = BLOCK_DOWNLOAD_REQUEST_TIMEOUT;
+	mgr->inv_type = bitcoin_inventory_type_msg_block;
+	mgr->next_height = start_height;
+	mgr->get_time = get_monotonic_time;
+
+	block_download_private_t * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->mgr = mgr;
+	pthread_mutex_init(&priv->mutex, NULL);
+	mgr->priv = priv;
+	return mgr;
+}
+
+void block_download_manager_free(block_download_manager_t * mgr)
+{
+	if(NULL == mgr) return;
+	block_download_private_t * priv = mgr->priv;
+	if(priv) {
+		if(priv->slots) {
+			for(ssize_t i = 0; i < mgr->window_size; ++i) slot_reset(priv, &priv->slots[i]);
+			free(priv->slots);
+		}
+		free(priv->peers);
+		pthread_mutex_destroy(&priv->mutex);
+		free(priv);
+		mgr->priv = NULL;
+	}
+	free(mgr);
+}
+
+// the window is allocated on first use, so that window_size can be changed after block_download_manager_new()
+static void init_slots(block_download_private_t * priv)
+{
+	if(priv->slots) return;
+	ssize_t window_size = priv->mgr->window_size;
+	assert(window_size > 0);
+	priv->slots = calloc(window_size, sizeof(*priv->slots));
+	assert(priv->slots);
+	for(ssize_t i = 0; i < window_size; ++i) {
+		priv->slots[i].height = -1;
+		priv->slots[i].peer_id = -1;
+		priv->slots[i].last_peer_id = -1;
+	}
+}
+
+int block_download_add_peer(block_download_manager_t * mgr, int peer_id, ssize_t best_height)
+{
+	block_download_private_t * priv = mgr->priv;
+	pthread_mutex_lock(&priv->mutex);
+	init_slots(priv);
+	struct download_peer * peer = find_peer(priv, peer_id);
+	if(NULL == peer) {
+		if(priv->num_peers >= priv->max_peers) {
+			ssize_t new_size = priv->max_peers?(priv->max_peers * 2):16;
+			struct download_peer * peers = realloc(priv->peers, new_size * sizeof(*peers));
+			assert(peers);
+			priv->peers = peers;
+			priv->max_peers = new_size;
+		}
+		peer = &priv->peers[priv->num_peers++];
+		memset(peer, 0, sizeof(*peer));
+		peer->peer_id = peer_id;
+		peer->max_in_flight = (mgr->max_in_flight + 1) / 2;	// slow start
+	}
+	peer->best_height = best_height;
+	pthread_mutex_unlock(&priv->mutex);
+	return 0;
+}
+
+void block_download_update_peer(block_download_manager_t * mgr, int peer_id, ssize_t best_height)
+{
+	block_download_private_t * priv = mgr->priv;
+	pthread_mutex_lock(&priv->mutex);
+	struct download_peer * peer = find_peer(priv, peer_id);
+	if(peer && best_height > peer->best_height) peer->best_height = best_height;
+	pthread_mutex_unlock(&priv->mutex);
+}
+
+void block_download_remove_peer(block_download_manager_t * mgr, int peer_id)
+{
+	block_download_private_t * priv = mgr->priv;
+	pthread_mutex_lock(&priv->mutex);
+	struct download_peer * peer = find_peer(priv, peer_id);
+	if(peer) {
+		if(priv->slots) {
+			for(ssize_t i = 0; i < mgr->window_size; ++i) {
+				struct download_slot * slot = &priv->slots[i];
+				if(slot->state == download_slot_state_in_flight && slot->peer_id == peer_id) slot_unassign(priv, slot, 0);
+			}
+		}
+		*peer = priv->peers[--priv->num_peers];
+	}
+	pthread_mutex_unlock(&priv->mutex);
+}
+
+int block_download_get_peer_stats(block_download_manager_t * mgr, int peer_id, struct block_download_peer_stats * stats)
+{
+	block_download_private_t * priv = mgr->priv;
+	pthread_mutex_lock(&priv->mutex);
+	struct download_peer * peer = find_peer(priv, peer_id);
+	if(peer) {
+		stats->peer_id = peer_id;
+		stats->in_flight = peer->in_flight;
+		stats->max_in_flight = peer->max_in_flight;
+		stats->received = peer->received;
+		stats->stalls = peer->stalls;
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	return peer?0:-1;
+}
+
+ssize_t block_download_get_requests(block_download_manager_t * mgr, int peer_id, struct bitcoin_inventory * invs, ssize_t max_count)
+{
+	assert(mgr && invs);
+	block_download_private_t * priv = mgr->priv;
+	ssize_t count = 0;
+
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(mgr->chain, snapshot);
+
+	pthread_mutex_lock(&priv->mutex);
+	struct download_peer * peer = find_peer(priv, peer_id);
+	if(NULL == peer) {
+		pthread_mutex_unlock(&priv->mutex);
+		blockchain_snapshot_release(snapshot);
+		return -1;
+	}
+
+	double now = mgr->get_time(mgr);
+	ssize_t last_height = mgr->next_height + mgr->window_size - 1;
+	if(last_height > blockchain_snapshot_height(snapshot)) last_height = blockchain_snapshot_height(snapshot);
+	if(peer->best_height > 0 && last_height > peer->best_height) last_height = peer->best_height;
+
+	for(ssize_t height = mgr->next_height; height <= last_height; ++height) {
+		if(count >= max_count || peer->in_flight >= peer->max_in_flight) break;
+
+		struct download_slot * slot = slot_sync(priv, snapshot, height);
+		if(NULL == slot || slot->state != download_slot_state_missing) continue;
+		if(slot->last_peer_id == peer_id && priv->num_peers > 1) continue;	// let another peer try it
+
+		slot->state = download_slot_state_in_flight;
+		slot->peer_id = peer_id;
+		slot->requested_at = now;
+		++peer->in_flight;
+
+		invs[count].type = mgr->inv_type;
+		memcpy(invs[count].hash, &slot->hash, sizeof(invs[count].hash));
+		++count;
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	blockchain_snapshot_release(snapshot);
+	return count;
+}
+
+int block_download_on_block(block_download_manager_t * mgr, int peer_id, const uint256_t * hash, void * block)
+{
+	assert(mgr && hash);
+	block_download_private_t * priv = mgr->priv;
+	int rc = -1;
+
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(mgr->chain, snapshot);
+	ssize_t height = blockchain_snapshot_get_height(snapshot, hash);
+
+	pthread_mutex_lock(&priv->mutex);
+	if(priv->slots && height >= mgr->next_height && height < (mgr->next_height + mgr->window_size)) {
+		struct download_slot * slot = slot_sync(priv, snapshot, height);
+		if(slot && slot->state != download_slot_state_received) {
+			struct download_peer * peer = find_peer(priv, peer_id);
+			if(slot->state == download_slot_state_in_flight) {
+				struct download_peer * requested_from = (slot->peer_id == peer_id)?peer:find_peer(priv, slot->peer_id);
+				if(requested_from) --requested_from->in_flight;
+
+				// delivered in time: grow the peer's window
+				if(peer && peer == requested_from && peer->max_in_flight < mgr->max_in_flight
+					&& (mgr->get_time(mgr) - slot->requested_at) < mgr->stall_timeout)
+				{
+					++peer->max_in_flight;
+				}
+			}
+			if(peer) ++peer->received;
+
+			slot->state = download_slot_state_received;
+			slot->peer_id = peer_id;
+			slot->block = block;
+			++priv->num_received;
+			rc = 0;
+
+			deliver_blocks(priv);
+		}
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	blockchain_snapshot_release(snapshot);
+	return rc;
+}
+
+int block_download_on_notfound(block_download_manager_t * mgr, int peer_id, const uint256_t * hash)
+{
+	block_download_private_t * priv = mgr->priv;
+	int rc = -1;
+
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(mgr->chain, snapshot);
+	ssize_t height = blockchain_snapshot_get_height(snapshot, hash);
+
+	pthread_mutex_lock(&priv->mutex);
+	if(priv->slots && height >= mgr->next_height && height < (mgr->next_height + mgr->window_size)) {
+		struct download_slot * slot = slot_at(priv, height);
+		if(slot->height == height && slot->state == download_slot_state_in_flight && slot->peer_id == peer_id) {
+			slot_unassign(priv, slot, 0);
+			rc = 0;
+		}
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	blockchain_snapshot_release(snapshot);
+	return rc;
+}
+
+ssize_t block_download_check_timeouts(block_download_manager_t * mgr)
+{
+	block_download_private_t * priv = mgr->priv;
+	ssize_t count = 0;
+	int stalling_peers[64];
+	int num_stalling = 0;
+
+	pthread_mutex_lock(&priv->mutex);
+	if(NULL == priv->slots) {
+		pthread_mutex_unlock(&priv->mutex);
+		return 0;
+	}
+	double now = mgr->get_time(mgr);
+	for(ssize_t height = mgr->next_height; height < (mgr->next_height + mgr->window_size); ++height) {
+		struct download_slot * slot = slot_at(priv, height);
+		if(slot->height != height || slot->state != download_slot_state_in_flight) continue;
+
+		double age = now - slot->requested_at;
+		// the first missing block holds back the blocks received after it
+		int is_stalling = (height == mgr->next_height && priv->num_received > 0 && age > mgr->stall_timeout);
+		if(!is_stalling && age <= mgr->request_timeout) continue;
+
+		int peer_id = slot->peer_id;
+		slot_unassign(priv, slot, 1);
+		++count;
+		if(is_stalling) {
+			// it's holding back the whole window, don't wait for its other requests either
+			for(ssize_t i = 0; i < mgr->window_size; ++i) {
+				struct download_slot * other = &priv->slots[i];
+				if(other->state == download_slot_state_in_flight && other->peer_id == peer_id) {
+					slot_unassign(priv, other, 0);
+					++count;
+				}
+			}
+		}
+
+		int i = 0;
+		for(; i < num_stalling; ++i) if(stalling_peers[i] == peer_id) break;
+		if(i == num_stalling && num_stalling < (int)(sizeof(stalling_peers) / sizeof(stalling_peers[0]))) {
+			stalling_peers[num_stalling++] = peer_id;
+		}
+	}
+	pthread_mutex_unlock(&priv->mutex);
+
+	if(mgr->on_peer_stalling) {
+		for(int i = 0; i < num_stalling; ++i) mgr->on_peer_stalling(mgr, stalling_peers[i]);
+	}
+	return count;
+}
+
+int block_download_is_known(block_download_manager_t * mgr, const uint256_t * hash)
+{
+	block_download_private_t * priv = mgr->priv;
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(mgr->chain, snapshot);
+	ssize_t height = blockchain_snapshot_get_height(snapshot, hash);
+	blockchain_snapshot_release(snapshot);
+	if(height < 0) return 0;	// not in the headers chain
+
+	int is_known = 0;
+	pthread_mutex_lock(&priv->mutex);
+	if(height < mgr->next_height) is_known = 1;	// delivered (next_height is moved back by block_download_on_reorg())
+	else if(priv->slots && height < (mgr->next_height + mgr->window_size)) {
+		// the slot may still hold the block replaced by a reorg at the same height
+		struct download_slot * slot = slot_at(priv, height);
+		is_known = (slot->height == height && slot->state != download_slot_state_missing
+			&& 0 == memcmp(&slot->hash, hash, sizeof(*hash)));
+	}
+	pthread_mutex_unlock(&priv->mutex);
+	return is_known;
+}
+
+void block_download_on_reorg(block_download_manager_t * mgr, ssize_t fork_height)
+{
+	assert(mgr && fork_height >= 0);
+	block_download_private_t * priv = mgr->priv;
+	pthread_mutex_lock(&priv->mutex);
+	if(mgr->next_height > (fork_height + 1)) mgr->next_height = fork_height + 1;
+	if(priv->slots) {
+		// the requests and the received blocks above the fork point belong to the old branch
+		for(ssize_t i = 0; i < mgr->window_size; ++i) {
+			struct download_slot * slot = &priv->slots[i];
+			if(slot->height > fork_height) slot_reset(priv, slot);
+		}
+	}
+	pthread_mutex_unlock(&priv->mutex);
+}
+
+
+#if defined(_TEST_BLOCK_DOWNLOAD) && defined(_STAND_ALONE)
+#define TEST_NUM_BLOCKS	(3000)
+#define TEST_TICK		(0.01)	// seconds of the simulated clock
+#define TEST_LATENCY	(5)		// ticks
+
+static double s_now;
+static ssize_t s_expected_height;
+static blockchain_t s_chain[1];
+static uint256_t s_hashes[TEST_NUM_BLOCKS + 1];
+static int s_stalling_events;
+
+static double test_get_time(block_download_manager_t * mgr)
+{
+	return s_now;
+}
+
+static int test_on_block_ready(block_download_manager_t * mgr, ssize_t height, const uint256_t * hash, void * block, int peer_id)
+{
+	assert(height == s_expected_height);	// in order
+	assert(0 == memcmp(hash, &s_hashes[height], sizeof(*hash)));
+	assert(0 == memcmp(block, hash, sizeof(*hash)));
+	++s_expected_height;
+	return 0;
+}
+
+static void test_on_peer_stalling(block_download_manager_t * mgr, int peer_id)
+{
+	++s_stalling_events;
+	block_download_remove_peer(mgr, peer_id);	// disconnect
+}
+
+static void build_chain(void)
+{
+	struct satoshi_block_header hdrs[TEST_NUM_BLOCKS + 1];
+	memset(hdrs, 0, sizeof(hdrs));
+	for(int i = 0; i <= TEST_NUM_BLOCKS; ++i) {
+		struct satoshi_block_header * hdr = &hdrs[i];
+		hdr->version = 4;
+		hdr->bits = 0x207fffff;
+		hdr->timestamp = 1296688602 + i * 600;
+		if(i > 0) memcpy(hdr->prev_hash, &s_hashes[i - 1], sizeof(uint256_t));
+		do {
+			++hdr->nonce;
+			hash256(hdr, sizeof(*hdr), (uint8_t *)&s_hashes[i]);
+		}while(uint256_compare_with_compact(&s_hashes[i], (compact_uint256_t *)&hdr->bits) > 0);
+	}
+	blockchain_init(s_chain, &s_hashes[0], &hdrs[0], NULL);
+	ssize_t count = blockchain_add_batch(s_chain, &hdrs[1], TEST_NUM_BLOCKS);
+	assert(count == TEST_NUM_BLOCKS && s_chain->height == TEST_NUM_BLOCKS);
+}
+
+/*
+ * add a branch of 'count' headers after the block 'fork_height',
+ * @return the hashes of the branch (from fork_height + 1)
+ */
+static uint256_t * build_fork(ssize_t fork_height, ssize_t count)
+{
+	uint256_t * hashes = calloc(count, sizeof(*hashes));
+	struct satoshi_block_header * hdrs = calloc(count, sizeof(*hdrs));
+	assert(hashes && hdrs);
+	for(ssize_t i = 0; i < count; ++i) {
+		struct satoshi_block_header * hdr = &hdrs[i];
+		ssize_t height = fork_height + 1 + i;
+		hdr->version = 4;
+		hdr->bits = 0x207fffff;
+		hdr->timestamp = 1296688602 + height * 600 + 1;	// differs from the main chain
+		memcpy(hdr->prev_hash, (i > 0)?&hashes[i - 1]:&s_hashes[fork_height], sizeof(uint256_t));
+		do {
+			++hdr->nonce;
+			hash256(hdr, sizeof(*hdr), (uint8_t *)&hashes[i]);
+		}while(uint256_compare_with_compact(&hashes[i], (compact_uint256_t *)&hdr->bits) > 0);
+	}
+	ssize_t num_added = blockchain_add_batch(s_chain, hdrs, count);
+	assert(num_added == count && s_chain->height == fork_height + count);
+	free(hdrs);
+	return hashes;
+}
+
+struct sim_request
+{
+	ssize_t due;	// tick
+	uint256_t hash;
+};
+
+/*
+ * simulate the peers: each one answers its requests after 'latencies[i]' ticks (never if latency < 0)
+ * @return the number of ticks to download all the blocks
+ */
+static ssize_t simulate(int num_peers, const int * latencies, ssize_t max_ticks)
+{
+	s_now = 0;
+	s_expected_height = 1;
+	s_stalling_events = 0;
+	block_download_manager_t * mgr = block_download_manager_new(s_chain, 1, NULL);
+	assert(mgr);
+	mgr->get_time = test_get_time;
+	mgr->on_block_ready = test_on_block_ready;
+	mgr->on_free_block = free;
+	mgr->on_peer_stalling = test_on_peer_stalling;
+	mgr->window_size = 256;
+
+	struct sim_request * queues[num_peers];
+	ssize_t counts[num_peers];
+	for(int i = 0; i < num_peers; ++i) {
+		block_download_add_peer(mgr, i, TEST_NUM_BLOCKS);
+		queues[i] = calloc(mgr->max_in_flight * 64, sizeof(**queues));
+		counts[i] = 0;
+	}
+
+	ssize_t tick = 0;
+	for(; tick < max_ticks && mgr->next_height <= TEST_NUM_BLOCKS; ++tick, s_now += TEST_TICK) {
+		for(int i = 0; i < num_peers; ++i) {
+			// receive the blocks (in the order they were requested)
+			ssize_t done = 0;
+			for(; done < counts[i] && queues[i][done].due <= tick; ++done) {
+				uint256_t * block = malloc(sizeof(*block));
+				*block = queues[i][done].hash;
+				if(block_download_on_block(mgr, i, &queues[i][done].hash, block)) free(block);
+			}
+			if(done > 0) memmove(queues[i], queues[i] + done, (counts[i] - done) * sizeof(**queues));
+			counts[i] -= done;
+
+			// send getdata
+			struct bitcoin_inventory invs[64];
+			ssize_t n = block_download_get_requests(mgr, i, invs, 64);
+			for(ssize_t k = 0; k < n && latencies[i] >= 0; ++k) {
+				struct sim_request * req = &queues[i][counts[i]++];
+				req->due = tick + latencies[i];
+				memcpy(&req->hash, invs[k].hash, sizeof(req->hash));
+			}
+		}
+		block_download_check_timeouts(mgr);
+	}
+
+	// the requests are released when a peer disconnects
+	for(int i = 0; i < num_peers; ++i) {
+		block_download_remove_peer(mgr, i);
+		free(queues[i]);
+	}
+	assert(mgr->next_height == TEST_NUM_BLOCKS + 1);
+	block_download_manager_free(mgr);
+	return tick;
+}
+
+int main(int argc, char ** argv)
+{
+	build_chain();
+
+	// 1. download rate scales with the number of peers
+	const int latencies[4] = { TEST_LATENCY, TEST_LATENCY, TEST_LATENCY, TEST_LATENCY };
+	ssize_t ticks_1 = simulate(1, latencies, 100000);
+	ssize_t ticks_4 = simulate(4, latencies, 100000);
+	fprintf(stderr, "%d blocks: 1 peer: %ld ticks, 4 peers: %ld ticks\n", TEST_NUM_BLOCKS, (long)ticks_1, (long)ticks_4);
+	assert(ticks_4 * 3 < ticks_1);
+
+	// 2. a peer that never answers stalls the window, its blocks are reassigned
+	const int with_staller[4] = { TEST_LATENCY, -1, TEST_LATENCY * 2, TEST_LATENCY };
+	ssize_t ticks = simulate(4, with_staller, 100000);
+	fprintf(stderr, "with a stalling peer: %ld ticks, stalling events: %d\n", (long)ticks, s_stalling_events);
+	assert(s_stalling_events == 1);
+	assert(ticks < ticks_1);
+
+	// 3. inv filtering
+	block_download_manager_t * mgr = block_download_manager_new(s_chain, 100, NULL);
+	block_download_add_peer(mgr, 1, 0);
+	struct bitcoin_inventory invs[4];
+	ssize_t n = block_download_get_requests(mgr, 1, invs, 4);
+	assert(n == 4 && 0 == memcmp(invs[0].hash, &s_hashes[100], 32));
+	assert(block_download_is_known(mgr, &s_hashes[50]));		// delivered
+	assert(block_download_is_known(mgr, &s_hashes[103]));		// in flight
+	assert(!block_download_is_known(mgr, &s_hashes[104]));	// missing
+	uint256_t unknown_hash;
+	memset(&unknown_hash, 0xab, sizeof(unknown_hash));
+	assert(!block_download_is_known(mgr, &unknown_hash));
+	assert(0 == block_download_on_notfound(mgr, 1, &s_hashes[101]));
+	assert(!block_download_is_known(mgr, &s_hashes[101]));
+	block_download_manager_free(mgr);
+
+	// 4. reorg: a longer branch from the block 99
+	mgr = block_download_manager_new(s_chain, 100, NULL);
+	block_download_add_peer(mgr, 1, 0);
+	n = block_download_get_requests(mgr, 1, invs, 4);
+	assert(n == 4);
+	assert(0 == block_download_on_block(mgr, 1, &s_hashes[100], &s_hashes[100]));
+	assert(0 == block_download_on_block(mgr, 1, &s_hashes[101], &s_hashes[101]));
+	assert(mgr->next_height == 102);
+
+	uint256_t * fork_hashes = build_fork(99, TEST_NUM_BLOCKS - 99 + 1);
+	assert(!block_download_is_known(mgr, &s_hashes[103]));		// no longer on the main chain
+	assert(!block_download_is_known(mgr, &fork_hashes[103 - 100]));	// same height, the slot holds the old block
+
+	block_download_on_reorg(mgr, 99);	// called by chain->on_remove_block()
+	assert(mgr->next_height == 100);
+	assert(!block_download_is_known(mgr, &fork_hashes[0]));
+	n = block_download_get_requests(mgr, 1, invs, 4);
+	assert(n == 4 && 0 == memcmp(invs[0].hash, &fork_hashes[0], 32) && 0 == memcmp(invs[3].hash, &fork_hashes[3], 32));
+	assert(block_download_is_known(mgr, &fork_hashes[3]));
+	block_download_manager_free(mgr);
+	free(fork_hashes);
+
+	blockchain_cleanup(s_chain);
+	return 0;
+}
+#endif
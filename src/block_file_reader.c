@@ -0,0 +1,793 @@
+/*
+ * block_file_reader.c
+ *
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "block_file_reader.h"
+#include "block_files.h"
+#include "utils.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAS_IO_URING	(1)
+#endif
+#endif
+
+struct read_batch;
+typedef struct read_item
+{
+	struct read_item * next;
+	struct read_batch * batch;
+	block_read_request_t * request;
+
+	int fd;
+	uint32_t cb_done;
+	struct iovec iov[1];
+}read_item_t;
+
+typedef struct read_batch
+{
+	block_read_request_t * requests;
+	ssize_t count;
+	long pending;
+
+	block_reader_on_completed_callback on_completed;
+	void * user_data;
+
+	read_item_t items[0];
+}read_batch_t;
+
+struct io_uring_ctx;
+typedef struct block_file_reader_private
+{
+	block_file_reader_t * reader;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quit;
+
+	// pending items (FIFO)
+	read_item_t * head;
+	read_item_t * tail;
+
+	int num_threads;
+	pthread_t * threads;
+
+	struct io_uring_ctx * uring;
+
+	block_files_t files[1];		// opened blk files
+}block_file_reader_private_t;
+
+/***************************************************************
+ * items queue
+****************************************************************/
+static void queue_push_items(block_file_reader_private_t * priv, read_item_t * first, read_item_t * last)
+{
+	pthread_mutex_lock(&priv->mutex);
+	if(priv->tail) priv->tail->next = first;
+	else priv->head = first;
+	priv->tail = last;
+	pthread_cond_broadcast(&priv->cond);
+	pthread_mutex_unlock(&priv->mutex);
+}
+
+static read_item_t * queue_pop_item_locked(block_file_reader_private_t * priv)
+{
+	read_item_t * item = priv->head;
+	if(item) {
+		priv->head = item->next;
+		if(NULL == priv->head) priv->tail = NULL;
+		item->next = NULL;
+	}
+	return item;
+}
+
+static void item_complete(block_file_reader_private_t * priv, read_item_t * item, int err_code)
+{
+	block_read_request_t * request = item->request;
+	request->err_code = err_code;
+	request->cb_read = err_code?-1:(ssize_t)item->cb_done;
+
+	// the read has finished (or was never started), release the fd
+	if(item->fd >= 0) block_files_put_fd(priv->files, request->file_index, item->fd);
+	item->fd = -1;
+
+	read_batch_t * batch = item->batch;
+	if(__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		if(batch->on_completed) batch->on_completed(priv->reader, batch->requests, batch->count, batch->user_data);
+		free(batch);
+	}
+}
+
+/***************************************************************
+ * backend: thread pool
+****************************************************************/
+static void * pread_worker_thread(void * user_data)
+{
+	block_file_reader_private_t * priv = user_data;
+	assert(priv);
+
+	while(1)
+	{
+		pthread_mutex_lock(&priv->mutex);
+		while(!priv->quit && NULL == priv->head) pthread_cond_wait(&priv->cond, &priv->mutex);
+		read_item_t * item = queue_pop_item_locked(priv);
+		pthread_mutex_unlock(&priv->mutex);
+
+		if(NULL == item) break;	// quit and the queue is empty
+
+		int err_code = 0;
+		block_read_request_t * request = item->request;
+		while(item->cb_done < request->length)
+		{
+			ssize_t cb = pread(item->fd, request->data + item->cb_done,
+				request->length - item->cb_done,
+				request->offset + item->cb_done);
+			if(cb < 0) {
+				if(errno == EINTR) continue;
+				err_code = errno;
+				break;
+			}
+			if(0 == cb) { err_code = ENODATA; break; } // EOF
+			item->cb_done += cb;
+		}
+		item_complete(priv, item, err_code);
+	}
+	pthread_exit((void *)(long)0);
+}
+
+/***************************************************************
+ * backend: io_uring (raw syscalls, liburing is not required)
+****************************************************************/
+#ifdef HAS_IO_URING
+typedef struct io_uring_ctx
+{
+	int ring_fd;
+	unsigned int entries;
+	unsigned int inflight;
+
+	void * sq_ptr;
+	size_t sq_ring_size;
+	void * cq_ptr;
+	size_t cq_ring_size;
+	struct io_uring_sqe * sqes;
+	size_t sqes_size;
+
+	unsigned int * sq_head;
+	unsigned int * sq_tail;
+	unsigned int * sq_mask;
+	unsigned int * sq_array;
+	unsigned int * cq_head;
+	unsigned int * cq_tail;
+	unsigned int * cq_mask;
+	struct io_uring_cqe * cqes;
+}io_uring_ctx_t;
+
+static void io_uring_ctx_free(io_uring_ctx_t * uring)
+{
+	if(NULL == uring) return;
+	if(uring->sqes) munmap(uring->sqes, uring->sqes_size);
+	if(uring->cq_ptr && uring->cq_ptr != uring->sq_ptr) munmap(uring->cq_ptr, uring->cq_ring_size);
+	if(uring->sq_ptr) munmap(uring->sq_ptr, uring->sq_ring_size);
+	if(uring->ring_fd >= 0) close(uring->ring_fd);
+	free(uring);
+}
+
+static io_uring_ctx_t * io_uring_ctx_new(unsigned int entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if(ring_fd < 0) return NULL; // ENOSYS or EPERM (disabled by sysctl / seccomp)
+
+	io_uring_ctx_t * uring = calloc(1, sizeof(*uring));
+	assert(uring);
+	uring->ring_fd = ring_fd;
+	uring->entries = params.sq_entries;
+
+	uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(uring->cq_ring_size > uring->sq_ring_size) uring->sq_ring_size = uring->cq_ring_size;
+		uring->cq_ring_size = uring->sq_ring_size;
+	}
+
+	void * sq_ptr = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if(sq_ptr == MAP_FAILED) goto label_err;
+	uring->sq_ptr = sq_ptr;
+
+	void * cq_ptr = sq_ptr;
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq_ptr = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if(cq_ptr == MAP_FAILED) goto label_err;
+	}
+	uring->cq_ptr = cq_ptr;
+
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void * sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED) goto label_err;
+	uring->sqes = sqes;
+
+	uring->sq_head  = (unsigned int *)((char *)sq_ptr + params.sq_off.head);
+	uring->sq_tail  = (unsigned int *)((char *)sq_ptr + params.sq_off.tail);
+	uring->sq_mask  = (unsigned int *)((char *)sq_ptr + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int *)((char *)sq_ptr + params.sq_off.array);
+	uring->cq_head  = (unsigned int *)((char *)cq_ptr + params.cq_off.head);
+	uring->cq_tail  = (unsigned int *)((char *)cq_ptr + params.cq_off.tail);
+	uring->cq_mask  = (unsigned int *)((char *)cq_ptr + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)((char *)cq_ptr + params.cq_off.cqes);
+	return uring;
+
+label_err:
+	perror("io_uring_ctx_new()::mmap()");
+	io_uring_ctx_free(uring);
+	return NULL;
+}
+
+static void io_uring_prep_read(io_uring_ctx_t * uring, read_item_t * item)
+{
+	block_read_request_t * request = item->request;
+	unsigned int tail = *uring->sq_tail;	// the only producer
+	unsigned int index = tail & *uring->sq_mask;
+
+	struct io_uring_sqe * sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+
+	item->iov->iov_base = request->data + item->cb_done;
+	item->iov->iov_len = request->length - item->cb_done;
+
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = item->fd;
+	sqe->addr = (uint64_t)(uintptr_t)item->iov;
+	sqe->len = 1;
+	sqe->off = request->offset + item->cb_done;
+	sqe->user_data = (uint64_t)(uintptr_t)item;
+
+	uring->sq_array[index] = index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++uring->inflight;
+}
+
+static unsigned int io_uring_reap(block_file_reader_private_t * priv, io_uring_ctx_t * uring)
+{
+	unsigned int to_submit = 0;
+	unsigned int head = *uring->cq_head;
+	unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while(head != tail)
+	{
+		struct io_uring_cqe * cqe = &uring->cqes[head & *uring->cq_mask];
+		read_item_t * item = (read_item_t *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+		++head;
+		--uring->inflight;
+
+		if(res < 0) {
+			item_complete(priv, item, -res);
+			continue;
+		}
+		if(res == 0) {
+			item_complete(priv, item, ENODATA);
+			continue;
+		}
+
+		item->cb_done += res;
+		if(item->cb_done < item->request->length) { // short read, resubmit the remaining part
+			io_uring_prep_read(uring, item);
+			++to_submit;
+			continue;
+		}
+		item_complete(priv, item, 0);
+	}
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	return to_submit;
+}
+
+static void * io_uring_thread(void * user_data)
+{
+	block_file_reader_private_t * priv = user_data;
+	assert(priv && priv->uring);
+	io_uring_ctx_t * uring = priv->uring;
+
+	unsigned int to_submit = 0;
+	while(1)
+	{
+		pthread_mutex_lock(&priv->mutex);
+		while(0 == uring->inflight && 0 == to_submit && !priv->quit && NULL == priv->head) {
+			pthread_cond_wait(&priv->cond, &priv->mutex);
+		}
+		if(priv->quit && NULL == priv->head && 0 == uring->inflight && 0 == to_submit) {
+			pthread_mutex_unlock(&priv->mutex);
+			break;
+		}
+
+		while((uring->inflight) < uring->entries)
+		{
+			read_item_t * item = queue_pop_item_locked(priv);
+			if(NULL == item) break;
+			io_uring_prep_read(uring, item);
+			++to_submit;
+		}
+		pthread_mutex_unlock(&priv->mutex);
+
+		int rc = (int)syscall(__NR_io_uring_enter, uring->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(rc < 0) {
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+			perror("io_uring_thread()::io_uring_enter()");
+			abort();
+		}
+		to_submit -= rc;
+		to_submit += io_uring_reap(priv, uring);
+	}
+	pthread_exit((void *)(long)0);
+}
+#endif
+
+/***************************************************************
+ * block_file_reader
+****************************************************************/
+static void give_readahead_hints(block_file_reader_private_t * priv, read_batch_t * batch)
+{
+	// merge the requests of the same file into one range
+	int64_t file_index = -1;
+	int fd = -1;
+	int64_t begin = 0, end = 0;
+	for(ssize_t i = 0; i <= batch->count; ++i)
+	{
+		read_item_t * item = (i < batch->count)?&batch->items[i]:NULL;
+		if(NULL == item || item->fd < 0 || item->request->file_index != file_index)
+		{
+			if(fd >= 0 && end > begin) {
+				posix_fadvise(fd, begin, end - begin, POSIX_FADV_SEQUENTIAL);
+				posix_fadvise(fd, begin, end - begin, POSIX_FADV_WILLNEED);	// start async readahead
+			}
+			if(NULL == item) break;
+			fd = item->fd;
+			file_index = item->request->file_index;
+			begin = item->request->offset;
+			end = begin + item->request->length;
+			continue;
+		}
+		if(item->request->offset < begin) begin = item->request->offset;
+		if((item->request->offset + item->request->length) > end) end = item->request->offset + item->request->length;
+	}
+}
+
+static int reader_submit(struct block_file_reader * reader,
+	block_read_request_t * requests, ssize_t count,
+	int flags,
+	block_reader_on_completed_callback on_completed,
+	void * user_data)
+{
+	assert(reader && reader->priv);
+	block_file_reader_private_t * priv = reader->priv;
+	if(count <= 0 || NULL == requests) return -1;
+
+	read_batch_t * batch = calloc(1, sizeof(*batch) + count * sizeof(read_item_t));
+	assert(batch);
+	batch->requests = requests;
+	batch->count = count;
+	batch->pending = count + 1;	// +1: hold the batch until all items were queued
+	batch->on_completed = on_completed;
+	batch->user_data = user_data;
+
+	read_item_t * first = NULL, * last = NULL;
+	for(ssize_t i = 0; i < count; ++i)
+	{
+		read_item_t * item = &batch->items[i];
+		block_read_request_t * request = &requests[i];
+		item->batch = batch;
+		item->request = request;
+		request->cb_read = 0;
+		request->err_code = 0;
+
+		item->fd = block_files_get_fd(priv->files, request->file_index);
+		if(NULL == request->data && request->length > 0) request->data = malloc(request->length);
+
+		if(item->fd < 0 || NULL == request->data || 0 == request->length) {
+			item_complete(priv, item, (item->fd < 0)?EBADF:EINVAL);
+			continue;
+		}
+
+		if(last) last->next = item;
+		else first = item;
+		last = item;
+	}
+
+	if(flags & block_reader_flags_sequential) give_readahead_hints(priv, batch);
+	if(first) queue_push_items(priv, first, last);
+
+	item_complete(priv, &(read_item_t){ .batch = batch, .request = &(block_read_request_t){ 0 }, .fd = -1 }, 0);
+	return 0;
+}
+
+struct read_batch_waiter
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done;
+};
+static void on_read_batch_completed(struct block_file_reader * reader,
+	block_read_request_t * requests, ssize_t count,
+	void * user_data)
+{
+	struct read_batch_waiter * waiter = user_data;
+	pthread_mutex_lock(&waiter->mutex);
+	waiter->done = 1;
+	pthread_cond_signal(&waiter->cond);
+	pthread_mutex_unlock(&waiter->mutex);
+}
+
+static ssize_t reader_read_batch(struct block_file_reader * reader,
+	block_read_request_t * requests, ssize_t count,
+	int flags)
+{
+	struct read_batch_waiter waiter = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+
+	int rc = reader_submit(reader, requests, count, flags, on_read_batch_completed, &waiter);
+	if(rc) return -1;
+
+	pthread_mutex_lock(&waiter.mutex);
+	while(!waiter.done) pthread_cond_wait(&waiter.cond, &waiter.mutex);
+	pthread_mutex_unlock(&waiter.mutex);
+
+	pthread_cond_destroy(&waiter.cond);
+	pthread_mutex_destroy(&waiter.mutex);
+
+	ssize_t num_ok = 0;
+	for(ssize_t i = 0; i < count; ++i) if(0 == requests[i].err_code) ++num_ok;
+	return num_ok;
+}
+
+block_file_reader_t * block_file_reader_init(block_file_reader_t * reader,
+	const char * blocks_dir,
+	int num_threads,
+	int use_io_uring,
+	void * user_data)
+{
+	if(NULL == blocks_dir) blocks_dir = "./blocks";
+	if(num_threads <= 0) num_threads = BLOCK_FILE_READER_DEFAULT_THREADS;
+
+	if(NULL == reader) reader = calloc(1, sizeof(*reader));
+	assert(reader);
+	reader->user_data = user_data;
+	reader->submit = reader_submit;
+	reader->read_batch = reader_read_batch;
+
+	block_file_reader_private_t * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->reader = reader;
+	reader->priv = priv;
+	block_files_init(priv->files, blocks_dir);
+
+	int rc = pthread_mutex_init(&priv->mutex, NULL);
+	assert(0 == rc);
+	rc = pthread_cond_init(&priv->cond, NULL);
+	assert(0 == rc);
+
+	reader->backend = block_reader_backend_thread_pool;
+#ifdef HAS_IO_URING
+	if(use_io_uring) {
+		priv->uring = io_uring_ctx_new(BLOCK_FILE_READER_QUEUE_DEPTH);
+		if(priv->uring) reader->backend = block_reader_backend_io_uring;
+	}
+#endif
+
+	if(reader->backend == block_reader_backend_io_uring) num_threads = 1;
+	priv->num_threads = num_threads;
+	priv->threads = calloc(num_threads, sizeof(*priv->threads));
+	assert(priv->threads);
+
+	for(int i = 0; i < num_threads; ++i)
+	{
+#ifdef HAS_IO_URING
+		if(priv->uring) {
+			rc = pthread_create(&priv->threads[i], NULL, io_uring_thread, priv);
+			assert(0 == rc);
+			continue;
+		}
+#endif
+		rc = pthread_create(&priv->threads[i], NULL, pread_worker_thread, priv);
+		assert(0 == rc);
+	}
+	return reader;
+}
+
+void block_file_reader_cleanup(block_file_reader_t * reader)
+{
+	if(NULL == reader || NULL == reader->priv) return;
+	block_file_reader_private_t * priv = reader->priv;
+
+	// finish all pending requests and stop
+	pthread_mutex_lock(&priv->mutex);
+	priv->quit = 1;
+	pthread_cond_broadcast(&priv->cond);
+	pthread_mutex_unlock(&priv->mutex);
+
+	for(int i = 0; i < priv->num_threads; ++i)
+	{
+		void * exit_code = NULL;
+		pthread_join(priv->threads[i], &exit_code);
+	}
+	free(priv->threads);
+
+#ifdef HAS_IO_URING
+	io_uring_ctx_free(priv->uring);
+#endif
+
+	block_files_cleanup(priv->files);
+	pthread_cond_destroy(&priv->cond);
+	pthread_mutex_destroy(&priv->mutex);
+	free(priv);
+	reader->priv = NULL;
+	return;
+}
+
+
+/***************************************************************
+ * sequential scan
+****************************************************************/
+ssize_t block_file_reader_scan(block_file_reader_t * reader, int64_t file_index, uint32_t magic,
+	block_reader_on_block_callback on_block, void * user_data)
+{
+	assert(reader && reader->priv && on_block);
+	block_file_reader_private_t * priv = reader->priv;
+
+	char path[PATH_MAX * 2] = "";
+	struct stat st[1];
+	snprintf(path, sizeof(path), "%s/" BLOCK_FILE_FMT, priv->files->blocks_dir, (int)file_index);
+	if(stat(path, st)) return -1;
+
+	int64_t file_size = st->st_size;
+	size_t window_size = BLOCK_FILE_READER_SCAN_WINDOW_SIZE;
+	unsigned char * window = malloc(window_size);
+	block_read_request_t * requests = calloc(window_size / BLOCK_FILE_READER_SCAN_CHUNK_SIZE + 1, sizeof(*requests));
+	assert(window && requests);
+
+	ssize_t num_blocks = 0;
+	int64_t pos = 0;	// the file offset of the window
+	int done = 0;
+	while(!done && (pos + 8) <= file_size)
+	{
+		// split the window into chunks, read in parallel
+		int64_t length = file_size - pos;
+		if(length > (int64_t)window_size) length = window_size;
+
+		ssize_t count = 0;
+		for(int64_t offset = 0; offset < length; offset += BLOCK_FILE_READER_SCAN_CHUNK_SIZE, ++count) {
+			int64_t cb = length - offset;
+			if(cb > BLOCK_FILE_READER_SCAN_CHUNK_SIZE) cb = BLOCK_FILE_READER_SCAN_CHUNK_SIZE;
+			requests[count] = (block_read_request_t){
+				.file_index = file_index,
+				.offset = pos + offset,
+				.length = cb,
+				.data = window + offset,
+			};
+		}
+		if(reader->read_batch(reader, requests, count, block_reader_flags_sequential) != count) {
+			num_blocks = -1;
+			break;
+		}
+
+		int64_t p = 0;
+		while(!done && (p + 8) <= length)
+		{
+			uint32_t record_magic = 0, block_size = 0;
+			memcpy(&record_magic, window + p, 4);
+			memcpy(&block_size, window + p + 4, 4);
+			if(record_magic != magic) {
+				if(0 == record_magic) { done = 1; break; }	// the preallocated space
+				fprintf(stderr, "\e[31m" "[ERROR]::%s(): invalid magic: file=%d, pos=%ld" "\e[39m" "\n",
+					__FUNCTION__, (int)file_index, (long)(pos + p));
+				num_blocks = -1;
+				done = 1;
+				break;
+			}
+			if((p + 8 + block_size) > length) break;	// continue from this record with the next window
+
+			++num_blocks;
+			if(on_block(reader, file_index, pos + p + 8, block_size, window + p + 8, user_data)) done = 1;
+			p += 8 + block_size;
+		}
+		if(done) break;
+
+		if(0 == p) {
+			// the first record does not fit in the window
+			uint32_t block_size = 0;
+			memcpy(&block_size, window + 4, 4);
+			if((pos + 8 + block_size) > file_size) break;	// truncated
+
+			window_size = ((8 + (size_t)block_size) + BLOCK_FILE_READER_SCAN_CHUNK_SIZE - 1) 
+				/ BLOCK_FILE_READER_SCAN_CHUNK_SIZE * BLOCK_FILE_READER_SCAN_CHUNK_SIZE;
+			window = realloc(window, window_size);
+			requests = realloc(requests, (window_size / BLOCK_FILE_READER_SCAN_CHUNK_SIZE + 1) * sizeof(*requests));
+			assert(window && requests);
+			continue;
+		}
+		pos += p;
+	}
+	free(requests);
+	free(window);
+	return num_blocks;
+}
+
+#if defined(_TEST_BLOCK_FILE_READER) && defined(_STAND_ALONE)
+#include <sys/stat.h>
+#include <time.h>
+
+#define NUM_BLOCKS	(200)
+static block_read_request_t s_requests[NUM_BLOCKS];
+
+static void generate_block_file(const char * blocks_dir)
+{
+	char path[PATH_MAX] = "";
+	mkdir(blocks_dir, 0775);
+	snprintf(path, sizeof(path), "%s/" BLOCK_FILE_FMT, blocks_dir, 0);
+
+	FILE * fp = fopen(path, "wb");
+	assert(fp);
+
+	int64_t pos = 0;
+	const uint32_t magic = 0xD9B4BEF9;
+	for(int i = 0; i < NUM_BLOCKS; ++i)
+	{
+		uint32_t block_size = 81 + (rand() % 256) * 1024;
+		unsigned char * data = malloc(block_size);
+		assert(data);
+		memset(data, i, block_size);
+
+		fwrite(&magic, sizeof(magic), 1, fp);
+		fwrite(&block_size, sizeof(block_size), 1, fp);
+		fwrite(data, 1, block_size, fp);
+		free(data);
+
+		pos += 8;
+		s_requests[i].file_index = 0;
+		s_requests[i].offset = pos;
+		s_requests[i].length = block_size;
+		pos += block_size;
+	}
+
+	// the preallocated space (zero-filled) at the end of the file
+	static const unsigned char zeros[4096];
+	fwrite(zeros, 1, sizeof(zeros), fp);
+	fclose(fp);
+}
+
+static void verify_requests(block_read_request_t * requests, ssize_t count)
+{
+	for(ssize_t i = 0; i < count; ++i)
+	{
+		assert(0 == requests[i].err_code && requests[i].cb_read == requests[i].length);
+		for(uint32_t j = 0; j < requests[i].length; ++j) assert(requests[i].data[j] == (unsigned char)i);
+		free(requests[i].data);
+		requests[i].data = NULL;
+	}
+}
+
+static void test_reader(const char * blocks_dir, int use_io_uring)
+{
+	block_file_reader_t * reader = block_file_reader_init(NULL, blocks_dir, 4, use_io_uring, NULL);
+	assert(reader);
+	printf("== backend: %s\n", (reader->backend == block_reader_backend_io_uring)?"io_uring":"pread thread pool");
+
+	struct timespec ts_begin, ts_end;
+	clock_gettime(CLOCK_MONOTONIC, &ts_begin);
+	ssize_t num_ok = reader->read_batch(reader, s_requests, NUM_BLOCKS, block_reader_flags_sequential);
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	double time_elapsed = (double)(ts_end.tv_sec - ts_begin.tv_sec) + (double)(ts_end.tv_nsec - ts_begin.tv_nsec) / 1000000000;
+	printf("   read %ld blocks in %.6f seconds\n", (long)num_ok, time_elapsed);
+
+	assert(num_ok == NUM_BLOCKS);
+	verify_requests(s_requests, NUM_BLOCKS);
+
+	// invalid file
+	block_read_request_t request[1] = {{ .file_index = 99999, .offset = 0, .length = 100 }};
+	num_ok = reader->read_batch(reader, request, 1, 0);
+	assert(0 == num_ok && request->err_code != 0 && request->cb_read == -1);
+	free(request->data);
+
+	block_file_reader_cleanup(reader);
+	free(reader);
+}
+
+struct scan_context
+{
+	ssize_t count;
+	ssize_t max_count;
+};
+static int on_scan_block(struct block_file_reader * reader,
+	int64_t file_index, int64_t start_pos, uint32_t block_size, const unsigned char * data,
+	void * user_data)
+{
+	struct scan_context * ctx = user_data;
+	ssize_t i = ctx->count++;
+	assert(i < NUM_BLOCKS);
+	assert(0 == file_index && start_pos == s_requests[i].offset && block_size == s_requests[i].length);
+	for(uint32_t j = 0; j < block_size; ++j) assert(data[j] == (unsigned char)i);
+	return (ctx->count == ctx->max_count);
+}
+
+static void test_scan(const char * blocks_dir)
+{
+	block_file_reader_t * reader = block_file_reader_init(NULL, blocks_dir, 4, 0, NULL);
+	assert(reader);
+
+	// the blocks span several windows, the scan stops at the zero-filled space
+	struct scan_context ctx = { 0 };
+	ssize_t count = block_file_reader_scan(reader, 0, 0xD9B4BEF9, on_scan_block, &ctx);
+	printf("== scan: %ld blocks\n", (long)count);
+	assert(count == NUM_BLOCKS && ctx.count == NUM_BLOCKS);
+
+	// stopped by the callback
+	ctx = (struct scan_context){ .max_count = 10 };
+	count = block_file_reader_scan(reader, 0, 0xD9B4BEF9, on_scan_block, &ctx);
+	assert(count == 10 && ctx.count == 10);
+
+	// wrong network, missing file
+	ctx = (struct scan_context){ 0 };
+	assert(-1 == block_file_reader_scan(reader, 0, 0x0709110B, on_scan_block, &ctx) && 0 == ctx.count);
+	assert(-1 == block_file_reader_scan(reader, 99999, 0xD9B4BEF9, on_scan_block, &ctx));
+
+	block_file_reader_cleanup(reader);
+	free(reader);
+}
+
+int main(int argc, char **argv)
+{
+	const char * blocks_dir = "data/blocks";
+	if(argc > 1) blocks_dir = argv[1];
+	generate_block_file(blocks_dir);
+
+	test_reader(blocks_dir, 0);
+	test_reader(blocks_dir, 1);
+	test_scan(blocks_dir);
+	return 0;
+}
+#endif
@@ -0,0 +1,168 @@
+/*
+ * block_files.c
+ *
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "block_files.h"
+
+static int block_files_resize(block_files_t * files, ssize_t new_size)
+{
+	if(new_size <= 0) new_size = BLOCK_FILES_ALLOC_SIZE;
+	else new_size = (new_size + BLOCK_FILES_ALLOC_SIZE - 1) / BLOCK_FILES_ALLOC_SIZE * BLOCK_FILES_ALLOC_SIZE;
+
+	if(new_size <= files->max_files) return 0;
+
+	struct block_file_ref * fds = realloc(files->fds, new_size * sizeof(*fds));
+	assert(fds);
+	for(ssize_t i = files->max_files; i < new_size; ++i) fds[i] = (struct block_file_ref){ .fd = -1 };
+
+	files->fds = fds;
+	files->max_files = new_size;
+	return 0;
+}
+
+block_files_t * block_files_init(block_files_t * files, const char * blocks_dir)
+{
+	if(NULL == blocks_dir) blocks_dir = "./blocks";
+	if(NULL == files) files = calloc(1, sizeof(*files));
+	else memset(files, 0, sizeof(*files));
+	assert(files);
+
+	strncpy(files->blocks_dir, blocks_dir, sizeof(files->blocks_dir) - 1);
+	int rc = pthread_mutex_init(&files->mutex, NULL);
+	assert(0 == rc);
+	block_files_resize(files, 0);
+	return files;
+}
+
+void block_files_cleanup(block_files_t * files)
+{
+	if(NULL == files) return;
+	for(ssize_t i = 0; i < files->max_files; ++i) {
+		assert(0 == files->fds[i].refs);
+		if(files->fds[i].fd >= 0) close(files->fds[i].fd);
+	}
+	free(files->fds);
+	files->fds = NULL;
+	files->max_files = 0;
+
+	// all users should have released their references by now
+	for(ssize_t i = 0; i < files->retired_count; ++i) close(files->retired[i].fd);
+	free(files->retired);
+	files->retired = NULL;
+	files->retired_count = 0;
+	files->retired_max = 0;
+
+	pthread_mutex_destroy(&files->mutex);
+	return;
+}
+
+int block_files_get_fd(block_files_t * files, int64_t file_index)
+{
+	if(file_index < 0 || file_index > INT_MAX) return -1;
+
+	int fd = -1;
+	pthread_mutex_lock(&files->mutex);
+	if(file_index >= files->max_files) block_files_resize(files, file_index + 1);
+
+	struct block_file_ref * ref = &files->fds[file_index];
+	if(ref->fd < 0)
+	{
+		char path[PATH_MAX * 2] = "";
+		int cb = snprintf(path, sizeof(path), "%s/" BLOCK_FILE_FMT, files->blocks_dir, (int)file_index);
+		assert(cb > 0 && cb < sizeof(path));
+
+		ref->fd = open(path, O_RDONLY | O_CLOEXEC);
+		if(ref->fd < 0) {
+			fprintf(stderr, "\e[31m" "[ERROR]::%s(): open('%s') failed: %s" "\e[39m" "\n",
+				__FUNCTION__, path, strerror(errno));
+		}
+	}
+	fd = ref->fd;
+	if(fd >= 0) ++ref->refs;
+	pthread_mutex_unlock(&files->mutex);
+	return fd;
+}
+
+void block_files_put_fd(block_files_t * files, int64_t file_index, int fd)
+{
+	if(fd < 0) return;
+
+	pthread_mutex_lock(&files->mutex);
+	if(file_index >= 0 && file_index < files->max_files && files->fds[file_index].fd == fd) {
+		assert(files->fds[file_index].refs > 0);
+		--files->fds[file_index].refs;
+		pthread_mutex_unlock(&files->mutex);
+		return;
+	}
+
+	// the file has been closed meanwhile, the fd can not have been reused since it is still open
+	ssize_t i = 0;
+	for(; i < files->retired_count; ++i) if(files->retired[i].fd == fd) break;
+	assert(i < files->retired_count && files->retired[i].refs > 0);
+	if(i < files->retired_count && --files->retired[i].refs == 0) {
+		close(fd);
+		files->retired[i] = files->retired[--files->retired_count];
+	}
+	pthread_mutex_unlock(&files->mutex);
+	return;
+}
+
+void block_files_close(block_files_t * files, int64_t file_index)
+{
+	pthread_mutex_lock(&files->mutex);
+	if(file_index >= 0 && file_index < files->max_files && files->fds[file_index].fd >= 0) {
+		struct block_file_ref * ref = &files->fds[file_index];
+		if(0 == ref->refs) close(ref->fd);
+		else {
+			// still in use: close it when the last reference is released
+			if(files->retired_count >= files->retired_max) {
+				ssize_t new_size = files->retired_max?(files->retired_max * 2):16;
+				struct block_file_ref * retired = realloc(files->retired, new_size * sizeof(*retired));
+				assert(retired);
+				files->retired = retired;
+				files->retired_max = new_size;
+			}
+			files->retired[files->retired_count++] = *ref;
+		}
+		*ref = (struct block_file_ref){ .fd = -1 };
+	}
+	pthread_mutex_unlock(&files->mutex);
+	return;
+}
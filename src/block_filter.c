@@ -0,0 +1,1345 @@
+/*
+ * block_filter.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "auto_buffer.h"
+#include "satoshi-types.h"
+#include "compact_block.h"	// siphash24()
+#include "block_filter.h"
+
+#define OP_RETURN	(0x6a)
+
+/*************************************
+ * golomb-rice coded set
+ ************************************/
+struct bit_writer
+{
+	unsigned char * p;
+	uint64_t acc;
+	int nbits;		// pending bits in acc (< 8)
+};
+
+static inline void bit_writer_write(struct bit_writer * writer, uint64_t value, int nbits)	// nbits <= 56
+{
+	writer->acc = (writer->acc << nbits) | (value & ((UINT64_C(1) << nbits) - 1));
+	writer->nbits += nbits;
+	while(writer->nbits >= 8) {
+		writer->nbits -= 8;
+		*writer->p++ = (unsigned char)(writer->acc >> writer->nbits);
+	}
+}
+
+static inline void bit_writer_flush(struct bit_writer * writer)
+{
+	if(writer->nbits > 0) *writer->p++ = (unsigned char)(writer->acc << (8 - writer->nbits));
+	writer->nbits = 0;
+}
+
+struct bit_reader
+{
+	const unsigned char * p;
+	const unsigned char * p_end;
+	uint64_t acc;
+	int nbits;
+};
+
+static inline int bit_reader_read(struct bit_reader * reader, int nbits, uint64_t * value)	// nbits <= 32
+{
+	while(reader->nbits < nbits) {
+		if(reader->p >= reader->p_end) return -1;
+		reader->acc = (reader->acc << 8) | *reader->p++;
+		reader->nbits += 8;
+	}
+	reader->nbits -= nbits;
+	*value = (reader->acc >> reader->nbits) & ((UINT64_C(1) << nbits) - 1);
+	return 0;
+}
+
+// quotient: unary coded (q '1' bits and a '0' bit), remainder: P bits
+static inline void golomb_rice_encode(struct bit_writer * writer, uint64_t delta)
+{
+	uint64_t q = delta >> BLOCK_FILTER_BASIC_P;
+	while(q >= 32) {
+		bit_writer_write(writer, 0xffffffff, 32);
+		q -= 32;
+	}
+	bit_writer_write(writer, ((UINT64_C(1) << q) - 1) << 1, q + 1);
+	bit_writer_write(writer, delta, BLOCK_FILTER_BASIC_P);
+}
+
+static inline int golomb_rice_decode(struct bit_reader * reader, uint64_t * delta)
+{
+	uint64_t q = 0, bit = 0;
+	while(1) {
+		if(bit_reader_read(reader, 1, &bit)) return -1;
+		if(!bit) break;
+		++q;
+	}
+	uint64_t r = 0;
+	if(bit_reader_read(reader, BLOCK_FILTER_BASIC_P, &r)) return -1;
+	*delta = (q << BLOCK_FILTER_BASIC_P) | r;
+	return 0;
+}
+
+// [0, 2^64) --> [0, range) without a division
+static inline uint64_t map_into_range(uint64_t hash, uint64_t range)
+{
+	return (uint64_t)(((unsigned __int128)hash * range) >> 64);
+}
+
+static inline uint64_t hash_element(const block_filter_t * filter, const void * data, size_t length)
+{
+	return map_into_range(siphash24(filter->k0, filter->k1, data, length), (uint64_t)filter->num_elements * BLOCK_FILTER_BASIC_M);
+}
+
+static void filter_set_block_hash(block_filter_t * filter, const uint256_t * block_hash)
+{
+	filter->block_hash = *block_hash;
+	memcpy(&filter->k0, (const unsigned char *)block_hash, 8);
+	memcpy(&filter->k1, (const unsigned char *)block_hash + 8, 8);
+}
+
+
+/*************************************
+ * filter
+ ************************************/
+struct gcs_element
+{
+	uint64_t hash;		// siphash (not mapped yet)
+	const unsigned char * data;
+	size_t length;
+};
+
+static int compare_elements(const void * _a, const void * _b)
+{
+	const struct gcs_element * a = _a, * b = _b;
+	if(a->hash != b->hash) return (a->hash < b->hash)?-1:1;
+	if(a->length != b->length) return (a->length < b->length)?-1:1;
+	return memcmp(a->data, b->data, a->length);
+}
+
+static inline ssize_t add_element(struct gcs_element * elements, ssize_t count, const varstr_t * scripts, int is_output)
+{
+	if(NULL == scripts) return count;
+	size_t length = varstr_length(scripts);
+	const unsigned char * data = varstr_getdata_ptr(scripts);
+	if(0 == length || (is_output && data[0] == OP_RETURN)) return count;
+	
+	elements[count].data = data;
+	elements[count].length = length;
+	return count + 1;
+}
+
+int block_filter_build(block_filter_t * filter, const satoshi_block_t * block, const uint256_t * block_hash,
+	const varstr_t ** spent_scripts, ssize_t spent_count)
+{
+	assert(filter && block);
+	if(NULL == block_hash) block_hash = &block->hash;
+	
+	ssize_t num_inputs = 0;
+	ssize_t max_elements = spent_count;
+	for(ssize_t i = 0; i < block->txn_count; ++i) {
+		if(i > 0) num_inputs += block->txns[i].txin_count;
+		max_elements += block->txns[i].txout_count;
+	}
+	if(num_inputs != spent_count || (spent_count > 0 && NULL == spent_scripts)) return -1;
+	
+	memset(filter, 0, sizeof(*filter));
+	filter->filter_type = BLOCK_FILTER_TYPE_BASIC;
+	filter_set_block_hash(filter, block_hash);
+	
+	struct gcs_element * elements = NULL;
+	if(max_elements > 0) {
+		elements = malloc(max_elements * sizeof(*elements));
+		assert(elements);
+	}
+	
+	ssize_t count = 0;
+	for(ssize_t i = 0; i < block->txn_count; ++i) {
+		const satoshi_tx_t * tx = &block->txns[i];
+		for(ssize_t ii = 0; ii < tx->txout_count; ++ii) count = add_element(elements, count, tx->txouts[ii].scripts, 1);
+	}
+	for(ssize_t i = 0; i < spent_count; ++i) count = add_element(elements, count, spent_scripts[i], 0);
+	
+	// the elements are a set: sorted by hash, the duplicates are adjacent
+	for(ssize_t i = 0; i < count; ++i) elements[i].hash = siphash24(filter->k0, filter->k1, elements[i].data, elements[i].length);
+	if(count > 1) qsort(elements, count, sizeof(*elements), compare_elements);
+	ssize_t num_elements = 0;
+	for(ssize_t i = 0; i < count; ++i) {
+		if(num_elements > 0 && 0 == compare_elements(&elements[num_elements - 1], &elements[i])) continue;
+		elements[num_elements++] = elements[i];
+	}
+	filter->num_elements = num_elements;
+	
+	// the sum of the quotients is less than (N * M) >> P ~= 1.5 * N, so an element takes less than (P + 1 + 1.5) bits on average
+	ssize_t vint_size = varint_calc_size(num_elements);
+	ssize_t max_size = vint_size + (num_elements * (BLOCK_FILTER_BASIC_P + 3) + 7) / 8 + 8;
+	unsigned char * data = malloc(max_size);
+	assert(data);
+	varint_set((varint_t *)data, num_elements);
+	
+	// the mapping keeps the order of the hashes
+	struct bit_writer writer = { .p = data + vint_size };
+	uint64_t range = (uint64_t)num_elements * BLOCK_FILTER_BASIC_M;
+	uint64_t last_value = 0;
+	for(ssize_t i = 0; i < num_elements; ++i) {
+		uint64_t value = map_into_range(elements[i].hash, range);
+		golomb_rice_encode(&writer, value - last_value);
+		last_value = value;
+	}
+	bit_writer_flush(&writer);
+	free(elements);
+	
+	filter->size = writer.p - data;
+	assert(filter->size <= max_size);
+	filter->data = data;
+	return 0;
+}
+
+int block_filter_load(block_filter_t * filter, const uint256_t * block_hash, const unsigned char * data, ssize_t size)
+{
+	assert(filter && block_hash);
+	if(NULL == data || size < 1) return -1;
+	
+	ssize_t vint_size = varint_size((varint_t *)data);
+	if(vint_size > size) return -1;
+	
+	// an element takes at least (P + 1) bits
+	uint64_t num_elements = varint_get((varint_t *)data);
+	if(num_elements > ((uint64_t)(size - vint_size) * 8 / (BLOCK_FILTER_BASIC_P + 1))) return -1;
+	
+	memset(filter, 0, sizeof(*filter));
+	filter->filter_type = BLOCK_FILTER_TYPE_BASIC;
+	filter_set_block_hash(filter, block_hash);
+	filter->num_elements = num_elements;
+	
+	filter->data = malloc(size);
+	assert(filter->data);
+	memcpy(filter->data, data, size);
+	filter->size = size;
+	return 0;
+}
+
+void block_filter_cleanup(block_filter_t * filter)
+{
+	if(NULL == filter) return;
+	free(filter->data);
+	filter->data = NULL;
+	filter->size = 0;
+	filter->num_elements = 0;
+}
+
+void block_filter_get_hash(const block_filter_t * filter, uint256_t * filter_hash)
+{
+	assert(filter && filter->data && filter_hash);
+	hash256(filter->data, filter->size, (uint8_t *)filter_hash);
+}
+
+void block_filter_compute_header(const uint256_t * filter_hash, const uint256_t * prev_header, uint256_t * header)
+{
+	unsigned char data[64];
+	memcpy(data, filter_hash, 32);
+	memcpy(data + 32, prev_header, 32);
+	hash256(data, sizeof(data), (uint8_t *)header);
+}
+
+// targets: sorted
+static int match_sorted(const block_filter_t * filter, ssize_t count, const uint64_t * targets)
+{
+	if(filter->num_elements <= 0 || count <= 0) return 0;
+	
+	struct bit_reader reader = {
+		.p = filter->data + varint_size((varint_t *)filter->data),
+		.p_end = filter->data + filter->size,
+	};
+	
+	uint64_t value = 0;
+	ssize_t t = 0;
+	for(ssize_t i = 0; i < filter->num_elements; ++i) {
+		uint64_t delta = 0;
+		if(golomb_rice_decode(&reader, &delta)) break;	// truncated
+		value += delta;
+		
+		while(targets[t] < value) if(++t == count) return 0;
+		if(targets[t] == value) return 1;
+	}
+	return 0;
+}
+
+int block_filter_match(const block_filter_t * filter, const void * element, size_t length)
+{
+	assert(filter && element);
+	uint64_t target = hash_element(filter, element, length);
+	return match_sorted(filter, 1, &target);
+}
+
+static int compare_uint64(const void * a, const void * b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x < y)?-1:(x > y);
+}
+
+int block_filter_match_any(const block_filter_t * filter, ssize_t count, const unsigned char ** elements, const size_t * lengths)
+{
+	assert(filter);
+	if(count <= 0 || filter->num_elements <= 0) return 0;
+	assert(elements && lengths);
+	
+	uint64_t * targets = malloc(count * sizeof(*targets));
+	assert(targets);
+	for(ssize_t i = 0; i < count; ++i) targets[i] = hash_element(filter, elements[i], lengths[i]);
+	qsort(targets, count, sizeof(*targets), compare_uint64);
+	
+	int rc = match_sorted(filter, count, targets);
+	free(targets);
+	return rc;
+}
+
+
+/*************************************
+ * block_filter_index
+ ************************************/
+#define TIP_KEY	"tip"	// in the undo db (the other keys are 32-byte block hashes)
+struct tip_record
+{
+	int32_t height;
+	uint256_t hash;
+	uint256_t header;
+}__attribute__((packed));
+
+typedef struct block_filter_index_private
+{
+	block_filter_index_t * index;
+	db_handle_t * db;			// block_hash --> struct block_filter_record
+	db_handle_t * height_db;	// height --> block_hash
+	db_handle_t * prevouts_db;	// outpoint --> struct prevout_record
+	db_handle_t * undo_db;		// block_hash --> undo data
+}block_filter_index_private_t;
+
+static ssize_t associate_height(db_handle_t * sdb,
+	const db_record_data_t * key,
+	const db_record_data_t * value,
+	db_record_data_t ** p_skeys)
+{
+	struct block_filter_record * record = value->data;
+	assert(value->size >= (ssize_t)sizeof(*record));
+	
+	db_record_data_t * skey = calloc(1, sizeof(*skey));
+	assert(skey);
+	skey->data = &record->height;
+	skey->size = sizeof(record->height);
+	*p_skeys = skey;
+	return 1;
+}
+
+static void free_records(db_record_data_t * records, ssize_t count)
+{
+	if(NULL == records) return;
+	for(ssize_t i = 0; i < count; ++i) db_record_data_cleanup(&records[i]);
+	free(records);
+}
+
+// the record (a copy) of the block, call free() to release it
+static struct block_filter_record * find_record(block_filter_index_private_t * priv, db_engine_txn_t * txn, 
+	const uint256_t * hash, ssize_t * p_size)
+{
+	db_record_data_t * values = NULL;
+	ssize_t count = priv->db->find(priv->db, txn, &(db_record_data_t){ .data = (void *)hash, .size = sizeof(*hash) }, &values);
+	
+	struct block_filter_record * record = NULL;
+	if(count == 1 && values[0].size > (ssize_t)sizeof(*record)) {
+		record = malloc(values[0].size);
+		assert(record);
+		memcpy(record, values[0].data, values[0].size);
+		*p_size = values[0].size;
+	}
+	free_records(values, count);
+	return record;
+}
+
+// only the main chain is indexed, there is one block at a height
+static struct block_filter_record * find_record_at(block_filter_index_private_t * priv, db_engine_txn_t * txn, 
+	int32_t height, uint256_t * hash, ssize_t * p_size)
+{
+	db_record_data_t * keys = NULL;
+	db_record_data_t * values = NULL;
+	ssize_t count = priv->height_db->find_secondary(priv->height_db, txn, 
+		&(db_record_data_t){ .data = &height, .size = sizeof(height) }, 
+		&keys, &values);
+	
+	struct block_filter_record * record = NULL;
+	if(count == 1 && keys[0].size == sizeof(*hash) && values[0].size > (ssize_t)sizeof(*record)) {
+		memcpy(hash, keys[0].data, sizeof(*hash));
+		record = malloc(values[0].size);
+		assert(record);
+		memcpy(record, values[0].data, values[0].size);
+		*p_size = values[0].size;
+	}
+	free_records(keys, count);
+	free_records(values, count);
+	return record;
+}
+
+static int put_tip(block_filter_index_private_t * priv, db_engine_txn_t * txn, const struct tip_record * tip)
+{
+	db_record_data_t key = { .data = TIP_KEY, .size = sizeof(TIP_KEY) - 1 };
+	if(tip->height < 0) {
+		int rc = priv->undo_db->del(priv->undo_db, txn, &key);
+		return (rc == DB_ENGINE_ERR_NOTFOUND)?0:rc;
+	}
+	return priv->undo_db->insert(priv->undo_db, txn, &key, &(db_record_data_t){ .data = (void *)tip, .size = sizeof(*tip) });
+}
+
+block_filter_index_t * block_filter_index_init(block_filter_index_t * index, db_engine_t * engine, const char * db_name, void * user_data)
+{
+	assert(engine);
+	if(NULL == db_name) db_name = "block_filters";
+	
+	if(NULL == index) index = calloc(1, sizeof(*index));
+	else memset(index, 0, sizeof(*index));
+	assert(index);
+	
+	index->user_data = user_data;
+	index->engine = engine;
+	index->num_threads = BLOCK_FILTER_INDEX_DEFAULT_THREADS;
+	index->height = -1;
+	pthread_mutex_init(&index->mutex, NULL);
+	
+	block_filter_index_private_t * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->index = index;
+	index->priv = priv;
+	
+	char name[PATH_MAX] = "";
+	snprintf(name, sizeof(name), "%s_height.db", db_name);
+	priv->height_db = engine->open_db(engine, name, db_format_type_btree, db_flags_dup_sort);
+	snprintf(name, sizeof(name), "%s.db", db_name);
+	priv->db = engine->open_db(engine, name, db_format_type_btree, 0);
+	snprintf(name, sizeof(name), "%s_prevouts.db", db_name);
+	priv->prevouts_db = engine->open_db(engine, name, db_format_type_hash, 0);
+	snprintf(name, sizeof(name), "%s_undo.db", db_name);
+	priv->undo_db = engine->open_db(engine, name, db_format_type_hash, 0);
+	assert(priv->db && priv->height_db && priv->prevouts_db && priv->undo_db);
+	
+	int rc = priv->db->associate(priv->db, NULL, priv->height_db, associate_height);
+	assert(0 == rc);
+	
+	// load the tip
+	db_record_data_t * values = NULL;
+	ssize_t count = priv->undo_db->find(priv->undo_db, NULL, &(db_record_data_t){ .data = TIP_KEY, .size = sizeof(TIP_KEY) - 1 }, &values);
+	if(count == 1 && values[0].size == sizeof(struct tip_record)) {
+		const struct tip_record * tip = values[0].data;
+		index->height = tip->height;
+		index->tip_hash = tip->hash;
+		index->tip_header = tip->header;
+	}
+	free_records(values, count);
+	return index;
+}
+
+void block_filter_index_cleanup(block_filter_index_t * index)
+{
+	if(NULL == index) return;
+	block_filter_index_private_t * priv = index->priv;
+	if(priv) {
+		db_engine_t * engine = index->engine;
+		engine->close_db(engine, priv->height_db);	// the secondary db first
+		engine->close_db(engine, priv->db);
+		engine->close_db(engine, priv->prevouts_db);
+		engine->close_db(engine, priv->undo_db);
+		free(priv);
+		index->priv = NULL;
+	}
+	pthread_mutex_destroy(&index->mutex);
+}
+
+/*
+ * connect / disconnect: maintain the unspent outputs store
+ *   undo data: varint(spent_count) { outpoint, prevout_record } ..., 
+ *              varint(txn_count) { txid, varint(txout_count) } ...
+ */
+struct prevout_record
+{
+	int64_t value;
+	unsigned char scripts[0];	// varstr
+}__attribute__((packed));
+
+static inline ssize_t prevout_record_size(const void * data, size_t length)
+{
+	if(length < (sizeof(struct prevout_record) + 1)) return -1;
+	const struct prevout_record * prevout = data;
+	ssize_t size = sizeof(*prevout) + varstr_size((const varstr_t *)prevout->scripts);
+	return (size <= length)?size:-1;
+}
+
+struct filter_job
+{
+	const satoshi_block_t * block;
+	const uint256_t * hash;
+	ssize_t spent_count;
+	varstr_t ** spent_scripts;
+	block_filter_t filter[1];
+	int rc;
+};
+
+static inline void push_varint(auto_buffer_t * buf, uint64_t value)
+{
+	unsigned char vint[9];
+	varint_set((varint_t *)vint, value);
+	auto_buffer_push(buf, vint, varint_calc_size(value));
+}
+
+static int connect_block(block_filter_index_private_t * priv, db_engine_txn_t * txn, struct filter_job * job)
+{
+	const satoshi_block_t * block = job->block;
+	ssize_t spent_count = 0;
+	for(ssize_t i = 1; i < block->txn_count; ++i) spent_count += block->txns[i].txin_count;
+	if(spent_count > 0) {
+		job->spent_scripts = calloc(spent_count, sizeof(*job->spent_scripts));
+		assert(job->spent_scripts);
+	}
+	
+	auto_buffer_t spent[1], created[1];
+	auto_buffer_init(spent, 0);
+	auto_buffer_init(created, 0);
+	
+	int rc = 0;
+	for(ssize_t i = 0; 0 == rc && i < block->txn_count; ++i) {
+		const satoshi_tx_t * tx = &block->txns[i];
+		
+		// the coinbase spends nothing
+		for(ssize_t ii = 0; i > 0 && ii < tx->txin_count; ++ii) {
+			const satoshi_outpoint_t * outpoint = &tx->txins[ii].outpoint;
+			db_record_data_t key = { .data = (void *)outpoint, .size = sizeof(*outpoint) };
+			db_record_data_t * values = NULL;
+			ssize_t count = priv->prevouts_db->find(priv->prevouts_db, txn, &key, &values);
+			if(count != 1 || prevout_record_size(values[0].data, values[0].size) != values[0].size) {
+				free_records(values, count);
+				fprintf(stderr, "\e[31m" "%s(): the spent output is unknown: tx=", __FUNCTION__);
+				dump2(stderr, tx->txid, sizeof(tx->txid));
+				fprintf(stderr, ", txin=%ld" "\e[39m" "\n", (long)ii);
+				rc = -1;
+				break;
+			}
+			const struct prevout_record * prevout = values[0].data;
+			job->spent_scripts[job->spent_count++] = varstr_clone((const varstr_t *)prevout->scripts);
+			auto_buffer_push(spent, outpoint, sizeof(*outpoint));
+			auto_buffer_push(spent, values[0].data, values[0].size);
+			free_records(values, count);
+			
+			rc = priv->prevouts_db->del(priv->prevouts_db, txn, &key);
+			if(rc) break;
+		}
+		if(rc) break;
+		
+		auto_buffer_push(created, tx->txid, sizeof(tx->txid));
+		push_varint(created, tx->txout_count);
+		for(ssize_t ii = 0; ii < tx->txout_count; ++ii) {
+			const varstr_t * scripts = tx->txouts[ii].scripts;
+			if(NULL == scripts) scripts = varstr_empty;
+			if(varstr_length(scripts) > 0 && varstr_getdata_ptr(scripts)[0] == OP_RETURN) continue;	// unspendable
+			
+			satoshi_outpoint_t outpoint = { .index = ii };
+			memcpy(outpoint.prev_hash, tx->txid, sizeof(outpoint.prev_hash));
+			
+			size_t size = sizeof(struct prevout_record) + varstr_size(scripts);
+			struct prevout_record * prevout = malloc(size);
+			assert(prevout);
+			prevout->value = tx->txouts[ii].value;
+			memcpy(prevout->scripts, scripts, varstr_size(scripts));
+			rc = priv->prevouts_db->insert(priv->prevouts_db, txn, 
+				&(db_record_data_t){ .data = &outpoint, .size = sizeof(outpoint) },
+				&(db_record_data_t){ .data = prevout, .size = size });
+			free(prevout);
+			if(rc) break;
+		}
+	}
+	
+	if(0 == rc) {
+		auto_buffer_t undo[1];
+		auto_buffer_init(undo, spent->length + created->length + 18);
+		push_varint(undo, job->spent_count);
+		auto_buffer_push(undo, auto_buffer_get_data(spent), spent->length);
+		push_varint(undo, block->txn_count);
+		auto_buffer_push(undo, auto_buffer_get_data(created), created->length);
+		
+		rc = priv->undo_db->insert(priv->undo_db, txn, 
+			&(db_record_data_t){ .data = (void *)job->hash, .size = sizeof(*job->hash) },
+			&(db_record_data_t){ .data = (void *)auto_buffer_get_data(undo), .size = undo->length });
+		auto_buffer_cleanup(undo);
+	}
+	auto_buffer_cleanup(spent);
+	auto_buffer_cleanup(created);
+	return rc;
+}
+
+static inline const unsigned char * parse_varint(const unsigned char * p, const unsigned char * p_end, ssize_t * value)
+{
+	if(p >= p_end || (p + varint_size((varint_t *)p)) > p_end) return NULL;
+	*value = varint_get((varint_t *)p);
+	return p + varint_size((varint_t *)p);
+}
+
+static int disconnect_block(block_filter_index_private_t * priv, db_engine_txn_t * txn, const uint256_t * hash)
+{
+	db_record_data_t key = { .data = (void *)hash, .size = sizeof(*hash) };
+	db_record_data_t * values = NULL;
+	ssize_t count = priv->undo_db->find(priv->undo_db, txn, &key, &values);
+	if(count != 1) {
+		free_records(values, count);
+		return -1;
+	}
+	
+	const unsigned char * p = values[0].data;
+	const unsigned char * p_end = p + values[0].size;
+	int rc = 0;
+	
+	// restore the spent outputs first: an output created and spent in this block is deleted with the created ones
+	ssize_t spent_count = 0;
+	p = parse_varint(p, p_end, &spent_count);
+	for(ssize_t i = 0; p && 0 == rc && i < spent_count; ++i) {
+		if((p + sizeof(satoshi_outpoint_t)) > p_end) { p = NULL; break; }
+		const unsigned char * prevout = p + sizeof(satoshi_outpoint_t);
+		ssize_t size = prevout_record_size(prevout, p_end - prevout);
+		if(size < 0) { p = NULL; break; }
+		
+		rc = priv->prevouts_db->insert(priv->prevouts_db, txn,
+			&(db_record_data_t){ .data = (void *)p, .size = sizeof(satoshi_outpoint_t) },
+			&(db_record_data_t){ .data = (void *)prevout, .size = size });
+		p += sizeof(satoshi_outpoint_t) + size;
+	}
+	
+	ssize_t txn_count = 0;
+	if(p) p = parse_varint(p, p_end, &txn_count);
+	for(ssize_t i = 0; p && 0 == rc && i < txn_count; ++i) {
+		satoshi_outpoint_t outpoint;
+		if((p + sizeof(outpoint.prev_hash)) > p_end) { p = NULL; break; }
+		memcpy(outpoint.prev_hash, p, sizeof(outpoint.prev_hash));
+		
+		ssize_t txout_count = 0;
+		p = parse_varint(p + sizeof(outpoint.prev_hash), p_end, &txout_count);
+		for(ssize_t ii = 0; p && 0 == rc && ii < txout_count; ++ii) {
+			outpoint.index = ii;
+			rc = priv->prevouts_db->del(priv->prevouts_db, txn, &(db_record_data_t){ .data = &outpoint, .size = sizeof(outpoint) });
+			if(rc == DB_ENGINE_ERR_NOTFOUND) rc = 0;	// unspendable, or spent in this block
+		}
+	}
+	free_records(values, count);
+	if(NULL == p) {
+		fprintf(stderr, "\e[31m" "%s(): corrupted undo data" "\e[39m" "\n", __FUNCTION__);
+		return -1;
+	}
+	
+	if(0 == rc) rc = priv->undo_db->del(priv->undo_db, txn, &key);
+	return rc;
+}
+
+/*
+ * parallel building
+ */
+struct build_context
+{
+	struct filter_job * jobs;
+	ssize_t count;
+	ssize_t next;
+};
+
+static void * build_filters_thread(void * user_data)
+{
+	struct build_context * ctx = user_data;
+	ssize_t i;
+	while((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->count) {
+		struct filter_job * job = &ctx->jobs[i];
+		job->rc = block_filter_build(job->filter, job->block, job->hash, (const varstr_t **)job->spent_scripts, job->spent_count);
+	}
+	return NULL;
+}
+
+static int build_filters(struct filter_job * jobs, ssize_t count, int num_threads)
+{
+	struct build_context ctx = { .jobs = jobs, .count = count };
+	if(num_threads > count) num_threads = count;
+	if(num_threads < 1) num_threads = 1;
+	
+	// the caller's thread is one of the workers
+	pthread_t threads[num_threads];
+	int num_started = 0;
+	for(int i = 1; i < num_threads; ++i) {
+		if(0 == pthread_create(&threads[num_started], NULL, build_filters_thread, &ctx)) ++num_started;
+	}
+	build_filters_thread(&ctx);
+	for(int i = 0; i < num_started; ++i) pthread_join(threads[i], NULL);
+	
+	for(ssize_t i = 0; i < count; ++i) if(jobs[i].rc) return -1;
+	return 0;
+}
+
+int block_filter_index_add_blocks(block_filter_index_t * index, int32_t start_height, ssize_t count,
+	const uint256_t * hashes, const satoshi_block_t * blocks)
+{
+	assert(index && index->priv);
+	if(count <= 0) return 0;
+	assert(hashes && blocks);
+	
+	block_filter_index_private_t * priv = index->priv;
+	db_engine_t * engine = index->engine;
+	
+	pthread_mutex_lock(&index->mutex);
+	if(start_height != (index->height + 1)) {
+		pthread_mutex_unlock(&index->mutex);
+		debug_printf("not on the tip: start_height=%d, tip=%d", (int)start_height, (int)index->height);
+		return -1;
+	}
+	
+	struct filter_job * jobs = calloc(count, sizeof(*jobs));
+	assert(jobs);
+	db_engine_txn_t * txn = engine->txn_new(engine, NULL);
+	assert(txn);
+	
+	// 1. resolve the spent scripts in block order (a block can spend the outputs of the previous ones)
+	int rc = 0;
+	for(ssize_t i = 0; 0 == rc && i < count; ++i) {
+		jobs[i].block = &blocks[i];
+		jobs[i].hash = &hashes[i];
+		rc = connect_block(priv, txn, &jobs[i]);
+	}
+	
+	// 2. build the filters in parallel
+	if(0 == rc) rc = build_filters(jobs, count, index->num_threads);
+	
+	// 3. chain the headers
+	struct tip_record tip = { .height = start_height + count - 1, .hash = hashes[count - 1], .header = index->tip_header };
+	for(ssize_t i = 0; 0 == rc && i < count; ++i) {
+		const block_filter_t * filter = jobs[i].filter;
+		ssize_t size = sizeof(struct block_filter_record) + filter->size;
+		struct block_filter_record * record = malloc(size);
+		assert(record);
+		
+		record->height = start_height + i;
+		block_filter_get_hash(filter, &record->filter_hash);
+		block_filter_compute_header(&record->filter_hash, &tip.header, &record->header);
+		memcpy(record->filter, filter->data, filter->size);
+		tip.header = record->header;
+		
+		rc = priv->db->insert(priv->db, txn, 
+			&(db_record_data_t){ .data = (void *)&hashes[i], .size = sizeof(hashes[i]) },
+			&(db_record_data_t){ .data = record, .size = size });
+		free(record);
+	}
+	if(0 == rc) rc = put_tip(priv, txn, &tip);
+	if(0 == rc) rc = txn->commit(txn, 0);
+	engine->txn_free(engine, txn);	// aborted if not committed
+	
+	if(0 == rc) {
+		index->height = tip.height;
+		index->tip_hash = tip.hash;
+		index->tip_header = tip.header;
+	}
+	pthread_mutex_unlock(&index->mutex);
+	
+	for(ssize_t i = 0; i < count; ++i) {
+		for(ssize_t ii = 0; ii < jobs[i].spent_count; ++ii) varstr_free(jobs[i].spent_scripts[ii]);
+		free(jobs[i].spent_scripts);
+		block_filter_cleanup(jobs[i].filter);
+	}
+	free(jobs);
+	return rc?-1:0;
+}
+
+int block_filter_index_remove_block(block_filter_index_t * index, const uint256_t * hash)
+{
+	assert(index && index->priv && hash);
+	block_filter_index_private_t * priv = index->priv;
+	db_engine_t * engine = index->engine;
+	
+	pthread_mutex_lock(&index->mutex);
+	if(index->height < 0 || memcmp(hash, &index->tip_hash, sizeof(*hash)) != 0) {
+		pthread_mutex_unlock(&index->mutex);
+		return -1;
+	}
+	
+	db_engine_txn_t * txn = engine->txn_new(engine, NULL);
+	assert(txn);
+	
+	int rc = disconnect_block(priv, txn, hash);
+	if(0 == rc) rc = priv->db->del(priv->db, txn, &(db_record_data_t){ .data = (void *)hash, .size = sizeof(*hash) });
+	
+	struct tip_record tip = { .height = index->height - 1 };
+	if(0 == rc && tip.height >= 0) {
+		ssize_t size = 0;
+		struct block_filter_record * record = find_record_at(priv, txn, tip.height, &tip.hash, &size);
+		if(record) tip.header = record->header;
+		else rc = -1;
+		free(record);
+	}
+	if(0 == rc) rc = put_tip(priv, txn, &tip);
+	if(0 == rc) rc = txn->commit(txn, 0);
+	engine->txn_free(engine, txn);
+	
+	if(0 == rc) {
+		index->height = tip.height;
+		index->tip_hash = tip.hash;
+		index->tip_header = tip.header;
+	}
+	pthread_mutex_unlock(&index->mutex);
+	return rc?-1:0;
+}
+
+ssize_t block_filter_index_reindex(block_filter_index_t * index, block_filter_get_block_callback get_block, void * user_data)
+{
+	assert(index && get_block);
+	uint256_t * hashes = calloc(BLOCK_FILTER_INDEX_REINDEX_BATCH, sizeof(*hashes));
+	satoshi_block_t * blocks = calloc(BLOCK_FILTER_INDEX_REINDEX_BATCH, sizeof(*blocks));
+	assert(hashes && blocks);
+	
+	ssize_t total = 0;
+	int rc = 0;
+	while(0 == rc) {
+		pthread_mutex_lock(&index->mutex);
+		int32_t start_height = index->height + 1;
+		pthread_mutex_unlock(&index->mutex);
+		
+		ssize_t count = 0;
+		while(count < BLOCK_FILTER_INDEX_REINDEX_BATCH 
+			&& 0 == get_block(user_data, start_height + count, &hashes[count], &blocks[count])) ++count;
+		if(count == 0) break;
+		
+		rc = block_filter_index_add_blocks(index, start_height, count, hashes, blocks);
+		for(ssize_t i = 0; i < count; ++i) {
+			satoshi_block_cleanup(&blocks[i]);
+			memset(&blocks[i], 0, sizeof(blocks[i]));
+		}
+		if(0 == rc) total += count;
+		if(count < BLOCK_FILTER_INDEX_REINDEX_BATCH) break;
+	}
+	free(hashes);
+	free(blocks);
+	return rc?-1:total;
+}
+
+int block_filter_index_find(block_filter_index_t * index, const uint256_t * hash,
+	int32_t * p_height, uint256_t * filter_hash, uint256_t * header, block_filter_t * filter)
+{
+	assert(index && index->priv && hash);
+	ssize_t size = 0;
+	pthread_mutex_lock(&index->mutex);
+	struct block_filter_record * record = find_record(index->priv, NULL, hash, &size);
+	pthread_mutex_unlock(&index->mutex);
+	if(NULL == record) return -1;
+	
+	int rc = 0;
+	if(p_height) *p_height = record->height;
+	if(filter_hash) *filter_hash = record->filter_hash;
+	if(header) *header = record->header;
+	if(filter) rc = block_filter_load(filter, hash, record->filter, size - sizeof(*record));
+	free(record);
+	return rc;
+}
+
+int block_filter_index_get_prevout(block_filter_index_t * index, const satoshi_outpoint_t * outpoint,
+	int64_t * p_value, varstr_t ** p_scripts)
+{
+	assert(index && index->priv && outpoint);
+	block_filter_index_private_t * priv = index->priv;
+	db_record_data_t key = { .data = (void *)outpoint, .size = sizeof(*outpoint) };
+	db_record_data_t * values = NULL;
+	
+	pthread_mutex_lock(&index->mutex);
+	ssize_t count = priv->prevouts_db->find(priv->prevouts_db, NULL, &key, &values);
+	pthread_mutex_unlock(&index->mutex);
+	
+	int rc = -1;
+	if(count == 1 && prevout_record_size(values[0].data, values[0].size) == values[0].size) {
+		const struct prevout_record * prevout = values[0].data;
+		if(p_value) *p_value = prevout->value;
+		if(p_scripts) *p_scripts = varstr_clone((const varstr_t *)prevout->scripts);
+		rc = 0;
+	}
+	free_records(values, count);
+	return rc;
+}
+
+int block_filter_index_get_hash(block_filter_index_t * index, int32_t height, uint256_t * hash)
+{
+	assert(index && index->priv && hash);
+	ssize_t size = 0;
+	pthread_mutex_lock(&index->mutex);
+	struct block_filter_record * record = find_record_at(index->priv, NULL, height, hash, &size);
+	pthread_mutex_unlock(&index->mutex);
+	
+	free(record);
+	return record?0:-1;
+}
+
+
+/*************************************
+ * BIP157 requests
+ ************************************/
+/*
+ * check_request(): 
+ * @return -1 if the request is invalid, 0 if the stop block is not indexed, 1 on success
+ */
+static int check_request(block_filter_index_private_t * priv, uint8_t filter_type, const uint256_t * stop_hash, int32_t * p_stop_height)
+{
+	if(filter_type != BLOCK_FILTER_TYPE_BASIC) return -1;
+	
+	ssize_t size = 0;
+	struct block_filter_record * record = find_record(priv, NULL, stop_hash, &size);
+	if(NULL == record) return 0;	// unknown, or not indexed yet
+	*p_stop_height = record->height;
+	free(record);
+	return 1;
+}
+
+ssize_t block_filter_index_get_cfilters(block_filter_index_t * index, const struct bitcoin_message_getcfilters * request,
+	struct bitcoin_message_cfilter ** p_filters)
+{
+	assert(index && index->priv && request && p_filters);
+	block_filter_index_private_t * priv = index->priv;
+	
+	pthread_mutex_lock(&index->mutex);
+	int32_t stop_height = -1;
+	int rc = check_request(priv, request->filter_type, &request->stop_hash, &stop_height);
+	if(rc == 1 && ((int64_t)request->start_height > stop_height 
+		|| (stop_height - (int64_t)request->start_height) >= BITCOIN_MESSAGE_MAX_GETCFILTERS_SIZE)) rc = -1;
+	if(rc != 1) {
+		pthread_mutex_unlock(&index->mutex);
+		return rc;
+	}
+	
+	ssize_t count = stop_height - request->start_height + 1;
+	struct bitcoin_message_cfilter * filters = calloc(count, sizeof(*filters));
+	assert(filters);
+	
+	ssize_t i = 0;
+	for(i = 0; i < count; ++i) {
+		ssize_t size = 0;
+		struct block_filter_record * record = find_record_at(priv, NULL, request->start_height + i, &filters[i].block_hash, &size);
+		if(NULL == record) break;
+		
+		filters[i].filter_type = BLOCK_FILTER_TYPE_BASIC;
+		filters[i].filter_size = size - sizeof(*record);
+		filters[i].filter = malloc(filters[i].filter_size);
+		assert(filters[i].filter);
+		memcpy(filters[i].filter, record->filter, filters[i].filter_size);
+		free(record);
+	}
+	pthread_mutex_unlock(&index->mutex);
+	
+	if(i < count) {	// the index does not start from the genesis block
+		for(ssize_t ii = 0; ii < i; ++ii) bitcoin_message_cfilter_cleanup(&filters[ii]);
+		free(filters);
+		return 0;
+	}
+	*p_filters = filters;
+	return count;
+}
+
+ssize_t block_filter_index_get_cfheaders(block_filter_index_t * index, const struct bitcoin_message_getcfheaders * request,
+	struct bitcoin_message_cfheaders * reply)
+{
+	assert(index && index->priv && request && reply);
+	block_filter_index_private_t * priv = index->priv;
+	memset(reply, 0, sizeof(*reply));
+	
+	pthread_mutex_lock(&index->mutex);
+	int32_t stop_height = -1;
+	int rc = check_request(priv, request->filter_type, &request->stop_hash, &stop_height);
+	if(rc == 1 && ((int64_t)request->start_height > stop_height 
+		|| (stop_height - (int64_t)request->start_height) >= BITCOIN_MESSAGE_MAX_CFHEADERS_SIZE)) rc = -1;
+	if(rc != 1) {
+		pthread_mutex_unlock(&index->mutex);
+		return rc;
+	}
+	
+	ssize_t count = stop_height - request->start_height + 1;
+	reply->filter_type = BLOCK_FILTER_TYPE_BASIC;
+	reply->stop_hash = request->stop_hash;
+	reply->filter_hashes = calloc(count, sizeof(*reply->filter_hashes));
+	assert(reply->filter_hashes);
+	
+	uint256_t hash;
+	ssize_t size = 0;
+	struct block_filter_record * record = NULL;
+	if(request->start_height > 0) {
+		record = find_record_at(priv, NULL, request->start_height - 1, &hash, &size);
+		if(record) reply->prev_header = record->header;
+		else rc = 0;
+		free(record);
+	}
+	for(ssize_t i = 0; rc == 1 && i < count; ++i) {
+		record = find_record_at(priv, NULL, request->start_height + i, &hash, &size);
+		if(NULL == record) { rc = 0; break; }
+		reply->filter_hashes[i] = record->filter_hash;
+		free(record);
+	}
+	pthread_mutex_unlock(&index->mutex);
+	
+	if(rc != 1) {
+		bitcoin_message_cfheaders_cleanup(reply);
+		return 0;
+	}
+	reply->count = count;
+	return count;
+}
+
+int block_filter_index_get_cfcheckpt(block_filter_index_t * index, const struct bitcoin_message_getcfcheckpt * request,
+	struct bitcoin_message_cfcheckpt * reply)
+{
+	assert(index && index->priv && request && reply);
+	block_filter_index_private_t * priv = index->priv;
+	memset(reply, 0, sizeof(*reply));
+	
+	pthread_mutex_lock(&index->mutex);
+	int32_t stop_height = -1;
+	int rc = check_request(priv, request->filter_type, &request->stop_hash, &stop_height);
+	if(rc != 1) {
+		pthread_mutex_unlock(&index->mutex);
+		return rc;
+	}
+	
+	ssize_t count = stop_height / BITCOIN_MESSAGE_CFCHECKPT_INTERVAL;
+	reply->filter_type = BLOCK_FILTER_TYPE_BASIC;
+	reply->stop_hash = request->stop_hash;
+	if(count > 0) {
+		reply->filter_headers = calloc(count, sizeof(*reply->filter_headers));
+		assert(reply->filter_headers);
+	}
+	for(ssize_t i = 0; i < count; ++i) {
+		uint256_t hash;
+		ssize_t size = 0;
+		struct block_filter_record * record = find_record_at(priv, NULL, (i + 1) * BITCOIN_MESSAGE_CFCHECKPT_INTERVAL, &hash, &size);
+		if(NULL == record) { rc = 0; break; }
+		reply->filter_headers[i] = record->header;
+		free(record);
+	}
+	pthread_mutex_unlock(&index->mutex);
+	
+	if(rc != 1) {
+		bitcoin_message_cfcheckpt_cleanup(reply);
+		return 0;
+	}
+	reply->count = count;
+	return 1;
+}
+
+
+#if defined(_TEST_BLOCK_FILTER) && defined(_STAND_ALONE)
+#include "db_engine.h"
+#include "test-utils.h"
+
+// BIP158 test vector: the genesis block of testnet3
+static const char * s_testnet_genesis_hex = 
+	"0100000000000000000000000000000000000000000000000000000000000000"
+	"000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa"
+	"4b1e5e4adae5494dffff001d1aa4ae1801"
+	"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff"
+	"4d04ffff001d0104455468652054696d65732030332f4a616e2f32303039204368616e63656c6c6f72"
+	"206f6e206272696e6b206f66207365636f6e64206261696c6f757420666f722062616e6b73ffffffff"
+	"0100f2052a01000000434104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f"
+	"61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac00000000";
+
+static void reverse_bytes(unsigned char * data, size_t length)
+{
+	for(size_t i = 0; i < length / 2; ++i) {
+		unsigned char c = data[i];
+		data[i] = data[length - 1 - i];
+		data[length - 1 - i] = c;
+	}
+}
+
+static void test_genesis_vector(void)
+{
+	unsigned char raw_block[512];
+	void * data = raw_block;
+	ssize_t cb = hex2bin(s_testnet_genesis_hex, strlen(s_testnet_genesis_hex), &data);
+	assert(cb > 80);
+	
+	satoshi_block_t block[1];
+	memset(block, 0, sizeof(*block));
+	assert(satoshi_block_parse(block, cb, raw_block) == cb);
+	
+	block_filter_t filter[1];
+	int rc = block_filter_build(filter, block, NULL, NULL, 0);
+	assert(0 == rc && filter->num_elements == 1);
+	
+	static const unsigned char expected_filter[] = { 0x01, 0x9d, 0xfc, 0xa8 };
+	assert(filter->size == sizeof(expected_filter) && 0 == memcmp(filter->data, expected_filter, filter->size));
+	
+	uint256_t filter_hash, header, prev_header;
+	memset(&prev_header, 0, sizeof(prev_header));
+	block_filter_get_hash(filter, &filter_hash);
+	block_filter_compute_header(&filter_hash, &prev_header, &header);
+	
+	unsigned char expected_header[32];
+	data = expected_header;
+	hex2bin("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750", 64, &data);
+	reverse_bytes(expected_header, 32);
+	assert(0 == memcmp(&header, expected_header, 32));
+	
+	// the output script
+	const varstr_t * scripts = block->txns[0].txouts[0].scripts;
+	assert(block_filter_match(filter, varstr_getdata_ptr(scripts), varstr_length(scripts)));
+	assert(!block_filter_match(filter, "", 0));
+	
+	block_filter_cleanup(filter);
+	satoshi_block_cleanup(block);
+	printf("%s(): PASSED\n", __FUNCTION__);
+}
+
+static size_t make_p2pkh(unsigned char script[static 25], int id)
+{
+	unsigned char pkh[20];
+	return test_make_p2pkh(script, test_make_pkh(pkh, id));
+}
+
+/*
+ * blocks[k]: txns[0]: coinbase, pays to p2pkh(k)
+ *            txns[1]: spends blocks[k - 1].txns[0], pays to p2pkh(1000 + k)
+ *            txns[2]: spends txns[1], pays to p2pkh(2000 + k)
+ */
+static void make_block(satoshi_block_t * block, uint256_t * hash, int height, const satoshi_block_t * prev)
+{
+	memset(block, 0, sizeof(*block));
+	block->txn_count = prev?3:1;
+	block->txns = calloc(block->txn_count, sizeof(*block->txns));
+	assert(block->txns);
+	
+	unsigned char null_hash[32] = { 0 };
+	unsigned char script[25];
+	
+	// make the coinbase txs unique
+	memcpy(null_hash, &height, sizeof(height));
+	test_make_tx(&block->txns[0], null_hash, 0xffffffff, NULL, 0, script, make_p2pkh(script, height));
+	if(prev) {
+		test_make_tx(&block->txns[1], prev->txns[0].txid, 0, NULL, 0, script, make_p2pkh(script, 1000 + height));
+		test_make_tx(&block->txns[2], block->txns[1].txid, 0, NULL, 0, script, make_p2pkh(script, 2000 + height));
+	}
+	hash256(&height, sizeof(height), (uint8_t *)hash);
+	block->hash = *hash;
+}
+
+static int match_script(const block_filter_t * filter, int id)
+{
+	unsigned char script[25];
+	return block_filter_match(filter, script, make_p2pkh(script, id));
+}
+
+#define NUM_BLOCKS	(20)
+static satoshi_block_t s_blocks[NUM_BLOCKS];
+static uint256_t s_hashes[NUM_BLOCKS];
+
+static int get_block(void * user_data, int32_t height, uint256_t * hash, satoshi_block_t * block)
+{
+	int32_t * p_limit = user_data;
+	if(height >= *p_limit) return -1;
+	make_block(block, hash, height, (height > 0)?&s_blocks[height - 1]:NULL);
+	return 0;
+}
+
+static void test_filter(void)
+{
+	// OP_RETURN and empty outputs are not in the filter
+	satoshi_block_t block[1];
+	uint256_t hash;
+	unsigned char null_hash[32] = { 0 };
+	unsigned char op_return[3] = { OP_RETURN, 1, 0xff };
+	memset(block, 0, sizeof(*block));
+	block->txn_count = 1;
+	block->txns = calloc(1, sizeof(*block->txns));
+	test_make_tx(&block->txns[0], null_hash, 0xffffffff, NULL, 0, op_return, sizeof(op_return));
+	memset(&hash, 0x11, sizeof(hash));
+	
+	block_filter_t filter[1];
+	assert(0 == block_filter_build(filter, block, &hash, NULL, 0));
+	assert(filter->num_elements == 0 && filter->size == 1 && filter->data[0] == 0);
+	assert(!block_filter_match(filter, op_return, sizeof(op_return)));
+	block_filter_cleanup(filter);
+	satoshi_block_cleanup(block);
+	
+	// the spent scripts are required
+	make_block(&s_blocks[0], &s_hashes[0], 0, NULL);
+	make_block(block, &hash, 1, &s_blocks[0]);
+	assert(-1 == block_filter_build(filter, block, &hash, NULL, 0));
+	
+	unsigned char script[25];
+	varstr_t * spent[2] = { varstr_new(script, make_p2pkh(script, 0)), varstr_new(script, make_p2pkh(script, 1001)) };
+	assert(0 == block_filter_build(filter, block, &hash, (const varstr_t **)spent, 2));
+	assert(filter->num_elements == 4);	// 1001 is both spent and created
+	assert(match_script(filter, 0) && match_script(filter, 1) && match_script(filter, 1001) && match_script(filter, 2001));
+	
+	const unsigned char * elements[2];
+	size_t lengths[2];
+	unsigned char scripts[2][25];
+	lengths[0] = make_p2pkh(scripts[0], 9999); elements[0] = scripts[0];
+	lengths[1] = make_p2pkh(scripts[1], 2001); elements[1] = scripts[1];
+	assert(block_filter_match_any(filter, 2, elements, lengths));
+	assert(!block_filter_match_any(filter, 1, elements, lengths));
+	
+	// load from the serialized filter
+	block_filter_t loaded[1];
+	assert(0 == block_filter_load(loaded, &hash, filter->data, filter->size));
+	assert(loaded->num_elements == 4 && match_script(loaded, 2001));
+	assert(-1 == block_filter_load(loaded, &hash, (unsigned char *)"\xff", 1));
+	block_filter_cleanup(loaded);
+	
+	// false positives: ~1/M
+	ssize_t false_positives = 0;
+	for(int i = 10000; i < 10000 + 100000; ++i) false_positives += match_script(filter, i);
+	printf("false positives: %ld / 100000\n", (long)false_positives);
+	assert(false_positives < 5);
+	
+	block_filter_cleanup(filter);
+	for(int i = 0; i < 2; ++i) varstr_free(spent[i]);
+	satoshi_block_cleanup(block);
+	satoshi_block_cleanup(&s_blocks[0]);
+	printf("%s(): PASSED\n", __FUNCTION__);
+}
+
+static void test_index(void)
+{
+	for(int i = 0; i < NUM_BLOCKS; ++i) make_block(&s_blocks[i], &s_hashes[i], i, (i > 0)?&s_blocks[i - 1]:NULL);
+	
+	db_engine_t * engine = db_engine_memory_new(NULL);
+	assert(engine);
+	block_filter_index_t index[1];
+	block_filter_index_init(index, engine, NULL, NULL);
+	assert(index->height == -1);
+	
+	// not contiguous
+	assert(-1 == block_filter_index_add_block(index, 1, &s_hashes[1], &s_blocks[1]));
+	assert(0 == block_filter_index_add_block(index, 0, &s_hashes[0], &s_blocks[0]));
+	assert(0 == block_filter_index_add_blocks(index, 1, NUM_BLOCKS - 1, &s_hashes[1], &s_blocks[1]));
+	assert(index->height == NUM_BLOCKS - 1);
+	
+	int32_t height = -1;
+	block_filter_t filter[1];
+	assert(0 == block_filter_index_find(index, &s_hashes[5], &height, NULL, NULL, filter));
+	assert(height == 5 && match_script(filter, 4) && match_script(filter, 1005) && match_script(filter, 2005));
+	block_filter_cleanup(filter);
+	
+	uint256_t hash;
+	assert(0 == block_filter_index_get_hash(index, 7, &hash) && 0 == memcmp(&hash, &s_hashes[7], 32));
+	
+	// the unspent outputs: the coinbase of the tip, and txns[2] of each block
+	satoshi_outpoint_t outpoint = { .index = 0 };
+	const satoshi_block_t * tip = &s_blocks[NUM_BLOCKS - 1];
+	int64_t value = 0;
+	varstr_t * scripts = NULL;
+	memcpy(outpoint.prev_hash, tip->txns[0].txid, 32);
+	assert(0 == block_filter_index_get_prevout(index, &outpoint, &value, &scripts));
+	assert(value == tip->txns[0].txouts[0].value && varstr_size(scripts) == varstr_size(tip->txns[0].txouts[0].scripts));
+	assert(0 == memcmp(scripts, tip->txns[0].txouts[0].scripts, varstr_size(scripts)));
+	varstr_free(scripts);
+	memcpy(outpoint.prev_hash, s_blocks[5].txns[2].txid, 32);
+	assert(0 == block_filter_index_get_prevout(index, &outpoint, &value, NULL));
+	memcpy(outpoint.prev_hash, s_blocks[5].txns[1].txid, 32);	// spent by txns[2]
+	assert(-1 == block_filter_index_get_prevout(index, &outpoint, &value, NULL));
+	
+	// reorg: the spent output of the tip is restored
+	uint256_t tip_header = index->tip_header;
+	assert(-1 == block_filter_index_remove_block(index, &s_hashes[5]));
+	assert(0 == block_filter_index_remove_block(index, &s_hashes[NUM_BLOCKS - 1]));
+	memcpy(outpoint.prev_hash, s_blocks[NUM_BLOCKS - 2].txns[0].txid, 32);
+	assert(0 == block_filter_index_get_prevout(index, &outpoint, &value, NULL) && value == s_blocks[NUM_BLOCKS - 2].txns[0].txouts[0].value);
+	assert(index->height == NUM_BLOCKS - 2 && 0 == memcmp(&index->tip_hash, &s_hashes[NUM_BLOCKS - 2], 32));
+	assert(-1 == block_filter_index_find(index, &s_hashes[NUM_BLOCKS - 1], NULL, NULL, NULL, NULL));
+	assert(0 == block_filter_index_add_block(index, NUM_BLOCKS - 1, &s_hashes[NUM_BLOCKS - 1], &s_blocks[NUM_BLOCKS - 1]));
+	assert(0 == memcmp(&index->tip_header, &tip_header, 32));
+	
+	// BIP157 requests
+	struct bitcoin_message_getcfilters getcfilters = { .start_height = 2, .stop_hash = s_hashes[9] };
+	struct bitcoin_message_cfilter * cfilters = NULL;
+	ssize_t count = block_filter_index_get_cfilters(index, &getcfilters, &cfilters);
+	assert(count == 8 && 0 == memcmp(&cfilters[0].block_hash, &s_hashes[2], 32));
+	
+	unsigned char * payload = NULL;
+	ssize_t cb = bitcoin_message_cfilter_serialize(&cfilters[3], &payload);
+	struct bitcoin_message_cfilter parsed[1];
+	assert(bitcoin_message_cfilter_parse(parsed, payload, cb) == parsed);
+	assert(parsed->filter_size == cfilters[3].filter_size && 0 == memcmp(parsed->filter, cfilters[3].filter, parsed->filter_size));
+	bitcoin_message_cfilter_cleanup(parsed);
+	free(payload);
+	for(ssize_t i = 0; i < count; ++i) bitcoin_message_cfilter_cleanup(&cfilters[i]);
+	free(cfilters);
+	
+	getcfilters.start_height = 10;	// > stop
+	assert(-1 == block_filter_index_get_cfilters(index, &getcfilters, &cfilters));
+	getcfilters.filter_type = 1;
+	assert(-1 == block_filter_index_get_cfilters(index, &getcfilters, &cfilters));
+	getcfilters.filter_type = 0;
+	memset(&getcfilters.stop_hash, 0xee, 32);
+	assert(0 == block_filter_index_get_cfilters(index, &getcfilters, &cfilters));
+	
+	// the headers chain up to the tip
+	struct bitcoin_message_getcfheaders getcfheaders = { .start_height = 1, .stop_hash = s_hashes[NUM_BLOCKS - 1] };
+	struct bitcoin_message_cfheaders cfheaders[1];
+	count = block_filter_index_get_cfheaders(index, &getcfheaders, cfheaders);
+	assert(count == NUM_BLOCKS - 1 && cfheaders->count == count);
+	uint256_t header = cfheaders->prev_header;
+	for(ssize_t i = 0; i < count; ++i) block_filter_compute_header(&cfheaders->filter_hashes[i], &header, &header);
+	assert(0 == memcmp(&header, &index->tip_header, 32));
+	bitcoin_message_cfheaders_cleanup(cfheaders);
+	
+	struct bitcoin_message_getcfcheckpt getcfcheckpt = { .stop_hash = s_hashes[NUM_BLOCKS - 1] };
+	struct bitcoin_message_cfcheckpt cfcheckpt[1];
+	assert(1 == block_filter_index_get_cfcheckpt(index, &getcfcheckpt, cfcheckpt) && cfcheckpt->count == 0);
+	bitcoin_message_cfcheckpt_cleanup(cfcheckpt);
+	
+	// reindex with a batch size of NUM_BLOCKS / 2, in a new index
+	db_engine_t * engine2 = db_engine_memory_new(NULL);
+	block_filter_index_t index2[1];
+	block_filter_index_init(index2, engine2, "filters", NULL);
+	int32_t limit = NUM_BLOCKS / 2;
+	assert(block_filter_index_reindex(index2, get_block, &limit) == NUM_BLOCKS / 2);
+	limit = NUM_BLOCKS;
+	assert(block_filter_index_reindex(index2, get_block, &limit) == NUM_BLOCKS / 2);
+	assert(index2->height == index->height && 0 == memcmp(&index2->tip_header, &index->tip_header, 32));
+	block_filter_index_cleanup(index2);
+	db_engine_memory_free(engine2);
+	
+	block_filter_index_cleanup(index);
+	db_engine_memory_free(engine);
+	for(int i = 0; i < NUM_BLOCKS; ++i) satoshi_block_cleanup(&s_blocks[i]);
+	printf("%s(): PASSED\n", __FUNCTION__);
+}
+
+int main(int argc, char **argv)
+{
+	test_genesis_vector();
+	test_filter();
+	test_index();
+	return 0;
+}
+#endif
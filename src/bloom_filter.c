@@ -0,0 +1,773 @@
+/*
+ * bloom_filter.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "bitcoin-consensus.h"
+#include "satoshi-types.h"
+#include "satoshi-script.h"
+#include "rolling_bloom_filter.h"
+#include "bloom_filter.h"
+
+/*************************************
+ * filter
+ ************************************/
+static void update_empty_full(bloom_filter_t * filter)
+{
+	int is_full = 1, is_empty = 1;
+	for(size_t i = 0; i < filter->size; ++i) {
+		is_full &= (filter->data[i] == 0xff);
+		is_empty &= (filter->data[i] == 0);
+	}
+	filter->is_full = is_full;
+	filter->is_empty = is_empty;
+}
+
+int bloom_filter_load(bloom_filter_t * filter, const struct bitcoin_message_filterload * msg)
+{
+	assert(filter && msg);
+	if(msg->filter_size < 0 || msg->filter_size > BLOOM_FILTER_MAX_SIZE || msg->hash_funcs > BLOOM_FILTER_MAX_HASH_FUNCS) return -1;
+	
+	memset(filter, 0, sizeof(*filter));
+	if(msg->filter_size > 0) {
+		filter->data = malloc(msg->filter_size);
+		assert(filter->data);
+		memcpy(filter->data, msg->filter, msg->filter_size);
+	}
+	filter->size = msg->filter_size;
+	filter->num_hash_funcs = msg->hash_funcs;
+	filter->tweak = msg->tweak;
+	filter->flags = msg->flags;
+	update_empty_full(filter);
+	return 0;
+}
+
+void bloom_filter_cleanup(bloom_filter_t * filter)
+{
+	if(NULL == filter) return;
+	free(filter->data);
+	memset(filter, 0, sizeof(*filter));
+}
+
+static inline uint32_t bloom_filter_hash(const bloom_filter_t * filter, uint32_t n, const void * data, size_t length)
+{
+	return murmur3_32(n * 0xFBA4C795 + filter->tweak, data, length) % (uint32_t)(filter->size * 8);
+}
+
+void bloom_filter_insert(bloom_filter_t * filter, const void * data, size_t length)
+{
+	if(filter->size == 0 || filter->is_full) return;
+	for(uint32_t i = 0; i < filter->num_hash_funcs; ++i) {
+		uint32_t bit = bloom_filter_hash(filter, i, data, length);
+		filter->data[bit >> 3] |= (1 << (bit & 7));
+	}
+	filter->is_empty = 0;
+}
+
+int bloom_filter_contains(const bloom_filter_t * filter, const void * data, size_t length)
+{
+	if(filter->size == 0 || filter->is_full) return 1;	// an empty bit array matches everything (no divide-by-zero)
+	if(filter->is_empty) return 0;
+	for(uint32_t i = 0; i < filter->num_hash_funcs; ++i) {
+		uint32_t bit = bloom_filter_hash(filter, i, data, length);
+		if(!(filter->data[bit >> 3] & (1 << (bit & 7)))) return 0;
+	}
+	return 1;
+}
+
+int bloom_filter_add(bloom_filter_t * filter, const struct bitcoin_message_filteradd * msg)
+{
+	assert(filter && msg);
+	if(msg->data_size < 0 || msg->data_size > BLOOM_FILTER_MAX_ELEMENT_SIZE) return -1;
+	bloom_filter_insert(filter, msg->data, msg->data_size);
+	return 0;
+}
+
+
+/*************************************
+ * scripts
+ ************************************/
+/*
+ * get_op(): the next opcode of the script, 
+ *   *p_length is the length of the pushed data (0 if the opcode is not a push).
+ * @return the position of the next opcode, NULL if the script is truncated.
+ */
+static const unsigned char * get_op(const unsigned char * p, const unsigned char * p_end, 
+	const unsigned char ** p_data, uint32_t * p_length)
+{
+	uint8_t opcode = *p++;
+	uint32_t length = 0;
+	if(opcode < satoshi_script_opcode_op_pushdata1) length = opcode;
+	else if(opcode == satoshi_script_opcode_op_pushdata1) {
+		if((p_end - p) < 1) return NULL;
+		length = p[0];
+		p += 1;
+	}else if(opcode == satoshi_script_opcode_op_pushdata2) {
+		if((p_end - p) < 2) return NULL;
+		length = (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+		p += 2;
+	}else if(opcode == satoshi_script_opcode_op_pushdata4) {
+		if((p_end - p) < 4) return NULL;
+		length = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+		p += 4;
+	}
+	if(length > (p_end - p)) return NULL;
+	
+	*p_data = p;
+	*p_length = length;
+	return p + length;
+}
+
+static inline int is_pubkey_push(const unsigned char * p, const unsigned char * p_end)
+{
+	ssize_t length = p_end - p;
+	if(length >= 34 && p[0] == 33 && (p[1] == 0x02 || p[1] == 0x03)) return 33 + 1;
+	if(length >= 66 && p[0] == 65 && (p[1] == 0x04 || p[1] == 0x06 || p[1] == 0x07)) return 65 + 1;
+	return 0;
+}
+
+// pay-to-pubkey: <pubkey> OP_CHECKSIG, multisig: OP_m <pubkey> ... OP_n OP_CHECKMULTISIG
+static int is_p2pubkey_or_multisig(const unsigned char * p, size_t length)
+{
+	const unsigned char * p_end = p + length;
+	int cb = is_pubkey_push(p, p_end);
+	if(cb > 0 && (p + cb + 1) == p_end && p[cb] == satoshi_script_opcode_op_checksig) return 1;
+	
+	if(length < 3 || p_end[-1] != satoshi_script_opcode_op_checkmultisig) return 0;
+	if(p[0] < satoshi_script_opcode_op_1 || p[0] > satoshi_script_opcode_op_16) return 0;
+	int m = p[0] - satoshi_script_opcode_op_1 + 1;
+	int n = 0;
+	for(++p; (cb = is_pubkey_push(p, p_end)) > 0; p += cb) ++n;
+	return ((p + 2) == p_end && n >= m && p[0] == (satoshi_script_opcode_op_1 + n - 1));
+}
+
+
+/*************************************
+ * block index
+ ************************************/
+struct items_buffer
+{
+	ssize_t count;
+	ssize_t max_size;
+	struct bloom_block_item * items;
+};
+
+static inline struct bloom_block_item * items_buffer_add(struct items_buffer * buf)
+{
+	if(buf->count >= buf->max_size) {
+		ssize_t new_size = (buf->max_size + 1024) * 2;
+		buf->items = realloc(buf->items, new_size * sizeof(*buf->items));
+		assert(buf->items);
+		buf->max_size = new_size;
+	}
+	return &buf->items[buf->count++];
+}
+
+static void add_script_pushes(struct items_buffer * buf, const varstr_t * scripts, 
+	enum bloom_block_item_type type, uint32_t txout_index)
+{
+	if(NULL == scripts) return;
+	const unsigned char * p = varstr_getdata_ptr(scripts);
+	const unsigned char * p_end = p + varstr_length(scripts);
+	int is_p2pubkey = (type == bloom_block_item_txout_push) && is_p2pubkey_or_multisig(p, p_end - p);
+	
+	while(p < p_end) {
+		const unsigned char * data = NULL;
+		uint32_t length = 0;
+		p = get_op(p, p_end, &data, &length);
+		if(NULL == p) break;
+		if(0 == length) continue;
+		
+		struct bloom_block_item * item = items_buffer_add(buf);
+		item->data = data;
+		item->length = length;
+		item->type = type;
+		item->is_p2pubkey = is_p2pubkey;
+		item->txout_index = txout_index;
+	}
+}
+
+// items order: the pushes of all outputs, then each input's outpoint followed by its pushes
+static void add_tx_items(struct items_buffer * buf, const satoshi_tx_t * tx)
+{
+	for(ssize_t i = 0; i < tx->txout_count; ++i) {
+		add_script_pushes(buf, tx->txouts[i].scripts, bloom_block_item_txout_push, (uint32_t)i);
+	}
+	for(ssize_t i = 0; i < tx->txin_count; ++i) {
+		struct bloom_block_item * item = items_buffer_add(buf);
+		memset(item, 0, sizeof(*item));
+		item->data = (const unsigned char *)&tx->txins[i].outpoint;
+		item->length = sizeof(satoshi_outpoint_t);
+		item->type = bloom_block_item_outpoint;
+		
+		add_script_pushes(buf, tx->txins[i].scripts, bloom_block_item_txin_push, 0);
+	}
+}
+
+static inline ssize_t tree_width(ssize_t txn_count, int height)
+{
+	return (txn_count + ((ssize_t)1 << height) - 1) >> height;
+}
+
+int bloom_block_index_init(bloom_block_index_t * index, const satoshi_block_t * block)
+{
+	assert(index && block);
+	assert(sizeof(satoshi_outpoint_t) == 36);	// serialized as is
+	memset(index, 0, sizeof(*index));
+	if(block->txn_count <= 0) return -1;
+	
+	ssize_t txn_count = block->txn_count;
+	index->block = block;
+	index->txn_count = txn_count;
+	index->tx_items = calloc(txn_count + 1, sizeof(*index->tx_items));
+	assert(index->tx_items);
+	
+	struct items_buffer buf[1] = {{ 0 }};
+	for(ssize_t i = 0; i < txn_count; ++i) {
+		index->tx_items[i] = buf->count;
+		add_tx_items(buf, &block->txns[i]);
+	}
+	index->tx_items[txn_count] = buf->count;
+	index->items = buf->items;
+	index->items_count = buf->count;
+	
+	// merkle tree
+	int height = 0;
+	while(tree_width(txn_count, height) > 1) ++height;
+	index->height = height;
+	index->level_offsets = calloc(height + 1, sizeof(*index->level_offsets));
+	assert(index->level_offsets);
+	
+	ssize_t total = 0;
+	for(int h = 0; h <= height; ++h) {
+		index->level_offsets[h] = total;
+		total += tree_width(txn_count, h);
+	}
+	index->hashes = calloc(total, sizeof(uint256_t));
+	assert(index->hashes);
+	
+	for(ssize_t i = 0; i < txn_count; ++i) index->hashes[i] = block->txns[i].txid[0];
+	for(int h = 0; h < height; ++h) {
+		const uint256_t * level = index->hashes + index->level_offsets[h];
+		uint256_t * parents = index->hashes + index->level_offsets[h + 1];
+		ssize_t width = tree_width(txn_count, h);
+		for(ssize_t pos = 0; pos < width; pos += 2) {
+			uint256_t nodes[2] = { level[pos], level[(pos + 1 < width)?(pos + 1):pos] };
+			hash256(nodes, sizeof(nodes), (uint8_t *)&parents[pos / 2]);
+		}
+	}
+	return 0;
+}
+
+void bloom_block_index_cleanup(bloom_block_index_t * index)
+{
+	if(NULL == index) return;
+	free(index->tx_items);
+	free(index->items);
+	free(index->level_offsets);
+	free(index->hashes);
+	memset(index, 0, sizeof(*index));
+}
+
+
+/*************************************
+ * matching
+ ************************************/
+static int match_tx_items(bloom_filter_t * filter, const uint256_t * txid, const struct bloom_block_item * items, ssize_t count)
+{
+	if(filter->is_full) return 1;
+	if(filter->is_empty) return 0;
+	
+	int found = bloom_filter_contains(filter, txid, sizeof(*txid));
+	int update_type = filter->flags & bloom_filter_update_mask;
+	
+	// outputs: the first matched push of each output, its outpoint is inserted according to the update flags
+	ssize_t i = 0;
+	int64_t matched_txout = -1;
+	for(; i < count && items[i].type == bloom_block_item_txout_push; ++i) {
+		const struct bloom_block_item * item = &items[i];
+		if((int64_t)item->txout_index == matched_txout) continue;
+		if(!bloom_filter_contains(filter, item->data, item->length)) continue;
+		
+		found = 1;
+		matched_txout = item->txout_index;
+		if(update_type == bloom_filter_update_all 
+			|| (update_type == bloom_filter_update_p2pubkey_only && item->is_p2pubkey))
+		{
+			satoshi_outpoint_t outpoint;
+			memcpy(outpoint.prev_hash, txid, sizeof(outpoint.prev_hash));
+			outpoint.index = item->txout_index;
+			bloom_filter_insert(filter, &outpoint, sizeof(outpoint));
+		}
+	}
+	if(found) return 1;
+	
+	// inputs: the spent outpoints and the pushes of the scripts
+	for(; i < count; ++i) {
+		if(bloom_filter_contains(filter, items[i].data, items[i].length)) return 1;
+	}
+	return 0;
+}
+
+int bloom_filter_match_tx(bloom_filter_t * filter, const satoshi_tx_t * tx)
+{
+	assert(filter && tx);
+	if(filter->is_full) return 1;
+	if(filter->is_empty) return 0;
+	
+	struct items_buffer buf[1] = {{ 0 }};
+	add_tx_items(buf, tx);
+	int found = match_tx_items(filter, tx->txid, buf->items, buf->count);
+	free(buf->items);
+	return found;
+}
+
+ssize_t bloom_filter_match_block(bloom_filter_t * filter, const bloom_block_index_t * index, uint8_t * matched)
+{
+	assert(filter && index && matched);
+	const satoshi_block_t * block = index->block;
+	ssize_t num_matched = 0;
+	for(ssize_t i = 0; i < index->txn_count; ++i) {
+		ssize_t first = index->tx_items[i];
+		matched[i] = match_tx_items(filter, block->txns[i].txid, &index->items[first], index->tx_items[i + 1] - first);
+		num_matched += matched[i];
+	}
+	return num_matched;
+}
+
+
+/*************************************
+ * partial merkle tree
+ ************************************/
+struct partial_merkle_tree
+{
+	const bloom_block_index_t * index;
+	const uint8_t * parent_of_match;	// per node, same layout as index->hashes
+	
+	ssize_t bits_count;
+	unsigned char * bits;
+	ssize_t hashes_count;
+	uint256_t * hashes;
+};
+
+static void traverse_and_build(struct partial_merkle_tree * tree, int height, ssize_t pos)
+{
+	const bloom_block_index_t * index = tree->index;
+	ssize_t node = index->level_offsets[height] + pos;
+	int parent_of_match = tree->parent_of_match[node];
+	
+	if(parent_of_match) tree->bits[tree->bits_count >> 3] |= (1 << (tree->bits_count & 7));
+	++tree->bits_count;
+	
+	if(0 == height || !parent_of_match) {
+		tree->hashes[tree->hashes_count++] = index->hashes[node];
+		return;
+	}
+	traverse_and_build(tree, height - 1, pos * 2);
+	if((pos * 2 + 1) < tree_width(index->txn_count, height - 1)) traverse_and_build(tree, height - 1, pos * 2 + 1);
+}
+
+int bloom_block_index_get_merkleblock(const bloom_block_index_t * index, const uint8_t * matched, struct bitcoin_message_merkleblock * msg)
+{
+	assert(index && matched && msg);
+	memset(msg, 0, sizeof(*msg));
+	if(index->txn_count <= 0) return -1;
+	
+	ssize_t total = index->level_offsets[index->height] + 1;
+	uint8_t * parent_of_match = calloc(total, 1);
+	assert(parent_of_match);
+	for(ssize_t i = 0; i < index->txn_count; ++i) parent_of_match[i] = (matched[i] != 0);
+	for(int h = 0; h < index->height; ++h) {
+		const uint8_t * level = parent_of_match + index->level_offsets[h];
+		uint8_t * parents = parent_of_match + index->level_offsets[h + 1];
+		ssize_t width = tree_width(index->txn_count, h);
+		for(ssize_t pos = 0; pos < width; ++pos) parents[pos / 2] |= level[pos];
+	}
+	
+	struct partial_merkle_tree tree = {
+		.index = index,
+		.parent_of_match = parent_of_match,
+		.bits = calloc((total + 7) / 8, 1),
+		.hashes = calloc(total, sizeof(uint256_t)),
+	};
+	assert(tree.bits && tree.hashes);
+	traverse_and_build(&tree, index->height, 0);
+	free(parent_of_match);
+	
+	msg->hdr = index->block->hdr;
+	msg->total_txns = (uint32_t)index->txn_count;
+	msg->hashes_count = tree.hashes_count;
+	msg->hashes = realloc(tree.hashes, tree.hashes_count * sizeof(uint256_t));
+	assert(msg->hashes);
+	msg->flags_size = (tree.bits_count + 7) / 8;
+	msg->flags = tree.bits;
+	return 0;
+}
+
+struct partial_merkle_tree_extractor
+{
+	const struct bitcoin_message_merkleblock * msg;
+	ssize_t bits_used;
+	ssize_t hashes_used;
+	ssize_t matches_count;
+	uint256_t * matches;
+	int error;
+};
+
+static void traverse_and_extract(struct partial_merkle_tree_extractor * tree, int height, ssize_t pos, uint256_t * hash)
+{
+	const struct bitcoin_message_merkleblock * msg = tree->msg;
+	if(tree->error) return;
+	if(tree->bits_used >= (msg->flags_size * 8)) { tree->error = 1; return; }	// overflowed the bits array
+	
+	int parent_of_match = (msg->flags[tree->bits_used >> 3] >> (tree->bits_used & 7)) & 1;
+	++tree->bits_used;
+	
+	if(0 == height || !parent_of_match) {
+		if(tree->hashes_used >= msg->hashes_count) { tree->error = 1; return; }	// overflowed the hashes array
+		*hash = msg->hashes[tree->hashes_used++];
+		if(0 == height && parent_of_match) tree->matches[tree->matches_count++] = *hash;
+		return;
+	}
+	
+	uint256_t nodes[2];
+	traverse_and_extract(tree, height - 1, pos * 2, &nodes[0]);
+	if((pos * 2 + 1) < tree_width(msg->total_txns, height - 1)) {
+		traverse_and_extract(tree, height - 1, pos * 2 + 1, &nodes[1]);
+		// the right branch can not be identical to the left one (CVE-2012-2459)
+		if(!tree->error && 0 == memcmp(&nodes[0], &nodes[1], sizeof(uint256_t))) tree->error = 1;
+	}else {
+		nodes[1] = nodes[0];
+	}
+	if(tree->error) return;
+	hash256(nodes, sizeof(nodes), (uint8_t *)hash);
+}
+
+ssize_t merkleblock_extract_matches(const struct bitcoin_message_merkleblock * msg, uint256_t ** p_txids)
+{
+	assert(msg);
+	ssize_t txn_count = msg->total_txns;
+	if(txn_count <= 0 || txn_count > (MAX_BLOCK_WEIGHT / MIN_TRANSACTION_WEIGHT)) return -1;
+	if(msg->hashes_count > txn_count || (msg->flags_size * 8) < msg->hashes_count) return -1;
+	
+	int height = 0;
+	while(tree_width(txn_count, height) > 1) ++height;
+	
+	struct partial_merkle_tree_extractor tree = {
+		.msg = msg,
+		.matches = calloc(msg->hashes_count + 1, sizeof(uint256_t)),
+	};
+	assert(tree.matches);
+	
+	uint256_t merkle_root;
+	traverse_and_extract(&tree, height, 0, &merkle_root);
+	
+	// all the hashes and bits (except the padding of the last byte) must have been consumed
+	if(tree.error 
+		|| tree.hashes_used != msg->hashes_count 
+		|| ((tree.bits_used + 7) / 8) != msg->flags_size
+		|| memcmp(&merkle_root, msg->hdr.merkle_root, sizeof(uint256_t)) != 0)
+	{
+		free(tree.matches);
+		return -1;
+	}
+	
+	if(p_txids) *p_txids = tree.matches;
+	else free(tree.matches);
+	return tree.matches_count;
+}
+
+
+#if defined(_TEST_BLOOM_FILTER) && defined(_STAND_ALONE)
+#include <time.h>
+#include "test-utils.h"
+
+static void load_filter(bloom_filter_t * filter, size_t size, uint32_t hash_funcs, uint32_t tweak, uint8_t flags)
+{
+	unsigned char data[BLOOM_FILTER_MAX_SIZE] = { 0 };
+	struct bitcoin_message_filterload msg = {
+		.filter_size = size, .filter = data,
+		.hash_funcs = hash_funcs, .tweak = tweak, .flags = flags,
+	};
+	int rc = bloom_filter_load(filter, &msg);
+	assert(0 == rc);
+}
+
+static void test_filter(void)
+{
+	// a filter of 3 elements with fp_rate = 0.01: 3 bytes, 5 hash functions
+	static const char * hex_elements[3] = {
+		"99108ad8ed9bb6274d3980bab5a85c048f0950c8",
+		"b5a2c786d9ef4658287ced5914b37a1b4aa32eee",
+		"b9300670b4c5366e95b2699e8b18bc75e5f729c5",
+	};
+	unsigned char elements[3][20];
+	for(int i = 0; i < 3; ++i) {
+		void * data = elements[i];
+		ssize_t cb = hex2bin(hex_elements[i], 40, &data);
+		assert(cb == 20);
+	}
+	
+	// murmur3_32(): the MurmurHash3 vectors of Bitcoin Core's hash_tests
+	static const struct { uint32_t seed; const char * hex_data; uint32_t hash; } murmur3_vectors[] = {
+		{ 0x00000000, "",           0x00000000 },
+		{ 0xFBA4C795, "",           0x6a396f08 },
+		{ 0xffffffff, "",           0x81f16f39 },
+		{ 0x00000000, "00",         0x514e28b7 },
+		{ 0xFBA4C795, "00",         0xea3f0b17 },
+		{ 0x00000000, "ff",         0xfd6cf10d },
+		{ 0x00000000, "0011",       0x16c6b7ab },
+		{ 0x00000000, "001122",     0x8eb51c3d },
+		{ 0x00000000, "00112233",   0xb4471bf8 },
+		{ 0x00000000, "0011223344", 0xe2301fa8 },
+	};
+	for(size_t i = 0; i < sizeof(murmur3_vectors) / sizeof(murmur3_vectors[0]); ++i) {
+		unsigned char data[8];
+		void * p_data = data;
+		ssize_t cb = hex2bin(murmur3_vectors[i].hex_data, -1, &p_data);
+		assert(cb >= 0 && murmur3_32(murmur3_vectors[i].seed, data, cb) == murmur3_vectors[i].hash);
+	}
+	
+	// the serialized filterload of Bitcoin Core's bloom_create_insert_serialize(_with_tweak) tests:
+	//   varint(3) | bits | nHashFuncs = 5 | nTweak | nFlags = BLOOM_UPDATE_ALL
+	static const struct { uint32_t tweak; const char * hex_serialized; } cases[] = {
+		{ 0,          "03614e9b050000000000000001" },
+		{ 2147483649, "03ce4299050000000100008001" },
+	};
+	for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		bloom_filter_t filter[1];
+		load_filter(filter, 3, 5, cases[i].tweak, bloom_filter_update_all);
+		assert(filter->is_empty && !bloom_filter_contains(filter, elements[0], 20));
+		
+		bloom_filter_insert(filter, elements[0], 20);
+		assert(!filter->is_empty && bloom_filter_contains(filter, elements[0], 20));
+		
+		struct bitcoin_message_filteradd add = { .data_size = 20, .data = elements[1] };
+		assert(0 == bloom_filter_add(filter, &add));
+		bloom_filter_insert(filter, elements[2], 20);
+		for(int k = 0; k < 3; ++k) assert(bloom_filter_contains(filter, elements[k], 20));
+		
+		// wire compatibility: the bits, nHashFuncs, nTweak and nFlags
+		struct bitcoin_message_filterload msg = {
+			.filter_size = filter->size, .filter = filter->data,
+			.hash_funcs = filter->num_hash_funcs, .tweak = filter->tweak, .flags = filter->flags,
+		};
+		unsigned char * payload = NULL;
+		ssize_t cb = bitcoin_message_filterload_serialize(&msg, &payload);
+		unsigned char expected[13];
+		void * data = expected;
+		assert(hex2bin(cases[i].hex_serialized, -1, &data) == sizeof(expected));
+		assert(cb == sizeof(expected) && 0 == memcmp(payload, expected, cb));
+		free(payload);
+		
+		add.data_size = BLOOM_FILTER_MAX_ELEMENT_SIZE + 1;
+		assert(-1 == bloom_filter_add(filter, &add));
+		bloom_filter_cleanup(filter);
+	}
+	
+	// all bits set: matches everything
+	bloom_filter_t filter[1];
+	unsigned char full[4] = { 0xff, 0xff, 0xff, 0xff };
+	struct bitcoin_message_filterload msg = { .filter_size = 4, .filter = full, .hash_funcs = 1 };
+	assert(0 == bloom_filter_load(filter, &msg));
+	assert(filter->is_full && bloom_filter_contains(filter, "", 0));
+	bloom_filter_cleanup(filter);
+	
+	// limits
+	msg.filter_size = BLOOM_FILTER_MAX_SIZE + 1;
+	assert(-1 == bloom_filter_load(filter, &msg));
+	msg.filter_size = 4;
+	msg.hash_funcs = BLOOM_FILTER_MAX_HASH_FUNCS + 1;
+	assert(-1 == bloom_filter_load(filter, &msg));
+	printf("%s(): PASSED\n", __FUNCTION__);
+}
+
+static void test_match_tx(void)
+{
+	unsigned char pkh[20], pk_script[67], sig_script[1 + 33];
+	memset(pkh, 0x11, sizeof(pkh));
+	uint256_t prev_hash;
+	memset(&prev_hash, 0x22, sizeof(prev_hash));
+	sig_script[0] = 33;
+	memset(sig_script + 1, 0x03, 33);
+	
+	// txs[0]: pays to pkh, txs[1]: spends txs[0], txs[2]: pays to a pubkey, txs[3]: spends txs[2]
+	satoshi_tx_t txs[4];
+	test_make_tx(&txs[0], &prev_hash, 0, sig_script, sizeof(sig_script), pk_script, test_make_p2pkh(pk_script, pkh));
+	test_make_tx(&txs[1], txs[0].txid, 0, sig_script, 0, pk_script, 0);
+	
+	unsigned char pubkey[33];
+	memset(pubkey, 0x33, sizeof(pubkey));
+	pubkey[0] = 0x02;
+	pk_script[0] = 33;
+	memcpy(pk_script + 1, pubkey, 33);
+	pk_script[34] = satoshi_script_opcode_op_checksig;
+	assert(is_p2pubkey_or_multisig(pk_script, 35));
+	test_make_tx(&txs[2], &prev_hash, 1, sig_script, 0, pk_script, 35);
+	test_make_tx(&txs[3], txs[2].txid, 0, sig_script, 0, pk_script, 0);
+	
+	// 1-of-2 multisig
+	unsigned char multisig[1 + 34 + 34 + 2] = { satoshi_script_opcode_op_1 };
+	for(int i = 0; i < 2; ++i) memcpy(multisig + 1 + 34 * i, pk_script, 34);
+	multisig[69] = satoshi_script_opcode_op_1 + 1;
+	multisig[70] = satoshi_script_opcode_op_checkmultisig;
+	assert(is_p2pubkey_or_multisig(multisig, sizeof(multisig)));
+	multisig[69] = satoshi_script_opcode_op_1 + 2;
+	assert(!is_p2pubkey_or_multisig(multisig, sizeof(multisig)));
+	
+	static const struct { uint8_t flags; int matches[4]; } cases[] = {
+		{ bloom_filter_update_none,          { 1, 0, 1, 0 } },
+		{ bloom_filter_update_all,           { 1, 1, 1, 1 } },
+		{ bloom_filter_update_p2pubkey_only, { 1, 0, 1, 1 } },
+	};
+	for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		bloom_filter_t filter[1];
+		load_filter(filter, 1000, 10, 12345, cases[c].flags);
+		bloom_filter_insert(filter, pkh, sizeof(pkh));
+		bloom_filter_insert(filter, pubkey, sizeof(pubkey));
+		for(int i = 0; i < 4; ++i) assert(bloom_filter_match_tx(filter, &txs[i]) == cases[c].matches[i]);
+		bloom_filter_cleanup(filter);
+	}
+	
+	// the txid, a spent outpoint, a push of the input script
+	bloom_filter_t filter[1];
+	load_filter(filter, 1000, 10, 0, bloom_filter_update_none);
+	assert(!bloom_filter_match_tx(filter, &txs[0]));
+	bloom_filter_insert(filter, txs[0].txid, 32);
+	assert(bloom_filter_match_tx(filter, &txs[0]));
+	bloom_filter_cleanup(filter);
+	
+	load_filter(filter, 1000, 10, 0, bloom_filter_update_none);
+	bloom_filter_insert(filter, &txs[0].txins[0].outpoint, 36);
+	assert(bloom_filter_match_tx(filter, &txs[0]));
+	bloom_filter_cleanup(filter);
+	
+	load_filter(filter, 1000, 10, 0, bloom_filter_update_none);
+	bloom_filter_insert(filter, sig_script + 1, 33);
+	assert(bloom_filter_match_tx(filter, &txs[0]) && !bloom_filter_match_tx(filter, &txs[1]));
+	bloom_filter_cleanup(filter);
+	
+	for(int i = 0; i < 4; ++i) satoshi_tx_cleanup(&txs[i]);
+	printf("%s(): PASSED\n", __FUNCTION__);
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static void test_merkleblock(ssize_t txn_count, int num_peers)
+{
+	satoshi_block_t block[1];
+	test_make_block(block, txn_count);
+	
+	double time_start = get_time();
+	bloom_block_index_t index[1];
+	int rc = bloom_block_index_init(index, block);
+	assert(0 == rc);
+	assert(0 == memcmp(&index->hashes[index->level_offsets[index->height]], block->hdr.merkle_root, 32));
+	double time_index = get_time() - time_start;
+	
+	uint8_t * matched = calloc(txn_count, 1);
+	assert(matched);
+	
+	time_start = get_time();
+	ssize_t total_matched = 0;
+	for(int peer = 0; peer < num_peers; ++peer) {
+		// each peer watches a few addresses
+		bloom_filter_t filter[1];
+		load_filter(filter, 1024, 10, (uint32_t)peer * 7919, bloom_filter_update_all);
+		ssize_t watched = (peer % 5);
+		for(ssize_t i = 0; i < watched; ++i) {
+			const satoshi_txout_t * txout = &block->txns[(peer * 31 + i * 97) % txn_count].txouts[0];
+			bloom_filter_insert(filter, varstr_getdata_ptr(txout->scripts) + 3, 20);
+		}
+		
+		ssize_t num_matched = bloom_filter_match_block(filter, index, matched);
+		for(ssize_t i = 0; i < watched; ++i) assert(matched[(peer * 31 + i * 97) % txn_count]);
+		total_matched += num_matched;
+		
+		struct bitcoin_message_merkleblock msg[1];
+		rc = bloom_block_index_get_merkleblock(index, matched, msg);
+		assert(0 == rc && msg->total_txns == txn_count);
+		
+		// serialize and parse again
+		unsigned char * payload = NULL;
+		ssize_t cb = bitcoin_message_merkleblock_serialize(msg, &payload);
+		struct bitcoin_message_merkleblock parsed[1];
+		assert(bitcoin_message_merkleblock_parse(parsed, payload, cb) == parsed);
+		free(payload);
+		
+		uint256_t * txids = NULL;
+		ssize_t count = merkleblock_extract_matches(parsed, &txids);
+		assert(count == num_matched);
+		for(ssize_t i = 0, k = 0; i < txn_count; ++i) {
+			if(matched[i]) assert(0 == memcmp(&txids[k++], block->txns[i].txid, 32));
+		}
+		free(txids);
+		
+		// tampered trees
+		parsed->hashes[parsed->hashes_count - 1].val[0] ^= 1;
+		assert(-1 == merkleblock_extract_matches(parsed, NULL));
+		parsed->hashes[parsed->hashes_count - 1].val[0] ^= 1;
+		parsed->hashes_count -= 1;
+		assert(-1 == merkleblock_extract_matches(parsed, NULL));
+		parsed->hashes_count += 1;
+		
+		bitcoin_message_merkleblock_cleanup(parsed);
+		bitcoin_message_merkleblock_cleanup(msg);
+		bloom_filter_cleanup(filter);
+	}
+	double time_match = get_time() - time_start;
+	
+	printf("%s(txn_count=%ld, peers=%d): PASSED, matched=%ld, index: %.3f ms, per peer: %.3f ms\n", __FUNCTION__, 
+		(long)txn_count, num_peers, (long)total_matched, time_index * 1000.0, time_match * 1000.0 / num_peers);
+	
+	free(matched);
+	bloom_block_index_cleanup(index);
+	satoshi_block_cleanup(block);
+}
+
+int main(int argc, char **argv)
+{
+	test_filter();
+	test_match_tx();
+	
+	test_merkleblock(1, 5);
+	test_merkleblock(2, 5);
+	test_merkleblock(7, 10);
+	test_merkleblock(100, 20);
+	test_merkleblock(2500, 100);
+	return 0;
+}
+#endif
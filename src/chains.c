@@ -30,12 +30,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <search.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "satoshi-types.h"
 #include "utils.h"
 
 #include "chains.h"
+#include "bitcoin-consensus.h"
 
 /**
  * @file chains.c
@@ -100,22 +102,16 @@
  *   replace the current one, and bring all the first-child on his chain back to the royal family.
  * 
  */
-int block_info_update_cumulative_difficulty(
-	block_info_t * node, // current node
-	double cumulative_difficulty,	// parent's cumulative_difficulty
-	block_info_t ** p_longest_offspring			// the child who currently at the end of the longest-chain  
-);
-int block_info_declare_inheritance(block_info_t * heir);
+static void block_info_update_best(block_info_t * node);
+static block_info_t * block_info_refresh_ancestors(block_info_t * node);
+static block_info_t * block_info_walk_to(block_info_t * node, int height);
+static void block_info_link(block_info_t * node);
+static void block_info_free_nodes(block_info_t * info, active_chain_list_t * list);
 static int active_chain_list_resize(active_chain_list_t * list, ssize_t max_size);
-
-
-enum traverse_action_type
-{
-	traverse_action_type_add,
-	traverse_action_type_remove,
-	traverse_action_types_count
-};
-static int search_tree_traverse_BFS(void ** p_search_root, enum traverse_action_type type, block_info_t * node);
+static block_info_t * active_chain_index_find(const struct active_chain_index * index, const uint256_t * hash);
+static block_info_t * active_chain_index_find_head(const struct active_chain_index * index, const uint256_t * hash);
+static int active_chain_list_unindex(active_chain_list_t * list, block_info_t * node);
+static void active_chain_list_touch(active_chain_list_t * list, active_chain_t * chain);
 
 #define MAX_FUTURE_BLOCK_TIME	(2 * 60 * 60)
 const uint256_t g_genesis_block_hash[1] = {{
@@ -155,13 +151,64 @@ const struct satoshi_block_header g_genesis_block_hdr[1] = {{
 }};
 
 #define BLOCKCHAIN_DEFAULT_ALLOC_SIZE (6 * 24 * 365 * 100)	// (6 blocks per hour) * 24hours * 365days * 100years
+#define BLOCKCHAIN_HEIRS_CHUNK_MASK	(BLOCKCHAIN_HEIRS_CHUNK_SIZE - 1)
+#define BLOCKCHAIN_RETIRED_ALLOC_SIZE	(256)
 
 /***********************************************************************
  * blockchain
  **********************************************************************/
-typedef int (* blockchain_heir_compare_func)(const void *, const void *);
-static blockchain_heir_compare_func blockchain_heir_compare = (blockchain_heir_compare_func)uint256_compare; 
+/**
+ * blockchain_retire():
+ *   the writer no longer uses 'ptr' (or the index entry (key, height) if ptr is NULL), 
+ *   but the snapshots may still do, it will be reclaimed after all readers of the current epoch have left.
+ */
+static void blockchain_retire(blockchain_t * chain, void * ptr, uint64_t key, int64_t height)
+{
+	struct blockchain_retired_list * list = chain->pending;
+	if(list->count >= list->max_size) {
+		ssize_t new_size = (list->count + 1 + BLOCKCHAIN_RETIRED_ALLOC_SIZE - 1) / BLOCKCHAIN_RETIRED_ALLOC_SIZE * BLOCKCHAIN_RETIRED_ALLOC_SIZE;
+		struct blockchain_retired_item * items = realloc(list->items, new_size * sizeof(*items));
+		assert(items);
+		list->items = items;
+		list->max_size = new_size;
+	}
+	
+	struct blockchain_retired_item * item = &list->items[list->count++];
+	item->ptr = ptr;
+	item->key = key;
+	item->height = height;
+}
 
+static void blockchain_retired_list_cleanup(struct blockchain_retired_list * list)
+{
+	for(ssize_t i = 0; i < list->count; ++i) free(list->items[i].ptr);
+	free(list->items);
+	memset(list, 0, sizeof(*list));
+}
+
+/**
+ * blockchain_copy_directory():
+ *   replace the published chunks directory with a private copy.
+ */
+static void blockchain_copy_directory(blockchain_t * chain, ssize_t num_chunks)
+{
+	ssize_t old_chunks = chain->max_size >> BLOCKCHAIN_HEIRS_CHUNK_BITS;
+	assert(num_chunks >= old_chunks);
+	
+	blockchain_heir_t ** heirs = calloc(num_chunks, sizeof(*heirs));
+	assert(heirs);
+	if(old_chunks > 0) memcpy(heirs, chain->heirs, old_chunks * sizeof(*heirs));
+	
+	if(chain->heirs) blockchain_retire(chain, chain->heirs, 0, 0);
+	chain->heirs = heirs;
+	chain->dir_shared = 0;
+}
+
+/**
+ * blockchain_resize():
+ *   grow the chunks directory, 'size' is the number of heirs, 
+ *   the chunks will be allocated on first write.
+ */
 static int blockchain_resize(blockchain_t * chain, ssize_t size)
 {
 	if(size <= 0) size = BLOCKCHAIN_DEFAULT_ALLOC_SIZE;
@@ -169,21 +216,585 @@ static int blockchain_resize(blockchain_t * chain, ssize_t size)
 	
 	if(size <= chain->max_size) return 0;
 	
-	blockchain_heir_t * heirs = realloc(chain->heirs, size * sizeof(*heirs));
-	assert(heirs);
+	ssize_t old_chunks = chain->max_size >> BLOCKCHAIN_HEIRS_CHUNK_BITS;
+	ssize_t num_chunks = (size + BLOCKCHAIN_HEIRS_CHUNK_SIZE - 1) >> BLOCKCHAIN_HEIRS_CHUNK_BITS;
 	
-	memset(heirs, 0, (size - chain->max_size) * sizeof(*heirs));
-	chain->heirs = heirs;
-	chain->max_size = size;
+	if(chain->dir_shared) {
+		blockchain_copy_directory(chain, num_chunks);
+	}else {
+		blockchain_heir_t ** heirs = realloc(chain->heirs, num_chunks * sizeof(*heirs));
+		assert(heirs);
+		memset(heirs + old_chunks, 0, (num_chunks - old_chunks) * sizeof(*heirs));
+		chain->heirs = heirs;
+	}
+	
+	ssize_t * sealed = realloc(chain->sealed, num_chunks * sizeof(*sealed));
+	assert(sealed);
+	for(ssize_t i = old_chunks; i < num_chunks; ++i) sealed[i] = -1;
+	chain->sealed = sealed;
+	
+	chain->max_size = num_chunks << BLOCKCHAIN_HEIRS_CHUNK_BITS;
+	return 0;
+}
+
+/**
+ * blockchain_heir_mut():
+ *   get a writable heir, 
+ *   the chunk (and the directory) will be copied if the heir has been published.
+ */
+static blockchain_heir_t * blockchain_heir_mut(blockchain_t * chain, ssize_t height)
+{
+	assert(height >= 0);
+	int rc = blockchain_resize(chain, height + 1);
+	assert(0 == rc);
+	
+	ssize_t index = height >> BLOCKCHAIN_HEIRS_CHUNK_BITS;
+	blockchain_heir_t * chunk = chain->heirs[index];
+	if(NULL == chunk) {
+		// the snapshots never read beyond their heights, a new chunk can be added in place.
+		chunk = calloc(BLOCKCHAIN_HEIRS_CHUNK_SIZE, sizeof(*chunk));
+		assert(chunk);
+		chain->heirs[index] = chunk;
+		chain->sealed[index] = -1;
+	}else if(height <= chain->sealed[index]) {
+		// copy on write
+		blockchain_heir_t * copy = malloc(BLOCKCHAIN_HEIRS_CHUNK_SIZE * sizeof(*copy));
+		assert(copy);
+		memcpy(copy, chunk, BLOCKCHAIN_HEIRS_CHUNK_SIZE * sizeof(*copy));
+		
+		if(chain->dir_shared) blockchain_copy_directory(chain, chain->max_size >> BLOCKCHAIN_HEIRS_CHUNK_BITS);
+		chain->heirs[index] = copy;
+		chain->sealed[index] = -1;
+		blockchain_retire(chain, chunk, 0, 0);
+		chunk = copy;
+	}
+	
+	if(index < chain->dirty_chunk) chain->dirty_chunk = index;
+	return &chunk[height & BLOCKCHAIN_HEIRS_CHUNK_MASK];
+}
+
+/***********************************************************************
+ * blockchain_hash_index
+ **********************************************************************/
+#define BLOCKCHAIN_HASH_INDEX_INIT_SIZE		(1 << 16)
+#define BLOCKCHAIN_HASH_INDEX_MIGRATE_STEPS	(64)
+
+static inline uint64_t hash_index_key(const uint256_t * hash)
+{
+	// the lower bytes of a block hash are uniformly random (the leading zeros are stored at the end)
+	uint64_t key = 0;
+	memcpy(&key, hash, sizeof(key));
+	return key?key:1;	// 0 is reserved for empty slots
+}
+
+/**
+ * hash_index_lookup_slots():
+ *   only the heirs within 'max_height' are visible, 
+ *   the writer uses its current height, the snapshots use their own.
+ */
+static ssize_t hash_index_lookup_slots(blockchain_heir_t * const * heirs, ssize_t max_height, 
+	const struct blockchain_hash_index_slot * slots, ssize_t size,
+	uint64_t key, const uint256_t * hash,
+	ssize_t * p_pos)
+{
+	if(NULL == slots) return -1;
+	
+	ssize_t mask = size - 1;
+	uint64_t slot_key;
+	for(ssize_t i = key & mask; (slot_key = __atomic_load_n(&slots[i].key, __ATOMIC_ACQUIRE)); i = (i + 1) & mask)
+	{
+		if(slot_key != key) continue;
+		
+		int64_t height = __atomic_load_n(&slots[i].height, __ATOMIC_RELAXED);
+		if(height < 0 || height > max_height) continue;
+		if(0 == memcmp(blockchain_heirs_at(heirs, height)->hash, hash, sizeof(uint256_t))) {
+			if(p_pos) *p_pos = i;
+			return height;
+		}
+	}
+	return -1;
+}
+
+static void hash_index_put(struct blockchain_hash_index * index, uint64_t key, int64_t height)
+{
+	struct blockchain_hash_index_slot * slots = index->slots;
+	ssize_t mask = index->size - 1;
+	ssize_t i = key & mask;
+	while(slots[i].key && slots[i].height >= 0) i = (i + 1) & mask;
+	
+	if(0 == slots[i].key) ++index->used;	// otherwise, reuse the tombstone
+	
+	// store the key at last, the snapshots will see either an empty slot or a complete one.
+	__atomic_store_n(&slots[i].height, height, __ATOMIC_RELAXED);
+	__atomic_store_n(&slots[i].key, key, __ATOMIC_RELEASE);
+}
+
+static void hash_index_mark_removed(struct blockchain_hash_index_slot * slots, ssize_t size, uint64_t key, int64_t height)
+{
+	if(NULL == slots) return;
+	
+	ssize_t mask = size - 1;
+	for(ssize_t i = key & mask; slots[i].key; i = (i + 1) & mask)
+	{
+		if(slots[i].key == key && slots[i].height == height) {
+			__atomic_store_n(&slots[i].height, -1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void hash_index_migrate(blockchain_t * chain, ssize_t steps)
+{
+	struct blockchain_hash_index * index = chain->hash_index;
+	if(NULL == index->old_slots) return;
+	
+	ssize_t end = index->migrate_pos + steps;
+	if(end > index->old_size) end = index->old_size;
+	
+	for(ssize_t i = index->migrate_pos; i < end; ++i)
+	{
+		struct blockchain_hash_index_slot * slot = &index->old_slots[i];
+		if(slot->key && slot->height >= 0) hash_index_put(index, slot->key, slot->height);
+	}
+	index->migrate_pos = end;
+	
+	if(end == index->old_size) {
+		blockchain_retire(chain, index->old_slots, 0, 0);	// may still be used by the snapshots
+		index->old_slots = NULL;
+		index->old_size = 0;
+		index->migrate_pos = 0;
+	}
+}
+
+static void blockchain_hash_index_init(struct blockchain_hash_index * index)
+{
+	memset(index, 0, sizeof(*index));
+	index->size = BLOCKCHAIN_HASH_INDEX_INIT_SIZE;
+	index->slots = calloc(index->size, sizeof(*index->slots));
+	assert(index->slots);
+}
+
+static void blockchain_hash_index_cleanup(struct blockchain_hash_index * index)
+{
+	free(index->slots);
+	free(index->old_slots);
+	memset(index, 0, sizeof(*index));
+}
+
+static ssize_t blockchain_hash_index_find(const blockchain_t * chain, const uint256_t * hash)
+{
+	const struct blockchain_hash_index * index = chain->hash_index;
+	uint64_t key = hash_index_key(hash);
+	
+	ssize_t height = hash_index_lookup_slots(chain->heirs, chain->height, index->slots, index->size, key, hash, NULL);
+	if(height < 0 && index->old_slots) {
+		height = hash_index_lookup_slots(chain->heirs, chain->height, index->old_slots, index->old_size, key, hash, NULL);
+	}
+	return height;
+}
+
+/**
+ * blockchain_hash_index_add(): 
+ *   the caller must make sure that 'heirs[height].hash' has been set and is not in the index.
+ */
+static int blockchain_hash_index_add(blockchain_t * chain, ssize_t height)
+{
+	struct blockchain_hash_index * index = chain->hash_index;
+	const uint256_t * hash = blockchain_heirs_at(chain->heirs, height)->hash;
+	uint64_t key = hash_index_key(hash);
+	
+	// a removed entry is kept until the snapshots have released it, just bring it back.
+	if(hash_index_lookup_slots(chain->heirs, height, index->slots, index->size, key, hash, NULL) == height
+		|| hash_index_lookup_slots(chain->heirs, height, index->old_slots, index->old_size, key, hash, NULL) == height)
+	{
+		++index->count;
+		return 0;
+	}
+	
+	hash_index_migrate(chain, BLOCKCHAIN_HASH_INDEX_MIGRATE_STEPS);
+	
+	if((index->used + 1) * 2 > index->size) {
+		hash_index_migrate(chain, index->old_size);	// finish the previous migration (rarely happens)
+		
+		// grow if more than 1/4 are alive, otherwise just rebuild to drop the tombstones
+		ssize_t new_size = index->size;
+		if((index->count + 1) * 4 > index->size) new_size *= 2;
+		
+		index->old_slots = index->slots;
+		index->old_size = index->size;
+		index->migrate_pos = 0;
+		
+		index->slots = calloc(new_size, sizeof(*index->slots));
+		assert(index->slots);
+		index->size = new_size;
+		index->used = 0;
+	}
+	
+	hash_index_put(index, key, height);
+	++index->count;
+	return 0;
+}
+
+/**
+ * blockchain_hash_index_remove(): 
+ *   the entry will be marked as removed after the snapshots have been released, 
+ *   the writer should lower its height to make it invisible immediately.
+ */
+static int blockchain_hash_index_remove(blockchain_t * chain, const uint256_t * hash)
+{
+	ssize_t height = blockchain_hash_index_find(chain, hash);
+	if(height < 0) return -1;
+	
+	blockchain_retire(chain, NULL, hash_index_key(hash), height);
+	--chain->hash_index->count;
+	return 0;
+}
+
+static void blockchain_hash_index_apply_removal(blockchain_t * chain, uint64_t key, int64_t height)
+{
+	// the heir has been added back 
+	if(height <= chain->height 
+		&& key == hash_index_key(blockchain_heirs_at(chain->heirs, height)->hash)) return;
+	
+	struct blockchain_hash_index * index = chain->hash_index;
+	hash_index_mark_removed(index->slots, index->size, key, height);
+	hash_index_mark_removed(index->old_slots, index->old_size, key, height);
+}
+
+/***********************************************************************
+ * blockchain_snapshot
+ * 
+ * epoch based reclamation:
+ *  - readers register themselves to the counter of the current epoch's parity;
+ *  - the writer publishes a new view after each add or reorg, 
+ *    and the memory which is no longer used is retired to the 'pending' list;
+ *  - when the 'limbo' list is empty, the writer starts a new epoch and moves 'pending' to 'limbo',
+ *    the items in 'limbo' are reclaimed once all readers of the previous epoch have left.
+ **********************************************************************/
+static void blockchain_retired_list_reclaim(blockchain_t * chain, struct blockchain_retired_list * list)
+{
+	for(ssize_t i = 0; i < list->count; ++i)
+	{
+		struct blockchain_retired_item * item = &list->items[i];
+		if(item->ptr) free(item->ptr);
+		else blockchain_hash_index_apply_removal(chain, item->key, item->height);
+	}
+	list->count = 0;
+}
+
+static void blockchain_reclaim(blockchain_t * chain)
+{
+	for(int i = 0; i < 2; ++i)
+	{
+		if(chain->limbo->count > 0) {
+			if(__atomic_load_n(&chain->readers[chain->limbo_parity], __ATOMIC_SEQ_CST) > 0) return;
+			blockchain_retired_list_reclaim(chain, chain->limbo);
+		}
+		if(0 == chain->pending->count) return;
+		
+		// start a new epoch, the readers coming later can only see the latest view.
+		chain->limbo_parity = chain->epoch & 1;
+		__atomic_add_fetch(&chain->epoch, 1, __ATOMIC_SEQ_CST);
+		
+		struct blockchain_retired_list list = chain->limbo[0];
+		chain->limbo[0] = chain->pending[0];
+		chain->pending[0] = list;
+	}
+}
+
+/**
+ * blockchain_publish():
+ *   make the current state of the main chain visible to the snapshots. (the caller must hold the lock)
+ */
+static void blockchain_publish(blockchain_t * chain)
+{
+	struct blockchain_hash_index * index = chain->hash_index;
+	blockchain_view_t * view = calloc(1, sizeof(*view));
+	assert(view);
+	
+	view->height = chain->height;
+	view->heirs = chain->heirs;
+	view->slots = index->slots;
+	view->size = index->size;
+	view->old_slots = index->old_slots;
+	view->old_size = index->old_size;
+	
+	// seal the chunks that the view can see, any further modification to them will make a copy.
+	ssize_t last_chunk = (chain->height >= 0)?(chain->height >> BLOCKCHAIN_HEIRS_CHUNK_BITS):-1;
+	for(ssize_t i = chain->dirty_chunk; i <= last_chunk; ++i)
+	{
+		ssize_t sealed = (i < last_chunk)?(((i + 1) << BLOCKCHAIN_HEIRS_CHUNK_BITS) - 1):chain->height;
+		if(chain->sealed[i] < sealed) chain->sealed[i] = sealed;
+	}
+	chain->dirty_chunk = (last_chunk >= 0)?last_chunk:0;
+	chain->dir_shared = 1;
+	
+	blockchain_view_t * old_view = __atomic_exchange_n(&chain->view, view, __ATOMIC_SEQ_CST);
+	if(old_view) blockchain_retire(chain, old_view, 0, 0);
+	
+	blockchain_reclaim(chain);
+}
+
+blockchain_snapshot_t * blockchain_snapshot_acquire(blockchain_t * chain, blockchain_snapshot_t * snapshot)
+{
+	assert(chain && snapshot);
+	
+	uint64_t epoch = 0;
+	while(1)
+	{
+		epoch = __atomic_load_n(&chain->epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&chain->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+		if(epoch == __atomic_load_n(&chain->epoch, __ATOMIC_SEQ_CST)) break;
+		
+		// the writer has just started a new epoch
+		__atomic_sub_fetch(&chain->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+	}
+	
+	snapshot->chain = chain;
+	snapshot->epoch = epoch;
+	snapshot->view = __atomic_load_n(&chain->view, __ATOMIC_ACQUIRE);
+	assert(snapshot->view);
+	return snapshot;
+}
+
+void blockchain_snapshot_release(blockchain_snapshot_t * snapshot)
+{
+	if(NULL == snapshot || NULL == snapshot->chain) return;
+	
+	__atomic_sub_fetch(&snapshot->chain->readers[snapshot->epoch & 1], 1, __ATOMIC_SEQ_CST);
+	snapshot->chain = NULL;
+	snapshot->view = NULL;
+}
+
+const blockchain_heir_t * blockchain_snapshot_get(const blockchain_snapshot_t * snapshot, ssize_t height)
+{
+	const blockchain_view_t * view = snapshot->view;
+	if(height < 0 || height > view->height) return NULL;
+	return blockchain_heirs_at(view->heirs, height);
+}
+
+/**
+ * heir_get_header(): 
+ *   reconstruct the full header from the compact heirs, 
+ *   prev_hash is taken from the previous heir (or the genesis_prev_hash).
+ */
+static void heir_get_header(blockchain_heir_t * const * heirs, ssize_t height, 
+	const uint256_t * genesis_prev_hash,
+	struct satoshi_block_header * hdr)
+{
+	const blockchain_heir_t * heir = blockchain_heirs_at(heirs, height);
+	hdr->version = heir->version;
+	memcpy(hdr->prev_hash, (height > 0)?blockchain_heirs_at(heirs, height - 1)->hash:genesis_prev_hash, sizeof(uint256_t));
+	memcpy(hdr->merkle_root, heir->merkle_root, sizeof(uint256_t));
+	hdr->timestamp = heir->timestamp;
+	hdr->bits = heir->bits;
+	hdr->nonce = heir->nonce;
+}
+
+int blockchain_snapshot_get_header(const blockchain_snapshot_t * snapshot, ssize_t height, struct satoshi_block_header * hdr)
+{
+	const blockchain_view_t * view = snapshot->view;
+	if(height < 0 || height > view->height) return -1;
+	heir_get_header(view->heirs, height, snapshot->chain->genesis_prev_hash, hdr);
 	return 0;
 }
 
+ssize_t blockchain_snapshot_get_height(const blockchain_snapshot_t * snapshot, const uint256_t * hash)
+{
+	const blockchain_view_t * view = snapshot->view;
+	uint64_t key = hash_index_key(hash);
+	
+	ssize_t height = hash_index_lookup_slots(view->heirs, view->height, view->slots, view->size, key, hash, NULL);
+	if(height < 0 && view->old_slots) {
+		height = hash_index_lookup_slots(view->heirs, view->height, view->old_slots, view->old_size, key, hash, NULL);
+	}
+	return height;
+}
+
+const blockchain_heir_t * blockchain_snapshot_find(const blockchain_snapshot_t * snapshot, const uint256_t * hash)
+{
+	ssize_t height = blockchain_snapshot_get_height(snapshot, hash);
+	if(height < 0) return NULL;
+	return blockchain_heirs_at(snapshot->view->heirs, height);
+}
+
 static int blockchain_add(blockchain_t * chain, const uint256_t * hash, const struct satoshi_block_header * hdr);
 static const blockchain_heir_t * blockchain_find(blockchain_t * chain, const uint256_t * hash);
 static const blockchain_heir_t * blockchain_get(blockchain_t * chain, ssize_t height);
 static ssize_t blockchain_get_height(blockchain_t * chain, const uint256_t * hash);
 
 
+/***********************************************************************
+ * contextual header validation
+ **********************************************************************/
+static void mtp_window_push(struct blockchain_mtp_window * window, uint32_t timestamp)
+{
+	uint32_t * sorted = window->sorted;
+	int n = window->count;
+	if(n == BLOCKCHAIN_MTP_SPAN) {
+		// replace the oldest one
+		uint32_t oldest = window->ring[window->oldest];
+		window->ring[window->oldest] = timestamp;
+		window->oldest = (window->oldest + 1) % BLOCKCHAIN_MTP_SPAN;
+		
+		int pos = 0;
+		while(sorted[pos] != oldest) ++pos;
+		memmove(&sorted[pos], &sorted[pos + 1], (n - 1 - pos) * sizeof(*sorted));
+		--n;
+	}else {
+		window->ring[(window->oldest + n) % BLOCKCHAIN_MTP_SPAN] = timestamp;
+		++window->count;
+	}
+	
+	// insertion sort (at most 10 moves)
+	int pos = n;
+	while(pos > 0 && sorted[pos - 1] > timestamp) {
+		sorted[pos] = sorted[pos - 1];
+		--pos;
+	}
+	sorted[pos] = timestamp;
+}
+
+static void mtp_window_load(struct blockchain_mtp_window * window, blockchain_t * chain, ssize_t height)
+{
+	assert(height >= 0 && height <= chain->height);
+	window->count = 0;
+	window->oldest = 0;
+	
+	ssize_t first = height - (BLOCKCHAIN_MTP_SPAN - 1);
+	if(first < 0) first = 0;
+	for(ssize_t i = first; i <= height; ++i) {
+		mtp_window_push(window, blockchain_heirs_at(chain->heirs, i)->timestamp);
+	}
+	window->height = height;
+}
+
+int64_t blockchain_get_median_time_past(blockchain_t * chain, ssize_t height)
+{
+	assert(chain);
+	if(height < 0 || height > chain->height) return -1;
+	
+	struct blockchain_mtp_window * window = chain->mtp;
+	struct blockchain_mtp_window tmp[1];
+	if(height != window->height) {
+		// keep the cached window for the tip, a temporary one for the others
+		if(height != chain->height) window = tmp;
+		mtp_window_load(window, chain, height);
+	}
+	return window->sorted[window->count / 2];
+}
+
+void blockchain_set_params(blockchain_t * chain, const struct bitcoin_params * params)
+{
+	assert(chain);
+	chain->params = params;
+	chain->retarget->height = -1;
+}
+
+/**
+ * get_next_work_required():
+ *   the reference client's GetNextWorkRequired(), on the main chain.
+ *   the required bits only change at the first block of each epoch, 
+ *   which is computed once and cached, the others are O(1).
+ */
+static uint32_t get_next_work_required(blockchain_t * chain, ssize_t parent_height, const struct satoshi_block_header * hdr)
+{
+	const bitcoin_params_t * params = chain->params;
+	assert(params && parent_height >= 0 && parent_height <= chain->height);
+	
+	const blockchain_heir_t * parent = blockchain_heirs_at(chain->heirs, parent_height);
+	ssize_t height = parent_height + 1;
+	int64_t interval = params->pow_target_timespan / params->pow_target_spacing;
+	assert(interval > 0);
+	
+	uint256_u64_t pow_limit;
+	uint256_u64_from_uint256(&pow_limit, &params->pow_limit);
+	
+	if((height % interval) != 0) {
+		if(params->pow_allow_min_difficulty_blocks) {
+			// a block which has not been found in 2 * 10 minutes can be mined with the minimum difficulty
+			if((int64_t)hdr->timestamp > (int64_t)parent->timestamp + params->pow_target_spacing * 2) {
+				return uint256_u64_get_compact(&pow_limit);
+			}
+			// the last block which is not mined with the special rule: 
+			// the first block of the epoch (the special rule does not apply to it)
+			return blockchain_heirs_at(chain->heirs, height - (height % interval))->bits;
+		}
+		return parent->bits;
+	}
+	
+	if(params->pow_retargeting) return parent->bits;	// fPowNoRetargeting
+	
+	struct blockchain_retarget_cache * cache = chain->retarget;
+	if(cache->height == height && 0 == memcmp(cache->parent_hash, parent->hash, sizeof(uint256_t))) {
+		return cache->bits;
+	}
+	
+	// the first block of the previous epoch
+	const blockchain_heir_t * first = blockchain_heirs_at(chain->heirs, height - interval);
+	int64_t timespan = (int64_t)parent->timestamp - (int64_t)first->timestamp;
+	if(timespan < params->pow_target_timespan / 4) timespan = params->pow_target_timespan / 4;
+	if(timespan > params->pow_target_timespan * 4) timespan = params->pow_target_timespan * 4;
+	
+	uint256_u64_t target, actual, expected;
+	uint256_u64_set_compact(&target, parent->bits, NULL, NULL);
+	uint256_u64_set_u64(&actual, (uint64_t)timespan);
+	uint256_u64_set_u64(&expected, (uint64_t)params->pow_target_timespan);
+	
+	uint256_u64_t next = target;
+	if(0 == uint256_u64_mul(&next, &target, &actual)) {
+		uint256_u64_divmod(&next, NULL, &next, &expected);
+	}else {
+		// targets close to 2^256 (e.g. regtest), divide first
+		uint256_u64_divmod(&next, NULL, &target, &expected);
+		if(uint256_u64_mul(&next, &next, &actual)) next = pow_limit;
+	}
+	if(uint256_u64_compare(&next, &pow_limit) > 0) next = pow_limit;
+	
+	cache->height = height;
+	memcpy(cache->parent_hash, parent->hash, sizeof(uint256_t));
+	cache->bits = uint256_u64_get_compact(&next);
+	return cache->bits;
+}
+
+uint32_t blockchain_get_next_work_required(blockchain_t * chain, const struct satoshi_block_header * hdr)
+{
+	assert(chain && hdr && chain->height >= 0);
+	if(NULL == chain->params) return blockchain_heirs_at(chain->heirs, chain->height)->bits;
+	return get_next_work_required(chain, chain->height, hdr);
+}
+
+/**
+ * check_header_context():
+ *   the reference client's ContextualCheckBlockHeader() (without the checkpoints and the version rules), 
+ *   'hdr' is the child of the heir at 'parent_height'.
+ */
+static int check_header_context(blockchain_t * chain, ssize_t parent_height, const struct satoshi_block_header * hdr, int64_t now)
+{
+	if((int64_t)hdr->timestamp > now + MAX_FUTURE_BLOCK_TIME) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): time-too-new: timestamp=%u, now=%ld." "\e[39m" "\n", 
+			__FILE__, __LINE__, hdr->timestamp, (long)now);
+		return -1;
+	}
+	
+	int64_t median_time_past = blockchain_get_median_time_past(chain, parent_height);
+	if((int64_t)hdr->timestamp <= median_time_past) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): time-too-old: height=%ld, timestamp=%u, median-time-past=%ld." "\e[39m" "\n", 
+			__FILE__, __LINE__, (long)parent_height + 1, hdr->timestamp, (long)median_time_past);
+		return -1;
+	}
+	
+	if(chain->params) {
+		uint32_t bits = get_next_work_required(chain, parent_height, hdr);
+		if(hdr->bits != bits) {
+			fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): bad-diffbits: height=%ld, bits=0x%.8x, required=0x%.8x." "\e[39m" "\n", 
+				__FILE__, __LINE__, (long)parent_height + 1, hdr->bits, bits);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
 /**
  * abandon_child():
  *  export heir's data to a block_info object and return the pointer.
@@ -198,49 +809,70 @@ static inline block_info_t * abandon_child(
 	block_info_t * orphan = block_info_new(heir->hash, NULL);
 	assert(orphan);
 
-	memcpy(&orphan->hdr->prev_hash, parent->hash, sizeof(uint256_t));
+	// keep the full header, the orphan may return to the chain
+	orphan->hdr->version = heir->version;
+	memcpy(orphan->hdr->prev_hash, parent->hash, sizeof(uint256_t));
+	memcpy(orphan->hdr->merkle_root, heir->merkle_root, sizeof(uint256_t));
+	orphan->hdr->timestamp = heir->timestamp;
 	orphan->hdr->bits = heir->bits;
-	orphan->hdr->timestamp = (uint32_t)heir->timestamp;
-	orphan->cumulative_difficulty = heir->cumulative_difficulty;
+	orphan->hdr->nonce = heir->nonce;
+	uint256_u64_work_from_compact(&orphan->work, heir->bits);
+	orphan->best_work = orphan->work;
 	
 	debug_printf("\t del heir: timestamp=%d", (int)heir->timestamp);
-	tdelete(heir, &chain->search_root, blockchain_heir_compare);
+	blockchain_hash_index_remove(chain, heir->hash);
 	return orphan;
 }
 
-static inline blockchain_heir_t * add_heir(blockchain_t * chain,
-	blockchain_heir_t * parent, 
-	const block_info_t * child)
+static inline ssize_t append_heir(blockchain_t * chain,
+	ssize_t parent_height, 
+	const uint256_t * hash,
+	const struct satoshi_block_header * hdr)
 {
-	assert(parent && child && child);
-	assert(0 == memcmp(parent->hash, &child->hdr->prev_hash, sizeof(uint256_t)));
-	
-	blockchain_resize(chain, (1 + chain->height) + 1);
-	blockchain_heir_t * heir = parent + 1;
-	
-	memcpy(heir->hash, &child->hash, sizeof(uint256_t));
-	heir->bits = child->hdr->bits;
-	heir->timestamp = child->hdr->timestamp;
-	
-	double difficulty = compact_uint256_to_bdiff((compact_uint256_t *)&heir->bits);
-	heir->cumulative_difficulty	= parent->cumulative_difficulty + difficulty;
-	
-	memcpy(heir->hdr, child->hdr, sizeof(*child->hdr));
+	assert(parent_height >= 0 && hash && hdr);
+	
+	ssize_t height = parent_height + 1;
+	blockchain_heir_t * heir = blockchain_heir_mut(chain, height);
+	const blockchain_heir_t * parent = blockchain_heirs_at(chain->heirs, parent_height);
+	assert(0 == memcmp(parent->hash, hdr->prev_hash, sizeof(uint256_t)));
+	
+	memcpy(heir->hash, hash, sizeof(uint256_t));
+	memcpy(heir->merkle_root, hdr->merkle_root, sizeof(uint256_t));
+	heir->version = hdr->version;
+	heir->timestamp = hdr->timestamp;
+	heir->bits = hdr->bits;
+	heir->nonce = hdr->nonce;
+	
+	uint256_u64_t work;
+	uint256_u64_work_from_compact(&work, heir->bits);
+	uint256_u64_add(&heir->chainwork, &parent->chainwork, &work);
 		
-	blockchain_heir_t ** p_node = tsearch(heir, &chain->search_root, blockchain_heir_compare);
-	assert(p_node && *p_node == heir);
+	int rc = blockchain_hash_index_add(chain, height);
+	assert(0 == rc);
+	
+	if(chain->mtp->height == parent_height) {
+		mtp_window_push(chain->mtp, heir->timestamp);
+		chain->mtp->height = height;
+	}
 	
 	debug_printf("\t add heir: timestamp=%d", 
 		(int)heir->timestamp);
-	return heir;
+	return height;
+}
+
+static inline ssize_t add_heir(blockchain_t * chain,
+	ssize_t parent_height, 
+	const block_info_t * child)
+{
+	assert(child);
+	return append_heir(chain, parent_height, &child->hash, child->hdr);
 }
 
 #ifndef _DEBUG
 static  
 #endif
-block_info_t * blockchain_abandon_inheritances(blockchain_t * chain, blockchain_heir_t * parent)
+block_info_t * blockchain_abandon_inheritances(blockchain_t * chain, ssize_t height)
 {
-	ssize_t height = parent - chain->heirs;
 	assert(height >= 0 && height <= chain->height);
 	
 	if(height == chain->height) { // no children that need to be remove
@@ -248,79 +880,101 @@ block_info_t * blockchain_abandon_inheritances(blockchain_t * chain, blockchain_
 	}
 	
 	// abandon in reverse order (from the last-child to the parent)
-	blockchain_heir_t * last_offspring = &chain->heirs[chain->height];
 	struct block_info * orphans = NULL;
-	
-	while(last_offspring > parent)
+	for(ssize_t last = chain->height; last > height; --last)
 	{
-		struct block_info * current = abandon_child(chain, last_offspring - 1, last_offspring);
+		const blockchain_heir_t * last_offspring = blockchain_heirs_at(chain->heirs, last);
+		struct block_info * current = abandon_child(chain, 
+			blockchain_heirs_at(chain->heirs, last - 1), 
+			last_offspring);
 		
 		if(chain->on_remove_block) chain->on_remove_block(chain, 
 			last_offspring->hash,
-			last_offspring - chain->heirs,
+			last,
 			chain->user_data); 
 		
+		current->height = (int)last;
 		current->first_child = orphans;
 		if(orphans) orphans->parent = current;
+		block_info_update_best(current);	// only one child
 		orphans = current;
 		
-		--last_offspring;
+		// the removed hash is still in the index until the snapshots have been released
+		chain->height = last - 1;
 	}
+	if(chain->mtp->height > height) chain->mtp->height = -1;
 	
-	// reset current blockchain's height
-	chain->height = height;
-	printf("chain->height: %d\n", (int)chain->height);
+	debug_printf("chain->height: %d", (int)chain->height);
 	return orphans;
 }
 
+/**
+ * blockchain_add_inheritances():
+ *   append the first-child path of 'child' to the tip (at 'height'), 
+ *   stop at the first header which fails the contextual checks.
+ * @return the invalid node, or NULL if the whole path has been appended.
+ */
 static struct block_info * blockchain_add_inheritances(blockchain_t * chain, 
-	blockchain_heir_t * parent,
+	ssize_t height,
 	block_info_t * child)
 {
-	assert(chain && parent && child);
-	ssize_t height = parent - chain->heirs;
+	assert(chain && height >= 0 && child);
+	assert(height == chain->height);
 	
-	block_info_t * orphans = blockchain_abandon_inheritances(chain, parent);
+	int64_t now = time(NULL);
 	while(child)
 	{
-		parent = add_heir(chain, parent, child);
-		assert(parent);
+		if(check_header_context(chain, height, child->hdr, now)) return child;
+		
+		height = add_heir(chain, height, child);
+		assert(height > 0);
+		chain->height = height;
 		
 		if(chain->on_add_block) {
 			chain->on_add_block(chain, 
 				&child->hash, 
-				parent - chain->heirs,
+				height,
 				child->hdr,
 				chain->user_data);
 		}
 		
-		++height;
 		child = child->first_child;
 	}
 	
-	chain->height = height;
-	return orphans;
+	return NULL;
 }
 
 ssize_t blockchain_get_latest(blockchain_t * chain, uint256_t * hash, struct satoshi_block_header * hdr)
 {
-	pthread_mutex_lock(&chain->mutex);
-	ssize_t height = chain->height;
-	if(height >= 0) {
-		blockchain_heir_t * heir = &chain->heirs[height];
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(chain, snapshot);
+	
+	ssize_t height = blockchain_snapshot_height(snapshot);
+	const blockchain_heir_t * heir = blockchain_snapshot_get(snapshot, height);
+	if(heir) {
 		if(hash) memcpy(hash, heir->hash, sizeof(*hash));
-		if(hdr) memcpy(hdr, heir->hdr, sizeof(*hdr));
+		if(hdr) blockchain_snapshot_get_header(snapshot, height, hdr);
 	}
-	pthread_mutex_unlock(&chain->mutex);
+	
+	blockchain_snapshot_release(snapshot);
 	return height;
 }
 
+int blockchain_get_header(blockchain_t * chain, ssize_t height, struct satoshi_block_header * hdr)
+{
+	if(height < 0 || height > chain->height) return -1;
+	heir_get_header(chain->heirs, height, chain->genesis_prev_hash, hdr);
+	return 0;
+}
+
 ssize_t blockchain_get_known_hashes(blockchain_t * chain, size_t max_hashes, uint256_t ** p_hashes)
 {
 	if(max_hashes == 0 || max_hashes > 2000) max_hashes = 2000;
 	
-	pthread_mutex_lock(&chain->mutex);
-	ssize_t height = chain->height;
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(chain, snapshot);
+	
+	ssize_t height = blockchain_snapshot_height(snapshot);
 	uint256_t * hashes = *p_hashes;
 	if(NULL == hashes) {
 		hashes = calloc(max_hashes, sizeof(*hashes));
@@ -337,7 +991,7 @@ ssize_t blockchain_get_known_hashes(blockchain_t * chain, size_t max_hashes, uin
 	ssize_t count = 1;
 	int step = 1;
 	for(size_t i = 0; i < max_hashes && height >= 0; ++i, ++count) {
-		blockchain_heir_t * heir = &chain->heirs[height];
+		const blockchain_heir_t * heir = blockchain_snapshot_get(snapshot, height);
 		memcpy(&hashes[i], heir->hash, sizeof(*hashes));
 		if(height == 0) break;
 		
@@ -345,7 +999,7 @@ ssize_t blockchain_get_known_hashes(blockchain_t * chain, size_t max_hashes, uin
 		height -= step;
 		if(height < 0) height = 0;
 	}
-	pthread_mutex_unlock(&chain->mutex);
+	blockchain_snapshot_release(snapshot);
 	
 	return count;
 }
@@ -380,22 +1034,28 @@ blockchain_t * blockchain_init(blockchain_t * chain,
 	int rc = blockchain_resize(chain, 0);
 	assert(0 == rc);
 	
-	memcpy(chain->heirs[0].hash, genesis_block_hash, sizeof(uint256_t));
+	blockchain_heir_t * genesis = blockchain_heir_mut(chain, 0);
+	memcpy(genesis->hash, genesis_block_hash, sizeof(uint256_t));
 	if(genesis_block_hdr) 
 	{
-		memcpy(chain->heirs[0].hdr, genesis_block_hdr, sizeof(*genesis_block_hdr));
-		
-		chain->heirs[0].timestamp = genesis_block_hdr->timestamp;
-		chain->heirs[0].bits = genesis_block_hdr->bits;
-		chain->heirs[0].cumulative_difficulty = compact_uint256_to_bdiff((compact_uint256_t *)&genesis_block_hdr->bits);
+		memcpy(chain->genesis_prev_hash, genesis_block_hdr->prev_hash, sizeof(uint256_t));
+		memcpy(genesis->merkle_root, genesis_block_hdr->merkle_root, sizeof(uint256_t));
+		genesis->version = genesis_block_hdr->version;
+		genesis->timestamp = genesis_block_hdr->timestamp;
+		genesis->bits = genesis_block_hdr->bits;
+		genesis->nonce = genesis_block_hdr->nonce;
+		uint256_u64_work_from_compact(&genesis->chainwork, genesis_block_hdr->bits);
 	}
 	
-	tsearch(&chain->heirs[0], // add genesis block to the search-tree
-		&chain->search_root, 
-		blockchain_heir_compare
-	);
+	blockchain_hash_index_init(chain->hash_index);
+	blockchain_hash_index_add(chain, 0);	// add genesis block to the hash index
+	
+	chain->mtp->height = -1;
+	chain->retarget->height = -1;
 	
 	active_chain_list_init(chain->candidates_list, 0, chain);
+	
+	blockchain_publish(chain);
 	return chain;
 }
 
@@ -404,69 +1064,72 @@ void blockchain_reset(blockchain_t * chain)
 	if(NULL == chain || NULL == chain->heirs) return;
 	active_chain_list_cleanup(chain->candidates_list);
 	
-	for(ssize_t i = 0; i < (chain->height + 1); ++i) {
-		tdelete(&chain->heirs[i], &chain->search_root, blockchain_heir_compare);
-	}
+	// the old tables may still be used by the snapshots
+	struct blockchain_hash_index * index = chain->hash_index;
+	blockchain_retire(chain, index->slots, 0, 0);
+	if(index->old_slots) blockchain_retire(chain, index->old_slots, 0, 0);
+	blockchain_hash_index_init(index);
 	chain->height = -1;
+	chain->mtp->height = -1;
+	chain->retarget->height = -1;
+	
+	blockchain_publish(chain);
 	return;
 }
 
-static void no_free(void * data)
-{
-}
 void blockchain_cleanup(blockchain_t * chain)
 {
 	if(NULL == chain) return;
 	
 	active_chain_list_cleanup(chain->candidates_list);
-	free(chain->heirs);
+	
+	// all snapshots must have been released
+	assert(0 == chain->readers[0] && 0 == chain->readers[1]);
+	free(chain->view);
+	chain->view = NULL;
+	blockchain_retired_list_cleanup(chain->pending);
+	blockchain_retired_list_cleanup(chain->limbo);
+	
+	if(chain->heirs) {
+		ssize_t num_chunks = chain->max_size >> BLOCKCHAIN_HEIRS_CHUNK_BITS;
+		for(ssize_t i = 0; i < num_chunks; ++i) free(chain->heirs[i]);
+		free(chain->heirs);
+	}
+	free(chain->sealed);
 	chain->heirs = NULL;
+	chain->sealed = NULL;
 	chain->max_size = 0;
 	chain->height = -1;
 	
-	tdestroy(chain->search_root, no_free);
-	chain->search_root = NULL;
+	blockchain_hash_index_cleanup(chain->hash_index);
 	
 	pthread_mutex_destroy(&chain->mutex);
 	return;
 }
-static const blockchain_heir_t * blockchain_find(blockchain_t * chain, const uint256_t * hash)
-{
-	void ** p_node = tfind(hash, &chain->search_root, blockchain_heir_compare);
-
-	if(p_node) return *p_node;
-	return NULL;
-}
-
-static block_info_t * active_chain_list_find(active_chain_list_t * list, const uint256_t * hash)
+static const blockchain_heir_t * blockchain_find(blockchain_t * chain, const uint256_t * hash)
 {
-	void ** p_node = tfind(hash, &list->search_root, blockchain_heir_compare);
-	if(p_node) return *p_node;
-	
-	return NULL;
+	ssize_t height = blockchain_hash_index_find(chain, hash);
+	if(height < 0) return NULL;
+	return blockchain_heirs_at(chain->heirs, height);
 }
 
-static inline active_chain_t * get_current_chain(block_info_t * parent)
+static block_info_t * active_chain_list_find(active_chain_list_t * list, const uint256_t * hash)
 {
-	if(NULL == parent) return NULL;
-	
-	while(parent->parent) parent = parent->parent;
-	return (active_chain_t *)parent;
+	return active_chain_index_find(list->index, hash);
 }
 
-
 static int abandon_siblings(block_info_t * successor, active_chain_list_t * list);
+static void abandon_brothers(block_info_t * successor, active_chain_list_t * list);
 
-static void update_first_child_cumulative_difficulty(block_info_t * child, double cumulative_difficulty)
+static block_info_t * block_info_new_from_header(const uint256_t * hash, const struct satoshi_block_header * hdr)
 {
-	while(child)
-	{
-		double difficulty = compact_uint256_to_bdiff((compact_uint256_t *)&child->hdr->bits);
-		cumulative_difficulty += difficulty;
-		child->cumulative_difficulty = cumulative_difficulty;
-		child = child->first_child;
-	}
-	return;
+	block_info_t * node = block_info_new(hash, NULL);
+	assert(node);
+	memcpy(node->hdr, hdr, sizeof(*hdr));
+	
+	uint256_u64_work_from_compact(&node->work, hdr->bits);
+	node->best_work = node->work;
+	return node;
 }
 
 #define AUTO_UNLOCK_MUTEX_PTR __attribute__((cleanup(auto_unlock_mutex_ptr)))
@@ -478,17 +1141,22 @@ static void auto_unlock_mutex_ptr(void * ptr)
 		*(pthread_mutex_t **)ptr = NULL;
 	}
 }
+static int blockchain_add_locked(blockchain_t * block_chain, const uint256_t * block_hash, const struct satoshi_block_header * hdr, int peer_id);
 static int blockchain_add(blockchain_t * block_chain, 
 	const uint256_t * block_hash, 
 	const struct satoshi_block_header * hdr)
+{
+	return blockchain_add_from_peer(block_chain, block_hash, hdr, -1);
+}
+
+int blockchain_add_from_peer(blockchain_t * block_chain, 
+	const uint256_t * block_hash, 
+	const struct satoshi_block_header * hdr,
+	int peer_id)
 {
 	assert(hdr);
-	debug_printf("\n========== hdr.nonce: %d ==========", (int)hdr->nonce);
-	
 	
-	AUTO_UNLOCK_MUTEX_PTR pthread_mutex_t * p_mutex = &block_chain->mutex;
-	pthread_mutex_lock(p_mutex);
-
+	// hash the header before taking the lock
 	unsigned char hash[32];
 	hash256(hdr, sizeof(*hdr), hash);
 	
@@ -497,11 +1165,77 @@ static int blockchain_add(blockchain_t * block_chain,
 		assert(0 == memcmp(hash, block_hash, sizeof(uint256_t)));
 	}
 	
+	AUTO_UNLOCK_MUTEX_PTR pthread_mutex_t * p_mutex = &block_chain->mutex;
+	pthread_mutex_lock(p_mutex);
+	return blockchain_add_locked(block_chain, block_hash, hdr, peer_id);
+}
+
+/**
+ * claim_waiting_chain():
+ *   a node which has just joined the chains-list (e.g. an abandoned heir) 
+ *   claims the children of the chain who is waiting for him, the same as the chain's sub-rule.
+ */
+static void claim_waiting_chain(active_chain_list_t * list, block_info_t * node)
+{
+	block_info_t * head = active_chain_index_find_head(list->index, &node->hash);
+	if(NULL == head) return;
+	
+	list->index_remove(list, head);
+	block_info_t * child = head->first_child;
+	head->first_child = NULL;
+	while(child) {
+		block_info_t * next = child->next_sibling;
+		child->next_sibling = NULL;
+		block_info_add_child(node, child);
+		child = next;
+	}
+	list->remove(list, (active_chain_t *)head);
+}
+
+/**
+ * find_heaviest_candidate():
+ *   find the chain which is connected to the main chain (at 'min_height' or above) 
+ *   and has more work than the tip.
+ */
+static active_chain_t * find_heaviest_candidate(blockchain_t * block_chain, ssize_t min_height, ssize_t * p_parent_height)
+{
+	active_chain_list_t * list = block_chain->candidates_list;
+	active_chain_t * best = NULL;
+	uint256_u64_t best_work = blockchain_heirs_at(block_chain->heirs, block_chain->height)->chainwork;
+	
+	for(ssize_t i = 0; i < list->count; ++i)
+	{
+		active_chain_t * chain = list->chains[i];
+		ssize_t height = blockchain_hash_index_find(block_chain, &chain->head->hash);
+		if(height < min_height) continue;
+		
+		uint256_u64_t chainwork;
+		uint256_u64_add(&chainwork, &blockchain_heirs_at(block_chain->heirs, height)->chainwork, &chain->head->best_work);
+		if(uint256_u64_compare(&chainwork, &best_work) > 0) {
+			best = chain;
+			best_work = chainwork;
+			*p_parent_height = height;
+		}
+	}
+	return best;
+}
+
+/**
+ * blockchain_add_locked():
+ *   the caller must hold the lock, and 'block_hash' must be the hash of 'hdr'.
+ */
+static int blockchain_add_locked(blockchain_t * block_chain, 
+	const uint256_t * block_hash, 
+	const struct satoshi_block_header * hdr,
+	int peer_id)
+{
+	assert(block_hash && hdr);
+	debug_printf("\n========== hdr.nonce: %d ==========", (int)hdr->nonce);
+	
 	active_chain_list_t * list = block_chain->candidates_list;
 	const blockchain_heir_t * heir = NULL;
 	block_info_t * orphan = NULL;
 	active_chain_t * chain = NULL;
-	block_info_t * longest_end = NULL;
 	block_info_t * parent = NULL;
 	
 	// Rule 0. check if it is already on the chain
@@ -514,13 +1248,36 @@ static int blockchain_add(blockchain_t * block_chain,
 		///@>
 		return -1;	// already on the BLOCKCHAIN
 	}
+	
+	// not invalid forever, but can not be accepted now (nor kept in the orphan pool)
+	if((int64_t)hdr->timestamp > (int64_t)time(NULL) + MAX_FUTURE_BLOCK_TIME) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): time-too-new: timestamp=%u." "\e[39m" "\n", 
+			__FILE__, __LINE__, hdr->timestamp);
+		return -1;
+	}
+	
+	// make room for the new node (and drop the expired chains) before looking up the orphan pool
+	active_chain_list_evict(list, time(NULL));
 
 	orphan = active_chain_list_find(list, block_hash);
+	
+	// a disconnected header which nobody is waiting for, check the peer's quota
+	if(NULL == orphan && peer_id >= 0 && list->max_bytes_per_peer > 0
+		&& blockchain_hash_index_find(block_chain, hdr->prev_hash) < 0)
+	{
+		const struct active_chain_peer_usage * usage = active_chain_list_get_peer_usage(list, peer_id);
+		if(usage && (usage->bytes + (ssize_t)ACTIVE_CHAIN_NODE_SIZE) > list->max_bytes_per_peer) {
+			++((struct active_chain_peer_usage *)usage)->num_rejected;
+			if(list->on_peer_over_quota) list->on_peer_over_quota(list, peer_id, list->user_data);
+			return -1;
+		}
+	}
+	
 	if(orphan){
 		// check chain's sub-rule
 		if(orphan->parent != NULL) return -1;
 		
-		printf("\e[32m" "--> [%s]: " "\e[39m" "\n", "CHAIN::sub-rules");
+		debug_printf("--> [%s]", "CHAIN::sub-rules");
 	
 		/**
 		 * orphan is the 'head' of an active_chain, 
@@ -530,22 +1287,20 @@ static int blockchain_add(blockchain_t * block_chain,
 		block_info_t * head = orphan;
 		chain = (active_chain_t *)head;
 		
-		// First, remove the head->hash from the search-root.
-		list->search_tree_remove(list, head);
+		// First, remove the head->hash from the index.
+		list->index_remove(list, head);
 		
 		// create a new node
-		orphan = block_info_new(block_hash, NULL);
-		assert(orphan);
-		memcpy(orphan->hdr, hdr, sizeof(*hdr));
+		orphan = block_info_new_from_header(block_hash, hdr);
+		orphan->peer_id = peer_id;
 		
-		// and claim the children on the chain
-		block_info_t * child = head->first_child;
-		while(child) {
-			block_info_add_child(orphan, child);
-			child = child->next_sibling;
+		// and claim the children on the chain, 
+		// the cached best descendants are relative to each node, only the new parent needs to be updated.
+		orphan->first_child = head->first_child;
+		for(block_info_t * child = orphan->first_child; child; child = child->next_sibling) {
+			child->parent = orphan;
 		}
-		
-		block_info_update_cumulative_difficulty(orphan, 0.0, NULL);
+		block_info_update_best(orphan);
 		
 		// delete the chain from the list.
 		chain->head->first_child = NULL;
@@ -554,72 +1309,99 @@ static int blockchain_add(blockchain_t * block_chain,
 	
 	// create a new node if chain's sub-rule is not executed
 	if(NULL == orphan) {
-		orphan = block_info_new(block_hash, NULL);
-		assert(orphan);
-		memcpy(orphan->hdr, hdr, sizeof(*hdr));
+		orphan = block_info_new_from_header(block_hash, hdr);
+		orphan->peer_id = peer_id;
 	}
 
-	list->search_tree_add(list, orphan);
+	list->index_add(list, orphan);
 	
 	// Rule I. find parent in the active_chain_list
 	
-	printf("\e[32m" "--> [%s]: " "\e[39m" "\n", "Rule I");
+	debug_printf("--> [%s]", "Rule I");
 	parent = active_chain_list_find(list, orphan->hdr->prev_hash);
 	if(parent) { // Rule II.
 		
-		printf("\e[32m" "--> [%s]: " "\e[39m" "\n", "Rule II");
-		
-		chain = get_current_chain(parent);
-		assert(chain);
+		debug_printf("--> [%s]", "Rule II");
 		
 		block_info_add_child(parent, orphan);
-		block_info_update_cumulative_difficulty(orphan, parent->cumulative_difficulty, &longest_end);
-	
-		// update chain's longest_end
-		if(longest_end != chain->longest_end)
-		{
-			block_info_declare_inheritance(longest_end);
-			chain->longest_end = longest_end;
-		}
+		if(parent->height >= 0) block_info_link(orphan);	// (and the children claimed by the orphan)
+		
+		// refresh the cached best descendants along the path (and move the heaviest branches to the first place), 
+		// the root of the path is the 'head' of the chain.
+		chain = (active_chain_t *)block_info_refresh_ancestors(parent);
+		assert(chain);
+		chain->longest_end = chain->head->best_descendant;
+		active_chain_list_touch(list, chain);
 	}else { // Rule III.
-		printf("\e[32m" "--> [%s]: " "\e[39m" "\n", "Rule III");
+		debug_printf("--> [%s]", "Rule III");
 		
-		chain = active_chain_new(orphan, NULL);
+		chain = active_chain_new(orphan, list);
 		assert(chain);
-		chain->p_search_root = &list->search_root;
 		
-		list->search_tree_add(list, chain->head);
+		list->index_add(list, chain->head);
 		list->add(list, chain);
 		
 		debug_printf("== new chain: %p", chain);
-		
-		// find the longest-end
-		block_info_update_cumulative_difficulty(orphan, 0.0, &chain->longest_end);
 	}
 	
 	
 	assert(chain);
-	longest_end = chain->longest_end;
 	
 	// Rule IV. find parent in the BLOCKCHAIN
-	heir = block_chain->find(block_chain, &chain->head->hash);
-	if(NULL == heir) return 0;
-
-	printf("\e[32m" "--> [%s]: " "\e[39m" "\n", "Rule IV");
-	// update longest_end's cumulative_difficulty 
-	update_first_child_cumulative_difficulty(chain->head->first_child, heir->cumulative_difficulty);
-	blockchain_heir_t * current = &block_chain->heirs[block_chain->height];
-	
-	dump_line("chain::difficuty   : ", &chain->longest_end->cumulative_difficulty, 32);
-	dump_line("current::difficulty: ", & current->cumulative_difficulty, 32);
-	
-	if(chain->longest_end->cumulative_difficulty > current->cumulative_difficulty) // win the round. 
+	ssize_t parent_height = blockchain_hash_index_find(block_chain, &chain->head->hash);
+	if(parent_height < 0) return 0;
+
+	debug_printf("--> [%s]", "Rule IV");
+	if(chain->head->height < 0) { // connected to the BLOCKCHAIN for the first time, the heights are known now
+		chain->head->height = (int)parent_height;
+		for(block_info_t * child = chain->head->first_child; child; child = child->next_sibling) {
+			block_info_link(child);
+		}
+	}
+	/**
+	 * the main chain only changes here, the headers are validated against their ancestors when appended.
+	 * if a header fails, he and his offsprings are cut off, 
+	 * then the heaviest branch (may be the abandoned one) is reselected until nobody wins.
+	 */
+	int num_invalid = 0;
+	while(chain)
 	{
-		// replace the current one
-		block_info_t * orphans = blockchain_abandon_inheritances(block_chain, (blockchain_heir_t *)heir);
+		heir = blockchain_heirs_at(block_chain->heirs, parent_height);
+		
+		// longest_end's chainwork 
+		uint256_u64_t chainwork;
+		uint256_u64_add(&chainwork, &heir->chainwork, &chain->head->best_work);
+		const blockchain_heir_t * current = blockchain_heirs_at(block_chain->heirs, block_chain->height);
+		
+		debug_dump_line("chain::chainwork   : ", &chainwork, 32);
+		debug_dump_line("current::chainwork : ", &current->chainwork, 32);
+		
+		if(uint256_u64_compare(&chainwork, &current->chainwork) <= 0) break;
+		
+		// win the round, replace the current one
+		block_info_t * orphans = blockchain_abandon_inheritances(block_chain, parent_height);
 		block_info_t * successor = chain->head->first_child;
 		
-		blockchain_add_inheritances(block_chain, (blockchain_heir_t *)heir, successor);
+		block_info_t * invalid = blockchain_add_inheritances(block_chain, parent_height, successor);
+		blockchain_publish(block_chain);	// make the new main chain visible to the snapshots
+		
+		if(invalid) {
+			++num_invalid;
+			
+			// his brothers are still candidates
+			block_info_t * prev = invalid->parent;
+			assert(prev && prev->first_child == invalid);
+			if(invalid == successor) {
+				prev->first_child = invalid->next_sibling;
+				successor = NULL;
+			}else {
+				abandon_brothers(invalid, list);
+				prev->first_child = NULL;
+			}
+			invalid->next_sibling = NULL;
+			invalid->parent = NULL;
+			block_info_free_nodes(invalid, list);
+		}
 		
 		/**
 		 * forget the successor and all his first-child, 
@@ -629,82 +1411,311 @@ static int blockchain_add(blockchain_t * block_chain,
 		 * those orphans shoud establish a new chain of their own.
 		 */
 		
-		// remove all first_child nodes from the search-tree
-		block_info_t * child = successor->first_child;
-		while(child)	
-		{
-			list->search_tree_remove(list, child);
-			child = child->first_child;
-		} 
+		// remove the successor and all his first_child nodes from the index
+		for(block_info_t * child = successor; child; child = child->first_child) {
+			list->index_remove(list, child);
+		}
 		
 		// leave the current chain (swap positions with the orphan or the next_sibling)
+		block_info_t * siblings = chain->head->first_child;
+		if(successor) {
+			siblings = successor->next_sibling;
+			successor->next_sibling = NULL;
+		}
 		if(orphans) {
-			// join the orphan's family to the search-tree
-			search_tree_traverse_BFS(&list->search_root, traverse_action_type_add, orphans);
+			// join the orphan's family (a single branch) to the index
+			for(block_info_t * child = orphans; child; child = child->first_child) {
+				list->index_add(list, child);
+			}
 			
 			// claim siblings
-			orphans->next_sibling = successor->next_sibling;
-			chain->head->first_child = orphans;
-		}else {
-			chain->head->first_child = successor->next_sibling;
+			orphans->parent = chain->head;
+			orphans->next_sibling = siblings;
+			siblings = orphans;
+			
+			// the chains waiting for the abandoned heirs join them
+			block_info_t * last = orphans;
+			for(block_info_t * child = orphans, * next = NULL; child; child = next) {
+				next = child->first_child;
+				claim_waiting_chain(list, child);
+				last = child;
+			}
+			block_info_link(orphans);
+			block_info_refresh_ancestors(last);
 		}
+		chain->head->first_child = siblings;
 		
-		// tell the first-child discard his siblings. 
-		abandon_siblings(successor->first_child, list);
-		
-		// destroy old identities
-		tdelete(successor, &list->search_root, blockchain_heir_compare);
-		block_info_free(successor);
+		if(successor) {
+			// tell the first-child discard his siblings. 
+			abandon_siblings(successor->first_child, list);
+			
+			// destroy old identities
+			block_info_free(successor);
+		}
 		
 		if(NULL == chain->head->first_child) { // all children have left home
 			
 			debug_printf("== remove chain: %p", chain);
-			list->remove(list, chain);	
+			list->remove(list, chain);
+			chain = NULL;
+		}else {
+			block_info_update_best(chain->head);
+			chain->longest_end = chain->head->best_descendant;
+			active_chain_list_touch(list, chain);
 		}
+		if(NULL == invalid) break;
+		
+		// the truncated branch may lose to any other branch connected to it
+		chain = find_heaviest_candidate(block_chain, parent_height, &parent_height);
 	}
-
+	
+	// the new header has been cut off
+	if(num_invalid > 0 
+		&& blockchain_hash_index_find(block_chain, block_hash) < 0 
+		&& NULL == active_chain_list_find(list, block_hash)) return -1;
 	return 0;
 }
 
-static int abandon_siblings(block_info_t * successor, active_chain_list_t * list)
+/***********************************************************************
+ * blockchain_add_batch
+ **********************************************************************/
+#define BLOCKCHAIN_BATCH_MAX_THREADS	(8)
+#define BLOCKCHAIN_BATCH_MIN_HEADERS_PER_THREAD	(256)
+
+struct batch_verify_context
+{
+	pthread_t th;
+	int started;
+	const struct satoshi_block_header * hdrs;
+	uint256_t * hashes;
+	ssize_t begin;
+	ssize_t end;
+	ssize_t first_invalid;	// the first header which does not meet its target, or 'end'
+};
+
+static void * batch_verify_thread(void * user_data)
+{
+	struct batch_verify_context * ctx = user_data;
+	ctx->first_invalid = ctx->end;
+	for(ssize_t i = ctx->begin; i < ctx->end; ++i)
+	{
+		hash256(&ctx->hdrs[i], sizeof(ctx->hdrs[i]), (uint8_t *)&ctx->hashes[i]);
+		if(uint256_compare_with_compact(&ctx->hashes[i], (compact_uint256_t *)&ctx->hdrs[i].bits) > 0) {
+			ctx->first_invalid = i;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * batch_verify():
+ *   hash and check proof-of-work of all headers, split into worker threads for large batches.
+ * @return the number of leading headers which are valid.
+ */
+static ssize_t batch_verify(const struct satoshi_block_header * hdrs, uint256_t * hashes, ssize_t count)
 {
-	if(NULL == successor) return 0;
+	struct batch_verify_context contexts[BLOCKCHAIN_BATCH_MAX_THREADS];
+	memset(contexts, 0, sizeof(contexts));
 	
-	// discard his siblings
-	block_info_t * sibling = successor->next_sibling;
+	ssize_t num_threads = count / BLOCKCHAIN_BATCH_MIN_HEADERS_PER_THREAD;
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_threads > num_cpus) num_threads = num_cpus;
+	if(num_threads > BLOCKCHAIN_BATCH_MAX_THREADS) num_threads = BLOCKCHAIN_BATCH_MAX_THREADS;
+	if(num_threads < 1) num_threads = 1;
 	
-	/**
-	 * his next_sibling will lead all other brothers to a new chain.
-	 * do not set new chain's search-root pointer when creating,
-	 * all nodes are already in the search-tree,
-	 * just add the new chain's 'head' only.
-	 */
-	if(sibling)
+	ssize_t per_thread = (count + num_threads - 1) / num_threads;
+	for(ssize_t i = 0; i < num_threads; ++i) 
 	{
-		active_chain_t * chain = active_chain_new(sibling, NULL);
-		assert(chain);
-		tsearch(chain->head, &list->search_root, blockchain_heir_compare); 
+		struct batch_verify_context * ctx = &contexts[i];
+		ctx->hdrs = hdrs;
+		ctx->hashes = hashes;
+		ctx->begin = i * per_thread;
+		ctx->end = ctx->begin + per_thread;
+		if(ctx->end > count) ctx->end = count;
 		
-		chain->p_search_root = &list->search_root;
-		list->add(list, chain);
+		// the current thread takes the first part
+		if(i > 0) ctx->started = (0 == pthread_create(&ctx->th, NULL, batch_verify_thread, ctx));
+	}
+	
+	ssize_t num_valid = count;
+	for(ssize_t i = 0; i < num_threads; ++i) 
+	{
+		struct batch_verify_context * ctx = &contexts[i];
+		if(ctx->started) pthread_join(ctx->th, NULL);
+		else batch_verify_thread(ctx);
+		
+		if(ctx->first_invalid < ctx->end && ctx->first_invalid < num_valid) num_valid = ctx->first_invalid;
+	}
+	return num_valid;
+}
+
+/**
+ * batch_check_linkage():
+ *   check all prev_hash fields in one pass (no dependency between iterations)
+ * @return the length of the leading run in which each header is the child of its predecessor
+ */
+static ssize_t batch_check_linkage(const struct satoshi_block_header * hdrs, const uint256_t * hashes, ssize_t count)
+{
+	for(ssize_t i = 1; i < count; ++i)
+	{
+		if(memcmp(hdrs[i].prev_hash, &hashes[i - 1], sizeof(uint256_t))) return i;
+	}
+	return count;
+}
+
+ssize_t blockchain_add_batch(blockchain_t * chain, const struct satoshi_block_header * hdrs, ssize_t count)
+{
+	return blockchain_add_batch_from_peer(chain, hdrs, count, -1);
+}
+
+ssize_t blockchain_add_batch_from_peer(blockchain_t * chain, const struct satoshi_block_header * hdrs, ssize_t count, int peer_id)
+{
+	assert(chain && hdrs);
+	if(count <= 0) return 0;
+	
+	uint256_t * hashes = malloc(count * sizeof(*hashes));
+	assert(hashes);
+	
+	ssize_t num_valid = batch_verify(hdrs, hashes, count);
+	if(num_valid < count) {
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): proof-of-work check failed at header %ld/%ld." "\e[39m" "\n", 
+			__FILE__, __LINE__, (long)num_valid, (long)count);
+	}
+	ssize_t num_linked = batch_check_linkage(hdrs, hashes, num_valid);
+	
+	pthread_mutex_lock(&chain->mutex);
+	
+	// fast path: append the run which extends the current tip
+	ssize_t i = 0;
+	if(num_linked > 0 && chain->height >= 0
+		&& 0 == memcmp(hdrs[0].prev_hash, blockchain_heirs_at(chain->heirs, chain->height)->hash, sizeof(uint256_t)))
+	{
+		int64_t now = time(NULL);
+		for(; i < num_linked; ++i)
+		{
+			// the header is known by the candidates (e.g. the missing parent of some orphans), let add() handle it.
+			if(active_chain_list_find(chain->candidates_list, &hashes[i])) break;
+			
+			// the median-time-past window and the retarget cache make this O(1) per header
+			if(check_header_context(chain, chain->height, &hdrs[i], now)) {
+				num_valid = i;
+				break;
+			}
+			
+			ssize_t height = append_heir(chain, chain->height, &hashes[i], &hdrs[i]);
+			chain->height = height;
+			if(chain->on_add_block) {
+				chain->on_add_block(chain, &hashes[i], height, &hdrs[i], chain->user_data);
+			}
+		}
+		if(i > 0) blockchain_publish(chain);
+	}
+	
+	// out-of-order or forking headers
+	for(; i < num_valid; ++i)
+	{
+		if(blockchain_add_locked(chain, &hashes[i], &hdrs[i], peer_id)) break;
 	}
 	
+	pthread_mutex_unlock(&chain->mutex);
+	free(hashes);
+	return i;
+}
+
+/**
+ * abandon_brothers():
+ *   the next_sibling of 'successor' will lead all other brothers to a new chain.
+ */
+static void abandon_brothers(block_info_t * successor, active_chain_list_t * list)
+{
+	block_info_t * sibling = successor->next_sibling;
+	if(NULL == sibling) return;
+	
 	// no more brothers
 	successor->next_sibling = NULL;
 	
-	// tell his first-child to do the same thing
-	return abandon_siblings(successor->first_child, list);	// tail-recursion, no need to optimize
+	/**
+	 * all nodes are already in the index,
+	 * just add the new chain's 'head' only.
+	 */
+	active_chain_t * chain = active_chain_new(sibling, list);
+	assert(chain);
+	
+	// the skip pointers may point to the successors, which are leaving
+	// (the heaviest brother has been moved to the first place)
+	chain->head->height = successor->height - 1;
+	for(block_info_t * child = chain->head->first_child; child; child = child->next_sibling) {
+		block_info_link(child);
+	}
+	
+	list->index_add(list, chain->head);
+	list->add(list, chain);
+}
+
+static int abandon_siblings(block_info_t * successor, active_chain_list_t * list)
+{
+	// walk down the first-child path, a long branch can not be handled by recursion
+	for(; successor; successor = successor->first_child)
+	{
+		// discard his siblings
+		abandon_brothers(successor, list);
+	}
+	return 0;
 }
 
 
 static const blockchain_heir_t * blockchain_get(blockchain_t * chain, ssize_t height)
 {
-	return NULL;
+	if(height < 0 || height > chain->height) return NULL;
+	return blockchain_heirs_at(chain->heirs, height);
 }
 
 static ssize_t blockchain_get_height(blockchain_t * chain, const uint256_t * hash)
 {
-	return -1;
+	return blockchain_hash_index_find(chain, hash);
+}
+
+static ssize_t find_fork_point_locked(blockchain_t * chain, const uint256_t * hash)
+{
+	ssize_t height = blockchain_hash_index_find(chain, hash);
+	while(height < 0)
+	{
+		block_info_t * node = active_chain_list_find(chain->candidates_list, hash);
+		if(NULL == node || node->height < 0) break;	// unknown, or not connected to the BLOCKCHAIN
+		
+		/**
+		 * the 'head' of the branch is the fork-point, 
+		 * unless it has left the main chain after a reorg, then it is an orphan (at a lower height) on another chain.
+		 */
+		block_info_t * head = block_info_walk_to(node, -1);
+		if(head == node) break;
+		hash = &head->hash;
+		height = blockchain_hash_index_find(chain, hash);
+	}
+	return height;
+}
+
+ssize_t blockchain_find_fork_point(blockchain_t * chain, const uint256_t * hash)
+{
+	assert(chain && hash);
+	pthread_mutex_lock(&chain->mutex);
+	ssize_t height = find_fork_point_locked(chain, hash);
+	pthread_mutex_unlock(&chain->mutex);
+	return height;
+}
+
+ssize_t blockchain_locate(blockchain_t * chain, const uint256_t * locator, ssize_t count)
+{
+	assert(chain && (count <= 0 || locator));
+	ssize_t height = -1;
+	
+	pthread_mutex_lock(&chain->mutex);
+	for(ssize_t i = 0; i < count && height < 0; ++i) {
+		height = find_fork_point_locked(chain, &locator[i]);
+	}
+	pthread_mutex_unlock(&chain->mutex);
+	return height;
 }
 
 
@@ -727,27 +1738,42 @@ block_info_t * block_info_new(const uint256_t * hash, struct satoshi_block_heade
 	
 	info->hdr = hdr;
 	info->height = -1;
+	info->best_descendant = info;
+	info->peer_id = -1;
 	return info;
 }
 
-void block_info_free(block_info_t * info)
+/**
+ * block_info_free_nodes():
+ *   free the node, all his siblings and offsprings, and remove them from the list's index (nullable).
+ *   (iterative: the children are spliced into the sibling list before the parent is freed)
+ */
+static void block_info_free_nodes(block_info_t * info, active_chain_list_t * list)
 {
-	if(NULL == info) return;
-	
-	if(info->next_sibling) {
-		block_info_free(info->next_sibling);
-		info->next_sibling = NULL;
-	}
-	
-	if(info->first_child) {
-		block_info_free(info->first_child);
-		info->first_child = NULL;
-	}
-	
-	if(info->hdr_free) {
-		info->hdr_free(info->hdr);
+	while(info)
+	{
+		block_info_t * child = info->first_child;
+		if(child) {
+			block_info_t * last = child;
+			while(last->next_sibling) last = last->next_sibling;
+			last->next_sibling = info->next_sibling;
+			info->next_sibling = child;
+			info->first_child = NULL;
+		}
+		
+		block_info_t * next = info->next_sibling;
+		if(list) active_chain_list_unindex(list, info);
+		if(info->hdr_free) {
+			info->hdr_free(info->hdr);
+		}
+		free(info);
+		info = next;
 	}
-	free(info);
+}
+
+void block_info_free(block_info_t * info)
+{
+	block_info_free_nodes(info, NULL);
 }
 
 int block_info_add_child(block_info_t * parent, block_info_t * child)
@@ -848,122 +1874,192 @@ void clib_queue_cleanup(struct clib_queue * queue)
 	return;
 }
 
-int block_info_update_cumulative_difficulty(
-	block_info_t * node, // current node
-	double cumulative_difficulty,	// parent's cumulative_difficulty
-	block_info_t ** p_longest_offspring			// the child who currently at the end of the longest-chain  
-)
+/**
+ * block_info_update_best():
+ *   recalculate the cached best descendant from the direct children (not recursive),
+ *   and move the heaviest child to the first place.
+ */
+static void block_info_update_best(block_info_t * node)
+{
+	assert(node);
+	block_info_t * best = node->first_child;
+	block_info_t * prev_of_best = NULL;
+	
+	if(NULL == best) {
+		node->best_work = node->work;
+		node->best_descendant = node;
+		return;
+	}
+	
+	for(block_info_t * prev = best, * child = best->next_sibling; child; prev = child, child = child->next_sibling)
+	{
+		if(uint256_u64_compare(&child->best_work, &best->best_work) > 0) {
+			best = child;
+			prev_of_best = prev;
+		}
+	}
+	
+	if(prev_of_best) { // jump to first place
+		prev_of_best->next_sibling = best->next_sibling;
+		best->next_sibling = node->first_child;
+		node->first_child = best;
+	}
+	
+	uint256_u64_add(&node->best_work, &node->work, &best->best_work);
+	node->best_descendant = best->best_descendant;
+}
+
+/**
+ * block_info_refresh_ancestors():
+ *   update the cached best descendants from 'node' up to the root, 
+ *   the cost is proportional to the length of the path (and the siblings on it), not the size of the tree.
+ * @return the root, which is the 'head' of the chain if the node is on an active_chain.
+ */
+static block_info_t * block_info_refresh_ancestors(block_info_t * node)
+{
+	assert(node);
+	while(1) {
+		block_info_update_best(node);
+		if(NULL == node->parent) break;
+		node = node->parent;
+	}
+	return node;
+}
+
+/**
+ * skip pointers (the same layout as the reference client's CBlockIndex::pskip)
+ */
+static inline int invert_lowest_one(int n) { return n & (n - 1); }
+static inline int get_skip_height(int height)
+{
+	if(height < 2) return 0;
+	
+	// any number strictly lower than height is acceptable, 
+	// but the following expression seems to perform well in simulations (max 110 steps to go back up to 2**18 blocks).
+	return (height & 1)?(invert_lowest_one(invert_lowest_one(height - 1)) + 1):invert_lowest_one(height);
+}
+
+/**
+ * block_info_walk_to():
+ *   walk down to 'height' through the skip pointers, 
+ *   stops at the 'head' of the chain if 'height' is below it.
+ */
+static block_info_t * block_info_walk_to(block_info_t * node, int height)
+{
+	assert(node && node->height >= 0);
+	while(node->height > height && node->parent)
+	{
+		block_info_t * skip = node->pskip;
+		int height_skip = skip?skip->height:-1;
+		int height_skip_prev = get_skip_height(node->height - 1);
+		
+		// only follow the skip pointer if the parent's skip pointer is not better
+		if(skip && (height_skip == height 
+			|| (height_skip > height && !(height_skip_prev < height_skip - 2 && height_skip_prev >= height))))
+		{
+			node = skip;
+		}else {
+			node = node->parent;
+		}
+	}
+	return node;
+}
+
+block_info_t * block_info_get_ancestor(block_info_t * node, int height)
 {
-	if(NULL == node) return -1;
-	
-	// update current node's cumulative_difficulty
-	double difficulty = compact_uint256_to_difficulty((compact_uint256_t *)&node->hdr->bits);
-	node->cumulative_difficulty = cumulative_difficulty + difficulty;
+	if(NULL == node || node->height < 0 || height < 0 || height > node->height) return NULL;
+	node = block_info_walk_to(node, height);
+	return (node->height == height)?node:NULL;
+}
+
+block_info_t * block_info_find_fork(block_info_t * a, block_info_t * b)
+{
+	if(NULL == a || NULL == b || a->height < 0 || b->height < 0) return NULL;
 	
-	if(p_longest_offspring)	// if need to declare the winner at the same time 
-	{
-		block_info_t * heir = *p_longest_offspring;
-		if(NULL == heir || (node->cumulative_difficulty > heir->cumulative_difficulty)) {
-			*p_longest_offspring = node;
-		}
-	} 
+	block_info_t * root = block_info_walk_to(a, -1);
+	if(root != block_info_walk_to(b, -1)) return NULL;	// not on the same chain
 	
-	// update first-child
-	block_info_update_cumulative_difficulty(node->first_child, node->cumulative_difficulty, p_longest_offspring);
+	int high = (a->height < b->height)?a->height:b->height;
+	a = block_info_walk_to(a, high);
+	b = block_info_walk_to(b, high);
+	if(a == b) return a;
 	
-	// update all siblings's cumulative_difficulty
-	block_info_t * sibling = node->next_sibling;
-	while(sibling)
+	// binary search: the ancestors at 'low' are the same, and at 'high' are different.
+	int low = root->height;
+	while(high - low > 1)
 	{
-		block_info_update_cumulative_difficulty(sibling, cumulative_difficulty, p_longest_offspring);
-		sibling = sibling->next_sibling;
+		int mid = low + (high - low) / 2;
+		if(block_info_walk_to(a, mid) == block_info_walk_to(b, mid)) low = mid;
+		else high = mid;
 	}
-	return 0;
+	return block_info_walk_to(a, low);
 }
 
-int block_info_declare_inheritance(block_info_t * heir)
+/**
+ * block_info_link():
+ *   set the heights and skip pointers of the node and all his offsprings, 
+ *   the parent's height must be known. (iterative, preorder: the parent is always linked before the children)
+ */
+static void block_info_link(block_info_t * node)
 {
-	if(NULL == heir || NULL == heir->parent) return 0;
-	block_info_t * parent = heir->parent;
-		
-	block_info_t * first_child = parent->first_child;
-	if(first_child != heir)
+	assert(node && node->parent && node->parent->height >= 0);
+	
+	block_info_t * current = node;
+	while(current)
 	{
-		block_info_t * prev = first_child;
-		while(prev && prev->next_sibling != heir) prev = prev->next_sibling;
-		assert(prev);
-		
+		current->height = current->parent->height + 1;
+		current->pskip = block_info_walk_to(current->parent, get_skip_height(current->height));
 		
-		// jump to first place
-		prev->next_sibling = heir->next_sibling;
-		heir->next_sibling = first_child;
-		parent->first_child = heir;
+		if(current->first_child) {
+			current = current->first_child;
+			continue;
+		}
+		while(current != node && NULL == current->next_sibling) current = current->parent;
+		if(current == node) break;
+		current = current->next_sibling;
 	}
-	
-	
-	return block_info_declare_inheritance(parent);	// Tail recursion.
 }
 
-
-active_chain_t * active_chain_new(block_info_t * orphan, void ** p_search_root)
+/**
+ * active_chain_new():
+ *   create a new chain with 'orphan' and all his next_siblings (if any) as the children of the 'head'.
+ *   the nodes are not added to the index, the caller should add the new nodes and the 'head'.
+ */
+active_chain_t * active_chain_new(block_info_t * orphan, struct active_chain_list * list)
 {
 	assert(orphan && orphan->hdr);
 
 	active_chain_t * chain = calloc(1, sizeof(*chain));
 	assert(chain);
-	chain->p_search_root = p_search_root;
+	chain->list = list;
+	chain->list_pos = -1;
 
 	block_info_t * head = chain->head;
+	head->peer_id = -1;
+	head->height = -1;
 
 	memcpy(&head->hash, &orphan->hdr->prev_hash, sizeof(uint256_t));	// save parent hash
 	head->first_child = orphan;
-	orphan->parent = head;
+	for(block_info_t * child = orphan; child; child = child->next_sibling) {
+		child->parent = head;
+	}
 
 	// find the longest-end
-	block_info_t * longest_end = orphan;
-	while(longest_end->first_child) longest_end	= longest_end->first_child;
-	chain->longest_end = longest_end;
-	
-	// add the new orphan and 'head->hash' to the search-root
-	if(p_search_root)
-	{
-		search_tree_traverse_BFS(p_search_root, traverse_action_type_add, head);
-		//~ tsearch(orphan, p_search_root, blockchain_heir_compare);
-		//~ tsearch(head, p_search_root, blockchain_heir_compare);
-	}
+	block_info_update_best(head);
+	chain->longest_end = head->best_descendant;
 	
 	return chain;
 }
 
-static void active_chain_remove_child(block_info_t * parent, void ** p_search_root)
-{
-	if(NULL == parent) return;
-	
-	block_info_t * child = parent->first_child;
-	while(child)
-	{
-		tdelete(child, p_search_root, blockchain_heir_compare);
-		active_chain_remove_child(child, p_search_root);
-		child = child->next_sibling;
-	}
-	return;
-}
-
 void active_chain_free(active_chain_t * chain)
 {
 	if(NULL == chain) return;
 	
-	// remove all children from the tsearch-tree first. 
-	active_chain_remove_child(chain->head, chain->p_search_root);
-	tdelete(chain->head, chain->p_search_root, blockchain_heir_compare);
+	// free all nodes except the 'head', and remove them from the index
+	block_info_free_nodes(chain->head->first_child, chain->list);
+	chain->head->first_child = NULL;
 	
-	// free all nodes except the 'head'
-	block_info_t * child = chain->head->first_child;
-	while(child)
-	{
-		block_info_free(child);
-		child = child->next_sibling;
-	}
+	if(chain->list) active_chain_list_unindex(chain->list, chain->head);
 	free(chain);
 }
 
@@ -973,83 +2069,200 @@ void active_chain_free(active_chain_t * chain)
  ****************************************************************/
 static int active_chain_list_resize(active_chain_list_t * list, ssize_t max_size);
 
-// use a queue to remove recursion. (breadth first)
-typedef void * (*traverse_action_callback)(const void *, void **, int (*)(const void *, const void *));
+/**
+ * active_chain_index:
+ *   nodes are compared by the full hash, and removed by the pointer.
+ *   (the 'head' of a claimed chain and the new parent who claims it share the same hash for a while)
+ */
+#define ACTIVE_CHAIN_INDEX_INIT_SIZE	(1024)
 
-static int search_tree_traverse_BFS(void ** p_search_root, enum traverse_action_type type, block_info_t * node)
+static block_info_t * active_chain_index_find(const struct active_chain_index * index, const uint256_t * hash)
 {
-	assert(node);
-	
-	static traverse_action_callback actions[traverse_action_types_count] = {
-		[traverse_action_type_add] = tsearch,
-		[traverse_action_type_remove] = tdelete,
-	};
-	
-	assert(type >= 0 && type < traverse_action_types_count);
-	traverse_action_callback action = actions[type];
-	
-	struct clib_queue queue[1];
-	memset(queue, 0, sizeof(queue));
-	clib_queue_init(queue, 100);
+	if(NULL == index->slots) return NULL;
 	
-	int rc = queue->enter(queue, node);
-	assert(0 == rc);
+	uint64_t key = hash_index_key(hash);
+	ssize_t mask = index->size - 1;
+	block_info_t * head = NULL;
+	for(ssize_t i = key & mask; index->slots[i].key; i = (i + 1) & mask)
+	{
+		const struct active_chain_index_slot * slot = &index->slots[i];
+		if(slot->key == key && slot->node 
+			&& 0 == memcmp(&slot->node->hash, hash, sizeof(uint256_t))) 
+		{
+			// a block can also be the missing parent ('head') of other chains, prefer the block itself
+			if(slot->node->parent) return slot->node;
+			head = slot->node;
+		}
+	}
+	return head;
+}
+
+/**
+ * active_chain_index_find_head(): 
+ *   find the 'head' of the chain who is waiting for 'hash' (not the block itself).
+ */
+static block_info_t * active_chain_index_find_head(const struct active_chain_index * index, const uint256_t * hash)
+{
+	if(NULL == index->slots) return NULL;
 	
-	while((node = queue->leave(queue)))
+	uint64_t key = hash_index_key(hash);
+	ssize_t mask = index->size - 1;
+	for(ssize_t i = key & mask; index->slots[i].key; i = (i + 1) & mask)
 	{
-		// add or remove node from the search-tree
-		action(node, p_search_root, blockchain_heir_compare);
+		const struct active_chain_index_slot * slot = &index->slots[i];
+		if(slot->key == key && slot->node && NULL == slot->node->parent
+			&& 0 == memcmp(&slot->node->hash, hash, sizeof(uint256_t))) return slot->node;
+	}
+	return NULL;
+}
+
+static void active_chain_index_put(struct active_chain_index * index, uint64_t key, block_info_t * node)
+{
+	struct active_chain_index_slot * slots = index->slots;
+	ssize_t mask = index->size - 1;
+	ssize_t i = key & mask;
+	while(slots[i].key && slots[i].node) i = (i + 1) & mask;
+	
+	if(0 == slots[i].key) ++index->used;	// otherwise, reuse the tombstone
+	slots[i].key = key;
+	slots[i].node = node;
+	++index->count;
+}
+
+static int active_chain_index_add(struct active_chain_index * index, block_info_t * node)
+{
+	assert(node);
+	if((index->used + 1) * 2 > index->size) {
+		// grow if more than 1/4 are alive, otherwise just rebuild to drop the tombstones
+		ssize_t new_size = index->size?index->size:ACTIVE_CHAIN_INDEX_INIT_SIZE;
+		if((index->count + 1) * 4 > new_size) new_size *= 2;
 		
-		// enqueue all siblings
-		block_info_t * sibling = node->next_sibling;
-		while(sibling) {
-			rc = queue->enter(queue, sibling);
-			assert(0 == rc);
-			sibling = sibling->next_sibling;
-		}
+		struct active_chain_index_slot * old_slots = index->slots;
+		ssize_t old_size = index->size;
 		
-		// enqueue child
-		rc = queue->enter(queue, node->first_child);
-		assert(0 == rc);
+		index->slots = calloc(new_size, sizeof(*index->slots));
+		assert(index->slots);
+		index->size = new_size;
+		index->used = 0;
+		index->count = 0;
+		
+		for(ssize_t i = 0; i < old_size; ++i) {
+			if(old_slots[i].key && old_slots[i].node) active_chain_index_put(index, old_slots[i].key, old_slots[i].node);
+		}
+		free(old_slots);
 	}
 	
-	assert(queue->length == 0);
-	clib_queue_cleanup(queue);
+	active_chain_index_put(index, hash_index_key(&node->hash), node);
 	return 0;
 }
 
+static int active_chain_index_remove(struct active_chain_index * index, block_info_t * node)
+{
+	if(NULL == index->slots) return -1;
+	
+	uint64_t key = hash_index_key(&node->hash);
+	ssize_t mask = index->size - 1;
+	for(ssize_t i = key & mask; index->slots[i].key; i = (i + 1) & mask)
+	{
+		if(index->slots[i].node == node) {
+			index->slots[i].node = NULL;	// tombstone
+			--index->count;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void active_chain_index_cleanup(struct active_chain_index * index)
+{
+	free(index->slots);
+	memset(index, 0, sizeof(*index));
+}
+
 static int list_add(active_chain_list_t * list, active_chain_t * chain)
 {
-	assert( (NULL == chain->p_search_root) || (chain->p_search_root == &list->search_root) );
+	assert( (NULL == chain->list) || (chain->list == list) );
 	
 	int rc = active_chain_list_resize(list, list->count + 1);
 	assert(0 == rc);
 
+	chain->list_pos = list->count;
 	list->chains[list->count++] = chain;
-	
-	if(NULL == chain->p_search_root)
-	{
-		chain->p_search_root = &list->search_root;
-		search_tree_traverse_BFS(&list->search_root, traverse_action_type_add, chain->head);
-	}
+	chain->list = list;
+	
+	// the most recently updated
+	chain->lru_prev = list->lru_last;
+	chain->lru_next = NULL;
+	if(list->lru_last) list->lru_last->lru_next = chain;
+	else list->lru_first = chain;
+	list->lru_last = chain;
+	chain->last_update = time(NULL);
 	return 0;
 }
 
+static void lru_unlink(active_chain_list_t * list, active_chain_t * chain)
+{
+	if(chain->lru_prev) chain->lru_prev->lru_next = chain->lru_next;
+	else list->lru_first = chain->lru_next;
+	
+	if(chain->lru_next) chain->lru_next->lru_prev = chain->lru_prev;
+	else list->lru_last = chain->lru_prev;
+	
+	chain->lru_prev = NULL;
+	chain->lru_next = NULL;
+}
+
+static void active_chain_list_touch(active_chain_list_t * list, active_chain_t * chain)
+{
+	chain->last_update = time(NULL);
+	if(chain == list->lru_last) return;
+	
+	lru_unlink(list, chain);
+	chain->lru_prev = list->lru_last;
+	list->lru_last->lru_next = chain;
+	list->lru_last = chain;
+}
+
 static int list_remove(active_chain_list_t * list, active_chain_t * chain)
 {
 	assert(chain);
-	ssize_t i = 0;
-	for(i = 0; i < list->count; ++i)
-	{
-		if(list->chains[i] == chain) {
-			active_chain_free(chain);
-			list->chains[i] = list->chains[--list->count];
-			list->chains[list->count] = NULL;
-			break;
-		}
+	ssize_t pos = chain->list_pos;
+	if(pos < 0 || pos >= list->count || list->chains[pos] != chain) return -1;
+	
+	lru_unlink(list, chain);
+	active_chain_free(chain);
+	
+	if(pos != --list->count) {
+		list->chains[pos] = list->chains[list->count];
+		list->chains[pos]->list_pos = pos;
 	}
+	list->chains[list->count] = NULL;
 	return 0;
 }
+
+/**
+ * active_chain_list_evict(): 
+ *   evict the least recently updated chains, 
+ *   until the pool has room for a new node, and no chains are older than 'max_age'.
+ */
+ssize_t active_chain_list_evict(active_chain_list_t * list, int64_t now)
+{
+	ssize_t num_evicted = 0;
+	while(list->lru_first)
+	{
+		active_chain_t * chain = list->lru_first;
+		int expired = (list->max_age > 0) && (now - chain->last_update) > list->max_age;
+		int over_budget = (list->max_bytes > 0) && (list->bytes_used + (ssize_t)ACTIVE_CHAIN_NODE_SIZE) > list->max_bytes;
+		if(!expired && !over_budget) break;
+		
+		ssize_t bytes_used = list->bytes_used;
+		debug_printf("== evict chain: %p (%s)", chain, expired?"expired":"over budget");
+		list->remove(list, chain);
+		num_evicted += (bytes_used - list->bytes_used) / (ssize_t)ACTIVE_CHAIN_NODE_SIZE;
+	}
+	list->num_evicted += num_evicted;
+	return num_evicted;
+}
  
  
 #define ACTIVE_CHAIN_LIST_ALLOC_SIZE (1024)
@@ -1070,20 +2283,83 @@ static int active_chain_list_resize(active_chain_list_t * list, ssize_t max_size
 	return 0;
 }
 
-static int list_search_tree_remove(struct active_chain_list * list, block_info_t * node)
+/**
+ * per-peer memory usage
+ */
+#define ACTIVE_CHAIN_LIST_PEERS_ALLOC_SIZE	(64)
+static struct active_chain_peer_usage * list_find_peer(const active_chain_list_t * list, int peer_id)
+{
+	for(ssize_t i = 0; i < list->peers_count; ++i) {
+		if(list->peers[i].peer_id == peer_id) return &list->peers[i];
+	}
+	return NULL;
+}
+
+const struct active_chain_peer_usage * active_chain_list_get_peer_usage(const active_chain_list_t * list, int peer_id)
+{
+	return list_find_peer(list, peer_id);
+}
+
+static void list_account(active_chain_list_t * list, const block_info_t * node, int sign)
+{
+	list->bytes_used += sign * (ssize_t)ACTIVE_CHAIN_NODE_SIZE;
+	if(node->peer_id < 0) return;
+	
+	struct active_chain_peer_usage * usage = list_find_peer(list, node->peer_id);
+	if(NULL == usage) {
+		assert(sign > 0);
+		if(list->peers_count >= list->peers_max) {
+			ssize_t new_size = (list->peers_count + ACTIVE_CHAIN_LIST_PEERS_ALLOC_SIZE) / ACTIVE_CHAIN_LIST_PEERS_ALLOC_SIZE * ACTIVE_CHAIN_LIST_PEERS_ALLOC_SIZE;
+			struct active_chain_peer_usage * peers = realloc(list->peers, new_size * sizeof(*peers));
+			assert(peers);
+			list->peers = peers;
+			list->peers_max = new_size;
+		}
+		usage = &list->peers[list->peers_count++];
+		memset(usage, 0, sizeof(*usage));
+		usage->peer_id = node->peer_id;
+	}
+	
+	usage->num_nodes += sign;
+	usage->bytes += sign * (ssize_t)ACTIVE_CHAIN_NODE_SIZE;
+	assert(usage->num_nodes >= 0);
+	if(0 == usage->num_nodes) { // forget the peer
+		*usage = list->peers[--list->peers_count];
+	}
+}
+
+static int active_chain_list_unindex(active_chain_list_t * list, block_info_t * node)
+{
+	int rc = active_chain_index_remove(list->index, node);
+	if(0 == rc) list_account(list, node, -1);
+	return rc;
+}
+
+static int list_index_remove(struct active_chain_list * list, block_info_t * node)
 {
 	debug_printf("node->hash: (0x%.8x...)", htobe32(*(uint32_t *)&node->hash));
-	void * p_parent_node = tdelete(node, &list->search_root, blockchain_heir_compare);
-	assert(p_parent_node);
-	return 0;
+	int rc = active_chain_list_unindex(list, node);
+	assert(0 == rc);
+	return rc;
 }
 
-static int list_search_tree_add(struct active_chain_list * list, block_info_t * node)
+static int list_index_add(struct active_chain_list * list, block_info_t * node)
 {
 	debug_printf("node->hash: (0x%.8x...)", htobe32(*(uint32_t *)&node->hash));
-	block_info_t ** p_node = tsearch(node, &list->search_root, blockchain_heir_compare);
-	assert(p_node && *p_node == node);
-	return 0;
+	int rc = active_chain_index_add(list->index, node);
+	if(0 == rc) list_account(list, node, 1);
+	return rc;
+}
+
+static block_info_t * list_find_node(struct active_chain_list * list, const uint256_t * hash, active_chain_t ** p_chain)
+{
+	block_info_t * node = active_chain_index_find(list->index, hash);
+	if(node && p_chain) {
+		block_info_t * root = node;
+		while(root->parent) root = root->parent;
+		*p_chain = (active_chain_t *)root;
+	}
+	return node;
 }
 
 active_chain_list_t * active_chain_list_init(active_chain_list_t * list, ssize_t max_size, void * user_data)
@@ -1095,8 +2371,13 @@ active_chain_list_t * active_chain_list_init(active_chain_list_t * list, ssize_t
 	list->add = list_add;
 	list->remove = list_remove;
 	
-	list->search_tree_add = list_search_tree_add;
-	list->search_tree_remove = list_search_tree_remove;
+	list->find_node = list_find_node;
+	list->index_add = list_index_add;
+	list->index_remove = list_index_remove;
+	
+	list->max_bytes = ACTIVE_CHAIN_LIST_DEFAULT_MAX_BYTES;
+	list->max_bytes_per_peer = ACTIVE_CHAIN_LIST_DEFAULT_MAX_BYTES_PER_PEER;
+	list->max_age = ACTIVE_CHAIN_LIST_DEFAULT_MAX_AGE;
 	
 	int rc = active_chain_list_resize(list, max_size);
 	assert(0 == rc);
@@ -1115,6 +2396,9 @@ void active_chain_list_reset(active_chain_list_t * list)
 		}
 	}
 	list->count = 0;
+	list->lru_first = NULL;
+	list->lru_last = NULL;
+	assert(0 == list->peers_count);
 	return;
 }
 
@@ -1127,7 +2411,11 @@ void active_chain_list_cleanup(active_chain_list_t * list)
 	list->chains = NULL;
 	list->max_size = 0;
 	
-	tdestroy(list->search_root, free);
+	active_chain_index_cleanup(list->index);
+	
+	free(list->peers);
+	list->peers = NULL;
+	list->peers_max = 0;
 	return;
 }
 
@@ -1153,7 +2441,7 @@ void block_info_dump_BFS(block_info_t * root)
 	{
 		block_info_t * node = queue->leave(queue);
 		printf("\t info.id = %p, parent=%p, ", node, node->parent);
-		dump_line("cumulative_difficulty=", &node->cumulative_difficulty, sizeof(node->cumulative_difficulty));
+		dump_line("best_work=", &node->best_work, sizeof(node->best_work));
 		dump_line("hash: ", &node->hash, 32);
 		if(node->hdr) {
 			dump_line("    prev-hash: ", &node->hdr->prev_hash, 32);
@@ -1211,8 +2499,734 @@ void test_compact_int_arithmetic_operations(void)
 	return ;
 }
 
+void test_blockchain_hash_index(void)
+{
+	const ssize_t num_blocks = 1000000;
+	blockchain_t chain[1];
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, NULL, NULL, NULL);
+	blockchain_resize(chain, num_blocks);
+	
+	// fake hashes
+	srand(10);
+	for(ssize_t height = 1; height < num_blocks; ++height)
+	{
+		uint32_t * p_hash = (uint32_t *)blockchain_heir_mut(chain, height)->hash;
+		for(int i = 0; i < 7; ++i) p_hash[i] = rand();
+		p_hash[7] = 0;	// leading zeros
+		
+		int rc = blockchain_hash_index_add(chain, height);
+		assert(0 == rc);
+		chain->height = height;
+	}
+	assert(chain->hash_index->count == num_blocks);
+	
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	for(ssize_t height = 0; height < num_blocks; ++height)
+	{
+		const blockchain_heir_t * heir = blockchain_heirs_at(chain->heirs, height);
+		assert(chain->get_height(chain, heir->hash) == height);
+		assert(chain->find(chain, heir->hash) == heir);
+	}
+	double time_elapsed = app_timer_stop(timer);
+	printf("%s(): %ld lookups, time_elapsed: %.6f s\n", __FUNCTION__, (long)num_blocks, time_elapsed);
+	
+	// reorganization: remove the last 100 blocks, and add them again 
+	for(ssize_t height = num_blocks - 1; height >= num_blocks - 100; --height) {
+		const uint256_t * hash = blockchain_heirs_at(chain->heirs, height)->hash;
+		int rc = blockchain_hash_index_remove(chain, hash);
+		assert(0 == rc);
+		chain->height = height - 1;
+		assert(chain->get_height(chain, hash) == -1);
+	}
+	for(ssize_t height = num_blocks - 100; height < num_blocks; ++height) {
+		blockchain_hash_index_add(chain, height);
+		chain->height = height;
+		assert(chain->get_height(chain, blockchain_heirs_at(chain->heirs, height)->hash) == height);
+	}
+	assert(chain->hash_index->count == num_blocks);
+	
+	uint256_t unknown_hash;
+	memset(&unknown_hash, 0xff, sizeof(unknown_hash));
+	assert(NULL == chain->find(chain, &unknown_hash));
+	
+	blockchain_cleanup(chain);
+}
+
+/**
+ * fake heirs for the snapshot tests: 
+ *   hash = { random key (8 bytes), height (8 bytes), generation (8 bytes), 0 }
+ */
+static void fake_heir_set(blockchain_t * chain, ssize_t height, int64_t generation, uint64_t * p_seed)
+{
+	blockchain_heir_t * heir = blockchain_heir_mut(chain, height);
+	uint64_t * p_hash = (uint64_t *)heir->hash;
+	
+	*p_seed = *p_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	p_hash[0] = *p_seed;
+	p_hash[1] = height;
+	p_hash[2] = generation;
+	p_hash[3] = 0;
+	
+	int rc = blockchain_hash_index_add(chain, height);
+	assert(0 == rc);
+	chain->height = height;
+}
+
+static void fake_chain_reorg(blockchain_t * chain, ssize_t depth, int64_t generation, uint64_t * p_seed)
+{
+	ssize_t height = chain->height;
+	for(ssize_t i = 0; i < depth && chain->height > 0; ++i) {
+		int rc = blockchain_hash_index_remove(chain, blockchain_heirs_at(chain->heirs, chain->height)->hash);
+		assert(0 == rc);
+		--chain->height;
+	}
+	while(chain->height < height) fake_heir_set(chain, chain->height + 1, generation, p_seed);
+}
+
+static int snapshot_check(blockchain_snapshot_t * snapshot, ssize_t height)
+{
+	const blockchain_heir_t * heir = blockchain_snapshot_get(snapshot, height);
+	assert(heir);
+	if(height > 0) assert(((uint64_t *)heir->hash)[1] == (uint64_t)height);	// not a fake heir at height 0
+	assert(blockchain_snapshot_get_height(snapshot, heir->hash) == height);
+	assert(blockchain_snapshot_find(snapshot, heir->hash) == heir);
+	return 0;
+}
+
+struct snapshot_reader_context
+{
+	pthread_t th;
+	blockchain_t * chain;
+	int * quit;
+	int64_t num_reads;
+	uint64_t seed;
+};
+static void * snapshot_reader_thread(void * user_data)
+{
+	struct snapshot_reader_context * ctx = user_data;
+	while(!__atomic_load_n(ctx->quit, __ATOMIC_ACQUIRE))
+	{
+		blockchain_snapshot_t snapshot[1];
+		blockchain_snapshot_acquire(ctx->chain, snapshot);
+		
+		ssize_t height = blockchain_snapshot_height(snapshot);
+		for(int i = 0; i < 16; ++i) {
+			ctx->seed = ctx->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			snapshot_check(snapshot, (ctx->seed >> 33) % (height + 1));
+		}
+		snapshot_check(snapshot, height);
+		
+		blockchain_snapshot_release(snapshot);
+		++ctx->num_reads;
+	}
+	return NULL;
+}
+
+void test_blockchain_snapshot(void)
+{
+	blockchain_t chain[1];
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, NULL, NULL, NULL);
+	uint64_t seed = 10;
+	int64_t generation = 0;
+	
+	// 1. a snapshot keeps its own version during reorgs
+	for(ssize_t height = 1; height <= 3000; ++height) fake_heir_set(chain, height, generation, &seed);
+	blockchain_publish(chain);
+	
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(chain, snapshot);
+	assert(blockchain_snapshot_height(snapshot) == 3000);
+	uint256_t old_tip;
+	memcpy(&old_tip, blockchain_snapshot_get(snapshot, 3000)->hash, sizeof(old_tip));
+	
+	for(int i = 0; i < 10; ++i) {
+		fake_chain_reorg(chain, 1500, ++generation, &seed);
+		blockchain_publish(chain);
+	}
+	assert(chain->limbo->count > 0);	// can not be reclaimed 
+	
+	assert(NULL == chain->find(chain, &old_tip));
+	assert(blockchain_snapshot_get_height(snapshot, &old_tip) == 3000);
+	for(ssize_t height = 0; height <= 3000; ++height) {
+		snapshot_check(snapshot, height);
+		if(height > 1500) assert(((uint64_t *)blockchain_snapshot_get(snapshot, height)->hash)[2] == 0);
+	}
+	blockchain_snapshot_release(snapshot);
+	
+	blockchain_publish(chain);
+	assert(0 == chain->limbo->count && 0 == chain->pending->count);
+	
+	blockchain_snapshot_acquire(chain, snapshot);
+	assert(blockchain_snapshot_get_height(snapshot, &old_tip) == -1);
+	assert(((uint64_t *)blockchain_snapshot_get(snapshot, 3000)->hash)[2] == generation);
+	blockchain_snapshot_release(snapshot);
+	
+	// 2. lock-free readers with a concurrent writer
+	int quit = 0;
+	struct snapshot_reader_context readers[4];
+	memset(readers, 0, sizeof(readers));
+	for(int i = 0; i < 4; ++i) {
+		readers[i].chain = chain;
+		readers[i].quit = &quit;
+		readers[i].seed = i + 1;
+		int rc = pthread_create(&readers[i].th, NULL, snapshot_reader_thread, &readers[i]);
+		assert(0 == rc);
+	}
+	
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	for(int round = 0; round < 2000; ++round)
+	{
+		pthread_mutex_lock(&chain->mutex);
+		for(int i = 0; i < 100; ++i) fake_heir_set(chain, chain->height + 1, generation, &seed);
+		if(0 == (round % 5)) fake_chain_reorg(chain, 1 + round % 700, ++generation, &seed);
+		blockchain_publish(chain);
+		pthread_mutex_unlock(&chain->mutex);
+	}
+	double time_elapsed = app_timer_stop(timer);
+	
+	__atomic_store_n(&quit, 1, __ATOMIC_RELEASE);
+	int64_t num_reads = 0;
+	for(int i = 0; i < 4; ++i) {
+		pthread_join(readers[i].th, NULL);
+		num_reads += readers[i].num_reads;
+	}
+	printf("%s(): height = %ld, snapshots read: %ld, time_elapsed: %.6f s\n", __FUNCTION__,
+		(long)chain->height, (long)num_reads, time_elapsed);
+	
+	uint256_t * hashes = NULL;
+	ssize_t count = blockchain_get_known_hashes(chain, 0, &hashes);
+	assert(count > 10 && 0 == memcmp(&hashes[count - 1], g_genesis_block_hash, sizeof(uint256_t)));
+	free(hashes);
+	assert(blockchain_get_latest(chain, NULL, NULL) == chain->height);
+	
+	blockchain_cleanup(chain);
+}
+
+/**
+ * regtest-like headers (bits = 0x207fffff), about 2 hashes per header to mine.
+ */
+static void mine_header(struct satoshi_block_header * hdr, uint256_t * hash)
+{
+	do {
+		++hdr->nonce;
+		hash256(hdr, sizeof(*hdr), (uint8_t *)hash);
+	}while(uint256_compare_with_compact(hash, (compact_uint256_t *)&hdr->bits) > 0);
+}
+
+static struct satoshi_block_header * make_headers(const uint256_t * prev_hash, uint32_t timestamp, 
+	ssize_t count, uint256_t * hashes)
+{
+	struct satoshi_block_header * hdrs = calloc(count, sizeof(*hdrs));
+	assert(hdrs);
+	for(ssize_t i = 0; i < count; ++i)
+	{
+		struct satoshi_block_header * hdr = &hdrs[i];
+		hdr->version = 4;
+		memcpy(hdr->prev_hash, (i == 0)?prev_hash:&hashes[i - 1], sizeof(uint256_t));
+		hdr->timestamp = timestamp + i * 600;
+		hdr->bits = 0x207fffff;
+		mine_header(hdr, &hashes[i]);
+	}
+	return hdrs;
+}
+
+void test_blockchain_add_batch(void)
+{
+	struct satoshi_block_header genesis[1];
+	memset(genesis, 0, sizeof(genesis));
+	genesis->version = 1;
+	genesis->timestamp = 1296688602;
+	genesis->bits = 0x207fffff;
+	
+	const ssize_t num_blocks = 6000;
+	uint256_t * hashes = calloc(num_blocks + 1, sizeof(*hashes));
+	assert(hashes);
+	mine_header(genesis, &hashes[0]);
+	struct satoshi_block_header * hdrs = make_headers(&hashes[0], genesis->timestamp + 600, num_blocks, &hashes[1]);
+	
+	// per-header path, for comparison
+	blockchain_t chain[1];
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, &hashes[0], genesis, NULL);
+	
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	for(ssize_t i = 0; i < num_blocks; ++i) {
+		int rc = chain->add(chain, &hashes[i + 1], &hdrs[i]);
+		assert(0 == rc);
+	}
+	double time_single = app_timer_stop(timer);
+	assert(chain->height == num_blocks);
+	blockchain_cleanup(chain);
+	
+	// 1. batches of 2000 headers
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, &hashes[0], genesis, NULL);
+	
+	app_timer_start(timer);
+	for(ssize_t i = 0; i < num_blocks; i += 2000) {
+		ssize_t num_added = blockchain_add_batch(chain, &hdrs[i], 2000);
+		assert(num_added == 2000);
+	}
+	double time_batch = app_timer_stop(timer);
+	printf("%s(): %ld headers, add(): %.6f s, add_batch(): %.6f s\n", __FUNCTION__, 
+		(long)num_blocks, time_single, time_batch);
+	
+	assert(chain->height == num_blocks);
+	for(ssize_t height = 0; height <= num_blocks; ++height) {
+		assert(chain->get_height(chain, &hashes[height]) == height);
+	}
+	
+	// the full headers can be reconstructed from the compact heirs
+	assert(sizeof(blockchain_heir_t) == 112);
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(chain, snapshot);
+	for(ssize_t height = 1; height <= num_blocks; ++height) {
+		struct satoshi_block_header hdr[1];
+		assert(0 == blockchain_get_header(chain, height, hdr));
+		assert(0 == memcmp(hdr, &hdrs[height - 1], sizeof(*hdr)));
+		
+		memset(hdr, 0, sizeof(hdr));
+		assert(0 == blockchain_snapshot_get_header(snapshot, height, hdr));
+		assert(0 == memcmp(hdr, &hdrs[height - 1], sizeof(*hdr)));
+	}
+	blockchain_snapshot_release(snapshot);
+	
+	// 2. headers already on the chain
+	assert(0 == blockchain_add_batch(chain, &hdrs[100], 10));
+	assert(chain->height == num_blocks);
+	
+	// 3. a longer fork from (num_blocks - 10), the second half arrives first
+	uint256_t fork_hashes[20];
+	struct satoshi_block_header * fork = make_headers(&hashes[num_blocks - 10], 
+		hdrs[num_blocks - 10].timestamp + 1, 20, fork_hashes);
+	
+	assert(10 == blockchain_add_batch(chain, &fork[10], 10));
+	assert(chain->height == num_blocks);
+	assert(10 == blockchain_add_batch(chain, &fork[0], 10));
+	assert(chain->height == num_blocks + 10);
+	assert(chain->get_height(chain, &fork_hashes[19]) == num_blocks + 10);
+	assert(chain->get_height(chain, &hashes[num_blocks]) == -1);
+	
+	// 4. the 4th header does not meet its target
+	uint256_t more_hashes[5];
+	struct satoshi_block_header * more = make_headers(&fork_hashes[19], fork[19].timestamp + 600, 5, more_hashes);
+	more[3].bits = 0x1d00ffff;
+	
+	assert(3 == blockchain_add_batch(chain, more, 5));
+	assert(chain->height == num_blocks + 13);
+	
+	// exact chainwork: 2 hashes per regtest block
+	const blockchain_heir_t * tip = chain->get(chain, chain->height);
+	assert(tip->chainwork.limbs[0] == 2 * (num_blocks + 14) && 0 == tip->chainwork.limbs[1]);
+	
+	free(more);
+	free(fork);
+	free(hdrs);
+	free(hashes);
+	blockchain_cleanup(chain);
+}
+
+/**
+ * out-of-order delivery: 
+ *   every header arrives before its parent, each one claims the chain of his children.
+ */
+void test_active_chain_out_of_order(void)
+{
+	struct satoshi_block_header genesis[1];
+	memset(genesis, 0, sizeof(genesis));
+	genesis->version = 1;
+	genesis->timestamp = 1296688602;
+	genesis->bits = 0x207fffff;
+	
+	const ssize_t num_blocks = 3000;
+	uint256_t * hashes = calloc(num_blocks + 1, sizeof(*hashes));
+	assert(hashes);
+	mine_header(genesis, &hashes[0]);
+	struct satoshi_block_header * hdrs = make_headers(&hashes[0], genesis->timestamp + 600, num_blocks, &hashes[1]);
+	
+	blockchain_t chain[1];
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, &hashes[0], genesis, NULL);
+	active_chain_list_t * list = chain->candidates_list;
+	
+	// 1. reverse order
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	for(ssize_t i = num_blocks - 1; i > 0; --i) {
+		int rc = chain->add(chain, &hashes[i + 1], &hdrs[i]);
+		assert(0 == rc);
+		assert(chain->height == 0 && list->count == 1);
+	}
+	active_chain_t * orphans = list->chains[0];
+	assert(list->index->count == num_blocks);	// (num_blocks - 1) nodes and the 'head'
+	assert(orphans->longest_end == list->find_node(list, &hashes[num_blocks], NULL));
+	assert(orphans->head->best_work.limbs[0] == 2 * (num_blocks - 1));
+	
+	// the missing header
+	int rc = chain->add(chain, &hashes[1], &hdrs[0]);
+	assert(0 == rc);
+	double time_elapsed = app_timer_stop(timer);
+	printf("%s(): %ld headers in reverse order: %.6f s\n", __FUNCTION__, (long)num_blocks, time_elapsed);
+	
+	assert(chain->height == num_blocks);
+	assert(list->count == 0 && list->index->count == 0);
+	
+	// 2. a shorter fork from (num_blocks - 50), shuffled
+	uint256_t fork_hashes[60];
+	struct satoshi_block_header * fork = make_headers(&hashes[num_blocks - 50], 
+		hdrs[num_blocks - 50].timestamp + 1, 60, fork_hashes);
+	
+	int order[30];
+	for(int i = 0; i < 30; ++i) order[i] = i;
+	uint64_t seed = 12345;
+	for(int i = 29; i > 0; --i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		int j = (int)((seed >> 33) % (i + 1));
+		int tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+	}
+	for(int i = 0; i < 30; ++i) {
+		rc = chain->add(chain, &fork_hashes[order[i]], &fork[order[i]]);
+		assert(0 == rc);
+	}
+	assert(chain->height == num_blocks);
+	assert(list->count == 1 && list->index->count == 31);
+	assert(list->chains[0]->longest_end == list->find_node(list, &fork_hashes[29], NULL));
+	
+	// duplicated
+	assert(-1 == chain->add(chain, &fork_hashes[10], &fork[10]));
+	
+	// 3. the fork becomes heavier, the old main chain is abandoned as the orphans
+	for(int i = 59; i >= 30; --i) {
+		rc = chain->add(chain, &fork_hashes[i], &fork[i]);
+		assert(0 == rc);
+	}
+	assert(chain->height == num_blocks - 50 + 60);
+	assert(chain->get_height(chain, &fork_hashes[59]) == chain->height);
+	assert(chain->get_height(chain, &hashes[num_blocks]) == -1);
+	
+	assert(list->count == 1 && list->index->count == 51);
+	active_chain_t * old_chain = list->chains[0];
+	assert(0 == memcmp(&old_chain->head->hash, &hashes[num_blocks - 50], sizeof(uint256_t)));
+	assert(old_chain->longest_end == list->find_node(list, &hashes[num_blocks], NULL));
+	
+	// 4. the old main chain comes back
+	uint256_t more_hashes[20];
+	struct satoshi_block_header * more = make_headers(&hashes[num_blocks], hdrs[num_blocks - 1].timestamp + 600, 20, more_hashes);
+	for(int i = 0; i < 20; ++i) {
+		rc = chain->add(chain, &more_hashes[i], &more[i]);
+		assert(0 == rc);
+	}
+	assert(chain->height == num_blocks + 20);
+	assert(chain->get_height(chain, &more_hashes[19]) == chain->height);
+	assert(list->count == 1 && list->index->count == 61);
+	
+	free(more);
+	free(fork);
+	free(hdrs);
+	free(hashes);
+	blockchain_cleanup(chain);
+}
+
+static int s_over_quota_count;
+static void on_peer_over_quota(struct active_chain_list * list, int peer_id, void * user_data)
+{
+	assert(peer_id == 1);
+	++s_over_quota_count;
+}
+
+void test_active_chain_orphan_pool(void)
+{
+	struct satoshi_block_header genesis[1];
+	memset(genesis, 0, sizeof(genesis));
+	genesis->version = 1;
+	genesis->timestamp = 1296688602;
+	genesis->bits = 0x207fffff;
+	
+	uint256_t genesis_hash;
+	mine_header(genesis, &genesis_hash);
+	
+	blockchain_t chain[1];
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, &genesis_hash, genesis, NULL);
+	
+	active_chain_list_t * list = chain->candidates_list;
+	list->max_bytes = 100 * ACTIVE_CHAIN_NODE_SIZE;
+	list->max_bytes_per_peer = 30 * ACTIVE_CHAIN_NODE_SIZE;
+	list->on_peer_over_quota = on_peer_over_quota;
+	
+	// 1. peer 1 sends 40 disconnected headers, the last 10 are over quota
+	uint256_t unknown_parent;
+	memset(&unknown_parent, 0x11, sizeof(unknown_parent));
+	uint256_t hashes[40];
+	struct satoshi_block_header * hdrs = make_headers(&unknown_parent, genesis->timestamp + 600, 40, hashes);
+	
+	for(int i = 0; i < 40; ++i) {
+		int rc = blockchain_add_from_peer(chain, &hashes[i], &hdrs[i], 1);
+		assert(rc == ((i < 30)?0:-1));
+	}
+	const struct active_chain_peer_usage * usage = active_chain_list_get_peer_usage(list, 1);
+	assert(usage && usage->num_nodes == 30 && usage->num_rejected == 10);
+	assert(s_over_quota_count == 10);
+	assert(list->bytes_used == 31 * ACTIVE_CHAIN_NODE_SIZE);	// and the 'head'
+	
+	// the headers which extend the main chain are always accepted
+	uint256_t tip_hash;
+	struct satoshi_block_header * tip = make_headers(&genesis_hash, genesis->timestamp + 600, 1, &tip_hash);
+	assert(0 == blockchain_add_from_peer(chain, &tip_hash, tip, 1));
+	assert(chain->height == 1);
+	
+	// 2. peer 2 fills the pool, the oldest chain (from peer 1) is evicted first
+	for(int k = 0; k < 3; ++k) {
+		memset(&unknown_parent, 0x22 + k, sizeof(unknown_parent));
+		uint256_t more_hashes[30];
+		struct satoshi_block_header * more = make_headers(&unknown_parent, genesis->timestamp + 600, 30, more_hashes);
+		for(int i = 0; i < 30; ++i) {
+			assert(0 == blockchain_add_from_peer(chain, &more_hashes[i], &more[i], 2 + k));
+			assert(list->bytes_used <= list->max_bytes);
+		}
+		free(more);
+	}
+	assert(NULL == active_chain_list_get_peer_usage(list, 1));
+	assert(list->num_evicted == 31);
+	assert(list->count == 3 && list->index->count == 93);
+	assert(NULL == list->find_node(list, &hashes[0], NULL));
+	
+	// 3. expired
+	assert(93 == active_chain_list_evict(list, time(NULL) + list->max_age + 1));
+	assert(list->count == 0 && list->index->count == 0 && list->bytes_used == 0);
+	assert(0 == list->peers_count && NULL == list->lru_first && NULL == list->lru_last);
+	
+	free(tip);
+	free(hdrs);
+	blockchain_cleanup(chain);
+}
+
+void test_block_info_fork_point(void)
+{
+	struct satoshi_block_header genesis[1];
+	memset(genesis, 0, sizeof(genesis));
+	genesis->version = 1;
+	genesis->timestamp = 1296688602;
+	genesis->bits = 0x207fffff;
+	
+	const ssize_t num_blocks = 3000;
+	uint256_t * hashes = calloc(num_blocks + 1, sizeof(*hashes));
+	assert(hashes);
+	mine_header(genesis, &hashes[0]);
+	struct satoshi_block_header * hdrs = make_headers(&hashes[0], genesis->timestamp + 600, num_blocks, &hashes[1]);
+	
+	blockchain_t chain[1];
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, &hashes[0], genesis, NULL);
+	active_chain_list_t * list = chain->candidates_list;
+	assert(num_blocks == blockchain_add_batch(chain, hdrs, num_blocks));
+	
+	// 1. a deep fork from height 10 (not long enough to win), the second half arrives first
+	const ssize_t fork_len = 2500;
+	uint256_t * fork_hashes = calloc(fork_len, sizeof(*fork_hashes));
+	assert(fork_hashes);
+	struct satoshi_block_header * fork = make_headers(&hashes[10], hdrs[9].timestamp + 1, fork_len, fork_hashes);
+	for(ssize_t i = fork_len / 2; i < fork_len; ++i) assert(0 == chain->add(chain, &fork_hashes[i], &fork[i]));
+	
+	block_info_t * tip = list->find_node(list, &fork_hashes[fork_len - 1], NULL);
+	assert(tip && tip->height == -1 && NULL == tip->pskip);
+	assert(-1 == blockchain_find_fork_point(chain, &fork_hashes[fork_len - 1]));
+	
+	for(ssize_t i = 0; i < fork_len / 2; ++i) assert(0 == chain->add(chain, &fork_hashes[i], &fork[i]));
+	assert(chain->height == num_blocks);
+	assert(tip->height == 10 + fork_len);
+	
+	for(int height = 11; height <= tip->height; height += 97) {
+		block_info_t * ancestor = block_info_get_ancestor(tip, height);
+		assert(ancestor && 0 == memcmp(&ancestor->hash, &fork_hashes[height - 11], sizeof(uint256_t)));
+	}
+	assert(block_info_get_ancestor(tip, 10) && NULL == block_info_get_ancestor(tip, 10)->parent);	// the 'head'
+	assert(NULL == block_info_get_ancestor(tip, 9));
+	
+	assert(10 == blockchain_find_fork_point(chain, &fork_hashes[fork_len - 1]));
+	assert(10 == blockchain_find_fork_point(chain, &fork_hashes[0]));
+	assert(100 == blockchain_find_fork_point(chain, &hashes[100]));
+	
+	// 2. a sub-fork from the fork at height 1010
+	uint256_t sub_hashes[5];
+	struct satoshi_block_header * sub = make_headers(&fork_hashes[999], fork[999].timestamp + 1, 5, sub_hashes);
+	for(int i = 0; i < 5; ++i) assert(0 == chain->add(chain, &sub_hashes[i], &sub[i]));
+	
+	block_info_t * sub_tip = list->find_node(list, &sub_hashes[4], NULL);
+	block_info_t * lca = block_info_find_fork(tip, sub_tip);
+	assert(lca && 0 == memcmp(&lca->hash, &fork_hashes[999], sizeof(uint256_t)));
+	assert(block_info_find_fork(tip, lca) == lca);
+	
+	// locator: unknown, sub-fork, main chain
+	uint256_t locator[3];
+	memset(&locator[0], 0x33, sizeof(uint256_t));
+	locator[1] = sub_hashes[2];
+	locator[2] = hashes[5];
+	assert(10 == blockchain_locate(chain, locator, 3));
+	
+	// 3. the fork wins, the old main chain becomes a branch from height 10
+	uint256_t more_hashes[600];
+	struct satoshi_block_header * more = make_headers(&fork_hashes[fork_len - 1], fork[fork_len - 1].timestamp + 1, 600, more_hashes);
+	for(int i = 0; i < 600; ++i) assert(0 == chain->add(chain, &more_hashes[i], &more[i]));
+	assert(chain->height == 10 + fork_len + 600);
+	
+	assert(10 == blockchain_find_fork_point(chain, &hashes[num_blocks]));
+	assert(1010 == blockchain_find_fork_point(chain, &sub_hashes[4]));
+	block_info_t * old_tip = list->find_node(list, &hashes[num_blocks], NULL);
+	assert(old_tip && old_tip->height == num_blocks);
+	assert(0 == memcmp(&block_info_get_ancestor(old_tip, 2000)->hash, &hashes[2000], sizeof(uint256_t)));
+	
+	free(more);
+	free(sub);
+	free(fork);
+	free(fork_hashes);
+	free(hdrs);
+	free(hashes);
+	blockchain_cleanup(chain);
+}
+
+void test_blockchain_contextual_checks(void)
+{
+	// regtest-like pow_limit, with a short epoch (16 blocks)
+	bitcoin_params_t params[1];
+	memset(params, 0, sizeof(params));
+	memset(&params->pow_limit, 0xff, sizeof(params->pow_limit));
+	params->pow_limit.val[31] = 0x7f;
+	params->pow_target_spacing = 600;
+	params->pow_target_timespan = 16 * 600;
+	
+	struct satoshi_block_header genesis[1];
+	memset(genesis, 0, sizeof(genesis));
+	genesis->version = 1;
+	genesis->timestamp = 1296688602;
+	genesis->bits = 0x207fffff;
+	
+	uint256_t hash;
+	mine_header(genesis, &hash);
+	
+	blockchain_t chain[1];
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, &hash, genesis, NULL);
+	blockchain_set_params(chain, params);
+	active_chain_list_t * list = chain->candidates_list;
+	
+	// 1. blocks are found twice as fast as expected, the difficulty rises at the first block of each epoch
+	const int num_blocks = 64;
+	uint32_t bits[num_blocks + 1];
+	bits[0] = genesis->bits;
+	for(int height = 1; height <= num_blocks; ++height) 
+	{
+		struct satoshi_block_header hdr[1];
+		memset(hdr, 0, sizeof(hdr));
+		hdr->version = 4;
+		memcpy(hdr->prev_hash, &hash, sizeof(uint256_t));
+		hdr->timestamp = genesis->timestamp + height * 300;
+		hdr->bits = blockchain_get_next_work_required(chain, hdr);
+		mine_header(hdr, &hash);
+		assert(0 == chain->add(chain, &hash, hdr));
+		bits[height] = hdr->bits;
+	}
+	assert(chain->height == num_blocks);
+	for(int height = 1; height <= num_blocks; ++height) {
+		if(height % 16) assert(bits[height] == bits[height - 1]);
+		else assert(bits[height] != bits[height - 1]);
+	}
+	uint256_u64_t target, next_target;
+	uint256_u64_set_compact(&target, bits[32], NULL, NULL);
+	uint256_u64_set_compact(&next_target, bits[48], NULL, NULL);
+	assert(uint256_u64_compare(&next_target, &target) < 0);
+	
+	// median-time-past: the 6th of the last 11 blocks
+	assert(blockchain_get_median_time_past(chain, num_blocks) == genesis->timestamp + (num_blocks - 5) * 300);
+	assert(blockchain_get_median_time_past(chain, 20) == genesis->timestamp + 15 * 300);
+	assert(blockchain_get_median_time_past(chain, 3) == genesis->timestamp + 2 * 300);
+	
+	// 2. invalid headers which extend the tip
+	struct satoshi_block_header hdrs[3];
+	uint256_t hashes[3];
+	memset(hdrs, 0, sizeof(hdrs));
+	for(int i = 0; i < 3; ++i) {
+		hdrs[i].version = 4;
+		memcpy(hdrs[i].prev_hash, (i == 0)?&hash:&hashes[i - 1], sizeof(uint256_t));
+		hdrs[i].timestamp = genesis->timestamp + (num_blocks + 1 + i) * 300;
+		hdrs[i].bits = bits[num_blocks];
+		if(i == 1) hdrs[i].bits = genesis->bits;	// bad-diffbits
+		mine_header(&hdrs[i], &hashes[i]);
+	}
+	
+	struct satoshi_block_header bad = hdrs[1];
+	memcpy(bad.prev_hash, &hash, sizeof(uint256_t));
+	mine_header(&bad, &hashes[1]);
+	assert(-1 == chain->add(chain, &hashes[1], &bad));
+	
+	bad.bits = bits[num_blocks];
+	bad.timestamp = blockchain_get_median_time_past(chain, num_blocks);	// time-too-old
+	mine_header(&bad, &hashes[1]);
+	assert(-1 == chain->add(chain, &hashes[1], &bad));
+	
+	bad.timestamp = time(NULL) + MAX_FUTURE_BLOCK_TIME + 600;	// time-too-new
+	mine_header(&bad, &hashes[1]);
+	assert(-1 == chain->add(chain, &hashes[1], &bad));
+	assert(chain->height == num_blocks && 0 == list->count);
+	
+	// the batch stops at the invalid one
+	assert(1 == blockchain_add_batch(chain, hdrs, 3));
+	assert(chain->height == num_blocks + 1);
+	blockchain_cleanup(chain);
+	
+	// 3. a fork with a time-too-old header wins the round, and loses after being cut off
+	const int main_len = 20, fork_len = 15;
+	uint256_t main_hashes[main_len + 1];
+	hash256(genesis, sizeof(*genesis), (uint8_t *)&main_hashes[0]);
+	struct satoshi_block_header * main_hdrs = make_headers(&main_hashes[0], genesis->timestamp + 600, main_len, &main_hashes[1]);
+	
+	memset(chain, 0, sizeof(chain));
+	blockchain_init(chain, &main_hashes[0], genesis, NULL);
+	assert(main_len == blockchain_add_batch(chain, main_hdrs, main_len));
+	
+	struct satoshi_block_header fork[fork_len];
+	uint256_t fork_hashes[fork_len];
+	memset(fork, 0, sizeof(fork));
+	for(int i = 0; i < fork_len; ++i) {
+		fork[i].version = 4;
+		memcpy(fork[i].prev_hash, (i == 0)?&main_hashes[10]:&fork_hashes[i - 1], sizeof(uint256_t));
+		fork[i].timestamp = main_hdrs[9].timestamp + 1 + i * 600;
+		if(i == 3) fork[i].timestamp = genesis->timestamp;
+		fork[i].bits = 0x207fffff;
+		mine_header(&fork[i], &fork_hashes[i]);
+	}
+	for(int i = 0; i < 10; ++i) assert(0 == chain->add(chain, &fork_hashes[i], &fork[i]));
+	assert(-1 == chain->add(chain, &fork_hashes[10], &fork[10]));	// cut off with fork[3]
+	assert(chain->height == main_len);
+	assert(main_len == chain->get_height(chain, &main_hashes[main_len]));
+	assert(list->find_node(list, &fork_hashes[2], NULL));
+	assert(NULL == list->find_node(list, &fork_hashes[3], NULL));
+	assert(NULL == list->find_node(list, &fork_hashes[9], NULL));
+	
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(chain, snapshot);
+	assert(blockchain_snapshot_height(snapshot) == main_len);
+	assert(0 == memcmp(blockchain_snapshot_get(snapshot, main_len)->hash, &main_hashes[main_len], sizeof(uint256_t)));
+	blockchain_snapshot_release(snapshot);
+	
+	free(main_hdrs);
+	blockchain_cleanup(chain);
+}
+
 int main(int argc, char **argv)
 {
+	test_blockchain_hash_index();
+	test_blockchain_snapshot();
+	test_blockchain_add_batch();
+	test_active_chain_out_of_order();
+	test_active_chain_orphan_pool();
+	test_block_info_fork_point();
+	test_blockchain_contextual_checks();
 	test_compact_int_arithmetic_operations();
 	exit(0);
 	
@@ -0,0 +1,575 @@
+/*
+ * compact_block.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "crypto/sha.h"
+#include "bitcoin-consensus.h"
+#include "satoshi-types.h"
+#include "compact_block.h"
+
+/*************************************
+ * SipHash-2-4 (64-bit output)
+ ************************************/
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+		v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);	\
+		v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;						\
+		v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;						\
+		v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);	\
+	} while(0)
+
+#define SIPHASH_INIT(k0, k1) \
+	uint64_t v0 = UINT64_C(0x736f6d6570736575) ^ (k0);	\
+	uint64_t v1 = UINT64_C(0x646f72616e646f6d) ^ (k1);	\
+	uint64_t v2 = UINT64_C(0x6c7967656e657261) ^ (k0);	\
+	uint64_t v3 = UINT64_C(0x7465646279746573) ^ (k1)
+
+#define SIPHASH_COMPRESS(m) do { v3 ^= (m); SIPROUND; SIPROUND; v0 ^= (m); } while(0)
+
+#define SIPHASH_FINALIZE(b) do { \
+		SIPHASH_COMPRESS(b);	\
+		v2 ^= 0xff;				\
+		SIPROUND; SIPROUND; SIPROUND; SIPROUND;	\
+	} while(0)
+
+uint64_t siphash24(uint64_t k0, uint64_t k1, const void * data, size_t length)
+{
+	SIPHASH_INIT(k0, k1);
+	const unsigned char * p = data;
+	const unsigned char * p_end = p + (length & ~(size_t)7);
+	
+	for(; p < p_end; p += 8) {
+		uint64_t m;
+		memcpy(&m, p, 8);	// little-endian
+		SIPHASH_COMPRESS(m);
+	}
+	
+	uint64_t b = (uint64_t)length << 56;
+	for(size_t i = 0; i < (length & 7); ++i) b |= (uint64_t)p[i] << (8 * i);
+	SIPHASH_FINALIZE(b);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// the short ids of all mempool txs are calculated for each compact block, 32 bytes without the tail loop
+uint64_t siphash24_uint256(uint64_t k0, uint64_t k1, const uint256_t * hash)
+{
+	SIPHASH_INIT(k0, k1);
+	uint64_t m[4];
+	memcpy(m, hash, sizeof(m));
+	SIPHASH_COMPRESS(m[0]);
+	SIPHASH_COMPRESS(m[1]);
+	SIPHASH_COMPRESS(m[2]);
+	SIPHASH_COMPRESS(m[3]);
+	SIPHASH_FINALIZE((uint64_t)32 << 56);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+#undef SIPHASH_FINALIZE
+#undef SIPHASH_COMPRESS
+#undef SIPHASH_INIT
+#undef SIPROUND
+#undef ROTL64
+
+void compact_block_get_keys(const struct satoshi_block_header * hdr, uint64_t nonce, uint64_t keys[static 2])
+{
+	// single-SHA256(block header || nonce (little-endian))
+	unsigned char data[sizeof(struct satoshi_block_header) + sizeof(uint64_t)];
+	memcpy(data, hdr, sizeof(struct satoshi_block_header));
+	memcpy(data + sizeof(struct satoshi_block_header), &nonce, sizeof(uint64_t));
+	
+	unsigned char hash[32];
+	sha256_hash(data, sizeof(data), hash);
+	memcpy(&keys[0], hash, 8);
+	memcpy(&keys[1], hash + 8, 8);
+}
+
+static inline const uint256_t * get_shortid_hash(const satoshi_tx_t * tx, int version)
+{
+	if(version == COMPACT_BLOCK_VERSION_WTXID && tx->has_flag) return tx->wtxid;
+	return tx->txid;	// the wtxid of a tx without witness is its txid
+}
+
+static int tx_copy(satoshi_tx_t * dst, const satoshi_tx_t * src)
+{
+	unsigned char * data = NULL;
+	ssize_t cb = satoshi_tx_serialize(src, &data);
+	assert(cb > 0 && data);
+	
+	memset(dst, 0, sizeof(*dst));
+	ssize_t cb_parsed = satoshi_tx_parse(dst, cb, data);
+	free(data);
+	return (cb_parsed == cb)?0:-1;
+}
+
+/*************************************
+ * sender
+ ************************************/
+int compact_block_from_block(struct bitcoin_message_cmpctblock * cmpct, const satoshi_block_t * block, uint64_t nonce, int version)
+{
+	assert(cmpct && block);
+	if(block->txn_count <= 0 || NULL == block->txns) return -1;
+	memset(cmpct, 0, sizeof(*cmpct));
+	
+	cmpct->hdr = block->hdr;
+	cmpct->nonce = nonce;
+	
+	// prefill the coinbase, which is never in the mempool
+	cmpct->prefilled_txns = calloc(1, sizeof(*cmpct->prefilled_txns));
+	assert(cmpct->prefilled_txns);
+	cmpct->prefilled_txns[0].index = 0;
+	if(tx_copy(&cmpct->prefilled_txns[0].tx, &block->txns[0])) {
+		bitcoin_message_cmpctblock_cleanup(cmpct);
+		return -1;
+	}
+	cmpct->prefilled_count = 1;
+	
+	uint64_t keys[2];
+	compact_block_get_keys(&block->hdr, nonce, keys);
+	cmpct->shortids_count = block->txn_count - 1;
+	if(cmpct->shortids_count > 0) {
+		cmpct->shortids = calloc(cmpct->shortids_count, sizeof(*cmpct->shortids));
+		assert(cmpct->shortids);
+	}
+	for(ssize_t i = 1; i < block->txn_count; ++i) {
+		cmpct->shortids[i - 1] = compact_block_shortid(keys, get_shortid_hash(&block->txns[i], version));
+	}
+	return 0;
+}
+
+int compact_block_get_txns(const satoshi_block_t * block, const struct bitcoin_message_getblocktxn * request, struct bitcoin_message_blocktxn * reply)
+{
+	assert(block && request && reply);
+	memset(reply, 0, sizeof(*reply));
+	if(memcmp(&block->hash, &request->block_hash, sizeof(uint256_t)) != 0) return -1;
+	
+	for(ssize_t i = 0; i < request->count; ++i) {
+		if(request->indexes[i] < 0 || request->indexes[i] >= block->txn_count) return -1;
+	}
+	
+	reply->block_hash = request->block_hash;
+	if(request->count <= 0) return 0;
+	reply->txns = calloc(request->count, sizeof(*reply->txns));
+	assert(reply->txns);
+	for(ssize_t i = 0; i < request->count; ++i) {
+		reply->count = i + 1;
+		if(tx_copy(&reply->txns[i], &block->txns[request->indexes[i]])) {
+			bitcoin_message_blocktxn_cleanup(reply);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*************************************
+ * receiver
+ ************************************/
+// short id --> tx index of the block, open addressing
+struct shortid_map
+{
+	size_t mask;
+	uint64_t * shortids;
+	ssize_t * indexes;	// -1: empty slot
+};
+
+static void shortid_map_init(struct shortid_map * map, ssize_t count)
+{
+	size_t size = 16;
+	while(size < (size_t)count * 2) size <<= 1;
+	map->mask = size - 1;
+	map->shortids = calloc(size, sizeof(*map->shortids));
+	map->indexes = malloc(size * sizeof(*map->indexes));
+	assert(map->shortids && map->indexes);
+	memset(map->indexes, -1, size * sizeof(*map->indexes));
+}
+
+static void shortid_map_cleanup(struct shortid_map * map)
+{
+	free(map->shortids);
+	free(map->indexes);
+	memset(map, 0, sizeof(*map));
+}
+
+static inline size_t shortid_map_slot(const struct shortid_map * map, uint64_t shortid)
+{
+	// short ids are uniformly distributed (siphash outputs)
+	size_t pos = (size_t)shortid & map->mask;
+	while(map->indexes[pos] >= 0 && map->shortids[pos] != shortid) pos = (pos + 1) & map->mask;
+	return pos;
+}
+
+int partial_block_init(partial_block_t * pblock, const struct bitcoin_message_cmpctblock * cmpct, int version, mempool_t * pool)
+{
+	assert(pblock && cmpct);
+	memset(pblock, 0, sizeof(*pblock));
+	
+	ssize_t txn_count = cmpct->shortids_count + cmpct->prefilled_count;
+	if(cmpct->shortids_count < 0 || cmpct->prefilled_count < 0) return -1;
+	if(txn_count <= 0 || txn_count > (MAX_BLOCK_WEIGHT / MIN_SERIALIZABLE_TRANSACTION_WEIGHT)) return -1;
+	
+	pblock->hdr = cmpct->hdr;
+	hash256(&cmpct->hdr, sizeof(struct satoshi_block_header), (uint8_t *)&pblock->hash);
+	pblock->version = version;
+	pblock->txn_count = txn_count;
+	pblock->txns = calloc(txn_count, sizeof(*pblock->txns));
+	assert(pblock->txns);
+	
+	// prefilled txs
+	ssize_t prev_index = -1;
+	for(ssize_t i = 0; i < cmpct->prefilled_count; ++i) {
+		const struct bitcoin_prefilled_tx * prefilled = &cmpct->prefilled_txns[i];
+		if(prefilled->index <= prev_index || prefilled->index >= txn_count) goto label_error;
+		prev_index = prefilled->index;
+		
+		struct partial_block_tx * ptx = &pblock->txns[prefilled->index];
+		ptx->txid = *prefilled->tx.txid;
+		ptx->length = satoshi_tx_serialize(&prefilled->tx, &ptx->data);
+		assert(ptx->length > 0);
+	}
+	pblock->prefilled_count = cmpct->prefilled_count;
+	
+	// the other slots are filled in order by the short ids
+	struct shortid_map map[1];
+	shortid_map_init(map, cmpct->shortids_count);
+	ssize_t index = 0;
+	for(ssize_t i = 0; i < cmpct->shortids_count; ++i, ++index) {
+		while(pblock->txns[index].length > 0) ++index;
+		assert(index < txn_count);
+		
+		uint64_t shortid = cmpct->shortids[i] & COMPACT_BLOCK_SHORTID_MASK;
+		size_t pos = shortid_map_slot(map, shortid);
+		if(map->indexes[pos] >= 0) {	// two txs of the block have the same short id
+			shortid_map_cleanup(map);
+			partial_block_cleanup(pblock);
+			return 1;
+		}
+		map->shortids[pos] = shortid;
+		map->indexes[pos] = index;
+	}
+	
+	// match the mempool txs, an index matched by more than one tx is left missing
+	ssize_t * matches = malloc(txn_count * sizeof(*matches));	// -1: none, -2: ambiguous, otherwise the mempool tx
+	assert(matches);
+	memset(matches, -1, txn_count * sizeof(*matches));
+	
+	uint256_t * txids = NULL;
+	uint256_t * wtxids = NULL;
+	ssize_t count = 0;
+	if(pool && cmpct->shortids_count > 0) count = mempool_get_hashes(pool, &txids, &wtxids);
+	
+	uint64_t keys[2];
+	compact_block_get_keys(&cmpct->hdr, cmpct->nonce, keys);
+	for(ssize_t i = 0; i < count; ++i) {
+		const uint256_t * hash = (version == COMPACT_BLOCK_VERSION_WTXID)?&wtxids[i]:&txids[i];
+		size_t pos = shortid_map_slot(map, compact_block_shortid(keys, hash));
+		if(map->indexes[pos] < 0) continue;
+		
+		ssize_t * match = &matches[map->indexes[pos]];
+		*match = (*match == -1)?i:-2;
+	}
+	
+	for(ssize_t i = 0; i < txn_count; ++i) {
+		if(matches[i] < 0) continue;
+		struct partial_block_tx * ptx = &pblock->txns[i];
+		ptx->length = mempool_get_tx(pool, &txids[matches[i]], 0, &ptx->data);
+		if(ptx->length <= 0) {	// removed from the mempool meanwhile
+			ptx->length = 0;
+			ptx->data = NULL;
+			continue;
+		}
+		ptx->txid = txids[matches[i]];
+		++pblock->mempool_count;
+	}
+	free(matches);
+	free(txids);
+	free(wtxids);
+	shortid_map_cleanup(map);
+	
+	pblock->missing_count = txn_count - pblock->prefilled_count - pblock->mempool_count;
+	return 0;
+	
+label_error:
+	partial_block_cleanup(pblock);
+	return -1;
+}
+
+void partial_block_cleanup(partial_block_t * pblock)
+{
+	if(NULL == pblock) return;
+	if(pblock->txns) {
+		for(ssize_t i = 0; i < pblock->txn_count; ++i) free(pblock->txns[i].data);
+		free(pblock->txns);
+		pblock->txns = NULL;
+	}
+	pblock->txn_count = 0;
+	pblock->missing_count = 0;
+	return;
+}
+
+ssize_t partial_block_get_missing(const partial_block_t * pblock, ssize_t ** p_indexes)
+{
+	assert(pblock && p_indexes);
+	*p_indexes = NULL;
+	if(pblock->missing_count <= 0) return 0;
+	
+	ssize_t * indexes = calloc(pblock->missing_count, sizeof(*indexes));
+	assert(indexes);
+	ssize_t count = 0;
+	for(ssize_t i = 0; i < pblock->txn_count; ++i) {
+		if(0 == pblock->txns[i].length) indexes[count++] = i;
+	}
+	assert(count == pblock->missing_count);
+	*p_indexes = indexes;
+	return count;
+}
+
+int partial_block_fill(partial_block_t * pblock, const struct bitcoin_message_blocktxn * blocktxn)
+{
+	assert(pblock && blocktxn);
+	if(memcmp(&pblock->hash, &blocktxn->block_hash, sizeof(uint256_t)) != 0) return -1;
+	if(blocktxn->count != pblock->missing_count) return -1;
+	
+	ssize_t index = 0;
+	for(ssize_t i = 0; i < blocktxn->count; ++i, ++index) {
+		while(pblock->txns[index].length > 0) ++index;
+		assert(index < pblock->txn_count);
+		
+		struct partial_block_tx * ptx = &pblock->txns[index];
+		ptx->txid = *blocktxn->txns[i].txid;
+		ptx->length = satoshi_tx_serialize(&blocktxn->txns[i], &ptx->data);
+		assert(ptx->length > 0);
+	}
+	pblock->missing_count = 0;
+	return 0;
+}
+
+ssize_t partial_block_build(partial_block_t * pblock, unsigned char ** p_data)
+{
+	assert(pblock && p_data);
+	if(pblock->missing_count > 0 || pblock->txn_count <= 0) return -1;
+	
+	// a wrong tx (short id collision with a mempool tx) is detected by the merkle root
+	uint256_merkle_tree_t * mtree = uint256_merkle_tree_new(pblock->txn_count, pblock);
+	assert(mtree);
+	for(ssize_t i = 0; i < pblock->txn_count; ++i) mtree->add(mtree, 1, &pblock->txns[i].txid);
+	mtree->recalc(mtree, 0, -1);
+	int rc = memcmp(&mtree->merkle_root, pblock->hdr.merkle_root, 32);
+	uint256_merkle_tree_free(mtree);
+	if(rc) {
+		debug_printf("merkle root mismatch, request the full block");
+		return -1;
+	}
+	
+	ssize_t vint_size = varint_calc_size(pblock->txn_count);
+	ssize_t block_size = sizeof(struct satoshi_block_header) + vint_size;
+	for(ssize_t i = 0; i < pblock->txn_count; ++i) block_size += pblock->txns[i].length;
+	if(block_size > MAX_BLOCK_SERIALIZED_SIZE) return -1;
+	
+	unsigned char * data = malloc(block_size);
+	assert(data);
+	unsigned char * p = data;
+	memcpy(p, &pblock->hdr, sizeof(struct satoshi_block_header));
+	p += sizeof(struct satoshi_block_header);
+	varint_set((varint_t *)p, pblock->txn_count);
+	p += vint_size;
+	for(ssize_t i = 0; i < pblock->txn_count; ++i) {
+		memcpy(p, pblock->txns[i].data, pblock->txns[i].length);
+		p += pblock->txns[i].length;
+	}
+	assert((p - data) == block_size);
+	
+	*p_data = data;
+	return block_size;
+}
+
+
+#if defined(_TEST_COMPACT_BLOCK) && defined(_STAND_ALONE)
+#include <time.h>
+#include "test-utils.h"
+
+static void test_siphash(void)
+{
+	// reference vectors (SipHash-2-4, key = 00 01 .. 0f, message = 00 01 .. (length - 1))
+	static const struct { size_t length; uint64_t hash; } vectors[] = {
+		{ 0,  UINT64_C(0x726fdb47dd0e0e31) },
+		{ 1,  UINT64_C(0x74f839c593dc67fd) },
+		{ 8,  UINT64_C(0x93f5f5799a932462) },
+		{ 15, UINT64_C(0xa129ca6149be45e5) },
+		{ 16, UINT64_C(0x3f2acc7f57c29bdb) },
+	};
+	const uint64_t k0 = UINT64_C(0x0706050403020100);
+	const uint64_t k1 = UINT64_C(0x0f0e0d0c0b0a0908);
+	
+	unsigned char data[32];
+	for(size_t i = 0; i < sizeof(data); ++i) data[i] = (unsigned char)i;
+	for(size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+		assert(siphash24(k0, k1, data, vectors[i].length) == vectors[i].hash);
+	}
+	assert(siphash24_uint256(k0, k1, (uint256_t *)data) == siphash24(k0, k1, data, 32));
+	printf("%s(): PASSED\n", __FUNCTION__);
+}
+
+// serialize and parse again
+#define message_round_trip(type, msg, copy) do { \
+		unsigned char * payload = NULL;						\
+		ssize_t cb = bitcoin_message_##type##_serialize(msg, &payload);	\
+		assert(cb > 0 && payload);							\
+		struct bitcoin_message_##type * parsed = bitcoin_message_##type##_parse(copy, payload, cb);	\
+		assert(parsed == copy);								\
+		unsigned char * payload2 = NULL;					\
+		assert(bitcoin_message_##type##_serialize(copy, &payload2) == cb);	\
+		assert(0 == memcmp(payload, payload2, cb));		\
+		free(payload); free(payload2);						\
+	} while(0)
+
+static void test_reconstruction(ssize_t txn_count, ssize_t num_unrelated)
+{
+	satoshi_block_t block[1];
+	test_make_block(block, txn_count);
+	
+	unsigned char * raw_block = NULL;
+	ssize_t block_size = satoshi_block_serialize(block, &raw_block);
+	assert(block_size > 0);
+	
+	// the mempool has 2/3 of the block's txs and some unrelated ones
+	mempool_t * pool = mempool_new(0, NULL);
+	ssize_t num_missing = 0;
+	for(ssize_t i = 1; i < txn_count; ++i) {
+		if((i % 3) == 0) { ++num_missing; continue; }
+		assert(mempool_add(pool, &block->txns[i], 1000) == mempool_status_ok);
+	}
+	for(ssize_t i = 0; i < num_unrelated; ++i) {
+		satoshi_tx_t tx[1];
+		test_make_indexed_tx(tx, txn_count + i);
+		assert(mempool_add(pool, tx, 1000) == mempool_status_ok);
+		satoshi_tx_cleanup(tx);
+	}
+	
+	// sender
+	struct bitcoin_message_cmpctblock cmpct[1], received[1];
+	int rc = compact_block_from_block(cmpct, block, UINT64_C(0x0123456789abcdef), COMPACT_BLOCK_VERSION_WTXID);
+	assert(0 == rc && cmpct->shortids_count == (txn_count - 1) && cmpct->prefilled_count == 1);
+	message_round_trip(cmpctblock, cmpct, received);
+	ssize_t cmpct_size = bitcoin_message_cmpctblock_serialize(cmpct, NULL);
+	bitcoin_message_cmpctblock_cleanup(cmpct);
+	
+	// receiver
+	struct timespec ts[2];
+	clock_gettime(CLOCK_MONOTONIC, &ts[0]);
+	partial_block_t pblock[1];
+	rc = partial_block_init(pblock, received, COMPACT_BLOCK_VERSION_WTXID, pool);
+	clock_gettime(CLOCK_MONOTONIC, &ts[1]);
+	assert(0 == rc);
+	assert(pblock->missing_count == num_missing && pblock->mempool_count == (txn_count - 1 - num_missing));
+	
+	struct bitcoin_message_getblocktxn request[1], request_received[1];
+	memset(request, 0, sizeof(request));
+	request->block_hash = pblock->hash;
+	request->count = partial_block_get_missing(pblock, &request->indexes);
+	assert(request->count == num_missing);
+	for(ssize_t i = 0; i < request->count; ++i) assert((request->indexes[i] % 3) == 0);
+	message_round_trip(getblocktxn, request, request_received);
+	bitcoin_message_getblocktxn_cleanup(request);
+	
+	struct bitcoin_message_blocktxn reply[1], reply_received[1];
+	rc = compact_block_get_txns(block, request_received, reply);
+	assert(0 == rc && reply->count == num_missing);
+	message_round_trip(blocktxn, reply, reply_received);
+	bitcoin_message_blocktxn_cleanup(reply);
+	
+	// a wrong tx is detected by the merkle root
+	if(reply_received->count >= 2) {
+		partial_block_t wrong[1];
+		assert(0 == partial_block_init(wrong, received, COMPACT_BLOCK_VERSION_WTXID, pool));
+		satoshi_tx_t tx = reply_received->txns[0];
+		reply_received->txns[0] = reply_received->txns[1];
+		reply_received->txns[1] = tx;
+		assert(0 == partial_block_fill(wrong, reply_received));
+		unsigned char * data = NULL;
+		assert(partial_block_build(wrong, &data) == -1 && NULL == data);
+		partial_block_cleanup(wrong);
+		reply_received->txns[1] = reply_received->txns[0];
+		reply_received->txns[0] = tx;
+	}
+	
+	unsigned char * data = NULL;
+	if(num_missing > 0) assert(partial_block_build(pblock, &data) == -1);	// not filled yet
+	rc = partial_block_fill(pblock, reply_received);
+	assert(0 == rc && 0 == pblock->missing_count);
+	ssize_t cb = partial_block_build(pblock, &data);
+	assert(cb == block_size && 0 == memcmp(data, raw_block, block_size));
+	
+	printf("%s(txn_count=%ld, mempool=%ld): PASSED, block: %ld bytes, cmpctblock: %ld bytes, "
+		"missing: %ld, reconstructed in %.3f ms\n",
+		__FUNCTION__, (long)txn_count, (long)(txn_count - 1 - num_missing + num_unrelated),
+		(long)block_size, (long)cmpct_size, (long)num_missing,
+		(ts[1].tv_sec - ts[0].tv_sec) * 1000.0 + (ts[1].tv_nsec - ts[0].tv_nsec) / 1000000.0);
+	
+	free(data);
+	free(raw_block);
+	partial_block_cleanup(pblock);
+	bitcoin_message_blocktxn_cleanup(reply_received);
+	bitcoin_message_getblocktxn_cleanup(request_received);
+	bitcoin_message_cmpctblock_cleanup(received);
+	satoshi_block_cleanup(block);
+	mempool_free(pool);
+}
+
+static void test_shortid_collision(void)
+{
+	// two identical short ids in a cmpctblock: the full block should be requested
+	satoshi_block_t block[1];
+	test_make_block(block, 4);
+	struct bitcoin_message_cmpctblock cmpct[1];
+	assert(0 == compact_block_from_block(cmpct, block, 1, COMPACT_BLOCK_VERSION_TXID));
+	cmpct->shortids[2] = cmpct->shortids[0];
+	
+	partial_block_t pblock[1];
+	assert(1 == partial_block_init(pblock, cmpct, COMPACT_BLOCK_VERSION_TXID, NULL));
+	
+	// out of range prefilled index
+	cmpct->prefilled_txns[0].index = 4;
+	assert(-1 == partial_block_init(pblock, cmpct, COMPACT_BLOCK_VERSION_TXID, NULL));
+	
+	bitcoin_message_cmpctblock_cleanup(cmpct);
+	satoshi_block_cleanup(block);
+	printf("%s(): PASSED\n", __FUNCTION__);
+}
+
+int main(int argc, char ** argv)
+{
+	test_siphash();
+	test_shortid_collision();
+	test_reconstruction(1, 0);
+	test_reconstruction(3, 10);
+	test_reconstruction(2500, 50000);
+	return 0;
+}
+#endif
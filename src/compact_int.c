@@ -32,8 +32,8 @@
 #include <assert.h>
 
 #include "satoshi-types.h"
+#include "uint256_math.h"
 #include <math.h>
-#include <gmp.h>
 
 #include "utils.h"
 
@@ -119,27 +119,10 @@ double compact_uint256_div(const compact_uint256_t * restrict n, const compact_u
 
 double uint256_div(const uint256_t * restrict n, const uint256_t * restrict d)
 {
-	mpz_t divident, divisor;
-	mpz_inits(divident, divisor, NULL);
-	mpz_import(divident, 1, -1, 32, 
-		-1, 
-		0, n);
-	mpz_import(divisor, 1, -1, 32, 
-		-1, 
-		0, d);
-	
-	mpf_t a, b, rop;
-	mpf_set_default_prec(256);
-	
-	mpf_inits(a, b, rop, NULL);
-	mpf_set_z(a, divident);
-	mpf_set_z(b, divisor);
-	mpf_div(rop, a, b);
-	
-	double result = mpf_get_d(rop);
-	mpz_clears(divident, divisor, NULL);
-	mpf_clears(a, b, rop, NULL);
-	return result;
+	uint256_u64_t a, b;
+	uint256_u64_from_uint256(&a, n);
+	uint256_u64_from_uint256(&b, d);
+	return uint256_u64_to_double(&a) / uint256_u64_to_double(&b);
 }
 
 int compact_uint256_compare(const compact_uint256_t * restrict a, const compact_uint256_t * restrict b)
@@ -168,14 +151,11 @@ int compact_uint256_compare(const compact_uint256_t * restrict a, const compact_
 int uint256_compare(const uint256_t * restrict  _a, const uint256_t * restrict _b)
 {
 	// treat uint256 as little-endian
-	uint64_t * a = (uint64_t *)_a;
-	uint64_t * b = (uint64_t *)_b;
-	for(int i = 3; i >= 0; --i)
-	{
-		if(a[i] == b[i]) continue;
-		return (a[i] > b[i])?1:-1;
-	}
-	return 0;
+	// (load the limbs bytewise, reading the byte array through a uint64_t pointer breaks strict aliasing)
+	uint256_u64_t a, b;
+	uint256_u64_from_uint256(&a, _a);
+	uint256_u64_from_uint256(&b, _b);
+	return uint256_u64_compare(&a, &b);
 }
 
 int uint256_compare_with_compact(const uint256_t * restrict hash, const compact_uint256_t * restrict _target)
@@ -185,22 +165,14 @@ int uint256_compare_with_compact(const uint256_t * restrict hash, const compact_
 }
 
 
-#define UINT256_BYTE_ORDER (1) 	// big-endian
 void uint256_add(uint256_t * c, const uint256_t *a, const uint256_t *b)
 {
 	assert(a && b && c);
-	memset(c, 0, sizeof(*c));
-	
-	mpz_t ma, mb, mc;
-	mpz_inits(ma, mb, mc, NULL);
-	
-	mpz_import(ma, 1, UINT256_BYTE_ORDER, sizeof(*a), 0, 0, a);
-	mpz_import(mb, 1, UINT256_BYTE_ORDER, sizeof(*b), 0, 0, b);
-	mpz_add(mc, ma, mb);
-	
-	size_t count = 0;
-	mpz_export(c, &count, UINT256_BYTE_ORDER, sizeof(*c), 0, 0, mc);
-	assert(count == 1);
+	uint256_u64_t ua, ub;
+	uint256_u64_from_uint256(&ua, a);
+	uint256_u64_from_uint256(&ub, b);
+	uint256_u64_add(&ua, &ua, &ub);
+	uint256_u64_to_uint256(c, &ua);
 	return;
 }
 
@@ -222,6 +194,17 @@ compact_uint256_t compact_uint256_add(const compact_uint256_t a, const compact_u
 	return uint256_to_compact(&uc);
 } 
 
+/**
+ * compact_uint256_complement(): c = ~a (as a 256-bit integer)
+ */
+compact_uint256_t compact_uint256_complement(const compact_uint256_t target)
+{
+	uint256_u64_t value;
+	uint256_u64_set_compact(&value, target.bits, NULL, NULL);
+	uint256_u64_not(&value, &value);
+	return (compact_uint256_t){ .bits = uint256_u64_get_compact(&value) };
+}
+
 /**
  * https://en.bitcoin.it/wiki/Difficulty
 **/
@@ -229,27 +212,12 @@ compact_uint256_t compact_uint256_add(const compact_uint256_t a, const compact_u
 static inline double calc_difficulty(const compact_uint256_t * cint, const uint256_t * difficulty_one)
 {
 	uint256_t u_target = compact_to_uint256(cint);
-	double difficulty = 1.0;
 	
 	//~ dump_line("one   : ", difficulty_one, 32);
 	//~ dump_line("target: ", &u_target, 32);
 	
-	mpz_t m_one, m_target;
-	mpz_inits(m_one, m_target, NULL);
-	mpz_import(m_one, 1, -1, sizeof(uint256_t), 0, 0, difficulty_one);
-	mpz_import(m_target, 1, -1, sizeof(uint256_t), 0, 0, &u_target);
-	
-	mpf_t one, target, bdiff;
-	mpf_inits(one, target, bdiff, NULL); 
-	mpf_set_z(one, m_one);
-	mpf_set_z(target, m_target);
-	mpf_div(bdiff, one, target);
-	
-	difficulty = mpf_get_d(bdiff);
-	
-	mpf_clears(one, target, bdiff, NULL);
-	mpz_clears(m_one, m_target, NULL);
-	return difficulty;
+	// the result is a double, 53 bits of the mantissa are enough
+	return uint256_div(difficulty_one, &u_target);
 }
 
 double compact_uint256_to_bdiff(const compact_uint256_t * cint)
@@ -278,4 +246,3 @@ double compact_uint256_to_pdiff(const compact_uint256_t * cint)
 	return calc_difficulty(cint, &pool_difficulty_one);
 }
 
-#undef UINT256_BYTE_ORDER
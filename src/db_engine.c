@@ -37,6 +37,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <limits.h>
+#include <time.h>
+
+#include <json-c/json.h>
 
 #include "db_engine.h"
 
@@ -72,8 +75,85 @@ typedef struct db_engine_private
 	char error_desc[4096];	//  last error description
 	
 	long refs_count;
+	
+	struct db_stats_op txn_commit_stats[1];
+	uint64_t txn_aborts;
 }db_engine_private_t;
 
+/**************************************************
+ * statistics
+ **************************************************/
+static const char * s_db_stats_op_names[db_stats_op_types_count] = {
+	[db_stats_op_find] = "find",
+	[db_stats_op_find_secondary] = "find_secondary",
+	[db_stats_op_insert] = "insert",
+	[db_stats_op_update] = "update",
+	[db_stats_op_del] = "del",
+	[db_stats_op_cursor] = "cursor",
+};
+const char * db_stats_op_type_to_string(enum db_stats_op_type type)
+{
+	if(type < 0 || type >= db_stats_op_types_count) return NULL;
+	return s_db_stats_op_names[type];
+}
+
+int64_t db_stats_clock_usec(void)
+{
+	struct timespec ts[1];
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return (int64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+void db_stats_op_record(struct db_stats_op * op, int64_t begin_usec, int is_error)
+{
+	int64_t usec = db_stats_clock_usec() - begin_usec;
+	if(usec < 0) usec = 0;
+	
+	int index = (usec == 0)?0:(64 - __builtin_clzll((uint64_t)usec));
+	if(index >= DB_STATS_HISTOGRAM_SIZE) index = DB_STATS_HISTOGRAM_SIZE - 1;
+	
+	__atomic_add_fetch(&op->count, 1, __ATOMIC_RELAXED);
+	if(is_error) __atomic_add_fetch(&op->errors, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&op->total_usec, (uint64_t)usec, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&op->histogram[index], 1, __ATOMIC_RELAXED);
+	
+	uint64_t max_usec = __atomic_load_n(&op->max_usec, __ATOMIC_RELAXED);
+	while((uint64_t)usec > max_usec 
+		&& !__atomic_compare_exchange_n(&op->max_usec, &max_usec, (uint64_t)usec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void db_stats_op_copy(struct db_stats_op * dst, struct db_stats_op * src)
+{
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->errors = __atomic_load_n(&src->errors, __ATOMIC_RELAXED);
+	dst->total_usec = __atomic_load_n(&src->total_usec, __ATOMIC_RELAXED);
+	dst->max_usec = __atomic_load_n(&src->max_usec, __ATOMIC_RELAXED);
+	for(int i = 0; i < DB_STATS_HISTOGRAM_SIZE; ++i) {
+		dst->histogram[i] = __atomic_load_n(&src->histogram[i], __ATOMIC_RELAXED);
+	}
+}
+
+json_object * db_stats_op_to_json(const struct db_stats_op * op)
+{
+	json_object * jop = json_object_new_object();
+	json_object_object_add(jop, "count", json_object_new_int64(op->count));
+	json_object_object_add(jop, "errors", json_object_new_int64(op->errors));
+	json_object_object_add(jop, "total_usec", json_object_new_int64(op->total_usec));
+	json_object_object_add(jop, "avg_usec", json_object_new_double(op->count?((double)op->total_usec / (double)op->count):0.0));
+	json_object_object_add(jop, "max_usec", json_object_new_int64(op->max_usec));
+	
+	// trim the empty tail of the histogram
+	int num_buckets = DB_STATS_HISTOGRAM_SIZE;
+	while(num_buckets > 0 && 0 == op->histogram[num_buckets - 1]) --num_buckets;
+	
+	json_object * jhistogram = json_object_new_array();
+	for(int i = 0; i < num_buckets; ++i) {
+		json_object_array_add(jhistogram, json_object_new_int64(op->histogram[i]));
+	}
+	json_object_object_add(jop, "histogram_log2_usec", jhistogram);
+	return jop;
+}
+
 
 
 
@@ -107,9 +187,13 @@ static int txn_commit(struct db_engine_txn * txn, int flags)
 	int rc = -1;
 	DB_TXN * db_txn = txn->priv;
 	if(db_txn) {
+		int64_t begin = db_stats_clock_usec();
 		rc = db_txn->commit(db_txn, flags);
 		txn->priv = NULL;
 		db_check_error(rc, "%s() failed: ", __FUNCTION__);
+		
+		db_engine_private_t * engine_priv = txn->engine->priv;
+		if(engine_priv) db_stats_op_record(engine_priv->txn_commit_stats, begin, rc);
 	}
 	return rc;
 }
@@ -118,6 +202,9 @@ static int txn_abort(struct db_engine_txn * txn)
 	int rc = -1;
 	DB_TXN * db_txn = txn->priv;
 	if(db_txn) {
+		db_engine_private_t * engine_priv = txn->engine->priv;
+		if(engine_priv) __atomic_add_fetch(&engine_priv->txn_aborts, 1, __ATOMIC_RELAXED);
+		
 		rc = db_txn->abort(db_txn);
 		txn->priv = NULL;
 		db_check_error(rc, "%s() failed: ", __FUNCTION__);
@@ -208,6 +295,7 @@ typedef struct db_private
 	char name[PATH_MAX];
 	
 	db_associate_callback associate_func;
+	db_handle_stats_t stats[1];
 }db_private_t;
 static inline DB * db_get_handle(struct db_handle * db) 
 { 
@@ -273,6 +361,7 @@ static int db_open(struct db_handle * db, db_engine_txn_t * txn, const char * na
 	}
 	
 	assert(priv->db_type != DB_UNKNOWN);
+	strncpy(priv->name, name, sizeof(priv->name) - 1);
 	
 	if(flags & db_flags_dup_sort) {
 		dbp->set_flags(dbp, DB_DUPSORT);
@@ -669,6 +758,78 @@ static int db_del(struct db_handle * db, db_engine_txn_t * _txn, const db_record
 }
 
 
+/*
+ * instrumented methods
+ */
+#define db_get_stats_op(db, type) &((db_private_t *)(db)->priv)->stats->ops[type]
+
+static ssize_t db_find_with_stats(struct db_handle * db, db_engine_txn_t * txn, 
+	const db_record_data_t * key, 
+	db_record_data_t ** p_values)
+{
+	int64_t begin = db_stats_clock_usec();
+	ssize_t count = db_find(db, txn, key, p_values);
+	db_stats_op_record(db_get_stats_op(db, db_stats_op_find), begin, (count < 0));
+	return count;
+}
+
+static ssize_t db_find_secondary_with_stats(struct db_handle * db, db_engine_txn_t * txn, 
+	const db_record_data_t * skey,
+	db_record_data_t ** p_keys,
+	db_record_data_t ** p_values)
+{
+	int64_t begin = db_stats_clock_usec();
+	ssize_t count = db_find_secondary(db, txn, skey, p_keys, p_values);
+	db_stats_op_record(db_get_stats_op(db, db_stats_op_find_secondary), begin, (count < 0));
+	return count;
+}
+
+static int db_insert_with_stats(struct db_handle * db, db_engine_txn_t * txn, 
+	const db_record_data_t * key, 
+	const db_record_data_t * value)
+{
+	int64_t begin = db_stats_clock_usec();
+	int rc = db_insert(db, txn, key, value);
+	db_stats_op_record(db_get_stats_op(db, db_stats_op_insert), begin, rc);
+	return rc;
+}
+
+static int db_update_with_stats(struct db_handle * db, db_engine_txn_t * txn, 
+	const db_record_data_t * key, 
+	const db_record_data_t * value)
+{
+	int64_t begin = db_stats_clock_usec();
+	int rc = db_update(db, txn, key, value);
+	db_stats_op_record(db_get_stats_op(db, db_stats_op_update), begin, rc);
+	return rc;
+}
+
+static int db_del_with_stats(struct db_handle * db, db_engine_txn_t * txn, const db_record_data_t * key)
+{
+	int64_t begin = db_stats_clock_usec();
+	int rc = db_del(db, txn, key);
+	db_stats_op_record(db_get_stats_op(db, db_stats_op_del), begin, rc);
+	return rc;
+}
+
+static int db_get_stats(struct db_handle * db, db_handle_stats_t * stats)
+{
+	assert(db && db->priv && stats);
+	db_private_t * priv = db->priv;
+	for(int i = 0; i < db_stats_op_types_count; ++i) {
+		db_stats_op_copy(&stats->ops[i], &priv->stats->ops[i]);
+	}
+	return 0;
+}
+
+static void db_reset_stats(struct db_handle * db)
+{
+	assert(db && db->priv);
+	db_private_t * priv = db->priv;
+	memset(priv->stats, 0, sizeof(priv->stats));
+}
+
+static int db_cursor_open(struct db_handle * db, db_engine_txn_t * txn, struct db_cursor * cursor, int flags);
 db_handle_t * db_handle_init(db_handle_t * db, db_engine_t * engine, void * user_data)
 {
 	if(NULL == db) db = calloc(1, sizeof(*db));
@@ -679,11 +840,15 @@ db_handle_t * db_handle_init(db_handle_t * db, db_engine_t * engine, void * user
 	db->open = db_open;
 	db->associate = db_associate;
 	db->close = db_close;
-	db->find = db_find;
-	db->find_secondary = db_find_secondary;
-	db->insert = db_insert;
-	db->update = db_update;
-	db->del = db_del;
+	db->find = db_find_with_stats;
+	db->find_secondary = db_find_secondary_with_stats;
+	db->insert = db_insert_with_stats;
+	db->update = db_update_with_stats;
+	db->del = db_del_with_stats;
+	
+	db->get_stats = db_get_stats;
+	db->reset_stats = db_reset_stats;
+	db->cursor_open = db_cursor_open;
 	
 	db_private_t * priv = db_private_new(db);
 	assert(priv && db->priv == priv);
@@ -711,6 +876,7 @@ static inline void db_cursor_clear_data(struct db_cursor * cursor)
 static inline int db_cursor_op(struct db_cursor * cursor, u_int32_t flags)
 {
 	int rc = -1;
+	int64_t begin = db_stats_clock_usec();
 	
 	DBC * cursorp = cursor->priv;
 	DBT skey, key, value;
@@ -760,6 +926,8 @@ static inline int db_cursor_op(struct db_cursor * cursor, u_int32_t flags)
 	if(key.flags & DB_DBT_MALLOC) 	free(key.data);
 	if(skey.flags & DB_DBT_MALLOC) 	free(skey.data);
 	if(value.flags & DB_DBT_MALLOC) free(value.data);
+	
+	db_stats_op_record(db_get_stats_op(cursor->db, db_stats_op_cursor), begin, (rc && rc != DB_NOTFOUND));
 	return rc;
 }
 
@@ -819,18 +987,200 @@ static int db_cursor_del(struct db_cursor * cursor)
 	return cursorp->del(cursorp, 0);
 }
 
-db_cursor_t * db_cursor_init(db_cursor_t * cursor, db_handle_t * db, db_engine_txn_t * txn, int flags)
+/*
+ * bulk scan: fetch pages of records with DB_MULTIPLE_KEY
+ */
+static inline int db_record_data_compare(const void * a, ssize_t a_size, const void * b, ssize_t b_size)
 {
-	assert(db);
+	// the default comparison of btree: lexicographic, shorter keys first
+	ssize_t size = (a_size < b_size)?a_size:b_size;
+	int rc = (size > 0)?memcmp(a, b, size):0;
+	if(rc) return rc;
+	return (a_size > b_size) - (a_size < b_size);
+}
+
+int db_scan_check_record(const db_scan_options_t * options, int is_sorted,
+	const db_record_data_t * key, const db_record_data_t * value)
+{
+	if(NULL == options) return 1;
+	
+	if(options->lower && db_record_data_compare(key->data, key->size, options->lower->data, options->lower->size) < 0) return 0;
+	if(options->upper && db_record_data_compare(key->data, key->size, options->upper->data, options->upper->size) >= 0) {
+		return is_sorted?-1:0;
+	}
+	
+	if(options->prefix && options->prefix_size > 0) {
+		if(key->size < options->prefix_size || memcmp(key->data, options->prefix, options->prefix_size)) {
+			if(!is_sorted) return 0;
+			// all keys with the prefix have been passed
+			if(db_record_data_compare(key->data, key->size, options->prefix, options->prefix_size) > 0) return -1;
+			return 0;
+		}
+	}
+	
+	if(options->filter && !options->filter(key, value, options->user_data)) return 0;
+	return 1;
+}
+
+typedef struct db_cursor_scan_ctx
+{
+	db_scan_options_t options[1];
+	int is_sorted;
+	
+	DBT buffer;		// DB_DBT_USERMEM, reused by all pages
+	void * p;		// DB_MULTIPLE_KEY iterator of the current page
+	int started;
+	int eof;
+}db_cursor_scan_ctx_t;
+
+static void db_cursor_scan_end(struct db_cursor * cursor)
+{
+	db_cursor_scan_ctx_t * ctx = cursor->scan_ctx;
+	if(NULL == ctx) return;
+	
+	free(ctx->buffer.data);
+	free(ctx);
+	cursor->scan_ctx = NULL;
+	return;
+}
+
+static int db_cursor_scan_begin(struct db_cursor * cursor, const db_scan_options_t * options)
+{
+	assert(cursor && cursor->priv && cursor->db);
+	db_cursor_scan_end(cursor);
+	
+	db_cursor_scan_ctx_t * ctx = calloc(1, sizeof(*ctx));
+	assert(ctx);
+	if(options) *ctx->options = *options;
+	ctx->is_sorted = (((db_private_t *)cursor->db->priv)->db_type == DB_BTREE);
+	
+	// the buffer size must be a multiple of 1024
+	ssize_t size = ctx->options->buffer_size;
+	if(size <= 0) size = DB_SCAN_DEFAULT_BUFFER_SIZE;
+	size = (size + 1023) / 1024 * 1024;
+	
+	ctx->buffer.data = malloc(size);
+	assert(ctx->buffer.data);
+	ctx->buffer.ulen = size;
+	ctx->buffer.flags = DB_DBT_USERMEM;
+	
+	cursor->scan_ctx = ctx;
+	return 0;
+}
+
+static int db_cursor_scan_fetch(struct db_cursor * cursor, db_cursor_scan_ctx_t * ctx)
+{
+	int64_t begin = db_stats_clock_usec();
+	DBC * cursorp = cursor->priv;
+	u_int32_t flags = DB_NEXT;
+	
+	DBT key;
+	memset(&key, 0, sizeof(key));
+	
+	const void * start = NULL;
+	if(!ctx->started) {
+		flags = DB_FIRST;
+		if(ctx->is_sorted) {
+			// start at max(lower, prefix)
+			const db_scan_options_t * options = ctx->options;
+			ssize_t start_size = 0;
+			if(options->lower) {
+				start = options->lower->data;
+				start_size = options->lower->size;
+			}
+			if(options->prefix && options->prefix_size > 0 
+				&& (NULL == start || db_record_data_compare(options->prefix, options->prefix_size, start, start_size) > 0))
+			{
+				start = options->prefix;
+				start_size = options->prefix_size;
+			}
+			if(start) {
+				flags = DB_SET_RANGE;
+				key.data = (void *)start;
+				key.size = start_size;
+				key.flags = DB_DBT_MALLOC;
+			}
+		}
+	}
+	
+	int rc = 0;
+	while(1)
+	{
+		rc = cursorp->get(cursorp, &key, &ctx->buffer, flags | DB_MULTIPLE_KEY);
+		if(rc != DB_BUFFER_SMALL) break;
+		
+		// a single record is larger than the buffer
+		u_int32_t new_size = (ctx->buffer.size + 1023) / 1024 * 1024;
+		if(new_size < ctx->buffer.ulen * 2) new_size = ctx->buffer.ulen * 2;
+		void * data = realloc(ctx->buffer.data, new_size);
+		assert(data);
+		ctx->buffer.data = data;
+		ctx->buffer.ulen = new_size;
+	}
+	if((key.flags & DB_DBT_MALLOC) && key.data != start) free(key.data);
+	
+	ctx->started = 1;
+	if(rc) {
+		if(rc != DB_NOTFOUND) db_check_error(rc, "cursorp->get(DB_MULTIPLE_KEY)=%d: ", rc);
+		ctx->p = NULL;
+		ctx->eof = 1;
+	}else {
+		DB_MULTIPLE_INIT(ctx->p, &ctx->buffer);
+	}
+	
+	db_stats_op_record(db_get_stats_op(cursor->db, db_stats_op_cursor), begin, (rc && rc != DB_NOTFOUND));
+	return rc;
+}
+
+static int db_cursor_scan_next(struct db_cursor * cursor, db_record_data_t * key, db_record_data_t * value)
+{
+	assert(cursor && key && value);
+	db_cursor_scan_ctx_t * ctx = cursor->scan_ctx;
+	if(NULL == ctx) return -1;
+	
+	while(!ctx->eof)
+	{
+		if(NULL == ctx->p) {
+			int rc = db_cursor_scan_fetch(cursor, ctx);
+			if(rc) return rc;
+		}
+		
+		void * key_data = NULL, * value_data = NULL;
+		u_int32_t key_size = 0, value_size = 0;
+		DB_MULTIPLE_KEY_NEXT(ctx->p, &ctx->buffer, key_data, key_size, value_data, value_size);
+		if(NULL == key_data) continue;	// end of the page
+		
+		*key = (db_record_data_t){ .data = key_data, .size = key_size };
+		*value = (db_record_data_t){ .data = value_data, .size = value_size };
+		
+		int match = db_scan_check_record(ctx->options, ctx->is_sorted, key, value);
+		if(match > 0) return 0;
+		if(match < 0) ctx->eof = 1;
+	}
+	return DB_NOTFOUND;
+}
+
+static void db_cursor_close(struct db_cursor * cursor)
+{
+	db_cursor_scan_end(cursor);
+	
+	DBC * cursorp = cursor->priv;
+	cursorp->close(cursorp);
+	cursor->priv = NULL;
+	
+	db_cursor_clear_data(cursor);
+	return;
+}
+
+static int db_cursor_open(struct db_handle * db, db_engine_txn_t * txn, struct db_cursor * cursor, int flags)
+{
+	assert(db && cursor);
 	DB * dbp = db_get_handle(db);
 	assert(dbp);
 	
 	DBC * cursorp = NULL;
 	int rc = dbp->cursor(dbp, db_txn_get_handle(txn), &cursorp, DB_READ_COMMITTED);
-	if(rc) return NULL;
-	
-	if(NULL == cursor) cursor = calloc(1, sizeof(*cursor));
-	assert(cursor);
+	if(rc) return rc;
 	
 	cursor->priv = cursorp;
 	cursor->db = db;
@@ -845,17 +1195,34 @@ db_cursor_t * db_cursor_init(db_cursor_t * cursor, db_handle_t * db, db_engine_t
 	cursor->move_to = db_cursor_move_to;
 	cursor->set = db_cursor_set;
 	cursor->del = db_cursor_del;
-	return cursor;
+	cursor->close = db_cursor_close;
+	
+	cursor->scan_begin = db_cursor_scan_begin;
+	cursor->scan_next = db_cursor_scan_next;
+	cursor->scan_end = db_cursor_scan_end;
+	return 0;
 }
 
-void db_cursor_cleanup(db_cursor_t * cursor)
+db_cursor_t * db_cursor_init(db_cursor_t * cursor, db_handle_t * db, db_engine_txn_t * txn, int flags)
 {
-	if(NULL == cursor || NULL == cursor->priv) return;
+	assert(db && db->cursor_open);
 	
-	DBC * cursorp = cursor->priv;
-	cursorp->close(cursorp);
+	db_cursor_t * new_cursor = cursor;
+	if(NULL == new_cursor) new_cursor = calloc(1, sizeof(*new_cursor));
+	assert(new_cursor);
 	
-	db_cursor_clear_data(cursor);
+	int rc = db->cursor_open(db, txn, new_cursor, flags);
+	if(rc) {
+		if(new_cursor != cursor) free(new_cursor);
+		return NULL;
+	}
+	return new_cursor;
+}
+
+void db_cursor_cleanup(db_cursor_t * cursor)
+{
+	if(NULL == cursor || NULL == cursor->priv) return;
+	if(cursor->close) cursor->close(cursor);
 	return;
 }
 
@@ -1066,6 +1433,111 @@ static void engine_txn_free(struct db_engine * engine, db_engine_txn_t * txn)
 	return;
 }
 
+static json_object * engine_get_stats(struct db_engine * engine)
+{
+	assert(engine && engine->priv);
+	db_engine_private_t * priv = engine->priv;
+	DB_ENV * env = priv->env;
+	assert(env);
+	int rc = 0;
+	
+	json_object * jstats = json_object_new_object();
+	json_object_object_add(jstats, "home_dir", json_object_new_string(priv->home_dir));
+	
+	// memory pool (cache)
+	DB_MPOOL_STAT * mpool_stat = NULL;
+	rc = env->memp_stat(env, &mpool_stat, NULL, 0);
+	db_check_error(rc, "env->memp_stat() failed: ");
+	if(0 == rc && mpool_stat) {
+		json_object * jmpool = json_object_new_object();
+		uint64_t hits = mpool_stat->st_cache_hit;
+		uint64_t misses = mpool_stat->st_cache_miss;
+		
+		json_object_object_add(jmpool, "cache_size", 
+			json_object_new_int64((int64_t)mpool_stat->st_gbytes * 1024 * 1024 * 1024 + mpool_stat->st_bytes));
+		json_object_object_add(jmpool, "num_caches", json_object_new_int64(mpool_stat->st_ncache));
+		json_object_object_add(jmpool, "pages", json_object_new_int64(mpool_stat->st_pages));
+		json_object_object_add(jmpool, "cache_hit", json_object_new_int64(hits));
+		json_object_object_add(jmpool, "cache_miss", json_object_new_int64(misses));
+		json_object_object_add(jmpool, "hit_ratio", json_object_new_double((hits + misses)?((double)hits / (double)(hits + misses)):0.0));
+		json_object_object_add(jmpool, "page_in", json_object_new_int64(mpool_stat->st_page_in));
+		json_object_object_add(jmpool, "page_out", json_object_new_int64(mpool_stat->st_page_out));
+		json_object_object_add(jmpool, "ro_evict", json_object_new_int64(mpool_stat->st_ro_evict));
+		json_object_object_add(jmpool, "rw_evict", json_object_new_int64(mpool_stat->st_rw_evict));
+		json_object_object_add(jstats, "mpool", jmpool);
+	}
+	free(mpool_stat);
+	
+	// log
+	DB_LOG_STAT * log_stat = NULL;
+	rc = env->log_stat(env, &log_stat, 0);
+	db_check_error(rc, "env->log_stat() failed: ");
+	if(0 == rc && log_stat) {
+		json_object * jlog = json_object_new_object();
+		json_object_object_add(jlog, "bytes_written", 
+			json_object_new_int64((int64_t)log_stat->st_w_mbytes * 1024 * 1024 + log_stat->st_w_bytes));
+		json_object_object_add(jlog, "bytes_since_checkpoint", 
+			json_object_new_int64((int64_t)log_stat->st_wc_mbytes * 1024 * 1024 + log_stat->st_wc_bytes));
+		json_object_object_add(jlog, "writes", json_object_new_int64(log_stat->st_wcount));
+		json_object_object_add(jlog, "syncs", json_object_new_int64(log_stat->st_scount));
+		json_object_object_add(jlog, "cur_file", json_object_new_int64(log_stat->st_cur_file));
+		json_object_object_add(jlog, "cur_offset", json_object_new_int64(log_stat->st_cur_offset));
+		json_object_object_add(jstats, "log", jlog);
+	}
+	free(log_stat);
+	
+	// transactions and checkpoint
+	json_object * jtxn = json_object_new_object();
+	DB_TXN_STAT * txn_stat = NULL;
+	rc = env->txn_stat(env, &txn_stat, 0);
+	db_check_error(rc, "env->txn_stat() failed: ");
+	if(0 == rc && txn_stat) {
+		json_object_object_add(jtxn, "begins", json_object_new_int64(txn_stat->st_nbegins));
+		json_object_object_add(jtxn, "commits", json_object_new_int64(txn_stat->st_ncommits));
+		json_object_object_add(jtxn, "aborts", json_object_new_int64(txn_stat->st_naborts));
+		json_object_object_add(jtxn, "active", json_object_new_int64(txn_stat->st_nactive));
+		json_object_object_add(jtxn, "max_active", json_object_new_int64(txn_stat->st_maxnactive));
+		
+		json_object * jckp = json_object_new_object();
+		json_object_object_add(jckp, "file", json_object_new_int64(txn_stat->st_last_ckp.file));
+		json_object_object_add(jckp, "offset", json_object_new_int64(txn_stat->st_last_ckp.offset));
+		json_object_object_add(jckp, "time", json_object_new_int64((int64_t)txn_stat->st_time_ckp));
+		json_object_object_add(jtxn, "last_checkpoint", jckp);
+	}
+	free(txn_stat);
+	
+	struct db_stats_op commit_stats[1];
+	db_stats_op_copy(commit_stats, priv->txn_commit_stats);
+	json_object_object_add(jtxn, "commit_latency", db_stats_op_to_json(commit_stats));
+	json_object_object_add(jtxn, "engine_aborts", json_object_new_int64(__atomic_load_n(&priv->txn_aborts, __ATOMIC_RELAXED)));
+	json_object_object_add(jstats, "txn", jtxn);
+	
+	// databases
+	json_object * jdbs = json_object_new_array();
+	global_lock();
+	for(int i = 0; i < priv->count; ++i)
+	{
+		db_handle_t * db = priv->databases[i];
+		if(NULL == db || NULL == db->priv) continue;
+		
+		db_handle_stats_t stats[1];
+		db->get_stats(db, stats);
+		
+		json_object * jdb = json_object_new_object();
+		json_object_object_add(jdb, "name", json_object_new_string(((db_private_t *)db->priv)->name));
+		for(int type = 0; type < db_stats_op_types_count; ++type)
+		{
+			if(0 == stats->ops[type].count) continue;
+			json_object_object_add(jdb, db_stats_op_type_to_string(type), db_stats_op_to_json(&stats->ops[type]));
+		}
+		json_object_array_add(jdbs, jdb);
+	}
+	global_unlock();
+	json_object_object_add(jstats, "databases", jdbs);
+	
+	return jstats;
+}
+
 static db_engine_t g_db_engine[1] = {{
 	.set_home = engine_set_home,
 	.open_db = engine_open_db,
@@ -1076,6 +1548,8 @@ static db_engine_t g_db_engine[1] = {{
 	
 	.txn_new = engine_txn_new,
 	.txn_free = engine_txn_free,
+	
+	.get_stats = engine_get_stats,
 }};
 
 
@@ -1348,9 +1822,48 @@ int main(int argc, char **argv)
 		rc = cursor->next(cursor);
 	}
 	
+	// bulk scan
+	printf("==== TEST db_cursor bulk scan ====\n");
+	ssize_t num_records = 0;
+	db_record_data_t key[1], value[1];
+	rc = cursor->scan_begin(cursor, NULL);
+	assert(0 == rc);
+	while(0 == (rc = cursor->scan_next(cursor, key, value))) ++num_records;
+	assert(rc == DB_NOTFOUND && num_records == 12);
+	
+	// only the orphan blocks: the keys start with (2000 + height + 1)
+	int orphan_key = 2004;
+	num_records = 0;
+	rc = cursor->scan_begin(cursor, &(db_scan_options_t){
+		.prefix = &orphan_key, .prefix_size = sizeof(orphan_key),
+		.buffer_size = 4096,
+	});
+	assert(0 == rc);
+	while(0 == (rc = cursor->scan_next(cursor, key, value)))
+	{
+		struct db_record_block_data * data = value->data;
+		printf("scan: key: %d, value: height=%d, timestamp=%d\n", *(int *)key->data, data->height, data->hdr.timestamp);
+		assert(*(int *)key->data == orphan_key && data->height == 3);
+		++num_records;
+	}
+	assert(num_records == 1);
+	cursor->scan_end(cursor);
+	
 	db_cursor_cleanup(cursor);
 	free(cursor);
 	
+	// test statistics
+	printf("==== TEST statistics ====\n");
+	db_handle_stats_t stats[1];
+	db->get_stats(db, stats);
+	assert(stats->ops[db_stats_op_find].count == 1);
+	assert(stats->ops[db_stats_op_cursor].count > 0);
+	
+	json_object * jstats = engine->get_stats(engine);
+	assert(jstats);
+	printf("%s\n", json_object_to_json_string_ext(jstats, JSON_C_TO_STRING_PRETTY));
+	json_object_put(jstats);
+	
 	// test add_ref / unref
 	db_engine_add_ref(engine);
 	db_engine_cleanup(engine);
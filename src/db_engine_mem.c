@@ -0,0 +1,2329 @@
+/*
+ * db_engine_mem.c
+ *
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <limits.h>
+
+#include <json-c/json.h>
+#include "db_engine.h"
+
+/**
+ * In-memory backend of db_engine_t / db_handle_t / db_cursor_t
+ *
+ * @details
+ *  MVCC: every record is an immutable version [begin_ts, end_ts).
+ *  - a version created (or deleted) by an uncommitted txn is marked by begin_txn (or end_txn),
+ *    and will be stamped with the commit_ts when the txn commits.
+ *  - readers see the versions committed before their snapshot (plus their own changes).
+ *  - write-write conflicts are detected on the latest version of a key (first-updater-wins).
+ *  - ended versions are garbage collected once no active snapshot can see them.
+ *
+ *  Storage:
+ *  - btree: records are sorted by (key, [value if dup_sort], begin_ts, seq)
+ *    and kept in pages of at most MEM_PAGE_SIZE records. (a two-level B+tree)
+ *  - hash: the same sorted arrays are used as the buckets of a hash table.
+ */
+
+#define MEM_TS_INFINITY			UINT64_MAX
+#define MEM_PAGE_SIZE			(256)
+#define MEM_HASH_INIT_SIZE		(64)
+#define MEM_HASH_LOAD_FACTOR	(4)
+#define MEM_ALLOC_SIZE			(16)
+
+/****************************************************************
+ * mem_record
+****************************************************************/
+typedef struct mem_record
+{
+	uint64_t begin_ts;		// MEM_TS_INFINITY while the creator is not committed
+	uint64_t end_ts;		// MEM_TS_INFINITY: not deleted (or deleted by an uncommitted txn)
+	uint64_t begin_txn;		// id of the uncommitted creator
+	uint64_t end_txn;		// id of the uncommitted deleter
+	uint64_t seq;			// creation order, the last sort key
+	long refs;
+
+	uint32_t key_size;
+	uint32_t value_size;
+	unsigned char * key;
+	unsigned char * value;
+	unsigned char data[0];
+}mem_record_t;
+
+static mem_record_t * mem_record_new(const void * key, size_t key_size, const void * value, size_t value_size)
+{
+	mem_record_t * rec = malloc(sizeof(*rec) + key_size + value_size);
+	assert(rec);
+	memset(rec, 0, sizeof(*rec));
+
+	rec->begin_ts = MEM_TS_INFINITY;
+	rec->end_ts = MEM_TS_INFINITY;
+	rec->refs = 1;
+
+	rec->key_size = key_size;
+	rec->value_size = value_size;
+	rec->key = rec->data;
+	rec->value = rec->data + key_size;
+	if(key_size) memcpy(rec->key, key, key_size);
+	if(value_size) memcpy(rec->value, value, value_size);
+	return rec;
+}
+
+static inline void mem_record_ref(mem_record_t * rec)
+{
+	__atomic_add_fetch(&rec->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline void mem_record_unref(mem_record_t * rec)
+{
+	if(NULL == rec) return;
+	if(__atomic_sub_fetch(&rec->refs, 1, __ATOMIC_ACQ_REL) == 0) free(rec);
+}
+
+static inline int lex_compare(const void * a, size_t a_size, const void * b, size_t b_size)
+{
+	size_t size = (a_size < b_size)?a_size:b_size;
+	int rc = size?memcmp(a, b, size):0;
+	if(rc) return rc;
+	return (a_size > b_size) - (a_size < b_size);
+}
+
+/****************************************************************
+ * mem_store: sorted segments (btree pages or hash buckets)
+****************************************************************/
+typedef struct mem_search_key
+{
+	const void * key;
+	size_t key_size;
+	const void * value;		// NULL: before all values of the key (only used by dup_sort)
+	size_t value_size;
+	uint64_t ts;			// 0: before all versions
+	uint64_t seq;
+}mem_search_key_t;
+
+typedef struct mem_segment
+{
+	ssize_t count;
+	ssize_t max_size;
+	mem_record_t ** records;
+}mem_segment_t;
+
+typedef struct mem_store
+{
+	int is_hash;
+	int dup_sort;
+
+	ssize_t num_segments;
+	ssize_t max_segments;
+	mem_segment_t * segments;
+
+	ssize_t count;			// all versions
+	int64_t total_bytes;
+}mem_store_t;
+
+typedef struct mem_pos
+{
+	ssize_t seg;
+	ssize_t slot;
+}mem_pos_t;
+
+static inline uint64_t mem_hash(const void * data, size_t size)
+{
+	// FNV-1a
+	const unsigned char * p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < size; ++i) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static inline mem_search_key_t search_key_from_record(const mem_store_t * store, const mem_record_t * rec)
+{
+	return (mem_search_key_t){
+		.key = rec->key, .key_size = rec->key_size,
+		.value = store->dup_sort?rec->value:NULL, .value_size = rec->value_size,
+		.ts = rec->begin_ts, .seq = rec->seq
+	};
+}
+
+static int store_compare(const mem_store_t * store, const mem_search_key_t * t, const mem_record_t * rec)
+{
+	int rc = lex_compare(t->key, t->key_size, rec->key, rec->key_size);
+	if(rc) return rc;
+
+	if(store->dup_sort) {
+		if(NULL == t->value) return -1;
+		rc = lex_compare(t->value, t->value_size, rec->value, rec->value_size);
+		if(rc) return rc;
+	}
+	if(t->ts != rec->begin_ts) return (t->ts < rec->begin_ts)?-1:1;
+	if(t->seq != rec->seq) return (t->seq < rec->seq)?-1:1;
+	return 0;
+}
+
+static int segment_resize(mem_segment_t * seg, ssize_t new_size)
+{
+	if(new_size <= 0) new_size = MEM_ALLOC_SIZE;
+	else new_size = (new_size + MEM_ALLOC_SIZE - 1) / MEM_ALLOC_SIZE * MEM_ALLOC_SIZE;
+	if(new_size <= seg->max_size) return 0;
+
+	mem_record_t ** records = realloc(seg->records, new_size * sizeof(*records));
+	assert(records);
+	memset(records + seg->max_size, 0, (new_size - seg->max_size) * sizeof(*records));
+	seg->records = records;
+	seg->max_size = new_size;
+	return 0;
+}
+
+static ssize_t segment_lower_bound(const mem_store_t * store, const mem_segment_t * seg, const mem_search_key_t * t)
+{
+	ssize_t left = 0, right = seg->count;
+	while(left < right)
+	{
+		ssize_t mid = (left + right) / 2;
+		if(store_compare(store, t, seg->records[mid]) > 0) left = mid + 1;
+		else right = mid;
+	}
+	return left;
+}
+
+static void segment_insert_at(mem_segment_t * seg, ssize_t slot, mem_record_t * rec)
+{
+	segment_resize(seg, seg->count + 1);
+	if(slot < seg->count) memmove(&seg->records[slot + 1], &seg->records[slot], (seg->count - slot) * sizeof(*seg->records));
+	seg->records[slot] = rec;
+	++seg->count;
+}
+
+static int store_resize_segments(mem_store_t * store, ssize_t new_size)
+{
+	if(new_size <= 0) new_size = MEM_ALLOC_SIZE;
+	else new_size = (new_size + MEM_ALLOC_SIZE - 1) / MEM_ALLOC_SIZE * MEM_ALLOC_SIZE;
+	if(new_size <= store->max_segments) return 0;
+
+	mem_segment_t * segments = realloc(store->segments, new_size * sizeof(*segments));
+	assert(segments);
+	memset(segments + store->max_segments, 0, (new_size - store->max_segments) * sizeof(*segments));
+	store->segments = segments;
+	store->max_segments = new_size;
+	return 0;
+}
+
+static void store_init(mem_store_t * store, int is_hash, int dup_sort)
+{
+	memset(store, 0, sizeof(*store));
+	store->is_hash = is_hash;
+	store->dup_sort = dup_sort;
+
+	if(is_hash) {
+		store_resize_segments(store, MEM_HASH_INIT_SIZE);
+		store->num_segments = MEM_HASH_INIT_SIZE;
+	}
+}
+
+static void store_cleanup(mem_store_t * store)
+{
+	for(ssize_t i = 0; i < store->max_segments; ++i)
+	{
+		mem_segment_t * seg = &store->segments[i];
+		for(ssize_t j = 0; j < seg->count; ++j) mem_record_unref(seg->records[j]);
+		free(seg->records);
+	}
+	free(store->segments);
+	memset(store, 0, sizeof(*store));
+}
+
+static ssize_t store_find_segment(const mem_store_t * store, const mem_search_key_t * t)
+{
+	if(store->is_hash) return mem_hash(t->key, t->key_size) & (store->num_segments - 1);
+	if(store->num_segments == 0) return -1;
+
+	// the first page whose last record >= t
+	ssize_t left = 0, right = store->num_segments - 1;
+	while(left < right)
+	{
+		ssize_t mid = (left + right) / 2;
+		const mem_segment_t * seg = &store->segments[mid];
+		if(seg->count > 0 && store_compare(store, t, seg->records[seg->count - 1]) > 0) left = mid + 1;
+		else right = mid;
+	}
+	return left;
+}
+
+static inline void store_normalize_forward(const mem_store_t * store, mem_pos_t * pos)
+{
+	while(pos->seg < store->num_segments && pos->slot >= store->segments[pos->seg].count)
+	{
+		++pos->seg;
+		pos->slot = 0;
+	}
+}
+
+static inline void store_normalize_backward(const mem_store_t * store, mem_pos_t * pos)
+{
+	while(pos->seg >= 0 && pos->slot < 0)
+	{
+		--pos->seg;
+		pos->slot = (pos->seg >= 0)?(store->segments[pos->seg].count - 1):-1;
+	}
+}
+
+static inline mem_record_t * store_get(const mem_store_t * store, const mem_pos_t * pos)
+{
+	if(pos->seg < 0 || pos->seg >= store->num_segments) return NULL;
+	const mem_segment_t * seg = &store->segments[pos->seg];
+	if(pos->slot < 0 || pos->slot >= seg->count) return NULL;
+	return seg->records[pos->slot];
+}
+
+static inline void store_forward(const mem_store_t * store, mem_pos_t * pos)
+{
+	++pos->slot;
+	store_normalize_forward(store, pos);
+}
+
+static inline void store_backward(const mem_store_t * store, mem_pos_t * pos)
+{
+	--pos->slot;
+	store_normalize_backward(store, pos);
+}
+
+static inline void store_first(const mem_store_t * store, mem_pos_t * pos)
+{
+	pos->seg = 0;
+	pos->slot = 0;
+	store_normalize_forward(store, pos);
+}
+
+static inline void store_last(const mem_store_t * store, mem_pos_t * pos)
+{
+	pos->seg = store->num_segments - 1;
+	pos->slot = (pos->seg >= 0)?(store->segments[pos->seg].count - 1):-1;
+	store_normalize_backward(store, pos);
+}
+
+static void store_lower_bound(const mem_store_t * store, const mem_search_key_t * t, mem_pos_t * pos)
+{
+	pos->seg = store_find_segment(store, t);
+	pos->slot = 0;
+	if(pos->seg < 0) { pos->seg = 0; return; }
+
+	pos->slot = segment_lower_bound(store, &store->segments[pos->seg], t);
+	store_normalize_forward(store, pos);
+}
+
+static void store_rehash(mem_store_t * store, ssize_t new_size)
+{
+	assert(store->is_hash && (new_size & (new_size - 1)) == 0);
+	mem_segment_t * old_segments = store->segments;
+	ssize_t old_size = store->num_segments;
+	ssize_t old_max = store->max_segments;
+
+	store->segments = NULL;
+	store->max_segments = 0;
+	store_resize_segments(store, new_size);
+	store->num_segments = new_size;
+
+	// new_size is a multiple of old_size,
+	// the records of an old bucket will be appended to the new buckets in order.
+	for(ssize_t i = 0; i < old_size; ++i)
+	{
+		mem_segment_t * seg = &old_segments[i];
+		for(ssize_t j = 0; j < seg->count; ++j)
+		{
+			mem_record_t * rec = seg->records[j];
+			mem_segment_t * dst = &store->segments[mem_hash(rec->key, rec->key_size) & (new_size - 1)];
+			segment_insert_at(dst, dst->count, rec);
+		}
+	}
+	for(ssize_t i = 0; i < old_max; ++i) free(old_segments[i].records);
+	free(old_segments);
+}
+
+static void store_split_page(mem_store_t * store, ssize_t index)
+{
+	store_resize_segments(store, store->num_segments + 1);
+	if(index + 1 < store->num_segments) {
+		memmove(&store->segments[index + 2], &store->segments[index + 1],
+			(store->num_segments - index - 1) * sizeof(*store->segments));
+	}
+	++store->num_segments;
+
+	mem_segment_t * seg = &store->segments[index];
+	mem_segment_t * new_seg = &store->segments[index + 1];
+	memset(new_seg, 0, sizeof(*new_seg));
+
+	ssize_t half = seg->count / 2;
+	segment_resize(new_seg, seg->count - half);
+	memcpy(new_seg->records, &seg->records[half], (seg->count - half) * sizeof(*seg->records));
+	new_seg->count = seg->count - half;
+	seg->count = half;
+}
+
+static void store_insert(mem_store_t * store, mem_record_t * rec)
+{
+	mem_search_key_t t = search_key_from_record(store, rec);
+	if(store->is_hash) {
+		if((store->count + 1) > store->num_segments * MEM_HASH_LOAD_FACTOR) store_rehash(store, store->num_segments * 2);
+	}else if(store->num_segments == 0) {
+		store_resize_segments(store, 1);
+		store->num_segments = 1;
+	}
+
+	ssize_t index = store_find_segment(store, &t);
+	assert(index >= 0);
+	mem_segment_t * seg = &store->segments[index];
+	ssize_t slot = segment_lower_bound(store, seg, &t);
+	segment_insert_at(seg, slot, rec);
+
+	++store->count;
+	store->total_bytes += sizeof(*rec) + rec->key_size + rec->value_size;
+
+	if(!store->is_hash && seg->count > MEM_PAGE_SIZE) store_split_page(store, index);
+}
+
+static int store_remove(mem_store_t * store, mem_record_t * rec)
+{
+	mem_search_key_t t = search_key_from_record(store, rec);
+	ssize_t index = store_find_segment(store, &t);
+	if(index < 0) return -1;
+
+	mem_segment_t * seg = &store->segments[index];
+	ssize_t slot = segment_lower_bound(store, seg, &t);
+	if(slot >= seg->count || seg->records[slot] != rec) return -1;
+
+	--seg->count;
+	if(slot < seg->count) memmove(&seg->records[slot], &seg->records[slot + 1], (seg->count - slot) * sizeof(*seg->records));
+	seg->records[seg->count] = NULL;
+
+	--store->count;
+	store->total_bytes -= sizeof(*rec) + rec->key_size + rec->value_size;
+
+	if(!store->is_hash && seg->count == 0 && store->num_segments > 1) {
+		free(seg->records);
+		--store->num_segments;
+		if(index < store->num_segments) {
+			memmove(&store->segments[index], &store->segments[index + 1], (store->num_segments - index) * sizeof(*store->segments));
+		}
+		memset(&store->segments[store->num_segments], 0, sizeof(*store->segments));
+	}
+	return 0;
+}
+
+/****************************************************************
+ * snapshots and transactions
+****************************************************************/
+struct mem_txn;
+typedef struct mem_snapshot
+{
+	uint64_t ts;
+	struct mem_txn * txn;		// nullable, the owner of uncommitted versions which are visible to this snapshot
+	struct mem_snapshot * prev;
+	struct mem_snapshot * next;
+}mem_snapshot_t;
+
+typedef struct mem_engine
+{
+	db_engine_t * engine;
+
+	pthread_mutex_t mutex;			// protects last_committed, snapshots and databases
+	pthread_mutex_t commit_mutex;
+	uint64_t last_committed;
+	uint64_t next_txn_id;
+	uint64_t next_seq;
+
+	mem_snapshot_t snapshots[1];	// list of active snapshots (sentinel)
+	ssize_t num_snapshots;
+
+	ssize_t max_size;
+	ssize_t count;
+	db_handle_t ** databases;
+
+	struct db_stats_op txn_commit_stats[1];
+	uint64_t txn_aborts;
+	uint64_t txn_conflicts;
+}mem_engine_t;
+
+struct mem_db;
+enum mem_write_type
+{
+	mem_write_type_insert = 1,
+	mem_write_type_delete = 2,
+};
+typedef struct mem_write
+{
+	struct mem_db * mdb;
+	mem_record_t * rec;
+	enum mem_write_type type;
+}mem_write_t;
+
+typedef struct mem_txn
+{
+	uint64_t id;
+	mem_engine_t * mem;
+	struct mem_txn * parent;
+	mem_snapshot_t snapshot[1];
+
+	ssize_t max_size;
+	ssize_t count;
+	mem_write_t * writes;
+
+	char name[256];
+}mem_txn_t;
+
+typedef struct mem_db
+{
+	db_handle_t * db;
+	mem_engine_t * mem;
+	pthread_rwlock_t rwlock;
+
+	char name[PATH_MAX];
+	int db_type;
+	mem_store_t store[1];
+
+	// ended versions, waiting for gc
+	ssize_t dead_max;
+	ssize_t dead_count;
+	mem_record_t ** dead;
+
+	// secondary index
+	struct mem_db * primary;
+	db_associate_callback associate_func;
+	ssize_t num_secondaries;
+	struct mem_db ** secondaries;
+
+	db_handle_stats_t stats[1];
+}mem_db_t;
+
+static void mem_snapshot_acquire(mem_engine_t * mem, mem_snapshot_t * snap, mem_txn_t * txn)
+{
+	pthread_mutex_lock(&mem->mutex);
+	snap->ts = mem->last_committed;
+	snap->txn = txn;
+
+	mem_snapshot_t * head = mem->snapshots;
+	snap->prev = head;
+	snap->next = head->next;
+	head->next->prev = snap;
+	head->next = snap;
+	++mem->num_snapshots;
+	pthread_mutex_unlock(&mem->mutex);
+}
+
+static void mem_snapshot_release(mem_engine_t * mem, mem_snapshot_t * snap)
+{
+	if(NULL == snap->prev) return;
+	pthread_mutex_lock(&mem->mutex);
+	snap->prev->next = snap->next;
+	snap->next->prev = snap->prev;
+	snap->prev = snap->next = NULL;
+	--mem->num_snapshots;
+	pthread_mutex_unlock(&mem->mutex);
+}
+
+static uint64_t mem_oldest_snapshot(mem_engine_t * mem)
+{
+	pthread_mutex_lock(&mem->mutex);
+	uint64_t ts = mem->last_committed;
+	for(mem_snapshot_t * snap = mem->snapshots->next; snap != mem->snapshots; snap = snap->next)
+	{
+		if(snap->ts < ts) ts = snap->ts;
+	}
+	pthread_mutex_unlock(&mem->mutex);
+	return ts;
+}
+
+static inline int txn_is_own(const mem_txn_t * txn, uint64_t txn_id)
+{
+	for(; txn; txn = txn->parent) if(txn->id == txn_id) return 1;
+	return 0;
+}
+
+static inline int record_is_visible(const mem_record_t * rec, const mem_snapshot_t * snap)
+{
+	if(rec->begin_txn) {
+		if(!txn_is_own(snap->txn, rec->begin_txn)) return 0;
+	}else if(rec->begin_ts > snap->ts) return 0;
+
+	if(rec->end_txn) return !txn_is_own(snap->txn, rec->end_txn);
+	return rec->end_ts > snap->ts;
+}
+
+/**
+ * check_conflict():
+ *   the latest version of a key was written by another txn,
+ *   which is either not committed, or committed after our snapshot.
+ */
+static inline int check_conflict(const mem_record_t * latest, const mem_txn_t * txn)
+{
+	if(NULL == latest) return 0;
+	if(latest->begin_txn) {
+		if(!txn_is_own(txn, latest->begin_txn)) return DB_ENGINE_ERR_CONFLICT;
+	}else if(latest->begin_ts > txn->snapshot->ts) return DB_ENGINE_ERR_CONFLICT;
+
+	if(latest->end_txn) {
+		if(!txn_is_own(txn, latest->end_txn)) return DB_ENGINE_ERR_CONFLICT;
+	}else if(latest->end_ts != MEM_TS_INFINITY && latest->end_ts > txn->snapshot->ts) return DB_ENGINE_ERR_CONFLICT;
+	return 0;
+}
+
+static inline int check_can_end(const mem_record_t * rec, const mem_txn_t * txn)
+{
+	if(rec->end_txn && !txn_is_own(txn, rec->end_txn)) return DB_ENGINE_ERR_CONFLICT;
+	if(rec->end_ts != MEM_TS_INFINITY) return DB_ENGINE_ERR_CONFLICT;
+	return 0;
+}
+
+static mem_txn_t * mem_txn_new(mem_engine_t * mem, mem_txn_t * parent)
+{
+	mem_txn_t * txn = calloc(1, sizeof(*txn));
+	assert(txn);
+	txn->mem = mem;
+	txn->parent = parent;
+	txn->id = __atomic_add_fetch(&mem->next_txn_id, 1, __ATOMIC_RELAXED);
+
+	if(parent) {	// shares the parent's snapshot
+		txn->snapshot->ts = parent->snapshot->ts;
+		txn->snapshot->txn = txn;
+	}else {
+		mem_snapshot_acquire(mem, txn->snapshot, txn);
+	}
+	return txn;
+}
+
+static void mem_txn_free(mem_txn_t * txn)
+{
+	if(NULL == txn) return;
+	if(NULL == txn->parent) mem_snapshot_release(txn->mem, txn->snapshot);
+	for(ssize_t i = 0; i < txn->count; ++i) mem_record_unref(txn->writes[i].rec);
+	free(txn->writes);
+	free(txn);
+}
+
+static void mem_txn_add_write(mem_txn_t * txn, mem_db_t * mdb, mem_record_t * rec, enum mem_write_type type)
+{
+	if(txn->count >= txn->max_size) {
+		ssize_t new_size = (txn->count + 1 + MEM_ALLOC_SIZE - 1) / MEM_ALLOC_SIZE * MEM_ALLOC_SIZE;
+		mem_write_t * writes = realloc(txn->writes, new_size * sizeof(*writes));
+		assert(writes);
+		txn->writes = writes;
+		txn->max_size = new_size;
+	}
+	mem_record_ref(rec);
+	txn->writes[txn->count++] = (mem_write_t){ .mdb = mdb, .rec = rec, .type = type };
+}
+
+static void mem_db_add_dead(mem_db_t * mdb, mem_record_t * rec)
+{
+	if(mdb->dead_count >= mdb->dead_max) {
+		ssize_t new_size = (mdb->dead_count + 1 + MEM_ALLOC_SIZE - 1) / MEM_ALLOC_SIZE * MEM_ALLOC_SIZE;
+		mem_record_t ** dead = realloc(mdb->dead, new_size * sizeof(*dead));
+		assert(dead);
+		mdb->dead = dead;
+		mdb->dead_max = new_size;
+	}
+	mdb->dead[mdb->dead_count++] = rec;
+}
+
+static void mem_db_gc(mem_db_t * mdb)
+{
+	uint64_t oldest = mem_oldest_snapshot(mdb->mem);
+
+	pthread_rwlock_wrlock(&mdb->rwlock);
+	ssize_t count = 0;
+	for(ssize_t i = 0; i < mdb->dead_count; ++i)
+	{
+		mem_record_t * rec = mdb->dead[i];
+		if(rec->end_ts <= oldest) {
+			int rc = store_remove(mdb->store, rec);
+			assert(0 == rc);
+			mem_record_unref(rec);
+			continue;
+		}
+		mdb->dead[count++] = rec;
+	}
+	mdb->dead_count = count;
+	pthread_rwlock_unlock(&mdb->rwlock);
+}
+
+static int mem_txn_commit(mem_txn_t * txn)
+{
+	mem_engine_t * mem = txn->mem;
+
+	if(txn->parent) { // merge into the parent
+		mem_txn_t * parent = txn->parent;
+		for(ssize_t i = 0; i < txn->count; ++i)
+		{
+			mem_write_t * write = &txn->writes[i];
+			pthread_rwlock_wrlock(&write->mdb->rwlock);
+			if(write->type == mem_write_type_insert) write->rec->begin_txn = parent->id;
+			else write->rec->end_txn = parent->id;
+			pthread_rwlock_unlock(&write->mdb->rwlock);
+
+			mem_txn_add_write(parent, write->mdb, write->rec, write->type);
+		}
+		mem_txn_free(txn);
+		return 0;
+	}
+
+	int64_t begin = db_stats_clock_usec();
+	pthread_mutex_lock(&mem->commit_mutex);
+	uint64_t commit_ts = mem->last_committed + 1;
+	for(ssize_t i = 0; i < txn->count; ++i)
+	{
+		mem_write_t * write = &txn->writes[i];
+		pthread_rwlock_wrlock(&write->mdb->rwlock);
+		if(write->type == mem_write_type_insert) {
+			// the sort order is kept: INFINITY ==> commit_ts, which is still the largest one of this key
+			write->rec->begin_ts = commit_ts;
+			write->rec->begin_txn = 0;
+		}else {
+			write->rec->end_ts = commit_ts;
+			write->rec->end_txn = 0;
+			mem_db_add_dead(write->mdb, write->rec);
+		}
+		pthread_rwlock_unlock(&write->mdb->rwlock);
+	}
+
+	// publish
+	pthread_mutex_lock(&mem->mutex);
+	mem->last_committed = commit_ts;
+	pthread_mutex_unlock(&mem->mutex);
+	pthread_mutex_unlock(&mem->commit_mutex);
+
+	mem_snapshot_release(mem, txn->snapshot);
+
+	// gc
+	for(ssize_t i = 0; i < txn->count; ++i)
+	{
+		mem_db_t * mdb = txn->writes[i].mdb;
+		int done = 0;
+		for(ssize_t j = 0; j < i; ++j) if(txn->writes[j].mdb == mdb) { done = 1; break; }
+		if(!done && mdb->dead_count > 0) mem_db_gc(mdb);
+	}
+
+	db_stats_op_record(mem->txn_commit_stats, begin, 0);
+	mem_txn_free(txn);
+	return 0;
+}
+
+static int mem_txn_abort(mem_txn_t * txn)
+{
+	mem_engine_t * mem = txn->mem;
+	for(ssize_t i = txn->count - 1; i >= 0; --i)
+	{
+		mem_write_t * write = &txn->writes[i];
+		pthread_rwlock_wrlock(&write->mdb->rwlock);
+		if(write->type == mem_write_type_insert) {
+			int rc = store_remove(write->mdb->store, write->rec);
+			assert(0 == rc);
+			mem_record_unref(write->rec);	// the reference held by the store
+		}else {
+			write->rec->end_txn = 0;
+		}
+		pthread_rwlock_unlock(&write->mdb->rwlock);
+	}
+	__atomic_add_fetch(&mem->txn_aborts, 1, __ATOMIC_RELAXED);
+	mem_txn_free(txn);
+	return 0;
+}
+
+/****************************************************************
+ * struct db_engine_txn
+****************************************************************/
+static int txn_begin(struct db_engine_txn * txn, struct db_engine_txn * parent_txn)
+{
+	assert(txn && txn->engine && txn->engine->priv);
+	assert(NULL == txn->priv);
+	txn->priv = mem_txn_new(txn->engine->priv, parent_txn?parent_txn->priv:NULL);
+	return 0;
+}
+static int txn_commit(struct db_engine_txn * txn, int flags)
+{
+	mem_txn_t * mtxn = txn->priv;
+	if(NULL == mtxn) return -1;
+	txn->priv = NULL;
+	return mem_txn_commit(mtxn);
+}
+static int txn_abort(struct db_engine_txn * txn)
+{
+	mem_txn_t * mtxn = txn->priv;
+	if(NULL == mtxn) return -1;
+	txn->priv = NULL;
+	return mem_txn_abort(mtxn);
+}
+static int txn_prepare(struct db_engine_txn * txn, unsigned char gid[])
+{
+	return txn->priv?0:-1;	// nothing to do, all changes are already in memory
+}
+static int txn_discard(struct db_engine_txn * txn)
+{
+	return txn_abort(txn);
+}
+static int txn_set_name(struct db_engine_txn * txn, const char * name)
+{
+	mem_txn_t * mtxn = txn->priv;
+	if(NULL == mtxn || NULL == name) return -1;
+	strncpy(mtxn->name, name, sizeof(mtxn->name) - 1);
+	return 0;
+}
+static const char * txn_get_name(struct db_engine_txn * txn)
+{
+	mem_txn_t * mtxn = txn->priv;
+	if(NULL == mtxn) return NULL;
+	return mtxn->name;
+}
+
+static db_engine_txn_t * mem_engine_txn_init(db_engine_txn_t * txn, db_engine_t * engine)
+{
+	if(NULL == txn) txn = calloc(1, sizeof(*txn));
+	assert(txn);
+	txn->engine = engine;
+
+	txn->begin = txn_begin;
+	txn->commit = txn_commit;
+	txn->abort = txn_abort;
+	txn->prepare = txn_prepare;
+	txn->discard = txn_discard;
+	txn->set_name = txn_set_name;
+	txn->get_name = txn_get_name;
+	return txn;
+}
+
+/****************************************************************
+ * struct db_handle
+****************************************************************/
+#define mem_db_get(db) ((mem_db_t *)(db)->priv)
+
+static inline void mem_record_data_set(db_record_data_t * result, const void * data, size_t size)
+{
+	if(result->data && (result->flags == 1 || result->size < (ssize_t)size)) {
+		if(result->flags == 1) {
+			void * p = realloc(result->data, size?size:1);
+			assert(p);
+			result->data = p;
+		}else {
+			result->data = NULL;
+		}
+	}
+	if(NULL == result->data) {
+		result->data = malloc(size?size:1);
+		assert(result->data);
+		result->flags = 1;
+	}
+	if(size) memcpy(result->data, data, size);
+	result->size = size;
+}
+
+// find the latest version of the key (or the (key, value) pair if dup_sort)
+static mem_record_t * store_find_latest(const mem_store_t * store,
+	const void * key, size_t key_size,
+	const void * value, size_t value_size)
+{
+	mem_search_key_t t = { .key = key, .key_size = key_size,
+		.value = store->dup_sort?value:NULL, .value_size = value_size };
+	mem_pos_t pos;
+	store_lower_bound(store, &t, &pos);
+
+	mem_record_t * latest = NULL;
+	mem_record_t * rec = NULL;
+	while((rec = store_get(store, &pos)))
+	{
+		if(lex_compare(key, key_size, rec->key, rec->key_size)) break;
+		if(store->dup_sort && lex_compare(value, value_size, rec->value, rec->value_size)) break;
+		latest = rec;
+		store_forward(store, &pos);
+	}
+	return latest;
+}
+
+// the first visible version of the key
+static mem_record_t * store_find_visible(const mem_store_t * store,
+	const void * key, size_t key_size,
+	const mem_snapshot_t * snap)
+{
+	mem_search_key_t t = { .key = key, .key_size = key_size };
+	mem_pos_t pos;
+	store_lower_bound(store, &t, &pos);
+
+	mem_record_t * rec = NULL;
+	while((rec = store_get(store, &pos)))
+	{
+		if(lex_compare(key, key_size, rec->key, rec->key_size)) return NULL;
+		if(record_is_visible(rec, snap)) return rec;
+		store_forward(store, &pos);
+	}
+	return NULL;
+}
+
+enum mem_put_flags
+{
+	mem_put_flags_no_overwrite = 0x01,
+	mem_put_flags_update_only = 0x02,
+	mem_put_flags_no_dup = 0x04,
+};
+
+/**
+ * mem_db_put_locked(): the caller must hold the write lock
+ */
+static int mem_db_put_locked(mem_db_t * mdb, mem_txn_t * txn,
+	const void * key, size_t key_size,
+	const void * value, size_t value_size,
+	int flags,
+	mem_record_t ** p_old)
+{
+	mem_store_t * store = mdb->store;
+	mem_snapshot_t * snap = txn->snapshot;
+	mem_record_t * old = NULL;
+	mem_record_t * latest = NULL;
+	int rc = 0;
+
+	if(!store->dup_sort) {
+		latest = store_find_latest(store, key, key_size, NULL, 0);
+		rc = check_conflict(latest, txn);
+		if(rc) return rc;
+		if(latest && record_is_visible(latest, snap)) old = latest;
+		if(old && (flags & mem_put_flags_no_overwrite)) return DB_ENGINE_ERR_KEYEXIST;
+	}else {
+		mem_record_t * first = store_find_visible(store, key, key_size, snap);
+		if(flags & mem_put_flags_update_only) {
+			old = first;
+			if(old && (rc = check_can_end(old, txn))) return rc;
+		}else if(first && (flags & (mem_put_flags_no_overwrite | mem_put_flags_no_dup))) {
+			return DB_ENGINE_ERR_KEYEXIST;
+		}
+
+		latest = store_find_latest(store, key, key_size, value, value_size);
+		rc = check_conflict(latest, txn);
+		if(rc) return rc;
+		if(latest && latest != old && record_is_visible(latest, snap)) return DB_ENGINE_ERR_KEYEXIST; // duplicated pair
+	}
+	if((flags & mem_put_flags_update_only) && NULL == old) return DB_ENGINE_ERR_NOTFOUND;
+
+	if(old) {
+		old->end_txn = txn->id;
+		mem_txn_add_write(txn, mdb, old, mem_write_type_delete);
+	}
+
+	mem_record_t * rec = mem_record_new(key, key_size, value, value_size);
+	rec->begin_txn = txn->id;
+	rec->seq = __atomic_add_fetch(&mdb->mem->next_seq, 1, __ATOMIC_RELAXED);
+	store_insert(store, rec);
+	mem_txn_add_write(txn, mdb, rec, mem_write_type_insert);
+
+	if(p_old) *p_old = old;
+	return 0;
+}
+
+static int mem_db_end_locked(mem_db_t * mdb, mem_txn_t * txn, mem_record_t * rec)
+{
+	int rc = check_can_end(rec, txn);
+	if(rc) return rc;
+	rec->end_txn = txn->id;
+	mem_txn_add_write(txn, mdb, rec, mem_write_type_delete);
+	return 0;
+}
+
+/*
+ * secondary index maintenance (called with the primary write lock held, lock order: primary ==> secondary)
+ */
+static ssize_t secondary_get_keys(mem_db_t * sdb, const mem_record_t * rec, db_record_data_t ** p_skeys)
+{
+	return sdb->associate_func(sdb->db,
+		&(db_record_data_t){ .data = rec->key, .size = rec->key_size },
+		&(db_record_data_t){ .data = rec->value, .size = rec->value_size },
+		p_skeys);
+}
+
+static void secondary_free_keys(db_record_data_t * skeys, ssize_t count)
+{
+	if(NULL == skeys) return;
+	for(ssize_t i = 0; i < count; ++i) db_record_data_cleanup(&skeys[i]);
+	free(skeys);
+}
+
+static int secondary_remove_locked(mem_db_t * sdb, mem_txn_t * txn, const mem_record_t * prec)
+{
+	int rc = 0;
+	db_record_data_t * skeys = NULL;
+	ssize_t count = secondary_get_keys(sdb, prec, &skeys);
+
+	for(ssize_t i = 0; i < count && 0 == rc; ++i)
+	{
+		mem_search_key_t t = { .key = skeys[i].data, .key_size = skeys[i].size,
+			.value = sdb->store->dup_sort?prec->key:NULL, .value_size = prec->key_size };
+		mem_pos_t pos;
+		store_lower_bound(sdb->store, &t, &pos);
+
+		mem_record_t * rec = NULL;
+		while((rec = store_get(sdb->store, &pos)))
+		{
+			if(lex_compare(t.key, t.key_size, rec->key, rec->key_size)) break;
+			if(record_is_visible(rec, txn->snapshot)
+				&& 0 == lex_compare(prec->key, prec->key_size, rec->value, rec->value_size))
+			{
+				rc = mem_db_end_locked(sdb, txn, rec);
+				break;
+			}
+			store_forward(sdb->store, &pos);
+		}
+	}
+	secondary_free_keys(skeys, count);
+	return rc;
+}
+
+static int secondary_add_locked(mem_db_t * sdb, mem_txn_t * txn, const mem_record_t * prec)
+{
+	int rc = 0;
+	db_record_data_t * skeys = NULL;
+	ssize_t count = secondary_get_keys(sdb, prec, &skeys);
+
+	for(ssize_t i = 0; i < count && 0 == rc; ++i)
+	{
+		rc = mem_db_put_locked(sdb, txn, skeys[i].data, skeys[i].size, prec->key, prec->key_size, 0, NULL);
+		if(rc == DB_ENGINE_ERR_KEYEXIST) rc = 0;
+	}
+	secondary_free_keys(skeys, count);
+	return rc;
+}
+
+static int mem_db_update_secondaries(mem_db_t * mdb, mem_txn_t * txn, const mem_record_t * old_rec, const mem_record_t * new_rec)
+{
+	int rc = 0;
+	for(ssize_t i = 0; i < mdb->num_secondaries && 0 == rc; ++i)
+	{
+		mem_db_t * sdb = mdb->secondaries[i];
+		pthread_rwlock_wrlock(&sdb->rwlock);
+		if(old_rec) rc = secondary_remove_locked(sdb, txn, old_rec);
+		if(0 == rc && new_rec) rc = secondary_add_locked(sdb, txn, new_rec);
+		pthread_rwlock_unlock(&sdb->rwlock);
+	}
+	return rc;
+}
+
+/*
+ * implicit transaction for the operations without txn
+ */
+static inline mem_txn_t * mem_txn_auto_begin(mem_db_t * mdb, db_engine_txn_t * txn, int * p_auto)
+{
+	*p_auto = 0;
+	if(txn) {
+		assert(txn->priv);
+		return txn->priv;
+	}
+	*p_auto = 1;
+	return mem_txn_new(mdb->mem, NULL);
+}
+
+static inline int mem_txn_auto_end(mem_txn_t * txn, int is_auto, int rc)
+{
+	if(!is_auto) return rc;
+	if(0 == rc) return mem_txn_commit(txn);
+	if(rc == DB_ENGINE_ERR_CONFLICT) __atomic_add_fetch(&txn->mem->txn_conflicts, 1, __ATOMIC_RELAXED);
+	mem_txn_abort(txn);
+	return rc;
+}
+
+static int mem_db_put(mem_db_t * mdb, db_engine_txn_t * _txn,
+	const db_record_data_t * key, const db_record_data_t * value,
+	int flags)
+{
+	if(mdb->primary) return -1;	// secondary databases are read-only
+
+	int is_auto = 0;
+	mem_txn_t * txn = mem_txn_auto_begin(mdb, _txn, &is_auto);
+
+	mem_record_t * old = NULL;
+	pthread_rwlock_wrlock(&mdb->rwlock);
+	int rc = mem_db_put_locked(mdb, txn, key->data, key->size, value->data, value->size, flags, &old);
+	if(0 == rc && mdb->num_secondaries > 0) {
+		mem_record_t * rec = txn->writes[txn->count - 1].rec;
+		rc = mem_db_update_secondaries(mdb, txn, old, rec);
+	}
+	pthread_rwlock_unlock(&mdb->rwlock);
+
+	return mem_txn_auto_end(txn, is_auto, rc);
+}
+
+static int mem_db_remove_key(mem_db_t * mdb, mem_txn_t * txn, const void * key, size_t key_size)
+{
+	int rc = DB_ENGINE_ERR_NOTFOUND;
+	mem_search_key_t t = { .key = key, .key_size = key_size };
+	mem_pos_t pos;
+
+	pthread_rwlock_wrlock(&mdb->rwlock);
+	store_lower_bound(mdb->store, &t, &pos);
+
+	mem_record_t * rec = NULL;
+	while((rec = store_get(mdb->store, &pos)))
+	{
+		if(lex_compare(key, key_size, rec->key, rec->key_size)) break;
+		if(record_is_visible(rec, txn->snapshot)) {
+			rc = mem_db_end_locked(mdb, txn, rec);
+			if(0 == rc && mdb->num_secondaries > 0) rc = mem_db_update_secondaries(mdb, txn, rec, NULL);
+			if(rc) break;
+		}
+		store_forward(mdb->store, &pos);
+	}
+
+	if(!mdb->store->dup_sort && rc == DB_ENGINE_ERR_NOTFOUND) {
+		// someone else may have inserted the key after our snapshot
+		int conflict = check_conflict(store_find_latest(mdb->store, key, key_size, NULL, 0), txn);
+		if(conflict) rc = conflict;
+	}
+	pthread_rwlock_unlock(&mdb->rwlock);
+	return rc;
+}
+
+static int mem_db_open(struct db_handle * db, db_engine_txn_t * txn, const char * name, int db_type, enum db_flags flags)
+{
+	assert(db && db->priv);
+	mem_db_t * mdb = db->priv;
+
+	if(db_type != db_format_type_btree && db_type != db_format_type_hash) return -1;
+	mdb->db_type = db_type;
+	if(name) strncpy(mdb->name, name, sizeof(mdb->name) - 1);
+
+	if(flags & db_flags_dup_sort) db->record_flags |= db_record_flags_multiple;
+
+	store_cleanup(mdb->store);
+	store_init(mdb->store, (db_type == db_format_type_hash), (flags & db_flags_dup_sort));
+	return 0;
+}
+
+static int mem_db_associate(struct db_handle * primary, db_engine_txn_t * _txn,
+	struct db_handle * secondary, db_associate_callback associated_by)
+{
+	mem_db_t * mdb = mem_db_get(primary);
+	mem_db_t * sdb = mem_db_get(secondary);
+	assert(mdb && sdb && associated_by);
+	if(sdb->primary) return -1;
+
+	sdb->primary = mdb;
+	sdb->associate_func = associated_by;
+
+	pthread_rwlock_wrlock(&mdb->rwlock);
+	mem_db_t ** secondaries = realloc(mdb->secondaries, (mdb->num_secondaries + 1) * sizeof(*secondaries));
+	assert(secondaries);
+	secondaries[mdb->num_secondaries++] = sdb;
+	mdb->secondaries = secondaries;
+
+	// build the index for all existing records (DB_CREATE)
+	int is_auto = 0;
+	mem_txn_t * txn = mem_txn_auto_begin(mdb, _txn, &is_auto);
+	int rc = 0;
+	mem_pos_t pos;
+	mem_record_t * rec = NULL;
+
+	pthread_rwlock_wrlock(&sdb->rwlock);
+	for(store_first(mdb->store, &pos); 0 == rc && (rec = store_get(mdb->store, &pos)); store_forward(mdb->store, &pos))
+	{
+		if(record_is_visible(rec, txn->snapshot)) rc = secondary_add_locked(sdb, txn, rec);
+	}
+	pthread_rwlock_unlock(&sdb->rwlock);
+	pthread_rwlock_unlock(&mdb->rwlock);
+
+	return mem_txn_auto_end(txn, is_auto, rc);
+}
+
+static int mem_db_close(struct db_handle * db)
+{
+	return 0;
+}
+
+static ssize_t mem_db_find(struct db_handle * db, db_engine_txn_t * txn,
+	const db_record_data_t * key,
+	db_record_data_t ** p_values)
+{
+	assert(db && db->priv && key);
+	int64_t begin = db_stats_clock_usec();
+	mem_db_t * mdb = db->priv;
+	mem_store_t * store = mdb->store;
+
+	mem_snapshot_t local_snap[1];
+	memset(local_snap, 0, sizeof(local_snap));
+	mem_snapshot_t * snap = local_snap;
+	if(txn) snap = ((mem_txn_t *)txn->priv)->snapshot;
+	else mem_snapshot_acquire(mdb->mem, snap, NULL);
+
+	ssize_t count = 0;
+	ssize_t max_size = 0;
+	db_record_data_t * results = NULL;
+
+	mem_search_key_t t = { .key = key->data, .key_size = key->size };
+	mem_pos_t pos;
+
+	pthread_rwlock_rdlock(&mdb->rwlock);
+	store_lower_bound(store, &t, &pos);
+
+	mem_record_t * rec = NULL;
+	while((rec = store_get(store, &pos)))
+	{
+		if(lex_compare(key->data, key->size, rec->key, rec->key_size)) break;
+		store_forward(store, &pos);
+		if(!record_is_visible(rec, snap)) continue;
+
+		if(!store->dup_sort) {
+			if(p_values) {
+				if(NULL == *p_values) *p_values = calloc(1, sizeof(**p_values));
+				assert(*p_values);
+				mem_record_data_set(*p_values, rec->value, rec->value_size);
+			}
+			count = 1;
+			break;
+		}
+
+		if(NULL == p_values) { ++count; continue; }
+		if(count >= max_size) {
+			ssize_t new_size = max_size?(max_size * 2):MEM_ALLOC_SIZE;
+			results = realloc(results, new_size * sizeof(*results));
+			assert(results);
+			memset(results + max_size, 0, (new_size - max_size) * sizeof(*results));
+			max_size = new_size;
+		}
+		mem_record_data_set(&results[count++], rec->value, rec->value_size);
+	}
+	pthread_rwlock_unlock(&mdb->rwlock);
+
+	if(NULL == txn) mem_snapshot_release(mdb->mem, snap);
+	if(results) {
+		if(count > 0) *p_values = results;
+		else free(results);
+	}
+
+	db_stats_op_record(&mdb->stats->ops[db_stats_op_find], begin, 0);
+	return count;
+}
+
+static ssize_t mem_db_find_secondary(struct db_handle * db, db_engine_txn_t * txn,
+	const db_record_data_t * skey,
+	db_record_data_t ** p_keys,
+	db_record_data_t ** p_values)
+{
+	assert(db && db->priv && skey);
+	int64_t begin = db_stats_clock_usec();
+	mem_db_t * sdb = db->priv;
+	mem_db_t * mdb = sdb->primary;
+	if(NULL == mdb) return -1;
+
+	mem_snapshot_t local_snap[1];
+	memset(local_snap, 0, sizeof(local_snap));
+	mem_snapshot_t * snap = local_snap;
+	if(txn) snap = ((mem_txn_t *)txn->priv)->snapshot;
+	else mem_snapshot_acquire(sdb->mem, snap, NULL);
+
+	// 1. collect the primary keys
+	ssize_t num_pkeys = 0;
+	ssize_t max_size = 0;
+	mem_record_t ** pkeys = NULL;
+
+	mem_search_key_t t = { .key = skey->data, .key_size = skey->size };
+	mem_pos_t pos;
+
+	pthread_rwlock_rdlock(&sdb->rwlock);
+	store_lower_bound(sdb->store, &t, &pos);
+	mem_record_t * rec = NULL;
+	while((rec = store_get(sdb->store, &pos)))
+	{
+		if(lex_compare(skey->data, skey->size, rec->key, rec->key_size)) break;
+		store_forward(sdb->store, &pos);
+		if(!record_is_visible(rec, snap)) continue;
+
+		if(num_pkeys >= max_size) {
+			max_size = max_size?(max_size * 2):MEM_ALLOC_SIZE;
+			pkeys = realloc(pkeys, max_size * sizeof(*pkeys));
+			assert(pkeys);
+		}
+		mem_record_ref(rec);
+		pkeys[num_pkeys++] = rec;
+		if(!sdb->store->dup_sort) break;
+	}
+	pthread_rwlock_unlock(&sdb->rwlock);
+
+	// 2. find the records in the primary db
+	ssize_t count = 0;
+	db_record_data_t * keys = NULL;
+	db_record_data_t * values = NULL;
+	int single = !sdb->store->dup_sort;
+
+	if(num_pkeys > 0) {
+		if(single) {
+			keys = p_keys?*p_keys:NULL;
+			values = *p_values;
+			if(p_keys && NULL == keys) keys = calloc(1, sizeof(*keys));
+			if(NULL == values) values = calloc(1, sizeof(*values));
+		}else {
+			if(p_keys) keys = calloc(num_pkeys, sizeof(*keys));
+			values = calloc(num_pkeys, sizeof(*values));
+		}
+	}
+
+	pthread_rwlock_rdlock(&mdb->rwlock);
+	for(ssize_t i = 0; i < num_pkeys; ++i)
+	{
+		mem_record_t * prec = store_find_visible(mdb->store, pkeys[i]->value, pkeys[i]->value_size, snap);
+		if(prec) {
+			if(keys) mem_record_data_set(&keys[count], prec->key, prec->key_size);
+			mem_record_data_set(&values[count], prec->value, prec->value_size);
+			++count;
+		}
+		mem_record_unref(pkeys[i]);
+	}
+	pthread_rwlock_unlock(&mdb->rwlock);
+	free(pkeys);
+
+	if(NULL == txn) mem_snapshot_release(sdb->mem, snap);
+
+	if(num_pkeys > 0) {
+		if(single) {
+			if(p_keys) *p_keys = keys;
+			*p_values = values;
+		}else if(count > 0) {
+			if(p_keys) *p_keys = keys;
+			*p_values = values;
+		}else {
+			free(keys);
+			free(values);
+		}
+	}
+
+	db_stats_op_record(&sdb->stats->ops[db_stats_op_find_secondary], begin, 0);
+	return count;
+}
+
+static int mem_db_insert(struct db_handle * db, db_engine_txn_t * txn, const db_record_data_t * key, const db_record_data_t * value)
+{
+	assert(db && db->priv && key && value);
+	int64_t begin = db_stats_clock_usec();
+	int flags = 0;
+	if(db->record_flags & db_record_flags_no_overwrite) flags |= mem_put_flags_no_overwrite;
+	if(db->record_flags & db_record_flags_no_dup) flags |= mem_put_flags_no_dup;
+
+	int rc = mem_db_put(db->priv, txn, key, value, flags);
+	db_stats_op_record(&mem_db_get(db)->stats->ops[db_stats_op_insert], begin, rc);
+	return rc;
+}
+
+static int mem_db_update(struct db_handle * db, db_engine_txn_t * txn, const db_record_data_t * key, const db_record_data_t * value)
+{
+	assert(db && db->priv && key && value);
+	int64_t begin = db_stats_clock_usec();
+	int rc = mem_db_put(db->priv, txn, key, value, mem_put_flags_update_only);
+	db_stats_op_record(&mem_db_get(db)->stats->ops[db_stats_op_update], begin, rc);
+	return rc;
+}
+
+static int mem_db_del(struct db_handle * db, db_engine_txn_t * _txn, const db_record_data_t * key)
+{
+	assert(db && db->priv && key);
+	int64_t begin = db_stats_clock_usec();
+	mem_db_t * mdb = db->priv;
+	int rc = -1;
+
+	if(mdb->primary) { // delete the primary records
+		db_record_data_t * pkeys = NULL;
+		db_record_data_t * values = NULL;
+		ssize_t count = mem_db_find_secondary(db, _txn, key, &pkeys, &values);
+
+		int is_auto = 0;
+		mem_txn_t * txn = mem_txn_auto_begin(mdb->primary, _txn, &is_auto);
+		rc = (count > 0)?0:DB_ENGINE_ERR_NOTFOUND;
+		for(ssize_t i = 0; i < count; ++i)
+		{
+			if(0 == rc) rc = mem_db_remove_key(mdb->primary, txn, pkeys[i].data, pkeys[i].size);
+			db_record_data_cleanup(&pkeys[i]);
+			db_record_data_cleanup(&values[i]);
+		}
+		free(pkeys);
+		free(values);
+		rc = mem_txn_auto_end(txn, is_auto, rc);
+	}else {
+		int is_auto = 0;
+		mem_txn_t * txn = mem_txn_auto_begin(mdb, _txn, &is_auto);
+		rc = mem_db_remove_key(mdb, txn, key->data, key->size);
+		rc = mem_txn_auto_end(txn, is_auto, rc);
+	}
+
+	db_stats_op_record(&mdb->stats->ops[db_stats_op_del], begin, (rc && rc != DB_ENGINE_ERR_NOTFOUND));
+	return rc;
+}
+
+static int mem_db_get_stats(struct db_handle * db, db_handle_stats_t * stats)
+{
+	assert(db && db->priv && stats);
+	mem_db_t * mdb = db->priv;
+	for(int i = 0; i < db_stats_op_types_count; ++i) {
+		db_stats_op_copy(&stats->ops[i], &mdb->stats->ops[i]);
+	}
+	return 0;
+}
+
+static void mem_db_reset_stats(struct db_handle * db)
+{
+	assert(db && db->priv);
+	memset(mem_db_get(db)->stats, 0, sizeof(db_handle_stats_t));
+}
+
+static int mem_cursor_open(struct db_handle * db, db_engine_txn_t * txn, struct db_cursor * cursor, int flags);
+static db_handle_t * mem_db_handle_new(mem_engine_t * mem, void * user_data)
+{
+	db_handle_t * db = calloc(1, sizeof(*db));
+	assert(db);
+	db->engine = mem->engine;
+	db->user_data = user_data;
+
+	mem_db_t * mdb = calloc(1, sizeof(*mdb));
+	assert(mdb);
+	mdb->db = db;
+	mdb->mem = mem;
+	int rc = pthread_rwlock_init(&mdb->rwlock, NULL);
+	assert(0 == rc);
+	store_init(mdb->store, 0, 0);
+	db->priv = mdb;
+
+	db->open = mem_db_open;
+	db->associate = mem_db_associate;
+	db->close = mem_db_close;
+	db->find = mem_db_find;
+	db->find_secondary = mem_db_find_secondary;
+	db->insert = mem_db_insert;
+	db->update = mem_db_update;
+	db->del = mem_db_del;
+	db->get_stats = mem_db_get_stats;
+	db->reset_stats = mem_db_reset_stats;
+	db->cursor_open = mem_cursor_open;
+	return db;
+}
+
+static void mem_db_handle_free(db_handle_t * db)
+{
+	if(NULL == db) return;
+	mem_db_t * mdb = db->priv;
+	if(mdb) {
+		store_cleanup(mdb->store);	// all records (include the dead ones) are referenced by the store
+		free(mdb->dead);
+		free(mdb->secondaries);
+		pthread_rwlock_destroy(&mdb->rwlock);
+		free(mdb);
+	}
+	free(db);
+}
+
+/****************************************************************
+ * struct db_cursor
+****************************************************************/
+typedef struct mem_cursor
+{
+	mem_db_t * mdb;
+	mem_txn_t * txn;				// nullable
+	mem_snapshot_t snapshot[1];		// used if no txn
+	mem_record_t * current;
+}mem_cursor_t;
+
+enum mem_cursor_move
+{
+	mem_cursor_move_first,
+	mem_cursor_move_last,
+	mem_cursor_move_next,
+	mem_cursor_move_prev,
+	mem_cursor_move_next_dup,
+	mem_cursor_move_prev_dup,
+	mem_cursor_move_set,
+};
+
+static inline mem_snapshot_t * mem_cursor_snapshot(mem_cursor_t * mc)
+{
+	return mc->txn?mc->txn->snapshot:mc->snapshot;
+}
+
+static int mem_cursor_move(struct db_cursor * cursor, enum mem_cursor_move how, const db_record_data_t * key)
+{
+	assert(cursor && cursor->priv);
+	int64_t begin = db_stats_clock_usec();
+	mem_cursor_t * mc = cursor->priv;
+	mem_db_t * mdb = mc->mdb;
+	mem_store_t * store = mdb->store;
+	mem_snapshot_t * snap = mem_cursor_snapshot(mc);
+
+	int forward = 1;
+	mem_pos_t pos = { 0, 0 };
+	mem_record_t * rec = NULL;
+	mem_record_t * current = mc->current;
+
+	pthread_rwlock_rdlock(&mdb->rwlock);
+	switch(how)
+	{
+	case mem_cursor_move_first:
+		store_first(store, &pos);
+		break;
+	case mem_cursor_move_last:
+		store_last(store, &pos);
+		forward = 0;
+		break;
+	case mem_cursor_move_next:
+	case mem_cursor_move_next_dup:
+		if(NULL == current) {
+			if(how == mem_cursor_move_next_dup) pos.seg = store->num_segments;	// not found
+			else store_first(store, &pos);
+			break;
+		}else {
+			mem_search_key_t t = search_key_from_record(store, current);
+			store_lower_bound(store, &t, &pos);
+			if(store_get(store, &pos) == current) store_forward(store, &pos);
+		}
+		break;
+	case mem_cursor_move_prev:
+	case mem_cursor_move_prev_dup:
+		forward = 0;
+		if(NULL == current) {
+			if(how == mem_cursor_move_prev_dup) pos.seg = -1;
+			else store_last(store, &pos);
+		}else {
+			mem_search_key_t t = search_key_from_record(store, current);
+			store_lower_bound(store, &t, &pos);
+			if(pos.seg >= store->num_segments) store_last(store, &pos);
+			else store_backward(store, &pos);
+		}
+		break;
+	case mem_cursor_move_set:
+		assert(key);
+		store_lower_bound(store, &(mem_search_key_t){ .key = key->data, .key_size = key->size }, &pos);
+		break;
+	default:
+		break;
+	}
+
+	while((rec = store_get(store, &pos)))
+	{
+		if((how == mem_cursor_move_next_dup || how == mem_cursor_move_prev_dup)
+			&& lex_compare(current->key, current->key_size, rec->key, rec->key_size)) { rec = NULL; break; }
+		if(how == mem_cursor_move_set && lex_compare(key->data, key->size, rec->key, rec->key_size)) { rec = NULL; break; }
+		if(record_is_visible(rec, snap)) break;
+
+		if(forward) store_forward(store, &pos);
+		else store_backward(store, &pos);
+	}
+
+	if(rec) {
+		mem_record_ref(rec);
+		mc->current = rec;
+		if(mdb->primary) {	// pget: skey, pkey, pvalue
+			mem_record_data_set(cursor->skey, rec->key, rec->key_size);
+			mem_record_data_set(cursor->key, rec->value, rec->value_size);
+		}else {
+			mem_record_data_set(cursor->key, rec->key, rec->key_size);
+			mem_record_data_set(cursor->value, rec->value, rec->value_size);
+		}
+	}
+	pthread_rwlock_unlock(&mdb->rwlock);
+
+	if(rec) {
+		mem_record_unref(current);
+		if(mdb->primary) {
+			mem_db_t * primary = mdb->primary;
+			pthread_rwlock_rdlock(&primary->rwlock);
+			mem_record_t * prec = store_find_visible(primary->store, rec->value, rec->value_size, snap);
+			if(prec) mem_record_data_set(cursor->value, prec->value, prec->value_size);
+			else mem_record_data_set(cursor->value, NULL, 0);
+			pthread_rwlock_unlock(&primary->rwlock);
+		}
+	}
+
+	int rc = rec?0:DB_ENGINE_ERR_NOTFOUND;
+	db_stats_op_record(&mdb->stats->ops[db_stats_op_cursor], begin, 0);
+	return rc;
+}
+
+static int mem_cursor_first(struct db_cursor * cursor) 		{ return mem_cursor_move(cursor, mem_cursor_move_first, NULL); }
+static int mem_cursor_last(struct db_cursor * cursor) 		{ return mem_cursor_move(cursor, mem_cursor_move_last, NULL); }
+static int mem_cursor_next(struct db_cursor * cursor) 		{ return mem_cursor_move(cursor, mem_cursor_move_next, NULL); }
+static int mem_cursor_prev(struct db_cursor * cursor) 		{ return mem_cursor_move(cursor, mem_cursor_move_prev, NULL); }
+static int mem_cursor_next_dup(struct db_cursor * cursor) 	{ return mem_cursor_move(cursor, mem_cursor_move_next_dup, NULL); }
+static int mem_cursor_prev_dup(struct db_cursor * cursor) 	{ return mem_cursor_move(cursor, mem_cursor_move_prev_dup, NULL); }
+static int mem_cursor_move_to(struct db_cursor * cursor, const db_record_data_t * key)
+{
+	return mem_cursor_move(cursor, mem_cursor_move_set, key);
+}
+
+static int mem_cursor_set(struct db_cursor * cursor)
+{
+	assert(cursor && cursor->priv);
+	mem_cursor_t * mc = cursor->priv;
+	mem_db_t * mdb = mc->mdb;
+	mem_record_t * current = mc->current;
+	if(NULL == current || mdb->primary) return -1;
+
+	int is_auto = 0;
+	mem_txn_t * txn = mem_txn_auto_begin(mdb, mc->txn?&(db_engine_txn_t){ .priv = mc->txn }:NULL, &is_auto);
+
+	pthread_rwlock_wrlock(&mdb->rwlock);
+	int rc = mem_db_end_locked(mdb, txn, current);
+	if(0 == rc) {
+		mem_record_t * rec = mem_record_new(current->key, current->key_size, cursor->value->data, cursor->value->size);
+		rec->begin_txn = txn->id;
+		rec->seq = __atomic_add_fetch(&mdb->mem->next_seq, 1, __ATOMIC_RELAXED);
+		store_insert(mdb->store, rec);
+		mem_txn_add_write(txn, mdb, rec, mem_write_type_insert);
+		if(mdb->num_secondaries > 0) rc = mem_db_update_secondaries(mdb, txn, current, rec);
+
+		if(0 == rc) {
+			mem_record_ref(rec);
+			mc->current = rec;
+			mem_record_unref(current);
+		}
+	}
+	pthread_rwlock_unlock(&mdb->rwlock);
+
+	return mem_txn_auto_end(txn, is_auto, rc);
+}
+
+static int mem_cursor_del(struct db_cursor * cursor)
+{
+	assert(cursor && cursor->priv);
+	mem_cursor_t * mc = cursor->priv;
+	mem_db_t * mdb = mc->mdb;
+	mem_record_t * current = mc->current;
+	if(NULL == current) return -1;
+
+	db_engine_txn_t * txn = mc->txn?&(db_engine_txn_t){ .priv = mc->txn }:NULL;
+	if(mdb->primary) return mem_db_del(mdb->primary->db, txn, cursor->key);
+
+	int is_auto = 0;
+	mem_txn_t * mtxn = mem_txn_auto_begin(mdb, txn, &is_auto);
+
+	pthread_rwlock_wrlock(&mdb->rwlock);
+	int rc = mem_db_end_locked(mdb, mtxn, current);
+	if(0 == rc && mdb->num_secondaries > 0) rc = mem_db_update_secondaries(mdb, mtxn, current, NULL);
+	pthread_rwlock_unlock(&mdb->rwlock);
+
+	return mem_txn_auto_end(mtxn, is_auto, rc);
+}
+
+/*
+ * bulk scan: pages of referenced records, the views point to the immutable record data directly
+ */
+#define MEM_SCAN_PAGE_SIZE	(256)
+typedef struct mem_scan_ctx
+{
+	db_scan_options_t options[1];
+	int is_sorted;
+	int started;
+	int eof;
+
+	mem_record_t * last;	// resume point of the next page
+	ssize_t count;
+	ssize_t index;
+	mem_record_t * records[MEM_SCAN_PAGE_SIZE];
+}mem_scan_ctx_t;
+
+static void mem_scan_release_page(mem_scan_ctx_t * ctx)
+{
+	for(ssize_t i = 0; i < ctx->count; ++i) mem_record_unref(ctx->records[i]);
+	ctx->count = 0;
+	ctx->index = 0;
+}
+
+static void mem_cursor_scan_end(struct db_cursor * cursor)
+{
+	mem_scan_ctx_t * ctx = cursor->scan_ctx;
+	if(NULL == ctx) return;
+
+	mem_scan_release_page(ctx);
+	mem_record_unref(ctx->last);
+	free(ctx);
+	cursor->scan_ctx = NULL;
+}
+
+static int mem_cursor_scan_begin(struct db_cursor * cursor, const db_scan_options_t * options)
+{
+	assert(cursor && cursor->priv);
+	mem_cursor_scan_end(cursor);
+
+	mem_cursor_t * mc = cursor->priv;
+	mem_scan_ctx_t * ctx = calloc(1, sizeof(*ctx));
+	assert(ctx);
+	if(options) *ctx->options = *options;
+	ctx->is_sorted = !mc->mdb->store->is_hash;
+
+	cursor->scan_ctx = ctx;
+	return 0;
+}
+
+static int mem_cursor_scan_fetch(struct db_cursor * cursor, mem_scan_ctx_t * ctx)
+{
+	int64_t begin = db_stats_clock_usec();
+	mem_cursor_t * mc = cursor->priv;
+	mem_db_t * mdb = mc->mdb;
+	mem_store_t * store = mdb->store;
+	mem_snapshot_t * snap = mem_cursor_snapshot(mc);
+
+	mem_scan_release_page(ctx);
+
+	mem_pos_t pos;
+	mem_record_t * rec = NULL;
+
+	pthread_rwlock_rdlock(&mdb->rwlock);
+	if(!ctx->started) {
+		// start at max(lower, prefix)
+		const db_scan_options_t * options = ctx->options;
+		mem_search_key_t t = { NULL };
+		if(ctx->is_sorted && options->lower) {
+			t.key = options->lower->data;
+			t.key_size = options->lower->size;
+		}
+		if(ctx->is_sorted && options->prefix && options->prefix_size > 0
+			&& (NULL == t.key || lex_compare(options->prefix, options->prefix_size, t.key, t.key_size) > 0))
+		{
+			t.key = options->prefix;
+			t.key_size = options->prefix_size;
+		}
+		if(t.key) store_lower_bound(store, &t, &pos);
+		else store_first(store, &pos);
+	}else {
+		// hash databases: a concurrent rehash may reorder the buckets between two pages
+		mem_search_key_t t = search_key_from_record(store, ctx->last);
+		store_lower_bound(store, &t, &pos);
+		if(store_get(store, &pos) == ctx->last) store_forward(store, &pos);
+	}
+
+	while(ctx->count < MEM_SCAN_PAGE_SIZE && (rec = store_get(store, &pos)))
+	{
+		store_forward(store, &pos);
+		if(!record_is_visible(rec, snap)) continue;
+
+		mem_record_ref(rec);
+		ctx->records[ctx->count++] = rec;
+	}
+	pthread_rwlock_unlock(&mdb->rwlock);
+
+	ctx->started = 1;
+	if(ctx->count > 0) {
+		mem_record_unref(ctx->last);
+		ctx->last = ctx->records[ctx->count - 1];
+		mem_record_ref(ctx->last);
+	}else {
+		ctx->eof = 1;
+	}
+
+	db_stats_op_record(&mdb->stats->ops[db_stats_op_cursor], begin, 0);
+	return (ctx->count > 0)?0:DB_ENGINE_ERR_NOTFOUND;
+}
+
+static int mem_cursor_scan_next(struct db_cursor * cursor, db_record_data_t * key, db_record_data_t * value)
+{
+	assert(cursor && key && value);
+	mem_scan_ctx_t * ctx = cursor->scan_ctx;
+	if(NULL == ctx) return -1;
+
+	while(!ctx->eof)
+	{
+		if(ctx->index >= ctx->count) {
+			int rc = mem_cursor_scan_fetch(cursor, ctx);
+			if(rc) return rc;
+		}
+
+		mem_record_t * rec = ctx->records[ctx->index++];
+		*key = (db_record_data_t){ .data = rec->key, .size = rec->key_size };
+		*value = (db_record_data_t){ .data = rec->value, .size = rec->value_size };
+
+		int match = db_scan_check_record(ctx->options, ctx->is_sorted, key, value);
+		if(match > 0) return 0;
+		if(match < 0) ctx->eof = 1;
+	}
+	return DB_ENGINE_ERR_NOTFOUND;
+}
+
+static void mem_cursor_close(struct db_cursor * cursor)
+{
+	mem_cursor_scan_end(cursor);
+
+	mem_cursor_t * mc = cursor->priv;
+	if(NULL == mc) return;
+
+	if(NULL == mc->txn) mem_snapshot_release(mc->mdb->mem, mc->snapshot);
+	mem_record_unref(mc->current);
+	free(mc);
+	cursor->priv = NULL;
+
+	db_record_data_cleanup(cursor->skey);
+	db_record_data_cleanup(cursor->key);
+	db_record_data_cleanup(cursor->value);
+}
+
+static int mem_cursor_open(struct db_handle * db, db_engine_txn_t * txn, struct db_cursor * cursor, int flags)
+{
+	assert(db && db->priv && cursor);
+	mem_db_t * mdb = db->priv;
+
+	mem_cursor_t * mc = calloc(1, sizeof(*mc));
+	assert(mc);
+	mc->mdb = mdb;
+	if(txn) mc->txn = txn->priv;
+	else mem_snapshot_acquire(mdb->mem, mc->snapshot, NULL);
+
+	cursor->priv = mc;
+	cursor->db = db;
+
+	cursor->first = mem_cursor_first;
+	cursor->last = mem_cursor_last;
+	cursor->next = mem_cursor_next;
+	cursor->prev = mem_cursor_prev;
+	cursor->next_dup = mem_cursor_next_dup;
+	cursor->prev_dup = mem_cursor_prev_dup;
+
+	cursor->move_to = mem_cursor_move_to;
+	cursor->set = mem_cursor_set;
+	cursor->del = mem_cursor_del;
+	cursor->close = mem_cursor_close;
+
+	cursor->scan_begin = mem_cursor_scan_begin;
+	cursor->scan_next = mem_cursor_scan_next;
+	cursor->scan_end = mem_cursor_scan_end;
+	return 0;
+}
+
+/****************************************************************
+ * struct db_engine
+****************************************************************/
+#define MEM_ENGINE_ALLOC_SIZE	(64)
+static int mem_engine_resize(mem_engine_t * mem, ssize_t new_size)
+{
+	if(new_size <= 0) new_size = MEM_ENGINE_ALLOC_SIZE;
+	else new_size = (new_size + MEM_ENGINE_ALLOC_SIZE - 1) / MEM_ENGINE_ALLOC_SIZE * MEM_ENGINE_ALLOC_SIZE;
+	if(new_size <= mem->max_size) return 0;
+
+	db_handle_t ** dbs = realloc(mem->databases, new_size * sizeof(*dbs));
+	assert(dbs);
+	memset(dbs + mem->max_size, 0, (new_size - mem->max_size) * sizeof(*dbs));
+	mem->databases = dbs;
+	mem->max_size = new_size;
+	return 0;
+}
+
+static int engine_set_home(struct db_engine * engine, const char * home_dir)
+{
+	return 0;	// nothing to do
+}
+
+static int engine_list_add(db_engine_t * engine, db_handle_t * db)
+{
+	mem_engine_t * mem = engine->priv;
+	pthread_mutex_lock(&mem->mutex);
+	for(ssize_t i = 0; i < mem->count; ++i) {
+		if(mem->databases[i] == db) { pthread_mutex_unlock(&mem->mutex); return -1; }
+	}
+	mem_engine_resize(mem, mem->count + 1);
+	mem->databases[mem->count++] = db;
+	pthread_mutex_unlock(&mem->mutex);
+	return 0;
+}
+
+static int engine_list_remove(db_engine_t * engine, db_handle_t * db)
+{
+	int rc = -1;
+	mem_engine_t * mem = engine->priv;
+	pthread_mutex_lock(&mem->mutex);
+	for(ssize_t i = 0; i < mem->count; ++i)
+	{
+		if(mem->databases[i] == db) {
+			mem->databases[i] = mem->databases[--mem->count];
+			mem->databases[mem->count] = NULL;
+			rc = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mem->mutex);
+	return rc;
+}
+
+static db_handle_t * engine_open_db(struct db_engine * engine, const char * db_name, enum db_format_type db_type, int flags)
+{
+	assert(engine && engine->priv);
+	db_handle_t * db = mem_db_handle_new(engine->priv, engine->user_data);
+	int rc = db->open(db, NULL, db_name, db_type, flags);
+	if(rc) {
+		mem_db_handle_free(db);
+		return NULL;
+	}
+	engine_list_add(engine, db);
+	return db;
+}
+
+static int engine_close_db(db_engine_t * engine, db_handle_t * db)
+{
+	if(NULL == db) return -1;
+	int rc = db->close(db);
+	engine_list_remove(engine, db);
+	mem_db_handle_free(db);
+	return rc;
+}
+
+static db_engine_txn_t * engine_txn_new(struct db_engine * engine, struct db_engine_txn * parent_txn)
+{
+	db_engine_txn_t * txn = mem_engine_txn_init(NULL, engine);
+	int rc = txn->begin(txn, parent_txn);
+	assert(0 == rc);
+	return txn;
+}
+
+static void engine_txn_free(struct db_engine * engine, db_engine_txn_t * txn)
+{
+	if(NULL == txn) return;
+	if(txn->priv) txn->abort(txn);
+	free(txn);
+}
+
+static json_object * engine_get_stats(struct db_engine * engine)
+{
+	assert(engine && engine->priv);
+	mem_engine_t * mem = engine->priv;
+
+	json_object * jstats = json_object_new_object();
+	json_object_object_add(jstats, "backend", json_object_new_string("memory"));
+
+	json_object * jtxn = json_object_new_object();
+	struct db_stats_op commit_stats[1];
+	db_stats_op_copy(commit_stats, mem->txn_commit_stats);
+
+	pthread_mutex_lock(&mem->mutex);
+	json_object_object_add(jtxn, "last_committed", json_object_new_int64(mem->last_committed));
+	json_object_object_add(jtxn, "active_snapshots", json_object_new_int64(mem->num_snapshots));
+	pthread_mutex_unlock(&mem->mutex);
+
+	json_object_object_add(jtxn, "aborts", json_object_new_int64(__atomic_load_n(&mem->txn_aborts, __ATOMIC_RELAXED)));
+	json_object_object_add(jtxn, "conflicts", json_object_new_int64(__atomic_load_n(&mem->txn_conflicts, __ATOMIC_RELAXED)));
+	json_object_object_add(jtxn, "commit_latency", db_stats_op_to_json(commit_stats));
+	json_object_object_add(jstats, "txn", jtxn);
+
+	json_object * jdbs = json_object_new_array();
+	pthread_mutex_lock(&mem->mutex);
+	for(ssize_t i = 0; i < mem->count; ++i)
+	{
+		db_handle_t * db = mem->databases[i];
+		mem_db_t * mdb = db->priv;
+
+		json_object * jdb = json_object_new_object();
+		json_object_object_add(jdb, "name", json_object_new_string(mdb->name));
+		json_object_object_add(jdb, "type", json_object_new_string((mdb->db_type == db_format_type_hash)?"hash":"btree"));
+
+		pthread_rwlock_rdlock(&mdb->rwlock);
+		json_object_object_add(jdb, "versions", json_object_new_int64(mdb->store->count));
+		json_object_object_add(jdb, "dead_versions", json_object_new_int64(mdb->dead_count));
+		json_object_object_add(jdb, "bytes", json_object_new_int64(mdb->store->total_bytes));
+		json_object_object_add(jdb, "segments", json_object_new_int64(mdb->store->num_segments));
+		pthread_rwlock_unlock(&mdb->rwlock);
+
+		db_handle_stats_t stats[1];
+		db->get_stats(db, stats);
+		for(int type = 0; type < db_stats_op_types_count; ++type)
+		{
+			if(0 == stats->ops[type].count) continue;
+			json_object_object_add(jdb, db_stats_op_type_to_string(type), db_stats_op_to_json(&stats->ops[type]));
+		}
+		json_object_array_add(jdbs, jdb);
+	}
+	pthread_mutex_unlock(&mem->mutex);
+	json_object_object_add(jstats, "databases", jdbs);
+	return jstats;
+}
+
+db_engine_t * db_engine_memory_new(void * user_data)
+{
+	db_engine_t * engine = calloc(1, sizeof(*engine));
+	assert(engine);
+	engine->user_data = user_data;
+
+	mem_engine_t * mem = calloc(1, sizeof(*mem));
+	assert(mem);
+	mem->engine = engine;
+	int rc = pthread_mutex_init(&mem->mutex, NULL);
+	assert(0 == rc);
+	rc = pthread_mutex_init(&mem->commit_mutex, NULL);
+	assert(0 == rc);
+	mem->snapshots->prev = mem->snapshots->next = mem->snapshots;
+	mem_engine_resize(mem, 0);
+	engine->priv = mem;
+
+	engine->set_home = engine_set_home;
+	engine->open_db = engine_open_db;
+	engine->close_db = engine_close_db;
+	engine->list_add = engine_list_add;
+	engine->list_remove = engine_list_remove;
+	engine->txn_new = engine_txn_new;
+	engine->txn_free = engine_txn_free;
+	engine->get_stats = engine_get_stats;
+	return engine;
+}
+
+void db_engine_memory_free(db_engine_t * engine)
+{
+	if(NULL == engine) return;
+	mem_engine_t * mem = engine->priv;
+	if(mem) {
+		for(ssize_t i = 0; i < mem->count; ++i) mem_db_handle_free(mem->databases[i]);
+		free(mem->databases);
+		pthread_mutex_destroy(&mem->commit_mutex);
+		pthread_mutex_destroy(&mem->mutex);
+		free(mem);
+	}
+	free(engine);
+}
+
+
+#if defined(_TEST_DB_ENGINE_MEM) && defined(_STAND_ALONE)
+#include <time.h>
+struct test_record
+{
+	int32_t height;
+	int32_t timestamp;
+};
+
+static ssize_t associate_height(db_handle_t * db,
+	const db_record_data_t * key,
+	const db_record_data_t * value,
+	db_record_data_t ** p_result)
+{
+	db_record_data_t * result = calloc(1, sizeof(*result));
+	assert(result);
+
+	struct test_record * record = value->data;
+	assert(value->size == sizeof(*record));
+	result->data = &record->height;
+	result->size = sizeof(record->height);
+	*p_result = result;
+	return 1;
+}
+
+static double time_elapsed(struct timespec * begin)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)(end.tv_sec - begin->tv_sec) + (double)(end.tv_nsec - begin->tv_nsec) / 1000000000;
+}
+
+static void test_primary_secondary(db_engine_t * engine)
+{
+	db_handle_t * sdb = engine->open_db(engine, "blocks_height.db", db_format_type_btree, db_flags_dup_sort);
+	db_handle_t * db = engine->open_db(engine, "blocks.db", db_format_type_btree, 0);
+	assert(db && sdb);
+	int rc = db->associate(db, NULL, sdb, associate_height);
+	assert(0 == rc);
+
+	db->record_flags |= db_record_flags_no_overwrite;
+
+	uint32_t key = 0;
+	struct test_record record[1];
+	for(int i = 0; i < 10; ++i)
+	{
+		key = 1000 + i + 1;
+		record->height = i;
+		record->timestamp = 1000 + i;
+		rc = db->insert(db, NULL,
+			&(db_record_data_t){ .data = &key, .size = sizeof(key) },
+			&(db_record_data_t){ .data = record, .size = sizeof(record) });
+		assert(0 == rc);
+	}
+	// orphans
+	for(int i = 3; i < 5; ++i)
+	{
+		key = 2000 + i + 1;
+		record->height = i;
+		record->timestamp = 2000 + i;
+		rc = db->insert(db, NULL,
+			&(db_record_data_t){ .data = &key, .size = sizeof(key) },
+			&(db_record_data_t){ .data = record, .size = sizeof(record) });
+		assert(0 == rc);
+	}
+
+	// duplicated key
+	key = 1001;
+	rc = db->insert(db, NULL,
+		&(db_record_data_t){ .data = &key, .size = sizeof(key) },
+		&(db_record_data_t){ .data = record, .size = sizeof(record) });
+	assert(rc == DB_ENGINE_ERR_KEYEXIST);
+
+	// find
+	key = 1003;
+	db_record_data_t * values = NULL;
+	ssize_t count = db->find(db, NULL, &(db_record_data_t){ .data = &key, .size = sizeof(key) }, &values);
+	assert(count == 1 && values && values->size == sizeof(struct test_record));
+	assert(((struct test_record *)values->data)->height == 2);
+	db_record_data_cleanup(values);
+	free(values);
+
+	// find_secondary
+	int32_t height = 3;
+	values = NULL;
+	db_record_data_t * keys = NULL;
+	count = sdb->find_secondary(sdb, NULL, &(db_record_data_t){ .data = &height, .size = sizeof(height) }, &keys, &values);
+	printf("find_secondary(height=%d): count=%ld\n", height, (long)count);
+	assert(count == 2);
+	for(int i = 0; i < count; ++i)
+	{
+		printf("  key: %u, height=%d, timestamp=%d\n", *(uint32_t *)keys[i].data,
+			((struct test_record *)values[i].data)->height,
+			((struct test_record *)values[i].data)->timestamp);
+		assert(((struct test_record *)values[i].data)->height == height);
+		db_record_data_cleanup(&keys[i]);
+		db_record_data_cleanup(&values[i]);
+	}
+	free(keys);
+	free(values);
+
+	// delete a primary record, the secondary index must follow
+	key = 2004;
+	rc = db->del(db, NULL, &(db_record_data_t){ .data = &key, .size = sizeof(key) });
+	assert(0 == rc);
+
+	keys = NULL; values = NULL;
+	count = sdb->find_secondary(sdb, NULL, &(db_record_data_t){ .data = &height, .size = sizeof(height) }, &keys, &values);
+	assert(count == 1 && *(uint32_t *)keys[0].data == 1004);
+	db_record_data_cleanup(&keys[0]);
+	db_record_data_cleanup(&values[0]);
+	free(keys);
+	free(values);
+
+	// cursor
+	db_cursor_t * cursor = db_cursor_init(NULL, db, NULL, 0);
+	assert(cursor);
+	count = 0;
+	uint32_t prev_key = 0;
+	for(rc = cursor->first(cursor); 0 == rc; rc = cursor->next(cursor))
+	{
+		uint32_t cur_key = *(uint32_t *)cursor->key->data;
+		assert(count == 0 || lex_compare(&prev_key, sizeof(prev_key), &cur_key, sizeof(cur_key)) < 0);	// sorted in bytes order
+		prev_key = cur_key;
+		++count;
+	}
+	assert(rc == DB_ENGINE_ERR_NOTFOUND && count == 11);
+
+	// backward
+	count = 0;
+	for(rc = cursor->last(cursor); 0 == rc; rc = cursor->prev(cursor)) ++count;
+	assert(count == 11);
+	db_cursor_cleanup(cursor);
+	free(cursor);
+
+	// secondary cursor (pget)
+	cursor = db_cursor_init(NULL, sdb, NULL, 0);
+	height = 4;
+	rc = cursor->move_to(cursor, &(db_record_data_t){ .data = &height, .size = sizeof(height) });
+	assert(0 == rc);
+	assert(*(int32_t *)cursor->skey->data == 4);
+	assert(((struct test_record *)cursor->value->data)->height == 4);
+	uint32_t pkey = *(uint32_t *)cursor->key->data;
+	rc = cursor->next_dup(cursor);
+	assert(0 == rc);
+	pkey += *(uint32_t *)cursor->key->data;
+	assert(pkey == (1005 + 2005));
+	rc = cursor->next_dup(cursor);
+	assert(rc == DB_ENGINE_ERR_NOTFOUND);
+	db_cursor_cleanup(cursor);
+	free(cursor);
+
+	printf("== %s() passed\n", __FUNCTION__);
+}
+
+static void test_snapshot_isolation(db_engine_t * engine)
+{
+	db_handle_t * db = engine->open_db(engine, "si.db", db_format_type_hash, 0);
+	assert(db);
+
+	int key = 1;
+	int value = 100;
+	int rc = db->insert(db, NULL, &(db_record_data_t){ .data = &key, .size = sizeof(key) }, &(db_record_data_t){ .data = &value, .size = sizeof(value) });
+	assert(0 == rc);
+
+	db_engine_txn_t * txn1 = engine->txn_new(engine, NULL);
+
+	// changed outside of txn1
+	value = 200;
+	rc = db->update(db, NULL, &(db_record_data_t){ .data = &key, .size = sizeof(key) }, &(db_record_data_t){ .data = &value, .size = sizeof(value) });
+	assert(0 == rc);
+
+	// txn1 still sees the old value
+	db_record_data_t * values = NULL;
+	ssize_t count = db->find(db, txn1, &(db_record_data_t){ .data = &key, .size = sizeof(key) }, &values);
+	assert(count == 1 && *(int *)values->data == 100);
+	db_record_data_cleanup(values);
+	free(values); values = NULL;
+
+	// write-write conflict
+	value = 300;
+	rc = db->update(db, txn1, &(db_record_data_t){ .data = &key, .size = sizeof(key) }, &(db_record_data_t){ .data = &value, .size = sizeof(value) });
+	assert(rc == DB_ENGINE_ERR_CONFLICT);
+	engine->txn_free(engine, txn1);	// abort
+
+	// uncommitted changes are invisible to others
+	db_engine_txn_t * txn2 = engine->txn_new(engine, NULL);
+	int key2 = 2;
+	rc = db->insert(db, txn2, &(db_record_data_t){ .data = &key2, .size = sizeof(key2) }, &(db_record_data_t){ .data = &value, .size = sizeof(value) });
+	assert(0 == rc);
+	count = db->find(db, NULL, &(db_record_data_t){ .data = &key2, .size = sizeof(key2) }, NULL);
+	assert(count == 0);
+	count = db->find(db, txn2, &(db_record_data_t){ .data = &key2, .size = sizeof(key2) }, NULL);
+	assert(count == 1);
+
+	// nested txn
+	db_engine_txn_t * child = engine->txn_new(engine, txn2);
+	rc = db->del(db, child, &(db_record_data_t){ .data = &key, .size = sizeof(key) });
+	assert(0 == rc);
+	rc = child->commit(child, 0);
+	assert(0 == rc);
+	engine->txn_free(engine, child);
+
+	rc = txn2->commit(txn2, 0);
+	assert(0 == rc);
+	engine->txn_free(engine, txn2);
+
+	count = db->find(db, NULL, &(db_record_data_t){ .data = &key2, .size = sizeof(key2) }, NULL);
+	assert(count == 1);
+	count = db->find(db, NULL, &(db_record_data_t){ .data = &key, .size = sizeof(key) }, NULL);
+	assert(count == 0);
+
+	// all dead versions have been collected
+	mem_db_t * mdb = db->priv;
+	assert(mdb->dead_count == 0 && mdb->store->count == 1);
+
+	printf("== %s() passed\n", __FUNCTION__);
+}
+
+static int filter_odd_values(const db_record_data_t * key, const db_record_data_t * value, void * user_data)
+{
+	return (*(int *)value->data) & 1;
+}
+
+static void test_bulk(db_engine_t * engine, enum db_format_type db_type, int num_records)
+{
+	db_handle_t * db = engine->open_db(engine, "bulk.db", db_type, 0);
+	assert(db);
+
+	struct timespec begin;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	srand(12345);
+	for(int i = 0; i < num_records; ++i)
+	{
+		uint64_t key = ((uint64_t)rand() << 32) | (uint64_t)i;
+		int rc = db->insert(db, NULL, &(db_record_data_t){ .data = &key, .size = sizeof(key) }, &(db_record_data_t){ .data = &i, .size = sizeof(i) });
+		assert(0 == rc);
+	}
+	double insert_time = time_elapsed(&begin);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	srand(12345);
+	for(int i = 0; i < num_records; ++i)
+	{
+		uint64_t key = ((uint64_t)rand() << 32) | (uint64_t)i;
+		db_record_data_t value[1] = {{ NULL }};
+		db_record_data_t * p_value = value;
+		ssize_t count = db->find(db, NULL, &(db_record_data_t){ .data = &key, .size = sizeof(key) }, &p_value);
+		assert(count == 1 && *(int *)value->data == i);
+		db_record_data_cleanup(value);
+	}
+	double find_time = time_elapsed(&begin);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	db_cursor_t cursor[1];
+	memset(cursor, 0, sizeof(cursor));
+	db_cursor_init(cursor, db, NULL, 0);
+	int count = 0;
+	uint64_t prev_key = 0;
+	for(int rc = cursor->first(cursor); 0 == rc; rc = cursor->next(cursor))
+	{
+		if(db_type == db_format_type_btree) {
+			uint64_t key = *(uint64_t *)cursor->key->data;
+			// keys are sorted in bytes order
+			assert(count == 0 || lex_compare(&prev_key, sizeof(prev_key), &key, sizeof(key)) < 0);
+			prev_key = key;
+		}
+		++count;
+	}
+	double scan_time = time_elapsed(&begin);
+	assert(count == num_records);
+
+	// bulk scan: pointer views, the upper half of the key range with odd values only
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	unsigned char lower_key[1] = { 0x80 };
+	int rc = cursor->scan_begin(cursor, &(db_scan_options_t){
+		.lower = &(db_record_data_t){ .data = lower_key, .size = sizeof(lower_key) },
+		.filter = filter_odd_values,
+	});
+	assert(0 == rc);
+	db_record_data_t key[1], value[1];
+	int bulk_count = 0;
+	while(0 == (rc = cursor->scan_next(cursor, key, value)))
+	{
+		assert(key->size == sizeof(uint64_t) && ((unsigned char *)key->data)[0] >= 0x80);
+		assert(*(int *)value->data & 1);
+		++bulk_count;
+	}
+	assert(rc == DB_ENGINE_ERR_NOTFOUND);
+	cursor->scan_end(cursor);
+	double bulk_scan_time = time_elapsed(&begin);
+	db_cursor_cleanup(cursor);
+
+	// verify with the full table
+	int expected = 0;
+	srand(12345);
+	for(int i = 0; i < num_records; ++i)
+	{
+		uint64_t key = ((uint64_t)rand() << 32) | (uint64_t)i;
+		if(((unsigned char *)&key)[0] >= 0x80 && (i & 1)) ++expected;
+	}
+	assert(bulk_count == expected);
+
+	printf("== %s(%s, %d): insert: %.3f s, find: %.3f s, scan: %.3f s, bulk scan: %.3f s (%d records)\n", __FUNCTION__,
+		(db_type == db_format_type_btree)?"btree":"hash", num_records,
+		insert_time, find_time, scan_time, bulk_scan_time, bulk_count);
+	engine->close_db(engine, db);
+}
+
+int main(int argc, char **argv)
+{
+	db_engine_t * engine = db_engine_memory_new(NULL);
+	assert(engine);
+
+	test_primary_secondary(engine);
+	test_snapshot_isolation(engine);
+	test_bulk(engine, db_format_type_btree, 200000);
+	test_bulk(engine, db_format_type_hash, 200000);
+
+	json_object * jstats = engine->get_stats(engine);
+	printf("%s\n", json_object_to_json_string_ext(jstats, JSON_C_TO_STRING_PRETTY));
+	json_object_put(jstats);
+
+	db_engine_memory_free(engine);
+	return 0;
+}
+#endif
@@ -0,0 +1,1326 @@
+/*
+ * mempool.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "satoshi-types.h"
+#include "mempool.h"
+
+#define MEMPOOL_INVALID_ID	(UINT32_MAX)
+#define MEMPOOL_MIN_FEE_HALFLIFE	(12 * 3600)	// seconds
+
+const char * mempool_status_to_string(enum mempool_status status)
+{
+	switch(status) {
+	case mempool_status_ok: return "ok";
+	case mempool_status_invalid: return "invalid";
+	case mempool_status_duplicate: return "duplicate";
+	case mempool_status_conflict: return "conflict";
+	case mempool_status_too_long_chain: return "too-long-mempool-chain";
+	case mempool_status_fee_too_low: return "fee-too-low";
+	case mempool_status_full: return "mempool-full";
+	default: break;
+	}
+	return "unknown";
+}
+
+/*************************************
+ * entries (slab)
+ ************************************/
+struct mempool_entry
+{
+	uint256_t txid;
+	uint256_t wtxid;
+	int64_t fee;
+	int32_t vsize;
+	int32_t size;
+	int64_t time;
+	
+	// aggregates, including the tx itself
+	int64_t ancestor_vsize;
+	int64_t ancestor_fees;
+	int64_t descendant_vsize;
+	int64_t descendant_fees;
+	int32_t ancestor_count;
+	int32_t descendant_count;
+	
+	uint32_t heap_pos;	// position in the eviction heap
+	uint32_t epoch;		// traversal marker
+	uint8_t in_use;
+	uint8_t removing;
+	
+	uint32_t txin_count;
+	uint32_t num_parents;
+	uint32_t num_children;
+	uint32_t max_children;
+	uint32_t * children;
+	int64_t mem_usage;
+	
+	// one allocation: [spent outpoints (txin_count)][parents (num_parents)][serialized tx (size)]
+	unsigned char * data;
+	satoshi_outpoint_t * spent;
+	uint32_t * parents;
+	unsigned char * raw_tx;
+};
+
+struct id_list
+{
+	uint32_t * ids;
+	size_t count;
+	size_t max_size;
+};
+
+static void id_list_push(struct id_list * list, uint32_t id)
+{
+	if(list->count >= list->max_size) {
+		size_t new_size = list->max_size?(list->max_size * 2):64;
+		uint32_t * ids = realloc(list->ids, new_size * sizeof(*ids));
+		assert(ids);
+		list->ids = ids;
+		list->max_size = new_size;
+	}
+	list->ids[list->count++] = id;
+}
+
+/*************************************
+ * hash_index: open addressing, linear probing
+ ************************************/
+#define HASH_INDEX_EMPTY	(0)
+#define HASH_INDEX_DELETED	(UINT64_MAX)
+
+struct mempool_private;
+struct hash_index
+{
+	uint64_t * slots;	// (value + 1), or HASH_INDEX_EMPTY / HASH_INDEX_DELETED
+	size_t size;		// power of 2
+	size_t count;
+	size_t used;		// count + deleted slots
+	
+	struct mempool_private * priv;
+	uint64_t (* hash_of)(struct mempool_private * priv, uint64_t value);
+	int (* match)(struct mempool_private * priv, uint64_t value, const void * key);
+};
+
+typedef struct mempool_private
+{
+	mempool_t * pool;
+	uint64_t salt;
+	
+	struct mempool_entry * entries;
+	uint32_t max_entries;
+	uint32_t num_entries;	// high-water mark of the used ids
+	struct id_list free_ids[1];
+	
+	struct hash_index txids[1];		// --> entry id
+	struct hash_index wtxids[1];	// --> entry id
+	struct hash_index outpoints[1];	// --> (entry id << 32) | txin index
+	
+	uint32_t * heap;	// eviction heap: entry ids, min descendant score first
+	uint32_t heap_size;
+	
+	uint32_t epoch;
+	struct id_list traversal[1];	// scratch lists
+	struct id_list removal[1];
+	struct id_list parents[1];
+	
+	int64_t count;
+	int64_t total_vsize;
+	int64_t total_fees;
+	int64_t memory_usage;
+	int64_t evicted;
+	
+	double min_fee_rate;	// rolling minimum
+	int64_t min_fee_rate_updated;
+}mempool_private_t;
+
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t hash_u256(uint64_t salt, const void * hash, uint32_t n)
+{
+	uint64_t a, b;
+	memcpy(&a, hash, sizeof(a));
+	memcpy(&b, (const unsigned char *)hash + 8, sizeof(b));
+	return mix64((a ^ salt) + mix64(b ^ ((uint64_t)n << 1)));
+}
+
+static void hash_index_init(struct hash_index * index, mempool_private_t * priv, size_t size,
+	uint64_t (* hash_of)(mempool_private_t *, uint64_t), 
+	int (* match)(mempool_private_t *, uint64_t, const void *))
+{
+	memset(index, 0, sizeof(*index));
+	index->size = size;
+	index->slots = calloc(size, sizeof(*index->slots));
+	assert(index->slots);
+	index->priv = priv;
+	index->hash_of = hash_of;
+	index->match = match;
+}
+
+static void hash_index_cleanup(struct hash_index * index)
+{
+	free(index->slots);
+	index->slots = NULL;
+	index->size = index->count = index->used = 0;
+}
+
+static ssize_t hash_index_find(const struct hash_index * index, uint64_t hash, const void * key)
+{
+	size_t mask = index->size - 1;
+	for(size_t pos = hash & mask; ; pos = (pos + 1) & mask) {
+		uint64_t slot = index->slots[pos];
+		if(slot == HASH_INDEX_EMPTY) return -1;
+		if(slot != HASH_INDEX_DELETED && index->match(index->priv, slot - 1, key)) return pos;
+	}
+	return -1;
+}
+
+static void hash_index_put(struct hash_index * index, uint64_t hash, uint64_t value)
+{
+	size_t mask = index->size - 1;
+	size_t pos = hash & mask;
+	while(index->slots[pos] != HASH_INDEX_EMPTY && index->slots[pos] != HASH_INDEX_DELETED) pos = (pos + 1) & mask;
+	if(index->slots[pos] == HASH_INDEX_EMPTY) ++index->used;
+	index->slots[pos] = value + 1;
+	++index->count;
+}
+
+static void hash_index_resize(struct hash_index * index, size_t new_size)
+{
+	uint64_t * slots = index->slots;
+	size_t size = index->size;
+	
+	index->slots = calloc(new_size, sizeof(*index->slots));
+	assert(index->slots);
+	index->size = new_size;
+	index->count = index->used = 0;
+	for(size_t i = 0; i < size; ++i) {
+		if(slots[i] == HASH_INDEX_EMPTY || slots[i] == HASH_INDEX_DELETED) continue;
+		hash_index_put(index, index->hash_of(index->priv, slots[i] - 1), slots[i] - 1);
+	}
+	free(slots);
+}
+
+static void hash_index_insert(struct hash_index * index, uint64_t hash, uint64_t value)
+{
+	// load factor <= 0.75 (including deleted slots)
+	if((index->used + 1) * 4 > index->size * 3) {
+		size_t new_size = index->size;
+		if((index->count + 1) * 2 > index->size) new_size *= 2;	// else: only purge the deleted slots
+		hash_index_resize(index, new_size);
+	}
+	hash_index_put(index, hash, value);
+}
+
+static void hash_index_remove(struct hash_index * index, ssize_t pos)
+{
+	assert(pos >= 0 && pos < index->size);
+	size_t mask = index->size - 1;
+	
+	// no need of a tombstone if the next slot is empty
+	if(index->slots[(pos + 1) & mask] == HASH_INDEX_EMPTY) {
+		index->slots[pos] = HASH_INDEX_EMPTY;
+		--index->used;
+	}else index->slots[pos] = HASH_INDEX_DELETED;
+	--index->count;
+}
+
+static uint64_t txid_hash_of(mempool_private_t * priv, uint64_t id)
+{
+	return hash_u256(priv->salt, &priv->entries[id].txid, 0);
+}
+static int txid_match(mempool_private_t * priv, uint64_t id, const void * key)
+{
+	return (0 == memcmp(&priv->entries[id].txid, key, sizeof(uint256_t)));
+}
+static uint64_t wtxid_hash_of(mempool_private_t * priv, uint64_t id)
+{
+	return hash_u256(priv->salt, &priv->entries[id].wtxid, 0);
+}
+static int wtxid_match(mempool_private_t * priv, uint64_t id, const void * key)
+{
+	return (0 == memcmp(&priv->entries[id].wtxid, key, sizeof(uint256_t)));
+}
+static uint64_t outpoint_hash(mempool_private_t * priv, const satoshi_outpoint_t * outpoint)
+{
+	return hash_u256(priv->salt, outpoint->prev_hash, outpoint->index);
+}
+static uint64_t outpoint_hash_of(mempool_private_t * priv, uint64_t value)
+{
+	const struct mempool_entry * entry = &priv->entries[value >> 32];
+	return outpoint_hash(priv, &entry->spent[value & UINT32_MAX]);
+}
+static int outpoint_match(mempool_private_t * priv, uint64_t value, const void * key)
+{
+	const struct mempool_entry * entry = &priv->entries[value >> 32];
+	return (0 == memcmp(&entry->spent[value & UINT32_MAX], key, sizeof(satoshi_outpoint_t)));
+}
+
+static inline uint32_t find_txid(mempool_private_t * priv, const uint256_t * txid)
+{
+	ssize_t pos = hash_index_find(priv->txids, hash_u256(priv->salt, txid, 0), txid);
+	return (pos < 0)?MEMPOOL_INVALID_ID:(uint32_t)(priv->txids->slots[pos] - 1);
+}
+
+static inline uint32_t find_wtxid(mempool_private_t * priv, const uint256_t * wtxid)
+{
+	ssize_t pos = hash_index_find(priv->wtxids, hash_u256(priv->salt, wtxid, 0), wtxid);
+	return (pos < 0)?MEMPOOL_INVALID_ID:(uint32_t)(priv->wtxids->slots[pos] - 1);
+}
+
+static inline uint32_t find_spender(mempool_private_t * priv, const satoshi_outpoint_t * outpoint)
+{
+	ssize_t pos = hash_index_find(priv->outpoints, outpoint_hash(priv, outpoint), outpoint);
+	return (pos < 0)?MEMPOOL_INVALID_ID:(uint32_t)((priv->outpoints->slots[pos] - 1) >> 32);
+}
+
+/*************************************
+ * eviction heap (min descendant score first)
+ ************************************/
+static inline double entry_fee_rate(int64_t fees, int64_t vsize)
+{
+	return (double)fees * 1000.0 / (double)vsize;
+}
+
+// the descendant score: a tx is not evicted before its low fee-rate descendants (CPFP)
+static inline double descendant_score(const struct mempool_entry * entry)
+{
+	double fee_rate = entry_fee_rate(entry->fee, entry->vsize);
+	double package_fee_rate = entry_fee_rate(entry->descendant_fees, entry->descendant_vsize);
+	return (fee_rate > package_fee_rate)?fee_rate:package_fee_rate;
+}
+
+static inline int heap_less(mempool_private_t * priv, uint32_t a, uint32_t b)
+{
+	double score_a = descendant_score(&priv->entries[a]);
+	double score_b = descendant_score(&priv->entries[b]);
+	if(score_a != score_b) return score_a < score_b;
+	return priv->entries[a].time > priv->entries[b].time;	// evict the newer one first
+}
+
+static inline void heap_set(mempool_private_t * priv, uint32_t pos, uint32_t id)
+{
+	priv->heap[pos] = id;
+	priv->entries[id].heap_pos = pos;
+}
+
+static void heap_sift_up(mempool_private_t * priv, uint32_t pos)
+{
+	uint32_t id = priv->heap[pos];
+	while(pos > 0) {
+		uint32_t parent = (pos - 1) / 2;
+		if(!heap_less(priv, id, priv->heap[parent])) break;
+		heap_set(priv, pos, priv->heap[parent]);
+		pos = parent;
+	}
+	heap_set(priv, pos, id);
+}
+
+static void heap_sift_down(mempool_private_t * priv, uint32_t pos)
+{
+	uint32_t id = priv->heap[pos];
+	while(1) {
+		uint32_t child = pos * 2 + 1;
+		if(child >= priv->heap_size) break;
+		if((child + 1) < priv->heap_size && heap_less(priv, priv->heap[child + 1], priv->heap[child])) ++child;
+		if(!heap_less(priv, priv->heap[child], id)) break;
+		heap_set(priv, pos, priv->heap[child]);
+		pos = child;
+	}
+	heap_set(priv, pos, id);
+}
+
+static void heap_push(mempool_private_t * priv, uint32_t id)
+{
+	uint32_t pos = priv->heap_size++;
+	heap_set(priv, pos, id);
+	heap_sift_up(priv, pos);
+}
+
+static void heap_remove(mempool_private_t * priv, uint32_t id)
+{
+	uint32_t pos = priv->entries[id].heap_pos;
+	assert(pos < priv->heap_size && priv->heap[pos] == id);
+	uint32_t last = priv->heap[--priv->heap_size];
+	if(pos == priv->heap_size) return;
+	heap_set(priv, pos, last);
+	heap_sift_up(priv, pos);
+	heap_sift_down(priv, priv->entries[last].heap_pos);
+}
+
+static void heap_update(mempool_private_t * priv, uint32_t id)
+{
+	heap_sift_up(priv, priv->entries[id].heap_pos);
+	heap_sift_down(priv, priv->entries[id].heap_pos);
+}
+
+/*************************************
+ * package graph
+ ************************************/
+static void new_epoch(mempool_private_t * priv)
+{
+	if(++priv->epoch == 0) {
+		for(uint32_t id = 0; id < priv->num_entries; ++id) priv->entries[id].epoch = 0;
+		priv->epoch = 1;
+	}
+}
+
+// the in-pool ancestors of a tx whose parents are given (not including the tx itself)
+static struct id_list * collect_ancestors(mempool_private_t * priv, const uint32_t * parents, uint32_t num_parents)
+{
+	struct id_list * list = priv->traversal;
+	list->count = 0;
+	new_epoch(priv);
+	for(uint32_t i = 0; i < num_parents; ++i) {
+		struct mempool_entry * parent = &priv->entries[parents[i]];
+		if(parent->epoch == priv->epoch) continue;
+		parent->epoch = priv->epoch;
+		id_list_push(list, parents[i]);
+	}
+	for(size_t i = 0; i < list->count; ++i) {
+		const struct mempool_entry * entry = &priv->entries[list->ids[i]];
+		for(uint32_t j = 0; j < entry->num_parents; ++j) {
+			struct mempool_entry * parent = &priv->entries[entry->parents[j]];
+			if(parent->epoch == priv->epoch) continue;
+			parent->epoch = priv->epoch;
+			id_list_push(list, entry->parents[j]);
+		}
+	}
+	return list;
+}
+
+// the in-pool descendants (not including the tx itself)
+static struct id_list * collect_descendants(mempool_private_t * priv, uint32_t id)
+{
+	struct id_list * list = priv->traversal;
+	list->count = 0;
+	new_epoch(priv);
+	priv->entries[id].epoch = priv->epoch;
+	
+	uint32_t current = id;
+	size_t i = 0;
+	while(1) {
+		const struct mempool_entry * entry = &priv->entries[current];
+		for(uint32_t j = 0; j < entry->num_children; ++j) {
+			struct mempool_entry * child = &priv->entries[entry->children[j]];
+			if(child->epoch == priv->epoch) continue;
+			child->epoch = priv->epoch;
+			id_list_push(list, entry->children[j]);
+		}
+		if(i >= list->count) break;
+		current = list->ids[i++];
+	}
+	return list;
+}
+
+static int64_t entry_memory_usage(const struct mempool_entry * entry)
+{
+	return sizeof(*entry) 
+		+ entry->txin_count * sizeof(satoshi_outpoint_t) + entry->num_parents * sizeof(uint32_t) + entry->size
+		+ entry->max_children * sizeof(uint32_t)
+		+ (2 + entry->txin_count) * 2 * sizeof(uint64_t)	// hash index slots (load factor ~ 0.5)
+		+ sizeof(uint32_t);	// heap
+}
+
+static void add_child(mempool_private_t * priv, uint32_t parent_id, uint32_t child_id)
+{
+	struct mempool_entry * parent = &priv->entries[parent_id];
+	if(parent->num_children >= parent->max_children) {
+		uint32_t new_size = parent->max_children?(parent->max_children * 2):4;
+		uint32_t * children = realloc(parent->children, new_size * sizeof(*children));
+		assert(children);
+		parent->children = children;
+		parent->max_children = new_size;
+		
+		priv->memory_usage -= parent->mem_usage;
+		parent->mem_usage = entry_memory_usage(parent);
+		priv->memory_usage += parent->mem_usage;
+	}
+	parent->children[parent->num_children++] = child_id;
+}
+
+static void remove_link(uint32_t * ids, uint32_t * p_count, uint32_t id)
+{
+	uint32_t count = *p_count;
+	for(uint32_t i = 0; i < count; ++i) {
+		if(ids[i] == id) {
+			ids[i] = ids[--count];
+			*p_count = count;
+			return;
+		}
+	}
+}
+
+/*
+ * remove_entries(): remove the entries in priv->removal (marked as 'removing'),
+ *   the aggregates of the remaining ancestors and descendants are updated.
+ */
+static void remove_entries(mempool_private_t * priv, int evicted)
+{
+	mempool_t * pool = priv->pool;
+	struct id_list * removal = priv->removal;
+	
+	for(size_t i = 0; i < removal->count; ++i) {
+		const struct mempool_entry * entry = &priv->entries[removal->ids[i]];
+		
+		struct id_list * list = collect_ancestors(priv, entry->parents, entry->num_parents);
+		for(size_t j = 0; j < list->count; ++j) {
+			struct mempool_entry * ancestor = &priv->entries[list->ids[j]];
+			if(ancestor->removing) continue;
+			ancestor->descendant_count -= 1;
+			ancestor->descendant_vsize -= entry->vsize;
+			ancestor->descendant_fees -= entry->fee;
+			heap_update(priv, list->ids[j]);
+		}
+		
+		list = collect_descendants(priv, removal->ids[i]);
+		for(size_t j = 0; j < list->count; ++j) {
+			struct mempool_entry * descendant = &priv->entries[list->ids[j]];
+			if(descendant->removing) continue;
+			descendant->ancestor_count -= 1;
+			descendant->ancestor_vsize -= entry->vsize;
+			descendant->ancestor_fees -= entry->fee;
+		}
+	}
+	
+	for(size_t i = 0; i < removal->count; ++i) {
+		uint32_t id = removal->ids[i];
+		struct mempool_entry * entry = &priv->entries[id];
+		
+		for(uint32_t j = 0; j < entry->num_parents; ++j) {
+			struct mempool_entry * parent = &priv->entries[entry->parents[j]];
+			if(!parent->removing) remove_link(parent->children, &parent->num_children, id);
+		}
+		for(uint32_t j = 0; j < entry->num_children; ++j) {
+			struct mempool_entry * child = &priv->entries[entry->children[j]];
+			if(!child->removing) remove_link(child->parents, &child->num_parents, id);
+		}
+		
+		hash_index_remove(priv->txids, hash_index_find(priv->txids, hash_u256(priv->salt, &entry->txid, 0), &entry->txid));
+		hash_index_remove(priv->wtxids, hash_index_find(priv->wtxids, hash_u256(priv->salt, &entry->wtxid, 0), &entry->wtxid));
+		for(uint32_t j = 0; j < entry->txin_count; ++j) {
+			hash_index_remove(priv->outpoints, hash_index_find(priv->outpoints, outpoint_hash(priv, &entry->spent[j]), &entry->spent[j]));
+		}
+		heap_remove(priv, id);
+		if(pool->on_tx_removed) pool->on_tx_removed(pool, &entry->txid, evicted);
+		
+		priv->count -= 1;
+		priv->total_vsize -= entry->vsize;
+		priv->total_fees -= entry->fee;
+		priv->memory_usage -= entry->mem_usage;
+		if(evicted) ++priv->evicted;
+		
+		free(entry->data);
+		free(entry->children);
+		memset(entry, 0, sizeof(*entry));
+		id_list_push(priv->free_ids, id);
+	}
+	removal->count = 0;
+}
+
+// mark an entry and all its descendants to be removed
+static void add_removal_with_descendants(mempool_private_t * priv, uint32_t id)
+{
+	if(!priv->entries[id].removing) {
+		priv->entries[id].removing = 1;
+		id_list_push(priv->removal, id);
+	}
+	struct id_list * list = collect_descendants(priv, id);
+	for(size_t i = 0; i < list->count; ++i) {
+		struct mempool_entry * entry = &priv->entries[list->ids[i]];
+		if(entry->removing) continue;
+		entry->removing = 1;
+		id_list_push(priv->removal, list->ids[i]);
+	}
+}
+
+/*************************************
+ * rolling minimum fee rate
+ ************************************/
+static double get_min_fee_rate(mempool_private_t * priv, int64_t now)
+{
+	mempool_t * pool = priv->pool;
+	if(priv->min_fee_rate <= 0) return 0;
+	
+	// decays faster when the pool is far from full
+	double halflife = MEMPOOL_MIN_FEE_HALFLIFE;
+	if(priv->memory_usage < pool->max_memory / 4) halflife /= 4;
+	else if(priv->memory_usage < pool->max_memory / 2) halflife /= 2;
+	
+	if(now > priv->min_fee_rate_updated) {
+		priv->min_fee_rate *= exp2(-(double)(now - priv->min_fee_rate_updated) / halflife);
+		priv->min_fee_rate_updated = now;
+		if(priv->min_fee_rate < pool->incremental_fee_rate / 2) priv->min_fee_rate = 0;
+	}
+	return priv->min_fee_rate;
+}
+
+// evict the cheapest packages until the memory usage is under the limit
+static void trim_to_size(mempool_private_t * priv, int64_t now)
+{
+	mempool_t * pool = priv->pool;
+	while(priv->memory_usage > pool->max_memory && priv->heap_size > 0) {
+		uint32_t id = priv->heap[0];
+		double fee_rate = descendant_score(&priv->entries[id]) + pool->incremental_fee_rate;
+		
+		add_removal_with_descendants(priv, id);
+		remove_entries(priv, 1);
+		
+		get_min_fee_rate(priv, now);
+		if(fee_rate > priv->min_fee_rate) priv->min_fee_rate = fee_rate;
+		priv->min_fee_rate_updated = now;
+	}
+}
+
+/*************************************
+ * mempool
+ ************************************/
+static mempool_private_t * mempool_private_new(mempool_t * pool)
+{
+	mempool_private_t * priv = calloc(1, sizeof(*priv));
+	assert(priv);
+	priv->pool = pool;
+	
+	struct timespec ts[1];
+	clock_gettime(CLOCK_REALTIME, ts);
+	priv->salt = mix64(((uint64_t)ts->tv_sec << 32) ^ (uint64_t)ts->tv_nsec ^ ((uint64_t)getpid() << 16) ^ (uint64_t)(uintptr_t)priv);
+	
+	priv->max_entries = 1024;
+	priv->entries = calloc(priv->max_entries, sizeof(*priv->entries));
+	priv->heap = calloc(priv->max_entries, sizeof(*priv->heap));
+	assert(priv->entries && priv->heap);
+	
+	hash_index_init(priv->txids, priv, 2048, txid_hash_of, txid_match);
+	hash_index_init(priv->wtxids, priv, 2048, wtxid_hash_of, wtxid_match);
+	hash_index_init(priv->outpoints, priv, 4096, outpoint_hash_of, outpoint_match);
+	return priv;
+}
+
+static void mempool_private_free(mempool_private_t * priv)
+{
+	if(NULL == priv) return;
+	for(uint32_t id = 0; id < priv->num_entries; ++id) {
+		free(priv->entries[id].data);
+		free(priv->entries[id].children);
+	}
+	free(priv->entries);
+	free(priv->heap);
+	hash_index_cleanup(priv->txids);
+	hash_index_cleanup(priv->wtxids);
+	hash_index_cleanup(priv->outpoints);
+	free(priv->free_ids->ids);
+	free(priv->traversal->ids);
+	free(priv->removal->ids);
+	free(priv->parents->ids);
+	free(priv);
+}
+
+mempool_t * mempool_new(int64_t max_memory, void * user_data)
+{
+	mempool_t * pool = calloc(1, sizeof(*pool));
+	assert(pool);
+	pool->user_data = user_data;
+	pool->max_memory = (max_memory > 0)?max_memory:MEMPOOL_DEFAULT_MAX_MEMORY;
+	pool->min_relay_fee_rate = MEMPOOL_DEFAULT_MIN_RELAY_FEE_RATE;
+	pool->incremental_fee_rate = MEMPOOL_DEFAULT_INCREMENTAL_FEE_RATE;
+	pthread_mutex_init(&pool->mutex, NULL);
+	
+	pool->priv = mempool_private_new(pool);
+	return pool;
+}
+
+void mempool_free(mempool_t * pool)
+{
+	if(NULL == pool) return;
+	mempool_private_free(pool->priv);
+	pool->priv = NULL;
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+static uint32_t alloc_entry(mempool_private_t * priv)
+{
+	if(priv->free_ids->count > 0) return priv->free_ids->ids[--priv->free_ids->count];
+	if(priv->num_entries >= priv->max_entries) {
+		uint32_t new_size = priv->max_entries * 2;
+		struct mempool_entry * entries = realloc(priv->entries, new_size * sizeof(*entries));
+		uint32_t * heap = realloc(priv->heap, new_size * sizeof(*heap));
+		assert(entries && heap);
+		memset(entries + priv->max_entries, 0, (new_size - priv->max_entries) * sizeof(*entries));
+		priv->entries = entries;
+		priv->heap = heap;
+		priv->max_entries = new_size;
+	}
+	return priv->num_entries++;
+}
+
+enum mempool_status mempool_add(mempool_t * pool, const satoshi_tx_t * tx, int64_t fee)
+{
+	assert(pool && pool->priv && tx);
+	if(tx->txin_count <= 0 || tx->txout_count <= 0 || fee < 0) return mempool_status_invalid;
+	
+	ssize_t size = satoshi_tx_serialize(tx, NULL);
+	if(size <= 0 || size > INT32_MAX) return mempool_status_invalid;
+	
+	// BIP141: weight = base_size * 3 + total_size, vsize = ceil(weight / 4)
+	ssize_t base_size = size - (tx->has_flag?(2 + tx->cb_witnesses):0);
+	int64_t vsize = (base_size * 3 + size + 3) / 4;
+	if(vsize > MEMPOOL_MAX_PACKAGE_VSIZE) return mempool_status_too_long_chain;
+	
+	const uint256_t * wtxid = tx->has_flag?tx->wtxid:tx->txid;
+	int64_t now = time(NULL);
+	
+	mempool_private_t * priv = pool->priv;
+	enum mempool_status status = mempool_status_ok;
+	pthread_mutex_lock(&pool->mutex);
+	
+	if(find_txid(priv, tx->txid) != MEMPOOL_INVALID_ID || find_wtxid(priv, wtxid) != MEMPOOL_INVALID_ID) {
+		status = mempool_status_duplicate;
+		goto label_final;
+	}
+	
+	double fee_rate = entry_fee_rate(fee, vsize);
+	if(fee_rate < pool->min_relay_fee_rate || fee_rate < get_min_fee_rate(priv, now)) {
+		status = mempool_status_fee_too_low;
+		goto label_final;
+	}
+	
+	// conflicts and parents
+	struct id_list * parents = priv->parents;
+	parents->count = 0;
+	new_epoch(priv);
+	for(ssize_t i = 0; i < tx->txin_count; ++i) {
+		const satoshi_outpoint_t * outpoint = &tx->txins[i].outpoint;
+		if(find_spender(priv, outpoint) != MEMPOOL_INVALID_ID) {
+			status = mempool_status_conflict;
+			goto label_final;
+		}
+		uint32_t parent_id = find_txid(priv, (const uint256_t *)outpoint->prev_hash);
+		if(parent_id == MEMPOOL_INVALID_ID || priv->entries[parent_id].epoch == priv->epoch) continue;
+		priv->entries[parent_id].epoch = priv->epoch;
+		id_list_push(parents, parent_id);
+	}
+	
+	// package limits
+	struct id_list * ancestors = collect_ancestors(priv, parents->ids, parents->count);
+	int64_t ancestor_vsize = vsize, ancestor_fees = fee;
+	if(ancestors->count + 1 > MEMPOOL_MAX_ANCESTORS) {
+		status = mempool_status_too_long_chain;
+		goto label_final;
+	}
+	for(size_t i = 0; i < ancestors->count; ++i) {
+		const struct mempool_entry * ancestor = &priv->entries[ancestors->ids[i]];
+		if(ancestor->descendant_count + 1 > MEMPOOL_MAX_DESCENDANTS
+			|| ancestor->descendant_vsize + vsize > MEMPOOL_MAX_PACKAGE_VSIZE) {
+			status = mempool_status_too_long_chain;
+			goto label_final;
+		}
+		ancestor_vsize += ancestor->vsize;
+		ancestor_fees += ancestor->fee;
+	}
+	if(ancestor_vsize > MEMPOOL_MAX_PACKAGE_VSIZE) {
+		status = mempool_status_too_long_chain;
+		goto label_final;
+	}
+	
+	// add the entry
+	uint32_t id = alloc_entry(priv);
+	struct mempool_entry * entry = &priv->entries[id];
+	memset(entry, 0, sizeof(*entry));
+	entry->txid = *tx->txid;
+	entry->wtxid = *wtxid;
+	entry->fee = fee;
+	entry->vsize = (int32_t)vsize;
+	entry->size = (int32_t)size;
+	entry->time = now;
+	entry->in_use = 1;
+	entry->ancestor_count = (int32_t)ancestors->count + 1;
+	entry->ancestor_vsize = ancestor_vsize;
+	entry->ancestor_fees = ancestor_fees;
+	entry->descendant_count = 1;
+	entry->descendant_vsize = vsize;
+	entry->descendant_fees = fee;
+	
+	entry->txin_count = (uint32_t)tx->txin_count;
+	entry->num_parents = (uint32_t)parents->count;
+	size_t cb_spent = entry->txin_count * sizeof(satoshi_outpoint_t);
+	size_t cb_parents = entry->num_parents * sizeof(uint32_t);
+	entry->data = malloc(cb_spent + cb_parents + size);
+	assert(entry->data);
+	entry->spent = (satoshi_outpoint_t *)entry->data;
+	entry->parents = (uint32_t *)(entry->data + cb_spent);
+	entry->raw_tx = entry->data + cb_spent + cb_parents;
+	for(ssize_t i = 0; i < tx->txin_count; ++i) entry->spent[i] = tx->txins[i].outpoint;
+	if(cb_parents) memcpy(entry->parents, parents->ids, cb_parents);
+	
+	unsigned char * raw_tx = entry->raw_tx;
+	ssize_t cb = satoshi_tx_serialize(tx, &raw_tx);
+	assert(cb == size);
+	
+	hash_index_insert(priv->txids, hash_u256(priv->salt, &entry->txid, 0), id);
+	hash_index_insert(priv->wtxids, hash_u256(priv->salt, &entry->wtxid, 0), id);
+	for(uint32_t i = 0; i < entry->txin_count; ++i) {
+		hash_index_insert(priv->outpoints, outpoint_hash(priv, &entry->spent[i]), ((uint64_t)id << 32) | i);
+	}
+	
+	for(uint32_t i = 0; i < entry->num_parents; ++i) add_child(priv, entry->parents[i], id);
+	for(size_t i = 0; i < ancestors->count; ++i) {
+		struct mempool_entry * ancestor = &priv->entries[ancestors->ids[i]];
+		ancestor->descendant_count += 1;
+		ancestor->descendant_vsize += vsize;
+		ancestor->descendant_fees += fee;
+		heap_update(priv, ancestors->ids[i]);
+	}
+	heap_push(priv, id);
+	
+	entry = &priv->entries[id];
+	entry->mem_usage = entry_memory_usage(entry);
+	priv->count += 1;
+	priv->total_vsize += vsize;
+	priv->total_fees += fee;
+	priv->memory_usage += entry->mem_usage;
+	
+	trim_to_size(priv, now);
+	if(!priv->entries[id].in_use || memcmp(&priv->entries[id].txid, tx->txid, sizeof(uint256_t)) != 0) {
+		status = mempool_status_full;
+	}
+	
+label_final:
+	pthread_mutex_unlock(&pool->mutex);
+	return status;
+}
+
+int mempool_contains(mempool_t * pool, const uint256_t * hash, int is_wtxid)
+{
+	mempool_private_t * priv = pool->priv;
+	pthread_mutex_lock(&pool->mutex);
+	uint32_t id = is_wtxid?find_wtxid(priv, hash):find_txid(priv, hash);
+	pthread_mutex_unlock(&pool->mutex);
+	return (id != MEMPOOL_INVALID_ID);
+}
+
+int mempool_get_entry_info(mempool_t * pool, const uint256_t * txid, struct mempool_entry_info * info)
+{
+	mempool_private_t * priv = pool->priv;
+	pthread_mutex_lock(&pool->mutex);
+	uint32_t id = find_txid(priv, txid);
+	if(id != MEMPOOL_INVALID_ID && info) {
+		const struct mempool_entry * entry = &priv->entries[id];
+		info->txid = entry->txid;
+		info->wtxid = entry->wtxid;
+		info->fee = entry->fee;
+		info->vsize = entry->vsize;
+		info->size = entry->size;
+		info->time = entry->time;
+		info->ancestor_count = entry->ancestor_count;
+		info->ancestor_vsize = entry->ancestor_vsize;
+		info->ancestor_fees = entry->ancestor_fees;
+		info->descendant_count = entry->descendant_count;
+		info->descendant_vsize = entry->descendant_vsize;
+		info->descendant_fees = entry->descendant_fees;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return (id != MEMPOOL_INVALID_ID)?0:-1;
+}
+
+ssize_t mempool_get_tx(mempool_t * pool, const uint256_t * hash, int is_wtxid, unsigned char ** p_data)
+{
+	assert(p_data);
+	mempool_private_t * priv = pool->priv;
+	ssize_t size = -1;
+	
+	pthread_mutex_lock(&pool->mutex);
+	uint32_t id = is_wtxid?find_wtxid(priv, hash):find_txid(priv, hash);
+	if(id != MEMPOOL_INVALID_ID) {
+		const struct mempool_entry * entry = &priv->entries[id];
+		size = entry->size;
+		unsigned char * data = malloc(size);
+		assert(data);
+		memcpy(data, entry->raw_tx, size);
+		*p_data = data;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return size;
+}
+
+int mempool_get_spender(mempool_t * pool, const satoshi_outpoint_t * outpoint, uint256_t * txid)
+{
+	mempool_private_t * priv = pool->priv;
+	pthread_mutex_lock(&pool->mutex);
+	uint32_t id = find_spender(priv, outpoint);
+	if(id != MEMPOOL_INVALID_ID && txid) *txid = priv->entries[id].txid;
+	pthread_mutex_unlock(&pool->mutex);
+	return (id != MEMPOOL_INVALID_ID);
+}
+
+ssize_t mempool_get_hashes(mempool_t * pool, uint256_t ** p_txids, uint256_t ** p_wtxids)
+{
+	mempool_private_t * priv = pool->priv;
+	uint256_t * txids = NULL;
+	uint256_t * wtxids = NULL;
+	ssize_t count = 0;
+	
+	pthread_mutex_lock(&pool->mutex);
+	if(priv->count > 0) {
+		if(p_txids) { txids = malloc(priv->count * sizeof(*txids)); assert(txids); }
+		if(p_wtxids) { wtxids = malloc(priv->count * sizeof(*wtxids)); assert(wtxids); }
+	}
+	for(uint32_t id = 0; id < priv->num_entries && count < priv->count; ++id) {
+		const struct mempool_entry * entry = &priv->entries[id];
+		if(!entry->in_use) continue;
+		if(txids) txids[count] = entry->txid;
+		if(wtxids) wtxids[count] = entry->wtxid;
+		++count;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	
+	if(p_txids) *p_txids = txids;
+	if(p_wtxids) *p_wtxids = wtxids;
+	return count;
+}
+
+ssize_t mempool_remove(mempool_t * pool, const uint256_t * txid)
+{
+	mempool_private_t * priv = pool->priv;
+	ssize_t count = 0;
+	pthread_mutex_lock(&pool->mutex);
+	uint32_t id = find_txid(priv, txid);
+	if(id != MEMPOOL_INVALID_ID) {
+		add_removal_with_descendants(priv, id);
+		count = priv->removal->count;
+		remove_entries(priv, 0);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return count;
+}
+
+ssize_t mempool_remove_for_block(mempool_t * pool, const satoshi_tx_t * txs, ssize_t count)
+{
+	mempool_private_t * priv = pool->priv;
+	ssize_t num_removed = 0;
+	pthread_mutex_lock(&pool->mutex);
+	
+	struct id_list * removal = priv->removal;
+	removal->count = 0;
+	for(ssize_t i = 0; i < count; ++i) {
+		const satoshi_tx_t * tx = &txs[i];
+		
+		// confirmed: its descendants stay in the pool, their inputs are now in the utxo set
+		uint32_t id = find_txid(priv, tx->txid);
+		if(id != MEMPOOL_INVALID_ID && !priv->entries[id].removing) {
+			priv->entries[id].removing = 1;
+			id_list_push(removal, id);
+		}
+		
+		// conflicts: double spent by the block
+		for(ssize_t j = 0; j < tx->txin_count; ++j) {
+			uint32_t spender = find_spender(priv, &tx->txins[j].outpoint);
+			if(spender == MEMPOOL_INVALID_ID || spender == id) continue;
+			add_removal_with_descendants(priv, spender);
+		}
+	}
+	num_removed = removal->count;
+	remove_entries(priv, 0);
+	
+	pthread_mutex_unlock(&pool->mutex);
+	return num_removed;
+}
+
+struct template_candidate
+{
+	double score;
+	int32_t ancestor_count;
+	uint32_t id;
+};
+
+static int compare_candidates(const void * _a, const void * _b)
+{
+	const struct template_candidate * a = _a;
+	const struct template_candidate * b = _b;
+	if(a->score != b->score) return (a->score > b->score)?-1:1;	// highest ancestor fee rate first
+	if(a->ancestor_count != b->ancestor_count) return a->ancestor_count - b->ancestor_count;
+	return (a->id < b->id)?-1:(a->id > b->id);
+}
+
+ssize_t mempool_select_txs(mempool_t * pool, int64_t max_vsize, uint256_t ** p_txids, int64_t * p_total_fees)
+{
+	assert(p_txids);
+	mempool_private_t * priv = pool->priv;
+	ssize_t count = 0;
+	int64_t total_vsize = 0, total_fees = 0;
+	
+	pthread_mutex_lock(&pool->mutex);
+	struct template_candidate * candidates = calloc(priv->count + 1, sizeof(*candidates));
+	uint8_t * included = calloc(priv->num_entries + 1, 1);
+	uint256_t * txids = calloc(priv->count + 1, sizeof(*txids));
+	assert(candidates && included && txids);
+	
+	ssize_t num_candidates = 0;
+	for(uint32_t id = 0; id < priv->num_entries; ++id) {
+		const struct mempool_entry * entry = &priv->entries[id];
+		if(!entry->in_use) continue;
+		candidates[num_candidates++] = (struct template_candidate){
+			.score = entry_fee_rate(entry->ancestor_fees, entry->ancestor_vsize),
+			.ancestor_count = entry->ancestor_count,
+			.id = id,
+		};
+	}
+	qsort(candidates, num_candidates, sizeof(*candidates), compare_candidates);
+	
+	struct id_list package[1];
+	memset(package, 0, sizeof(package));
+	for(ssize_t i = 0; i < num_candidates; ++i) {
+		uint32_t id = candidates[i].id;
+		if(included[id]) continue;
+		
+		// the package: the tx and its ancestors not yet included
+		const struct mempool_entry * entry = &priv->entries[id];
+		struct id_list * ancestors = collect_ancestors(priv, entry->parents, entry->num_parents);
+		package->count = 0;
+		int64_t package_vsize = entry->vsize;
+		for(size_t j = 0; j < ancestors->count; ++j) {
+			if(included[ancestors->ids[j]]) continue;
+			id_list_push(package, ancestors->ids[j]);
+			package_vsize += priv->entries[ancestors->ids[j]].vsize;
+		}
+		id_list_push(package, id);
+		if(total_vsize + package_vsize > max_vsize) continue;
+		
+		// topological order: a parent has fewer ancestors than its children
+		for(size_t j = 1; j < package->count; ++j) {
+			uint32_t key = package->ids[j];
+			size_t k = j;
+			for(; k > 0 && priv->entries[package->ids[k - 1]].ancestor_count > priv->entries[key].ancestor_count; --k) {
+				package->ids[k] = package->ids[k - 1];
+			}
+			package->ids[k] = key;
+		}
+		for(size_t j = 0; j < package->count; ++j) {
+			const struct mempool_entry * member = &priv->entries[package->ids[j]];
+			included[package->ids[j]] = 1;
+			txids[count++] = member->txid;
+			total_fees += member->fee;
+		}
+		total_vsize += package_vsize;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	
+	free(package->ids);
+	free(candidates);
+	free(included);
+	
+	*p_txids = txids;
+	if(p_total_fees) *p_total_fees = total_fees;
+	return count;
+}
+
+void mempool_get_stats(mempool_t * pool, struct mempool_stats * stats)
+{
+	assert(stats);
+	mempool_private_t * priv = pool->priv;
+	pthread_mutex_lock(&pool->mutex);
+	stats->count = priv->count;
+	stats->total_vsize = priv->total_vsize;
+	stats->total_fees = priv->total_fees;
+	stats->memory_usage = priv->memory_usage;
+	stats->min_fee_rate = (int64_t)get_min_fee_rate(priv, time(NULL));
+	stats->evicted = priv->evicted;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+
+#if defined(_TEST_MEMPOOL) && defined(_STAND_ALONE)
+static uint64_t s_tx_seq;
+
+// a tx with 'num_outputs' outputs, spending the given outpoints (fake scripts, unique txid)
+static void make_tx(satoshi_tx_t * tx, const satoshi_outpoint_t * outpoints, ssize_t num_inputs, ssize_t num_outputs)
+{
+	static const unsigned char scripts[107] = { 0 };
+	memset(tx, 0, sizeof(*tx));
+	tx->version = 2;
+	tx->txin_count = num_inputs;
+	tx->txins = calloc(num_inputs, sizeof(*tx->txins));
+	for(ssize_t i = 0; i < num_inputs; ++i) {
+		tx->txins[i].outpoint = outpoints[i];
+		tx->txins[i].scripts = varstr_new(scripts, sizeof(scripts));
+		tx->txins[i].sequence = 0xffffffff;
+	}
+	tx->txout_count = num_outputs;
+	tx->txouts = calloc(num_outputs, sizeof(*tx->txouts));
+	for(ssize_t i = 0; i < num_outputs; ++i) {
+		tx->txouts[i].value = 1000;
+		tx->txouts[i].scripts = varstr_new(scripts, 25);
+	}
+	
+	uint64_t seq = ++s_tx_seq;
+	hash256(&seq, sizeof(seq), (uint8_t *)tx->txid);
+}
+
+static satoshi_outpoint_t outpoint_of(const satoshi_tx_t * tx, uint32_t index)
+{
+	satoshi_outpoint_t outpoint;
+	memcpy(outpoint.prev_hash, tx->txid, 32);
+	outpoint.index = index;
+	return outpoint;
+}
+
+static satoshi_outpoint_t confirmed_outpoint(void)
+{
+	satoshi_outpoint_t outpoint = { .index = 0 };
+	uint64_t seq = ++s_tx_seq | (1ULL << 63);
+	hash256(&seq, sizeof(seq), outpoint.prev_hash);
+	return outpoint;
+}
+
+static int64_t s_vsize;	// all the test txs with 1 input and 1 output have the same size
+
+static void test_package_graph(void)
+{
+	mempool_t * pool = mempool_new(0, NULL);
+	satoshi_tx_t txs[4];
+	struct mempool_entry_info info[1];
+	
+	// a: confirmed --> a --> b --> c, d conflicts with a
+	satoshi_outpoint_t outpoint = confirmed_outpoint();
+	make_tx(&txs[0], &outpoint, 1, 1);
+	assert(mempool_add(pool, &txs[0], 1000) == mempool_status_ok);
+	assert(mempool_add(pool, &txs[0], 1000) == mempool_status_duplicate);
+	mempool_get_entry_info(pool, txs[0].txid, info);
+	s_vsize = info->vsize;
+	
+	make_tx(&txs[3], &outpoint, 1, 1);
+	assert(mempool_add(pool, &txs[3], 100000) == mempool_status_conflict);
+	assert(mempool_add(pool, &txs[3], 10) == mempool_status_fee_too_low);
+	
+	outpoint = outpoint_of(&txs[0], 0);
+	make_tx(&txs[1], &outpoint, 1, 1);
+	assert(mempool_add(pool, &txs[1], 2000) == mempool_status_ok);
+	outpoint = outpoint_of(&txs[1], 0);
+	make_tx(&txs[2], &outpoint, 1, 1);
+	assert(mempool_add(pool, &txs[2], 30000) == mempool_status_ok);
+	
+	assert(0 == mempool_get_entry_info(pool, txs[0].txid, info));
+	assert(info->descendant_count == 3 && info->descendant_fees == 33000 && info->descendant_vsize == 3 * s_vsize);
+	assert(0 == mempool_get_entry_info(pool, txs[2].txid, info));
+	assert(info->ancestor_count == 3 && info->ancestor_fees == 33000);
+	
+	uint256_t spender;
+	assert(mempool_get_spender(pool, &outpoint, &spender) && 0 == memcmp(&spender, txs[2].txid, 32));
+	
+	unsigned char * raw_tx = NULL;
+	ssize_t cb = mempool_get_tx(pool, txs[1].txid, 0, &raw_tx);
+	assert(cb > 0 && cb == satoshi_tx_serialize(&txs[1], NULL));
+	free(raw_tx);
+	
+	// CPFP: a, b, c are selected as a package before an independent tx with a medium fee rate
+	satoshi_tx_t medium[1];
+	outpoint = confirmed_outpoint();
+	make_tx(medium, &outpoint, 1, 1);
+	assert(mempool_add(pool, medium, 5000) == mempool_status_ok);
+	
+	uint256_t * txids = NULL;
+	int64_t fees = 0;
+	ssize_t count = mempool_select_txs(pool, 10 * s_vsize, &txids, &fees);
+	assert(count == 4 && fees == 38000);
+	assert(0 == memcmp(&txids[0], txs[0].txid, 32));
+	assert(0 == memcmp(&txids[1], txs[1].txid, 32));
+	assert(0 == memcmp(&txids[2], txs[2].txid, 32));
+	assert(0 == memcmp(&txids[3], medium->txid, 32));
+	free(txids);
+	
+	// not enough room for the whole package: the next best ones which fit
+	count = mempool_select_txs(pool, 2 * s_vsize, &txids, &fees);
+	assert(count == 2 && fees == 6000);
+	assert(0 == memcmp(&txids[0], medium->txid, 32) && 0 == memcmp(&txids[1], txs[0].txid, 32));
+	free(txids);
+	
+	// a block confirms a: b and c stay, the ancestors of c are updated
+	assert(1 == mempool_remove_for_block(pool, &txs[0], 1));
+	assert(!mempool_contains(pool, txs[0].txid, 0));
+	assert(0 == mempool_get_entry_info(pool, txs[2].txid, info));
+	assert(info->ancestor_count == 2 && info->ancestor_fees == 32000 && info->ancestor_vsize == 2 * s_vsize);
+	
+	// a block double-spends b's input: b and c are removed
+	satoshi_tx_t double_spend[1];
+	outpoint = outpoint_of(&txs[0], 0);
+	make_tx(double_spend, &outpoint, 1, 1);
+	assert(2 == mempool_remove_for_block(pool, double_spend, 1));
+	assert(!mempool_contains(pool, txs[1].txid, 0) && !mempool_contains(pool, txs[2].txid, 0));
+	
+	struct mempool_stats stats[1];
+	mempool_get_stats(pool, stats);
+	assert(stats->count == 1 && stats->total_fees == 5000);
+	
+	for(int i = 0; i < 4; ++i) satoshi_tx_cleanup(&txs[i]);
+	satoshi_tx_cleanup(medium);
+	satoshi_tx_cleanup(double_spend);
+	mempool_free(pool);
+	printf("package graph: [%s]\n", "\e[32mOK\e[39m");
+}
+
+static void test_chain_limits(void)
+{
+	mempool_t * pool = mempool_new(0, NULL);
+	satoshi_tx_t txs[MEMPOOL_MAX_ANCESTORS + 1];
+	
+	satoshi_outpoint_t outpoint = confirmed_outpoint();
+	for(int i = 0; i <= MEMPOOL_MAX_ANCESTORS; ++i) {
+		make_tx(&txs[i], &outpoint, 1, 1);
+		enum mempool_status status = mempool_add(pool, &txs[i], 1000);
+		assert(status == ((i < MEMPOOL_MAX_ANCESTORS)?mempool_status_ok:mempool_status_too_long_chain));
+		outpoint = outpoint_of(&txs[i], 0);
+	}
+	
+	// removing the 10th tx removes all of its descendants
+	assert(mempool_remove(pool, txs[9].txid) == MEMPOOL_MAX_ANCESTORS - 9);
+	struct mempool_entry_info info[1];
+	assert(0 == mempool_get_entry_info(pool, txs[0].txid, info));
+	assert(info->descendant_count == 9);
+	
+	for(int i = 0; i <= MEMPOOL_MAX_ANCESTORS; ++i) satoshi_tx_cleanup(&txs[i]);
+	mempool_free(pool);
+	printf("chain limits: [%s]\n", "\e[32mOK\e[39m");
+}
+
+static void test_memory_limit(int num_txs)
+{
+	const int64_t max_memory = 1024 * 1024;
+	mempool_t * pool = mempool_new(max_memory, NULL);
+	
+	satoshi_tx_t tx[1];
+	int64_t num_ok = 0, num_full = 0, num_too_low = 0;
+	
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	for(int i = 0; i < num_txs; ++i) {
+		satoshi_outpoint_t outpoint = confirmed_outpoint();
+		make_tx(tx, &outpoint, 1, 2);
+		
+		int64_t fee = 200 + (mix64(i) % 20000);	// 1..100 sat/vB
+		enum mempool_status status = mempool_add(pool, tx, fee);
+		if(status == mempool_status_ok) ++num_ok;
+		else if(status == mempool_status_full) ++num_full;
+		else if(status == mempool_status_fee_too_low) ++num_too_low;
+		else assert(0);
+		
+		satoshi_tx_cleanup(tx);
+	}
+	double elapsed = app_timer_stop(timer);
+	
+	struct mempool_stats stats[1];
+	mempool_get_stats(pool, stats);
+	printf("%d txs added in %.3f seconds (%.0f tx/s), ok: %ld, full: %ld, fee too low: %ld\n",
+		num_txs, elapsed, num_txs / elapsed, (long)num_ok, (long)num_full, (long)num_too_low);
+	printf("  count: %ld, memory_usage: %ld / %ld, evicted: %ld, min_fee_rate: %ld sat/kvB\n",
+		(long)stats->count, (long)stats->memory_usage, (long)max_memory, (long)stats->evicted, (long)stats->min_fee_rate);
+	assert(stats->memory_usage <= max_memory);
+	assert(stats->evicted > 0 && stats->min_fee_rate > MEMPOOL_DEFAULT_MIN_RELAY_FEE_RATE);
+	
+	// the cheapest txs were evicted: the pool only holds txs above the (raised) minimum fee rate
+	uint256_t * txids = NULL;
+	ssize_t count = mempool_select_txs(pool, INT64_MAX, &txids, NULL);
+	assert(count == stats->count);
+	for(ssize_t i = 0; i < count; ++i) {
+		struct mempool_entry_info info[1];
+		assert(0 == mempool_get_entry_info(pool, &txids[i], info));
+		assert(entry_fee_rate(info->fee, info->vsize) + MEMPOOL_DEFAULT_INCREMENTAL_FEE_RATE >= stats->min_fee_rate);
+	}
+	free(txids);
+	
+	mempool_free(pool);
+	printf("memory limit: [%s]\n", "\e[32mOK\e[39m");
+}
+
+// add txs (every other one spends its predecessor), then confirm them in blocks
+static void test_throughput(int num_txs)
+{
+	mempool_t * pool = mempool_new(0, NULL);
+	satoshi_tx_t * txs = calloc(num_txs, sizeof(*txs));
+	assert(txs);
+	
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	for(int i = 0; i < num_txs; ++i) {
+		satoshi_outpoint_t outpoint = (i & 1)?outpoint_of(&txs[i - 1], 1):confirmed_outpoint();
+		make_tx(&txs[i], &outpoint, 1, 2);
+		enum mempool_status status = mempool_add(pool, &txs[i], 1000 + (mix64(i) % 20000));
+		assert(status == mempool_status_ok);
+	}
+	double add_time = app_timer_stop(timer);
+	
+	uint256_t * txids = NULL;
+	app_timer_start(timer);
+	ssize_t count = mempool_select_txs(pool, 1000000, &txids, NULL);
+	double select_time = app_timer_stop(timer);
+	free(txids);
+	
+	const int block_size = 2000;
+	app_timer_start(timer);
+	for(int i = 0; i < num_txs; i += block_size) {
+		int n = (i + block_size <= num_txs)?block_size:(num_txs - i);
+		assert(mempool_remove_for_block(pool, &txs[i], n) == n);
+	}
+	double remove_time = app_timer_stop(timer);
+	
+	struct mempool_stats stats[1];
+	mempool_get_stats(pool, stats);
+	assert(stats->count == 0 && stats->memory_usage == 0);
+	
+	printf("throughput: add: %.0f tx/s, remove_for_block: %.0f tx/s, select %ld txs: %.3f ms\n",
+		num_txs / add_time, num_txs / remove_time, (long)count, select_time * 1000.0);
+	
+	for(int i = 0; i < num_txs; ++i) satoshi_tx_cleanup(&txs[i]);
+	free(txs);
+	mempool_free(pool);
+}
+
+int main(int argc, char ** argv)
+{
+	int num_txs = 100000;
+	if(argc > 1) num_txs = atoi(argv[1]);
+	
+	test_package_graph();
+	test_chain_limits();
+	test_memory_limit(num_txs);
+	test_throughput(num_txs);
+	return 0;
+}
+#endif
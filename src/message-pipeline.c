@@ -0,0 +1,642 @@
+/*
+ * message-pipeline.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "utils.h"
+#include "satoshi-types.h"
+#include "bitcoin-message.h"
+#include "message-pipeline.h"
+#include "lockfree_queue.h"
+
+#define MESSAGE_PIPELINE_IDLE_TIMEOUT_MS	(100)	// re-check the blocked sources at least this often
+
+struct pipeline_item
+{
+	message_pipeline_source_t * source;
+	int64_t submitted_at;	// ns
+	int64_t parsed_at;
+	int parse_rc;
+
+	bitcoin_message_t msg[1];
+	size_t size;	// sizeof(hdr) + hdr.length
+	struct bitcoin_message_header hdr;	// followed by the payload
+};
+
+struct blocked_source
+{
+	message_pipeline_source_t * source;
+	struct blocked_source * next;
+};
+
+typedef struct message_pipeline_private
+{
+	message_pipeline_t * pipeline;
+	int running;
+
+	mpsc_queue_t ingress[1];	// network threads ==> parse stage
+	spsc_queue_t parsed[1];		// parse stage ==> validation stage
+	sem_t ingress_sem;
+	sem_t parsed_sem;
+
+	pthread_t parse_th;
+	pthread_t validate_th;
+
+	pthread_mutex_t mutex;	// lock blocked_sources
+	struct blocked_source * blocked_sources;
+	int num_blocked;
+}message_pipeline_private_t;
+
+static inline int64_t get_monotonic_ns(void)
+{
+	struct timespec ts[1] = {{ 0 }};
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/**************************************************
+ * message_pipeline_source
+**************************************************/
+message_pipeline_source_t * message_pipeline_source_new(message_pipeline_t * pipeline, void * user_data)
+{
+	assert(pipeline);
+	message_pipeline_source_t * source = calloc(1, sizeof(*source));
+	assert(source);
+	source->user_data = user_data;
+	source->refs = 1;
+	source->max_pending_bytes = pipeline->default_max_pending_bytes;
+	return source;
+}
+
+void message_pipeline_source_close(message_pipeline_source_t * source)
+{
+	if(NULL == source) return;
+	__atomic_store_n(&source->closed, 1, __ATOMIC_RELEASE);
+}
+
+message_pipeline_source_t * message_pipeline_source_addref(message_pipeline_source_t * source)
+{
+	assert(source);
+	__atomic_add_fetch(&source->refs, 1, __ATOMIC_RELAXED);
+	return source;
+}
+
+void message_pipeline_source_unref(message_pipeline_source_t * source)
+{
+	if(NULL == source) return;
+	if(__atomic_sub_fetch(&source->refs, 1, __ATOMIC_ACQ_REL) == 0) free(source);
+}
+
+static int source_is_alive(message_pipeline_source_t * source)
+{
+	return !__atomic_load_n(&source->closed, __ATOMIC_ACQUIRE) && !__atomic_load_n(&source->error, __ATOMIC_ACQUIRE);
+}
+
+/**************************************************
+ * stats (each stage's stats are written by its own thread only)
+**************************************************/
+static inline void stats_set_max(int64_t * p_max, int64_t value)
+{
+	if(value > __atomic_load_n(p_max, __ATOMIC_RELAXED)) __atomic_store_n(p_max, value, __ATOMIC_RELAXED);
+}
+
+static void stats_update(struct message_pipeline_stage_stats * stats, int64_t depth, int64_t wait_ns, int64_t busy_ns, int dropped)
+{
+	__atomic_store_n(&stats->queue_depth, depth, __ATOMIC_RELAXED);
+	stats_set_max(&stats->max_queue_depth, depth);
+	__atomic_store_n(&stats->total_wait_ns, stats->total_wait_ns + wait_ns, __ATOMIC_RELAXED);
+	stats_set_max(&stats->max_wait_ns, wait_ns);
+	__atomic_store_n(&stats->total_busy_ns, stats->total_busy_ns + busy_ns, __ATOMIC_RELAXED);
+	stats_set_max(&stats->max_busy_ns, busy_ns);
+	if(dropped) __atomic_store_n(&stats->dropped, stats->dropped + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->processed, stats->processed + 1, __ATOMIC_RELEASE);
+}
+
+void message_pipeline_get_stats(message_pipeline_t * pipeline, enum message_pipeline_stage stage, struct message_pipeline_stage_stats * stats)
+{
+	assert(pipeline && stats);
+	assert(stage >= 0 && stage < message_pipeline_stages_count);
+	const struct message_pipeline_stage_stats * src = &pipeline->stats[stage];
+	stats->processed = __atomic_load_n(&src->processed, __ATOMIC_ACQUIRE);
+	stats->queue_depth = __atomic_load_n(&src->queue_depth, __ATOMIC_RELAXED);
+	stats->max_queue_depth = __atomic_load_n(&src->max_queue_depth, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&src->dropped, __ATOMIC_RELAXED);
+	stats->total_wait_ns = __atomic_load_n(&src->total_wait_ns, __ATOMIC_RELAXED);
+	stats->max_wait_ns = __atomic_load_n(&src->max_wait_ns, __ATOMIC_RELAXED);
+	stats->total_busy_ns = __atomic_load_n(&src->total_busy_ns, __ATOMIC_RELAXED);
+	stats->max_busy_ns = __atomic_load_n(&src->max_busy_ns, __ATOMIC_RELAXED);
+}
+
+void message_pipeline_dump_stats(message_pipeline_t * pipeline, FILE * fp)
+{
+	static const char * stage_names[message_pipeline_stages_count] = {
+		[message_pipeline_stage_parse] = "parse",
+		[message_pipeline_stage_validate] = "validate",
+	};
+	if(NULL == fp) fp = stderr;
+	for(int stage = 0; stage < message_pipeline_stages_count; ++stage) {
+		struct message_pipeline_stage_stats stats[1];
+		message_pipeline_get_stats(pipeline, stage, stats);
+		int64_t count = stats->processed?stats->processed:1;
+		fprintf(fp, "[pipeline] %-8s: processed=%ld, dropped=%ld, depth=%ld (max %ld), "
+			"wait=%.3f ms (max %.3f), busy=%.3f ms (max %.3f)\n",
+			stage_names[stage], (long)stats->processed, (long)stats->dropped,
+			(long)stats->queue_depth, (long)stats->max_queue_depth,
+			(double)stats->total_wait_ns / count / 1000000.0, (double)stats->max_wait_ns / 1000000.0,
+			(double)stats->total_busy_ns / count / 1000000.0, (double)stats->max_busy_ns / 1000000.0);
+	}
+}
+
+/**************************************************
+ * backpressure
+**************************************************/
+static void pipeline_block_source(message_pipeline_private_t * priv, message_pipeline_source_t * source)
+{
+	pthread_mutex_lock(&priv->mutex);
+	if(!source->blocked) {
+		struct blocked_source * node = calloc(1, sizeof(*node));
+		assert(node);
+		node->source = message_pipeline_source_addref(source);
+		node->next = priv->blocked_sources;
+		priv->blocked_sources = node;
+		__atomic_store_n(&source->blocked, 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&priv->num_blocked, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&priv->mutex);
+}
+
+// called in the validation thread: resume the sources which have drained below half of their limits
+static void pipeline_check_blocked_sources(message_pipeline_private_t * priv)
+{
+	if(0 == __atomic_load_n(&priv->num_blocked, __ATOMIC_ACQUIRE)) return;
+	message_pipeline_t * pipeline = priv->pipeline;
+	if(mpsc_queue_size(priv->ingress) > (priv->ingress->capacity / 2)) return;
+
+	struct blocked_source * drained = NULL;
+	pthread_mutex_lock(&priv->mutex);
+	struct blocked_source ** p_node = &priv->blocked_sources;
+	while(*p_node) {
+		struct blocked_source * node = *p_node;
+		message_pipeline_source_t * source = node->source;
+		if(__atomic_load_n(&source->pending_bytes, __ATOMIC_ACQUIRE) > (source->max_pending_bytes / 2)) {
+			p_node = &node->next;
+			continue;
+		}
+		*p_node = node->next;
+		__atomic_store_n(&source->blocked, 0, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&priv->num_blocked, 1, __ATOMIC_RELEASE);
+		node->next = drained;
+		drained = node;
+	}
+	pthread_mutex_unlock(&priv->mutex);
+
+	while(drained) {
+		struct blocked_source * node = drained;
+		drained = node->next;
+		if(pipeline->on_source_drained && source_is_alive(node->source)) pipeline->on_source_drained(pipeline, node->source);
+		message_pipeline_source_unref(node->source);
+		free(node);
+	}
+}
+
+/**************************************************
+ * items
+**************************************************/
+static void pipeline_item_free(struct pipeline_item * item)
+{
+	if(NULL == item) return;
+	message_pipeline_source_t * source = item->source;
+	bitcoin_message_cleanup(item->msg);
+	if(source) {
+		__atomic_sub_fetch(&source->pending_bytes, (int64_t)item->size, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&source->pending_count, 1, __ATOMIC_RELEASE);
+		message_pipeline_source_unref(source);
+	}
+	free(item);
+}
+
+int message_pipeline_submit(message_pipeline_t * pipeline, message_pipeline_source_t * source,
+	const struct bitcoin_message_header * msg_hdr, int verify_checksum)
+{
+	assert(pipeline && pipeline->priv && source && msg_hdr);
+	message_pipeline_private_t * priv = pipeline->priv;
+
+	if(!source_is_alive(source) || !__atomic_load_n(&priv->running, __ATOMIC_ACQUIRE)) {
+		errno = EPIPE;
+		return -1;
+	}
+	if(verify_checksum) {
+		unsigned char hash[32];
+		hash256(msg_hdr->payload, msg_hdr->length, hash);
+		if(memcmp(hash, &msg_hdr->checksum, sizeof(msg_hdr->checksum)) != 0) {
+			errno = EBADMSG;
+			return -1;
+		}
+	}
+
+	// a message is always accepted if nothing is pending (the limit may be smaller than a block)
+	size_t size = sizeof(*msg_hdr) + msg_hdr->length;
+	int64_t pending_bytes = __atomic_load_n(&source->pending_bytes, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&source->blocked, __ATOMIC_ACQUIRE)
+		|| (pending_bytes > 0 && (pending_bytes + (int64_t)size) > source->max_pending_bytes))
+	{
+		pipeline_block_source(priv, source);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct pipeline_item * item = malloc(sizeof(*item) + msg_hdr->length);
+	assert(item);
+	memset(item, 0, sizeof(*item));
+	item->size = size;
+	memcpy(&item->hdr, msg_hdr, size);
+
+	item->source = message_pipeline_source_addref(source);
+	__atomic_add_fetch(&source->pending_bytes, (int64_t)size, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&source->pending_count, 1, __ATOMIC_RELEASE);
+	item->submitted_at = get_monotonic_ns();
+
+	if(mpsc_queue_push(priv->ingress, item)) {	// queue full
+		pipeline_item_free(item);
+		pipeline_block_source(priv, source);
+		errno = EAGAIN;
+		return -1;
+	}
+	sem_post(&priv->ingress_sem);
+	return 0;
+}
+
+/**************************************************
+ * stages
+**************************************************/
+static int stage_wait(message_pipeline_private_t * priv, sem_t * sem)
+{
+	struct timespec deadline[1];
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_nsec += MESSAGE_PIPELINE_IDLE_TIMEOUT_MS * 1000000;
+	if(deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec += deadline->tv_nsec / 1000000000;
+		deadline->tv_nsec %= 1000000000;
+	}
+	while(__atomic_load_n(&priv->running, __ATOMIC_ACQUIRE)) {
+		if(0 == sem_timedwait(sem, deadline)) return __atomic_load_n(&priv->running, __ATOMIC_ACQUIRE)?0:-1;
+		if(errno == EINTR) continue;
+		break;	// ETIMEDOUT
+	}
+	return -1;
+}
+
+static void * parse_thread(void * user_data)
+{
+	message_pipeline_private_t * priv = user_data;
+	message_pipeline_t * pipeline = priv->pipeline;
+	struct message_pipeline_stage_stats * stats = &pipeline->stats[message_pipeline_stage_parse];
+
+	while(__atomic_load_n(&priv->running, __ATOMIC_ACQUIRE)) {
+		if(stage_wait(priv, &priv->ingress_sem)) continue;
+
+		int64_t depth = mpsc_queue_size(priv->ingress);
+		struct pipeline_item * item = NULL;
+		while(NULL == (item = mpsc_queue_pop(priv->ingress))) sched_yield();	// the producer is still writing the cell
+
+		int64_t started_at = get_monotonic_ns();
+		int dropped = !source_is_alive(item->source);
+		if(!dropped) {
+			item->parse_rc = bitcoin_message_parse_in_place(item->msg, &item->hdr, 0);
+			dropped = (0 != item->parse_rc);	// passed to the validation stage to report the error
+		}
+		item->parsed_at = get_monotonic_ns();
+		stats_update(stats, depth, started_at - item->submitted_at, item->parsed_at - started_at, dropped);
+
+		// the validation stage is the only consumer, wait for free slots rather than dropping messages
+		while(spsc_queue_push(priv->parsed, item)) {
+			if(!__atomic_load_n(&priv->running, __ATOMIC_ACQUIRE)) break;
+			usleep(100);
+		}
+		if(!__atomic_load_n(&priv->running, __ATOMIC_ACQUIRE)) {
+			pipeline_item_free(item);
+			break;
+		}
+		sem_post(&priv->parsed_sem);
+	}
+	return NULL;
+}
+
+static void * validate_thread(void * user_data)
+{
+	message_pipeline_private_t * priv = user_data;
+	message_pipeline_t * pipeline = priv->pipeline;
+	struct message_pipeline_stage_stats * stats = &pipeline->stats[message_pipeline_stage_validate];
+
+	while(__atomic_load_n(&priv->running, __ATOMIC_ACQUIRE)) {
+		if(stage_wait(priv, &priv->parsed_sem)) {
+			pipeline_check_blocked_sources(priv);
+			continue;
+		}
+
+		int64_t depth = spsc_queue_size(priv->parsed);
+		struct pipeline_item * item = spsc_queue_pop(priv->parsed);
+		assert(item);
+
+		int64_t started_at = get_monotonic_ns();
+		message_pipeline_source_t * source = item->source;
+		int dropped = 1;
+		if(source_is_alive(source)) {
+			int rc = item->parse_rc;
+			if(0 == rc && pipeline->on_message) rc = pipeline->on_message(pipeline, source, item->msg);
+			if(rc) {
+				int error = 0;
+				if(__atomic_compare_exchange_n(&source->error, &error, rc, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+					fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): %s message failed (rc = %d)" "\e[39m" "\n",
+						__FILE__, __LINE__, bitcoin_message_type_to_string(item->msg->msg_type), rc);
+					if(pipeline->on_source_error) pipeline->on_source_error(pipeline, source, rc);
+				}
+			}else {
+				dropped = 0;
+			}
+		}
+		int64_t finished_at = get_monotonic_ns();
+		stats_update(stats, depth, started_at - item->parsed_at, finished_at - started_at, dropped);
+
+		pipeline_item_free(item);
+		pipeline_check_blocked_sources(priv);
+	}
+	return NULL;
+}
+
+/**************************************************
+ * message_pipeline
+**************************************************/
+message_pipeline_t * message_pipeline_new(size_t queue_size, void * user_data)
+{
+	if(0 == queue_size) queue_size = MESSAGE_PIPELINE_DEFAULT_QUEUE_SIZE;
+
+	message_pipeline_t * pipeline = calloc(1, sizeof(*pipeline));
+	assert(pipeline);
+	pipeline->user_data = user_data;
+	pipeline->queue_size = queue_size;
+	pipeline->default_max_pending_bytes = MESSAGE_PIPELINE_DEFAULT_MAX_PENDING_BYTES;
+
+	message_pipeline_private_t * priv = NULL;
+	int rc = posix_memalign((void **)&priv, LOCKFREE_QUEUE_CACHE_LINE_SIZE, sizeof(*priv));
+	assert(0 == rc && priv);
+	memset(priv, 0, sizeof(*priv));
+	priv->pipeline = pipeline;
+	pipeline->priv = priv;
+
+	mpsc_queue_init(priv->ingress, queue_size);
+	spsc_queue_init(priv->parsed, queue_size);
+	sem_init(&priv->ingress_sem, 0, 0);
+	sem_init(&priv->parsed_sem, 0, 0);
+	pthread_mutex_init(&priv->mutex, NULL);
+	return pipeline;
+}
+
+int message_pipeline_start(message_pipeline_t * pipeline)
+{
+	assert(pipeline && pipeline->priv);
+	message_pipeline_private_t * priv = pipeline->priv;
+	if(__atomic_load_n(&priv->running, __ATOMIC_ACQUIRE)) return 0;
+
+	__atomic_store_n(&priv->running, 1, __ATOMIC_RELEASE);
+	int rc = pthread_create(&priv->parse_th, NULL, parse_thread, priv);
+	if(0 == rc) {
+		rc = pthread_create(&priv->validate_th, NULL, validate_thread, priv);
+		if(rc) {
+			__atomic_store_n(&priv->running, 0, __ATOMIC_RELEASE);
+			pthread_join(priv->parse_th, NULL);
+		}
+	}
+	if(rc) {
+		__atomic_store_n(&priv->running, 0, __ATOMIC_RELEASE);
+		fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): pthread_create() failed: %s" "\e[39m" "\n",
+			__FILE__, __LINE__, strerror(rc));
+		return -1;
+	}
+	return 0;
+}
+
+void message_pipeline_stop(message_pipeline_t * pipeline)
+{
+	if(NULL == pipeline || NULL == pipeline->priv) return;
+	message_pipeline_private_t * priv = pipeline->priv;
+	if(!__atomic_exchange_n(&priv->running, 0, __ATOMIC_ACQ_REL)) return;
+
+	sem_post(&priv->ingress_sem);
+	sem_post(&priv->parsed_sem);
+	pthread_join(priv->parse_th, NULL);
+	pthread_join(priv->validate_th, NULL);
+
+	// drop the pending messages
+	struct pipeline_item * item = NULL;
+	while((item = spsc_queue_pop(priv->parsed))) pipeline_item_free(item);
+	while((item = mpsc_queue_pop(priv->ingress))) pipeline_item_free(item);
+
+	pthread_mutex_lock(&priv->mutex);
+	while(priv->blocked_sources) {
+		struct blocked_source * node = priv->blocked_sources;
+		priv->blocked_sources = node->next;
+		__atomic_store_n(&node->source->blocked, 0, __ATOMIC_RELEASE);
+		message_pipeline_source_unref(node->source);
+		free(node);
+	}
+	priv->num_blocked = 0;
+	pthread_mutex_unlock(&priv->mutex);
+}
+
+void message_pipeline_free(message_pipeline_t * pipeline)
+{
+	if(NULL == pipeline) return;
+	message_pipeline_stop(pipeline);
+
+	message_pipeline_private_t * priv = pipeline->priv;
+	if(priv) {
+		mpsc_queue_cleanup(priv->ingress);
+		spsc_queue_cleanup(priv->parsed);
+		sem_destroy(&priv->ingress_sem);
+		sem_destroy(&priv->parsed_sem);
+		pthread_mutex_destroy(&priv->mutex);
+		free(priv);
+		pipeline->priv = NULL;
+	}
+	free(pipeline);
+}
+
+
+#if defined(_TEST_MESSAGE_PIPELINE) && defined(_STAND_ALONE)
+#define NUM_NETWORK_THREADS	(4)
+#define SOURCES_PER_THREAD	(8)
+#define MESSAGES_PER_SOURCE	(20000)
+
+struct test_peer
+{
+	message_pipeline_source_t * source;
+	uint64_t next_nonce;	// validation thread only
+	int drained;
+	int error;
+};
+static message_pipeline_t * s_pipeline;
+static struct test_peer s_peers[NUM_NETWORK_THREADS][SOURCES_PER_THREAD];
+
+static int test_on_message(message_pipeline_t * pipeline, message_pipeline_source_t * source, const bitcoin_message_t * msg)
+{
+	struct test_peer * peer = source->user_data;
+	assert(msg->msg_type == bitcoin_message_type_ping);
+	uint64_t nonce = *(uint64_t *)msg->msg_data->payload;
+	assert(nonce == peer->next_nonce);	// in order per source
+	++peer->next_nonce;
+	if((nonce % 5000) == 0) usleep(2000);	// slow validation
+	return 0;
+}
+
+static void test_on_source_drained(message_pipeline_t * pipeline, message_pipeline_source_t * source)
+{
+	struct test_peer * peer = source->user_data;
+	__atomic_store_n(&peer->drained, 1, __ATOMIC_RELEASE);
+}
+
+static void test_on_source_error(message_pipeline_t * pipeline, message_pipeline_source_t * source, int error)
+{
+	struct test_peer * peer = source->user_data;
+	__atomic_store_n(&peer->error, error, __ATOMIC_RELEASE);
+}
+
+static void * network_thread(void * user_data)
+{
+	struct test_peer * peers = user_data;
+	struct
+	{
+		struct bitcoin_message_header hdr;
+		uint64_t nonce;
+	}__attribute__((packed)) ping = {
+		.hdr.magic = BITCOIN_MESSAGE_MAGIC_REGTEST,
+		.hdr.command = "ping",
+		.hdr.length = sizeof(uint64_t),
+	};
+
+	uint64_t nonces[SOURCES_PER_THREAD] = { 0 };
+	int num_blocked = 0;
+	for(int done = 0; done < SOURCES_PER_THREAD; ) {
+		int num_sent = 0;
+		done = 0;
+		for(int i = 0; i < SOURCES_PER_THREAD; ++i) {
+			struct test_peer * peer = &peers[i];
+			if(nonces[i] == MESSAGES_PER_SOURCE) { ++done; continue; }
+			if(__atomic_load_n(&peer->source->blocked, __ATOMIC_ACQUIRE)) continue;	// paused, serve other peers
+
+			ping.nonce = nonces[i];
+			int rc = message_pipeline_submit(s_pipeline, peer->source, &ping.hdr, 0);
+			if(rc) {
+				assert(errno == EAGAIN);
+				++num_blocked;
+				continue;
+			}
+			++nonces[i];
+			++num_sent;
+		}
+		if(0 == num_sent && done < SOURCES_PER_THREAD) usleep(100);	// all paused, (poll() in a real network thread)
+	}
+	return (void *)(long)num_blocked;
+}
+
+int main(int argc, char ** argv)
+{
+	s_pipeline = message_pipeline_new(256, NULL);
+	assert(s_pipeline);
+	s_pipeline->default_max_pending_bytes = 32 * 1024;
+	s_pipeline->on_message = test_on_message;
+	s_pipeline->on_source_drained = test_on_source_drained;
+	s_pipeline->on_source_error = test_on_source_error;
+	int rc = message_pipeline_start(s_pipeline);
+	assert(0 == rc);
+
+	// test 1. a message which fails to parse reports an error on its source only
+	struct test_peer bad_peer = { NULL };
+	bad_peer.source = message_pipeline_source_new(s_pipeline, &bad_peer);
+	struct bitcoin_message_header bad_msg = { .magic = BITCOIN_MESSAGE_MAGIC_REGTEST, .command = "bogus" };
+	rc = message_pipeline_submit(s_pipeline, bad_peer.source, &bad_msg, 1);
+	assert(rc == -1 && errno == EBADMSG);
+	rc = message_pipeline_submit(s_pipeline, bad_peer.source, &bad_msg, 0);
+	assert(0 == rc);
+	for(int i = 0; i < 5000 && !__atomic_load_n(&bad_peer.error, __ATOMIC_ACQUIRE); ++i) usleep(1000);
+	assert(bad_peer.error);
+	rc = message_pipeline_submit(s_pipeline, bad_peer.source, &bad_msg, 1);
+	assert(rc == -1 && errno == EPIPE);
+	message_pipeline_source_unref(bad_peer.source);
+
+	// test 2. N network threads, per-source ordering and backpressure
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	pthread_t threads[NUM_NETWORK_THREADS];
+	for(int i = 0; i < NUM_NETWORK_THREADS; ++i) {
+		for(int j = 0; j < SOURCES_PER_THREAD; ++j) s_peers[i][j].source = message_pipeline_source_new(s_pipeline, &s_peers[i][j]);
+		rc = pthread_create(&threads[i], NULL, network_thread, s_peers[i]);
+		assert(0 == rc);
+	}
+	long num_blocked = 0;
+	for(int i = 0; i < NUM_NETWORK_THREADS; ++i) {
+		void * exit_code = NULL;
+		pthread_join(threads[i], &exit_code);
+		num_blocked += (long)exit_code;
+	}
+
+	const int64_t total = (int64_t)NUM_NETWORK_THREADS * SOURCES_PER_THREAD * MESSAGES_PER_SOURCE;
+	struct message_pipeline_stage_stats stats[1];
+	for(int i = 0; i < 10000; ++i) {
+		message_pipeline_get_stats(s_pipeline, message_pipeline_stage_validate, stats);
+		if(stats->processed >= total + 1) break;
+		usleep(1000);
+	}
+	fprintf(stderr, "messages: %ld, refused (EAGAIN): %ld, time_elapsed: %.6f s\n",
+		(long)total, num_blocked, app_timer_stop(timer));
+	message_pipeline_dump_stats(s_pipeline, stderr);
+	assert(stats->processed == total + 1 && stats->dropped == 1);
+	assert(num_blocked > 0);
+
+	message_pipeline_stop(s_pipeline);
+	for(int i = 0; i < NUM_NETWORK_THREADS; ++i) {
+		for(int j = 0; j < SOURCES_PER_THREAD; ++j) {
+			struct test_peer * peer = &s_peers[i][j];
+			assert(peer->next_nonce == MESSAGES_PER_SOURCE);
+			assert(peer->source->pending_bytes == 0 && peer->source->refs == 1);
+			message_pipeline_source_unref(peer->source);
+		}
+	}
+	message_pipeline_free(s_pipeline);
+	return 0;
+}
+#endif
@@ -68,7 +68,7 @@ int satoshi_block_header_verify(const struct satoshi_block_header * hdr, uint256
 	if(NULL == p_hash) p_hash = hash;
 	
 	hash256(hdr, sizeof(struct satoshi_block_header), (uint8_t *)p_hash);
-	int compare_diff = uint256_compare_with_compact(hash, (compact_uint256_t *)&hdr->bits);
+	int compare_diff = uint256_compare_with_compact(p_hash, (compact_uint256_t *)&hdr->bits);
 	//~ assert(compare_diff <= 0);
 	
 	if(compare_diff > 0) return -1;
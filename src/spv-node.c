@@ -46,6 +46,9 @@
 #include <poll.h>
 #include <signal.h>
 #include <errno.h>
+#include <sys/eventfd.h>
+#include <math.h>
+#include <time.h>
 
 #include "auto_buffer.h"
 #include "chains.h"
@@ -152,20 +155,108 @@ int on_message_handler(spv_node_context_t *spv, const struct bitcoin_message * i
 /**************************************************
  * network controller
 **************************************************/
+#define SPV_NODE_READ_SIZE	(64 * 1024)
+
+static void spv_node_wakeup(spv_node_context_t * spv)
+{
+	uint64_t value = 1;
+	ssize_t cb = write(spv->wakeup_fd, &value, sizeof(value));
+	(void)cb;	// EAGAIN: the counter is already non-zero
+}
+
+static int on_pipeline_message(message_pipeline_t * pipeline, message_pipeline_source_t * source, const bitcoin_message_t * msg)
+{
+	spv_node_context_t * spv = pipeline->user_data;
+	return on_message_handler(spv, msg);
+}
+
+static void on_pipeline_source_error(message_pipeline_t * pipeline, message_pipeline_source_t * source, int error)
+{
+	spv_node_wakeup(pipeline->user_data);	// the network thread will close the connection
+}
+
+static void on_pipeline_source_drained(message_pipeline_t * pipeline, message_pipeline_source_t * source)
+{
+	spv_node_wakeup(pipeline->user_data);	// the network thread will resume reading
+}
+
+/*
+ * frame and checksum the received messages, then pass them to the pipeline.
+ *   stops at the first message refused by the pipeline (it stays in in_buf), and sets spv->read_paused.
+ */
+static int submit_messages(spv_node_context_t * spv)
+{
+	auto_buffer_t * in_buf = spv->in_buf;
+	const size_t hdr_size = sizeof(struct bitcoin_message_header);
+	int rc = 0;
+	
+	while(in_buf->length >= hdr_size) {
+		const struct bitcoin_message_header * msg_hdr = (void *)(in_buf->data + in_buf->start_pos);
+		if(msg_hdr->magic != spv->magic) {
+			fprintf(stderr, "\e[31m" "[FATAL ERROR]: invalid network magic" "\e[39m" "\n");
+			rc = -1;
+			break;
+		}
+		if(msg_hdr->length > BITCOIN_MESSAGE_MAX_PAYLOAD_SIZE) {
+			fprintf(stderr, "\e[31m" "[ERROR]: payload too large: %u" "\e[39m" "\n", msg_hdr->length);
+			rc = -1;
+			break;
+		}
+		size_t msg_size = hdr_size + msg_hdr->length;
+		if(in_buf->length < msg_size) break;
+		
+		rc = message_pipeline_submit(spv->pipeline, spv->source, msg_hdr, 1);
+		if(rc) {
+			if(errno == EAGAIN) {
+				spv->read_paused = 1;
+				rc = 0;
+			}else {
+				fprintf(stderr, "\e[31m" "[ERROR]: %.12s message refused: %s" "\e[39m" "\n", msg_hdr->command, strerror(errno));
+			}
+			break;
+		}
+		
+		in_buf->start_pos += msg_size;
+		in_buf->length -= msg_size;
+	}
+	if(in_buf->length == 0) in_buf->start_pos = 0;
+	return rc;
+}
+
 static int on_read(struct pollfd * pfd, void * user_data)
 {
 	spv_node_context_t * spv = user_data;
 	auto_buffer_t * in_buf = spv->in_buf;
+	const size_t hdr_size = sizeof(struct bitcoin_message_header);
 	
 	ssize_t length = 0;
-	int rc = 0;
-	
-	struct bitcoin_message msg[1];
-	memset(msg, 0, sizeof(msg));
-	
-	while(0 == rc) {
-		char data[4096] = "";
-		length = read(pfd->fd, data, sizeof(data));
+	int rc = submit_messages(spv);	// the messages received before the last pause
+	
+	while(0 == rc && !spv->read_paused) {
+		/*
+		 * read directly into in_buf:
+		 * if the header of the pending message has been received, 
+		 * the buffer is pre-sized to hold the whole message, and the payload will never be moved.
+		 */
+		size_t needed = SPV_NODE_READ_SIZE;
+		if(in_buf->length >= hdr_size) {
+			const struct bitcoin_message_header * msg_hdr = (void *)(in_buf->data + in_buf->start_pos);
+			size_t msg_size = hdr_size + msg_hdr->length;
+			if(msg_hdr->length <= BITCOIN_MESSAGE_MAX_PAYLOAD_SIZE && msg_size > in_buf->length) needed = msg_size - in_buf->length;
+		}
+		if((in_buf->size - in_buf->start_pos - in_buf->length) < needed) {
+			if(in_buf->start_pos > 0) {
+				if(in_buf->length > 0) memmove(in_buf->data, in_buf->data + in_buf->start_pos, in_buf->length);
+				in_buf->start_pos = 0;
+			}
+			if((in_buf->size - in_buf->length) < needed) {
+				rc = auto_buffer_resize(in_buf, in_buf->length + needed);
+				if(rc) break;
+			}
+		}
+		
+		unsigned char * p_end = in_buf->data + in_buf->start_pos + in_buf->length;
+		length = read(pfd->fd, p_end, in_buf->size - in_buf->start_pos - in_buf->length);
 		if(length <= 0) {
 			if(length < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
 			//	fprintf(stderr, "[INFO]: would block\n");
@@ -175,41 +266,15 @@ static int on_read(struct pollfd * pfd, void * user_data)
 			rc = -1;
 			break;
 		}
-		auto_buffer_push(in_buf, data, length);
-		if(in_buf->length < sizeof(struct bitcoin_message_header)) continue;
-		
-		const unsigned char * p_start = auto_buffer_get_data(in_buf);
-		const unsigned char * p_end = p_start + in_buf->length;
-		
-		while(p_start < p_end) {
-			struct bitcoin_message_header * msg_hdr = (struct bitcoin_message_header * )p_start;
-			if((p_start + sizeof(*msg_hdr) + msg_hdr->length) > p_end) break;
-			
-			if(msg_hdr->magic != spv->magic) {
-				fprintf(stderr, "\e[31m" "[FATAL ERROR]: invalid network magic" "\e[39m" "\n");
-				rc = -1;
-				break;
-			}
-			bitcoin_message_cleanup(msg);
-			rc = bitcoin_message_parse(msg, msg_hdr, msg_hdr->payload, msg_hdr->length);
-			if(rc) break;
-			
-			rc = on_message_handler(spv, msg);
-			p_start = msg_hdr->payload + msg_hdr->length;
-		}
-		
-		if(p_start < p_end) memmove(in_buf->data, p_start, p_end - p_start);
-		in_buf->start_pos = 0;
-		in_buf->length = p_end - p_start;
-	}
-	
-	if(0 == rc && spv->out_buf->length > 0) {
-		spv->pfd->events |= POLLOUT;
+		in_buf->length += length;
+		rc = submit_messages(spv);
 	}
 	
-	bitcoin_message_cleanup(msg);
+	// stop polling the socket until the pipeline has been drained (the peer will be throttled by TCP)
+	if(spv->read_paused) pfd->events &= ~POLLIN;
 	return rc;
 }
+#undef SPV_NODE_READ_SIZE
 
 static int on_write(struct pollfd * pfd, void * user_data)
 {
@@ -219,6 +284,7 @@ static int on_write(struct pollfd * pfd, void * user_data)
 	int rc = 0;
 	ssize_t cb = 0;
 
+	pthread_mutex_lock(&spv->out_mutex);
 	auto_buffer_t * out_buf = spv->out_buf;
 	const unsigned char * data = auto_buffer_get_data(out_buf);
 	ssize_t length = out_buf->length;
@@ -227,7 +293,7 @@ static int on_write(struct pollfd * pfd, void * user_data)
 		debug_printf("%s(length=%ld)", __FUNCTION__, (long)length); 
 		cb = write(pfd->fd, data, length);
 		if(cb <= 0) {
-			if(length < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) break;
+			if(cb < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) break;
 			
 			perror("write");
 			rc = -1;
@@ -246,6 +312,7 @@ static int on_write(struct pollfd * pfd, void * user_data)
 	if(spv->out_buf->length <= 0) {
 		spv->pfd->events &= ~POLLOUT;
 	}
+	pthread_mutex_unlock(&spv->out_mutex);
 	return rc;
 }
 
@@ -265,6 +332,8 @@ static int add_message_version(spv_node_context_t * spv, int protocol_version)
 	msg_ver->services = bitcoin_message_service_type_node_network 
 		| bitcoin_message_service_type_node_network_limited
 		| bitcoin_message_service_type_node_witness
+		| (spv->bloom_filters?bitcoin_message_service_type_node_bloom:0)
+		| (spv->compact_filters?bitcoin_message_service_type_node_compact_filters:0)
 		| 0;
 	msg_ver->timestamp = timestamp.tv_sec;
 	
@@ -307,13 +376,14 @@ static int add_message_version(spv_node_context_t * spv, int protocol_version)
 	hash256(payload, cb, hash);
 	memcpy(&hdr->checksum, hash, 4);
 	
+	pthread_mutex_lock(&spv->out_mutex);
 	auto_buffer_push(out_buf, hdr, sizeof(hdr));
 	auto_buffer_push(out_buf, payload, cb);
+	dump_line("raw data: ", out_buf->data, out_buf->length);
+	pthread_mutex_unlock(&spv->out_mutex);
 	
 	free(payload);
 	payload = NULL;
-	
-	dump_line("raw data: ", out_buf->data, out_buf->length);
 
 	dump_line("version: ", &msg_ver->version, 4);
 	dump_line("services: ", &msg_ver->services, 8);
@@ -330,26 +400,169 @@ static int add_message_version(spv_node_context_t * spv, int protocol_version)
 	return 0;
 }
 
+int spv_node_send_data(spv_node_context_t * spv, const void * data, size_t length)
+{
+	pthread_mutex_lock(&spv->out_mutex);
+	int rc = auto_buffer_push(spv->out_buf, data, length);
+	pthread_mutex_unlock(&spv->out_mutex);
+	
+	spv_node_wakeup(spv);	// poll POLLOUT
+	return rc;
+}
+
 static int spv_node_send_message(spv_node_context_t * spv, bitcoin_message_t * msg)
 {
 	ssize_t cb_payload = 0;
 	cb_payload = bitcoin_message_serialize(msg, NULL);
 	if(cb_payload <= 0) return -1;
 	
-	int rc = 0;
-	long length = 0;
-	pthread_mutex_lock(&spv->out_mutex);
-	rc = auto_buffer_push(spv->out_buf, msg->msg_data, cb_payload);
-	length = spv->out_buf->length;
-	pthread_mutex_unlock(&spv->out_mutex);
-	
-	(void)(length);	// unused
+	int rc = spv_node_send_data(spv, msg->msg_data, cb_payload);
 	
 	fprintf(stderr, "==== %s() ====\n", __FUNCTION__);
 	bitcoin_message_header_dump(msg->msg_data);
 	return rc;
 }
 
+/**************************************************
+ * known inventories
+**************************************************/
+#define SPV_NODE_KNOWN_INVS_MAX	(50000)
+#define SPV_NODE_RECENT_INVS_MAX	(120000)
+#define SPV_NODE_INVS_FP_RATE	(0.000001)
+
+static double get_time_monotonic(void)
+{
+	struct timespec ts[1];
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return (double)ts->tv_sec + (double)ts->tv_nsec / 1000000000.0;
+}
+
+static inline int is_block_inv(const struct bitcoin_inventory * inv)
+{
+	uint32_t type = inv->type & ~bitcoin_inventory_type_msg_witness_flag;
+	return (type == bitcoin_inventory_type_msg_block 
+		|| type == bitcoin_inventory_type_msg_filtered_block
+		|| type == bitcoin_inventory_type_msg_cmpct_block);
+}
+
+ssize_t spv_node_filter_invs(spv_node_context_t * spv, const struct bitcoin_inventory * invs, ssize_t count, struct bitcoin_inventory * unknown_invs)
+{
+	assert(spv && unknown_invs);
+	if(count <= 0) return 0;
+	
+	ssize_t num_unknown = 0;
+	pthread_mutex_lock(&spv->inv_mutex);
+	for(ssize_t i = 0; i < count; ++i) {
+		struct bitcoin_inventory inv = invs[i];
+		rolling_bloom_filter_insert(spv->peer_known_invs, inv.hash, sizeof(inv.hash));
+		
+		if(rolling_bloom_filter_contains(spv->recent_invs, inv.hash, sizeof(inv.hash))
+			|| rolling_bloom_filter_contains(spv->recent_rejects, inv.hash, sizeof(inv.hash))
+			|| rolling_bloom_filter_contains(spv->requested_invs, inv.hash, sizeof(inv.hash))) continue;
+		
+		// the blocks are requested by the download scheduler (headers-first)
+		if(!is_block_inv(&inv)) rolling_bloom_filter_insert(spv->requested_invs, inv.hash, sizeof(inv.hash));
+		unknown_invs[num_unknown++] = inv;
+	}
+	pthread_mutex_unlock(&spv->inv_mutex);
+	return num_unknown;
+}
+
+void spv_node_mark_inv_received(spv_node_context_t * spv, const uint256_t * hash, int rejected)
+{
+	pthread_mutex_lock(&spv->inv_mutex);
+	rolling_bloom_filter_insert(rejected?spv->recent_rejects:spv->recent_invs, hash, sizeof(*hash));
+	pthread_mutex_unlock(&spv->inv_mutex);
+}
+
+void spv_node_mark_inv_known_by_peer(spv_node_context_t * spv, const uint256_t * hash)
+{
+	pthread_mutex_lock(&spv->inv_mutex);
+	rolling_bloom_filter_insert(spv->peer_known_invs, hash, sizeof(*hash));
+	pthread_mutex_unlock(&spv->inv_mutex);
+}
+
+int spv_node_announce_inv(spv_node_context_t * spv, const struct bitcoin_inventory * inv)
+{
+	int rc = 0;
+	int is_block = is_block_inv(inv);
+	
+	pthread_mutex_lock(&spv->inv_mutex);
+	if(rolling_bloom_filter_contains(spv->peer_known_invs, inv->hash, sizeof(inv->hash))) {
+		pthread_mutex_unlock(&spv->inv_mutex);
+		return 0;
+	}
+	
+	if(spv->pending_invs_count >= spv->max_pending_invs) {
+		ssize_t new_size = spv->max_pending_invs * 2;
+		if(new_size > SPV_NODE_MAX_INV_SIZE) new_size = SPV_NODE_MAX_INV_SIZE;
+		if(new_size <= spv->pending_invs_count) rc = -1;	// too many pending announcements, drop it
+		else {
+			struct bitcoin_inventory * invs = realloc(spv->pending_invs, new_size * sizeof(*invs));
+			assert(invs);
+			spv->pending_invs = invs;
+			spv->max_pending_invs = new_size;
+		}
+	}
+	if(0 == rc) {
+		spv->pending_invs[spv->pending_invs_count++] = *inv;
+		rolling_bloom_filter_insert(spv->peer_known_invs, inv->hash, sizeof(inv->hash));
+		if(is_block) spv->next_trickle_time = 0;	// blocks are not delayed
+	}
+	pthread_mutex_unlock(&spv->inv_mutex);
+	
+	if(0 == rc && is_block) spv_node_wakeup(spv);
+	return rc;
+}
+
+/*
+ * flush_pending_invs(): called in the network thread
+ *   all pending blocks and up to SPV_NODE_INV_BROADCAST_MAX txs are sent in one inv message,
+ *   the next trickle is scheduled after a random (exponential) delay, 
+ *   so the announcements of a tx do not reveal when it was received.
+ */
+static int flush_pending_invs(spv_node_context_t * spv)
+{
+	double now = get_time_monotonic();
+	
+	pthread_mutex_lock(&spv->inv_mutex);
+	if(now < spv->next_trickle_time || spv->pending_invs_count == 0) {
+		pthread_mutex_unlock(&spv->inv_mutex);
+		return 0;
+	}
+	spv->next_trickle_time = now - log1p(-drand48()) * SPV_NODE_INV_TRICKLE_INTERVAL;
+	
+	ssize_t count = 0;
+	ssize_t num_txs = 0;
+	struct bitcoin_inventory * invs = calloc(spv->pending_invs_count, sizeof(*invs));
+	assert(invs);
+	
+	// keep the txs over the limit (in order) for the next trickle
+	ssize_t num_left = 0;
+	for(ssize_t i = 0; i < spv->pending_invs_count; ++i) {
+		struct bitcoin_inventory * inv = &spv->pending_invs[i];
+		if(is_block_inv(inv) || num_txs++ < SPV_NODE_INV_BROADCAST_MAX) invs[count++] = *inv;
+		else spv->pending_invs[num_left++] = *inv;
+	}
+	spv->pending_invs_count = num_left;
+	pthread_mutex_unlock(&spv->inv_mutex);
+	
+	struct bitcoin_message * inv_msg = bitcoin_message_new(NULL, spv->magic, bitcoin_message_type_inv, spv);
+	assert(inv_msg);
+	struct bitcoin_message_inv * msg = bitcoin_message_get_object(inv_msg);
+	msg->count = count;
+	msg->invs = invs;
+	
+	int rc = spv->send_message(spv, inv_msg);
+	
+	// clear data
+	msg->count = 0;
+	msg->invs = NULL;
+	bitcoin_message_free(inv_msg);
+	free(invs);
+	return rc;
+}
+
 spv_node_context_t * spv_node_context_init(spv_node_context_t * spv, void * user_data)
 {
 	if(NULL == spv) spv = calloc(1, sizeof(*spv));
@@ -359,11 +572,35 @@ spv_node_context_t * spv_node_context_init(spv_node_context_t * spv, void * user
 	spv->user_data = user_data;
 	spv->max_retries = 5;
 	spv->protocol_version = 70015;
+	spv->cmpct_high_bandwidth = 1;
+	spv->bloom_filters = 1;
+	spv->peer_relay_txs = 1;
 	
 	pthread_mutex_init(&spv->in_mutex, NULL);
 	pthread_mutex_init(&spv->out_mutex, NULL);
 	auto_buffer_init(spv->in_buf, 0);
 	auto_buffer_init(spv->out_buf, 0);
+	
+	pthread_mutex_init(&spv->inv_mutex, NULL);
+	rolling_bloom_filter_init(spv->peer_known_invs, SPV_NODE_KNOWN_INVS_MAX, SPV_NODE_INVS_FP_RATE);
+	rolling_bloom_filter_init(spv->requested_invs, SPV_NODE_KNOWN_INVS_MAX, SPV_NODE_INVS_FP_RATE);
+	rolling_bloom_filter_init(spv->recent_invs, SPV_NODE_RECENT_INVS_MAX, SPV_NODE_INVS_FP_RATE);
+	rolling_bloom_filter_init(spv->recent_rejects, SPV_NODE_RECENT_INVS_MAX, SPV_NODE_INVS_FP_RATE);
+	spv->max_pending_invs = 1024;
+	spv->pending_invs = calloc(spv->max_pending_invs, sizeof(*spv->pending_invs));
+	assert(spv->pending_invs);
+	srand48((long)time(NULL) ^ (long)getpid());
+	
+	spv->fd = -1;
+	spv->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(spv->wakeup_fd >= 0);
+	
+	message_pipeline_t * pipeline = message_pipeline_new(0, spv);
+	assert(pipeline);
+	pipeline->on_message = on_pipeline_message;
+	pipeline->on_source_error = on_pipeline_source_error;
+	pipeline->on_source_drained = on_pipeline_source_drained;
+	spv->pipeline = pipeline;
 
 	avl_tree_t * tree = avl_tree_init(spv->addrs_list, spv);
 	tree->on_free_data = free;
@@ -387,9 +624,36 @@ spv_node_context_t * spv_node_context_init(spv_node_context_t * spv, void * user
 void spv_node_context_cleanup(spv_node_context_t * spv)
 {
 	if(NULL == spv) return;
+	
+	// stop the pipeline threads before releasing the states used by the callbacks
+	if(spv->pipeline) {
+		message_pipeline_stop(spv->pipeline);
+		message_pipeline_dump_stats(spv->pipeline, stderr);
+		message_pipeline_free(spv->pipeline);
+		spv->pipeline = NULL;
+	}
+	message_pipeline_source_unref(spv->source);
+	spv->source = NULL;
+	if(spv->wakeup_fd >= 0) {
+		close(spv->wakeup_fd);
+		spv->wakeup_fd = -1;
+	}
+	
 	auto_buffer_cleanup(spv->in_buf);
 	auto_buffer_cleanup(spv->out_buf);
 	
+	rolling_bloom_filter_cleanup(spv->peer_known_invs);
+	rolling_bloom_filter_cleanup(spv->requested_invs);
+	rolling_bloom_filter_cleanup(spv->recent_invs);
+	rolling_bloom_filter_cleanup(spv->recent_rejects);
+	free(spv->pending_invs);
+	spv->pending_invs = NULL;
+	spv->pending_invs_count = 0;
+	
+	bloom_filter_cleanup(spv->peer_filter);
+	free(spv->peer_filter);
+	spv->peer_filter = NULL;
+	
 	if(spv->jconfig) {
 		json_object_put(spv->jconfig);
 		spv->jconfig = NULL;
@@ -401,6 +665,7 @@ void spv_node_context_cleanup(spv_node_context_t * spv)
 	
 	pthread_mutex_destroy(&spv->in_mutex);
 	pthread_mutex_destroy(&spv->out_mutex);
+	pthread_mutex_destroy(&spv->inv_mutex);
 	return;
 }
 
@@ -418,6 +683,9 @@ int spv_node_load_config(spv_node_context_t * spv, json_object * jconfig)
 	
 	int max_retries = json_get_value(jconfig, int, max_retries);
 	if(max_retries > 0) spv->max_retries = max_retries;
+	spv->cmpct_high_bandwidth = json_get_value_default(jconfig, boolean, compact_blocks_high_bandwidth, spv->cmpct_high_bandwidth);
+	spv->bloom_filters = json_get_value_default(jconfig, boolean, peer_bloom_filters, spv->bloom_filters);
+	spv->compact_filters = json_get_value_default(jconfig, boolean, peer_compact_filters, spv->compact_filters);
 	
 	enum bitcoin_network_type type = bitcoin_network_type_from_string(network_type);
 	assert(type != -1);
@@ -461,9 +729,13 @@ int spv_node_run(spv_node_context_t * spv, int async_mode)
 		.tv_nsec = 100 * 1000000,
 	}};
 	
+	rc = message_pipeline_start(spv->pipeline);
+	if(rc) return rc;
+	
 	struct pollfd *pfd = spv->pfd;
-	memset(pfd, 0, sizeof(*pfd));
-	pfd->events = POLLIN | POLLHUP | POLLRDHUP;
+	memset(spv->pfd, 0, sizeof(spv->pfd));
+	pfd[1].fd = spv->wakeup_fd;
+	pfd[1].events = POLLIN;
 
 	for(int retries = 0; !g_quit && (retries < spv->max_retries); ++retries) 
 	{
@@ -474,17 +746,44 @@ int spv_node_run(spv_node_context_t * spv, int async_mode)
 			continue;
 		}
 		pfd->fd = fd;
+		pfd->events = POLLIN | POLLHUP | POLLRDHUP;
 		spv->fd = fd;
 		
+		// the pending messages of the previous connection are dropped by the pipeline
+		if(spv->source) {
+			message_pipeline_source_close(spv->source);
+			message_pipeline_source_unref(spv->source);
+		}
+		spv->source = message_pipeline_source_new(spv->pipeline, spv);
+		spv->read_paused = 0;
+		
+		// a new peer: it knows nothing, and the requests sent to the previous one will never be answered
+		pthread_mutex_lock(&spv->inv_mutex);
+		rolling_bloom_filter_reset(spv->peer_known_invs);
+		rolling_bloom_filter_reset(spv->requested_invs);
+		spv->pending_invs_count = 0;
+		spv->next_trickle_time = 0;
+		pthread_mutex_unlock(&spv->inv_mutex);
+		spv->peer_version = 0;
+		spv->peer_cmpct_version = 0;
+		spv->peer_cmpct_announce = 0;
+		
 		auto_buffer_cleanup(spv->in_buf);
+		pthread_mutex_lock(&spv->out_mutex);
 		auto_buffer_cleanup(spv->out_buf);
+		pthread_mutex_unlock(&spv->out_mutex);
 		add_message_version(spv, 0);
 		pfd->events |= POLLOUT;
 		
 		while(!g_quit) {
 			rc = 0;
+			if(pfd[0].fd >= 0 && spv->peer_version) flush_pending_invs(spv);	// after the version handshake
+			
+			pthread_mutex_lock(&spv->out_mutex);
 			if(spv->out_buf->length > 0) pfd->events |= POLLOUT;
-			int n = ppoll(pfd, 1, timeout, &sigs);
+			pthread_mutex_unlock(&spv->out_mutex);
+			
+			int n = ppoll(pfd, 2, timeout, &sigs);
 			if(n == -1) {
 				rc = errno;
 				break;
@@ -495,7 +794,21 @@ int spv_node_run(spv_node_context_t * spv, int async_mode)
 				continue;
 			}
 			
-			if(pfd[0].revents & POLLIN) {
+			if(pfd[1].revents & POLLIN) {	// woken by the pipeline threads
+				uint64_t value = 0;
+				ssize_t cb = read(spv->wakeup_fd, &value, sizeof(value));
+				(void)cb;
+				
+				if(pfd[0].fd >= 0 && spv->read_paused && !__atomic_load_n(&spv->source->blocked, __ATOMIC_ACQUIRE)) {
+					spv->read_paused = 0;
+					pfd->events |= POLLIN;
+					rc = on_read(pfd, spv);
+				}
+			}
+			if(pfd[0].fd < 0) continue;
+			if(__atomic_load_n(&spv->source->error, __ATOMIC_ACQUIRE)) rc = -1;	// a message handler has failed
+			
+			if(0 == rc && (pfd[0].revents & POLLIN)) {
 				rc = on_read(pfd, spv);
 			}
 			if(0 == rc && (pfd[0].revents & POLLOUT)) {
@@ -516,6 +829,7 @@ int spv_node_run(spv_node_context_t * spv, int async_mode)
 				}
 				fd = -1;
 				spv->fd = -1;
+				message_pipeline_source_close(spv->source);
 			}
 		}
 	
@@ -33,6 +33,7 @@
 
 #include <signal.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "spv-node.h"
 #include "app.h"
@@ -104,6 +105,9 @@ app_context_t * app_context_init(app_context_t * app, void * user_data)
 	assert(chain);
 	chain->on_add_block = on_add_block;
 	chain->on_remove_block = on_remove_block;
+	
+	app->mempool = mempool_new(0, app);
+	assert(app->mempool);
 
 	return app;
 }
@@ -112,6 +116,35 @@ void app_context_cleanup(app_context_t * app)
 {
 	if(NULL == app) return;
 	spv_node_context_cleanup(app->spv);
+	block_download_manager_free(app->blocks_downloader);
+	app->blocks_downloader = NULL;
+	mempool_free(app->mempool);
+	app->mempool = NULL;
+	
+	partial_block_cleanup(app->partial_block);
+	free(app->partial_block);
+	app->partial_block = NULL;
+	for(int i = 0; i < APP_RECENT_BLOCKS; ++i) {
+		free(app->recent_blocks[i]);
+		app->recent_blocks[i] = NULL;
+	}
+	bloom_block_index_cleanup(app->filtered_index);
+	satoshi_block_cleanup(app->filtered_block);
+	if(app->filter_index) {
+		block_filter_index_cleanup(app->filter_index);
+		free(app->filter_index);
+		app->filter_index = NULL;
+	}
+	db_engine_cleanup(app->filters_engine);
+	app->filters_engine = NULL;
+	if(app->blocks_cache) {
+		block_cache_cleanup(app->blocks_cache);
+		free(app->blocks_cache);
+		app->blocks_cache = NULL;
+	}
+	free(app->block_positions);
+	app->block_positions = NULL;
+	app->num_block_positions = 0;
 	block_headers_db_cleanup(app->hdrs_db);
 	
 	if(app->db_env) {
@@ -141,6 +174,14 @@ static int on_message_getheaders(struct spv_node_context * spv, const bitcoin_me
 static int on_message_tx(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
 static int on_message_block(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
 static int on_message_headers(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
+static int on_message_mempool(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
+static int on_message_cmpctblock(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
+static int on_message_getblocktxn(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
+static int on_message_blocktxn(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
+static int on_message_getcfilters(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
+static int on_message_getcfheaders(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
+static int on_message_getcfcheckpt(struct spv_node_context * spv, const bitcoin_message_t * in_msg);
+static int on_block_ready(block_download_manager_t * mgr, ssize_t height, const uint256_t * hash, void * block, int peer_id);
 static int custom_init(spv_node_context_t * spv)
 {
 	spv_node_message_callback_fn * callbacks = spv->msg_callbacks;
@@ -155,10 +196,18 @@ static int custom_init(spv_node_context_t * spv)
 	callbacks[bitcoin_message_type_tx]         = on_message_tx;
 	callbacks[bitcoin_message_type_block]      = on_message_block;
 	callbacks[bitcoin_message_type_headers]    = on_message_headers;
+	callbacks[bitcoin_message_type_mempool]    = on_message_mempool;
+	callbacks[bitcoin_message_type_cmpctblock] = on_message_cmpctblock;
+	callbacks[bitcoin_message_type_getblocktxn] = on_message_getblocktxn;
+	callbacks[bitcoin_message_type_blocktxn]   = on_message_blocktxn;
+	callbacks[bitcoin_message_type_getcfilters]  = on_message_getcfilters;
+	callbacks[bitcoin_message_type_getcfheaders] = on_message_getcfheaders;
+	callbacks[bitcoin_message_type_getcfcheckpt] = on_message_getcfcheckpt;
 
 	return 0; 
 }
 
+static int load_block_files(app_context_t * app);
 extern volatile int g_quit;
 int app_run(app_context_t * app)
 {
@@ -194,6 +243,30 @@ int app_run(app_context_t * app)
 	
 	fprintf(stderr, "latest height: %ld\n", (long)chain->height);
 	
+	// BIP157/158: the filters are built from the downloaded blocks
+	if(spv->compact_filters) {
+		const char * filters_home = "data/filters";
+		if(mkdir(filters_home, 0775) && errno != EEXIST) {
+			perror("mkdir(data/filters)");
+			return -1;
+		}
+		app->filters_engine = db_engine_init(filters_home, app);
+		assert(app->filters_engine);
+		app->filter_index = block_filter_index_init(NULL, app->filters_engine, NULL, app);
+		assert(app->filter_index);
+		fprintf(stderr, "block filters height: %ld\n", (long)app->filter_index->height);
+	}
+	
+	// the blocks already stored in the local blk files are not downloaded again
+	load_block_files(app);
+	
+	// download the blocks announced after the local headers (headers-first)
+	block_download_manager_t * downloader = block_download_manager_new(chain, chain->height + 1, app);
+	assert(downloader);
+	downloader->on_block_ready = on_block_ready;
+	downloader->on_free_block = free;
+	app->blocks_downloader = downloader;
+	
 	rc = spv_node_run(app->spv, 0);
 	return rc;
 }
@@ -205,6 +278,140 @@ int app_stop(app_context_t * app)
 }
 
 
+/*
+ * blk(nnnnn).dat files (APP_BLOCKS_DIR): 
+ *   scanned sequentially at startup to locate the blocks of the main chain,
+ *   which are then read in batches to build the missing block filters,
+ *   and served to the peers through the block cache.
+ */
+struct scan_context
+{
+	app_context_t * app;
+	blockchain_snapshot_t snapshot[1];
+	ssize_t num_found;
+};
+static int on_scan_block(struct block_file_reader * reader,
+	int64_t file_index, int64_t start_pos, uint32_t block_size, const unsigned char * data,
+	void * user_data)
+{
+	struct scan_context * ctx = user_data;
+	app_context_t * app = ctx->app;
+	if(block_size < sizeof(struct satoshi_block_header)) return 0;
+	
+	uint256_t hash;
+	hash256(data, sizeof(struct satoshi_block_header), (uint8_t *)&hash);
+	ssize_t height = blockchain_snapshot_get_height(ctx->snapshot, &hash);
+	if(height < 0 || height >= app->num_block_positions) return 0;	// orphan or unknown
+	
+	app->block_positions[height] = (struct block_file_pos){
+		.hash = hash,
+		.file_index = file_index,
+		.start_pos = start_pos,
+		.block_size = block_size,
+	};
+	++ctx->num_found;
+	return 0;
+}
+
+struct reindex_context
+{
+	app_context_t * app;
+	block_file_reader_t * reader;
+	
+	// the current batch: blocks [first_height, first_height + count)
+	int32_t first_height;
+	ssize_t count;
+	block_read_request_t requests[APP_REINDEX_BATCH];
+};
+static void reindex_context_clear(struct reindex_context * ctx)
+{
+	for(ssize_t i = 0; i < ctx->count; ++i) free(ctx->requests[i].data);
+	memset(ctx->requests, 0, sizeof(ctx->requests));
+	ctx->count = 0;
+}
+
+static int get_block_from_files(void * user_data, int32_t height, uint256_t * hash, satoshi_block_t * block)
+{
+	struct reindex_context * ctx = user_data;
+	app_context_t * app = ctx->app;
+	if(height < 0 || height >= app->num_block_positions) return -1;
+	const struct block_file_pos * pos = &app->block_positions[height];
+	if(0 == pos->block_size) return -1;
+	
+	if(height < ctx->first_height || height >= (ctx->first_height + ctx->count)) {
+		// read the following blocks (until the first missing one) in one batch
+		reindex_context_clear(ctx);
+		ctx->first_height = height;
+		while(ctx->count < APP_REINDEX_BATCH && (height + ctx->count) < app->num_block_positions) {
+			const struct block_file_pos * next = &app->block_positions[height + ctx->count];
+			if(0 == next->block_size) break;
+			ctx->requests[ctx->count++] = (block_read_request_t){
+				.file_index = next->file_index,
+				.offset = next->start_pos,
+				.length = next->block_size,
+			};
+		}
+		ctx->reader->read_batch(ctx->reader, ctx->requests, ctx->count, block_reader_flags_sequential);
+	}
+	
+	const block_read_request_t * request = &ctx->requests[height - ctx->first_height];
+	if(request->cb_read != request->length) return -1;
+	
+	memset(block, 0, sizeof(*block));
+	if(satoshi_block_parse(block, request->length, request->data) != request->length) {
+		fprintf(stderr, "\e[31m" "%s(height=%ld): invalid block data" "\e[39m" "\n", __FUNCTION__, (long)height);
+		satoshi_block_cleanup(block);
+		return -1;
+	}
+	*hash = pos->hash;
+	return 0;
+}
+
+static int load_block_files(app_context_t * app)
+{
+	struct stat st[1];
+	if(stat(APP_BLOCKS_DIR, st) || !S_ISDIR(st->st_mode)) return 0;
+	
+	spv_node_context_t * spv = app->spv;
+	block_file_reader_t * reader = block_file_reader_init(NULL, APP_BLOCKS_DIR, 0, 1, app);
+	assert(reader);
+	
+	struct scan_context scan = { .app = app };
+	blockchain_snapshot_acquire(spv->chain, scan.snapshot);
+	app->num_block_positions = blockchain_snapshot_height(scan.snapshot) + 1;
+	app->block_positions = calloc(app->num_block_positions, sizeof(*app->block_positions));
+	assert(app->block_positions);
+	
+	int64_t num_files = 0;
+	while(block_file_reader_scan(reader, num_files, spv->magic, on_scan_block, &scan) >= 0) ++num_files;
+	blockchain_snapshot_release(scan.snapshot);
+	fprintf(stderr, "%s: %ld blocks of the main chain found in %ld files\n", 
+		APP_BLOCKS_DIR, (long)scan.num_found, (long)num_files);
+	
+	// BIP157/158: build the filters above the tip of the filter index
+	if(app->filter_index && scan.num_found > 0) {
+		struct reindex_context * ctx = calloc(1, sizeof(*ctx));
+		assert(ctx);
+		ctx->app = app;
+		ctx->reader = reader;
+		
+		ssize_t count = block_filter_index_reindex(app->filter_index, get_block_from_files, ctx);
+		reindex_context_clear(ctx);
+		free(ctx);
+		fprintf(stderr, "block filters: %ld blocks reindexed, height: %ld\n", 
+			(long)count, (long)app->filter_index->height);
+	}
+	
+	block_file_reader_cleanup(reader);
+	free(reader);
+	
+	if(scan.num_found > 0) {
+		app->blocks_cache = block_cache_init(NULL, APP_BLOCKS_DIR, APP_BLOCK_CACHE_SIZE, 0, app);
+		assert(app->blocks_cache);
+	}
+	return 0;
+}
+
 
 
 #define COLOR_RED "\e[31m"
@@ -223,6 +430,17 @@ static int on_remove_block(struct blockchain * chain,
 	
 	ssize_t count = db->del(db, block_hash);
 	assert(count == 1);
+	
+	// the blocks are removed from the tip: download the new branch from the fork point
+	app_context_t * app = db->user_data;
+	if(app && app->blocks_downloader) block_download_on_reorg(app->blocks_downloader, height - 1);
+	
+	// only the tip of the filter index can be removed, the blocks above it have not been indexed
+	if(app && app->filter_index && app->filter_index->height == height) {
+		if(block_filter_index_remove_block(app->filter_index, block_hash)) {
+			fprintf(stderr, COLOR_RED "%s(): remove block filter failed" COLOR_DEFAULT "\n", __FUNCTION__);
+		}
+	}
 	return 0;
 }
 
@@ -272,13 +490,10 @@ static int bitcoin_message_getheaders_set(struct bitcoin_message_getheaders * ge
 }
 
 
-static int on_message_verack(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+static int send_getheaders(struct spv_node_context * spv, uint32_t magic, size_t max_hashes)
 {
-	// send test data when 'verack' msg received
-	bitcoin_message_header_dump(in_msg->msg_data);
-	
 	struct bitcoin_message * getheaders_msg = bitcoin_message_new(NULL, 
-		in_msg->msg_data->magic, 
+		magic, 
 		bitcoin_message_type_getheaders, 
 		spv);
 	struct bitcoin_message_getheaders * getheaders = bitcoin_message_get_object(getheaders_msg);
@@ -287,12 +502,8 @@ static int on_message_verack(struct spv_node_context * spv, const bitcoin_messag
 	uint32_t version = spv->peer_version;
 	if(0 == version || version > spv->protocol_version) version = spv->protocol_version;
 	
-	
 	uint256_t * hashes = NULL;
-	blockchain_t * chain = spv->chain;
-	assert(chain && chain->add);
-	
-	ssize_t count = blockchain_get_known_hashes(chain, 0, &hashes);
+	ssize_t count = blockchain_get_known_hashes(spv->chain, max_hashes, &hashes);
 	assert(count > 0 && hashes);
 	
 	int rc = bitcoin_message_getheaders_set(getheaders, version, count, hashes, NULL);
@@ -304,44 +515,331 @@ static int on_message_verack(struct spv_node_context * spv, const bitcoin_messag
 	return rc;
 }
 
-static int on_message_inv(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+static int send_getdata(struct spv_node_context * spv, uint32_t magic, struct bitcoin_inventory * invs, ssize_t count)
 {
-	struct bitcoin_message_inv * msg = bitcoin_message_get_object(in_msg);
-	bitcoin_message_inv_dump(msg);
-	
-	/** 
-	 * getdata is used in response to inv, to retrieve the content of a specific object, 
-	 * and is usually sent after receiving an inv packet, after filtering known elements. 
-	*/
+	if(count <= 0) return 0;
 	struct bitcoin_message * getdata_msg = bitcoin_message_new(NULL, 
-		in_msg->msg_data->magic, 
+		magic, 
 		bitcoin_message_type_getdata, 
 		spv);
-
 	assert(getdata_msg);
 	struct bitcoin_message_getdata * getdata = bitcoin_message_get_object(getdata_msg);
+	getdata->count = count;
+	getdata->invs = invs;
 	
-	///< @todo : filter-out known elements
-	getdata->count = msg->count;
-	getdata->invs = (struct bitcoin_inventory *)msg->invs;
-
 	bitcoin_message_getdata_dump(getdata);
-	assert(spv->send_message);
-	
 	if(spv->send_message) spv->send_message(spv, getdata_msg);
 	
-	// clear data
+	// the invs are owned by the caller
 	getdata->count = 0;
 	getdata->invs = NULL;
-	
 	bitcoin_message_free(getdata_msg);
 	return 0;
 }
 
+/*
+ * assign the next missing blocks to the peer, at most max_in_flight blocks are requested at a time.
+ *   'receiving': a block being received as a compact block, it's assigned but not requested.
+ *   BIP152 low-bandwidth mode: the blocks near the tip are requested as compact blocks.
+ */
+static int request_blocks(struct spv_node_context * spv, uint32_t magic, const uint256_t * receiving)
+{
+	app_context_t * app = spv->user_data;
+	block_download_manager_t * downloader = app->blocks_downloader;
+	if(NULL == downloader) return 0;
+	
+	block_download_check_timeouts(downloader);
+	
+	struct bitcoin_inventory invs[BLOCK_DOWNLOAD_DEFAULT_MAX_IN_FLIGHT];
+	ssize_t count = block_download_get_requests(downloader, spv->fd, invs, BLOCK_DOWNLOAD_DEFAULT_MAX_IN_FLIGHT);
+	
+	// the headers chain may be extended by other peers at the same time, read it from a snapshot
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(spv->chain, snapshot);
+	ssize_t num_requests = 0;
+	for(ssize_t i = 0; i < count; ++i) {
+		if(receiving && 0 == memcmp(invs[i].hash, receiving, sizeof(invs[i].hash))) continue;
+		if(spv->peer_cmpct_version) {
+			ssize_t height = blockchain_snapshot_get_height(snapshot, (const uint256_t *)invs[i].hash);
+			if(height >= 0 && (height + COMPACT_BLOCK_MAX_DEPTH) > blockchain_snapshot_height(snapshot)) {
+				invs[i].type = bitcoin_inventory_type_msg_cmpct_block;
+			}
+		}
+		invs[num_requests++] = invs[i];
+	}
+	blockchain_snapshot_release(snapshot);
+	return send_getdata(spv, magic, invs, num_requests);
+}
+
+static int request_full_block(struct spv_node_context * spv, uint32_t magic, const uint256_t * hash)
+{
+	app_context_t * app = spv->user_data;
+	struct bitcoin_inventory inv = { .type = app->blocks_downloader->inv_type };
+	memcpy(inv.hash, hash, sizeof(inv.hash));
+	return send_getdata(spv, magic, &inv, 1);
+}
+
+static int send_sendcmpct(struct spv_node_context * spv, uint32_t magic)
+{
+	struct bitcoin_message * msg = bitcoin_message_new(NULL, magic, bitcoin_message_type_sendcmpct, spv);
+	assert(msg);
+	struct bitcoin_message_sendcmpct * sendcmpct = bitcoin_message_get_object(msg);
+	sendcmpct->announce = spv->cmpct_high_bandwidth?1:0;
+	sendcmpct->version = SPV_NODE_CMPCT_VERSION;
+	
+	if(spv->send_message) spv->send_message(spv, msg);
+	bitcoin_message_free(msg);
+	return 0;
+}
+
+static void add_recent_block(app_context_t * app, const uint256_t * hash, const struct raw_block * block)
+{
+	int pos = app->recent_blocks_pos;
+	app->recent_blocks_pos = (pos + 1) % APP_RECENT_BLOCKS;
+	
+	free(app->recent_blocks[pos]);
+	app->recent_blocks[pos] = malloc(sizeof(*block) + block->length);
+	assert(app->recent_blocks[pos]);
+	memcpy(app->recent_blocks[pos], block, sizeof(*block) + block->length);
+	app->recent_hashes[pos] = *hash;
+}
+
+static int get_recent_block(app_context_t * app, const uint256_t * hash, satoshi_block_t * block)
+{
+	for(int i = 0; i < APP_RECENT_BLOCKS; ++i) {
+		const struct raw_block * raw_block = app->recent_blocks[i];
+		if(NULL == raw_block || memcmp(&app->recent_hashes[i], hash, sizeof(*hash)) != 0) continue;
+		
+		memset(block, 0, sizeof(*block));
+		if(satoshi_block_parse(block, raw_block->length, raw_block->data) == raw_block->length) return 0;
+		satoshi_block_cleanup(block);
+		break;
+	}
+	return -1;
+}
+
+static const bloom_block_index_t * get_filtered_block_index(app_context_t * app, const uint256_t * hash)
+{
+	bloom_block_index_t * index = app->filtered_index;
+	if(index->block && 0 == memcmp(&app->filtered_hash, hash, sizeof(*hash))) return index;
+	
+	bloom_block_index_cleanup(index);
+	satoshi_block_cleanup(app->filtered_block);
+	if(get_recent_block(app, hash, app->filtered_block)) {
+		memset(app->filtered_block, 0, sizeof(app->filtered_block));
+		return NULL;
+	}
+	if(bloom_block_index_init(index, app->filtered_block)) return NULL;
+	app->filtered_hash = *hash;
+	return index;
+}
+
+/*
+ * BIP37: reply with a merkleblock, followed by the matched txs
+ */
+static int send_filtered_block(struct spv_node_context * spv, uint32_t magic, const uint256_t * hash)
+{
+	app_context_t * app = spv->user_data;
+	const bloom_block_index_t * index = get_filtered_block_index(app, hash);
+	if(NULL == index || NULL == spv->send_message) return 0;
+	
+	uint8_t * matched = calloc(index->txn_count, 1);
+	assert(matched);
+	bloom_filter_match_block(spv->peer_filter, index, matched);
+	
+	struct bitcoin_message * merkle_msg = bitcoin_message_new(NULL, magic, bitcoin_message_type_merkleblock, spv);
+	assert(merkle_msg);
+	int rc = bloom_block_index_get_merkleblock(index, matched, bitcoin_message_get_object(merkle_msg));
+	if(0 == rc) rc = spv->send_message(spv, merkle_msg);
+	bitcoin_message_free(merkle_msg);
+	
+	// the txs are sent without being copied: attached to the message, and detached after being serialized
+	bitcoin_message_t tx_msg[1];
+	bitcoin_message_new(tx_msg, magic, bitcoin_message_type_unknown, spv);
+	for(ssize_t i = 0; 0 == rc && i < index->txn_count; ++i) {
+		if(!matched[i]) continue;
+		satoshi_tx_t * tx = &app->filtered_block->txns[i];
+		
+		void * tx_object = NULL;
+		rc = tx_msg->attach(tx_msg, magic, bitcoin_message_type_tx, tx);
+		if(0 == rc) rc = spv->send_message(spv, tx_msg);
+		tx_msg->detach(tx_msg, &tx_object);
+		assert(tx_object == tx);
+		spv_node_mark_inv_known_by_peer(spv, tx->txid);
+	}
+	bitcoin_message_cleanup(tx_msg);
+	free(matched);
+	return rc;
+}
+
+static int on_block_ready(block_download_manager_t * mgr, ssize_t height, const uint256_t * hash, void * block, int peer_id)
+{
+	app_context_t * app = mgr->user_data;
+	struct raw_block * raw_block = block;
+	
+	fprintf(stderr, "\e[32m" "== %s(height=%ld, peer=%d): hash=", __FUNCTION__, (long)height, peer_id);
+	dump2(stderr, hash, sizeof(*hash));
+	fprintf(stderr, "\e[39m" "\n");
+	
+	satoshi_block_t blk[1];
+	memset(blk, 0, sizeof(blk));
+	if(satoshi_block_parse(blk, raw_block->length, raw_block->data) != raw_block->length) {
+		satoshi_block_cleanup(blk);
+		return -1;
+	}
+	
+	// the confirmed txs and the double spends are removed from the mempool
+	ssize_t num_removed = mempool_remove_for_block(app->mempool, blk->txns, blk->txn_count);
+	if(num_removed > 0) debug_printf("%ld txs removed from mempool", (long)num_removed);
+	
+	for(ssize_t i = 0; i < blk->txn_count; ++i) spv_node_mark_inv_received(app->spv, blk->txns[i].txid, 0);
+	
+	// the filter index starts from the genesis block (or its own tip), see block_filter_index_reindex()
+	if(app->filter_index && app->filter_index->height == (height - 1)) {
+		if(block_filter_index_add_block(app->filter_index, height, hash, blk)) {
+			fprintf(stderr, "\e[31m" "%s(height=%ld): build block filter failed" "\e[39m" "\n", __FUNCTION__, (long)height);
+		}
+	}
+	satoshi_block_cleanup(blk);
+	
+	add_recent_block(app, hash, raw_block);
+	return 0;
+}
+
+static int on_message_verack(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	app_context_t * app = spv->user_data;
+	if(app->blocks_downloader) block_download_add_peer(app->blocks_downloader, spv->fd, spv->peer_height);
+	
+	// send test data when 'verack' msg received
+	bitcoin_message_header_dump(in_msg->msg_data);
+	
+	assert(spv->chain && spv->chain->add);
+	if(spv->peer_version >= SPV_NODE_CMPCT_MIN_PROTOCOL_VERSION) send_sendcmpct(spv, in_msg->msg_data->magic);
+	return send_getheaders(spv, in_msg->msg_data->magic, 0);
+}
+
+static int on_message_inv(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	struct bitcoin_message_inv * msg = bitcoin_message_get_object(in_msg);
+	if(NULL == msg || msg->count <= 0) return 0;
+	bitcoin_message_inv_dump(msg);
+	
+	app_context_t * app = spv->user_data;
+	uint32_t magic = in_msg->msg_data->magic;
+	
+	/** 
+	 * getdata is used in response to inv, to retrieve the content of a specific object, 
+	 * and is usually sent after receiving an inv packet, after filtering known elements. 
+	 *   the known elements (recently received, rejected or requested) are filtered out by spv_node_filter_invs(),
+	 *   blocks are downloaded headers-first: an unknown block triggers getheaders, 
+	 *   the known ones are scheduled by the blocks_downloader.
+	*/
+	struct bitcoin_inventory * invs = calloc(msg->count, sizeof(*invs));
+	assert(invs);
+	ssize_t num_unknown = spv_node_filter_invs(spv, msg->invs, msg->count, invs);
+	ssize_t count = 0;
+	int unknown_blocks = 0;
+	for(ssize_t i = 0; i < num_unknown; ++i) {
+		const struct bitcoin_inventory * inv = &invs[i];
+		uint32_t type = inv->type & ~bitcoin_inventory_type_msg_witness_flag;
+		if(type == bitcoin_inventory_type_msg_block) {
+			if(NULL == app->blocks_downloader || !block_download_is_known(app->blocks_downloader, (const uint256_t *)inv->hash)) ++unknown_blocks;
+			continue;
+		}
+		invs[count++] = *inv;
+	}
+	
+	int rc = send_getdata(spv, magic, invs, count);
+	free(invs);
+	
+	if(0 == rc && unknown_blocks > 0) rc = send_getheaders(spv, magic, 0);
+	if(0 == rc) rc = request_blocks(spv, magic, NULL);
+	return rc;
+}
+
+/*
+ * reply with a block of the blk files (read through the block cache),
+ *   the blocks are stored with their witness data, so only getdata(witness_block) is answered from them.
+ */
+static int send_block_from_files(struct spv_node_context * spv, uint32_t magic, const uint256_t * hash)
+{
+	app_context_t * app = spv->user_data;
+	if(NULL == app->blocks_cache) return -1;
+	
+	blockchain_snapshot_t snapshot[1];
+	blockchain_snapshot_acquire(spv->chain, snapshot);
+	ssize_t height = blockchain_snapshot_get_height(snapshot, hash);
+	blockchain_snapshot_release(snapshot);
+	if(height < 0 || height >= app->num_block_positions) return -1;
+	
+	const struct block_file_pos * pos = &app->block_positions[height];
+	if(0 == pos->block_size || memcmp(&pos->hash, hash, sizeof(*hash)) != 0) return -1;
+	
+	block_cache_t * cache = app->blocks_cache;
+	block_cache_entry_t * entry = block_cache_get_record(cache, pos);
+	if(NULL == entry) return -1;
+	
+	struct bitcoin_message_header * msg_data = calloc(1, sizeof(*msg_data) + entry->block_size);
+	assert(msg_data);
+	msg_data->magic = magic;
+	strncpy(msg_data->command, bitcoin_message_type_to_string(bitcoin_message_type_block), sizeof(msg_data->command));
+	msg_data->length = entry->block_size;
+	
+	unsigned char checksum[32];
+	hash256(entry->data, entry->block_size, checksum);
+	memcpy(&msg_data->checksum, checksum, 4);
+	memcpy(msg_data->payload, entry->data, entry->block_size);
+	cache->release(cache, entry);
+	
+	int rc = spv_node_send_data(spv, msg_data, sizeof(*msg_data) + msg_data->length);
+	free(msg_data);
+	return rc;
+}
+
 static int on_message_getdata(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
 {
 	struct bitcoin_message_getdata * msg = bitcoin_message_get_object(in_msg);
 	bitcoin_message_getdata_dump(msg);
+	if(NULL == msg) return 0;
+	
+	// the peer has got them (from someone else) or will get them, do not announce them again
+	for(ssize_t i = 0; i < msg->count; ++i) spv_node_mark_inv_known_by_peer(spv, (const uint256_t *)msg->invs[i].hash);
+	
+	// BIP37: filtered blocks are served to the peers which have loaded a filter
+	for(ssize_t i = 0; NULL != spv->peer_filter && i < msg->count; ++i) {
+		if(msg->invs[i].type != bitcoin_inventory_type_msg_filtered_block) continue;
+		int rc = send_filtered_block(spv, in_msg->msg_data->magic, (const uint256_t *)msg->invs[i].hash);
+		if(rc) return rc;
+	}
+	
+	// the blocks of the local blk files
+	for(ssize_t i = 0; i < msg->count; ++i) {
+		if(msg->invs[i].type != bitcoin_inventory_type_msg_witness_block) continue;
+		if(send_block_from_files(spv, in_msg->msg_data->magic, (const uint256_t *)msg->invs[i].hash)) {
+			debug_printf("block not found in %s", APP_BLOCKS_DIR);
+		}
+	}
+	
+	// BIP152: the recent blocks can be requested as compact blocks
+	app_context_t * app = spv->user_data;
+	for(ssize_t i = 0; i < msg->count; ++i) {
+		if(msg->invs[i].type != bitcoin_inventory_type_msg_cmpct_block) continue;
+		
+		satoshi_block_t block[1];
+		if(get_recent_block(app, (const uint256_t *)msg->invs[i].hash, block)) continue;
+		
+		struct bitcoin_message * cmpct_msg = bitcoin_message_new(NULL, in_msg->msg_data->magic, bitcoin_message_type_cmpctblock, spv);
+		assert(cmpct_msg);
+		struct bitcoin_message_cmpctblock * cmpct = bitcoin_message_get_object(cmpct_msg);
+		uint64_t nonce = ((uint64_t)mrand48() << 32) ^ (uint32_t)mrand48();
+		int version = spv->peer_cmpct_version?(int)spv->peer_cmpct_version:SPV_NODE_CMPCT_VERSION;
+		if(0 == compact_block_from_block(cmpct, block, nonce, version)) {
+			if(spv->send_message) spv->send_message(spv, cmpct_msg);
+		}
+		bitcoin_message_free(cmpct_msg);
+		satoshi_block_cleanup(block);
+	}
 	return 0;
 }
 
@@ -349,7 +847,15 @@ static int on_message_notfound(struct spv_node_context * spv, const bitcoin_mess
 {
 	struct bitcoin_message_getdata * msg = bitcoin_message_get_object(in_msg);
 	bitcoin_message_getdata_dump(msg);
-	return 0;
+	
+	app_context_t * app = spv->user_data;
+	if(NULL == msg || NULL == app->blocks_downloader) return 0;
+	for(ssize_t i = 0; i < msg->count; ++i) {
+		uint32_t type = msg->invs[i].type & ~bitcoin_inventory_type_msg_witness_flag;
+		if(type != bitcoin_inventory_type_msg_block) continue;
+		block_download_on_notfound(app->blocks_downloader, spv->fd, (const uint256_t *)msg->invs[i].hash);
+	}
+	return request_blocks(spv, in_msg->msg_data->magic, NULL);	// try the next ones
 }
 
 static int on_message_getblocks(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
@@ -367,12 +873,116 @@ static int on_message_getheaders(struct spv_node_context * spv, const bitcoin_me
 	return 0;
 }
 
+/*
+ * the value of a spent output: 
+ *   an unconfirmed tx (the mempool), or a confirmed one (the unspent outputs kept by the filter index)
+ */
+static int get_prevout_value(app_context_t * app, const satoshi_outpoint_t * outpoint, int64_t * p_value)
+{
+	unsigned char * raw_tx = NULL;
+	ssize_t cb = mempool_get_tx(app->mempool, (const uint256_t *)outpoint->prev_hash, 0, &raw_tx);
+	if(cb <= 0) {
+		if(NULL == app->filter_index) return -1;
+		return block_filter_index_get_prevout(app->filter_index, outpoint, p_value, NULL);
+	}
+	
+	satoshi_tx_t parent[1];
+	memset(parent, 0, sizeof(parent));
+	ssize_t cb_parsed = satoshi_tx_parse(parent, cb, raw_tx);
+	free(raw_tx);
+	
+	int rc = -1;
+	if(cb_parsed == cb && outpoint->index < parent->txout_count) {
+		*p_value = parent->txouts[outpoint->index].value;
+		rc = 0;
+	}
+	satoshi_tx_cleanup(parent);
+	return rc;
+}
+
+// fee = sum(inputs) - sum(outputs)
+static int get_tx_fee(app_context_t * app, const satoshi_tx_t * tx, int64_t * p_fee)
+{
+	int64_t fee = 0;
+	for(ssize_t i = 0; i < tx->txin_count; ++i) {
+		int64_t value = 0;
+		if(get_prevout_value(app, &tx->txins[i].outpoint, &value)) return -1;
+		fee += value;
+	}
+	for(ssize_t i = 0; i < tx->txout_count; ++i) fee -= tx->txouts[i].value;
+	if(fee < 0) return -1;
+	
+	*p_fee = fee;
+	return 0;
+}
+
+// BIP37: only the txs matching the peer's filter are announced
+static int is_tx_relevant(struct spv_node_context * spv, const satoshi_tx_t * tx)
+{
+	if(!spv->peer_relay_txs) return 0;
+	return (NULL == spv->peer_filter) || bloom_filter_match_tx(spv->peer_filter, tx);
+}
+
 static int on_message_tx(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
 {
 	bitcoin_message_tx_t * msg = bitcoin_message_get_object(in_msg);
 	bitcoin_message_tx_dump(msg);
+	if(NULL == msg) return 0;
+	
+	spv_node_mark_inv_known_by_peer(spv, msg->txid);
+	
+	// the confirmed inputs can only be resolved when the filter index is enabled (BIP157)
+	app_context_t * app = spv->user_data;
+	int64_t fee = 0;
+	if(get_tx_fee(app, msg, &fee)) {
+		debug_printf("the inputs of the tx are unknown");
+		spv_node_mark_inv_received(spv, msg->txid, 0);
+		return 0;
+	}
 	
-//	exit(0);
+	enum mempool_status status = mempool_add(app->mempool, msg, fee);
+	debug_printf("mempool_add(): %s", mempool_status_to_string(status));
+	if(status == mempool_status_ok && is_tx_relevant(spv, msg)) {
+		struct bitcoin_inventory inv = { .type = bitcoin_inventory_type_msg_tx };
+		memcpy(inv.hash, msg->txid, sizeof(inv.hash));
+		spv_node_announce_inv(spv, &inv);
+	}
+	
+	// a tx refused for policy reasons (fee rate, chain limits, conflicts) is not requested again soon
+	spv_node_mark_inv_received(spv, msg->txid, (status != mempool_status_ok && status != mempool_status_duplicate));
+	return 0;
+}
+
+/*
+ * BIP35: reply with the txids of the mempool (best fee rate first), 
+ *   the announcements are filtered (known by the peer, and the peer's bloom filter) and trickled.
+ */
+static int on_message_mempool(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	app_context_t * app = spv->user_data;
+	uint256_t * txids = NULL;
+	ssize_t count = mempool_select_txs(app->mempool, INT64_MAX, &txids, NULL);
+	if(count > SPV_NODE_MAX_INV_SIZE) count = SPV_NODE_MAX_INV_SIZE;
+	
+	for(ssize_t i = 0; i < count; ++i) {
+		if(spv->peer_filter) {
+			unsigned char * raw_tx = NULL;
+			ssize_t cb = mempool_get_tx(app->mempool, &txids[i], 0, &raw_tx);
+			if(cb <= 0) continue;
+			
+			satoshi_tx_t tx[1];
+			memset(tx, 0, sizeof(tx));
+			int relevant = (satoshi_tx_parse(tx, cb, raw_tx) == cb) && bloom_filter_match_tx(spv->peer_filter, tx);
+			satoshi_tx_cleanup(tx);
+			free(raw_tx);
+			if(!relevant) continue;
+		}
+		
+		struct bitcoin_inventory inv = { .type = bitcoin_inventory_type_msg_tx };
+		memcpy(inv.hash, &txids[i], sizeof(inv.hash));
+		if(spv_node_announce_inv(spv, &inv)) break;
+	}
+	free(txids);
 	return 0;
 }
 
@@ -381,8 +991,24 @@ static int on_message_block(struct spv_node_context * spv, const bitcoin_message
 	bitcoin_message_block_t * msg = bitcoin_message_get_object(in_msg);
 	bitcoin_message_block_dump(msg);
 	
-//	exit(0);
-	return 0;
+	app_context_t * app = spv->user_data;
+	const struct bitcoin_message_header * msg_data = in_msg->msg_data;
+	if(NULL == app->blocks_downloader || msg_data->length < sizeof(struct satoshi_block_header)) return 0;
+	
+	// keep the raw block until all the blocks before it have been received
+	uint256_t hash;
+	hash256(msg_data->payload, sizeof(struct satoshi_block_header), (uint8_t *)&hash);
+	spv_node_mark_inv_known_by_peer(spv, &hash);
+	
+	struct raw_block * block = malloc(sizeof(*block) + msg_data->length);
+	assert(block);
+	block->length = msg_data->length;
+	memcpy(block->data, msg_data->payload, msg_data->length);
+	if(block_download_on_block(app->blocks_downloader, spv->fd, &hash, block)) {
+		debug_printf("unrequested block");
+		free(block);
+	}
+	return request_blocks(spv, msg_data->magic, NULL);
 }
 
 static int on_message_headers(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
@@ -393,42 +1019,230 @@ static int on_message_headers(struct spv_node_context * spv, const bitcoin_messa
 	
 	bitcoin_message_block_headers_dump(msg);
 
+	app_context_t * app = spv->user_data;
 	blockchain_t * chain = spv->chain;
 	block_headers_db_t * db = chain->user_data;
 	
 	assert(chain && chain->add && db);
 	int rc = 0;
 	
-	for(int i = 0; i < msg->count; ++i) {	
-		rc = chain->add(chain, NULL, &msg->hdrs[i].hdr);
-		if(rc) break;	
+	// the headers in the message are followed by txn_count, copy them to a contiguous array
+	struct satoshi_block_header * hdrs = calloc(msg->count, sizeof(*hdrs));
+	assert(hdrs);
+	for(int i = 0; i < msg->count; ++i) memcpy(&hdrs[i], &msg->hdrs[i].hdr, sizeof(*hdrs));
+	
+	ssize_t num_added = blockchain_add_batch_from_peer(chain, hdrs, msg->count, spv->fd);
+	free(hdrs);
+	if(num_added < msg->count) {
+		debug_printf("%ld of %ld headers added", (long)num_added, (long)msg->count);
 	}
 	
-	ssize_t height = chain->height;
+	ssize_t height = blockchain_get_latest(chain, NULL, NULL);
 	fprintf(stderr, "\e[32m" "current height: %ld" "\e[39m" "\n", (long)height);
 	
-	// pull more headers
-	struct bitcoin_message * getheaders_msg = bitcoin_message_new(NULL, 
-		in_msg->msg_data->magic, 
-		bitcoin_message_type_getheaders, 
-		spv);
-	struct bitcoin_message_getheaders * getheaders = bitcoin_message_get_object(getheaders_msg);
-	assert(getheaders);
+	// pull more headers, or download the blocks once the headers have caught up
+	if(msg->count >= 2000) rc = send_getheaders(spv, in_msg->msg_data->magic, 100);
+	else {
+		if(app->blocks_downloader) block_download_update_peer(app->blocks_downloader, spv->fd, height);
+		rc = request_blocks(spv, in_msg->msg_data->magic, NULL);
+	}
 	
-	uint32_t version = spv->peer_version;
-	if(0 == version || version > spv->protocol_version) version = spv->protocol_version;
+	assert(0 == rc);
+	return rc;
+}
+
+/*
+ * BIP152: compact blocks
+ *   cmpctblock: the reply of getdata(cmpct_block) (low-bandwidth mode), 
+ *     or a new block announced before its header (high-bandwidth mode).
+ *   the block is reconstructed from the mempool, the missing txs are requested with getblocktxn,
+ *   the full block is requested if the short ids collide.
+ */
+static int on_compact_block_completed(struct spv_node_context * spv, uint32_t magic, partial_block_t * pblock)
+{
+	app_context_t * app = spv->user_data;
+	unsigned char * data = NULL;
+	ssize_t length = partial_block_build(pblock, &data);
+	if(length <= 0) return request_full_block(spv, magic, &pblock->hash);
 	
-	uint256_t * hashes = NULL;
-	ssize_t count = blockchain_get_known_hashes(chain, 100, &hashes);
-	assert(count > 0 && hashes);
+	debug_printf("compact block reconstructed: %ld txs (%ld from the mempool)", 
+		(long)pblock->txn_count, (long)pblock->mempool_count);
 	
-	rc = bitcoin_message_getheaders_set(getheaders, version, count, hashes, NULL);
-	if(0 == rc) {
-		if(spv->send_message) spv->send_message(spv, getheaders_msg);
+	struct raw_block * block = malloc(sizeof(*block) + length);
+	assert(block);
+	block->length = length;
+	memcpy(block->data, data, length);
+	free(data);
+	
+	if(block_download_on_block(app->blocks_downloader, spv->fd, &pblock->hash, block)) {
+		debug_printf("unrequested block");
+		free(block);
 	}
-	free(hashes);
-	bitcoin_message_free(getheaders_msg);
+	return request_blocks(spv, magic, NULL);
+}
+
+static int on_message_cmpctblock(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	struct bitcoin_message_cmpctblock * msg = bitcoin_message_get_object(in_msg);
+	bitcoin_message_cmpctblock_dump(msg);
 	
-	assert(0 == rc);
+	app_context_t * app = spv->user_data;
+	block_download_manager_t * downloader = app->blocks_downloader;
+	if(NULL == msg || NULL == downloader) return 0;
+	
+	uint32_t magic = in_msg->msg_data->magic;
+	uint256_t hash;
+	hash256(&msg->hdr, sizeof(msg->hdr), (uint8_t *)&hash);
+	spv_node_mark_inv_known_by_peer(spv, &hash);
+	
+	if(!block_download_is_known(downloader, &hash)) {
+		// high-bandwidth mode: extend the headers chain, and assign the block to the peer
+		blockchain_t * chain = spv->chain;
+		blockchain_snapshot_t snapshot[1];
+		blockchain_snapshot_acquire(chain, snapshot);
+		ssize_t height = blockchain_snapshot_get_height(snapshot, &hash);
+		blockchain_snapshot_release(snapshot);
+		if(height < 0) {
+			if(blockchain_add_batch_from_peer(chain, &msg->hdr, 1, spv->fd) != 1) return send_getheaders(spv, magic, 0);
+			block_download_update_peer(downloader, spv->fd, blockchain_get_latest(chain, NULL, NULL));
+		}
+		int rc = request_blocks(spv, magic, &hash);
+		if(rc || !block_download_is_known(downloader, &hash)) return rc;	// not in the download window yet
+	}
+	
+	partial_block_t * pblock = calloc(1, sizeof(*pblock));
+	assert(pblock);
+	int version = spv->peer_cmpct_version?(int)spv->peer_cmpct_version:SPV_NODE_CMPCT_VERSION;
+	int rc = partial_block_init(pblock, msg, version, app->mempool);
+	if(rc) {
+		free(pblock);
+		if(rc < 0) return -1;	// invalid message
+		return request_full_block(spv, magic, &hash);
+	}
+	
+	if(0 == pblock->missing_count) {
+		rc = on_compact_block_completed(spv, magic, pblock);
+		partial_block_cleanup(pblock);
+		free(pblock);
+		return rc;
+	}
+	
+	// only the latest compact block waits for its missing txs, the previous one is downloaded again after the timeout
+	partial_block_cleanup(app->partial_block);
+	free(app->partial_block);
+	app->partial_block = pblock;
+	
+	struct bitcoin_message * getblocktxn_msg = bitcoin_message_new(NULL, magic, bitcoin_message_type_getblocktxn, spv);
+	assert(getblocktxn_msg);
+	struct bitcoin_message_getblocktxn * getblocktxn = bitcoin_message_get_object(getblocktxn_msg);
+	getblocktxn->block_hash = hash;
+	getblocktxn->count = partial_block_get_missing(pblock, &getblocktxn->indexes);
+	if(spv->send_message) spv->send_message(spv, getblocktxn_msg);
+	bitcoin_message_free(getblocktxn_msg);
+	return 0;
+}
+
+static int on_message_blocktxn(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	struct bitcoin_message_blocktxn * msg = bitcoin_message_get_object(in_msg);
+	bitcoin_message_blocktxn_dump(msg);
+	
+	app_context_t * app = spv->user_data;
+	partial_block_t * pblock = app->partial_block;
+	if(NULL == msg || NULL == pblock || memcmp(&pblock->hash, &msg->block_hash, sizeof(uint256_t)) != 0) return 0;	// unrequested
+	app->partial_block = NULL;
+	
+	uint32_t magic = in_msg->msg_data->magic;
+	int rc = 0;
+	if(partial_block_fill(pblock, msg)) rc = request_full_block(spv, magic, &pblock->hash);
+	else rc = on_compact_block_completed(spv, magic, pblock);
+	
+	partial_block_cleanup(pblock);
+	free(pblock);
 	return rc;
 }
+
+static int on_message_getblocktxn(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	struct bitcoin_message_getblocktxn * msg = bitcoin_message_get_object(in_msg);
+	bitcoin_message_getblocktxn_dump(msg);
+	
+	app_context_t * app = spv->user_data;
+	satoshi_block_t block[1];
+	if(NULL == msg || get_recent_block(app, &msg->block_hash, block)) return 0;
+	
+	struct bitcoin_message * blocktxn_msg = bitcoin_message_new(NULL, in_msg->msg_data->magic, bitcoin_message_type_blocktxn, spv);
+	assert(blocktxn_msg);
+	struct bitcoin_message_blocktxn * blocktxn = bitcoin_message_get_object(blocktxn_msg);
+	int rc = compact_block_get_txns(block, msg, blocktxn);
+	if(0 == rc && spv->send_message) spv->send_message(spv, blocktxn_msg);
+	
+	bitcoin_message_free(blocktxn_msg);
+	satoshi_block_cleanup(block);
+	return rc;	// an index out of range is a protocol violation
+}
+
+/*
+ * BIP157: serve the compact block filters
+ *   an invalid request (unknown filter type, a reversed or too large range) is a protocol violation,
+ *   the requests for blocks which have not been indexed are ignored.
+ */
+static int on_message_getcfilters(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	struct bitcoin_message_getcfilters * msg = bitcoin_message_get_object(in_msg);
+	bitcoin_message_getcfilters_dump(msg);
+	
+	app_context_t * app = spv->user_data;
+	if(NULL == msg || NULL == app->filter_index) return 0;
+	
+	struct bitcoin_message_cfilter * filters = NULL;
+	ssize_t count = block_filter_index_get_cfilters(app->filter_index, msg, &filters);
+	if(count <= 0) return (int)count;
+	
+	for(ssize_t i = 0; i < count; ++i) {
+		struct bitcoin_message * cfilter_msg = bitcoin_message_new(NULL, in_msg->msg_data->magic, bitcoin_message_type_cfilter, spv);
+		assert(cfilter_msg);
+		
+		// the filter is moved into the message
+		struct bitcoin_message_cfilter * cfilter = bitcoin_message_get_object(cfilter_msg);
+		*cfilter = filters[i];
+		if(spv->send_message) spv->send_message(spv, cfilter_msg);
+		bitcoin_message_free(cfilter_msg);
+	}
+	free(filters);
+	return 0;
+}
+
+static int on_message_getcfheaders(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	struct bitcoin_message_getcfheaders * msg = bitcoin_message_get_object(in_msg);
+	bitcoin_message_getcfheaders_dump(msg);
+	
+	app_context_t * app = spv->user_data;
+	if(NULL == msg || NULL == app->filter_index) return 0;
+	
+	struct bitcoin_message * cfheaders_msg = bitcoin_message_new(NULL, in_msg->msg_data->magic, bitcoin_message_type_cfheaders, spv);
+	assert(cfheaders_msg);
+	ssize_t count = block_filter_index_get_cfheaders(app->filter_index, msg, bitcoin_message_get_object(cfheaders_msg));
+	if(count > 0 && spv->send_message) spv->send_message(spv, cfheaders_msg);
+	
+	bitcoin_message_free(cfheaders_msg);
+	return (count < 0)?-1:0;
+}
+
+static int on_message_getcfcheckpt(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
+{
+	struct bitcoin_message_getcfcheckpt * msg = bitcoin_message_get_object(in_msg);
+	bitcoin_message_getcfcheckpt_dump(msg);
+	
+	app_context_t * app = spv->user_data;
+	if(NULL == msg || NULL == app->filter_index) return 0;
+	
+	struct bitcoin_message * cfcheckpt_msg = bitcoin_message_new(NULL, in_msg->msg_data->magic, bitcoin_message_type_cfcheckpt, spv);
+	assert(cfcheckpt_msg);
+	int rc = block_filter_index_get_cfcheckpt(app->filter_index, msg, bitcoin_message_get_object(cfcheckpt_msg));
+	if(rc == 1 && spv->send_message) spv->send_message(spv, cfcheckpt_msg);
+	
+	bitcoin_message_free(cfcheckpt_msg);
+	return (rc < 0)?-1:0;
+}
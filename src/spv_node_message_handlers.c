@@ -114,8 +114,7 @@ static int send_message_verack(spv_node_context_t * spv, const struct bitcoin_me
 	}};
 	hdr->magic = in_msg->msg_data->magic;
 	
-	auto_buffer_push(spv->out_buf, hdr, sizeof(*hdr));
-	return 0;
+	return spv_node_send_data(spv, hdr, sizeof(*hdr));
 }
 
 static int send_message_pong(spv_node_context_t * spv, const struct bitcoin_message * in_msg)
@@ -135,8 +134,7 @@ static int send_message_pong(spv_node_context_t * spv, const struct bitcoin_mess
 		.nonce = *(uint64_t *)msg_data->payload
 	};
 	
-	auto_buffer_push(spv->out_buf, &msg_pong, sizeof(msg_pong));
-	return 0;
+	return spv_node_send_data(spv, &msg_pong, sizeof(msg_pong));
 }
 
 static int on_message_unknown(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
@@ -155,6 +153,14 @@ static int on_message_version(struct spv_node_context * spv, const bitcoin_messa
 	spv->peer_version = msg_ver->version;
 	spv->peer_height = msg_ver->start_height;
 	
+	// BIP37: a new connection, without a filter until filterload
+	spv->peer_relay_txs = msg_ver->relay;
+	if(spv->peer_filter) {
+		bloom_filter_cleanup(spv->peer_filter);
+		free(spv->peer_filter);
+		spv->peer_filter = NULL;
+	}
+	
 	return send_message_verack(spv, in_msg);
 }
 
@@ -209,13 +215,22 @@ static int on_message_addr(struct spv_node_context * spv, const bitcoin_message_
 static int on_message_inv(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
 {
 	debug_printf("%s(%p)", __FUNCTION__, in_msg);
-	bitcoin_message_inv_dump(in_msg->msg_object);
+	struct bitcoin_message_inv * msg = in_msg->msg_object;
+	bitcoin_message_inv_dump(msg);
+	if(NULL == msg) return 0;
+	
+	// nothing is downloaded by default, only remember what the peer knows
+	for(ssize_t i = 0; i < msg->count; ++i) spv_node_mark_inv_known_by_peer(spv, (const uint256_t *)msg->invs[i].hash);
 	return 0;
 }
 
 static int on_message_getdata(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
 {
 	debug_printf("%s(%p)", __FUNCTION__, in_msg);
+	struct bitcoin_message_getdata * msg = in_msg->msg_object;
+	if(NULL == msg) return 0;
+	
+	for(ssize_t i = 0; i < msg->count; ++i) spv_node_mark_inv_known_by_peer(spv, (const uint256_t *)msg->invs[i].hash);
 	return 0;
 }
 static int on_message_notfound(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
@@ -310,21 +325,54 @@ static int on_message_reject(struct spv_node_context * spv, const bitcoin_messag
 	return 0;
 }
 
+/*
+ * BIP37: the filter messages are protocol violations (the peer is disconnected) 
+ *   if bloom filters are not served (BIP111), or if the filter exceeds the limits.
+ */
 static int on_message_filterload(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
 {
 	debug_printf("%s(%p)", __FUNCTION__, in_msg);
+	struct bitcoin_message_filterload * msg = bitcoin_message_get_object(in_msg);
+	bitcoin_message_filterload_dump(msg);
+	if(NULL == msg || !spv->bloom_filters) return -1;
+	
+	bloom_filter_t * filter = spv->peer_filter;
+	if(NULL == filter) filter = calloc(1, sizeof(*filter));
+	else bloom_filter_cleanup(filter);
+	assert(filter);
+	spv->peer_filter = filter;
+	
+	int rc = bloom_filter_load(filter, msg);
+	if(rc) {
+		free(filter);
+		spv->peer_filter = NULL;
+		return rc;
+	}
+	spv->peer_relay_txs = 1;
 	return 0;
 }
 
 static int on_message_filteradd(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
 {
 	debug_printf("%s(%p)", __FUNCTION__, in_msg);
-	return 0;
+	struct bitcoin_message_filteradd * msg = bitcoin_message_get_object(in_msg);
+	bitcoin_message_filteradd_dump(msg);
+	if(NULL == msg || !spv->bloom_filters || NULL == spv->peer_filter) return -1;
+	
+	return bloom_filter_add(spv->peer_filter, msg);
 }
 
 static int on_message_filterclear(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
 {
 	debug_printf("%s(%p)", __FUNCTION__, in_msg);
+	if(!spv->bloom_filters) return -1;
+	
+	if(spv->peer_filter) {
+		bloom_filter_cleanup(spv->peer_filter);
+		free(spv->peer_filter);
+		spv->peer_filter = NULL;
+	}
+	spv->peer_relay_txs = 1;
 	return 0;
 }
 
@@ -356,6 +404,16 @@ static int on_message_feefilter(struct spv_node_context * spv, const bitcoin_mes
 static int on_message_sendcmpct(struct spv_node_context * spv, const bitcoin_message_t * in_msg)
 {
 	debug_printf("%s(%p)", __FUNCTION__, in_msg);
+	struct bitcoin_message_sendcmpct * msg = bitcoin_message_get_object(in_msg);
+	if(NULL == msg) return 0;
+	bitcoin_message_sendcmpct_dump(msg);
+	
+	// BIP152: a peer may send several sendcmpct, the highest version supported by both sides is used
+	if(msg->version < 1 || msg->version > SPV_NODE_CMPCT_VERSION) return 0;
+	if(msg->version >= spv->peer_cmpct_version) {
+		spv->peer_cmpct_version = msg->version;
+		spv->peer_cmpct_announce = msg->announce;
+	}
 	return 0;
 }
 
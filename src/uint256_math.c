@@ -0,0 +1,455 @@
+/*
+ * uint256_math.c
+ * 
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ * 
+ * The MIT License (MIT)
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy 
+ * of this software and associated documentation files (the "Software"), to deal 
+ * in the Software without restriction, including without limitation the rights 
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell 
+ * copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS 
+ * IN THE SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "uint256_math.h"
+
+void uint256_u64_from_uint256(uint256_u64_t * r, const uint256_t * u)
+{
+	const uint8_t * p = u->val;
+	for(int i = 0; i < 4; ++i, p += 8)
+	{
+		uint64_t limb = 0;
+		for(int j = 7; j >= 0; --j) limb = (limb << 8) | p[j];
+		r->limbs[i] = limb;
+	}
+}
+
+void uint256_u64_to_uint256(uint256_t * u, const uint256_u64_t * a)
+{
+	uint8_t * p = u->val;
+	for(int i = 0; i < 4; ++i)
+	{
+		uint64_t limb = a->limbs[i];
+		for(int j = 0; j < 8; ++j, limb >>= 8) *p++ = (uint8_t)limb;
+	}
+}
+
+void uint256_u64_set_u64(uint256_u64_t * r, uint64_t value)
+{
+	r->limbs[0] = value;
+	r->limbs[1] = r->limbs[2] = r->limbs[3] = 0;
+}
+
+int uint256_u64_is_zero(const uint256_u64_t * a)
+{
+	return 0 == (a->limbs[0] | a->limbs[1] | a->limbs[2] | a->limbs[3]);
+}
+
+int uint256_u64_compare(const uint256_u64_t * a, const uint256_u64_t * b)
+{
+	for(int i = 3; i >= 0; --i)
+	{
+		if(a->limbs[i] == b->limbs[i]) continue;
+		return (a->limbs[i] > b->limbs[i])?1:-1;
+	}
+	return 0;
+}
+
+int uint256_u64_bits(const uint256_u64_t * a)
+{
+	for(int i = 3; i >= 0; --i)
+	{
+		if(a->limbs[i]) return i * 64 + 64 - __builtin_clzll(a->limbs[i]);
+	}
+	return 0;
+}
+
+int uint256_u64_add(uint256_u64_t * r, const uint256_u64_t * a, const uint256_u64_t * b)
+{
+	uint64_t carry = 0;
+	for(int i = 0; i < 4; ++i)
+	{
+		unsigned __int128 sum = (unsigned __int128)a->limbs[i] + b->limbs[i] + carry;
+		r->limbs[i] = (uint64_t)sum;
+		carry = (uint64_t)(sum >> 64);
+	}
+	return (int)carry;
+}
+
+int uint256_u64_sub(uint256_u64_t * r, const uint256_u64_t * a, const uint256_u64_t * b)
+{
+	uint64_t borrow = 0;
+	for(int i = 0; i < 4; ++i)
+	{
+		unsigned __int128 diff = (unsigned __int128)a->limbs[i] - b->limbs[i] - borrow;
+		r->limbs[i] = (uint64_t)diff;
+		borrow = (diff >> 64)?1:0;
+	}
+	return (int)borrow;
+}
+
+int uint256_u64_mul(uint256_u64_t * r, const uint256_u64_t * a, const uint256_u64_t * b)
+{
+	uint64_t t[4] = { 0 };
+	int overflow = 0;
+	for(int i = 0; i < 4; ++i)
+	{
+		if(0 == a->limbs[i]) continue;
+		
+		uint64_t carry = 0;
+		for(int j = 0; j < 4; ++j)
+		{
+			if(i + j >= 4) {
+				if(b->limbs[j]) overflow = 1;
+				continue;
+			}
+			unsigned __int128 product = (unsigned __int128)a->limbs[i] * b->limbs[j] + t[i + j] + carry;
+			t[i + j] = (uint64_t)product;
+			carry = (uint64_t)(product >> 64);
+		}
+		if(carry) overflow = 1;
+	}
+	memcpy(r->limbs, t, sizeof(t));
+	return overflow;
+}
+
+void uint256_u64_not(uint256_u64_t * r, const uint256_u64_t * a)
+{
+	for(int i = 0; i < 4; ++i) r->limbs[i] = ~a->limbs[i];
+}
+
+void uint256_u64_shl(uint256_u64_t * r, const uint256_u64_t * a, unsigned int bits)
+{
+	uint64_t t[4] = { 0 };
+	if(bits < 256) {
+		int offset = bits / 64;
+		int shift = bits % 64;
+		for(int i = 3; i >= offset; --i)
+		{
+			t[i] = a->limbs[i - offset] << shift;
+			if(shift && (i - offset - 1) >= 0) t[i] |= a->limbs[i - offset - 1] >> (64 - shift);
+		}
+	}
+	memcpy(r->limbs, t, sizeof(t));
+}
+
+void uint256_u64_shr(uint256_u64_t * r, const uint256_u64_t * a, unsigned int bits)
+{
+	uint64_t t[4] = { 0 };
+	if(bits < 256) {
+		int offset = bits / 64;
+		int shift = bits % 64;
+		for(int i = 0; i < 4 - offset; ++i)
+		{
+			t[i] = a->limbs[i + offset] >> shift;
+			if(shift && (i + offset + 1) < 4) t[i] |= a->limbs[i + offset + 1] << (64 - shift);
+		}
+	}
+	memcpy(r->limbs, t, sizeof(t));
+}
+
+/**
+ * divmod_knuth(): 
+ *   Knuth's algorithm D with 64-bit digits (Hacker's Delight, divmnu), 
+ *   m: number of limbs of u, n: number of limbs of v (n >= 2, v[n - 1] != 0, m >= n)
+ */
+static void divmod_knuth(uint64_t q[4], uint64_t r[4], const uint64_t u[4], int m, const uint64_t v[4], int n)
+{
+	uint64_t un[5] = { 0 };
+	uint64_t vn[4] = { 0 };
+	
+	// normalize: shift v to make its highest bit set
+	int s = __builtin_clzll(v[n - 1]);
+	for(int i = n - 1; i > 0; --i) vn[i] = (v[i] << s) | (s?(v[i - 1] >> (64 - s)):0);
+	vn[0] = v[0] << s;
+	
+	un[m] = s?(u[m - 1] >> (64 - s)):0;
+	for(int i = m - 1; i > 0; --i) un[i] = (u[i] << s) | (s?(u[i - 1] >> (64 - s)):0);
+	un[0] = u[0] << s;
+	
+	for(int j = m - n; j >= 0; --j)
+	{
+		// estimate the quotient digit
+		unsigned __int128 num = ((unsigned __int128)un[j + n] << 64) | un[j + n - 1];
+		unsigned __int128 qhat = num / vn[n - 1];
+		unsigned __int128 rhat = num % vn[n - 1];
+		while((qhat >> 64) 
+			|| (qhat * vn[n - 2]) > ((rhat << 64) | un[j + n - 2]))
+		{
+			--qhat;
+			rhat += vn[n - 1];
+			if(rhat >> 64) break;
+		}
+		
+		// multiply and subtract
+		__int128 k = 0, t = 0;
+		for(int i = 0; i < n; ++i)
+		{
+			unsigned __int128 p = qhat * vn[i];
+			t = (__int128)un[i + j] - k - (__int128)(uint64_t)p;
+			un[i + j] = (uint64_t)t;
+			k = (__int128)(uint64_t)(p >> 64) - (t >> 64);
+		}
+		t = (__int128)un[j + n] - k;
+		un[j + n] = (uint64_t)t;
+		
+		q[j] = (uint64_t)qhat;
+		if(t < 0) {
+			// subtracted too much, add back
+			--q[j];
+			unsigned __int128 carry = 0;
+			for(int i = 0; i < n; ++i)
+			{
+				carry += (unsigned __int128)un[i + j] + vn[i];
+				un[i + j] = (uint64_t)carry;
+				carry >>= 64;
+			}
+			un[j + n] += (uint64_t)carry;
+		}
+	}
+	
+	// unnormalize the remainder
+	for(int i = 0; i < n; ++i) r[i] = (un[i] >> s) | (s?(un[i + 1] << (64 - s)):0);
+}
+
+int uint256_u64_divmod(uint256_u64_t * q, uint256_u64_t * r, const uint256_u64_t * n, const uint256_u64_t * d)
+{
+	if(uint256_u64_is_zero(d)) return -1;
+	
+	uint256_u64_t num = *n;
+	uint256_u64_t den = *d;
+	uint256_u64_t quot = uint256_u64_zero;
+	uint256_u64_t rem = uint256_u64_zero;
+	
+	int num_limbs = (uint256_u64_bits(&num) + 63) / 64;
+	int den_limbs = (uint256_u64_bits(&den) + 63) / 64;
+	
+	if(uint256_u64_compare(&num, &den) < 0) {
+		rem = num;
+	}else if(den_limbs == 1) {
+		uint64_t divisor = den.limbs[0];
+		unsigned __int128 remainder = 0;
+		for(int i = num_limbs - 1; i >= 0; --i)
+		{
+			remainder = (remainder << 64) | num.limbs[i];
+			quot.limbs[i] = (uint64_t)(remainder / divisor);
+			remainder %= divisor;
+		}
+		rem.limbs[0] = (uint64_t)remainder;
+	}else {
+		divmod_knuth(quot.limbs, rem.limbs, num.limbs, num_limbs, den.limbs, den_limbs);
+	}
+	
+	if(q) *q = quot;
+	if(r) *r = rem;
+	return 0;
+}
+
+void uint256_u64_set_compact(uint256_u64_t * r, uint32_t bits, int * p_negative, int * p_overflow)
+{
+	int size = bits >> 24;
+	uint32_t word = bits & 0x007fffff;
+	
+	if(size <= 3) {
+		word >>= 8 * (3 - size);
+		uint256_u64_set_u64(r, word);
+	}else {
+		uint256_u64_set_u64(r, word);
+		uint256_u64_shl(r, r, 8 * (size - 3));
+	}
+	
+	if(p_negative) *p_negative = (word != 0) && (bits & 0x00800000);
+	if(p_overflow) *p_overflow = (word != 0) && ((size > 34) 
+		|| (word > 0xff && size > 33) 
+		|| (word > 0xffff && size > 32));
+}
+
+uint32_t uint256_u64_get_compact(const uint256_u64_t * a)
+{
+	int size = (uint256_u64_bits(a) + 7) / 8;
+	uint32_t compact = 0;
+	if(size <= 3) {
+		compact = (uint32_t)(a->limbs[0] << (8 * (3 - size)));
+	}else {
+		uint256_u64_t t;
+		uint256_u64_shr(&t, a, 8 * (size - 3));
+		compact = (uint32_t)t.limbs[0];
+	}
+	
+	// the 0x00800000 bit denotes the sign, use one more byte if it is set.
+	if(compact & 0x00800000) {
+		compact >>= 8;
+		++size;
+	}
+	return compact | ((uint32_t)size << 24);
+}
+
+void uint256_u64_work_from_compact(uint256_u64_t * work, uint32_t bits)
+{
+	int negative = 0, overflow = 0;
+	uint256_u64_t target;
+	uint256_u64_set_compact(&target, bits, &negative, &overflow);
+	if(negative || overflow || uint256_u64_is_zero(&target)) {
+		*work = uint256_u64_zero;
+		return;
+	}
+	
+	// 2^256 can not be represented, use: (~target / (target + 1)) + 1
+	uint256_u64_t one, divisor, inverse;
+	uint256_u64_set_u64(&one, 1);
+	uint256_u64_add(&divisor, &target, &one);
+	uint256_u64_not(&inverse, &target);
+	
+	int rc = uint256_u64_divmod(work, NULL, &inverse, &divisor);
+	assert(0 == rc);
+	uint256_u64_add(work, work, &one);
+}
+
+double uint256_u64_to_double(const uint256_u64_t * a)
+{
+	double value = 0.0;
+	for(int i = 3; i >= 0; --i) value = value * 18446744073709551616.0 + (double)a->limbs[i];
+	return value;
+}
+
+
+#if defined(_TEST_UINT256_MATH) && defined(_STAND_ALONE)
+#include "utils.h"
+
+static void random_uint256(uint256_u64_t * r, int num_limbs)
+{
+	for(int i = 0; i < 4; ++i)
+	{
+		r->limbs[i] = (i < num_limbs)?(((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ (uint64_t)rand()):0;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	// compact encoding (test vectors of the reference client)
+	static const struct {
+		uint32_t bits;
+		uint32_t compact;	// get_compact(set_compact(bits))
+		int negative;
+		int overflow;
+	}vectors[] = {
+		{ 0x00123456, 0x00000000, 0, 0 },
+		{ 0x01003456, 0x00000000, 0, 0 },
+		{ 0x01123456, 0x01120000, 0, 0 },
+		{ 0x02123456, 0x02123400, 0, 0 },
+		{ 0x03123456, 0x03123456, 0, 0 },
+		{ 0x04123456, 0x04123456, 0, 0 },
+		{ 0x04923456, 0x00000000, 1, 0 },	// negative
+		{ 0x05009234, 0x05009234, 0, 0 },
+		{ 0x1d00ffff, 0x1d00ffff, 0, 0 },
+		{ 0x1b0404cb, 0x1b0404cb, 0, 0 },
+		{ 0x20123456, 0x20123456, 0, 0 },
+		{ 0xff123456, 0x00000000, 0, 1 },	// overflow
+	};
+	for(size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i)
+	{
+		uint256_u64_t target;
+		int negative = 0, overflow = 0;
+		uint256_u64_set_compact(&target, vectors[i].bits, &negative, &overflow);
+		assert(negative == vectors[i].negative && overflow == vectors[i].overflow);
+		if(negative || overflow) continue;
+		assert(uint256_u64_get_compact(&target) == vectors[i].compact);
+	}
+	
+	// the same layout as uint256_t
+	uint256_u64_t target;
+	uint256_t u_target;
+	uint256_u64_set_compact(&target, 0x1b0404cb, NULL, NULL);
+	uint256_u64_to_uint256(&u_target, &target);
+	uint256_t expected = compact_to_uint256(&(compact_uint256_t){ .bits = 0x1b0404cb });
+	assert(0 == memcmp(&u_target, &expected, sizeof(uint256_t)));
+	
+	// work of the genesis block: 0x0100010001, and of the regtest blocks: 2
+	uint256_u64_t work;
+	uint256_u64_work_from_compact(&work, 0x1d00ffff);
+	assert(work.limbs[0] == 0x0100010001ULL && 0 == (work.limbs[1] | work.limbs[2] | work.limbs[3]));
+	uint256_u64_work_from_compact(&work, 0x207fffff);
+	assert(work.limbs[0] == 2);
+	uint256_u64_work_from_compact(&work, 0x04923456);
+	assert(uint256_u64_is_zero(&work));
+	
+	// arithmetic: n = q * d + r, (r < d)
+	srand(10);
+	for(int i = 0; i < 100000; ++i)
+	{
+		uint256_u64_t n, d, q, r, t, check;
+		random_uint256(&n, 1 + i % 4);
+		random_uint256(&d, 1 + (i / 4) % 4);
+		if(uint256_u64_is_zero(&d)) continue;
+		
+		int rc = uint256_u64_divmod(&q, &r, &n, &d);
+		assert(0 == rc);
+		assert(uint256_u64_compare(&r, &d) < 0);
+		
+		int overflow = uint256_u64_mul(&t, &q, &d);
+		assert(!overflow);
+		int carry = uint256_u64_add(&check, &t, &r);
+		assert(!carry && 0 == uint256_u64_compare(&check, &n));
+		
+		int borrow = uint256_u64_sub(&check, &check, &r);
+		assert(!borrow && 0 == uint256_u64_compare(&check, &t));
+		
+		int shift = i % 256;
+		uint256_u64_shr(&t, &n, shift);
+		uint256_u64_shl(&t, &t, shift);
+		uint256_u64_shr(&check, &n, shift);
+		assert(uint256_u64_bits(&check) == ((uint256_u64_bits(&n) > shift)?(uint256_u64_bits(&n) - shift):0));
+		uint256_u64_sub(&check, &n, &t);	// the lower bits
+		assert(uint256_u64_bits(&check) <= shift);
+	}
+	
+	// edge cases of the quotient estimation
+	for(int i = 0; i < 4096; ++i)
+	{
+		uint256_u64_t n, d, q, r, t;
+		for(int k = 0; k < 4; ++k) {
+			n.limbs[k] = (i & (1 << k))?UINT64_MAX:(uint64_t)(i * 0x9e3779b97f4a7c15ULL);
+			d.limbs[k] = (i & (16 << k))?UINT64_MAX:((i & (256 << k))?0:((uint64_t)1 << (i % 64)));
+		}
+		if(uint256_u64_is_zero(&d)) continue;
+		
+		uint256_u64_divmod(&q, &r, &n, &d);
+		assert(uint256_u64_compare(&r, &d) < 0);
+		assert(!uint256_u64_mul(&t, &q, &d));
+		assert(!uint256_u64_add(&t, &t, &r) && 0 == uint256_u64_compare(&t, &n));
+	}
+	
+	app_timer_t timer[1];
+	app_timer_start(timer);
+	uint256_u64_t chainwork = uint256_u64_zero;
+	for(uint32_t i = 0; i < 1000000; ++i)
+	{
+		uint256_u64_work_from_compact(&work, 0x17000000 | (0x10000 + i));
+		uint256_u64_add(&chainwork, &chainwork, &work);
+	}
+	double time_elapsed = app_timer_stop(timer);
+	printf("work_from_compact(): 1000000 calls, time_elapsed: %.6f s, chainwork ~= %g\n", 
+		time_elapsed, uint256_u64_to_double(&chainwork));
+	return 0;
+}
+#endif
@@ -0,0 +1,606 @@
+/*
+ * test-chains-fuzz.c
+ *
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/**
+ * @file test-chains-fuzz.c
+ *
+ * headless stress test and benchmark of the chains engine (src/chains.c),
+ * (the GTK harness in test3/ can only be run on a desktop)
+ *
+ *  1. generate a random header tree:
+ *     extend one of the live branches, or fork from an ancestor of a branch (fork_rate, max_depth);
+ *  2. deliver the headers out of order (each header moves forward by up to 'window' positions),
+ *     from random peers, one by one with blockchain_add_from_peer() or in runs with blockchain_add_batch_from_peer();
+ *     the orphan pool has small finite budgets (pool_nodes, and pool_nodes / (FUZZ_NUM_PEERS + 1) per peer),
+ *     and the clock jumps forward from time to time (expire_interval) to let all the chains of the pool expire,
+ *     the headers which are refused (over quota) or evicted are delivered again later (at most FUZZ_MAX_DELIVERIES times);
+ *  3. check the invariants every 'check_interval' headers and at the end:
+ *     - the heirs are linked, and the tip has the largest chainwork among the connected headers;
+ *     - every delivered header is either a heir or a node of the chains-list;
+ *     - the chains-list's trees are consistent (parent / first_child / cached best descendant),
+ *       and the index contains exactly the nodes of the trees.
+ *
+ * usage: test_chains_fuzz [-n num_blocks] [-f fork_rate] [-d max_depth] [-w window]
+ *                         [-p pool_nodes] [-b batch_size] [-e expire_interval]
+ *                         [-r rounds] [-s seed] [-c check_interval]
+ *
+ * build with -D_LIBFUZZER (and -fsanitize=fuzzer) to let the fuzzer choose the parameters and the seed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "satoshi-types.h"
+#include "chains.h"
+#include "utils.h"
+
+#define FUZZ_MAX_BRANCHES	(8)
+#define FUZZ_BITS	(0x207fffff)	// regtest, about 2 hashes per header to mine
+#define FUZZ_NUM_PEERS	(4)		// peer_id: [-1, FUZZ_NUM_PEERS), -1: local (no quota)
+#define FUZZ_MAX_DELIVERIES	(4)
+#define FUZZ_MAX_BATCH_SIZE	(64)
+
+struct fuzz_params
+{
+	ssize_t num_blocks;
+	double fork_rate;
+	int max_depth;
+	int window;
+	ssize_t pool_nodes;			// orphan pool budget (in headers), 0: unlimited
+	int batch_size;				// max headers per blockchain_add_batch_from_peer() call, <= 1: single adds only
+	ssize_t expire_interval;	// average deliveries between two clock jumps, 0: never
+	int rounds;
+	uint64_t seed;
+	ssize_t check_interval;	// 0: check at the end only
+};
+
+struct fuzz_block
+{
+	struct satoshi_block_header hdr;
+	uint256_t hash;
+	ssize_t parent;		// index of the parent, -1 for the genesis block
+	int height;
+	int delivered;		// added and still held by the chain (on the main chain or in the chains-list)
+	int num_deliveries;
+	int connected;		// all ancestors have been delivered
+	uint256_u64_t chainwork;
+};
+
+struct fuzz_stats
+{
+	ssize_t num_adds;
+	ssize_t num_batches;
+	double add_time;
+	
+	ssize_t num_rejected;	// over quota
+	ssize_t num_dropped;	// evicted from the orphan pool
+	ssize_t num_expiries;
+
+	ssize_t num_reorgs;
+	ssize_t max_reorg_depth;
+	double reorg_time;
+	double max_reorg_time;
+};
+
+struct fuzz_context
+{
+	struct fuzz_params params;
+	uint64_t rng;
+
+	struct fuzz_block * blocks;	// blocks[0] is the genesis block
+	ssize_t num_blocks;
+	ssize_t * order;			// delivery queue (the headers which are refused or evicted are appended again)
+	ssize_t num_queued;
+
+	// hash ==> index of the blocks
+	ssize_t map_size;
+	ssize_t * map;
+
+	blockchain_t chain[1];
+	ssize_t num_removed;	// heirs removed by the current add()
+	struct fuzz_stats stats;
+};
+
+#define fuzz_check(ctx, cond) do {	\
+		if(!(cond)) {	\
+			fprintf(stderr, "\e[31m" "[ERROR]: %s(%d): invariant '%s' violated, seed=%lu" "\e[39m" "\n", \
+				__FILE__, __LINE__, #cond, (unsigned long)(ctx)->params.seed); \
+			abort(); \
+		}	\
+	} while(0)
+
+static uint64_t fuzz_rand(struct fuzz_context * ctx)
+{
+	// xorshift64*
+	uint64_t x = ctx->rng;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	ctx->rng = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+#define fuzz_rand_uniform(ctx, n) (fuzz_rand(ctx) % (uint64_t)(n))
+#define fuzz_rand_double(ctx) ((double)(fuzz_rand(ctx) >> 11) / (double)(1ULL << 53))
+
+static inline uint64_t hash_key(const uint256_t * hash)
+{
+	uint64_t key;
+	memcpy(&key, &hash->val[8], sizeof(key));
+	return key;
+}
+
+static void map_add(struct fuzz_context * ctx, ssize_t index)
+{
+	ssize_t mask = ctx->map_size - 1;
+	ssize_t pos = hash_key(&ctx->blocks[index].hash) & mask;
+	while(ctx->map[pos] >= 0) pos = (pos + 1) & mask;
+	ctx->map[pos] = index;
+}
+
+static ssize_t map_find(const struct fuzz_context * ctx, const uint256_t * hash)
+{
+	ssize_t mask = ctx->map_size - 1;
+	ssize_t pos = hash_key(hash) & mask;
+	for(; ctx->map[pos] >= 0; pos = (pos + 1) & mask) {
+		ssize_t index = ctx->map[pos];
+		if(0 == memcmp(&ctx->blocks[index].hash, hash, sizeof(uint256_t))) return index;
+	}
+	return -1;
+}
+
+static void requeue(struct fuzz_context * ctx, ssize_t index)
+{
+	struct fuzz_block * block = &ctx->blocks[index];
+	block->delivered = 0;
+	if(block->num_deliveries < FUZZ_MAX_DELIVERIES) ctx->order[ctx->num_queued++] = index;
+}
+
+static void mine_block(struct fuzz_context * ctx, ssize_t index, ssize_t parent)
+{
+	struct fuzz_block * block = &ctx->blocks[index];
+	struct satoshi_block_header * hdr = &block->hdr;
+
+	hdr->version = 4;
+	hdr->bits = FUZZ_BITS;
+	block->parent = parent;
+	if(parent >= 0) {
+		const struct fuzz_block * prev = &ctx->blocks[parent];
+		memcpy(hdr->prev_hash, &prev->hash, sizeof(uint256_t));
+		hdr->timestamp = prev->hdr.timestamp + 1 + (uint32_t)fuzz_rand_uniform(ctx, 60);	// always > median-time-past
+		block->height = prev->height + 1;
+	}else {
+		hdr->timestamp = 1296688602;
+	}
+
+	// siblings must have different hashes
+	for(int i = 0; i < 4; ++i) {
+		uint64_t r = fuzz_rand(ctx);
+		memcpy(&hdr->merkle_root[0].val[i * 8], &r, sizeof(r));
+	}
+	hdr->nonce = (uint32_t)fuzz_rand(ctx);
+	do {
+		++hdr->nonce;
+		hash256(hdr, sizeof(*hdr), (uint8_t *)&block->hash);
+	}while(uint256_compare_with_compact(&block->hash, (compact_uint256_t *)&hdr->bits) > 0);
+
+	uint256_u64_t work;
+	uint256_u64_work_from_compact(&work, hdr->bits);
+	block->chainwork = work;
+	if(parent >= 0) uint256_u64_add(&block->chainwork, &ctx->blocks[parent].chainwork, &work);
+}
+
+/**
+ * generate_tree():
+ *   extend a random branch, or start a new one from an ancestor (at most 'max_depth' blocks back).
+ */
+static void generate_tree(struct fuzz_context * ctx)
+{
+	const struct fuzz_params * params = &ctx->params;
+	ssize_t tips[FUZZ_MAX_BRANCHES] = { 0 };
+	int num_tips = 1;
+
+	mine_block(ctx, 0, -1);
+	map_add(ctx, 0);
+	for(ssize_t i = 1; i <= params->num_blocks; ++i)
+	{
+		int branch = (int)fuzz_rand_uniform(ctx, num_tips);
+		ssize_t parent = tips[branch];
+		if(fuzz_rand_double(ctx) < params->fork_rate) {
+			int depth = 1 + (int)fuzz_rand_uniform(ctx, params->max_depth);
+			while(depth-- > 0 && ctx->blocks[parent].parent >= 0) parent = ctx->blocks[parent].parent;
+
+			if(num_tips < FUZZ_MAX_BRANCHES) branch = num_tips++;
+			else branch = (int)fuzz_rand_uniform(ctx, num_tips);
+		}
+		mine_block(ctx, i, parent);
+		map_add(ctx, i);
+		tips[branch] = i;
+	}
+	ctx->num_blocks = params->num_blocks + 1;
+
+	// delivery order
+	ctx->num_queued = params->num_blocks;
+	for(ssize_t i = 0; i < params->num_blocks; ++i) ctx->order[i] = i + 1;
+	if(params->window > 1) {
+		for(ssize_t i = 0; i < params->num_blocks; ++i) {
+			ssize_t j = i + (ssize_t)fuzz_rand_uniform(ctx, params->window);
+			if(j >= params->num_blocks) j = params->num_blocks - 1;
+			ssize_t tmp = ctx->order[i];
+			ctx->order[i] = ctx->order[j];
+			ctx->order[j] = tmp;
+		}
+	}
+}
+
+/**
+ * check_list():
+ *   walk all trees of the chains-list (iteratively, preorder),
+ * @return the number of nodes (including the 'head' of each chain)
+ */
+static ssize_t check_list(struct fuzz_context * ctx)
+{
+	blockchain_t * chain = ctx->chain;
+	active_chain_list_t * list = chain->candidates_list;
+	ssize_t num_nodes = 0;
+
+	for(ssize_t i = 0; i < list->count; ++i)
+	{
+		active_chain_t * active = list->chains[i];
+		block_info_t * head = active->head;
+		fuzz_check(ctx, head->parent == NULL && head->first_child != NULL);
+		fuzz_check(ctx, active->list_pos == i);
+		++num_nodes;
+
+		block_info_t * node = head->first_child;
+		while(node)
+		{
+			++num_nodes;
+			fuzz_check(ctx, node->parent != NULL);
+			fuzz_check(ctx, list->find_node(list, &node->hash, NULL) == node);
+
+			// a delivered header which is not on the main chain
+			ssize_t index = map_find(ctx, &node->hash);
+			fuzz_check(ctx, index > 0 && ctx->blocks[index].delivered);
+			fuzz_check(ctx, chain->get_height(chain, &node->hash) < 0);
+			fuzz_check(ctx, 0 == memcmp(node->hdr->prev_hash, &node->parent->hash, sizeof(uint256_t)));
+			if(node->height >= 0) {
+				// the skip pointer is an ancestor on the same chain (or the 'head')
+				fuzz_check(ctx, node->height == ctx->blocks[index].height);
+				fuzz_check(ctx, node->pskip != NULL);
+				block_info_t * ancestor = node->parent;
+				while(ancestor != node->pskip && ancestor->parent) ancestor = ancestor->parent;
+				fuzz_check(ctx, ancestor == node->pskip);
+			}
+
+			// the heaviest child is the first one, and the cached best_work is up to date
+			uint256_u64_t best_work = node->work;
+			if(node->first_child) {
+				uint256_u64_add(&best_work, &node->work, &node->first_child->best_work);
+				for(block_info_t * child = node->first_child->next_sibling; child; child = child->next_sibling) {
+					fuzz_check(ctx, uint256_u64_compare(&child->best_work, &node->first_child->best_work) <= 0);
+				}
+			}
+			fuzz_check(ctx, 0 == uint256_u64_compare(&best_work, &node->best_work));
+
+			// next node (preorder)
+			if(node->first_child) { node = node->first_child; continue; }
+			while(node != head && NULL == node->next_sibling) node = node->parent;
+			node = (node == head)?NULL:node->next_sibling;
+		}
+	}
+	return num_nodes;
+}
+
+static void check_invariants(struct fuzz_context * ctx)
+{
+	blockchain_t * chain = ctx->chain;
+	active_chain_list_t * list = chain->candidates_list;
+
+	// the headers evicted since the last check (or expired) are no longer delivered
+	for(ssize_t i = 1; i < ctx->num_blocks; ++i) {
+		struct fuzz_block * block = &ctx->blocks[i];
+		if(!block->delivered) continue;
+		if(chain->get_height(chain, &block->hash) == block->height) continue;
+
+		block_info_t * node = list->find_node(list, &block->hash, NULL);
+		if(node && node->parent != NULL) continue;
+
+		fuzz_check(ctx, list->num_evicted > 0);
+		++ctx->stats.num_dropped;
+		requeue(ctx, i);
+	}
+
+	// the parents are always generated before their children
+	const uint256_u64_t * max_work = &ctx->blocks[0].chainwork;
+	for(ssize_t i = 1; i < ctx->num_blocks; ++i) {
+		struct fuzz_block * block = &ctx->blocks[i];
+		block->connected = block->delivered && ctx->blocks[block->parent].connected;
+		if(block->connected && uint256_u64_compare(&block->chainwork, max_work) > 0) max_work = &block->chainwork;
+	}
+
+	// the main chain: the heaviest branch
+	const blockchain_heir_t * tip = chain->get(chain, chain->height);
+	ssize_t index = map_find(ctx, tip->hash);
+	fuzz_check(ctx, index >= 0 && ctx->blocks[index].connected);
+	fuzz_check(ctx, ctx->blocks[index].height == chain->height);
+	fuzz_check(ctx, 0 == uint256_u64_compare(&tip->chainwork, max_work));
+	for(ssize_t height = chain->height; height >= 0; --height) {
+		const blockchain_heir_t * heir = chain->get(chain, height);
+		fuzz_check(ctx, index >= 0 && 0 == memcmp(heir->hash, &ctx->blocks[index].hash, sizeof(uint256_t)));
+		fuzz_check(ctx, 0 == uint256_u64_compare(&heir->chainwork, &ctx->blocks[index].chainwork));
+		index = ctx->blocks[index].parent;
+	}
+
+	// all other delivered headers are in the chains-list
+	for(ssize_t i = 1; i < ctx->num_blocks; ++i) {
+		struct fuzz_block * block = &ctx->blocks[i];
+		if(!block->delivered) continue;
+		if(block->connected && chain->get_height(chain, &block->hash) == block->height) continue;
+
+		block_info_t * node = list->find_node(list, &block->hash, NULL);
+		fuzz_check(ctx, node && node->parent != NULL);
+		if(block->connected) fuzz_check(ctx, node->height == block->height);
+	}
+
+	fuzz_check(ctx, check_list(ctx) == list->index->count);
+}
+
+static int on_remove_block(struct blockchain * chain, const uint256_t * block_hash, const int height, void * user_data)
+{
+	struct fuzz_context * ctx = user_data;
+	++ctx->num_removed;
+	return 0;
+}
+
+static void on_peer_over_quota(struct active_chain_list * list, int peer_id, void * user_data)
+{
+	blockchain_t * chain = user_data;
+	struct fuzz_context * ctx = chain->user_data;
+	fuzz_check(ctx, peer_id >= 0 && peer_id < FUZZ_NUM_PEERS);
+	++ctx->stats.num_rejected;
+}
+
+/**
+ * deliver():
+ *   add the header at 'pos' of the queue, or a run of the following headers (sorted by the generation order)
+ *   with blockchain_add_batch_from_peer().
+ * @return the number of headers taken from the queue
+ */
+static ssize_t deliver(struct fuzz_context * ctx, ssize_t pos)
+{
+	const struct fuzz_params * params = &ctx->params;
+	blockchain_t * chain = ctx->chain;
+	struct fuzz_stats * stats = &ctx->stats;
+	int peer_id = (int)fuzz_rand_uniform(ctx, FUZZ_NUM_PEERS + 1) - 1;
+
+	ssize_t count = 1;
+	if(params->batch_size > 1 && 0 == fuzz_rand_uniform(ctx, 4)) {
+		count = 2 + (ssize_t)fuzz_rand_uniform(ctx, params->batch_size - 1);
+		if(count > ctx->num_queued - pos) count = ctx->num_queued - pos;
+	}
+
+	// the parents are generated before their children, sorting makes the linked runs more likely
+	ssize_t * indexes = &ctx->order[pos];
+	for(ssize_t i = 1; i < count; ++i) {
+		ssize_t index = indexes[i];
+		ssize_t j = i;
+		for(; j > 0 && indexes[j - 1] > index; --j) indexes[j] = indexes[j - 1];
+		indexes[j] = index;
+	}
+
+	ssize_t num_rejected = stats->num_rejected;
+	ssize_t num_added = 0;
+	app_timer_t timer[1];
+	double time_elapsed = 0;
+	ctx->num_removed = 0;
+	if(count == 1) {
+		struct fuzz_block * block = &ctx->blocks[indexes[0]];
+		app_timer_start(timer);
+		int rc = blockchain_add_from_peer(chain, &block->hash, &block->hdr, peer_id);
+		time_elapsed = app_timer_stop(timer);
+		num_added = (0 == rc);
+	}else {
+		struct satoshi_block_header hdrs[FUZZ_MAX_BATCH_SIZE];
+		for(ssize_t i = 0; i < count; ++i) hdrs[i] = ctx->blocks[indexes[i]].hdr;
+		app_timer_start(timer);
+		num_added = blockchain_add_batch_from_peer(chain, hdrs, count, peer_id);
+		time_elapsed = app_timer_stop(timer);
+		++stats->num_batches;
+	}
+	stats->add_time += time_elapsed;
+
+	// a header can only be refused when its peer is over quota
+	fuzz_check(ctx, num_added == count || (peer_id >= 0 && stats->num_rejected > num_rejected));
+	for(ssize_t i = 0; i < count; ++i) {
+		struct fuzz_block * block = &ctx->blocks[indexes[i]];
+		++block->num_deliveries;
+		if(i < num_added) block->delivered = 1;
+		else requeue(ctx, indexes[i]);
+	}
+
+	stats->num_adds += num_added;
+	if(ctx->num_removed > 0) {
+		++stats->num_reorgs;
+		stats->reorg_time += time_elapsed;
+		if(time_elapsed > stats->max_reorg_time) stats->max_reorg_time = time_elapsed;
+		if(ctx->num_removed > stats->max_reorg_depth) stats->max_reorg_depth = ctx->num_removed;
+	}
+	return count;
+}
+
+static void run_round(const struct fuzz_params * params)
+{
+	struct fuzz_context ctx[1];
+	memset(ctx, 0, sizeof(ctx));
+	ctx->params = *params;
+	ctx->rng = params->seed * 2 + 1;	// never 0
+
+	ctx->blocks = calloc(params->num_blocks + 1, sizeof(*ctx->blocks));
+	ctx->order = calloc(params->num_blocks * FUZZ_MAX_DELIVERIES + 1, sizeof(*ctx->order));
+	ctx->map_size = 1024;
+	while(ctx->map_size < (params->num_blocks + 1) * 2) ctx->map_size *= 2;
+	ctx->map = malloc(ctx->map_size * sizeof(*ctx->map));
+	assert(ctx->blocks && ctx->order && ctx->map);
+	memset(ctx->map, -1, ctx->map_size * sizeof(*ctx->map));
+
+	generate_tree(ctx);
+
+	blockchain_t * chain = ctx->chain;
+	blockchain_init(chain, &ctx->blocks[0].hash, &ctx->blocks[0].hdr, ctx);
+	chain->on_remove_block = on_remove_block;
+
+	// small finite budgets: the headers are evicted, or refused when the peer is over quota
+	active_chain_list_t * list = chain->candidates_list;
+	list->max_bytes = params->pool_nodes * ACTIVE_CHAIN_NODE_SIZE;
+	list->max_bytes_per_peer = params->pool_nodes / (FUZZ_NUM_PEERS + 1) * ACTIVE_CHAIN_NODE_SIZE;
+	list->max_age = (params->pool_nodes > 0)?ACTIVE_CHAIN_LIST_DEFAULT_MAX_AGE:0;
+	list->on_peer_over_quota = on_peer_over_quota;
+	ctx->blocks[0].delivered = 1;
+	ctx->blocks[0].connected = 1;
+
+	struct fuzz_stats * stats = &ctx->stats;
+	ssize_t pos = 0;
+	ssize_t last_check = 0;
+	while(1)
+	{
+		while(pos < ctx->num_queued)
+		{
+			pos += deliver(ctx, pos);
+			if(params->expire_interval > 0 && list->max_age > 0 && 0 == fuzz_rand_uniform(ctx, params->expire_interval)) {
+				// the clock jumps forward: all chains of the orphan pool expire
+				active_chain_list_evict(list, time(NULL) + list->max_age + 1);
+				++stats->num_expiries;
+			}
+			if(params->check_interval > 0 && (pos - last_check) >= params->check_interval) {
+				check_invariants(ctx);
+				last_check = pos;
+			}
+		}
+		check_invariants(ctx);	// the evicted headers are queued again
+		if(pos == ctx->num_queued) break;
+	}
+
+	struct rusage usage;
+	memset(&usage, 0, sizeof(usage));
+	getrusage(RUSAGE_SELF, &usage);
+	printf("seed=%lu: %ld headers (%ld batches), height=%ld, active chains=%ld, "
+		"rejected: %ld, evicted: %ld (%ld expiries), "
+		"adds/sec: %.0f, reorgs: %ld (max depth %ld), reorg latency: avg %.3f ms, max %.3f ms, peak rss: %ld KB\n",
+		(unsigned long)params->seed, (long)stats->num_adds, (long)stats->num_batches, (long)chain->height,
+		(long)chain->candidates_list->count,
+		(long)stats->num_rejected, (long)stats->num_dropped, (long)stats->num_expiries,
+		(stats->add_time > 0)?(stats->num_adds / stats->add_time):0.0,
+		(long)stats->num_reorgs, (long)stats->max_reorg_depth,
+		(stats->num_reorgs > 0)?(stats->reorg_time * 1000.0 / stats->num_reorgs):0.0,
+		stats->max_reorg_time * 1000.0,
+		(long)usage.ru_maxrss);
+
+	blockchain_cleanup(chain);
+	free(ctx->map);
+	free(ctx->order);
+	free(ctx->blocks);
+}
+
+#if defined(_LIBFUZZER)
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+	// 8 bytes seed, the shape of the tree and the pool budgets from the following bytes
+	if(size < 15) return 0;
+	struct fuzz_params params = {
+		.num_blocks = 1 + data[8] * 8,
+		.fork_rate = data[9] / 256.0,
+		.max_depth = 1 + data[10] % 64,
+		.window = 1 + data[11],
+		.pool_nodes = data[12],
+		.batch_size = data[13] % (FUZZ_MAX_BATCH_SIZE + 1),
+		.expire_interval = data[14] * 16,
+		.rounds = 1,
+		.check_interval = 64,
+	};
+	memcpy(&params.seed, data, sizeof(params.seed));
+	run_round(&params);
+	return 0;
+}
+#else
+int main(int argc, char **argv)
+{
+	struct fuzz_params params = {
+		.num_blocks = 20000,
+		.fork_rate = 0.05,
+		.max_depth = 20,
+		.window = 64,
+		.pool_nodes = 4096,
+		.batch_size = 16,
+		.expire_interval = 5000,
+		.rounds = 1,
+		.seed = (uint64_t)time(NULL),
+		.check_interval = 1000,
+	};
+
+	while(1) {
+		int c = getopt(argc, argv, "n:f:d:w:p:b:e:r:s:c:h");
+		if(c == -1) break;
+
+		switch(c) {
+		case 'n': params.num_blocks = atol(optarg); break;
+		case 'f': params.fork_rate = atof(optarg); break;
+		case 'd': params.max_depth = atoi(optarg); break;
+		case 'w': params.window = atoi(optarg); break;
+		case 'p': params.pool_nodes = atol(optarg); break;
+		case 'b': params.batch_size = atoi(optarg); break;
+		case 'e': params.expire_interval = atol(optarg); break;
+		case 'r': params.rounds = atoi(optarg); break;
+		case 's': params.seed = strtoull(optarg, NULL, 10); break;
+		case 'c': params.check_interval = atol(optarg); break;
+		case 'h':
+		default:
+			printf("Usage: %s [-n num_blocks] [-f fork_rate] [-d max_depth] [-w window] "
+				"[-p pool_nodes] [-b batch_size] [-e expire_interval] "
+				"[-r rounds] [-s seed] [-c check_interval]\n", argv[0]);
+			exit(c != 'h');
+		}
+	}
+	if(params.num_blocks < 1 || params.max_depth < 1 || params.window < 1
+		|| params.pool_nodes < 0 || params.batch_size > FUZZ_MAX_BATCH_SIZE || params.expire_interval < 0) {
+		fprintf(stderr, "\e[31m" "[ERROR]: invalid parameters." "\e[39m" "\n");
+		exit(1);
+	}
+
+	uint64_t seed = params.seed;
+	for(int i = 0; i < params.rounds; ++i) {
+		params.seed = seed + i;
+		run_round(&params);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,113 @@
+/*
+ * test-utils.c
+ *
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "satoshi-types.h"
+#include "test-utils.h"
+
+void test_make_tx(satoshi_tx_t * tx, const void * prev_hash, uint32_t prev_index,
+	const unsigned char * sig_script, size_t cb_sig, const unsigned char * pk_script, size_t cb_pk)
+{
+	assert(cb_sig < 0xfd && cb_pk < 0xfd);
+	unsigned char raw_tx[4 + 1 + 36 + 1 + 0xfd + 4 + 1 + 8 + 1 + 0xfd + 4] = { 0 };
+	unsigned char * p = raw_tx;
+	int32_t version = 1;
+	uint32_t sequence = 0xffffffff;
+	int64_t value = 1000;
+	
+	memcpy(p, &version, 4); p += 4;
+	*p++ = 1;	// txin_count
+	memcpy(p, prev_hash, 32); p += 32;
+	memcpy(p, &prev_index, 4); p += 4;
+	*p++ = cb_sig; 
+	if(cb_sig) memcpy(p, sig_script, cb_sig); 
+	p += cb_sig;
+	memcpy(p, &sequence, 4); p += 4;
+	*p++ = 1;	// txout_count
+	memcpy(p, &value, 8); p += 8;
+	*p++ = cb_pk; 
+	if(cb_pk) memcpy(p, pk_script, cb_pk); 
+	p += cb_pk;
+	p += 4;	// lock_time
+	
+	memset(tx, 0, sizeof(*tx));
+	ssize_t cb = satoshi_tx_parse(tx, p - raw_tx, raw_tx);
+	assert(cb == (p - raw_tx));
+}
+
+size_t test_make_p2pkh(unsigned char script[static 25], const unsigned char pkh[static 20])
+{
+	script[0] = 0x76; script[1] = 0xa9; script[2] = 20;
+	memcpy(script + 3, pkh, 20);
+	script[23] = 0x88; script[24] = 0xac;
+	return 25;
+}
+
+const unsigned char * test_make_pkh(unsigned char pkh[static 20], uint64_t id)
+{
+	memcpy(pkh, &id, sizeof(id));
+	memset(pkh + sizeof(id), 0xa5, 20 - sizeof(id));
+	return pkh;
+}
+
+void test_make_indexed_tx(satoshi_tx_t * tx, uint64_t seq)
+{
+	uint256_t prev_hash;
+	unsigned char sig_script[1 + 72 + 1 + 33] = { 72 };	// <signature> <pubkey>
+	unsigned char pkh[20], pk_script[25];
+	
+	hash256(&seq, sizeof(seq), (uint8_t *)&prev_hash);
+	sig_script[73] = 33;
+	sig_script[74] = 0x02;
+	test_make_tx(tx, &prev_hash, (seq == 0)?0xffffffff:0, sig_script, sizeof(sig_script),
+		pk_script, test_make_p2pkh(pk_script, test_make_pkh(pkh, seq)));
+}
+
+void test_make_block(satoshi_block_t * block, ssize_t txn_count)
+{
+	memset(block, 0, sizeof(*block));
+	block->hdr.version = 0x20000000;
+	block->hdr.timestamp = 1600000000;
+	block->txn_count = txn_count;
+	block->txns = calloc(txn_count, sizeof(*block->txns));
+	assert(block->txns);
+	
+	uint256_merkle_tree_t * mtree = uint256_merkle_tree_new(txn_count, block);
+	for(ssize_t i = 0; i < txn_count; ++i) {
+		test_make_indexed_tx(&block->txns[i], i);
+		mtree->add(mtree, 1, block->txns[i].txid);
+	}
+	mtree->recalc(mtree, 0, -1);
+	memcpy(block->hdr.merkle_root, &mtree->merkle_root, 32);
+	uint256_merkle_tree_free(mtree);
+	hash256(&block->hdr, sizeof(block->hdr), (uint8_t *)&block->hash);
+}
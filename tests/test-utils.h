@@ -0,0 +1,64 @@
+/*
+ * test-utils.h
+ *
+ * Copyright 2020 Che Hongwei <htc.chehw@gmail.com>
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _TEST_UTILS_H_
+#define _TEST_UTILS_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "satoshi-types.h"
+
+/**
+ * test fixtures shared by the stand-alone tests (see tests/Makefile)
+ * 
+ * test_make_tx(): a tx (version 1) with one input and one output of 1000 satoshi, the scripts are shorter than 0xfd bytes.
+ * test_make_p2pkh(): OP_DUP OP_HASH160 <pkh> OP_EQUALVERIFY OP_CHECKSIG, return the length of the script (25).
+ * test_make_pkh(): a fake pubkey hash which is unique for each 'id', return 'pkh'.
+ * 
+ * test_make_indexed_tx(): spends the fake outpoint hash256(seq):0 (a coinbase input if seq == 0) with a fake <sig> <pubkey>,
+ *   and pays to p2pkh(test_make_pkh(seq)).
+ * test_make_block(): txns[i] = test_make_indexed_tx(i), the merkle root and the block hash are set.
+ *   (call satoshi_block_cleanup() to release the txs)
+ */
+void test_make_tx(satoshi_tx_t * tx, const void * prev_hash, uint32_t prev_index,
+	const unsigned char * sig_script, size_t cb_sig, const unsigned char * pk_script, size_t cb_pk);
+size_t test_make_p2pkh(unsigned char script[static 25], const unsigned char pkh[static 20]);
+const unsigned char * test_make_pkh(unsigned char pkh[static 20], uint64_t id);
+
+void test_make_indexed_tx(satoshi_tx_t * tx, uint64_t seq);
+void test_make_block(satoshi_block_t * block, ssize_t txn_count);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,257 @@
+/*
+ * lockfree_queue.c
+ * 
+ * Copyright 2020 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "lockfree_queue.h"
+
+static size_t round_up_pow2(size_t capacity)
+{
+	size_t size = 2;
+	while(size < capacity) size <<= 1;
+	return size;
+}
+
+/*************************************
+ * spsc_queue
+ ************************************/
+spsc_queue_t * spsc_queue_init(spsc_queue_t * queue, size_t capacity)
+{
+	if(NULL == queue) {
+		int rc = posix_memalign((void **)&queue, LOCKFREE_QUEUE_CACHE_LINE_SIZE, sizeof(*queue));
+		assert(0 == rc);
+	}
+	assert(queue);
+	memset(queue, 0, sizeof(*queue));
+
+	queue->capacity = round_up_pow2(capacity);
+	queue->mask = queue->capacity - 1;
+	queue->items = calloc(queue->capacity, sizeof(*queue->items));
+	assert(queue->items);
+	return queue;
+}
+
+void spsc_queue_cleanup(spsc_queue_t * queue)
+{
+	if(NULL == queue) return;
+	free(queue->items);
+	queue->items = NULL;
+	queue->head = queue->tail = 0;
+}
+
+int spsc_queue_push(spsc_queue_t * queue, void * item)
+{
+	assert(item);
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if((tail - head) >= queue->capacity) return -1;	// full
+
+	queue->items[tail & queue->mask] = item;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void * spsc_queue_pop(spsc_queue_t * queue)
+{
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	if(head == tail) return NULL;	// empty
+
+	void * item = queue->items[head & queue->mask];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+size_t spsc_queue_size(const spsc_queue_t * queue)
+{
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	return (tail > head)?(tail - head):0;
+}
+
+/*************************************
+ * mpsc_queue
+ ************************************/
+struct mpsc_queue_cell
+{
+	size_t seq;	// == pos: free for the producer of pos, == pos + 1: ready for the consumer
+	void * item;
+};
+
+mpsc_queue_t * mpsc_queue_init(mpsc_queue_t * queue, size_t capacity)
+{
+	if(NULL == queue) {
+		int rc = posix_memalign((void **)&queue, LOCKFREE_QUEUE_CACHE_LINE_SIZE, sizeof(*queue));
+		assert(0 == rc);
+	}
+	assert(queue);
+	memset(queue, 0, sizeof(*queue));
+
+	queue->capacity = round_up_pow2(capacity);
+	queue->mask = queue->capacity - 1;
+	queue->cells = calloc(queue->capacity, sizeof(*queue->cells));
+	assert(queue->cells);
+	for(size_t i = 0; i < queue->capacity; ++i) queue->cells[i].seq = i;
+	return queue;
+}
+
+void mpsc_queue_cleanup(mpsc_queue_t * queue)
+{
+	if(NULL == queue) return;
+	free(queue->cells);
+	queue->cells = NULL;
+	queue->head = queue->tail = 0;
+}
+
+int mpsc_queue_push(mpsc_queue_t * queue, void * item)
+{
+	assert(item);
+	struct mpsc_queue_cell * cell = NULL;
+	size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	while(1) {
+		cell = &queue->cells[pos & queue->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if(diff == 0) {
+			// claim the cell, pos is updated with the current tail on failure
+			if(__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		}else if(diff < 0) {
+			return -1;	// full
+		}else {
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->item = item;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void * mpsc_queue_pop(mpsc_queue_t * queue)
+{
+	size_t pos = queue->head;
+	struct mpsc_queue_cell * cell = &queue->cells[pos & queue->mask];
+	size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	if(seq != (pos + 1)) return NULL;	// empty (or the producer has not finished writing yet)
+
+	void * item = cell->item;
+	cell->item = NULL;
+	__atomic_store_n(&cell->seq, pos + queue->capacity, __ATOMIC_RELEASE);	// free for the next round
+	__atomic_store_n(&queue->head, pos + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+size_t mpsc_queue_size(const mpsc_queue_t * queue)
+{
+	size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	return (tail > head)?(tail - head):0;
+}
+
+
+#if defined(_TEST_LOCKFREE_QUEUE) && defined(_STAND_ALONE)
+#include <pthread.h>
+
+#define NUM_PRODUCERS	(4)
+#define NUM_ITEMS		(1000000)
+
+static mpsc_queue_t s_mpsc[1];
+static spsc_queue_t s_spsc[1];
+
+static void * producer_thread(void * user_data)
+{
+	long id = (long)user_data;
+	for(long i = 1; i <= NUM_ITEMS; ++i) {
+		// item: (producer_id << 32) | sequence, never NULL
+		while(mpsc_queue_push(s_mpsc, (void *)((id << 32) | i))) sched_yield();
+	}
+	return NULL;
+}
+
+static void * spsc_producer_thread(void * user_data)
+{
+	for(long i = 1; i <= NUM_ITEMS; ++i) {
+		while(spsc_queue_push(s_spsc, (void *)i)) sched_yield();
+	}
+	return NULL;
+}
+
+int main(int argc, char ** argv)
+{
+	// single thread: capacity and order
+	spsc_queue_init(s_spsc, 5);
+	assert(s_spsc->capacity == 8);
+	for(long i = 1; i <= 8; ++i) assert(0 == spsc_queue_push(s_spsc, (void *)i));
+	assert(-1 == spsc_queue_push(s_spsc, (void *)9L));
+	for(long i = 1; i <= 8; ++i) assert((long)spsc_queue_pop(s_spsc) == i);
+	assert(NULL == spsc_queue_pop(s_spsc));
+
+	mpsc_queue_init(s_mpsc, 1024);
+	for(long i = 1; i <= 1024; ++i) assert(0 == mpsc_queue_push(s_mpsc, (void *)i));
+	assert(-1 == mpsc_queue_push(s_mpsc, (void *)1025L));
+	assert(mpsc_queue_size(s_mpsc) == 1024);
+	for(long i = 1; i <= 1024; ++i) assert((long)mpsc_queue_pop(s_mpsc) == i);
+	assert(NULL == mpsc_queue_pop(s_mpsc));
+
+	// spsc: one producer thread, FIFO order
+	pthread_t th;
+	pthread_create(&th, NULL, spsc_producer_thread, NULL);
+	for(long i = 1; i <= NUM_ITEMS; ) {
+		void * item = spsc_queue_pop(s_spsc);
+		if(NULL == item) { sched_yield(); continue; }
+		assert((long)item == i);
+		++i;
+	}
+	pthread_join(th, NULL);
+	printf("spsc: %d items [%s]\n", NUM_ITEMS, "\e[32mOK\e[39m");
+
+	// mpsc: each producer's items are received in order
+	pthread_t producers[NUM_PRODUCERS];
+	long last_seq[NUM_PRODUCERS] = { 0 };
+	for(long i = 0; i < NUM_PRODUCERS; ++i) pthread_create(&producers[i], NULL, producer_thread, (void *)i);
+	for(long count = 0; count < (long)NUM_PRODUCERS * NUM_ITEMS; ) {
+		void * item = mpsc_queue_pop(s_mpsc);
+		if(NULL == item) { sched_yield(); continue; }
+		long id = (long)item >> 32;
+		long seq = (long)item & 0xffffffff;
+		assert(id >= 0 && id < NUM_PRODUCERS);
+		assert(seq == last_seq[id] + 1);
+		last_seq[id] = seq;
+		++count;
+	}
+	for(int i = 0; i < NUM_PRODUCERS; ++i) pthread_join(producers[i], NULL);
+	printf("mpsc: %d producers x %d items [%s]\n", NUM_PRODUCERS, NUM_ITEMS, "\e[32mOK\e[39m");
+
+	spsc_queue_cleanup(s_spsc);
+	mpsc_queue_cleanup(s_mpsc);
+	return 0;
+}
+#endif
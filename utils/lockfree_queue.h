@@ -0,0 +1,59 @@
+#ifndef LOCKFREE_QUEUE_H_
+#define LOCKFREE_QUEUE_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * bounded lock-free queues (fixed capacity, rounded up to a power of 2)
+ *
+ * spsc_queue: single producer / single consumer ring buffer.
+ * mpsc_queue: multiple producers / single consumer, (cells with sequence numbers, D. Vyukov's design)
+ *
+ * push() returns -1 if the queue is full, pop() returns NULL if the queue is empty,
+ *   neither of them blocks, NULL can not be pushed.
+ */
+
+#define LOCKFREE_QUEUE_CACHE_LINE_SIZE	(64)
+
+typedef struct spsc_queue
+{
+	size_t capacity;
+	size_t mask;
+	void ** items;
+
+	size_t head __attribute__((aligned(LOCKFREE_QUEUE_CACHE_LINE_SIZE)));	// written by the consumer
+	size_t tail __attribute__((aligned(LOCKFREE_QUEUE_CACHE_LINE_SIZE)));	// written by the producer
+}spsc_queue_t;
+spsc_queue_t * spsc_queue_init(spsc_queue_t * queue, size_t capacity);
+void spsc_queue_cleanup(spsc_queue_t * queue);
+int spsc_queue_push(spsc_queue_t * queue, void * item);
+void * spsc_queue_pop(spsc_queue_t * queue);
+size_t spsc_queue_size(const spsc_queue_t * queue);	// approximate if called by a third thread
+
+
+struct mpsc_queue_cell;
+typedef struct mpsc_queue
+{
+	size_t capacity;
+	size_t mask;
+	struct mpsc_queue_cell * cells;
+
+	size_t head __attribute__((aligned(LOCKFREE_QUEUE_CACHE_LINE_SIZE)));	// written by the consumer
+	size_t tail __attribute__((aligned(LOCKFREE_QUEUE_CACHE_LINE_SIZE)));	// claimed by the producers (CAS)
+}mpsc_queue_t;
+mpsc_queue_t * mpsc_queue_init(mpsc_queue_t * queue, size_t capacity);
+void mpsc_queue_cleanup(mpsc_queue_t * queue);
+int mpsc_queue_push(mpsc_queue_t * queue, void * item);
+void * mpsc_queue_pop(mpsc_queue_t * queue);
+size_t mpsc_queue_size(const mpsc_queue_t * queue);	// approximate
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,282 @@
+/*
+ * rolling_bloom_filter.c
+ * 
+ * Copyright 2020 chehw <hongwei.che@gmail.com>
+ * 
+ * The MIT License
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of 
+ * this software and associated documentation files (the "Software"), to deal in 
+ * the Software without restriction, including without limitation the rights to 
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+ * of the Software, and to permit persons to whom the Software is furnished to 
+ * do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all 
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+ * SOFTWARE.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rolling_bloom_filter.h"
+
+/*************************************
+ * MurmurHash3 (x86_32)
+ ************************************/
+static inline uint32_t rotl32(uint32_t x, int8_t r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+uint32_t murmur3_32(uint32_t seed, const void * data, size_t length)
+{
+	const uint8_t * p = data;
+	const uint32_t c1 = 0xcc9e2d51;
+	const uint32_t c2 = 0x1b873593;
+	uint32_t h1 = seed;
+	
+	size_t num_blocks = length / 4;
+	for(size_t i = 0; i < num_blocks; ++i, p += 4) {
+		uint32_t k1 = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+		k1 *= c1;
+		k1 = rotl32(k1, 15);
+		k1 *= c2;
+		
+		h1 ^= k1;
+		h1 = rotl32(h1, 13);
+		h1 = h1 * 5 + 0xe6546b64;
+	}
+	
+	// tail
+	uint32_t k1 = 0;
+	switch(length & 3) {
+	case 3: k1 ^= (uint32_t)p[2] << 16;	// fall through
+	case 2: k1 ^= (uint32_t)p[1] << 8;	// fall through
+	case 1: k1 ^= (uint32_t)p[0];
+		k1 *= c1;
+		k1 = rotl32(k1, 15);
+		k1 *= c2;
+		h1 ^= k1;
+	}
+	
+	// finalization
+	h1 ^= (uint32_t)length;
+	h1 ^= h1 >> 16;
+	h1 *= 0x85ebca6b;
+	h1 ^= h1 >> 13;
+	h1 *= 0xc2b2ae35;
+	h1 ^= h1 >> 16;
+	return h1;
+}
+
+/*************************************
+ * rolling_bloom_filter
+ ************************************/
+static uint32_t random_tweak(void)
+{
+	struct timespec ts[1];
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	static uint32_t s_counter;
+	uint32_t counter = __atomic_add_fetch(&s_counter, 1, __ATOMIC_RELAXED);
+	
+	uint32_t seeds[4] = { (uint32_t)ts->tv_nsec, (uint32_t)ts->tv_sec, (uint32_t)getpid(), counter };
+	return murmur3_32((uint32_t)(uintptr_t)&s_counter, seeds, sizeof(seeds));
+}
+
+static inline uint32_t filter_hash(const rolling_bloom_filter_t * filter, uint32_t n, const void * data, size_t length)
+{
+	return murmur3_32(n * 0xFBA4C795 + filter->tweak, data, length);
+}
+
+// map h to [0, n) without division
+static inline uint32_t fast_range32(uint32_t h, uint32_t n)
+{
+	return (uint32_t)(((uint64_t)h * (uint64_t)n) >> 32);
+}
+
+rolling_bloom_filter_t * rolling_bloom_filter_init(rolling_bloom_filter_t * filter, int64_t max_elements, double fp_rate)
+{
+	assert(max_elements > 0 && fp_rate > 0 && fp_rate < 1);
+	if(NULL == filter) filter = calloc(1, sizeof(*filter));
+	assert(filter);
+	memset(filter, 0, sizeof(*filter));
+	
+	double log_fp_rate = log(fp_rate);
+	
+	// the optimal number of hash functions: -log2(fp_rate), limited to [1, 50]
+	int num_hash_funcs = (int)round(log_fp_rate / log(0.5));
+	if(num_hash_funcs < 1) num_hash_funcs = 1;
+	if(num_hash_funcs > 50) num_hash_funcs = 50;
+	filter->num_hash_funcs = num_hash_funcs;
+	
+	// up to 3 generations (1.5 * max_elements) are stored at the same time
+	filter->entries_per_generation = (max_elements + 1) / 2;
+	int64_t max_entries = filter->entries_per_generation * 3;
+	
+	// fp_rate = (1 - exp(-k * n / m)) ^ k  ==>  m = -k * n / log(1 - exp(log(fp_rate) / k))
+	uint64_t num_bits = (uint64_t)ceil(-1.0 * num_hash_funcs * max_entries / log(1.0 - exp(log_fp_rate / num_hash_funcs)));
+	filter->data_size = ((num_bits + 63) / 64) * 2;
+	assert(filter->data_size <= UINT32_MAX);
+	
+	filter->data = calloc(filter->data_size, sizeof(*filter->data));
+	assert(filter->data);
+	
+	rolling_bloom_filter_reset(filter);
+	return filter;
+}
+
+void rolling_bloom_filter_cleanup(rolling_bloom_filter_t * filter)
+{
+	if(NULL == filter) return;
+	free(filter->data);
+	filter->data = NULL;
+	filter->data_size = 0;
+}
+
+void rolling_bloom_filter_reset(rolling_bloom_filter_t * filter)
+{
+	assert(filter && filter->data);
+	filter->tweak = random_tweak();
+	filter->entries_this_generation = 0;
+	filter->generation = 1;
+	memset(filter->data, 0, filter->data_size * sizeof(*filter->data));
+}
+
+void rolling_bloom_filter_insert(rolling_bloom_filter_t * filter, const void * data, size_t length)
+{
+	assert(filter && filter->data);
+	if(filter->entries_this_generation == filter->entries_per_generation) {
+		filter->entries_this_generation = 0;
+		if(++filter->generation == 4) filter->generation = 1;
+		
+		// clear the bits of the oldest generation (which is equal to the new generation number)
+		uint64_t gen_mask1 = -(uint64_t)(filter->generation & 1);
+		uint64_t gen_mask2 = -(uint64_t)(filter->generation >> 1);
+		for(size_t p = 0; p < filter->data_size; p += 2) {
+			uint64_t p1 = filter->data[p], p2 = filter->data[p + 1];
+			uint64_t mask = (p1 ^ gen_mask1) | (p2 ^ gen_mask2);
+			filter->data[p] = p1 & mask;
+			filter->data[p + 1] = p2 & mask;
+		}
+	}
+	++filter->entries_this_generation;
+	
+	uint64_t gen1 = filter->generation & 1;
+	uint64_t gen2 = filter->generation >> 1;
+	for(uint32_t n = 0; n < filter->num_hash_funcs; ++n) {
+		uint32_t h = filter_hash(filter, n, data, length);
+		int bit = h & 0x3F;
+		uint32_t pos = fast_range32(h, (uint32_t)filter->data_size);
+		
+		// set the bit's generation number to the current one
+		filter->data[pos & ~1U] = (filter->data[pos & ~1U] & ~((uint64_t)1 << bit)) | (gen1 << bit);
+		filter->data[pos | 1U] = (filter->data[pos | 1U] & ~((uint64_t)1 << bit)) | (gen2 << bit);
+	}
+}
+
+int rolling_bloom_filter_contains(const rolling_bloom_filter_t * filter, const void * data, size_t length)
+{
+	assert(filter && filter->data);
+	for(uint32_t n = 0; n < filter->num_hash_funcs; ++n) {
+		uint32_t h = filter_hash(filter, n, data, length);
+		int bit = h & 0x3F;
+		uint32_t pos = fast_range32(h, (uint32_t)filter->data_size);
+		
+		// generation number 0 means unset
+		if(0 == (((filter->data[pos & ~1U] | filter->data[pos | 1U]) >> bit) & 1)) return 0;
+	}
+	return 1;
+}
+
+
+#if defined(_TEST_ROLLING_BLOOM_FILTER) && defined(_STAND_ALONE)
+static void make_key(uint8_t key[static 32], uint64_t seq)
+{
+	memset(key, 0, 32);
+	uint32_t h = murmur3_32(0, &seq, sizeof(seq));
+	memcpy(key, &seq, sizeof(seq));
+	memcpy(key + 8, &h, sizeof(h));
+}
+
+int main(int argc, char ** argv)
+{
+	// MurmurHash3 test vectors
+	assert(murmur3_32(0x00000000, "", 0) == 0x00000000);
+	assert(murmur3_32(0xFBA4C795, "", 0) == 0x6a396f08);
+	assert(murmur3_32(0xffffffff, "", 0) == 0x81f16f39);
+	assert(murmur3_32(0x00000000, "\x00", 1) == 0x514e28b7);
+	assert(murmur3_32(0xFBA4C795, "\x00", 1) == 0xea3f0b17);
+	assert(murmur3_32(0x00000000, "\xff", 1) == 0xfd6cf10d);
+	assert(murmur3_32(0x00000000, "\x00\x11", 2) == 0x16c6b7ab);
+	assert(murmur3_32(0x00000000, "\x00\x11\x22", 3) == 0x8eb51c3d);
+	assert(murmur3_32(0x00000000, "\x00\x11\x22\x33", 4) == 0xb4471bf8);
+	assert(murmur3_32(0x00000000, "\x00\x11\x22\x33\x44", 5) == 0xe2301fa8);
+	assert(murmur3_32(0x00000000, "\x00\x11\x22\x33\x44\x55", 6) == 0xfc2e4a15);
+	assert(murmur3_32(0x00000000, "\x00\x11\x22\x33\x44\x55\x66", 7) == 0xb074502c);
+	assert(murmur3_32(0x00000000, "\x00\x11\x22\x33\x44\x55\x66\x77", 8) == 0x8034d2a0);
+	assert(murmur3_32(0x00000000, "\x00\x11\x22\x33\x44\x55\x66\x77\x88", 9) == 0xb4698def);
+	printf("murmur3_32: [%s]\n", "\e[32mOK\e[39m");
+	
+	const int64_t max_elements = 10000;
+	const double fp_rate = 0.001;
+	rolling_bloom_filter_t filter[1];
+	rolling_bloom_filter_init(filter, max_elements, fp_rate);
+	printf("max_elements: %ld, fp_rate: %g ==> hash funcs: %u, size: %lu bytes\n", 
+		(long)max_elements, fp_rate, filter->num_hash_funcs, (unsigned long)(filter->data_size * sizeof(uint64_t)));
+	
+	uint8_t key[32];
+	const uint64_t num_inserted = max_elements * 10;
+	for(uint64_t i = 0; i < num_inserted; ++i) {
+		make_key(key, i);
+		rolling_bloom_filter_insert(filter, key, sizeof(key));
+		
+		// no false negatives for the last max_elements
+		if((i % 997) == 0) {
+			uint64_t first = (i + 1 > (uint64_t)max_elements)?(i + 1 - max_elements):0;
+			for(uint64_t j = first; j <= i; j += 7) {
+				make_key(key, j);
+				assert(rolling_bloom_filter_contains(filter, key, sizeof(key)));
+			}
+		}
+	}
+	
+	// the old elements have been forgotten (only false positives remain), and the fp rate of unseen elements
+	int64_t old_hits = 0, fp_hits = 0;
+	const int64_t num_tests = 100000;
+	for(int64_t i = 0; i < num_tests; ++i) {
+		make_key(key, i % (num_inserted - 2 * max_elements));
+		old_hits += rolling_bloom_filter_contains(filter, key, sizeof(key));
+		make_key(key, num_inserted + i);
+		fp_hits += rolling_bloom_filter_contains(filter, key, sizeof(key));
+	}
+	double fp = (double)fp_hits / num_tests;
+	printf("old elements found: %ld / %ld, false positives: %ld / %ld (%g)\n", 
+		(long)old_hits, (long)num_tests, (long)fp_hits, (long)num_tests, fp);
+	assert(fp < fp_rate * 2);
+	assert(old_hits < num_tests * fp_rate * 2);
+	
+	rolling_bloom_filter_reset(filter);
+	make_key(key, num_inserted - 1);
+	assert(!rolling_bloom_filter_contains(filter, key, sizeof(key)));
+	
+	rolling_bloom_filter_cleanup(filter);
+	printf("rolling_bloom_filter: [%s]\n", "\e[32mOK\e[39m");
+	return 0;
+}
+#endif
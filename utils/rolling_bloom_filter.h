@@ -0,0 +1,50 @@
+#ifndef ROLLING_BLOOM_FILTER_H_
+#define ROLLING_BLOOM_FILTER_H_
+
+#include <stdio.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * murmur3_32(): MurmurHash3 (x86_32), the hash function of BIP37 bloom filters
+ */
+uint32_t murmur3_32(uint32_t seed, const void * data, size_t length);
+
+/**
+ * rolling_bloom_filter: remembers (approximately) the most recently inserted elements
+ *
+ * @details
+ *  - the elements are inserted in generations of (max_elements + 1) / 2,
+ *    each bit of the filter is stored as a 2-bit generation number (0: unset, 1..3).
+ *  - when the current generation is full, the bits of the oldest one are cleared,
+ *    so at least the last 'max_elements' (and at most 1.5 * max_elements) elements are always found.
+ *  - false positive rate <= 'fp_rate', no false negatives for the recent elements.
+ *  - hashes are tweaked by a random value, chosen by each filter.
+ *  - not thread-safe.
+ */
+typedef struct rolling_bloom_filter
+{
+	uint32_t num_hash_funcs;
+	uint32_t tweak;
+	int64_t entries_per_generation;
+	int64_t entries_this_generation;
+	uint32_t generation;	// 1..3
+
+	size_t data_size;	// number of uint64_t, (2 words per 64 bits)
+	uint64_t * data;
+}rolling_bloom_filter_t;
+rolling_bloom_filter_t * rolling_bloom_filter_init(rolling_bloom_filter_t * filter, int64_t max_elements, double fp_rate);
+void rolling_bloom_filter_cleanup(rolling_bloom_filter_t * filter);
+void rolling_bloom_filter_reset(rolling_bloom_filter_t * filter);	// clear all, and choose a new tweak
+
+void rolling_bloom_filter_insert(rolling_bloom_filter_t * filter, const void * data, size_t length);
+int rolling_bloom_filter_contains(const rolling_bloom_filter_t * filter, const void * data, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+#endif